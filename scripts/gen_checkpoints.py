@@ -0,0 +1,47 @@
+"""Generate src/checkpoints.inc from checkpoint files.
+
+Each file is named for its network (e.g. checkpoints/main.txt) and has a
+height and a block hash on each line, like --checkpoints-file; blank lines
+and lines starting with # are skipped. The output has a sorted constexpr
+array of Checkpoints per network, for network.cc to include.
+"""
+
+import os
+import re
+import sys
+
+HASH_RE = re.compile(r'^[0-9a-fA-F]{64}$')
+
+
+def parse(path):
+    checkpoints = {}
+    with open(path) as f:
+        for lineno, line in enumerate(f, 1):
+            fields = line.split()
+            if not fields or fields[0].startswith('#'):
+                continue
+            if (len(fields) != 2 or not fields[0].isdigit() or
+                    not HASH_RE.match(fields[1])):
+                sys.exit('%s:%d: bad checkpoint' % (path, lineno))
+            height = int(fields[0])
+            if height in checkpoints:
+                sys.exit('%s:%d: height %d is checkpointed twice' %
+                         (path, lineno, height))
+            checkpoints[height] = fields[1].lower()
+    return sorted(checkpoints.items())
+
+
+def main():
+    print('// Generated by scripts/gen_checkpoints.py; do not edit.')
+    for path in sys.argv[1:]:
+        name = os.path.splitext(os.path.basename(path))[0]
+        print()
+        print('constexpr Checkpoint %s_checkpoints[] = {' % name)
+        for height, block_hash in parse(path):
+            print('    {%d,' % height)
+            print('     h("%s")},' % block_hash)
+        print('};')
+
+
+if __name__ == '__main__':
+    main()
@@ -14,89 +14,170 @@
 // You should have received a copy of the GNU General Public License along with
 // SPV. If not, see <http://www.gnu.org/licenses/>.
 
+
 #include "./addr.h"
 
 #include <arpa/inet.h>
 #include <cassert>
+#include <cstdlib>
 #include <cstring>
 
 #include "./logging.h"
-#include "./settings.h"
 
 namespace spv {
 MODULE_LOGGER
-Addr::Addr(const addrinfo *ai) : af_(ai->ai_family) {
-  assert(ai->ai_family == ai->ai_addr->sa_family);
 
-  char buf[INET6_ADDRSTRLEN];
-  std::memset(buf, 0, sizeof buf);
+const static std::array<uint8_t, 12> ipv4_prefix = {0, 0, 0, 0, 0,    0,
+                                                    0, 0, 0, 0, 0xff, 0xff};
 
-  switch (af_) {
+// OnionCat's fd87:d87e:eb43::/48, which old clients used for Tor v2
+const static std::array<uint8_t, 6> onioncat_prefix = {0xfd, 0x87, 0xd8,
+                                                       0x7e, 0xeb, 0x43};
+
+size_t netid_size(uint8_t id) {
+  switch (NetId(id)) {
+    case NetId::IPV4:
+      return 4;
+    case NetId::IPV6:
+    case NetId::CJDNS:
+      return 16;
+    case NetId::TORV2:
+      return 10;
+    case NetId::TORV3:
+    case NetId::I2P:
+      return 32;
+  }
+  return 0;
+}
+
+Addr::Addr(const addrinfo *ai, uint16_t port) : buf_{}, port_(0) {
+  assert(ai->ai_family == ai->ai_addr->sa_family);
+  switch (ai->ai_family) {
     case AF_INET: {
-      sockaddr_in *sa4 = reinterpret_cast<sockaddr_in *>(ai->ai_addr);
-      if (inet_ntop(sa4->sin_family, &sa4->sin_addr, buf, sizeof buf) ==
-          nullptr) {
-        log->error("inet_ntop failed: {}", strerror(errno));
-      }
+      const sockaddr_in *sa4 = reinterpret_cast<sockaddr_in *>(ai->ai_addr);
+      std::memcpy(buf_.data(), ipv4_prefix.data(), ipv4_prefix.size());
+      std::memcpy(buf_.data() + 12, &sa4->sin_addr, 4);
+      static_assert(sizeof(sa4->sin_addr) == 4);
       break;
     }
     case AF_INET6: {
-      sockaddr_in6 *sa6 = reinterpret_cast<sockaddr_in6 *>(ai->ai_addr);
-      if (inet_ntop(sa6->sin6_family, &sa6->sin6_addr, buf, sizeof buf) ==
-          nullptr) {
-        log->error("inet_ntop failed: {}", strerror(errno));
-      }
+      const sockaddr_in6 *sa6 = reinterpret_cast<sockaddr_in6 *>(ai->ai_addr);
+      std::memcpy(buf_.data(), &sa6->sin6_addr, 16);
+      static_assert(sizeof(sa6->sin6_addr) == 16);
       break;
     }
     default:
       log->warn("unknown address family {}", ai->ai_addr->sa_family);
       return;
   }
-  port_ = get_settings().port;
-  ip_ = buf;
-  assert(ip_.size() < INET6_ADDRSTRLEN);
+  port_ = port;
 }
 
-const static std::array<uint8_t, 12> ipv4_prefix = {0, 0, 0, 0, 0,    0,
-                                                    0, 0, 0, 0, 0xff, 0xff};
+int Addr::af() const {
+  if (std::memcmp(buf_.data(), ipv4_prefix.data(), ipv4_prefix.size()) == 0) {
+    return AF_INET;
+  }
+  static const addrbuf_t unset{};
+  return buf_ == unset ? -1 : AF_INET6;
+}
 
-void Addr::encode_addrbuf(addrbuf_t &buf) const {
-  switch (af_) {
-    case -1:
-      std::memset(buf.data(), 0, 16);
-      static_assert(sizeof(buf) == 16);
-      return;
-    case AF_INET:
-      std::memmove(buf.data(), ipv4_prefix.data(), 12);
-      std::memmove(buf.data() + 12, &inaddr_.ipv4.s_addr, 4);
-      static_assert(sizeof(inaddr_.ipv4.s_addr) == 4);
-      return;
-    case AF_INET6:
-      std::memmove(buf.data(), &inaddr_.ipv6.s6_addr, 16);
-      static_assert(sizeof(inaddr_.ipv6.s6_addr) == 16);
-      return;
+std::string Addr::ip() const {
+  char buf[INET6_ADDRSTRLEN];
+  const int family = af();
+  if (family == -1) {
+    return "";
+  }
+  const uint8_t *src = family == AF_INET ? buf_.data() + 12 : buf_.data();
+  if (inet_ntop(family, src, buf, sizeof buf) == nullptr) {
+    log->warn("failed to format addr: {}", strerror(errno));
+    return "";
+  }
+  return buf;
+}
+
+bool Addr::set_ip(const std::string &ip) {
+  in_addr ipv4;
+  if (inet_pton(AF_INET, ip.c_str(), &ipv4) == 1) {
+    std::memcpy(buf_.data(), ipv4_prefix.data(), ipv4_prefix.size());
+    std::memcpy(buf_.data() + 12, &ipv4, 4);
+    return true;
+  }
+  return inet_pton(AF_INET6, ip.c_str(), buf_.data()) == 1;
+}
+
+bool Addr::set_bip155(NetId id, const uint8_t *data) {
+  switch (id) {
+    case NetId::IPV4:
+      std::memcpy(buf_.data(), ipv4_prefix.data(), ipv4_prefix.size());
+      std::memcpy(buf_.data() + 12, data, 4);
+      return true;
+    case NetId::IPV6:
+      // the other networks have ids of their own in addrv2
+      if (std::memcmp(data, ipv4_prefix.data(), ipv4_prefix.size()) == 0 ||
+          std::memcmp(data, onioncat_prefix.data(), onioncat_prefix.size()) ==
+              0) {
+        return false;
+      }
+      std::memcpy(buf_.data(), data, 16);
+      return true;
+    default:
+      return false;
   }
-  assert(false);  // not reached
 }
 
-void Addr::set_addr(const addrbuf_t &buf) {
-  // apply a basic heuristic to detect ipv4 messages
-  const void *src;
-  if (std::memcmp(buf.data(), ipv4_prefix.data(), 12) == 0) {
-    af_ = AF_INET;
-    src = buf.data() + 12;
+void Addr::to_sockaddr(sockaddr_storage &sa) const {
+  std::memset(&sa, 0, sizeof sa);
+  if (af() == AF_INET) {
+    sockaddr_in *sa4 = reinterpret_cast<sockaddr_in *>(&sa);
+    sa4->sin_family = AF_INET;
+    sa4->sin_port = htons(port_);
+    std::memcpy(&sa4->sin_addr, buf_.data() + 12, 4);
   } else {
-    af_ = AF_INET6;
-    src = buf.data();
+    sockaddr_in6 *sa6 = reinterpret_cast<sockaddr_in6 *>(&sa);
+    sa6->sin6_family = AF_INET6;
+    sa6->sin6_port = htons(port_);
+    std::memcpy(&sa6->sin6_addr, buf_.data(), 16);
   }
-  char string_buf[INET6_ADDRSTRLEN];
-  const char *s = inet_ntop(af_, src, string_buf, sizeof string_buf);
-  if (s == nullptr) {
-    log->warn("failed to decode addr: {}", strerror(errno));
-    return;
+}
+
+bool parse_peer(const std::string &peer, uint16_t port, Addr &addr) {
+  std::string host = peer;
+  size_t colon = peer.rfind(':');
+  if (!peer.empty() && peer[0] == '[') {
+    const size_t close = peer.find(']');
+    if (close == std::string::npos ||
+        (close + 1 != peer.size() && close != colon - 1)) {
+      return false;
+    }
+    host = peer.substr(1, close - 1);
+    colon = close + 1 == peer.size() ? std::string::npos : colon;
+  } else if (colon != std::string::npos) {
+    host = peer.substr(0, colon);
+  }
+  if (colon != std::string::npos) {
+    char *end;
+    const unsigned long n = std::strtoul(peer.c_str() + colon + 1, &end, 10);
+    if (*end != '\0' || end == peer.c_str() + colon + 1 || n == 0 ||
+        n > 65535) {
+      return false;
+    }
+    port = n;
+  }
+  if (!addr.set_ip(host)) {
+    return false;
+  }
+  addr.set_port(port);
+  return true;
+}
+
+uint64_t net_group(const Addr &addr) {
+  const addrbuf_t &buf = addr.addrbuf();
+  if (addr.af() == AF_INET) {
+    return uint64_t(1) << 32 | buf[12] << 8 | buf[13];
   }
-  ip_ = s;
-  assert(ip_.size() < INET6_ADDRSTRLEN);
+  uint32_t prefix;
+  std::memcpy(&prefix, buf.data(), sizeof prefix);
+  return uint64_t(2) << 32 | prefix;
 }
 }  // namespace spv
 
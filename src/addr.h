@@ -14,6 +14,7 @@
 // You should have received a copy of the GNU General Public License along with
 // SPV. If not, see <http://www.gnu.org/licenses/>.
 
+
 #pragma once
 
 #include <netdb.h>
@@ -21,48 +22,86 @@
 #include <sys/types.h>
 
 #include <array>
+#include <cstdint>
 #include <cstring>
+#include <string>
+#include <type_traits>
 
 namespace spv {
 typedef std::array<uint8_t, 16> addrbuf_t;
 
-union inaddr {
-  in_addr ipv4;
-  in6_addr ipv6;
-
-  inaddr() { std::memset(this, 0, sizeof(inaddr)); }
+// the network ids of BIP155 (addrv2) addresses
+enum class NetId : uint8_t {
+  IPV4 = 1,
+  IPV6 = 2,
+  TORV2 = 3,
+  TORV3 = 4,
+  I2P = 5,
+  CJDNS = 6,
 };
 
+// the length BIP155 gives the addresses of network id, or 0 if it's unknown
+size_t netid_size(uint8_t id);
+
+// A network address: 16 bytes holding an IPv6 address, or an IPv4 address
+// mapped into ::ffff:0:0/96 as in the p2p protocol, plus a port. It's a
+// plain value type so that comparing, hashing and decoding addresses never
+// allocates; ip() formats the address for logging.
 class Addr {
  public:
-  Addr() : af_(-1), port_(0) {}
-  Addr(const Addr& other)
-      : af_(other.af_),
-        port_(other.port_),
-        inaddr_(other.inaddr_),
-        ip_(other.ip_) {}
-  explicit Addr(const addrinfo* ai);
-
-  inline int af() const { return af_; }
+  Addr() : buf_{}, port_(0) {}
+  Addr(const addrinfo* ai, uint16_t port);  // e.g. from a DNS seed
+
+  // AF_INET or AF_INET6, or -1 if no address has been set
+  int af() const;
   inline uint16_t port() const { return port_; }
-  inline const std::string& ip() const { return ip_; }
+  std::string ip() const;
 
   inline void set_port(uint16_t port) { port_ = port; }  // in host order
-  void set_addr(const addrbuf_t& buf);
+  inline void set_addr(const addrbuf_t& buf) { buf_ = buf; }
 
-  void encode_addrbuf(addrbuf_t& buf) const;
+  // parse an IPv4 or IPv6 address; returns false if it isn't one
+  bool set_ip(const std::string& ip);
+
+  // Set the address from a BIP155 one of netid_size(id) bytes. Returns
+  // false for networks we can't reach over TCP/IP (Tor, I2P and CJDNS),
+  // and for IPv6 addresses that BIP155 says to ignore.
+  bool set_bip155(NetId id, const uint8_t* data);
+
+  // the BIP155 network id, and the address bytes for it (4 or 16)
+  inline NetId netid() const {
+    return af() == AF_INET ? NetId::IPV4 : NetId::IPV6;
+  }
+  inline const uint8_t* bip155_data() const {
+    return af() == AF_INET ? buf_.data() + 12 : buf_.data();
+  }
+
+  inline const addrbuf_t& addrbuf() const { return buf_; }
+  inline void encode_addrbuf(addrbuf_t& buf) const { buf = buf_; }
+
+  // fill in a sockaddr_in or sockaddr_in6 for connecting to this address
+  void to_sockaddr(sockaddr_storage& sa) const;
 
   inline bool operator==(const Addr& other) const {
-    return af_ == other.af_ && port_ == other.port_ && ip_ == other.ip_;
+    return port_ == other.port_ && buf_ == other.buf_;
   }
   inline bool operator!=(const Addr& other) const { return !operator==(other); }
 
  private:
-  int af_;  // address family: AF_INET or AF_INET6
+  addrbuf_t buf_;
   uint16_t port_;
-  inaddr inaddr_;
-  std::string ip_;
 };
+
+// Parse a peer given on the command line (e.g. --connect): an IPv4 address
+// or a bracketed IPv6 address, with an optional port, or else port.
+bool parse_peer(const std::string& peer, uint16_t port, Addr& addr);
+
+// The network group of an address, the /16 of an IPv4 address or the /32
+// of an IPv6 one, which is roughly who controls it.
+uint64_t net_group(const Addr& addr);
+
+static_assert(std::is_trivially_copyable<Addr>::value);
+static_assert(sizeof(Addr) == 18);
 }  // namespace spv
 
 std::ostream& operator<<(std::ostream& o, const spv::Addr& addr);
@@ -71,9 +110,12 @@ namespace std {
 template <>
 struct hash<spv::Addr> {
   std::size_t operator()(const spv::Addr& addr) const noexcept {
-    std::size_t h1 = std::hash<uint16_t>{}(addr.port());
-    std::size_t h2 = std::hash<std::string>{}(addr.ip());
-    return h1 ^ (h2 << 1);
+    uint64_t hi, lo;
+    std::memcpy(&hi, addr.addrbuf().data(), sizeof hi);
+    std::memcpy(&lo, addr.addrbuf().data() + sizeof hi, sizeof lo);
+    uint64_t h = (hi ^ (uint64_t(addr.port()) << 48)) * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (h >> 32) ^ lo) * 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 29);
   }
 };
 }  // namespace std
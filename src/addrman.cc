@@ -0,0 +1,500 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./addrman.h"
+
+#include <endian.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include "./logging.h"
+#include "./util.h"
+
+namespace spv {
+MODULE_LOGGER
+
+static const char file_magic[4] = {'S', 'P', 'V', 'A'};
+static const uint32_t file_version = 2;  // 1 had no announce_lag_ms
+
+// how long after an attempt an address is left alone
+static const uint32_t retry_delay = 60;
+
+// how many random addresses select() compares, and how many it draws
+// before falling back to a scan
+static const int select_candidates = 3;
+static const int select_draws = 64;
+
+// splitmix64's finalizer
+static inline uint64_t mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// the address and port, folded into 64 bits
+static uint64_t fold(const Addr &addr) {
+  const addrbuf_t &buf = addr.addrbuf();
+  uint64_t hi, lo;
+  std::memcpy(&hi, buf.data(), sizeof hi);
+  std::memcpy(&lo, buf.data() + sizeof hi, sizeof lo);
+  return mix(hi ^ mix(lo ^ addr.port()));
+}
+
+// moving average that weights the old value 3:1, starting from the first
+// sample
+static inline uint32_t average(uint32_t avg, uint64_t sample) {
+  return avg ? (3 * uint64_t(avg) + sample) / 4 : sample;
+}
+
+AddrManager::AddrManager()
+    : key_(rand64()),
+      new_buckets_(NEW_BUCKETS * BUCKET_SIZE, no_id),
+      tried_buckets_(TRIED_BUCKETS * BUCKET_SIZE, no_id) {}
+
+uint64_t AddrManager::hash(uint64_t a, uint64_t b) const {
+  return mix(key_ ^ mix(a ^ mix(b)));
+}
+
+uint32_t AddrManager::new_bucket(const Addr &addr, const Addr &source) const {
+  return hash(net_group(addr), net_group(source)) % NEW_BUCKETS;
+}
+
+uint32_t AddrManager::tried_bucket(const Addr &addr) const {
+  // each group can only use 8 of the tried buckets
+  return hash(net_group(addr), hash(fold(addr), 0) % 8) % TRIED_BUCKETS;
+}
+
+size_t AddrManager::slot(const Entry &entry) const {
+  return entry.bucket * BUCKET_SIZE +
+         hash(fold(entry.addr), entry.bucket) % BUCKET_SIZE;
+}
+
+bool AddrManager::terrible(const Entry &entry) const {
+  if (entry.last_try && time32() - entry.last_try < retry_delay) {
+    return false;  // give it a chance to finish
+  }
+  return (entry.successes == 0 && entry.failures >= 3) ||
+         entry.failures >= 10;
+}
+
+double AddrManager::score(const Entry &entry) const {
+  double s = entry.tried ? 2 : 1;
+  s *= std::pow(0.66, std::min<uint32_t>(entry.failures, 8));
+  if (entry.latency_ms) {
+    s *= 1000.0 / (1000.0 + entry.latency_ms);
+  }
+  s *= 1 + entry.header_rate / 10000.0;
+  s *= 2000.0 / (2000.0 + entry.announce_lag_ms);
+  if (entry.last_try && time32() - entry.last_try < retry_delay) {
+    s *= 0.01;
+  }
+  return s;
+}
+
+bool AddrManager::place(id_t id, bool tried, uint32_t bucket) {
+  Entry &entry = entries_[id];
+  entry.tried = tried;
+  entry.bucket = bucket;
+  std::vector<id_t> &buckets = tried ? tried_buckets_ : new_buckets_;
+  const size_t i = slot(entry);
+  const id_t other = buckets[i];
+  if (other != no_id) {
+    if (!terrible(entries_[other])) {
+      return false;
+    }
+    unplace(other);
+    release(other);
+  }
+  buckets[i] = id;
+  std::vector<id_t> &list = tried ? tried_ : new_;
+  entry.pos = list.size();
+  list.push_back(id);
+  return true;
+}
+
+void AddrManager::unplace(id_t id) {
+  const Entry &entry = entries_[id];
+  std::vector<id_t> &buckets = entry.tried ? tried_buckets_ : new_buckets_;
+  assert(buckets[slot(entry)] == id);
+  buckets[slot(entry)] = no_id;
+  std::vector<id_t> &list = entry.tried ? tried_ : new_;
+  list[entry.pos] = list.back();
+  entries_[list[entry.pos]].pos = entry.pos;
+  list.pop_back();
+}
+
+void AddrManager::release(id_t id) {
+  ids_.erase(entries_[id].addr);
+  entries_[id] = Entry();
+  free_.push_back(id);
+}
+
+AddrManager::id_t AddrManager::allocate(const Addr &addr) {
+  id_t id;
+  if (free_.empty()) {
+    id = entries_.size();
+    entries_.emplace_back();
+  } else {
+    id = free_.back();
+    free_.pop_back();
+  }
+  entries_[id].addr = addr;
+  ids_.emplace(addr, id);
+  return id;
+}
+
+void AddrManager::clear() {
+  entries_.clear();
+  free_.clear();
+  ids_.clear();
+  std::fill(new_buckets_.begin(), new_buckets_.end(), no_id);
+  std::fill(tried_buckets_.begin(), tried_buckets_.end(), no_id);
+  new_.clear();
+  tried_.clear();
+}
+
+bool AddrManager::add(const Addr &addr, const Addr &source) {
+  if (addr.af() == -1 || addr.port() == 0 || contains(addr)) {
+    return false;
+  }
+  const id_t id = allocate(addr);
+  if (!place(id, false, new_bucket(addr, source))) {
+    release(id);
+    return false;
+  }
+  return true;
+}
+
+void AddrManager::attempt(const Addr &addr) {
+  const id_t *id = ids_.find(addr);
+  if (id != nullptr) {
+    entries_[*id].attempts++;
+    entries_[*id].last_try = time32();
+  }
+}
+
+void AddrManager::good(const Addr &addr, std::chrono::milliseconds latency) {
+  const id_t *found = ids_.find(addr);
+  if (found == nullptr) {
+    return;
+  }
+  const id_t id = *found;
+  Entry &entry = entries_[id];
+  entry.failures = 0;
+  entry.successes++;
+  entry.last_success = time32();
+  entry.latency_ms = average(entry.latency_ms, latency.count());
+  if (entry.tried) {
+    return;
+  }
+
+  // Move it to the tried table. Whatever had its slot there goes back to
+  // the new table, if there's room.
+  unplace(id);
+  const uint32_t bucket = tried_bucket(addr);
+  entry.bucket = bucket;
+  const id_t other = tried_buckets_[slot(entry)];
+  if (other != no_id) {
+    unplace(other);
+    const Addr &other_addr = entries_[other].addr;
+    if (!place(other, false, new_bucket(other_addr, other_addr))) {
+      release(other);
+    }
+  }
+  const bool placed = place(id, true, bucket);
+  assert(placed);
+}
+
+void AddrManager::failed(const Addr &addr) {
+  const id_t *id = ids_.find(addr);
+  if (id != nullptr) {
+    entries_[*id].failures++;
+  }
+}
+
+// the key for a host's bans, which cover every port
+static inline Addr host(const Addr &addr) {
+  Addr out = addr;
+  out.set_port(0);
+  return out;
+}
+
+void AddrManager::ban(const Addr &addr, uint32_t seconds) {
+  const uint32_t now = time32();
+  std::vector<Addr> expired;
+  bans_.for_each([&](const Addr &a, uint32_t until) {
+    if (until <= now) {
+      expired.push_back(a);
+    }
+  });
+  for (const auto &a : expired) {
+    bans_.erase(a);
+  }
+  uint32_t &until = bans_[host(addr)];
+  until = std::max(until, now + seconds);
+
+  // it's also the worst kind of failure, so it's the first to be evicted
+  const id_t *id = ids_.find(addr);
+  if (id != nullptr) {
+    entries_[*id].failures += 10;
+  }
+}
+
+bool AddrManager::banned(const Addr &addr) const {
+  if (bans_.empty()) {
+    return false;
+  }
+  const uint32_t *until = bans_.find(host(addr));
+  return until != nullptr && *until > time32();
+}
+
+void AddrManager::headers(const Addr &addr, size_t count,
+                          std::chrono::milliseconds elapsed) {
+  const id_t *id = ids_.find(addr);
+  if (id == nullptr || count == 0 || elapsed.count() <= 0) {
+    return;
+  }
+  const uint64_t rate = count * 1000 / elapsed.count();
+  entries_[*id].header_rate = average(entries_[*id].header_rate, rate);
+}
+
+void AddrManager::announced(const Addr &addr,
+                            std::chrono::milliseconds lag) {
+  const id_t *id = ids_.find(addr);
+  if (id != nullptr) {
+    entries_[*id].announce_lag_ms =
+        average(entries_[*id].announce_lag_ms, lag.count());
+  }
+}
+
+bool AddrManager::select(Addr &out,
+                         const std::function<bool(const Addr &)> &skip,
+                         bool exhaustive) const {
+  const Entry *best = nullptr;
+  double best_score = 0;
+  int candidates = 0;
+  for (int draw = 0;
+       !empty() && draw < select_draws && candidates < select_candidates;
+       draw++) {
+    const bool use_tried = !tried_.empty() && (new_.empty() || (rg() & 1));
+    const std::vector<id_t> &list = use_tried ? tried_ : new_;
+    const Entry &entry = entries_[list[rg() % list.size()]];
+    if (skip(entry.addr) || banned(entry.addr)) {
+      continue;
+    }
+    candidates++;
+    const double s = score(entry);
+    if (best == nullptr || s > best_score) {
+      best = &entry;
+      best_score = s;
+    }
+  }
+  if (best != nullptr) {
+    out = best->addr;
+    return true;
+  }
+  if (!exhaustive) {
+    return false;
+  }
+
+  // nearly everything is skipped, so look at them all
+  for (const auto *list : {&tried_, &new_}) {
+    for (id_t id : *list) {
+      if (!skip(entries_[id].addr) && !banned(entries_[id].addr)) {
+        out = entries_[id].addr;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void AddrManager::sample(size_t max, std::vector<NetAddr> &out) const {
+  std::vector<id_t> ids(tried_);
+  ids.insert(ids.end(), new_.begin(), new_.end());
+  const size_t n = std::min(max, ids.size() / 4);
+  const uint32_t day_ago = adjusted_time() - 24 * 60 * 60;
+  for (size_t i = 0, taken = 0; i < ids.size() && taken < n; i++) {
+    std::swap(ids[i], ids[i + rg() % (ids.size() - i)]);
+    const Entry &entry = entries_[ids[i]];
+    if (banned(entry.addr)) {
+      continue;
+    }
+    NetAddr addr;
+    addr.time = entry.tried ? entry.last_success : day_ago;
+    addr.services = NODE_NETWORK;
+    addr.addr = entry.addr;
+    out.push_back(addr);
+    taken++;
+  }
+}
+
+static inline void put16(std::string &out, uint16_t val) {
+  val = htole16(val);
+  out.append(reinterpret_cast<const char *>(&val), sizeof val);
+}
+
+static inline void put32(std::string &out, uint32_t val) {
+  val = htole32(val);
+  out.append(reinterpret_cast<const char *>(&val), sizeof val);
+}
+
+static inline void put64(std::string &out, uint64_t val) {
+  val = htole64(val);
+  out.append(reinterpret_cast<const char *>(&val), sizeof val);
+}
+
+bool AddrManager::save(const std::string &path) const {
+  std::string out(file_magic, sizeof file_magic);
+  put32(out, file_version);
+  put64(out, key_);
+  put32(out, size());
+  for (const auto *list : {&new_, &tried_}) {
+    for (id_t id : *list) {
+      const Entry &entry = entries_[id];
+      const addrbuf_t &buf = entry.addr.addrbuf();
+      out.append(reinterpret_cast<const char *>(buf.data()), buf.size());
+      put16(out, entry.addr.port());
+      out.push_back(entry.tried);
+      put32(out, entry.bucket);
+      put32(out, entry.attempts);
+      put32(out, entry.failures);
+      put32(out, entry.successes);
+      put32(out, entry.last_try);
+      put32(out, entry.last_success);
+      put32(out, entry.latency_ms);
+      put32(out, entry.header_rate);
+      put32(out, entry.announce_lag_ms);
+    }
+  }
+
+  // write a new file and rename it, so a crash can't leave half a table
+  const std::string tmp = path + ".tmp";
+  std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+  file.write(out.data(), out.size());
+  file.close();
+  if (!file || std::rename(tmp.c_str(), path.c_str()) != 0) {
+    log->warn("failed to save peer addresses to {}", path);
+    return false;
+  }
+  LOG_DEBUG(log, "saved {} peer addresses to {}", size(), path);
+  return true;
+}
+
+namespace {
+// reads little-endian values out of a string, failing at the end
+class Reader {
+ public:
+  explicit Reader(const std::string &data) : data_(data), off_(0) {}
+
+  template <typename T>
+  bool get(T &val) {
+    if (off_ + sizeof val > data_.size()) {
+      return false;
+    }
+    std::memcpy(&val, data_.data() + off_, sizeof val);
+    off_ += sizeof val;
+    return true;
+  }
+
+  bool get(uint16_t &val) {
+    if (!get<uint16_t>(val)) {
+      return false;
+    }
+    val = le16toh(val);
+    return true;
+  }
+  bool get(uint32_t &val) {
+    if (!get<uint32_t>(val)) {
+      return false;
+    }
+    val = le32toh(val);
+    return true;
+  }
+  bool get(uint64_t &val) {
+    if (!get<uint64_t>(val)) {
+      return false;
+    }
+    val = le64toh(val);
+    return true;
+  }
+
+ private:
+  const std::string &data_;
+  size_t off_;
+};
+}  // namespace
+
+bool AddrManager::load(const std::string &path) {
+  clear();
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    LOG_DEBUG(log, "no saved peer addresses in {}", path);
+    return false;
+  }
+  const std::string data((std::istreambuf_iterator<char>(file)),
+                         std::istreambuf_iterator<char>());
+  Reader in(data);
+  std::array<char, sizeof file_magic> magic;
+  uint32_t version, count;
+  if (!in.get(magic) ||
+      std::memcmp(magic.data(), file_magic, sizeof file_magic) != 0 ||
+      !in.get(version) || version < 1 || version > file_version ||
+      !in.get(key_) || !in.get(count)) {
+    log->warn("ignoring bad peer address file {}", path);
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    addrbuf_t buf;
+    uint16_t port;
+    uint8_t tried;
+    Entry entry;
+    if (!in.get(buf) || !in.get(port) || !in.get(tried) ||
+        !in.get(entry.bucket) || !in.get(entry.attempts) ||
+        !in.get(entry.failures) || !in.get(entry.successes) ||
+        !in.get(entry.last_try) || !in.get(entry.last_success) ||
+        !in.get(entry.latency_ms) || !in.get(entry.header_rate) ||
+        (version > 1 && !in.get(entry.announce_lag_ms))) {
+      log->warn("ignoring truncated peer address file {}", path);
+      clear();
+      return false;
+    }
+    entry.addr.set_addr(buf);
+    entry.addr.set_port(port);
+    const uint32_t buckets = tried ? TRIED_BUCKETS : NEW_BUCKETS;
+    if (contains(entry.addr) || entry.bucket >= buckets) {
+      continue;
+    }
+    const id_t id = allocate(entry.addr);
+    entries_[id] = entry;
+    if (!place(id, tried, entry.bucket)) {
+      release(id);
+    }
+  }
+  log->info("loaded {} peer addresses ({} tried) from {}", size(),
+            tried_count(), path);
+  return true;
+}
+}  // namespace spv
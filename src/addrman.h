@@ -0,0 +1,174 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "./addr.h"
+#include "./fields.h"
+#include "./hashmap.h"
+
+namespace spv {
+// AddrManager keeps the peer addresses we know about, along the lines of
+// addrman in Bitcoin Core. Addresses start in the "new" table and move to
+// the "tried" table once a handshake with them succeeds. Both tables are
+// made of fixed-size buckets, picked by a keyed hash of the address's
+// network group (and for new addresses, the group of the peer that told us
+// about them), so no one network can take over the table. Each table also
+// keeps a dense list of its addresses, so a random pick is O(1).
+//
+// Addresses are scored by their handshake latency, header throughput, block
+// announcement lag and failures, and select() takes the best of a few
+// random picks.
+class AddrManager {
+ public:
+  AddrManager();
+  AddrManager(const AddrManager &other) = delete;
+
+  inline size_t size() const { return new_.size() + tried_.size(); }
+  inline bool empty() const { return size() == 0; }
+  inline size_t new_count() const { return new_.size(); }
+  inline size_t tried_count() const { return tried_.size(); }
+
+  inline bool contains(const Addr &addr) const { return ids_.contains(addr); }
+
+  // Add an address learned from source (which can be the address itself,
+  // e.g. for DNS seeds). Returns false if it was known or didn't fit.
+  bool add(const Addr &addr, const Addr &source);
+
+  // We're about to connect to this address.
+  void attempt(const Addr &addr);
+
+  // The handshake with this address finished, taking this long.
+  void good(const Addr &addr, std::chrono::milliseconds latency);
+
+  // A connection to this address failed before the handshake finished.
+  void failed(const Addr &addr);
+
+  // Ban the host of this address, on every port, for this many seconds,
+  // e.g. for misbehaving. select() skips banned addresses, and inbound
+  // peers from them are refused. Bans aren't saved with the table.
+  void ban(const Addr &addr, uint32_t seconds);
+  bool banned(const Addr &addr) const;
+  inline size_t ban_count() const { return bans_.size(); }
+
+  // This address sent count headers in reply to a getheaders after elapsed.
+  void headers(const Addr &addr, size_t count,
+               std::chrono::milliseconds elapsed);
+
+  // This address announced a new block this long after the first peer
+  // did; see AnnounceTracker.
+  void announced(const Addr &addr, std::chrono::milliseconds lag);
+
+  // Pick an address to connect to, skipping the ones skip() is true for
+  // (e.g. existing connections). Returns false if there's nothing to pick.
+  // If most addresses are skipped the random picks may all miss; then the
+  // whole table is scanned, unless exhaustive is false.
+  bool select(Addr &out, const std::function<bool(const Addr &)> &skip,
+              bool exhaustive = true) const;
+
+  // Append up to max random addresses that aren't banned, for a getaddr
+  // reply: at most a quarter of the table, tried ones with the time of their
+  // last handshake and new ones with a day ago.
+  void sample(size_t max, std::vector<NetAddr> &out) const;
+
+  // Save the table to a file, or replace the table with the one saved in a
+  // file. Both return false on failure; a failed load leaves the table
+  // empty.
+  bool save(const std::string &path) const;
+  bool load(const std::string &path);
+
+ private:
+  enum {
+    NEW_BUCKETS = 1024,
+    TRIED_BUCKETS = 256,
+    BUCKET_SIZE = 64,
+  };
+
+  typedef uint32_t id_t;
+  static constexpr id_t no_id = static_cast<id_t>(-1);
+
+  struct Entry {
+    Addr addr;
+    bool tried;
+    uint32_t bucket;  // in the table given by tried
+    size_t pos;       // in new_ or tried_
+    uint32_t attempts;
+    uint32_t failures;  // since the last success
+    uint32_t successes;
+    uint32_t last_try;  // unix times
+    uint32_t last_success;
+    uint32_t latency_ms;       // moving average, or 0 if unknown
+    uint32_t header_rate;      // headers per second, moving average
+    uint32_t announce_lag_ms;  // behind the first announcer, moving average
+
+    Entry()
+        : tried(false),
+          bucket(0),
+          pos(0),
+          attempts(0),
+          failures(0),
+          successes(0),
+          last_try(0),
+          last_success(0),
+          latency_ms(0),
+          header_rate(0),
+          announce_lag_ms(0) {}
+  };
+
+  uint64_t key_;  // random, so that bucket placement can't be predicted
+  std::vector<Entry> entries_;
+  std::vector<id_t> free_;  // unused ids in entries_
+  FlatHashMap<Addr, id_t, std::hash<Addr> > ids_;
+  std::vector<id_t> new_buckets_;  // NEW_BUCKETS * BUCKET_SIZE slots
+  std::vector<id_t> tried_buckets_;
+  std::vector<id_t> new_;  // ids in each table, for random selection
+  std::vector<id_t> tried_;
+  FlatHashMap<Addr, uint32_t, std::hash<Addr> > bans_;  // host to end time
+
+  uint64_t hash(uint64_t a, uint64_t b) const;
+  uint32_t new_bucket(const Addr &addr, const Addr &source) const;
+  uint32_t tried_bucket(const Addr &addr) const;
+  size_t slot(const Entry &entry) const;  // in its table's bucket array
+
+  // is this entry not worth keeping?
+  bool terrible(const Entry &entry) const;
+
+  double score(const Entry &entry) const;
+
+  // put an entry into a table, at its bucket; returns false if the slot
+  // was taken by an entry that's worth keeping
+  bool place(id_t id, bool tried, uint32_t bucket);
+
+  // take an entry out of its table
+  void unplace(id_t id);
+
+  // forget an entry that isn't in a table
+  void release(id_t id);
+
+  id_t allocate(const Addr &addr);
+
+  // forget every address
+  void clear();
+};
+}  // namespace spv
@@ -0,0 +1,178 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./affinity.h"
+
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include "./logging.h"
+
+namespace spv {
+MODULE_LOGGER
+
+namespace {
+struct Placement {
+  std::vector<unsigned> cpus;
+  int node = -1;  // the NUMA node of all of the CPUs, if they share one
+};
+
+// written before the threads start, and only read after
+Placement placements[size_t(ThreadGroup::NUM_GROUPS)];
+
+// The CPUs the process could run on before anything was pinned. A thread
+// starts out with its creator's CPUs, so those of a group without any get
+// these back, rather than keeping e.g. the main loop's.
+bool pinned = false;
+cpu_set_t unpinned;
+
+// the NUMA node of a CPU, from its nodeN entry in sysfs, or -1
+int cpu_node(unsigned cpu) {
+  const std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+  DIR *d = opendir(dir.c_str());
+  if (d == nullptr) {
+    return -1;
+  }
+  int node = -1;
+  while (dirent *ent = readdir(d)) {
+    if (std::strncmp(ent->d_name, "node", 4) == 0 &&
+        ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+      node = std::atoi(ent->d_name + 4);
+      break;
+    }
+  }
+  closedir(d);
+  return node;
+}
+}  // namespace
+
+const char *thread_group_name(ThreadGroup group) {
+  switch (group) {
+    case ThreadGroup::NETWORK:
+      return "network";
+    case ThreadGroup::WORKERS:
+      return "worker";
+    case ThreadGroup::CHAIN:
+      return "chain";
+    case ThreadGroup::NUM_GROUPS:
+      break;
+  }
+  return "unknown";
+}
+
+bool parse_cpu_list(const std::string &list, std::vector<unsigned> &cpus) {
+  cpus.clear();
+  size_t pos = 0;
+  while (pos < list.size()) {
+    size_t end = list.find(',', pos);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    const std::string range = list.substr(pos, end - pos);
+    const size_t dash = range.find('-');
+    char *rest;
+    const unsigned long first = std::strtoul(range.c_str(), &rest, 10);
+    unsigned long last = first;
+    if (rest == range.c_str()) {
+      return false;
+    }
+    if (dash != std::string::npos) {
+      if (rest != range.c_str() + dash) {
+        return false;
+      }
+      const char *from = range.c_str() + dash + 1;
+      last = std::strtoul(from, &rest, 10);
+      if (rest == from) {
+        return false;
+      }
+    }
+    if (*rest != '\0' || last < first || last >= CPU_SETSIZE) {
+      return false;
+    }
+    for (unsigned long cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+    pos = end + 1;
+  }
+  return !cpus.empty();
+}
+
+void set_group_cpus(ThreadGroup group, const std::vector<unsigned> &cpus) {
+  if (!pinned && !cpus.empty()) {
+    if (sched_getaffinity(0, sizeof unpinned, &unpinned) != 0) {
+      log->warn("failed to get the CPUs we run on: {}", std::strerror(errno));
+      return;
+    }
+    pinned = true;
+  }
+  Placement &p = placements[size_t(group)];
+  p.cpus = cpus;
+  p.node = -1;
+  for (size_t i = 0; i < cpus.size(); i++) {
+    const int node = cpu_node(cpus[i]);
+    if (node < 0 || (i && node != p.node)) {
+      p.node = -1;
+      break;
+    }
+    p.node = node;
+  }
+  if (!cpus.empty()) {
+    if (p.node >= 0) {
+      log->info("placing the {} threads on {} CPUs of NUMA node {}",
+                thread_group_name(group), cpus.size(), p.node);
+    } else {
+      log->info("placing the {} threads on {} CPUs",
+                thread_group_name(group), cpus.size());
+    }
+  }
+}
+
+void place_thread(ThreadGroup group) {
+  const Placement &p = placements[size_t(group)];
+  if (!pinned) {
+    return;
+  }
+  cpu_set_t set = unpinned;
+  if (!p.cpus.empty()) {
+    CPU_ZERO(&set);
+    for (unsigned cpu : p.cpus) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  const int err = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+  if (err) {
+    log->warn("failed to pin a {} thread: {}", thread_group_name(group),
+              std::strerror(err));
+    return;
+  }
+  if (p.node >= 0 && size_t(p.node) < 8 * sizeof(unsigned long)) {
+    const unsigned long mask = 1ul << p.node;
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask,
+                8 * sizeof mask) != 0) {
+      LOG_DEBUG(log, "failed to prefer NUMA node {}: {}", p.node,
+                std::strerror(errno));
+    }
+  }
+}
+}  // namespace spv
@@ -0,0 +1,53 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace spv {
+// Thread placement, from --network-cpus, --worker-cpus and --chain-cpus.
+// Each group of threads can be pinned to a set of CPUs, and when those are
+// all on one NUMA node, its threads also prefer that node's memory. Linux
+// already puts a page on the node of the thread that first touches it, so
+// with the threads pinned the slab free lists, read buffers and the header
+// index (which the loader thread builds) end up local to the group that
+// uses them; the preference covers what is allocated before a thread has
+// settled.
+enum class ThreadGroup {
+  NETWORK,  // the event loops: the main loop, the network threads and the
+            // --io-threads
+  WORKERS,  // the Scheduler's pool, which validates and hashes headers and
+            // blocks
+  CHAIN,    // the index loader and the chain writers
+  NUM_GROUPS,
+};
+
+const char *thread_group_name(ThreadGroup group);
+
+// Parse a list of CPUs like "0-3,8,10-11". Returns false if it's malformed.
+bool parse_cpu_list(const std::string &list, std::vector<unsigned> &cpus);
+
+// Set a group's CPUs, or with none leave its threads to the scheduler. This
+// has to happen before the group's threads start.
+void set_group_cpus(ThreadGroup group, const std::vector<unsigned> &cpus);
+
+// Pin the calling thread to its group's CPUs, or if it has none but another
+// group does, to the ones the process started with. Failures are only
+// logged.
+void place_thread(ThreadGroup group);
+}  // namespace spv
@@ -0,0 +1,111 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./announce.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <sstream>
+
+#include "./metrics.h"
+
+namespace spv {
+// An announcement this long after the first is of an old block (e.g. a
+// peer that was behind catching up), not a measure of how fast it relays.
+static const std::chrono::seconds MAX_ANNOUNCE_LAG{60};
+
+const uint32_t AnnounceTracker::bucket_bounds[num_buckets] = {
+    50, 100, 250, 500, 1000, 2000, 5000, 10000, 30000};
+
+bool AnnounceTracker::announced(const hash_t &hash, const Addr &peer,
+                                time_point t,
+                                std::chrono::milliseconds &lag) {
+  auto it = blocks_.find(hash);
+  if (it == blocks_.end()) {
+    while (blocks_.size() >= max_blocks_ && !order_.empty()) {
+      blocks_.erase(order_.front());
+      order_.pop_front();
+    }
+    it = blocks_.emplace(hash, Block{t, {}}).first;
+    order_.push_back(hash);
+  }
+  Block &block = it->second;
+  if (std::find(block.peers.begin(), block.peers.end(), peer) !=
+      block.peers.end()) {
+    return false;
+  }
+  lag = std::max(std::chrono::milliseconds(0),
+                 std::chrono::duration_cast<std::chrono::milliseconds>(
+                     t - block.first));
+  if (lag > MAX_ANNOUNCE_LAG) {
+    return false;
+  }
+  block.peers.push_back(peer);
+
+  PeerStats &stats = peers_[peer];
+  const uint32_t ms = lag.count();
+  const size_t i =
+      std::lower_bound(bucket_bounds, bucket_bounds + num_buckets, ms) -
+      bucket_bounds;
+  stats.buckets[i]++;
+  stats.firsts += block.peers.size() == 1;
+  stats.lag_sum_ms += ms;
+  // weights the old average 3:1, like AddrManager's
+  stats.lag_ms = stats.count ? (3 * uint64_t(stats.lag_ms) + ms) / 4 : ms;
+  stats.count++;
+  return true;
+}
+
+const AnnounceTracker::PeerStats *AnnounceTracker::find(
+    const Addr &peer) const {
+  auto it = peers_.find(peer);
+  return it == peers_.end() ? nullptr : &it->second;
+}
+
+void AnnounceTracker::expose(std::string &out) const {
+  expose_header(out, "spv_peer_announce_lag_seconds", "histogram",
+                "How long after the first announcer each peer announced new "
+                "blocks");
+  for (const auto &pr : peers_) {
+    std::ostringstream peer;
+    peer << "peer=\"" << pr.first << '"';
+    const PeerStats &stats = pr.second;
+    uint64_t total = 0;
+    char le[48];
+    for (size_t i = 0; i < num_buckets; i++) {
+      total += stats.buckets[i];
+      std::snprintf(le, sizeof le, ",le=\"%g\"", bucket_bounds[i] / 1e3);
+      expose_sample(out, "spv_peer_announce_lag_seconds_bucket",
+                    peer.str() + le, total);
+    }
+    expose_sample(out, "spv_peer_announce_lag_seconds_bucket",
+                  peer.str() + ",le=\"+Inf\"", stats.count);
+    expose_sample(out, "spv_peer_announce_lag_seconds_sum", peer.str(),
+                  stats.lag_sum_ms / 1e3);
+    expose_sample(out, "spv_peer_announce_lag_seconds_count", peer.str(),
+                  stats.count);
+  }
+  expose_header(out, "spv_peer_announce_first_total", "counter",
+                "New blocks each peer announced before any other");
+  for (const auto &pr : peers_) {
+    std::ostringstream peer;
+    peer << "peer=\"" << pr.first << '"';
+    expose_sample(out, "spv_peer_announce_first_total", peer.str(),
+                  pr.second.firsts);
+  }
+}
+}  // namespace spv
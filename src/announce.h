@@ -0,0 +1,88 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "./addr.h"
+#include "./constants.h"
+#include "./hashmap.h"
+#include "./util.h"
+
+namespace spv {
+// AnnounceTracker times which peers tell us about new blocks first. For
+// each of the last few blocks it keeps when the first announcement came
+// in, whether by inv, headers or cmpctblock, and the peers that have
+// announced it since. A peer's lag on a block is how long after the first
+// announcer it got there. The lags go into a small histogram per connected
+// peer, for metrics, and a moving average that ranks the peers for high
+// bandwidth compact blocks.
+class AnnounceTracker {
+ public:
+  // lag buckets, as upper bounds in milliseconds, then one for the rest
+  static const size_t num_buckets = 9;
+  static const uint32_t bucket_bounds[num_buckets];
+
+  struct PeerStats {
+    uint64_t buckets[num_buckets + 1];  // not cumulative
+    uint64_t count;
+    uint64_t firsts;  // blocks it announced before any other peer
+    uint64_t lag_sum_ms;
+    uint32_t lag_ms;  // moving average
+
+    PeerStats() : buckets(), count(0), firsts(0), lag_sum_ms(0), lag_ms(0) {}
+  };
+
+  explicit AnnounceTracker(size_t max_blocks) : max_blocks_(max_blocks) {}
+  AnnounceTracker(const AnnounceTracker &other) = delete;
+
+  // A peer announced the block at t. Returns false if it had announced it
+  // already, or the first announcement was too long ago for this to be
+  // news; otherwise lag is how long after the first announcer it was,
+  // zero for the first.
+  bool announced(const hash_t &hash, const Addr &peer, time_point t,
+                 std::chrono::milliseconds &lag);
+
+  // the stats of a peer that's announced anything, or nullptr
+  const PeerStats *find(const Addr &peer) const;
+
+  // forget a peer that disconnected
+  inline void remove(const Addr &peer) { peers_.erase(peer); }
+
+  // Append spv_peer_announce_lag_seconds, a histogram per peer, and
+  // spv_peer_announce_first_total in the Prometheus text format.
+  void expose(std::string &out) const;
+
+ private:
+  struct Block {
+    time_point first;
+    std::vector<Addr> peers;
+  };
+
+  size_t max_blocks_;
+  std::unordered_map<hash_t, Block, BlockHashHasher> blocks_;
+  std::deque<hash_t> order_;  // oldest first, for eviction
+  std::unordered_map<Addr, PeerStats> peers_;
+};
+}  // namespace spv
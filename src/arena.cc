@@ -0,0 +1,56 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./arena.h"
+
+#include <algorithm>
+#include <cstdint>
+
+#include "./memory.h"
+#include "./slab.h"
+
+namespace spv {
+Arena::~Arena() {
+  for (auto &chunk : chunks_) {
+    mem_add(MemTag::ARENAS, -int64_t(chunk.size));
+    slab::release(std::move(chunk.data), chunk.size);
+  }
+}
+
+void *Arena::allocate(size_t sz, size_t align) {
+  for (;;) {
+    if (current_ < chunks_.size()) {
+      Chunk &chunk = chunks_[current_];
+      const uintptr_t base = reinterpret_cast<uintptr_t>(chunk.data.get());
+      const size_t off = ((base + used_ + align - 1) & ~(align - 1)) - base;
+      if (off + sz <= chunk.size) {
+        used_ = off + sz;
+        return chunk.data.get() + off;
+      }
+      if (current_ + 1 < chunks_.size()) {
+        current_++;
+        used_ = 0;
+        continue;
+      }
+    }
+    const size_t size = slab::round_up(std::max(chunk_size_, sz + align));
+    chunks_.push_back({slab::allocate(size), size});
+    mem_add(MemTag::ARENAS, size);
+    current_ = chunks_.size() - 1;
+    used_ = 0;
+  }
+}
+}  // namespace spv
@@ -0,0 +1,72 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace spv {
+// A bump allocator for objects that all die together, e.g. the messages
+// decoded from one read. Chunks come from the slab pool and are kept across
+// reset(), so once it has warmed up an arena doesn't allocate at all.
+class Arena {
+ public:
+  // Runs the destructor but doesn't free anything; the memory is reclaimed
+  // by reset().
+  struct Deleter {
+    template <typename T>
+    void operator()(T *obj) const {
+      obj->~T();
+    }
+  };
+
+  template <typename T>
+  using Ptr = std::unique_ptr<T, Deleter>;
+
+  explicit Arena(size_t chunk_size = 16 << 10)
+      : chunk_size_(chunk_size), current_(0), used_(0) {}
+  Arena(const Arena &other) = delete;
+  ~Arena();
+
+  // get sz bytes of storage; align must be a power of two
+  void *allocate(size_t sz, size_t align = alignof(std::max_align_t));
+
+  template <typename T, typename... Args>
+  Ptr<T> make(Args &&... args) {
+    void *mem = allocate(sizeof(T), alignof(T));
+    return Ptr<T>(new (mem) T(std::forward<Args>(args)...));
+  }
+
+  // Reuse all of the storage. Everything made from the arena must already
+  // have been destroyed.
+  void reset() { current_ = used_ = 0; }
+
+ private:
+  struct Chunk {
+    std::unique_ptr<char[]> data;
+    size_t size;
+  };
+
+  size_t chunk_size_;
+  std::vector<Chunk> chunks_;
+  size_t current_;  // the chunk being filled
+  size_t used_;     // bytes used in the current chunk
+};
+}  // namespace spv
@@ -0,0 +1,252 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./asmap.h"
+
+#include <fstream>
+#include <iterator>
+
+#include "./logging.h"
+
+namespace spv {
+MODULE_LOGGER
+
+namespace {
+static const uint32_t invalid = 0xffffffff;
+
+enum class Op : uint32_t {
+  RETURN = 0,
+  JUMP = 1,
+  MATCH = 2,
+  DEFAULT = 3,
+};
+
+// The exponent-mantissa classes of each kind of operand: a 1 bit moves on
+// to the next class, past the values of this one, and a 0 bit is followed
+// by that many bits of mantissa. The last class has no 1 bit to read.
+static const uint8_t type_sizes[] = {0, 0, 1};
+static const uint8_t asn_sizes[] = {15, 16, 17, 18, 19, 20, 21, 22, 23, 24};
+static const uint8_t match_sizes[] = {1, 2, 3, 4, 5, 6, 7, 8};
+static const uint8_t jump_sizes[] = {5,  6,  7,  8,  9,  10, 11, 12, 13,
+                                     14, 15, 16, 17, 18, 19, 20, 21, 22,
+                                     23, 24, 25, 26, 27, 28, 29, 30};
+
+// reads the program's bits in order, without running off the end
+class BitReader {
+ public:
+  explicit BitReader(const std::vector<uint8_t> &bytes)
+      : data_(bytes.data()), pos_(0), end_(bytes.size() * 8) {}
+
+  inline size_t pos() const { return pos_; }
+  inline size_t left() const { return end_ - pos_; }
+  inline bool done() const { return pos_ == end_; }
+  inline void skip(size_t n) { pos_ += n; }
+
+  inline bool bit() { return (data_[pos_ >> 3] >> (pos_++ & 7)) & 1; }
+
+  template <size_t N>
+  uint32_t decode(uint32_t minval, const uint8_t (&sizes)[N]) {
+    uint32_t val = minval;
+    for (size_t i = 0; i < N; i++) {
+      if (i + 1 < N) {
+        if (done()) {
+          return invalid;
+        }
+        if (bit()) {
+          val += uint32_t(1) << sizes[i];
+          continue;
+        }
+      }
+      if (left() < sizes[i]) {
+        return invalid;
+      }
+      for (size_t b = 0; b < sizes[i]; b++) {
+        val += uint32_t(bit()) << (sizes[i] - 1 - b);
+      }
+      return val;
+    }
+    return invalid;
+  }
+
+  inline Op op() { return static_cast<Op>(decode(0, type_sizes)); }
+  inline uint32_t asn() { return decode(1, asn_sizes); }
+  inline uint32_t match() { return decode(2, match_sizes); }
+  inline uint32_t jump() { return decode(17, jump_sizes); }
+
+ private:
+  const uint8_t *data_;
+  size_t pos_;
+  size_t end_;
+};
+
+// the bits a MATCH operand compares, below its leading 1
+static inline unsigned match_length(uint32_t match) {
+  return 31 - __builtin_clz(match);
+}
+}  // namespace
+
+bool AsMap::valid(const std::vector<uint8_t> &bytes, size_t input_bits) {
+  BitReader in(bytes);
+  // where each jump still to be followed lands, and the input bits left
+  // there, innermost last
+  std::vector<std::pair<size_t, size_t> > jumps;
+  Op prev = Op::JUMP;
+  bool had_incomplete_match = false;
+  size_t bits = input_bits;
+  while (!in.done()) {
+    if (!jumps.empty() && in.pos() >= jumps.back().first) {
+      return false;  // a jump into the middle of an instruction
+    }
+    const uint32_t op = in.decode(0, type_sizes);
+    if (op == uint32_t(Op::RETURN)) {
+      if (prev == Op::DEFAULT || in.asn() == invalid) {
+        return false;  // DEFAULT then RETURN should just be RETURN
+      }
+      if (jumps.empty()) {
+        // only zero padding to the end of the last byte may follow
+        if (in.left() > 7) {
+          return false;
+        }
+        while (!in.done()) {
+          if (in.bit()) {
+            return false;
+          }
+        }
+        return true;
+      }
+      if (in.pos() != jumps.back().first) {
+        return false;  // unreachable code
+      }
+      bits = jumps.back().second;
+      jumps.pop_back();
+      prev = Op::JUMP;
+    } else if (op == uint32_t(Op::JUMP)) {
+      const uint32_t jump = in.jump();
+      if (jump == invalid || jump > in.left() || bits == 0) {
+        return false;
+      }
+      bits--;
+      const size_t target = in.pos() + jump;
+      if (!jumps.empty() && target >= jumps.back().first) {
+        return false;  // intersecting jumps
+      }
+      jumps.emplace_back(target, bits);
+      prev = Op::JUMP;
+    } else if (op == uint32_t(Op::MATCH)) {
+      const uint32_t match = in.match();
+      if (match == invalid) {
+        return false;
+      }
+      const unsigned len = match_length(match);
+      if (prev != Op::MATCH) {
+        had_incomplete_match = false;
+      }
+      // within a run of matches, only one may be shorter than a byte
+      if ((len < 8 && had_incomplete_match) || bits < len) {
+        return false;
+      }
+      had_incomplete_match = len < 8;
+      bits -= len;
+      prev = Op::MATCH;
+    } else if (op == uint32_t(Op::DEFAULT)) {
+      if (prev == Op::DEFAULT || in.asn() == invalid) {
+        return false;
+      }
+      prev = Op::DEFAULT;
+    } else {
+      return false;  // the instruction runs off the end
+    }
+  }
+  return false;  // no RETURN at the end
+}
+
+bool AsMap::load(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    log->error("failed to open asmap file {}", path);
+    return false;
+  }
+  std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(in)),
+                             std::istreambuf_iterator<char>());
+  if (bytes.empty() || !valid(bytes, 128)) {
+    log->error("asmap file {} isn't a valid asmap", path);
+    return false;
+  }
+  bits_.swap(bytes);
+  log->info("loaded a {} byte asmap from {}", bits_.size(), path);
+  return true;
+}
+
+uint32_t AsMap::lookup(const Addr &addr) const {
+  if (bits_.empty() || addr.af() == -1) {
+    return 0;
+  }
+  const addrbuf_t &ip = addr.addrbuf();
+  BitReader in(bits_);
+  size_t next = 0;  // of the 128 input bits
+  auto input = [&]() -> unsigned {
+    return (ip[next >> 3] >> (7 - (next & 7))) & 1;
+  };
+  uint32_t asn = 0;
+  // valid() has checked every path ends in a RETURN within the input
+  while (!in.done()) {
+    switch (in.op()) {
+      case Op::RETURN:
+        return in.asn();
+      case Op::JUMP: {
+        const uint32_t jump = in.jump();
+        if (input()) {
+          in.skip(jump);
+        }
+        next++;
+        break;
+      }
+      case Op::MATCH: {
+        const uint32_t match = in.match();
+        const unsigned len = match_length(match);
+        for (unsigned b = 0; b < len; b++, next++) {
+          if (input() != ((match >> (len - 1 - b)) & 1)) {
+            return asn;
+          }
+        }
+        break;
+      }
+      case Op::DEFAULT:
+        asn = in.asn();
+        break;
+      default:
+        return 0;
+    }
+  }
+  return 0;
+}
+
+static AsMap &global_asmap() {
+  static AsMap map;
+  return map;
+}
+
+const AsMap &asmap() { return global_asmap(); }
+
+bool load_asmap(const std::string &path) { return global_asmap().load(path); }
+
+uint64_t peer_group(const Addr &addr) {
+  const uint32_t asn = asmap().lookup(addr);
+  // net_group() tags its groups with 1 or 2 above the low 32 bits
+  return asn ? uint64_t(3) << 32 | asn : net_group(addr);
+}
+}  // namespace spv
@@ -0,0 +1,64 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "./addr.h"
+
+namespace spv {
+// An IP to AS number map in the format of Bitcoin Core's -asmap: a bit
+// string (read from the low bit of each byte up) of instructions that walk
+// the bits of the address, from the high bit of its first byte, like a
+// compressed trie. lookup() runs the program straight from the bytes, so it
+// allocates nothing and takes a few hundred bit reads at most; the program
+// is checked once, by load(), so lookup() can't run off its end.
+class AsMap {
+ public:
+  AsMap() {}
+
+  inline bool empty() const { return bits_.empty(); }
+
+  // Replace the map with the one in this file. Returns false, leaving the
+  // map as it was, if the file can't be read or isn't a valid program.
+  bool load(const std::string &path);
+
+  // the AS number of an IPv4 (as ::ffff:a.b.c.d) or IPv6 address, or 0 if
+  // it isn't mapped
+  uint32_t lookup(const Addr &addr) const;
+
+  // check that the program is well formed for inputs of this many bits, as
+  // SanityCheckASMap() in Bitcoin Core
+  static bool valid(const std::vector<uint8_t> &bits, size_t input_bits);
+
+ private:
+  std::vector<uint8_t> bits_;
+};
+
+// The map loaded by load_asmap(), or an empty one, for every client in the
+// process.
+const AsMap &asmap();
+bool load_asmap(const std::string &path);
+
+// The group an outbound connection is counted against: the AS number of
+// the address with an asmap, or else its net_group().
+uint64_t peer_group(const Addr &addr);
+}  // namespace spv
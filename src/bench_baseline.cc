@@ -0,0 +1,279 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./bench_baseline.h"
+
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+#include "./sha256.h"
+
+namespace spv {
+// resamples per case for the confidence interval
+static const size_t bootstrap_rounds = 2000;
+
+// the first line of a baseline file
+static const char baseline_magic[] = "spv benchmark baseline 1";
+
+void Baseline::add(const std::string &name, double sample) {
+  for (auto &c : cases_) {
+    if (c.first == name) {
+      c.second.push_back(sample);
+      return;
+    }
+  }
+  cases_.emplace_back(name, std::vector<double>{sample});
+}
+
+const std::vector<double> *Baseline::samples(const std::string &name) const {
+  for (const auto &c : cases_) {
+    if (c.first == name) {
+      return &c.second;
+    }
+  }
+  return nullptr;
+}
+
+static std::string cpu_model() {
+  std::ifstream cpuinfo("/proc/cpuinfo");
+  std::string line;
+  while (std::getline(cpuinfo, line)) {
+    if (line.compare(0, 10, "model name") == 0) {
+      const size_t colon = line.find(':');
+      if (colon != std::string::npos && colon + 2 <= line.size()) {
+        return line.substr(colon + 2);
+      }
+    }
+  }
+  return "unknown";
+}
+
+void Baseline::describe_machine() {
+  struct utsname uts;
+  const bool have_uts = uname(&uts) == 0;
+  machine_.clear();
+  machine_.emplace_back("cpu", cpu_model());
+  machine_.emplace_back("cores", std::to_string(sysconf(_SC_NPROCESSORS_ONLN)));
+  machine_.emplace_back("kernel", have_uts ? uts.release : "unknown");
+  machine_.emplace_back("arch", have_uts ? uts.machine : "unknown");
+  machine_.emplace_back("compiler", __VERSION__);
+  machine_.emplace_back("sha256", sha256::backend());
+}
+
+bool Baseline::save(const std::string &path) const {
+  const std::string tmp = path + ".tmp";
+  FILE *f = std::fopen(tmp.c_str(), "w");
+  if (f == nullptr) {
+    std::fprintf(stderr, "failed to write %s: %s\n", tmp.c_str(),
+                 std::strerror(errno));
+    return false;
+  }
+  std::fprintf(f, "%s\n", baseline_magic);
+  for (const auto &m : machine_) {
+    std::fprintf(f, "machine\t%s\t%s\n", m.first.c_str(), m.second.c_str());
+  }
+  for (const auto &c : cases_) {
+    std::fprintf(f, "case\t%s\t", c.first.c_str());
+    for (size_t i = 0; i < c.second.size(); i++) {
+      std::fprintf(f, i ? " %.17g" : "%.17g", c.second[i]);
+    }
+    std::fprintf(f, "\n");
+  }
+  if (std::fclose(f) != 0 || std::rename(tmp.c_str(), path.c_str()) != 0) {
+    std::fprintf(stderr, "failed to write %s: %s\n", path.c_str(),
+                 std::strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+bool Baseline::load(const std::string &path) {
+  std::ifstream in(path);
+  std::string line;
+  if (!std::getline(in, line) || line != baseline_magic) {
+    std::fprintf(stderr, "%s isn't a benchmark baseline\n", path.c_str());
+    return false;
+  }
+  machine_.clear();
+  cases_.clear();
+  while (std::getline(in, line)) {
+    const size_t tab1 = line.find('\t');
+    const size_t tab2 =
+        tab1 == std::string::npos ? tab1 : line.find('\t', tab1 + 1);
+    if (tab2 == std::string::npos) {
+      std::fprintf(stderr, "bad line in %s: %s\n", path.c_str(),
+                   line.c_str());
+      return false;
+    }
+    const std::string kind = line.substr(0, tab1);
+    const std::string key = line.substr(tab1 + 1, tab2 - tab1 - 1);
+    const std::string val = line.substr(tab2 + 1);
+    if (kind == "machine") {
+      machine_.emplace_back(key, val);
+    } else if (kind == "case") {
+      std::istringstream samples(val);
+      double sample;
+      while (samples >> sample) {
+        add(key, sample);
+      }
+    }
+  }
+  return true;
+}
+
+static double median(std::vector<double> &v) {
+  const size_t mid = v.size() / 2;
+  std::nth_element(v.begin(), v.begin() + mid, v.end());
+  if (v.size() % 2) {
+    return v[mid];
+  }
+  return (v[mid] + *std::max_element(v.begin(), v.begin() + mid)) / 2;
+}
+
+static double median_of(std::vector<double> v) { return median(v); }
+
+// a bootstrap 99% confidence interval for median(now) / median(base)
+static void ratio_interval(const std::vector<double> &base,
+                           const std::vector<double> &now, double &lo,
+                           double &hi) {
+  std::mt19937_64 rng(1);  // the same verdict every time for the same data
+  std::vector<double> ratios(bootstrap_rounds), a(base.size()), b(now.size());
+  for (auto &ratio : ratios) {
+    for (auto &x : a) {
+      x = base[rng() % base.size()];
+    }
+    for (auto &x : b) {
+      x = now[rng() % now.size()];
+    }
+    ratio = median(b) / median(a);
+  }
+  std::sort(ratios.begin(), ratios.end());
+  lo = ratios[bootstrap_rounds / 200];
+  hi = ratios[bootstrap_rounds - 1 - bootstrap_rounds / 200];
+}
+
+size_t Baseline::compare(const Baseline &base, double threshold) const {
+  for (const auto &m : machine_) {
+    for (const auto &b : base.machine_) {
+      if (b.first == m.first && b.second != m.second) {
+        std::printf("warning: the baseline's %s was %s, this is %s\n",
+                    m.first.c_str(), b.second.c_str(), m.second.c_str());
+      }
+    }
+  }
+  size_t regressions = 0;
+  std::printf("%-32s %12s %12s %8s %20s\n", "case", "baseline", "this run",
+              "change", "99% interval");
+  for (const auto &c : cases_) {
+    const double now = median_of(c.second);
+    const std::vector<double> *old = base.samples(c.first);
+    if (old == nullptr || old->empty()) {
+      std::printf("%-32s %12s %12.1f %8s %20s new\n", c.first.c_str(), "-",
+                  now, "-", "-");
+      continue;
+    }
+    double lo, hi;
+    ratio_interval(*old, c.second, lo, hi);
+    const char *verdict = "";
+    if (lo > 1 + threshold) {
+      verdict = "REGRESSED";
+      regressions++;
+    } else if (hi < 1 - threshold) {
+      verdict = "improved";
+    }
+    char interval[32];
+    std::snprintf(interval, sizeof interval, "[%+.1f%%, %+.1f%%]",
+                  (lo - 1) * 100, (hi - 1) * 100);
+    const double then = median_of(*old);
+    std::printf("%-32s %12.1f %12.1f %+7.1f%% %20s%s%s\n", c.first.c_str(),
+                then, now, (now / then - 1) * 100, interval,
+                *verdict ? " " : "", verdict);
+  }
+  return regressions;
+}
+
+static bool is_baseline_option(const char *arg) {
+  for (const char *opt :
+       {"--save-baseline", "--compare", "--threshold", "--samples"}) {
+    if (std::strcmp(arg, opt) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool parse_baseline_options(int &argc, char **argv, BaselineOptions &opts) {
+  int out = 1;
+  int i = 1;
+  for (; i < argc && std::strcmp(argv[i], "--") != 0; i++) {
+    const std::string arg = argv[i];
+    if (!is_baseline_option(argv[i])) {
+      argv[out++] = argv[i];
+      continue;
+    }
+    if (i + 1 == argc) {
+      std::fprintf(stderr, "%s needs a value\n", argv[i]);
+      return false;
+    }
+    const char *val = argv[++i];
+    if (arg == "--save-baseline") {
+      opts.save = val;
+    } else if (arg == "--compare") {
+      opts.compare = val;
+    } else if (arg == "--threshold") {
+      opts.threshold = std::atof(val) / 100;
+    } else {
+      opts.samples = std::max(std::atoi(val), 1);
+    }
+  }
+  for (; i < argc; i++) {
+    argv[out++] = argv[i];
+  }
+  argc = out;
+  argv[argc] = nullptr;
+  return true;
+}
+
+int finish_baseline(Baseline &run, const BaselineOptions &opts) {
+  run.describe_machine();
+  int ret = 0;
+  if (!opts.compare.empty()) {
+    Baseline base;
+    if (!base.load(opts.compare)) {
+      return 1;
+    }
+    const size_t regressions = run.compare(base, opts.threshold);
+    if (regressions) {
+      std::printf("%zu case(s) regressed by more than %.1f%%\n", regressions,
+                  opts.threshold * 100);
+      ret = 1;
+    }
+  }
+  if (!opts.save.empty() && !run.save(opts.save)) {
+    ret = 1;
+  }
+  return ret;
+}
+}  // namespace spv
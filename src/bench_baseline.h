@@ -0,0 +1,78 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace spv {
+// Benchmark results saved for later builds to be checked against, e.g.
+// before rolling one out. A benchmark program takes
+//
+//   --save-baseline FILE  write this run's results to FILE
+//   --compare FILE        compare this run with the one saved in FILE
+//   --threshold PCT       the slowdown that counts as a regression (5)
+//   --samples N           how many samples to take of each case
+//
+// Each case is a set of samples, where lower is better (ns per call, us per
+// header). A case is compared by the ratio of its median to the baseline's.
+// Both sets of samples are resampled with replacement to get a bootstrap
+// 99% confidence interval for the ratio, and the case regressed only if the
+// whole interval is above the threshold, so run-to-run noise isn't counted.
+// A baseline also records the machine and build it ran on; if those differ
+// the comparison is still made, with a warning about each difference.
+class Baseline {
+ public:
+  void add(const std::string &name, double sample);
+
+  // Record this machine: the CPU, cores, kernel, compiler and hash backend.
+  void describe_machine();
+
+  // both print why they failed to stderr
+  bool save(const std::string &path) const;
+  bool load(const std::string &path);
+
+  // Print each case of this run against base, returning how many regressed.
+  // Cases that base doesn't have are shown as new.
+  size_t compare(const Baseline &base, double threshold) const;
+
+ private:
+  std::vector<std::pair<std::string, std::string> > machine_;
+  std::vector<std::pair<std::string, std::vector<double> > > cases_;
+
+  const std::vector<double> *samples(const std::string &name) const;
+};
+
+struct BaselineOptions {
+  std::string save;
+  std::string compare;
+  double threshold = 0.05;
+  size_t samples = 0;  // or the program's default
+
+  bool enabled() const { return !save.empty() || !compare.empty(); }
+};
+
+// Take the baseline options out of argv (up to a "--", if there is one),
+// leaving the program's own. Returns false, after printing why, if one is
+// missing its value.
+bool parse_baseline_options(int &argc, char **argv, BaselineOptions &opts);
+
+// Save and compare run as asked, returning the exit status: 1 if something
+// regressed or a file couldn't be used, and otherwise 0.
+int finish_baseline(Baseline &run, const BaselineOptions &opts);
+}  // namespace spv
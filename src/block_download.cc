@@ -0,0 +1,179 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./block_download.h"
+
+#include <cassert>
+#include <utility>
+
+namespace spv {
+bool BlockDownload::want(size_t height, const hash_t &block_hash) {
+  if (!heights_.emplace(block_hash, height).second) {
+    return false;
+  }
+  auto res = items_.emplace(height, Item());
+  if (!res.second) {
+    heights_.erase(block_hash);
+    return false;
+  }
+  Item &item = res.first->second;
+  item.block_hash = block_hash;
+  item.state = State::QUEUED;
+  return true;
+}
+
+bool BlockDownload::assignable() const {
+  size_t n = 0;
+  for (auto it = items_.begin(); it != items_.end() && n < window_;
+       ++it, n++) {
+    if (it->second.state == State::QUEUED) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void BlockDownload::assign(const Addr &peer, time_point now,
+                           std::vector<hash_t> &out) {
+  size_t &count = per_peer_count_[peer];
+  size_t n = 0;
+  for (auto it = items_.begin();
+       it != items_.end() && n < window_ && count < per_peer_; ++it, n++) {
+    Item &item = it->second;
+    if (item.state == State::QUEUED) {
+      item.state = State::INFLIGHT;
+      item.peer = peer;
+      item.sent = now;
+      count++;
+      out.push_back(item.block_hash);
+    }
+  }
+  if (count == 0) {
+    per_peer_count_.erase(peer);
+  }
+}
+
+BlockDownload::Item *BlockDownload::find(const Addr &peer,
+                                         const hash_t &block_hash) {
+  auto it = heights_.find(block_hash);
+  if (it == heights_.end()) {
+    return nullptr;
+  }
+  Item &item = items_.at(it->second);
+  if (item.state != State::INFLIGHT || item.peer != peer) {
+    return nullptr;
+  }
+  return &item;
+}
+
+bool BlockDownload::requested(const Addr &peer,
+                              const hash_t &block_hash) const {
+  auto it = heights_.find(block_hash);
+  if (it == heights_.end()) {
+    return false;
+  }
+  const Item &item = items_.at(it->second);
+  return item.state == State::INFLIGHT && item.peer == peer;
+}
+
+void BlockDownload::requeue(Item &item) {
+  assert(item.state == State::INFLIGHT);
+  auto it = per_peer_count_.find(item.peer);
+  assert(it != per_peer_count_.end());
+  if (--it->second == 0) {
+    per_peer_count_.erase(it);
+  }
+  item.state = State::QUEUED;
+}
+
+bool BlockDownload::received(const Addr &peer, Block &&block) {
+  Item *item = find(peer, block.header.block_hash);
+  if (item == nullptr) {
+    return false;
+  }
+  requeue(*item);
+  item->state = State::RECEIVED;
+  item->block = std::move(block);
+  return true;
+}
+
+void BlockDownload::failed(const Addr &peer, const hash_t &block_hash) {
+  Item *item = find(peer, block_hash);
+  if (item != nullptr) {
+    requeue(*item);
+  }
+}
+
+bool BlockDownload::next(size_t &height, Addr &peer, Block &block) {
+  auto it = items_.begin();
+  if (it == items_.end() || it->second.state != State::RECEIVED) {
+    return false;
+  }
+  height = it->first;
+  peer = it->second.peer;
+  block = std::move(it->second.block);
+  heights_.erase(it->second.block_hash);
+  items_.erase(it);
+  return true;
+}
+
+void BlockDownload::release(const Addr &peer) {
+  if (per_peer_count_.count(peer) == 0) {
+    return;
+  }
+  for (auto &pr : items_) {
+    if (pr.second.state == State::INFLIGHT && pr.second.peer == peer) {
+      requeue(pr.second);
+    }
+  }
+  assert(per_peer_count_.count(peer) == 0);
+}
+
+void BlockDownload::stalled(time_point now, std::chrono::milliseconds stall,
+                            std::chrono::milliseconds timeout,
+                            std::vector<Addr> &out) const {
+  std::unordered_map<Addr, bool> seen;
+  bool queued = false;
+  size_t n = 0;
+  for (const auto &pr : items_) {
+    const Item &item = pr.second;
+    if (item.state == State::QUEUED && n < window_) {
+      queued = true;
+    }
+    n++;
+    if (item.state == State::INFLIGHT && now - item.sent > timeout &&
+        seen.emplace(item.peer, true).second) {
+      out.push_back(item.peer);
+    }
+  }
+  // with the window all asked for, and more behind it, nothing moves until
+  // the first block is in
+  if (queued || items_.size() <= window_) {
+    return;
+  }
+  const Item &front = items_.begin()->second;
+  if (front.state == State::INFLIGHT && now - front.sent > stall &&
+      seen.emplace(front.peer, true).second) {
+    out.push_back(front.peer);
+  }
+}
+
+void BlockDownload::clear() {
+  items_.clear();
+  heights_.clear();
+  per_peer_count_.clear();
+}
+}  // namespace spv
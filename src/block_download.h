@@ -0,0 +1,118 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+#include "./addr.h"
+#include "./constants.h"
+#include "./hashmap.h"
+#include "./message.h"
+#include "./util.h"
+
+namespace spv {
+// BlockDownload fetches full blocks by height from several peers at once,
+// as Bitcoin Core does. Only the first window blocks still wanted are
+// handed out, each peer gets at most per_peer of them at a time, and the
+// blocks are delivered in height order however they arrive, so what's held
+// in memory is bounded by the window. A peer is given up on if a block
+// takes too long, or if it holds up the whole window: every block in it is
+// asked for but the first one, which it still hasn't sent. Like Rescan, it
+// doesn't talk to peers itself: the client asks it for blocks to request
+// and hands it the ones that arrive.
+class BlockDownload {
+ public:
+  BlockDownload() = delete;
+  BlockDownload(const BlockDownload &other) = delete;
+  BlockDownload(size_t window, size_t per_peer)
+      : window_(window), per_peer_(per_peer) {}
+
+  // Queue the block at height. Returns false if it's already queued.
+  bool want(size_t height, const hash_t &block_hash);
+
+  // is there a queued block in the window that isn't asked for yet?
+  bool assignable() const;
+
+  // Add the blocks for peer to fetch next to out, and count them as asked
+  // of it at now.
+  void assign(const Addr &peer, time_point now, std::vector<hash_t> &out);
+
+  // number of blocks asked of peer and not yet received
+  inline size_t inflight(const Addr &peer) const {
+    auto it = per_peer_count_.find(peer);
+    return it == per_peer_count_.end() ? 0 : it->second;
+  }
+
+  // Was this block asked of peer?
+  bool requested(const Addr &peer, const hash_t &block_hash) const;
+
+  // A requested block arrived and checked out; it's kept until the ones
+  // below it are in too. Returns false if it wasn't asked of peer.
+  bool received(const Addr &peer, Block &&block);
+
+  // a requested block was bad, so put it back in the queue
+  void failed(const Addr &peer, const hash_t &block_hash);
+
+  // Take the lowest block if it has arrived, with its height and the peer
+  // that sent it.
+  bool next(size_t &height, Addr &peer, Block &block);
+
+  // put everything asked of peer back in the queue, e.g. on disconnect
+  void release(const Addr &peer);
+
+  // Add the peers to give up on to out: those with a block asked for
+  // longer than timeout ago, and the one holding up a full window for
+  // longer than stall.
+  void stalled(time_point now, std::chrono::milliseconds stall,
+               std::chrono::milliseconds timeout,
+               std::vector<Addr> &out) const;
+
+  inline bool empty() const { return items_.empty(); }
+  inline size_t size() const { return items_.size(); }
+
+  void clear();
+
+ private:
+  enum class State { QUEUED, INFLIGHT, RECEIVED };
+
+  struct Item {
+    hash_t block_hash;
+    State state;
+    Addr peer;
+    time_point sent;
+    Block block;
+  };
+
+  const size_t window_;
+  const size_t per_peer_;
+
+  // by height, the front of it being the window
+  std::map<size_t, Item> items_;
+  std::unordered_map<hash_t, size_t, BlockHashHasher> heights_;
+  std::unordered_map<Addr, size_t> per_peer_count_;
+
+  // the item asked of peer for block_hash, or nullptr
+  Item *find(const Addr &peer, const hash_t &block_hash);
+
+  // back to QUEUED, one less in flight from its peer
+  void requeue(Item &item);
+};
+}  // namespace spv
@@ -0,0 +1,264 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./block_store.h"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "./chain.h"
+#include "./decoder.h"
+#include "./logging.h"
+#include "./util.h"
+
+namespace spv {
+MODULE_LOGGER
+
+// as in Bitcoin Core; a record never spans two files
+static const size_t max_file_size = 128 << 20;
+
+// index records are this prefix and the block hash's 32 bytes
+static const std::string index_prefix = "blk/";
+
+static std::string index_key(const hash_t &hash) {
+  return index_prefix + std::string(hash.begin(), hash.end());
+}
+
+BlockStore::BlockStore(const std::string &datadir, Chain &chain, size_t limit)
+    : datadir_(datadir), chain_(chain), limit_(limit), bytes_(0) {
+  std::map<uint32_t, size_t> ends;
+  std::vector<std::string> bad;
+  chain_.for_each_state(
+      index_prefix, [&](const std::string &key, const std::string &val) {
+        uint64_t fields[3];
+        if (key.size() != index_prefix.size() + sizeof(hash_t) ||
+            val.size() != sizeof fields) {
+          bad.push_back(key);
+          return;
+        }
+        hash_t hash;
+        std::memcpy(hash.data(), key.data() + index_prefix.size(),
+                    sizeof hash);
+        std::memcpy(fields, val.data(), sizeof fields);
+        Location loc;
+        loc.file = le64toh(fields[0]) >> 32;
+        loc.size = le64toh(fields[0]) & 0xffffffff;
+        loc.offset = le64toh(fields[1]);
+        loc.height = le64toh(fields[2]);
+        index_.emplace(hash, loc);
+        size_t &end = ends[loc.file];
+        end = std::max<size_t>(end, loc.offset + loc.size);
+      });
+  for (const auto &key : bad) {
+    log->warn("dropping a malformed block index record");
+    chain_.erase_state(key);
+  }
+
+  // a file that's gone takes its index records with it
+  std::vector<hash_t> lost;
+  for (const auto &pr : ends) {
+    if (!open_file(pr.first, pr.second, pr.first == ends.rbegin()->first)) {
+      index_.for_each([&](const hash_t &hash, const Location &loc) {
+        if (loc.file == pr.first) {
+          lost.push_back(hash);
+        }
+      });
+    }
+  }
+  for (const auto &hash : lost) {
+    index_.erase(hash);
+    chain_.erase_state(index_key(hash));
+  }
+  log->info("block store has {} blocks in {} files ({} MiB)", index_.size(),
+            files_.size(), bytes_ >> 20);
+  prune();
+}
+
+BlockStore::~BlockStore() {
+  for (auto &pr : files_) {
+    close_file(pr.second);
+  }
+}
+
+std::string BlockStore::path(uint32_t file) const {
+  char name[16];
+  std::snprintf(name, sizeof name, "blk%05u.dat", file);
+  return datadir_ + "/" + name;
+}
+
+bool BlockStore::open_file(uint32_t file, size_t used, bool last) {
+  const std::string name = path(file);
+  const int fd = open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    log->error("failed to open block file {}: {}", name, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || size_t(st.st_size) < used) {
+    log->error("block file {} is missing blocks", name);
+    close(fd);
+    return false;
+  }
+  // a file that's only read is mapped as far as it was written
+  const size_t len = last ? max_file_size : used;
+  if (last && ftruncate(fd, len) == -1) {
+    log->error("failed to size block file {}: {}", name, strerror(errno));
+    close(fd);
+    return false;
+  }
+  char *base = nullptr;
+  if (len) {
+    void *addr = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      log->error("failed to mmap block file {}: {}", name, strerror(errno));
+      close(fd);
+      return false;
+    }
+    base = static_cast<char *>(addr);
+  }
+  files_[file] = File{fd, base, len, used};
+  bytes_ += used;
+  return true;
+}
+
+void BlockStore::close_file(File &file) {
+  if (file.base != nullptr) {
+    munmap(file.base, file.mapped);
+  }
+  if (file.mapped > file.used && ftruncate(file.fd, file.used) == -1) {
+    log->warn("failed to trim a block file: {}", strerror(errno));
+  }
+  close(file.fd);
+}
+
+bool BlockStore::put(size_t height, const Block &block) {
+  const hash_t &hash = block.header.block_hash;
+  if (has(hash)) {
+    return true;
+  }
+  const size_t record = sizeof(uint32_t) + block.raw.size();
+  if (record > max_file_size) {
+    log->warn("block {} is too big to store", to_hex(hash));
+    return false;
+  }
+  if (files_.empty() ||
+      files_.rbegin()->second.used + record > files_.rbegin()->second.mapped) {
+    const uint32_t next = files_.empty() ? 0 : files_.rbegin()->first + 1;
+    if (!open_file(next, 0, true)) {
+      return false;
+    }
+  }
+  const uint32_t number = files_.rbegin()->first;
+  File &file = files_.rbegin()->second;
+  uint32_t len = htole32(static_cast<uint32_t>(block.raw.size()));
+  struct iovec iov[2] = {
+      {&len, sizeof len},
+      {const_cast<char *>(block.raw.data()), block.raw.size()}};
+  if (pwritev(file.fd, iov, 2, file.used) != ssize_t(record)) {
+    log->error("failed to write block {} to {}: {}", to_hex(hash),
+               path(number), strerror(errno));
+    return false;
+  }
+  Location loc;
+  loc.file = number;
+  loc.size = block.raw.size();
+  loc.offset = file.used + sizeof len;
+  loc.height = height;
+  file.used += record;
+  bytes_ += record;
+  index_.emplace(hash, loc);
+
+  const uint64_t fields[3] = {
+      htole64(uint64_t(loc.file) << 32 | loc.size), htole64(loc.offset),
+      htole64(loc.height)};
+  chain_.put_state(index_key(hash),
+                   std::string(reinterpret_cast<const char *>(fields),
+                               sizeof fields));
+  prune();
+  return true;
+}
+
+bool BlockStore::get(const hash_t &block_hash, Stored *out) const {
+  const Location *loc = index_.find(block_hash);
+  if (loc == nullptr) {
+    return false;
+  }
+  auto it = files_.find(loc->file);
+  if (it == files_.end()) {
+    return false;
+  }
+  out->data = it->second.base + loc->offset;
+  out->size = loc->size;
+  out->height = loc->height;
+  return true;
+}
+
+bool BlockStore::read(const hash_t &block_hash, Block *block) const {
+  Stored stored;
+  if (!get(block_hash, &stored)) {
+    return false;
+  }
+  block->raw.assign(stored.data, stored.size);
+  try {
+    block->index();
+  } catch (const DecodeError &exc) {
+    log->warn("stored block {} is corrupt: {}", to_hex(block_hash),
+              exc.what());
+    return false;
+  }
+  return block->header.block_hash == block_hash;
+}
+
+void BlockStore::sync() {
+  if (!files_.empty() && fdatasync(files_.rbegin()->second.fd) == -1) {
+    log->warn("failed to sync the block file: {}", strerror(errno));
+  }
+}
+
+void BlockStore::prune() {
+  while (limit_ && bytes_ > limit_ && files_.size() > 1) {
+    auto oldest = files_.begin();
+    std::vector<hash_t> pruned;
+    index_.for_each([&](const hash_t &hash, const Location &loc) {
+      if (loc.file == oldest->first) {
+        pruned.push_back(hash);
+      }
+    });
+    for (const auto &hash : pruned) {
+      index_.erase(hash);
+      chain_.erase_state(index_key(hash));
+    }
+    close_file(oldest->second);
+    bytes_ -= oldest->second.used;
+    const std::string name = path(oldest->first);
+    if (unlink(name.c_str()) == -1) {
+      log->warn("failed to delete block file {}: {}", name, strerror(errno));
+    }
+    log->info("pruned {} blocks in {}", pruned.size(), name);
+    files_.erase(oldest);
+  }
+}
+}  // namespace spv
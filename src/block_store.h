@@ -0,0 +1,112 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "./constants.h"
+#include "./hashmap.h"
+#include "./message.h"
+
+namespace spv {
+class Chain;
+
+// BlockStore keeps full blocks, such as the ones downloaded for watched
+// scripts, in append-only files in the data directory, blk00000.dat,
+// blk00001.dat and so on, as Bitcoin Core does. Each record is the block's
+// payload after its length as a 4-byte little-endian integer. A file is
+// created at its full size and mapped whole, so stored blocks are read in
+// place without a copy, and stay mapped until their file is pruned.
+//
+// The index, from block hash to file, offset, length and height, lives in
+// the chain's database as state records (see Chain::put_state()), and is
+// loaded at open. With a limit, the oldest files are deleted once the
+// blocks take up more than that, the file being written excepted.
+class BlockStore {
+ public:
+  // a block in place in its file
+  struct Stored {
+    const char *data;  // the payload, valid until the file is pruned
+    size_t size;
+    size_t height;
+  };
+
+  BlockStore() = delete;
+  BlockStore(const BlockStore &other) = delete;
+  BlockStore(const std::string &datadir, Chain &chain, size_t limit);
+  ~BlockStore();
+
+  inline bool has(const hash_t &block_hash) const {
+    return index_.contains(block_hash);
+  }
+
+  // Append a block, which may prune the oldest file. Returns false if it
+  // couldn't be written.
+  bool put(size_t height, const Block &block);
+
+  // Find a stored block, pointing out at it.
+  bool get(const hash_t &block_hash, Stored *out) const;
+
+  // Copy a stored block into block and index it, as parsing does. Returns
+  // false if it isn't stored or doesn't decode.
+  bool read(const hash_t &block_hash, Block *block) const;
+
+  // number of blocks stored, and the bytes of the files holding them
+  inline size_t size() const { return index_.size(); }
+  inline size_t bytes() const { return bytes_; }
+
+  // flush the file being written to disk
+  void sync();
+
+ private:
+  struct Location {
+    uint32_t file;
+    uint32_t size;
+    uint64_t offset;  // of the payload
+    uint64_t height;
+  };
+
+  struct File {
+    int fd;
+    char *base;
+    size_t mapped;
+    size_t used;  // where the next record goes
+  };
+
+  std::string datadir_;
+  Chain &chain_;
+  size_t limit_;
+  size_t bytes_;
+  FlatHashMap<hash_t, Location, BlockHashHasher> index_;
+  std::map<uint32_t, File> files_;  // oldest first
+
+  std::string path(uint32_t file) const;
+
+  // Open and map a file, creating it if need be. The last one is mapped at
+  // its full size, to be appended to.
+  bool open_file(uint32_t file, size_t used, bool last);
+
+  // unmap and close a file, trimming it to what's been written
+  void close_file(File &file);
+
+  // delete the oldest files until the blocks fit in limit_
+  void prune();
+};
+}  // namespace spv
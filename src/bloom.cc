@@ -0,0 +1,112 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./bloom.h"
+
+#include <endian.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "./constants.h"
+
+namespace spv {
+static inline uint32_t rotl32(uint32_t x, unsigned r) {
+  return (x << r) | (x >> (32 - r));
+}
+
+uint32_t murmur3(uint32_t seed, const char *data, size_t len) {
+  const uint32_t c1 = 0xcc9e2d51, c2 = 0x1b873593;
+  uint32_t h = seed;
+
+  // the body, four bytes at a time
+  const size_t blocks = len / 4;
+  for (size_t i = 0; i < blocks; i++) {
+    uint32_t k;
+    std::memcpy(&k, data + 4 * i, sizeof k);
+    k = le32toh(k) * c1;
+    k = rotl32(k, 15) * c2;
+    h ^= k;
+    h = rotl32(h, 13) * 5 + 0xe6546b64;
+  }
+
+  // the last one to three bytes
+  const uint8_t *tail = reinterpret_cast<const uint8_t *>(data + 4 * blocks);
+  uint32_t k = 0;
+  switch (len & 3) {
+    case 3:
+      k ^= uint32_t(tail[2]) << 16;
+      // fall through
+    case 2:
+      k ^= uint32_t(tail[1]) << 8;
+      // fall through
+    case 1:
+      k ^= tail[0];
+      k = rotl32(k * c1, 15) * c2;
+      h ^= k;
+  }
+
+  // finalization
+  h ^= len;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+BloomFilter::BloomFilter(size_t elements, double fp_rate, uint32_t tweak,
+                         BloomUpdate flags)
+    : tweak_(tweak), flags_(flags) {
+  // the optimal sizes for a bloom filter, as in BIP37
+  const double ln2 = std::log(2.0);
+  const double n = std::max<size_t>(elements, 1);
+  const double bytes = -n * std::log(fp_rate) / (ln2 * ln2) / 8;
+  bits_.resize(std::min<size_t>(
+      std::max<size_t>(bytes, 1), MAX_BLOOM_FILTER_SIZE));
+  nbits_ = bits_.size() * 8;
+  hash_funcs_ = std::min<uint32_t>(
+      std::max<uint32_t>(nbits_ / n * ln2, 1), MAX_BLOOM_HASH_FUNCS);
+}
+
+void BloomFilter::insert(const char *data, size_t len) {
+  for (uint32_t n = 0; n < hash_funcs_; n++) {
+    const size_t b = bit(n, data, len);
+    bits_[b / 8] |= 1 << (b % 8);
+  }
+}
+
+bool BloomFilter::contains(const char *data, size_t len) const {
+  for (uint32_t n = 0; n < hash_funcs_; n++) {
+    const size_t b = bit(n, data, len);
+    if (!(bits_[b / 8] & (1 << (b % 8)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+FilterLoad BloomFilter::message() const {
+  FilterLoad msg;
+  msg.filter.assign(bits_.begin(), bits_.end());
+  msg.hash_funcs = hash_funcs_;
+  msg.tweak = tweak_;
+  msg.flags = static_cast<uint8_t>(flags_);
+  return msg;
+}
+}  // namespace spv
@@ -0,0 +1,79 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "./message.h"
+
+namespace spv {
+// what a peer adds to our filter by itself when a transaction matches it
+enum class BloomUpdate : uint8_t {
+  NONE = 0,
+  ALL = 1,            // the outpoint of every matching output
+  P2PUBKEY_ONLY = 2,  // only those of pay-to-pubkey and multisig outputs
+};
+
+// MurmurHash3 (x86, 32-bit), the hash function BIP37 uses
+uint32_t murmur3(uint32_t seed, const char *data, size_t len);
+
+// A BIP37 bloom filter, for peers to match transactions against so that we
+// only get the ones we're watching for (in merkleblock and tx messages)
+// rather than whole blocks. The peer does the matching, so the bit layout
+// and hash functions are fixed by the protocol; the bits are one contiguous
+// array, small enough (at most 36 KB) to stay in cache.
+class BloomFilter {
+ public:
+  // Size a filter for this many elements to have about this false positive
+  // rate, within the protocol limits.
+  BloomFilter(size_t elements, double fp_rate, uint32_t tweak,
+              BloomUpdate flags = BloomUpdate::ALL);
+
+  // the size of the filter in bytes
+  inline size_t size() const { return bits_.size(); }
+
+  inline uint32_t hash_funcs() const { return hash_funcs_; }
+
+  void insert(const char *data, size_t len);
+  inline void insert(const std::string &data) {
+    insert(data.data(), data.size());
+  }
+
+  bool contains(const char *data, size_t len) const;
+  inline bool contains(const std::string &data) const {
+    return contains(data.data(), data.size());
+  }
+
+  // the filterload message that sends this filter
+  FilterLoad message() const;
+
+ private:
+  std::vector<uint8_t> bits_;
+  size_t nbits_;
+  uint32_t hash_funcs_;
+  uint32_t tweak_;
+  BloomUpdate flags_;
+
+  // the bit that hash function n sets for data
+  inline size_t bit(uint32_t n, const char *data, size_t len) const {
+    return murmur3(n * 0xfba4c795 + tweak_, data, len) % nbits_;
+  }
+};
+}  // namespace spv
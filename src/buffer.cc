@@ -16,38 +16,61 @@
 
 #include "./buffer.h"
 
+#include <algorithm>
+
 #include "./logging.h"
 
 namespace spv {
 MODULE_LOGGER
 
 void Buffer::reserve(size_t capacity) {
-  assert(capacity >= size_);
+  assert(capacity >= size());
+  capacity = slab::round_up(capacity);
   if (capacity != capacity_) {
-    log->debug("{} buffer from {} to {}",
-               capacity > capacity_ ? "growing" : "shrinking", capacity_,
-               capacity);
-    std::unique_ptr<char[]> new_data(new char[capacity]);
-    std::memmove(new_data.get(), data_.get(), capacity_);
-    if (capacity > capacity_) {
-      std::memset(new_data.get() + capacity_, 0, capacity - capacity_);
-    }
+    LOG_DEBUG(log, "{} buffer from {} to {}",
+              capacity > capacity_ ? "growing" : "shrinking", capacity_,
+              capacity);
+    std::unique_ptr<char[]> new_data = slab::allocate(capacity);
+    std::memmove(new_data.get(), data(), size());
+    slab::release(std::move(data_), capacity_);
     data_ = std::move(new_data);
+    mem_add(MemTag::BUFFERS, int64_t(capacity) - int64_t(capacity_));
     capacity_ = capacity;
+    end_ -= begin_;
+    begin_ = 0;
+  }
+}
+
+void Buffer::shrink(size_t floor) {
+  const size_t capacity = slab::round_up(std::max(size(), floor));
+  if (capacity < capacity_) {
+    reserve(capacity);
   }
 }
 
 void Buffer::ensure_capacity(size_t len) {
-  size_t new_capacity = capacity_;
-  while (size_ + len > new_capacity) {
+  if (end_ + len <= capacity_) {
+    return;
+  }
+  if (begin_ && size() + len <= capacity_) {
+    // compact; this only moves the bytes that haven't been consumed yet
+    std::memmove(data_.get(), data(), size());
+    end_ -= begin_;
+    begin_ = 0;
+    return;
+  }
+  size_t new_capacity = capacity_ ? capacity_ : 1;
+  while (size() + len > new_capacity) {
     new_capacity *= 2;
   }
   reserve(new_capacity);
 }
 
 std::unique_ptr<char[]> Buffer::move_buffer(size_t &sz) {
-  sz = size_;
-  size_ = 0;
+  assert(begin_ == 0);
+  sz = end_;
+  begin_ = end_ = 0;
+  mem_add(MemTag::BUFFERS, -int64_t(capacity_));
   capacity_ = 0;
   return std::move(data_);
 }
@@ -22,25 +22,44 @@
 #include <memory>
 #include <vector>
 
+#include "./memory.h"
+#include "./profiler.h"
+#include "./slab.h"
+
 namespace spv {
-// Buffer represents a byte buffer.
+// Buffer represents a byte buffer. Bytes are appended at the back and
+// consumed from the front; consuming just moves a read cursor, and the
+// remaining bytes are only moved back to the start of the allocation when
+// more room is needed at the back. Storage comes from the slab pool and
+// isn't zero-initialized.
 class Buffer {
  public:
   Buffer() : Buffer(128) {}
-  explicit Buffer(size_t cap) : capacity_(cap), size_(0), data_(new char[cap]) {
-    std::memset(data_.get(), 0, cap);
+  explicit Buffer(size_t cap)
+      : capacity_(slab::round_up(cap)),
+        begin_(0),
+        end_(0),
+        data_(slab::allocate(cap)) {
+    mem_add(MemTag::BUFFERS, capacity_);
   }
   Buffer(const Buffer &other) = delete;
   Buffer(Buffer &&other)
       : capacity_(other.capacity_),
-        size_(other.size_),
-        data_(std::move(other.data_)) {}
+        begin_(other.begin_),
+        end_(other.end_),
+        data_(std::move(other.data_)) {
+    other.capacity_ = other.begin_ = other.end_ = 0;
+  }
+  ~Buffer() {
+    mem_add(MemTag::BUFFERS, -int64_t(capacity_));
+    slab::release(std::move(data_), capacity_);
+  }
 
   // append data
-  void append(const void *addr, size_t len) {
+  PROFILE_BOUNDARY void append(const void *addr, size_t len) {
     ensure_capacity(len);
-    std::memmove(data_.get() + static_cast<ptrdiff_t>(size_), addr, len);
-    size_ += len;
+    std::memmove(data_.get() + end_, addr, len);
+    end_ += len;
   }
 
   // append string data
@@ -53,38 +72,48 @@ class Buffer {
     }
   }
 
-  // append zeros; note that the buffer is already zero-initialized
-  void append_zeros(size_t len) {
+  // append zeros
+  PROFILE_BOUNDARY void append_zeros(size_t len) {
     ensure_capacity(len);
-    size_ += len;
+    std::memset(data_.get() + end_, 0, len);
+    end_ += len;
   }
 
   // insert directly into the middle of the buffer
   void insert(const void *addr, size_t len, size_t offset) {
-    assert(offset + len <= size_);
-    std::memmove(data_.get() + offset, addr, len);
+    assert(offset + len <= size());
+    std::memmove(data_.get() + begin_ + offset, addr, len);
   }
 
-  inline size_t size() const { return size_; }
-  inline const char *data() const { return data_.get(); }
+  inline size_t size() const { return end_ - begin_; }
+  inline size_t capacity() const { return capacity_; }
+  inline const char *data() const { return data_.get() + begin_; }
+  inline char *mutable_data() { return data_.get() + begin_; }
 
-  // this could be made more efficient
-  void consume(size_t sz) {
-    assert(size_ >= sz);
-    std::memcpy(data_.get(), data_.get() + sz, capacity_ - sz);
-    size_ -= sz;
-    std::memset(data_.get() + size_, 0, capacity_ - size_);
+  // drop bytes from the front of the buffer, in constant time
+  PROFILE_BOUNDARY void consume(size_t sz) {
+    assert(size() >= sz);
+    begin_ += sz;
+    if (begin_ == end_) {
+      begin_ = end_ = 0;
+    }
   }
 
-  // Reserve total storage space for this many bytes.
+  // Reserve total storage space for at least this many bytes.
   void reserve(size_t capacity);
 
+  // Give storage back to the slab pool, keeping at least floor bytes and
+  // whatever is still buffered.
+  void shrink(size_t floor);
+
  private:
   size_t capacity_;
-  size_t size_;
+  size_t begin_;  // read cursor
+  size_t end_;    // write cursor
   std::unique_ptr<char[]> data_;
 
-  // Ensure there's enough capacity to add len bytes.
+  // Ensure there's enough capacity to add len bytes, moving the unconsumed
+  // bytes to the front of the buffer first if that makes enough room.
   void ensure_capacity(size_t len);
 
  protected:
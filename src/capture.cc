@@ -0,0 +1,137 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./capture.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include "./logging.h"
+
+namespace spv {
+MODULE_LOGGER
+
+// buffer a good few reads before going to the kernel
+static const size_t capture_buffer_size = 1 << 20;
+
+bool CaptureWriter::open(const std::string &path) {
+  close();
+  file_ = std::fopen(path.c_str(), "wb");
+  if (file_ == nullptr) {
+    log->error("failed to open capture file {}: {}", path, strerror(errno));
+    return false;
+  }
+  std::setvbuf(file_, nullptr, _IOFBF, capture_buffer_size);
+  std::fwrite(CAPTURE_MAGIC, sizeof CAPTURE_MAGIC, 1, file_);
+  start_ = std::chrono::steady_clock::now();
+  log->info("capturing peer traffic to {}", path);
+  return true;
+}
+
+void CaptureWriter::close() {
+  if (file_ != nullptr) {
+    std::fclose(file_);
+    file_ = nullptr;
+  }
+}
+
+uint32_t CaptureWriter::open_peer(const Addr &addr, bool inbound) {
+  const uint32_t peer = next_peer_++;
+  char payload[sizeof(addrbuf_t) + sizeof(uint16_t)];
+  const uint16_t port = addr.port();
+  std::memcpy(payload, addr.addrbuf().data(), sizeof(addrbuf_t));
+  std::memcpy(payload + sizeof(addrbuf_t), &port, sizeof port);
+  record(peer, CaptureType::OPEN, payload, sizeof payload, inbound);
+  return peer;
+}
+
+void CaptureWriter::close_peer(uint32_t peer) {
+  record(peer, CaptureType::CLOSE, nullptr, 0);
+}
+
+void CaptureWriter::record(uint32_t peer, CaptureType type, const char *data,
+                           size_t size, bool inbound) {
+  if (file_ == nullptr) {
+    return;
+  }
+  CaptureRecord rec;
+  std::memset(&rec, 0, sizeof rec);
+  rec.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::steady_clock::now() - start_)
+                 .count();
+  rec.peer = peer;
+  rec.type = type;
+  rec.inbound = inbound;
+  rec.size = size;
+  if (std::fwrite(&rec, sizeof rec, 1, file_) != 1 ||
+      (size && std::fwrite(data, size, 1, file_) != 1)) {
+    log->error("failed to write the capture, stopping it: {}",
+               strerror(errno));
+    close();
+  }
+}
+
+bool CaptureReader::open(const std::string &path) {
+  close();
+  file_ = std::fopen(path.c_str(), "rb");
+  if (file_ == nullptr) {
+    log->error("failed to open capture file {}: {}", path, strerror(errno));
+    return false;
+  }
+  std::setvbuf(file_, nullptr, _IOFBF, capture_buffer_size);
+  char magic[sizeof CAPTURE_MAGIC];
+  if (std::fread(magic, sizeof magic, 1, file_) != 1 ||
+      std::memcmp(magic, CAPTURE_MAGIC, sizeof magic) != 0) {
+    log->error("{} is not a capture file", path);
+    close();
+    return false;
+  }
+  return true;
+}
+
+void CaptureReader::close() {
+  if (file_ != nullptr) {
+    std::fclose(file_);
+    file_ = nullptr;
+  }
+}
+
+bool CaptureReader::next(CaptureRecord &rec, std::string &payload) {
+  if (file_ == nullptr || std::fread(&rec, sizeof rec, 1, file_) != 1) {
+    return false;
+  }
+  payload.resize(rec.size);
+  if (rec.size && std::fread(&payload[0], rec.size, 1, file_) != 1) {
+    log->warn("capture ends in the middle of a record");
+    return false;
+  }
+  return true;
+}
+
+Addr CaptureReader::peer_addr(const std::string &payload) {
+  Addr addr;
+  if (payload.size() == sizeof(addrbuf_t) + sizeof(uint16_t)) {
+    addrbuf_t buf;
+    uint16_t port;
+    std::memcpy(buf.data(), payload.data(), buf.size());
+    std::memcpy(&port, payload.data() + buf.size(), sizeof port);
+    addr.set_addr(buf);
+    addr.set_port(port);
+  }
+  return addr;
+}
+}  // namespace spv
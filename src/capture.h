@@ -0,0 +1,104 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include "./addr.h"
+
+namespace spv {
+// Peer traffic captured with --capture-file, for spv-replay to feed back
+// into a Client later without sockets: the bytes each peer sent us, as they
+// were read, and what we wrote to it. The file is CAPTURE_MAGIC then
+// records in host byte order, each a CaptureRecord and size bytes of
+// payload. Peers are numbered in the order they appear, from 0; an OPEN
+// record's payload is the peer's 16-byte address and then its port.
+enum class CaptureType : uint8_t {
+  OPEN = 1,  // a connection was made or accepted
+  RECV,      // bytes read from the peer
+  SEND,      // bytes written to the peer
+  CLOSE,     // the connection went away
+};
+
+struct CaptureRecord {
+  uint64_t time;  // ns since the capture started
+  uint32_t peer;
+  CaptureType type;
+  uint8_t inbound;  // for OPEN, did the peer connect to us?
+  uint16_t unused;
+  uint32_t size;  // of the payload
+};
+static_assert(sizeof(CaptureRecord) == 24, "the capture format changed");
+
+static const char CAPTURE_MAGIC[8] = {'S', 'P', 'V', 'C', 'A', 'P', '0', '1'};
+
+class CaptureWriter {
+ public:
+  CaptureWriter() : file_(nullptr), next_peer_(0) {}
+  CaptureWriter(const CaptureWriter &other) = delete;
+  ~CaptureWriter() { close(); }
+
+  // start a capture in this file, logging why not
+  bool open(const std::string &path);
+  void close();
+
+  // number a new connection and record it
+  uint32_t open_peer(const Addr &addr, bool inbound);
+  void close_peer(uint32_t peer);
+
+  inline void recv(uint32_t peer, const char *data, size_t size) {
+    record(peer, CaptureType::RECV, data, size);
+  }
+  inline void send(uint32_t peer, const char *data, size_t size) {
+    record(peer, CaptureType::SEND, data, size);
+  }
+
+ private:
+  std::FILE *file_;
+  std::chrono::steady_clock::time_point start_;
+  uint32_t next_peer_;
+
+  void record(uint32_t peer, CaptureType type, const char *data, size_t size,
+              bool inbound = false);
+};
+
+class CaptureReader {
+ public:
+  CaptureReader() : file_(nullptr) {}
+  CaptureReader(const CaptureReader &other) = delete;
+  ~CaptureReader() { close(); }
+
+  // open a capture, logging why not
+  bool open(const std::string &path);
+  void close();
+
+  // Read the next record and its payload. Returns false at the end, or if
+  // the file is cut short.
+  bool next(CaptureRecord &rec, std::string &payload);
+
+  // the address in an OPEN record's payload
+  static Addr peer_addr(const std::string &payload);
+
+ private:
+  std::FILE *file_;
+};
+}  // namespace spv
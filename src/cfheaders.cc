@@ -0,0 +1,120 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./cfheaders.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "./gcs.h"
+#include "./logging.h"
+
+namespace spv {
+MODULE_LOGGER
+
+FilterHeaderChain::FilterHeaderChain(const std::string &path) : fd_(-1) {
+  static_assert(sizeof(Record) == 2 * sizeof(hash_t), "Record is padded");
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd_ == -1) {
+    log->error("failed to open filter headers {}: {}", path, strerror(errno));
+    assert(false);
+  }
+  struct stat st;
+  assert(fstat(fd_, &st) == 0);
+  records_.resize(st.st_size / sizeof(Record));
+  const size_t len = records_.size() * sizeof(Record);
+  char *buf = reinterpret_cast<char *>(records_.data());
+  for (size_t done = 0; done < len;) {
+    const ssize_t n = pread(fd_, buf + done, len - done, done);
+    if (n <= 0) {
+      log->error("failed to read filter headers {}: {}", path,
+                 strerror(errno));
+      records_.resize(done / sizeof(Record));
+      break;
+    }
+    done += n;
+  }
+  // drop a partial record left by a crash in the middle of an append
+  truncate(records_.size());
+  log->info("loaded {} filter headers from {}", records_.size(), path);
+}
+
+FilterHeaderChain::~FilterHeaderChain() {
+  if (fd_ != -1) {
+    close(fd_);
+  }
+}
+
+bool FilterHeaderChain::extend(const hash_t &prev,
+                               const std::vector<hash_t> &block_hashes,
+                               const std::vector<hash_t> &filter_hashes,
+                               const std::vector<hash_t> &checkpoints) {
+  assert(block_hashes.size() == filter_hashes.size());
+  const size_t start = records_.size();
+  if (prev != prev_header(start)) {
+    return false;
+  }
+  std::vector<Record> added(filter_hashes.size());
+  const hash_t *last = &prev;
+  for (size_t i = 0; i < added.size(); i++) {
+    added[i].block_hash = block_hashes[i];
+    added[i].header = filter_header(filter_hashes[i], *last);
+    last = &added[i].header;
+
+    const size_t height = start + i;
+    const size_t checkpoint = height / CFCHECKPT_INTERVAL;
+    if (height && height % CFCHECKPT_INTERVAL == 0 &&
+        checkpoint <= checkpoints.size() &&
+        checkpoints[checkpoint - 1] != added[i].header) {
+      log->warn("filter header at height {} does not match its checkpoint",
+                height);
+      return false;
+    }
+  }
+
+  const size_t len = added.size() * sizeof(Record);
+  const char *buf = reinterpret_cast<const char *>(added.data());
+  for (size_t done = 0; done < len;) {
+    const ssize_t n =
+        pwrite(fd_, buf + done, len - done, start * sizeof(Record) + done);
+    if (n <= 0) {
+      log->error("failed to write filter headers: {}", strerror(errno));
+      assert(false);
+    }
+    done += n;
+  }
+  records_.insert(records_.end(), added.begin(), added.end());
+  return true;
+}
+
+bool FilterHeaderChain::check_filter(size_t height,
+                                     const std::string &filter) const {
+  return filter_header(filter_hash(filter), prev_header(height)) ==
+         header(height);
+}
+
+void FilterHeaderChain::truncate(size_t height) {
+  if (height < records_.size()) {
+    records_.resize(height);
+  }
+  assert(ftruncate(fd_, records_.size() * sizeof(Record)) == 0);
+}
+}  // namespace spv
@@ -0,0 +1,81 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "./constants.h"
+
+namespace spv {
+// The BIP157 filter header chain along our best chain of block headers:
+// for each height the block hash and the filter header that commits to
+// that block's basic filter and, through the previous filter header, to
+// every filter before it. It is kept in memory and appended to a flat file
+// of 64-byte records next to the header database.
+class FilterHeaderChain {
+ public:
+  FilterHeaderChain() = delete;
+  FilterHeaderChain(const FilterHeaderChain &other) = delete;
+  explicit FilterHeaderChain(const std::string &path);
+  ~FilterHeaderChain();
+
+  // number of filter headers, i.e. the height of the next one
+  inline size_t size() const { return records_.size(); }
+
+  inline const hash_t &block_hash(size_t height) const {
+    assert(height < records_.size());
+    return records_[height].block_hash;
+  }
+
+  inline const hash_t &header(size_t height) const {
+    assert(height < records_.size());
+    return records_[height].header;
+  }
+
+  // the filter header before this height; all zeros before the genesis block
+  inline const hash_t &prev_header(size_t height) const {
+    return height == 0 ? empty_hash : header(height - 1);
+  }
+
+  // Extend the chain from size() with the filter hashes of these blocks, as
+  // listed by a cfheaders message. Nothing is added unless prev is the
+  // header at size() - 1 and every new header at a checkpoint height (see
+  // CFCHECKPT_INTERVAL) matches checkpoints, where there is one.
+  bool extend(const hash_t &prev, const std::vector<hash_t> &block_hashes,
+              const std::vector<hash_t> &filter_hashes,
+              const std::vector<hash_t> &checkpoints);
+
+  // does this encoded filter hash to the one committed to at this height?
+  bool check_filter(size_t height, const std::string &filter) const;
+
+  // drop every header at or above this height, e.g. after a reorg
+  void truncate(size_t height);
+
+ private:
+  struct Record {
+    hash_t block_hash;
+    hash_t header;
+  };
+
+  int fd_;
+  std::vector<Record> records_;
+};
+}  // namespace spv
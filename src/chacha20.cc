@@ -0,0 +1,465 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./chacha20.h"
+
+#include <endian.h>
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#endif
+
+#include "./logging.h"
+#include "./sha256.h"
+
+namespace spv {
+MODULE_LOGGER
+
+#define CHACHA_INLINE __attribute__((always_inline)) inline
+
+// macros, so that they work on the vectors below as well as on scalars
+#define ROTL32(x, b) (((x) << (b)) | ((x) >> (32 - (b))))
+
+#define QUARTERROUND(a, b, c, d) \
+  do {                           \
+    a += b;                      \
+    d ^= a;                      \
+    d = ROTL32(d, 16);           \
+    c += d;                      \
+    b ^= c;                      \
+    b = ROTL32(b, 12);           \
+    a += b;                      \
+    d ^= a;                      \
+    d = ROTL32(d, 8);            \
+    c += d;                      \
+    b ^= c;                      \
+    b = ROTL32(b, 7);            \
+  } while (0)
+
+static const uint32_t sigma[4] = {0x61707865, 0x3320646e, 0x79622d32,
+                                  0x6b206574};
+
+static CHACHA_INLINE uint32_t load_le32(const uint8_t *p) {
+  uint32_t x;
+  std::memcpy(&x, p, sizeof x);
+  return le32toh(x);
+}
+
+static CHACHA_INLINE void store_le32(uint8_t *p, uint32_t x) {
+  x = htole32(x);
+  std::memcpy(p, &x, sizeof x);
+}
+
+static CHACHA_INLINE uint64_t load_le64(const uint8_t *p) {
+  uint64_t x;
+  std::memcpy(&x, p, sizeof x);
+  return le64toh(x);
+}
+
+static CHACHA_INLINE void store_le64(uint8_t *p, uint64_t x) {
+  x = htole64(x);
+  std::memcpy(p, &x, sizeof x);
+}
+
+// keys are wiped when they're done with, in a way the compiler can't drop
+static void wipe(void *p, size_t size) {
+  std::memset(p, 0, size);
+  asm volatile("" : : "r"(p) : "memory");
+}
+
+template <typename V>
+static CHACHA_INLINE void double_rounds(V *x) {
+  for (int i = 0; i < 10; i++) {
+    QUARTERROUND(x[0], x[4], x[8], x[12]);
+    QUARTERROUND(x[1], x[5], x[9], x[13]);
+    QUARTERROUND(x[2], x[6], x[10], x[14]);
+    QUARTERROUND(x[3], x[7], x[11], x[15]);
+    QUARTERROUND(x[0], x[5], x[10], x[15]);
+    QUARTERROUND(x[1], x[6], x[11], x[12]);
+    QUARTERROUND(x[2], x[7], x[8], x[13]);
+    QUARTERROUND(x[3], x[4], x[9], x[14]);
+  }
+}
+
+static void block_scalar(const uint32_t *state, uint8_t *out) {
+  uint32_t x[16];
+  std::memcpy(x, state, sizeof x);
+  double_rounds(x);
+  for (size_t i = 0; i < 16; i++) {
+    store_le32(out + 4 * i, x[i] + state[i]);
+  }
+}
+
+// Each 32-bit lane of a vector holds the same word of a different block,
+// with consecutive counters, so the lanes need no shuffling between rounds.
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+
+template <typename V, size_t N>
+static CHACHA_INLINE void blocks_lanes(const uint32_t *state, uint8_t *out) {
+  V s[16], x[16];
+  for (size_t i = 0; i < 16; i++) {
+    s[i] = V{} + state[i];
+  }
+  for (size_t l = 0; l < N; l++) {
+    s[12][l] += l;
+  }
+  std::memcpy(x, s, sizeof x);
+  double_rounds(x);
+  for (size_t i = 0; i < 16; i++) {
+    x[i] += s[i];
+  }
+  for (size_t l = 0; l < N; l++) {
+    for (size_t i = 0; i < 16; i++) {
+      store_le32(out + ChaCha20::BLOCK_SIZE * l + 4 * i, x[i][l]);
+    }
+  }
+}
+
+// SSE2 on x86-64 and NEON on ARMv8 are always there
+static void blocks4(const uint32_t *state, uint8_t *out) {
+  blocks_lanes<v4u32, 4>(state, out);
+}
+
+#ifdef HAVE_X86
+typedef uint32_t v8u32 __attribute__((vector_size(32)));
+
+__attribute__((target("avx2"))) static void blocks8_avx2(
+    const uint32_t *state, uint8_t *out) {
+  blocks_lanes<v8u32, 8>(state, out);
+}
+#endif
+
+#undef QUARTERROUND
+#undef ROTL32
+
+typedef void (*blocks_fn)(const uint32_t *state, uint8_t *out);
+
+static const size_t max_lanes = 8;
+
+struct ChaChaBackend {
+  const char *name;
+  blocks_fn wide;  // max_lanes blocks at once, or nullptr
+};
+
+static const ChaChaBackend &get_chacha_backend() {
+  static const ChaChaBackend backend = [] {
+    ChaChaBackend b{"4-way", nullptr};
+#ifdef HAVE_X86
+    if (sha256::have_avx2()) {  // which checks the OS saves YMM state
+      b = {"avx2", blocks8_avx2};
+    }
+#endif
+    LOG_DEBUG(log, "using {} chacha20", b.name);
+    return b;
+  }();
+  return backend;
+}
+
+const char *chacha20_backend() { return get_chacha_backend().name; }
+
+ChaCha20::ChaCha20(const uint8_t *key) { set_key(key); }
+
+void ChaCha20::set_key(const uint8_t *key) {
+  std::memcpy(state_, sigma, sizeof sigma);
+  for (size_t i = 0; i < 8; i++) {
+    state_[4 + i] = load_le32(key + 4 * i);
+  }
+  seek(0, 0, 0);
+}
+
+void ChaCha20::seek(uint32_t nonce0, uint64_t nonce1, uint32_t counter) {
+  state_[12] = counter;
+  state_[13] = nonce0;
+  state_[14] = uint32_t(nonce1);
+  state_[15] = uint32_t(nonce1 >> 32);
+  left_ = 0;
+}
+
+void ChaCha20::crypt(const uint8_t *in, uint8_t *out, size_t size) {
+  const size_t n = std::min(size, left_);
+  const uint8_t *ks = buf_ + BLOCK_SIZE - left_;
+  for (size_t i = 0; i < n; i++) {
+    out[i] = in[i] ^ ks[i];
+  }
+  left_ -= n;
+  in += n;
+  out += n;
+  size -= n;
+
+  const blocks_fn wide = get_chacha_backend().wide;
+  uint8_t stream[max_lanes * BLOCK_SIZE];
+  while (size >= BLOCK_SIZE) {
+    size_t blocks = size / BLOCK_SIZE;
+    if (blocks >= max_lanes && wide != nullptr) {
+      wide(state_, stream);
+      blocks = max_lanes;
+    } else if (blocks >= 4) {
+      blocks4(state_, stream);
+      blocks = 4;
+    } else {
+      block_scalar(state_, stream);
+      blocks = 1;
+    }
+    state_[12] += blocks;
+    for (size_t i = 0; i < blocks * BLOCK_SIZE; i++) {
+      out[i] = in[i] ^ stream[i];
+    }
+    in += blocks * BLOCK_SIZE;
+    out += blocks * BLOCK_SIZE;
+    size -= blocks * BLOCK_SIZE;
+  }
+  if (size) {
+    block_scalar(state_, buf_);
+    state_[12]++;
+    for (size_t i = 0; i < size; i++) {
+      out[i] = in[i] ^ buf_[i];
+    }
+    left_ = BLOCK_SIZE - size;
+  }
+}
+
+void ChaCha20::keystream(uint8_t *out, size_t size) {
+  std::memset(out, 0, size);
+  crypt(out, out, size);
+}
+
+// Poly1305 in radix 2^44, after poly1305-donna: each block is three
+// 64x64-bit multiplies per limb and a carry chain.
+static const uint64_t mask44 = 0xfffffffffff;
+static const uint64_t mask42 = 0x3ffffffffff;
+
+Poly1305::Poly1305(const uint8_t *key) : have_(0) {
+  const uint64_t t0 = load_le64(key), t1 = load_le64(key + 8);
+  r_[0] = t0 & 0xffc0fffffff;
+  r_[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffff;
+  r_[2] = (t1 >> 24) & 0x00ffffffc0f;
+  h_[0] = h_[1] = h_[2] = 0;
+  pad_[0] = load_le64(key + 16);
+  pad_[1] = load_le64(key + 24);
+}
+
+void Poly1305::blocks(const uint8_t *data, size_t size, uint64_t hibit) {
+  typedef unsigned __int128 u128;
+  const uint64_t r0 = r_[0], r1 = r_[1], r2 = r_[2];
+  const uint64_t s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+  uint64_t h0 = h_[0], h1 = h_[1], h2 = h_[2];
+  for (; size >= 16; data += 16, size -= 16) {
+    const uint64_t t0 = load_le64(data), t1 = load_le64(data + 8);
+    h0 += t0 & mask44;
+    h1 += ((t0 >> 44) | (t1 << 20)) & mask44;
+    h2 += ((t1 >> 24) & mask42) | hibit;
+
+    u128 d0 = u128(h0) * r0 + u128(h1) * s2 + u128(h2) * s1;
+    u128 d1 = u128(h0) * r1 + u128(h1) * r0 + u128(h2) * s2;
+    u128 d2 = u128(h0) * r2 + u128(h1) * r1 + u128(h2) * r0;
+    uint64_t c = uint64_t(d0 >> 44);
+    h0 = uint64_t(d0) & mask44;
+    d1 += c;
+    c = uint64_t(d1 >> 44);
+    h1 = uint64_t(d1) & mask44;
+    d2 += c;
+    c = uint64_t(d2 >> 42);
+    h2 = uint64_t(d2) & mask42;
+    h0 += c * 5;
+    c = h0 >> 44;
+    h0 &= mask44;
+    h1 += c;
+  }
+  h_[0] = h0;
+  h_[1] = h1;
+  h_[2] = h2;
+}
+
+void Poly1305::update(const uint8_t *data, size_t size) {
+  if (have_) {
+    const size_t n = std::min(size, sizeof buf_ - have_);
+    std::memcpy(buf_ + have_, data, n);
+    have_ += n;
+    data += n;
+    size -= n;
+    if (have_ < sizeof buf_) {
+      return;
+    }
+    blocks(buf_, sizeof buf_, uint64_t(1) << 40);
+    have_ = 0;
+  }
+  const size_t whole = size & ~size_t(15);
+  blocks(data, whole, uint64_t(1) << 40);
+  std::memcpy(buf_, data + whole, size - whole);
+  have_ = size - whole;
+}
+
+void Poly1305::finish(uint8_t *tag) {
+  if (have_) {
+    buf_[have_] = 1;
+    std::memset(buf_ + have_ + 1, 0, sizeof buf_ - have_ - 1);
+    blocks(buf_, sizeof buf_, 0);
+  }
+  uint64_t h0 = h_[0], h1 = h_[1], h2 = h_[2], c;
+  c = h1 >> 44;
+  h1 &= mask44;
+  h2 += c;
+  c = h2 >> 42;
+  h2 &= mask42;
+  h0 += c * 5;
+  c = h0 >> 44;
+  h0 &= mask44;
+  h1 += c;
+  c = h1 >> 44;
+  h1 &= mask44;
+  h2 += c;
+  c = h2 >> 42;
+  h2 &= mask42;
+  h0 += c * 5;
+  c = h0 >> 44;
+  h0 &= mask44;
+  h1 += c;
+
+  // h - p, which is the result if it doesn't go negative
+  uint64_t g0 = h0 + 5;
+  c = g0 >> 44;
+  g0 &= mask44;
+  uint64_t g1 = h1 + c;
+  c = g1 >> 44;
+  g1 &= mask44;
+  uint64_t g2 = h2 + c - (uint64_t(1) << 42);
+  const uint64_t keep = (g2 >> 63) - 1;  // all ones if h >= p
+  h0 = (h0 & ~keep) | (g0 & keep);
+  h1 = (h1 & ~keep) | (g1 & keep);
+  h2 = (h2 & ~keep) | (g2 & keep);
+
+  // h + pad, mod 2^128
+  const uint64_t t0 = pad_[0], t1 = pad_[1];
+  h0 += t0 & mask44;
+  c = h0 >> 44;
+  h0 &= mask44;
+  h1 += (((t0 >> 44) | (t1 << 20)) & mask44) + c;
+  c = h1 >> 44;
+  h1 &= mask44;
+  h2 += ((t1 >> 24) & mask42) + c;
+  h2 &= mask42;
+  store_le64(tag, h0 | (h1 << 44));
+  store_le64(tag + 8, (h1 >> 20) | (h2 << 24));
+  wipe(r_, sizeof r_);
+  wipe(pad_, sizeof pad_);
+}
+
+// Poly1305 of the AAD and the ciphertext, each padded to 16 bytes, and then
+// their lengths.
+static void aead_tag(const uint8_t *poly_key, const uint8_t *aad,
+                     size_t aad_size, const uint8_t *ct, size_t size,
+                     uint8_t *tag) {
+  static const uint8_t zeros[16] = {};
+  Poly1305 poly(poly_key);
+  poly.update(aad, aad_size);
+  poly.update(zeros, (16 - aad_size % 16) % 16);
+  poly.update(ct, size);
+  poly.update(zeros, (16 - size % 16) % 16);
+  uint8_t sizes[16];
+  store_le64(sizes, aad_size);
+  store_le64(sizes + 8, size);
+  poly.update(sizes, sizeof sizes);
+  poly.finish(tag);
+}
+
+void aead_seal(const uint8_t *key, uint32_t nonce0, uint64_t nonce1,
+               const uint8_t *aad, size_t aad_size, const uint8_t *in,
+               size_t size, uint8_t *out) {
+  ChaCha20 chacha(key);
+  chacha.seek(nonce0, nonce1, 0);
+  uint8_t poly_key[ChaCha20::BLOCK_SIZE];  // all of block 0
+  chacha.keystream(poly_key, sizeof poly_key);
+  chacha.crypt(in, out, size);
+  aead_tag(poly_key, aad, aad_size, out, size, out + size);
+  wipe(poly_key, sizeof poly_key);
+}
+
+bool aead_open(const uint8_t *key, uint32_t nonce0, uint64_t nonce1,
+               const uint8_t *aad, size_t aad_size, const uint8_t *in,
+               size_t size, uint8_t *out) {
+  if (size < Poly1305::TAG_SIZE) {
+    return false;
+  }
+  size -= Poly1305::TAG_SIZE;
+  ChaCha20 chacha(key);
+  chacha.seek(nonce0, nonce1, 0);
+  uint8_t poly_key[ChaCha20::BLOCK_SIZE];
+  chacha.keystream(poly_key, sizeof poly_key);
+  uint8_t tag[Poly1305::TAG_SIZE];
+  aead_tag(poly_key, aad, aad_size, in, size, tag);
+  wipe(poly_key, sizeof poly_key);
+  uint8_t diff = 0;  // in constant time
+  for (size_t i = 0; i < sizeof tag; i++) {
+    diff |= tag[i] ^ in[size + i];
+  }
+  if (diff != 0) {
+    return false;
+  }
+  chacha.crypt(in, out, size);
+  return true;
+}
+
+FSChaCha20::FSChaCha20(const uint8_t *key)
+    : chacha_(key), chunks_(0), rekeys_(0) {}
+
+void FSChaCha20::crypt(const uint8_t *in, uint8_t *out, size_t size) {
+  chacha_.crypt(in, out, size);
+  if (++chunks_ == REKEY_INTERVAL) {
+    uint8_t key[ChaCha20::KEY_SIZE];
+    chacha_.keystream(key, sizeof key);
+    chacha_.set_key(key);
+    wipe(key, sizeof key);
+    chunks_ = 0;
+    chacha_.seek(0, ++rekeys_, 0);
+  }
+}
+
+FSChaCha20Poly1305::FSChaCha20Poly1305(const uint8_t *key)
+    : messages_(0), rekeys_(0) {
+  std::memcpy(key_, key, sizeof key_);
+}
+
+FSChaCha20Poly1305::~FSChaCha20Poly1305() { wipe(key_, sizeof key_); }
+
+void FSChaCha20Poly1305::seal(const uint8_t *aad, size_t aad_size,
+                              const uint8_t *in, size_t size, uint8_t *out) {
+  aead_seal(key_, messages_, rekeys_, aad, aad_size, in, size, out);
+  next();
+}
+
+bool FSChaCha20Poly1305::open(const uint8_t *aad, size_t aad_size,
+                              const uint8_t *in, size_t size, uint8_t *out) {
+  const bool ok =
+      aead_open(key_, messages_, rekeys_, aad, aad_size, in, size, out);
+  next();
+  return ok;
+}
+
+void FSChaCha20Poly1305::next() {
+  if (++messages_ < REKEY_INTERVAL) {
+    return;
+  }
+  // the new key is the keystream for a nonce no message uses
+  ChaCha20 chacha(key_);
+  chacha.seek(0xffffffff, rekeys_, 1);
+  chacha.keystream(key_, sizeof key_);
+  messages_ = 0;
+  rekeys_++;
+}
+}  // namespace spv
@@ -0,0 +1,140 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace spv {
+// ChaCha20 and Poly1305 as in RFC 8439, and the forward secure versions of
+// them that BIP324's v2 transport is built from. The ChaCha20 block
+// function is picked at startup like the SHA-256 one: eight blocks at once
+// with AVX2, four with SSE2 or NEON, and ChaCha20 one block at a time for
+// what's left.
+
+// name of the block function in use, e.g. "avx2"
+const char *chacha20_backend();
+
+// A ChaCha20 stream with a 96-bit nonce, given here as the little-endian
+// word and double word BIP324 makes it from, and a 32-bit block counter.
+class ChaCha20 {
+ public:
+  static const size_t KEY_SIZE = 32;
+  static const size_t BLOCK_SIZE = 64;
+
+  ChaCha20() = delete;
+  explicit ChaCha20(const uint8_t *key);
+
+  // use a new key, at the start of the stream for nonce 0
+  void set_key(const uint8_t *key);
+
+  // move to block counter of the stream for a nonce
+  void seek(uint32_t nonce0, uint64_t nonce1, uint32_t counter);
+
+  // out = in ^ the next size bytes of keystream; in may be out
+  void crypt(const uint8_t *in, uint8_t *out, size_t size);
+
+  // the next size bytes of keystream
+  void keystream(uint8_t *out, size_t size);
+
+ private:
+  uint32_t state_[16];
+
+  // keystream left over from the last block used
+  uint8_t buf_[BLOCK_SIZE];
+  size_t left_;
+};
+
+// A Poly1305 one-time authenticator.
+class Poly1305 {
+ public:
+  static const size_t KEY_SIZE = 32;
+  static const size_t TAG_SIZE = 16;
+
+  Poly1305() = delete;
+  explicit Poly1305(const uint8_t *key);
+
+  void update(const uint8_t *data, size_t size);
+
+  // write the tag; nothing can be added after this
+  void finish(uint8_t *tag);
+
+ private:
+  uint64_t r_[3];  // 44, 44 and 42 bit limbs, like h_
+  uint64_t h_[3];
+  uint64_t pad_[2];
+  uint8_t buf_[16];
+  size_t have_;
+
+  // add in 16-byte blocks, with hibit set for whole ones
+  void blocks(const uint8_t *data, size_t size, uint64_t hibit);
+};
+
+// The ChaCha20-Poly1305 AEAD. seal() writes size + TAG_SIZE bytes of
+// ciphertext and tag to out, and open() checks the tag of size bytes (the
+// tag included) before writing size - TAG_SIZE bytes of plaintext. Either
+// can work in place.
+void aead_seal(const uint8_t *key, uint32_t nonce0, uint64_t nonce1,
+               const uint8_t *aad, size_t aad_size, const uint8_t *in,
+               size_t size, uint8_t *out);
+bool aead_open(const uint8_t *key, uint32_t nonce0, uint64_t nonce1,
+               const uint8_t *aad, size_t aad_size, const uint8_t *in,
+               size_t size, uint8_t *out);
+
+// BIP324 rekeys its ciphers after this many messages.
+static const uint32_t REKEY_INTERVAL = 224;
+
+// ChaCha20 for a run of small chunks (the v2 transport's packet lengths),
+// one stream per REKEY_INTERVAL chunks, each keyed from the end of the one
+// before it.
+class FSChaCha20 {
+ public:
+  FSChaCha20() = delete;
+  explicit FSChaCha20(const uint8_t *key);
+
+  // crypt the next chunk
+  void crypt(const uint8_t *in, uint8_t *out, size_t size);
+
+ private:
+  ChaCha20 chacha_;
+  uint32_t chunks_;
+  uint64_t rekeys_;
+};
+
+// The AEAD with a nonce per message, counting messages, and a new key
+// every REKEY_INTERVAL messages.
+class FSChaCha20Poly1305 {
+ public:
+  FSChaCha20Poly1305() = delete;
+  explicit FSChaCha20Poly1305(const uint8_t *key);
+  ~FSChaCha20Poly1305();
+
+  // aead_seal() and aead_open() of the next message
+  void seal(const uint8_t *aad, size_t aad_size, const uint8_t *in,
+            size_t size, uint8_t *out);
+  bool open(const uint8_t *aad, size_t aad_size, const uint8_t *in,
+            size_t size, uint8_t *out);
+
+ private:
+  uint8_t key_[ChaCha20::KEY_SIZE];
+  uint32_t messages_;
+  uint64_t rekeys_;
+
+  void next();
+};
+}  // namespace spv
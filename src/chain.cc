@@ -16,12 +16,40 @@
 
 #include "./chain.h"
 
+#include <rocksdb/filter_policy.h>
+#include <rocksdb/listener.h>
+#include <rocksdb/rate_limiter.h>
+#include <rocksdb/table.h>
+
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
-#include <unordered_map>
+#include <thread>
 
+#include "./affinity.h"
+#include "./chain_writer.h"
+#include "./cpu_time.h"
 #include "./encoder.h"
+#include "./eventlog.h"
+#include "./lmdb_store.h"
 #include "./logging.h"
+#include "./loop_monitor.h"
+#include "./memory.h"
+#include "./pow.h"
+#include "./presync.h"
+#include "./profiler.h"
+#include "./proto.h"
+#include "./scheduler.h"
+#include "./trace.h"
+#include "./util.h"
 
 namespace spv {
 MODULE_LOGGER
@@ -31,66 +59,1087 @@ rocksdb::WriteOptions write_opts;
 
 static const std::string tip_key = "tip";
 
-// If this block is at a checkpointed height, verify that we have the expected
-// block hash.
-inline void check_checkpoint(const BlockHeader &hdr) {
-  static const size_t checkpoint_interval = 500000;
-  static const std::unordered_map<size_t, hash_t> checkpoints{
-      {500000,
-       {0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0xa7, 0xc0, 0xaa, 0xa2, 0x63,
-        0x0f, 0xbb, 0x2c, 0x0e, 0x47, 0x6a, 0xaf, 0xff, 0xc6, 0x0f, 0x82,
-        0x17, 0x73, 0x75, 0xb2, 0xaa, 0xa2, 0x22, 0x09, 0xf6, 0x06}},
-      {1000000,
-       {0x00, 0x00, 0x00, 0x00, 0x00, 0x47, 0x8e, 0x25, 0x9a, 0x3e, 0xda,
-        0x2f, 0xaf, 0xbe, 0xeb, 0x01, 0x06, 0x62, 0x6f, 0x94, 0x63, 0x47,
-        0x95, 0x5e, 0x99, 0x27, 0x8f, 0xe6, 0xcc, 0x84, 0x84, 0x14}},
-  };
-  if (hdr.height % checkpoint_interval == 0) {
-    auto it = checkpoints.find(hdr.height);
-    assert(it != checkpoints.end());
-    assert(hdr.block_hash == it->second);
+// How many parents verify_headers() looks up per MultiGet.
+static const size_t verify_batch_size = 256;
+
+// prefix of the keys for get_state() and put_state()
+static const std::string state_prefix = "state/";
+
+// Version 1 switched height_view_ from decimal to big-endian height keys.
+// Version 2 moved hdr_view_ and height_view_ into their own column families.
+// Version 3 stores best chain headers without prev_block.
+static const std::string version_key = "version";
+static const std::string db_version = "3";
+
+static const std::string headers_family = "headers";
+static const std::string heights_family = "heights";
+
+// How many keys migrate_column_families() moves per write.
+static const int migrate_batch_size = 50000;
+
+// How many encoded getheaders replies to keep.
+static const size_t reply_cache_size = 16;
+
+// The selected network's checkpoints, unless load_checkpoints() replaced
+// them. All of the maps are built at once, so that chains on different
+// threads don't race to build their own.
+static std::map<size_t, hash_t> &checkpoint_map() {
+  static std::array<std::map<size_t, hash_t>, NETWORK_COUNT> maps = []() {
+    std::array<std::map<size_t, hash_t>, NETWORK_COUNT> out;
+    for (size_t n = 0; n < NETWORK_COUNT; n++) {
+      const NetworkParams &net = network_params(Network(n));
+      for (size_t i = 0; i < net.checkpoint_count; i++) {
+        out[n].emplace(net.checkpoints[i].height, net.checkpoints[i].hash);
+      }
+    }
+    return out;
+  }();
+  return maps[size_t(network().id)];
+}
+
+const std::map<size_t, hash_t> &checkpoints() { return checkpoint_map(); }
+
+static bool parse_hash(const std::string &hex, hash_t &hash) {
+  return hex.size() == 2 * sizeof(hash_t) &&
+         hex_decode(hex.data(), sizeof(hash_t), hash.data());
+}
+
+bool load_checkpoints(const std::string &path) {
+  std::ifstream in(path);
+  if (!in) {
+    log->error("failed to open checkpoints file {}", path);
+    return false;
+  }
+  std::map<size_t, hash_t> loaded;
+  std::string line;
+  for (size_t lineno = 1; std::getline(in, line); lineno++) {
+    std::istringstream fields(line);
+    std::string height, hex, extra;
+    if (!(fields >> height) || height[0] == '#') {
+      continue;
+    }
+    hash_t hash;
+    if (height.size() > 18 ||
+        height.find_first_not_of("0123456789") != std::string::npos ||
+        !(fields >> hex) || !parse_hash(hex, hash) || (fields >> extra)) {
+      log->error("bad checkpoint on line {} of {}", lineno, path);
+      return false;
+    }
+    loaded[std::stoull(height)] = hash;
+  }
+  log->info("loaded {} checkpoint(s) from {}", loaded.size(), path);
+  checkpoint_map().swap(loaded);
+  return true;
+}
+
+// Does this block have the checkpointed hash, if its height has one?
+PROFILE_BOUNDARY static bool check_checkpoint(const BlockHeader &hdr) {
+  const std::map<size_t, hash_t> &cps = checkpoints();
+  if (cps.empty() || hdr.height > cps.rbegin()->first) {
+    return true;  // past the last one, like nearly every header synced
+  }
+  auto it = cps.find(hdr.height);
+  return it == cps.end() || hdr.block_hash == it->second;
+}
+
+static const std::string store_file = "/headers.dat";
+static const std::string lmdb_file = "/headers.mdb";
+static const std::string image_file = "/index.dat";
+
+// index.dat is this, then the index's entries as they are in memory, so an
+// image is only good for the build and platform that wrote it; the entry
+// size and checksum catch the rest
+struct IndexImageHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size;  // sizeof(IndexEntry)
+  uint32_t network;     // network().magic
+  uint32_t height;      // of the tip it was written at
+  uint64_t entries;
+  hash_t tip;
+  uint64_t checksum;  // HeaderIndex::checksum()
+};
+
+static const char image_magic[8] = {'S', 'P', 'V', 'I', 'N', 'D', 'E', 'X'};
+static const uint32_t image_version = 1;
+
+// the best chain's store for this backend, or nullptr to keep it in RocksDB
+static std::unique_ptr<BestChainStore> open_store(const std::string &datadir,
+                                                  HeaderBackend backend) {
+  switch (backend) {
+    case HeaderBackend::ROCKSDB:
+      break;
+    case HeaderBackend::MMAP:
+      return std::unique_ptr<BestChainStore>(
+          new HeaderStore(datadir + store_file));
+    case HeaderBackend::LMDB:
+      return std::unique_ptr<BestChainStore>(
+          new LmdbStore(datadir + lmdb_file));
   }
+  return nullptr;
 }
 
-Chain::Chain(const std::string &datadir)
-    : hdr_view_('h'), orphan_view_('o'), height_view_('y') {
+// One block cache for every chain open in the process, e.g. with several
+// networks at once, sized by the first of them to be opened.
+static std::shared_ptr<rocksdb::Cache> shared_block_cache(size_t size) {
+  static std::mutex mutex;
+  static std::weak_ptr<rocksdb::Cache> shared;
+  std::lock_guard<std::mutex> lock(mutex);
+  std::shared_ptr<rocksdb::Cache> cache = shared.lock();
+  if (!cache) {
+    cache = rocksdb::NewLRUCache(size);
+    shared = cache;
+  }
+  return cache;
+}
+
+// The column families, in the order of Chain::families_. Both data families
+// share the block cache. Headers are keyed by hash, so random lookups get a
+// bloom filter. Heights are written and scanned in order, and their values
+// are hashes that don't compress, so they get big uncompressed blocks.
+static std::vector<rocksdb::ColumnFamilyDescriptor> column_families(
+    const rocksdb::Options &dbopts, size_t block_cache_size) {
+  const auto cache = shared_block_cache(block_cache_size);
+
+  rocksdb::BlockBasedTableOptions hdr_table;
+  hdr_table.block_cache = cache;
+  hdr_table.filter_policy.reset(rocksdb::NewBloomFilterPolicy(10, false));
+  rocksdb::ColumnFamilyOptions hdr_opts;
+  hdr_opts.table_factory.reset(rocksdb::NewBlockBasedTableFactory(hdr_table));
+
+  rocksdb::BlockBasedTableOptions height_table;
+  height_table.block_cache = cache;
+  height_table.block_size = 64 << 10;
+  rocksdb::ColumnFamilyOptions height_opts;
+  height_opts.compression = rocksdb::kNoCompression;
+  height_opts.table_factory.reset(
+      rocksdb::NewBlockBasedTableFactory(height_table));
+
+  return {{rocksdb::kDefaultColumnFamilyName, dbopts},
+          {headers_family, hdr_opts},
+          {heights_family, height_opts}};
+}
+
+// Passes RocksDB's write stalls on to Chain::stall_changed().
+class StallListener : public rocksdb::EventListener {
+ public:
+  explicit StallListener(Chain *chain) : chain_(chain) {}
+
+  void OnStallConditionsChanged(const rocksdb::WriteStallInfo &info) override {
+    using rocksdb::WriteStallCondition;
+    chain_->stall_changed(info.cf_name,
+                          info.condition.prev != WriteStallCondition::kNormal,
+                          info.condition.cur != WriteStallCondition::kNormal);
+  }
+
+ private:
+  Chain *chain_;
+};
+
+Chain::Chain(const std::string &datadir, HeaderBackend backend,
+             size_t block_cache_size, size_t header_cache_size,
+             size_t background_jobs, size_t write_rate)
+    : loaded_(false),
+      image_path_(datadir + image_file),
+      image_entries_(0),
+      replies_(reply_cache_size),
+      cache_(HeaderCache::capacity_for(header_cache_size)),
+      assume_valid_(0),
+      window_tip_(empty_hash),
+      durability_(Durability::ASYNC),
+      sync_interval_(0),
+      bulk_load_(false),
+      stalled_families_(0),
+      hdr_view_('h'),
+      height_view_('y') {
   rocksdb::Options dbopts;
   dbopts.OptimizeForSmallDb();
-  auto status = rocksdb::DB::Open(dbopts, datadir, &db_);
+  dbopts.create_missing_column_families = true;  // for version 1 and older
+  dbopts.max_background_jobs = std::max<size_t>(background_jobs, 1);
+  if (write_rate) {
+    // flushes and compactions, so they don't starve reads of the disk
+    dbopts.rate_limiter.reset(rocksdb::NewGenericRateLimiter(write_rate));
+  }
+  dbopts.listeners.push_back(std::make_shared<StallListener>(this));
+  block_cache_ = shared_block_cache(block_cache_size);
+  const auto families = column_families(dbopts, block_cache_size);
+  auto status = rocksdb::DB::Open(dbopts, datadir, families, &families_, &db_);
   if (status.ok()) {
     initialize_views();
-    tip_ = find_tip();
+    migrate();
+    drop_persisted_orphans();
+    store_ = open_store(datadir, backend);
+    tip_ = read_tip();
+    if (tip_.is_empty()) {
+      wait_index();  // finds the tip, adding the genesis block if need be
+    }
     log->info("initialized chain with tip {}", tip_);
     return;
   }
 
   dbopts.create_if_missing = true;
   dbopts.error_if_exists = true;
-  status = rocksdb::DB::Open(dbopts, datadir, &db_);
+  status = rocksdb::DB::Open(dbopts, datadir, families, &families_, &db_);
   assert(status.ok());
   initialize_views();
+  status = db_->Put(write_opts, version_key, db_version);
+  assert(status.ok());
+  loaded_ = true;  // there's nothing to load
+  store_ = open_store(datadir, backend);
+  if (store_) {
+    store_->truncate(0);  // left over from an old data directory
+  }
   add_genesis_block();
 }
 
+Chain::~Chain() { close(); }
+
+void Chain::close() {
+  if (db_ == nullptr) {
+    return;
+  }
+  assert(!batch_);
+  if (loader_.joinable()) {
+    loader_.join();
+  }
+  set_writer(false);
+  const auto start = std::chrono::steady_clock::now();
+  mmr_.reset();  // syncs it
+  work_mmr_.reset();
+  if (durability_ == Durability::NO_WAL || bulk_load_) {
+    // nothing else will bring back what's still in the memtables
+    save_tip(true);
+    for (auto *cf : families_) {
+      assert(db_->Flush(rocksdb::FlushOptions(), cf).ok());
+    }
+  } else {
+    // the log is written in order, so syncing the tip syncs everything
+    // before it
+    rocksdb::WriteOptions opts = write_opts;
+    opts.sync = true;
+    auto s = db_->Put(opts, tip_key, encode_hash(tip_.block_hash));
+    assert(s.ok());
+  }
+  if (store_) {
+    store_->sync(true);
+  }
+  write_index_image();
+  set_stall_callback(nullptr);
+  for (auto *cf : families_) {
+    delete cf;
+  }
+  families_.clear();
+  delete db_;
+  db_ = nullptr;
+  log->info("closed chain at {} in {} ms", tip_,
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count());
+  log->info("header cache had {} hits and {} misses", cache_.hits(),
+            cache_.misses());
+}
+
+void Chain::set_durability(Durability durability,
+                           std::chrono::milliseconds sync_interval) {
+  durability_ = durability;
+  sync_interval_ = sync_interval;
+  last_sync_ = std::chrono::steady_clock::now();
+  write_opts.sync = durability == Durability::SYNC && !bulk_load_;
+  write_opts.disableWAL = durability == Durability::NO_WAL || bulk_load_;
+}
+
+void Chain::set_writer(bool on) {
+  assert(!batch_);
+  if (on == (writer_ != nullptr)) {
+    return;
+  }
+  if (on) {
+    writer_.reset(new ChainWriter(db_, shared_tip_));
+    return;
+  }
+  writer_.reset();  // writes out what it has
+  overlay_.reset();
+  set_overlay();
+  if (loaded_) {
+    shared_tip_.store(tip_, chainwork());
+  }
+}
+
+const rocksdb::Snapshot *Chain::snapshot() const {
+  if (writer_) {
+    writer_->flush();
+  }
+  return db_->GetSnapshot();
+}
+
+void Chain::set_stall_callback(std::function<void(bool)> stalled) {
+  std::lock_guard<std::mutex> lock(stall_mutex_);
+  stall_callback_ = std::move(stalled);
+}
+
+void Chain::stall_changed(const std::string &family, bool was, bool is) {
+  if (was == is) {
+    return;  // e.g. from slowed to stopped
+  }
+  if (is) {
+    log->warn("writes to {} are stalled until compactions catch up", family);
+    metrics().db_write_stalls.add();
+  } else {
+    log->info("writes to {} are no longer stalled", family);
+  }
+  const int before = stalled_families_.fetch_add(is ? 1 : -1);
+  const bool stalled = before + (is ? 1 : -1) > 0;
+  metrics().db_write_stalled.set(stalled);
+  if (stalled != (before > 0)) {
+    std::lock_guard<std::mutex> lock(stall_mutex_);
+    if (stall_callback_) {
+      stall_callback_(stalled);
+    }
+  }
+}
+
+void Chain::resize_header_cache(size_t bytes) {
+  cache_.resize(HeaderCache::capacity_for(bytes));
+}
+
+void Chain::resize_block_cache(size_t bytes) {
+  block_cache_->SetCapacity(bytes);
+}
+
+size_t Chain::block_cache_size() const { return block_cache_->GetCapacity(); }
+
+bool Chain::set_db_option(const std::string &name, const std::string &value,
+                          std::string &error) {
+  const std::unordered_map<std::string, std::string> opts{{name, value}};
+  rocksdb::Status s;
+  for (size_t i = 0; i < families_.size(); i++) {
+    if (bulk_load_ && bulk_saved_[i].count(name)) {
+      bulk_saved_[i][name] = value;
+      continue;
+    }
+    s = db_->SetOptions(families_[i], opts);
+    if (!s.ok()) {
+      break;
+    }
+  }
+  if (!s.ok()) {
+    // not a column family option, so maybe a database one
+    const rocksdb::Status db_status = db_->SetDBOptions(opts);
+    if (!db_status.ok()) {
+      error = s.ToString();
+      return false;
+    }
+  }
+  log->info("set rocksdb option {} to {}", name, value);
+  return true;
+}
+
+void Chain::set_bulk_load(bool bulk) {
+  if (bulk == bulk_load_) {
+    return;
+  }
+  assert(!batch_);
+  bulk_load_ = bulk;
+  if (bulk) {
+    // Without compactions level 0 only grows, so it mustn't stall writes.
+    const std::unordered_map<std::string, std::string> opts{
+        {"disable_auto_compactions", "true"},
+        {"level0_slowdown_writes_trigger", "1000000"},
+        {"level0_stop_writes_trigger", "1000000"}};
+    bulk_saved_.clear();
+    for (auto *cf : families_) {
+      const auto old = db_->GetOptions(cf);
+      bulk_saved_.push_back(
+          {{"disable_auto_compactions",
+            old.disable_auto_compactions ? "true" : "false"},
+           {"level0_slowdown_writes_trigger",
+            std::to_string(old.level0_slowdown_writes_trigger)},
+           {"level0_stop_writes_trigger",
+            std::to_string(old.level0_stop_writes_trigger)}});
+      assert(db_->SetOptions(cf, opts).ok());
+    }
+    write_opts.sync = false;
+    write_opts.disableWAL = true;
+    log->info("tip {} is behind, bulk loading headers", tip_);
+    return;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  assert(bulk_saved_.size() == families_.size());
+  for (size_t i = 0; i < families_.size(); i++) {
+    // the flush makes what skipped the WAL durable before it's turned on
+    assert(db_->Flush(rocksdb::FlushOptions(), families_[i]).ok());
+    assert(db_->CompactRange(rocksdb::CompactRangeOptions(), families_[i],
+                             nullptr, nullptr)
+               .ok());
+    assert(db_->SetOptions(families_[i], bulk_saved_[i]).ok());
+  }
+  bulk_saved_.clear();
+  set_durability(durability_, sync_interval_);
+  log->info("done bulk loading at {}, compacted in {} ms", tip_,
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count());
+}
+
+void Chain::migrate() {
+  std::string version;
+  auto s = db_->Get(read_opts, version_key, &version);
+  if (!s.ok()) {
+    // Databases without a version key have decimal height keys, e.g. "y123".
+    migrate_height_keys();
+    version = "1";
+  }
+  if (version == "1") {
+    migrate_column_families();
+    version = "2";
+  }
+  if (version == "2") {
+    migrate_compact_headers();
+    version = "3";
+  }
+  assert(version == db_version);
+}
+
+void Chain::migrate_height_keys() {
+  log->warn("migrating height keys in database to version 1");
+  const TableView heights(db_, 'y');  // still in the default family
+  rocksdb::WriteBatch batch;
+  size_t count = 0;
+  heights.for_each([&](const std::string &key, const std::string &val) {
+    const size_t height = std::stoull(key.substr(1));
+    assert(batch.Delete(key).ok());
+    assert(batch.Put(heights.encode_key(height), val).ok());
+    count++;
+  });
+  assert(batch.Put(version_key, "1").ok());
+  auto s = db_->Write(write_opts, &batch);
+  assert(s.ok());
+  log->info("migrated {} height keys", count);
+}
+
+void Chain::migrate_column_families() {
+  // The keys keep their prefixes, so a crash part way through just leaves
+  // some keys to move on the next start.
+  log->warn("migrating database to version 2, this may take a while");
+  size_t count = 0;
+  rocksdb::WriteBatch batch;
+  auto move = [&](const TableView &from, rocksdb::ColumnFamilyHandle *cf) {
+    from.for_each([&](const std::string &key, const std::string &val) {
+      assert(batch.Put(cf, key, val).ok());
+      assert(batch.Delete(key).ok());
+      if (batch.Count() >= 2 * migrate_batch_size) {
+        assert(db_->Write(write_opts, &batch).ok());
+        batch.Clear();
+      }
+      count++;
+    });
+  };
+  move(TableView(db_, hdr_view_.prefix_), families_[1]);
+  move(TableView(db_, height_view_.prefix_), families_[2]);
+  assert(batch.Put(version_key, "2").ok());
+  auto s = db_->Write(write_opts, &batch);
+  assert(s.ok());
+  log->info("moved {} keys into column families", count);
+}
+
+void Chain::migrate_compact_headers() {
+  // Records are only compacted where height_view_ has the parent a height
+  // below, so a crash part way through leaves a valid mix.
+  log->warn("migrating database to version 3, this may take a while");
+  size_t count = 0;
+  rocksdb::WriteBatch batch;
+  size_t prev_height = 0;
+  hash_t prev = empty_hash;
+  height_view_.for_each_height(
+      0, std::numeric_limits<size_t>::max(),
+      [&](size_t height, const hash_t &hash) {
+        bool found;
+        const std::string val = hdr_view_.find(hash, found);
+        if (found && height > 0 && height == prev_height + 1 &&
+            val.size() == HEADER_RECORD_SIZE) {
+          BlockHeader hdr;
+          hdr.db_decode(val);
+          if (hdr.height == height && hdr.prev_block == prev) {
+            assert(batch
+                       .Put(hdr_view_.cf(), hdr_view_.encode_key(hash).slice(),
+                            encode_header_record(val.data(), height, true))
+                       .ok());
+            count++;
+          }
+          if (batch.Count() >= migrate_batch_size) {
+            assert(db_->Write(write_opts, &batch).ok());
+            batch.Clear();
+          }
+        }
+        prev_height = height;
+        prev = hash;
+      });
+  assert(batch.Put(version_key, "3").ok());
+  auto s = db_->Write(write_opts, &batch);
+  assert(s.ok());
+  log->info("compacted {} header records", count);
+}
+
+void Chain::drop_persisted_orphans() {
+  const TableView orphan_view(db_, 'o');
+  rocksdb::WriteBatch batch;
+  size_t count = 0;
+  orphan_view.for_each([&](const std::string &key, const std::string &) {
+    assert(batch.Delete(key).ok());
+    count++;
+  });
+  if (count) {
+    auto s = db_->Write(write_opts, &batch);
+    assert(s.ok());
+    log->info("deleted {} persisted orphan(s)", count);
+  }
+}
+
 void Chain::add_genesis_block() {
   // TODO: use a transaction
   tip_ = BlockHeader::genesis();
-  assert(hdr_view_.put(tip_.block_hash, tip_.db_encode()));
-  assert(height_view_.put(0, tip_.block_hash));
+  add_header(tip_);
+  sync_best();
+  if (!store_) {
+    assert(height_view_.put(tip_.height, tip_.block_hash));
+  }
   save_tip();
 }
 
-BlockHeader Chain::find(const hash_t &hash) const {
-  bool found = false;
-  const std::string data = hdr_view_.find(hash, found);
-  assert(found);
+void Chain::load_index() {
+  if (read_index_image()) {
+    return;
+  }
+  index_.clear();  // whatever a bad image left
+  if (store_) {
+    index_.reserve(store_->size());
+    for (size_t h = 0; h < store_->size(); h++) {
+      const BlockHeader hdr = store_->header(h);
+      if (h ? hdr.prev_block != index_.at(h - 1).hash : !hdr.is_genesis()) {
+        // e.g. a torn write from a crash; the rest will be downloaded again
+        log->warn("truncating header store at height {}", h);
+        store_->truncate(h);
+        break;
+      }
+      index_.insert(hdr);
+    }
+  }
+
+  std::vector<BlockHeader> hdrs;
+  bool compact = false;
+  hdr_view_.for_each([&](const std::string &key, const std::string &val) {
+    // The key already has the hash, so there's no need to recompute it.
+    BlockHeader hdr;
+    hdr.db_decode(val);
+    hdr.block_hash = hdr_view_.decode_key(key);
+    hdrs.push_back(hdr);
+    compact = compact || is_compact_record(val);
+  });
+
+  // compact records get prev_block from the best chain a height below
+  if (compact) {
+    std::vector<hash_t> best;
+    height_view_.for_each_height(
+        0, std::numeric_limits<size_t>::max(),
+        [&](size_t height, const hash_t &hash) {
+          if (height >= best.size()) {
+            best.resize(height + 1, empty_hash);
+          }
+          best[height] = hash;
+        });
+    size_t dropped = 0;
+    for (auto &hdr : hdrs) {
+      if (hdr.prev_block != empty_hash || hdr.is_genesis()) {
+        continue;
+      }
+      if (hdr.height > 0 && hdr.height < best.size() &&
+          best[hdr.height] == hdr.block_hash) {
+        hdr.prev_block = best[hdr.height - 1];
+      } else {
+        hdr.height = 0;  // dropped below
+        dropped++;
+      }
+    }
+    if (dropped) {
+      // e.g. torn writes; they'll be downloaded again
+      log->warn("dropping {} compact header(s) off the best chain", dropped);
+      hdrs.erase(std::remove_if(hdrs.begin(), hdrs.end(),
+                                [](const BlockHeader &hdr) {
+                                  return hdr.is_orphan();
+                                }),
+                 hdrs.end());
+    }
+  }
+
+  // parents have to be inserted before their children
+  std::sort(hdrs.begin(), hdrs.end(),
+            [](const BlockHeader &a, const BlockHeader &b) {
+              return a.height < b.height;
+            });
+  index_.reserve(index_.size() + hdrs.size());
+  for (const auto &hdr : hdrs) {
+    index_.insert(hdr);
+  }
+  log->info("loaded {} headers into the header index", index_.size());
+  if (store_ && store_->size() == 0 && index_.size() > 0) {
+    fill_store();
+  }
+}
+
+bool Chain::read_index_image() {
+  std::FILE *file = std::fopen(image_path_.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  IndexImageHeader image;
+  bool ok = std::fread(&image, sizeof image, 1, file) == 1 &&
+            std::memcmp(image.magic, image_magic, sizeof image_magic) == 0 &&
+            image.version == image_version &&
+            image.entry_size == sizeof(IndexEntry) &&
+            image.network == network().magic && image.entries > 0 &&
+            index_.read_image(file, image.entries) &&
+            index_.checksum() == image.checksum;
+  std::fclose(file);
+  const IndexEntry *tip = ok ? index_.find(image.tip) : nullptr;
+  if (tip == nullptr || tip->height != image.height) {
+    log->warn("ignoring bad header index image {}", image_path_);
+    return false;
+  }
+
+  // The image's tip has to still be on the best chain, and everything past
+  // it on the best chain is replayed in order, each header linking to the
+  // one before.
+  size_t replayed = 0;
+  hash_t prev = image.tip;
+  if (store_) {
+    ok = store_->size() > image.height &&
+         store_->header(image.height).block_hash == image.tip;
+    for (size_t h = image.height + 1; ok && h < store_->size(); h++) {
+      const BlockHeader hdr = store_->header(h);
+      if (hdr.prev_block != prev) {
+        // as in the full load
+        log->warn("truncating header store at height {}", h);
+        store_->truncate(h);
+        break;
+      }
+      index_.insert(hdr);
+      prev = hdr.block_hash;
+      replayed++;
+    }
+  } else {
+    bool found;
+    ok = height_view_.find_hash(image.height, found) == image.tip && found;
+    size_t next = image.height + 1;
+    height_view_.for_each_height(
+        next, read_tip().height + 1, [&](size_t height, const hash_t &hash) {
+          bool found = false;
+          const std::string raw =
+              ok && height == next ? hdr_view_.find(hash, found) : "";
+          BlockHeader hdr;
+          if (found) {
+            hdr.db_decode(raw);
+            hdr.block_hash = hash;
+            if (is_compact_record(raw)) {
+              hdr.prev_block = prev;
+            }
+          }
+          ok = found && hdr.prev_block == prev && hdr.height == height;
+          if (ok) {
+            index_.insert(hdr);
+            prev = hash;
+            next++;
+            replayed++;
+          }
+        });
+  }
+  if (!ok) {
+    log->info("header index image is off the best chain, loading it all");
+    return false;
+  }
+  image_entries_ = image.entries;
+  log->info("loaded {} headers from the index image and {} past it",
+            image.entries, replayed);
+  return true;
+}
+
+void Chain::write_index_image(size_t min_new) {
+  if (!loaded_ || index_.size() < image_entries_ + min_new) {
+    return;
+  }
+  assert(!batch_);
+  if (writer_) {
+    writer_->flush();
+  }
+  const auto start = std::chrono::steady_clock::now();
+
+  // Everything in the image has to survive a crash, or the next start
+  // would have headers the database lost.
+  if (durability_ == Durability::NO_WAL || bulk_load_) {
+    for (auto *cf : families_) {
+      assert(db_->Flush(rocksdb::FlushOptions(), cf).ok());
+    }
+  } else {
+    assert(db_->FlushWAL(true).ok());
+  }
+  if (store_) {
+    store_->sync(true);
+  }
+
+  IndexImageHeader image;
+  std::memset(&image, 0, sizeof image);
+  std::memcpy(image.magic, image_magic, sizeof image_magic);
+  image.version = image_version;
+  image.entry_size = sizeof(IndexEntry);
+  image.network = network().magic;
+  image.height = tip_.height;
+  image.entries = index_.size();
+  image.tip = tip_.block_hash;
+  image.checksum = index_.checksum();
+
+  // a new file renamed over the old one, as in AddrManager::save()
+  const std::string tmp = image_path_ + ".tmp";
+  std::FILE *file = std::fopen(tmp.c_str(), "wb");
+  bool ok = file != nullptr &&
+            std::fwrite(&image, sizeof image, 1, file) == 1 &&
+            index_.write_image(file);
+  if (file != nullptr) {
+    ok = std::fclose(file) == 0 && ok;
+  }
+  if (!ok || std::rename(tmp.c_str(), image_path_.c_str()) != 0) {
+    log->warn("failed to write header index image {}", image_path_);
+    std::remove(tmp.c_str());
+    return;
+  }
+  image_entries_ = index_.size();
+  log->info("wrote {} headers to the index image in {} ms", image_entries_,
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count());
+}
+
+void Chain::load_index_async(std::function<void()> done) {
+  assert(!loader_.joinable());
+  if (loaded_) {
+    done();
+    return;
+  }
+  loader_ = std::thread([this, done]() {
+    place_thread(ThreadGroup::CHAIN);
+    HeapScope scope(HeapTag::CHAIN);
+    const auto start = std::chrono::steady_clock::now();
+    load_index();
+    log->info("loaded the header index in {} ms",
+              std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::steady_clock::now() - start)
+                  .count());
+    done();
+  });
+}
+
+void Chain::wait_index() const {
+  if (loaded_) {
+    return;
+  }
+  // Loading adds nothing the chain doesn't already have on disk, so like
+  // the caches it's done from const methods.
+  Chain *self = const_cast<Chain *>(this);
+  if (loader_.joinable()) {
+    self->loader_.join();
+  } else {
+    self->load_index();
+  }
+  self->loaded_ = true;
 
+  // e.g. the tip read at startup was torn off the header store
+  const BlockHeader tip = self->find_tip();
+  if (tip.block_hash != tip_.block_hash) {
+    if (!tip_.is_empty()) {
+      log->warn("tip {} isn't in the header index, using {}", tip_, tip);
+    }
+    self->tip_ = tip;
+  }
+  self->sync_best();
+}
+
+BlockHeader Chain::read_tip() const {
+  if (store_) {
+    return store_->size() ? store_->header(store_->size() - 1)
+                          : BlockHeader();
+  }
+  std::string val;
+  if (!db_->Get(read_opts, tip_key, &val).ok()) {
+    return BlockHeader();
+  }
   BlockHeader hdr;
-  hdr.db_decode(data);
+  bool found;
+  const hash_t hash = decode_hash(val);
+  const std::string raw = hdr_view_.find(hash, found);
+  if (found) {
+    hdr.db_decode(raw);
+    hdr.block_hash = hash;
+    if (is_compact_record(raw)) {
+      hdr.prev_block = height_view_.find_hash(hdr.height - 1, found);
+    }
+  }
   return hdr;
 }
 
+void Chain::fill_store() {
+  log->info("copying best chain into the header store");
+  height_view_.for_each_height(
+      0, std::numeric_limits<size_t>::max(),
+      [&](size_t height, const hash_t &hash) {
+        const IndexEntry *entry = index_.find(hash);
+        assert(entry != nullptr);
+        const BlockHeader hdr = entry->header();
+        if (store_->extends(hdr)) {
+          store_->append(hdr, entry->data.data());
+        }
+      });
+  store_->sync();
+  log->info("copied {} headers into the header store", store_->size());
+}
+
+PROFILE_BOUNDARY void Chain::add_header(const BlockHeader &hdr) {
+  assert(hdr.height || hdr.is_genesis());
+  // N.B. height_view_ is only updated for the best chain, by update_tip()
+  const IndexEntry &entry = index_.insert(hdr);
+  if (store_ && store_->extends(hdr)) {
+    store_->append(hdr, entry.data.data());
+  } else {
+    // a header that extends the tip is the new tip, see update_tip()
+    const bool compact =
+        !store_ && hdr.height > 0 && hdr.prev_block == tip_.block_hash;
+    assert(hdr_view_.put(hdr.block_hash, entry.db_encode(compact)));
+  }
+}
+
+hash_t Chain::find_hash(size_t height, bool &found) const {
+  found = height <= tip_.height;
+  if (!found) {
+    return empty_hash;
+  }
+  const BlockHeader *cached = cache_.find(height);
+  if (cached != nullptr) {
+    return cached->block_hash;
+  }
+  wait_index();
+  const IndexEntry &entry = index_.at(best_.slot(height));
+  cache_.put(entry.header(), true);
+  return entry.hash;
+}
+
+const IndexEntry *Chain::best_entry(size_t height) const {
+  wait_index();
+  if (height >= best_.size()) {
+    return nullptr;
+  }
+  return &index_.at(best_.slot(height));
+}
+
+size_t Chain::height_at_time(uint32_t time) const {
+  wait_index();
+  return best_.first_at_time(time);
+}
+
+bool Chain::on_best_chain(const IndexEntry &entry) const {
+  const IndexEntry *best = best_entry(entry.height);
+  return best != nullptr && best->hash == entry.hash;
+}
+
+bool Chain::presync_anchor(const hash_t &hash, PresyncAnchor &anchor) const {
+  wait_index();
+  const IndexEntry *entry = index_.find(hash);
+  if (entry == nullptr) {
+    return false;
+  }
+  const IndexEntry &first = index_.at(entry->epoch);
+  anchor.hash = entry->hash;
+  anchor.height = entry->height;
+  anchor.bits = entry->difficulty();
+  anchor.timestamp = entry->timestamp();
+  anchor.first_bits = first.difficulty();
+  anchor.first_time = first.timestamp();
+  anchor.chainwork = entry->chainwork;
+  anchor.times.clear();
+  for (;;) {
+    anchor.times.push_back(entry->timestamp());
+    if (anchor.times.size() == MedianTime::SPAN ||
+        entry->parent == HeaderIndex::no_slot) {
+      break;
+    }
+    entry = &index_.at(entry->parent);
+  }
+  std::reverse(anchor.times.begin(), anchor.times.end());
+  return true;
+}
+
+size_t Chain::has_blocks(const hash_t *hashes, size_t n, bool *out) const {
+  wait_index();
+  size_t known = index_.contains_many(hashes, n, out);
+  if (!orphans_.empty()) {
+    for (size_t i = 0; i < n; i++) {
+      if (!out[i] && orphans_.contains(hashes[i])) {
+        out[i] = true;
+        known++;
+      }
+    }
+  }
+  return known;
+}
+
+BlockHeader Chain::find(const hash_t &hash) const {
+  const BlockHeader *cached = cache_.find(hash);
+  if (cached != nullptr) {
+    return *cached;
+  }
+  wait_index();
+  const IndexEntry *entry = index_.find(hash);
+  assert(entry != nullptr);
+  const BlockHeader hdr = entry->header();
+  cache_.put(hdr);
+  return hdr;
+}
+
+std::vector<hash_t> Chain::locator() const {
+  std::vector<hash_t> hashes{tip_.block_hash};
+  size_t height = tip_.height;
+  size_t step = 1;
+  while (height > 0) {
+    height = height > step ? height - step : 0;
+    bool found = false;
+    const hash_t hash = find_hash(height, found);
+    if (found) {
+      hashes.push_back(hash);
+    }
+    if (hashes.size() > 10) {
+      step *= 2;
+    }
+  }
+  return hashes;
+}
+
+std::vector<hash_t> Chain::locator(const hash_t &from) const {
+  wait_index();
+  const IndexEntry *entry = index_.find(from);
+  if (entry == nullptr) {
+    return locator();
+  }
+  const HeaderIndex::slot_t slot = index_.slot(from);
+  std::vector<hash_t> hashes{from};
+  size_t height = entry->height;
+  size_t step = 1;
+  while (height > 0) {
+    height = height > step ? height - step : 0;
+    hashes.push_back(index_.at(index_.ancestor(slot, height)).hash);
+    if (hashes.size() > 10) {
+      step *= 2;
+    }
+  }
+  return hashes;
+}
+
+HeaderIndex::slot_t Chain::reply_range(const std::vector<hash_t> &locator,
+                                       const hash_t &stop, size_t max,
+                                       size_t &start, size_t &last) const {
+  auto on_best_chain = [&](const IndexEntry *entry) {
+    return entry != nullptr && entry->height < best_.size() &&
+           index_.at(best_.slot(entry->height)).hash == entry->hash;
+  };
+  const IndexEntry *stop_entry = index_.find(stop);
+  if (!on_best_chain(stop_entry)) {
+    stop_entry = nullptr;
+  }
+  if (locator.empty()) {
+    if (stop_entry == nullptr || stop_entry->height == 0) {
+      return HeaderIndex::no_slot;
+    }
+    start = stop_entry->height - 1;
+    last = stop_entry->height;
+    return index_.slot(stop);
+  }
+
+  // the fork point, like FindForkInGlobalIndex() in Bitcoin Core
+  start = 0;
+  std::vector<const IndexEntry *> entries(locator.size());
+  index_.find_many(locator.data(), locator.size(), entries.data());
+  for (const IndexEntry *entry : entries) {
+    if (on_best_chain(entry)) {
+      start = entry->height;
+      break;
+    }
+  }
+  last = std::min(tip_.height, start + max);
+  if (stop_entry != nullptr && stop_entry->height > start &&
+      stop_entry->height < last) {
+    last = stop_entry->height;
+  }
+  return last > start ? best_.slot(last) : HeaderIndex::no_slot;
+}
+
+std::vector<BlockHeader> Chain::headers_after(
+    const std::vector<hash_t> &locator, const hash_t &stop,
+    size_t max) const {
+  wait_index();
+  std::vector<BlockHeader> hdrs;
+  size_t start, last;
+  HeaderIndex::slot_t slot = reply_range(locator, stop, max, start, last);
+  if (slot == HeaderIndex::no_slot) {
+    return hdrs;
+  }
+  // walk back from the end of the range
+  hdrs.resize(last - start);
+  for (size_t i = hdrs.size(); i-- > 0;) {
+    const IndexEntry &entry = index_.at(slot);
+    hdrs[i] = entry.header();
+    slot = entry.parent;
+  }
+  return hdrs;
+}
+
+ReplyCache::Message Chain::headers_message(const std::vector<hash_t> &locator,
+                                           const hash_t &stop) const {
+  wait_index();
+  size_t start = 0, last = 0;
+  HeaderIndex::slot_t slot =
+      reply_range(locator, stop, MAX_HEADERS_RESULTS, start, last);
+  const hash_t last_hash =
+      slot == HeaderIndex::no_slot ? empty_hash : index_.at(slot).hash;
+  ReplyCache::Message msg = replies_.find(start, last_hash);
+  if (msg) {
+    return msg;
+  }
+
+  // each header is its wire bytes plus a zero transaction count
+  const size_t count = last - start;
+  const size_t payload = varint_size(count) + count * HeadersView::stride;
+  Encoder enc(Headers("headers"), HEADER_SIZE + payload);
+  enc.push_varint(count);
+  const size_t first = enc.size();
+  enc.append_zeros(count * HeadersView::stride);
+  for (size_t i = count; i-- > 0;) {
+    const IndexEntry &entry = index_.at(slot);
+    enc.insert(entry.data.data(), BLOCK_HEADER_SIZE,
+               first + i * HeadersView::stride);
+    slot = entry.parent;
+  }
+  enc.finish_headers();
+  msg = std::make_shared<const std::string>(enc.data(), enc.size());
+  replies_.put(start, last_hash, msg);
+  return msg;
+}
+
 BlockHeader Chain::find_tip() {
+  if (store_) {
+    // the tip is always the last header in the store
+    if (store_->size() == 0) {
+      log->warn("no tip...");
+      add_genesis_block();
+    }
+    return find(store_->header(store_->size() - 1).block_hash);
+  }
+
   std::string val;
   auto s = db_->Get(read_opts, tip_key, &val);
   if (!s.ok()) {
@@ -100,71 +1149,827 @@ BlockHeader Chain::find_tip() {
   }
   assert(s.ok());
   const hash_t tip_hash = decode_hash(val);
-  log->debug("fetching tip whose hash is {}", tip_hash);
+  LOG_DEBUG(log, "fetching tip whose hash is {}", tip_hash);
   return find(tip_hash);
 }
 
-void Chain::put_block_header(const BlockHeader &hdr, bool check_duplicate) {
-  assert(hdr.block_hash != empty_hash);
-  bool found = false;
-  std::string prev_block_data = hdr_view_.find(hdr.prev_block, found);
-  if (found) {
-    BlockHeader prev_block;
-    prev_block.db_decode(prev_block_data);
-    if (prev_block.is_genesis() || prev_block.height) {
-      // insert the block with the correct block height
-      BlockHeader copy(hdr);
-      copy.height = prev_block.height + 1;
-      check_checkpoint(copy);
-      assert(hdr_view_.put(copy.block_hash, copy.db_encode()));
-      assert(height_view_.put(copy.height, copy.block_hash));
-      attach_orphan(copy);
-      update_tip(copy);
-      return;
+void Chain::memory_usage(
+    std::vector<std::pair<const char *, size_t> > &out) const {
+  // N.B. the index may still be loading, and isn't ours to look at
+  out.emplace_back("header_index",
+                   loaded_ ? index_.memory_usage() + best_.memory_usage() : 0);
+  out.emplace_back("orphans", orphans_.memory_usage());
+  out.emplace_back("header_cache", cache_.memory_usage());
+
+  // The families share one block cache. Properties this version of
+  // RocksDB doesn't know about are just skipped.
+  uint64_t rocksdb = 0, val;
+  if (db_->GetIntProperty("rocksdb.block-cache-usage", &val)) {
+    rocksdb += val;
+  }
+  for (auto *cf : families_) {
+    for (const char *prop : {"rocksdb.cur-size-all-mem-tables",
+                             "rocksdb.estimate-table-readers-mem"}) {
+      if (db_->GetIntProperty(cf, prop, &val)) {
+        rocksdb += val;
+      }
     }
   }
+  out.emplace_back("rocksdb", rocksdb);
+}
 
-  // This is an orphan block; either the ancestor doesn't exist, or the ancestor
-  // is an orphan. This is indexed based on the orphan's prev_block;
-  assert(orphan_view_.put(hdr.prev_block, hdr.db_encode()));
-  log->debug("added orphan block {}", hdr);
+bool Chain::put_block_headers(const std::vector<BlockHeader> &hdrs) {
+  wait_index();
+  HeapScope scope(HeapTag::CHAIN);
+  CpuScope cpu(CpuTag::STORAGE);
+  ScopedLatency timer(metrics().header_insert);
+  TraceSpan span("insert", nullptr, 0, hdrs.size());
+  LoopScope loop_scope("chain", "put_block_headers");
+  bool ok = true;
+  begin_batch();
+  for (const auto &hdr : hdrs) {
+    if (!put_block_header(hdr)) {
+      ok = false;  // the rest descend from it
+      break;
+    }
+  }
+  save_tip();
+  commit_batch();
+  return ok;
 }
 
-bool Chain::attach_orphan(const BlockHeader &hdr) {
-  assert(hdr.height || hdr.is_genesis());
+// An overlay past this is written out and started over even if the
+// writer never goes idle, to bound what each read has to merge.
+static const size_t max_overlay_bytes = 64 << 20;
 
-  bool found = false;
-  const std::string data = orphan_view_.find(hdr.block_hash, found);
-  if (!found) {
+void Chain::begin_batch() {
+  assert(!batch_);
+  if (!writer_) {
+    batch_.reset(new rocksdb::WriteBatchWithIndex);
+    hdr_view_.set_batch(batch_.get());
+    height_view_.set_batch(batch_.get());
+    return;
+  }
+  if (overlay_ && (writer_->idle() ||
+                   overlay_->GetWriteBatch()->GetDataSize() >
+                       max_overlay_bytes)) {
+    writer_->flush();
+    overlay_.reset();
+  }
+  // overwrite_key, so reads through the overlay see only the last write
+  batch_ = overlay_ ? std::move(overlay_)
+                    : std::unique_ptr<rocksdb::WriteBatchWithIndex>(
+                          new rocksdb::WriteBatchWithIndex(
+                              rocksdb::BytewiseComparator(), 0, true));
+  tail_.reset(new rocksdb::WriteBatch);
+  hdr_view_.set_batch(batch_.get(), tail_.get());
+  height_view_.set_batch(batch_.get(), tail_.get());
+  set_overlay();
+}
+
+void Chain::commit_batch() {
+  assert(batch_);
+  hdr_view_.set_batch(nullptr);
+  height_view_.set_batch(nullptr);
+  const bool sync_wal = wal_sync_due();
+  if (writer_) {
+    writer_->submit(std::move(tail_), tip_, chainwork(), write_opts,
+                    sync_wal);
+    overlay_ = std::move(batch_);
+    set_overlay();
+  } else {
+    rocksdb::Status s;
+    {
+      CpuScope cpu(CpuTag::STORAGE);
+      ScopedLatency timer(metrics().db_write);
+      s = db_->Write(write_opts, batch_->GetWriteBatch());
+    }
+    assert(s.ok());
+    batch_.reset();
+    if (sync_wal) {
+      assert(db_->SyncWAL().ok());
+    }
+  }
+  if (store_) {
+    store_->sync(durability_ == Durability::SYNC || sync_wal);
+  }
+}
+
+bool Chain::wal_sync_due() {
+  if (durability_ != Durability::PERIODIC || bulk_load_) {
     return false;
   }
+  const auto now = std::chrono::steady_clock::now();
+  if (now - last_sync_ < sync_interval_) {
+    return false;
+  }
+  last_sync_ = now;
+  return true;
+}
 
-  BlockHeader orphan;
-  orphan.db_decode(data);
-  assert(orphan.height == 0);
-  assert(orphan.prev_block == hdr.block_hash);
-  orphan.height = hdr.height + 1;
+void Chain::set_overlay() {
+  rocksdb::WriteBatchWithIndex *overlay = batch_ ? batch_.get()
+                                                 : overlay_.get();
+  hdr_view_.set_overlay(overlay);
+  height_view_.set_overlay(overlay);
+}
+
+bool Chain::check_header(const BlockHeader &hdr,
+                         HeaderIndex::slot_t parent) {
+  if (!check_checkpoint(hdr)) {
+    log->warn("header {} doesn't match the checkpoint at height {}", hdr,
+              hdr.height);
+    return false;
+  }
+  if (assume_valid_ == ALL_VALID) {
+    return true;
+  }
+  const uint32_t want = index_.next_difficulty(parent, hdr.timestamp);
+  if (hdr.difficulty != want) {
+    log->warn("header {} has nBits {:08x}, expected {:08x}", hdr,
+              hdr.difficulty, want);
+    return false;
+  }
+  if (window_tip_ != hdr.prev_block) {
+    fill_window(parent);
+  }
+  if (hdr.timestamp <= window_.median()) {
+    log->warn("header {} has time {}, not after the median time past {}",
+              hdr, hdr.timestamp, window_.median());
+    return false;
+  }
+  const int64_t limit = int64_t(adjusted_time()) + MAX_FUTURE_BLOCK_TIME;
+  if (hdr.timestamp > limit) {
+    log->warn("header {} has time {}, more than {}s in the future", hdr,
+              hdr.timestamp, MAX_FUTURE_BLOCK_TIME);
+    return false;
+  }
+  window_.push(hdr.timestamp);
+  window_tip_ = hdr.block_hash;
+  return true;
+}
 
-  // TODO: Use a tx for this.
-  // TODO: Handle the case where multiple block have the same height.
-  assert(hdr_view_.put(orphan.block_hash, orphan.db_encode()));
-  assert(height_view_.put(orphan.height, orphan.block_hash));
-  assert(orphan_view_.erase(hdr.block_hash));
-  log->warn("attached orphan {}", orphan);
+void Chain::fill_window(HeaderIndex::slot_t slot) {
+  window_tip_ = index_.at(slot).hash;
+  const size_t height = index_.at(slot).height;
+  if (best_.contains(slot, height)) {
+    // the usual case, read straight out of best_
+    const size_t span = MedianTime::SPAN;
+    window_.clear();
+    for (size_t h = height + 1 > span ? height + 1 - span : 0; h <= height;
+         h++) {
+      window_.push(best_.timestamp(h));
+    }
+    return;
+  }
+  std::array<uint32_t, MedianTime::SPAN> times;
+  size_t n = 0;
+  for (; n < times.size() && slot != HeaderIndex::no_slot; n++) {
+    times[n] = index_.at(slot).timestamp();
+    slot = index_.at(slot).parent;
+  }
+  window_.clear();
+  while (n) {
+    window_.push(times[--n]);
+  }
+}
 
-  update_tip(orphan);
+PROFILE_BOUNDARY bool Chain::put_block_header(const BlockHeader &hdr,
+                                               bool check_duplicate) {
+  assert(hdr.block_hash != empty_hash);
+  wait_index();
+  if (check_duplicate && index_.contains(hdr.block_hash)) {
+    return true;
+  }
+  const IndexEntry *prev_block = index_.find(hdr.prev_block);
+  assert(assume_valid_ == ALL_VALID ||
+         (prev_block != nullptr && prev_block->height < assume_valid_) ||
+         check_pow(hdr.block_hash, hdr.difficulty));
+  if (prev_block == nullptr) {
+    // This is an orphan block; either the ancestor doesn't exist, or the
+    // ancestor is an orphan.
+    HeapScope scope(HeapTag::ORPHANS);
+    if (orphans_.add(hdr)) {
+      LOG_DEBUG(log, "added orphan block {}", hdr);
+      event_log().header(EventType::ORPHAN, hdr);
+    }
+    return true;
+  }
 
-  // look for orphans recursively
-  attach_orphan(orphan);
+  // insert the block with the correct block height
+  BlockHeader copy(hdr);
+  copy.height = prev_block->height + 1;
+  if (!check_header(copy, index_.slot(hdr.prev_block))) {
+    return false;
+  }
+  add_header(copy);
+  update_tip(copy);
+  event_log().header(EventType::HEADER, copy);
+  if (!orphans_.empty()) {
+    attach_orphans(copy);
+  }
   return true;
 }
 
-void Chain::update_tip(const BlockHeader &hdr) {
-  if (hdr.height < tip_.height) {
+PROFILE_BOUNDARY void Chain::attach_orphans(const BlockHeader &hdr) {
+  assert(hdr.height || hdr.is_genesis());
+  const bool batched = batch_ != nullptr;
+  size_t count = 0;
+  std::vector<BlockHeader> parents{hdr};
+  while (!parents.empty()) {
+    const BlockHeader parent = parents.back();
+    parents.pop_back();
+    for (auto &orphan : orphans_.take_children(parent.block_hash)) {
+      if (index_.contains(orphan.block_hash)) {
+        continue;  // it arrived again after its parent
+      }
+      if (!batched && !batch_) {
+        begin_batch();
+      }
+      orphan.height = parent.height + 1;
+      if (!check_header(orphan, index_.slot(parent.block_hash))) {
+        continue;  // its own orphans are left to expire
+      }
+      add_header(orphan);
+      update_tip(orphan);
+      event_log().header(EventType::HEADER, orphan);
+      parents.push_back(orphan);
+      count++;
+    }
+  }
+  if (count) {
+    log->info("attached {} orphan(s) below {}", count, hdr);
+  }
+  if (!batched && batch_) {
+    save_tip();
+    commit_batch();
+  }
+}
+
+PROFILE_BOUNDARY void Chain::update_tip(const BlockHeader &hdr) {
+  // ties go to the chain we saw first
+  if (index_.find(hdr.block_hash)->chainwork <= chainwork()) {
     return;
   }
-  assert(hdr.height == tip_.height + 1);
+  const bool reorg = hdr.prev_block != tip_.block_hash;
+  size_t fork_height = tip_.height;
+  if (!reorg) {
+    if (!store_) {
+      assert(height_view_.put(hdr.height, hdr.block_hash));
+    }
+  } else {
+    fork_height = reorganize(hdr);
+  }
   tip_ = hdr;
+  sync_best();
+  cache_.put(tip_, true);
+  feed_.publish(tip_, fork_height, reorg);
+}
+
+void Chain::sync_best() {
+  const HeaderIndex::slot_t tip_slot = index_.slot(tip_.block_hash);
+  if (!writer_ || !batch_) {  // else the writer stores it once it's written
+    shared_tip_.store(tip_, index_.at(tip_slot).chainwork);
+  }
+  std::vector<HeaderIndex::slot_t> path;
+  for (HeaderIndex::slot_t slot = tip_slot;
+       slot != HeaderIndex::no_slot &&
+       !best_.contains(slot, index_.at(slot).height);
+       slot = index_.at(slot).parent) {
+    path.push_back(slot);
+  }
+  best_.truncate(path.empty() ? tip_.height + 1
+                              : index_.at(path.back()).height);
+  for (auto it = path.rbegin(); it != path.rend(); ++it) {
+    best_.push(*it, index_.at(*it).timestamp());
+  }
+  assert(best_.size() == tip_.height + 1);
+  sync_mmr();
+}
+
+void Chain::open_mmr(const std::string &path) {
+  mmr_.reset(new HeaderMmr(path));
+  if (loaded_) {
+    sync_mmr();
+  }
+}
+
+void Chain::open_work_mmr(const std::string &path) {
+  work_mmr_.reset(new HeaderMmr(path));
+  if (loaded_) {
+    sync_mmr();
+  }
+}
+
+// rewind an mmr to where its leaves agree with best_ and append the rest,
+// the leaf at each height coming from its index entry
+template <typename F>
+static void sync_leaves(HeaderMmr &mmr, const BestChain &best,
+                        const HeaderIndex &index, const char *name, F leaf) {
+  // usually this checks the last leaf and appends one
+  size_t n = std::min(mmr.size(), best.size());
+  while (n > 0 && mmr.leaf(n - 1) != leaf(index.at(best.slot(n - 1)))) {
+    n--;
+  }
+  mmr.truncate(n);
+  if (best.size() - n > 1000) {
+    log->info("adding {} headers to the {}", best.size() - n, name);
+  }
+  for (; n < best.size(); n++) {
+    mmr.append(leaf(index.at(best.slot(n))));
+  }
+}
+
+void Chain::sync_mmr() {
+  if (mmr_) {
+    sync_leaves(*mmr_, best_, index_, "header mmr",
+                [](const IndexEntry &entry) { return entry.hash; });
+  }
+  if (work_mmr_) {
+    sync_leaves(*work_mmr_, best_, index_, "work mmr",
+                [](const IndexEntry &entry) {
+                  return chain_proof_leaf(entry.hash, entry.chainwork);
+                });
+  }
+}
+
+bool Chain::mmr_proof(size_t height, size_t &leaves, hash_t &root,
+                      std::vector<hash_t> &proof) const {
+  wait_index();
+  if (!mmr_ || height >= mmr_->size()) {
+    return false;
+  }
+  leaves = mmr_->size();
+  root = mmr_->root();
+  proof = mmr_->prove(height);
+  return true;
+}
+
+bool Chain::chain_proof(size_t samples, ChainProof &proof) const {
+  wait_index();
+  if (!work_mmr_ || work_mmr_->size() == 0) {
+    return false;
+  }
+  proof.leaves = work_mmr_->size();
+  proof.root = work_mmr_->root();
+  proof.chainwork = index_.at(best_.slot(proof.leaves - 1)).chainwork;
+
+  // the heights holding each point, found by bisecting best_ on chainwork
+  std::vector<size_t> heights;
+  for (const uint256 &point : chain_proof_points(proof.leaves, proof.root,
+                                                 proof.chainwork, samples)) {
+    size_t lo = 0, hi = proof.leaves - 1;
+    while (lo < hi) {
+      const size_t mid = lo + (hi - lo) / 2;
+      if (point < index_.at(best_.slot(mid)).chainwork) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    heights.push_back(lo);
+  }
+  heights.push_back(proof.leaves - 1);
+  std::sort(heights.begin(), heights.end());
+  heights.erase(std::unique(heights.begin(), heights.end()), heights.end());
+
+  proof.samples.clear();
+  for (size_t height : heights) {
+    const IndexEntry &entry = index_.at(best_.slot(height));
+    ChainProof::Sample sample;
+    sample.height = height;
+    sample.chainwork = entry.chainwork;
+    sample.header = entry.data;
+    sample.branch = work_mmr_->prove(height);
+    proof.samples.push_back(std::move(sample));
+  }
+  return true;
+}
+
+size_t Chain::reorganize(const BlockHeader &hdr) {
+  const HeaderIndex::slot_t fork = index_.last_common_ancestor(
+      index_.slot(hdr.block_hash), index_.slot(tip_.block_hash));
+  const size_t fork_height = index_.at(fork).height;
+
+  // the new branch, from hdr back to (but not including) the fork
+  std::vector<BlockHeader> branch;
+  for (HeaderIndex::slot_t slot = index_.slot(hdr.block_hash); slot != fork;
+       slot = index_.at(slot).parent) {
+    branch.push_back(index_.at(slot).header());
+  }
+  log->warn("reorganizing from {} to {}, forked at height {}", tip_, hdr,
+            fork_height);
+  cache_.unwind(fork_height);
+  for (const auto &b : branch) {
+    cache_.put(b, true);
+  }
+
+  // The old branch goes back to being a side chain in hdr_view_, in full
+  // records, since heights won't lead to its parents any more. This comes
+  // before the heights change so a crash can't leave a compact record
+  // pointing at the new branch.
+  for (HeaderIndex::slot_t slot = index_.slot(tip_.block_hash); slot != fork;
+       slot = index_.at(slot).parent) {
+    const IndexEntry &old = index_.at(slot);
+    assert(hdr_view_.put(old.hash, old.db_encode()));
+  }
+  if (store_) {
+    store_->truncate(fork_height + 1);
+    for (auto it = branch.rbegin(); it != branch.rend(); ++it) {
+      store_->append(*it, index_.find(it->block_hash)->data.data());
+    }
+    return fork_height;
+  }
+  for (size_t h = hdr.height + 1; h <= tip_.height; h++) {
+    assert(height_view_.erase(h));
+  }
+  for (const auto &b : branch) {
+    assert(height_view_.put(b.height, b.block_hash));
+  }
+  return fork_height;
+}
+
+// Headers read from an import file at a time, 4 MB worth.
+static const size_t import_chunk_size = 50000;
+
+// Hash headers on every worker and check their proof of work.
+static bool hash_headers(const char *raw, size_t n,
+                         std::vector<hash_t> &hashes) {
+  hashes.resize(n);
+  const size_t nthreads = scheduler().threads();
+  const size_t per_thread = (n + nthreads - 1) / nthreads;
+  std::atomic<bool> ok(true);
+  TaskGroup group;
+  for (size_t begin = 0; begin < n; begin += per_thread) {
+    const size_t end = std::min(n, begin + per_thread);
+    group.run([&, begin, end, net = &network()]() {
+      NetworkScope scope(*net);
+      pow_hash_batch(raw + begin * BLOCK_HEADER_SIZE, BLOCK_HEADER_SIZE,
+                     end - begin, &hashes[begin]);
+      for (size_t i = begin; i < end; i++) {
+        BlockHeader hdr;
+        hdr.unpack(raw + i * BLOCK_HEADER_SIZE);
+        if (!check_pow(hashes[i], hdr.difficulty)) {
+          ok = false;
+        }
+      }
+    });
+  }
+  group.wait();
+  return ok;
+}
+
+bool Chain::import_headers(const std::string &path) {
+  wait_index();
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    log->error("failed to open header file {}", path);
+    return false;
+  }
+  log->info("importing headers from {}", path);
+  std::vector<char> buf(import_chunk_size * BLOCK_HEADER_SIZE);
+  std::vector<hash_t> hashes;
+  std::vector<BlockHeader> hdrs;
+  size_t count = 0, height = 0;
+  hash_t prev = empty_hash;
+  while (in.read(buf.data(), buf.size()) || in.gcount()) {
+    const size_t sz = in.gcount();
+    if (sz % BLOCK_HEADER_SIZE) {
+      log->error("header file {} is truncated", path);
+      return false;
+    }
+    const size_t n = sz / BLOCK_HEADER_SIZE;
+    if (!hash_headers(buf.data(), n, hashes)) {
+      log->error("header file {} has insufficient proof of work", path);
+      return false;
+    }
+    hdrs.clear();
+    for (size_t i = 0; i < n; i++) {
+      BlockHeader hdr;
+      hdr.unpack(buf.data() + i * BLOCK_HEADER_SIZE);
+      hdr.block_hash = hashes[i];
+      if (count == 0) {
+        const IndexEntry *parent = index_.find(hdr.prev_block);
+        if (parent == nullptr && !hdr.is_genesis()) {
+          log->error("header file {} doesn't connect to the chain", path);
+          return false;
+        }
+        height = parent ? parent->height + 1 : 0;
+      } else if (hdr.prev_block != prev) {
+        log->error("header file {} isn't contiguous at height {}", path,
+                   height + 1);
+        return false;
+      } else {
+        height++;
+      }
+      auto it = checkpoints().find(height);
+      if (it != checkpoints().end() && it->second != hdr.block_hash) {
+        log->error("header file {} fails the checkpoint at height {}", path,
+                   height);
+        return false;
+      }
+      prev = hdr.block_hash;
+      hdrs.push_back(hdr);
+      count++;
+    }
+    if (!put_block_headers(hdrs)) {
+      log->error("header file {} has an invalid header", path);
+      return false;
+    }
+  }
+  log->info("imported {} headers, tip is now {}", count, tip_);
+  return true;
+}
+
+bool Chain::export_headers(const std::string &path) const {
+  wait_index();
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    log->error("failed to create header file {}", path);
+    return false;
+  }
+  // walk back from the tip, then write in height order
+  std::vector<HeaderIndex::slot_t> slots(tip_.height + 1);
+  HeaderIndex::slot_t slot = index_.slot(tip_.block_hash);
+  for (size_t h = slots.size(); h-- > 0; slot = index_.at(slot).parent) {
+    slots[h] = slot;
+  }
+  for (const HeaderIndex::slot_t s : slots) {
+    out.write(index_.at(s).data.data(), BLOCK_HEADER_SIZE);
+  }
+  out.close();
+  if (!out) {
+    log->error("failed to write header file {}", path);
+    return false;
+  }
+  log->info("exported {} headers to {}", slots.size(), path);
+  return true;
+}
+
+bool Chain::export_proto(const std::string &path, size_t from,
+                         size_t to) const {
+  wait_index();
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    log->error("failed to create header file {}", path);
+    return false;
+  }
+  to = std::min(to, tip_.height + 1);
+  from = std::min(from, to);
+  // buffer about 1 MB of messages per write
+  static const size_t chunk_headers = 8192;
+  std::unique_ptr<char[]> buf(new char[chunk_headers * MAX_PROTO_HEADER_SIZE]);
+  size_t n = 0, used = 0;
+  headers_in_range(from, to, [&](const BlockHeader &hdr) {
+    used += proto_encode(hdr, buf.get() + used);
+    if (++n % chunk_headers == 0) {
+      out.write(buf.get(), used);
+      used = 0;
+    }
+  });
+  out.write(buf.get(), used);
+  out.close();
+  if (!out) {
+    log->error("failed to write header file {}", path);
+    return false;
+  }
+  log->info("exported {} headers at heights [{}, {}) to {}", n, from, to,
+            path);
+  return true;
+}
+
+void TableView::find_many(const std::vector<hash_t> &hashes,
+                          std::vector<rocksdb::PinnableSlice> &vals,
+                          std::vector<bool> &found,
+                          const rocksdb::ReadOptions &opts) const {
+  const size_t n = hashes.size();
+  std::vector<TableKey> keys;
+  std::vector<rocksdb::Slice> slices;
+  keys.reserve(n);
+  slices.reserve(n);
+  for (const auto &hash : hashes) {
+    keys.push_back(encode_key(hash));
+    slices.push_back(keys.back().slice());
+  }
+  std::vector<rocksdb::Status> statuses(n);
+  vals.clear();
+  vals.resize(n);
+  {
+    CpuScope cpu(CpuTag::STORAGE);
+    ScopedLatency timer(metrics().db_read);
+    // a snapshot is older than any open batch, and than anything left to
+    // the writer, so it only reads the db
+    if (opts.snapshot == nullptr && reads()) {
+      reads()->MultiGetFromBatchAndDB(db_, opts, cf(), n, slices.data(),
+                                      vals.data(), statuses.data(), false);
+    } else {
+      db_->MultiGet(opts, cf(), n, slices.data(), vals.data(),
+                    statuses.data());
+    }
+  }
+  found.assign(n, false);
+  for (size_t i = 0; i < n; i++) {
+    found[i] = statuses[i].ok();
+  }
+}
+
+void VerifyResult::merge(VerifyResult &&other) {
+  checked += other.checked;
+  bad_headers.insert(bad_headers.end(), other.bad_headers.begin(),
+                     other.bad_headers.end());
+  bad_heights.insert(bad_heights.end(), other.bad_heights.begin(),
+                     other.bad_heights.end());
+  parentless.insert(parentless.end(), other.parentless.begin(),
+                    other.parentless.end());
+}
+
+void Chain::verify_headers(const rocksdb::Snapshot *snap, uint8_t first,
+                           uint8_t last, VerifyResult &result) const {
+  rocksdb::ReadOptions opts(read_opts);
+  opts.snapshot = snap;
+  opts.fill_cache = false;  // don't push out the working set
+  const std::string start{hdr_view_.prefix_, static_cast<char>(first)};
+
+  // the headers whose parents are yet to be looked up, a batch at a time
+  std::vector<BlockHeader> children;
+  std::vector<hash_t> parents;
+  std::vector<rocksdb::PinnableSlice> vals;
+  std::vector<bool> found;
+  auto check_parents = [&]() {
+    hdr_view_.find_many(parents, vals, found, opts);
+    for (size_t i = 0; i < children.size(); i++) {
+      if (!found[i]) {
+        result.parentless.push_back(children[i]);
+      }
+    }
+    children.clear();
+    parents.clear();
+  };
+
+  std::unique_ptr<rocksdb::Iterator> it(
+      db_->NewIterator(opts, hdr_view_.cf()));
+  for (it->Seek(start); it->Valid(); it->Next()) {
+    const std::string key = it->key().ToString();
+    if (key.size() < 2 || key[0] != hdr_view_.prefix_ ||
+        static_cast<uint8_t>(key[1]) > last) {
+      break;
+    }
+    result.checked++;
+    const std::string val = it->value().ToString();
+    if (key.size() != sizeof(hash_t) + 1 ||
+        (val.size() != HEADER_RECORD_SIZE && !is_compact_record(val))) {
+      result.bad_headers.push_back(key.size() == sizeof(hash_t) + 1
+                                       ? hdr_view_.decode_key(key)
+                                       : empty_hash);
+      continue;
+    }
+    BlockHeader hdr;
+    hdr.db_decode(val);
+    hdr.block_hash = hdr_view_.decode_key(key);
+    char raw[BLOCK_HEADER_SIZE];
+    if (is_compact_record(val)) {
+      // it has to be on the best chain, with its parent a height below
+      std::string here, below;
+      if (hdr.height == 0 ||
+          !db_->Get(opts, height_view_.cf(),
+                    height_view_.encode_key(hdr.height), &here)
+               .ok() ||
+          height_view_.decode_key(here) != hdr.block_hash ||
+          !db_->Get(opts, height_view_.cf(),
+                    height_view_.encode_key(hdr.height - 1), &below)
+               .ok()) {
+        result.bad_headers.push_back(hdr.block_hash);
+        continue;
+      }
+      hdr.prev_block = height_view_.decode_key(below);
+      hdr.pack(raw);
+    } else {
+      std::memcpy(raw, val.data(), BLOCK_HEADER_SIZE);
+    }
+    if (pow_hash(raw, BLOCK_HEADER_SIZE, true) != hdr.block_hash) {
+      result.bad_headers.push_back(hdr.block_hash);
+      continue;
+    }
+    if (hdr.is_genesis()) {
+      continue;
+    }
+    children.push_back(hdr);
+    parents.push_back(hdr.prev_block);
+    if (parents.size() == verify_batch_size) {
+      check_parents();
+    }
+  }
+  assert(it->status().ok());
+  if (!parents.empty()) {
+    check_parents();
+  }
+}
+
+void Chain::verify_heights(const rocksdb::Snapshot *snap, size_t from,
+                           size_t to, size_t end,
+                           VerifyResult &result) const {
+  rocksdb::ReadOptions opts(read_opts);
+  opts.snapshot = snap;
+  opts.fill_cache = false;
+
+  // the header that the first one in this range should link to
+  hash_t prev = empty_hash;
+  std::string val;
+  if (from > 0) {
+    const TableKey key = height_view_.encode_key(from - 1);
+    if (db_->Get(opts, height_view_.cf(), key, &val).ok()) {
+      prev = height_view_.decode_key(val);
+    }
+  }
+
+  size_t expect = from;
+  const TableKey start = height_view_.encode_key(from);
+  const TableKey stop = height_view_.encode_key(to);
+  const rocksdb::Slice upper_bound = stop.slice();
+  opts.iterate_upper_bound = &upper_bound;
+  std::unique_ptr<rocksdb::Iterator> it(
+      db_->NewIterator(opts, height_view_.cf()));
+  for (it->Seek(start); it->Valid(); it->Next()) {
+    const size_t height = height_view_.decode_height(it->key());
+    const hash_t hash = height_view_.decode_key(it->value());
+    result.checked++;
+    for (; expect < std::min(height, end); expect++) {
+      result.bad_heights.push_back(expect);  // a hole
+    }
+    expect = height + 1;
+    if (height >= end) {
+      result.bad_heights.push_back(height);  // above the tip
+      continue;
+    }
+    const TableKey key = hdr_view_.encode_key(hash);
+    const bool found =
+        db_->Get(opts, hdr_view_.cf(), key, &val).ok() &&
+        (val.size() == HEADER_RECORD_SIZE || is_compact_record(val));
+    BlockHeader hdr;
+    if (found) {
+      hdr.db_decode(val);
+      if (is_compact_record(val)) {
+        hdr.prev_block = prev;  // by definition
+      }
+    }
+    if (!found || hdr.height != height ||
+        (height > 0 && hdr.prev_block != prev)) {
+      result.bad_heights.push_back(height);
+    }
+    prev = hash;
+  }
+  assert(it->status().ok());
+  for (; expect < std::min(to, end); expect++) {
+    result.bad_heights.push_back(expect);
+  }
+}
+
+void Chain::check_parentless(VerifyResult &result) const {
+  wait_index();
+  auto &hdrs = result.parentless;
+  hdrs.erase(std::remove_if(hdrs.begin(), hdrs.end(),
+                            [this](const BlockHeader &hdr) {
+                              return index_.contains(hdr.prev_block);
+                            }),
+             hdrs.end());
+}
+
+size_t Chain::repair(const VerifyResult &result) {
+  wait_index();
+  size_t fixed = 0;
+  begin_batch();
+  for (const auto &hash : result.bad_headers) {
+    const IndexEntry *entry = index_.find(hash);
+    if (entry != nullptr &&
+        pow_hash(entry->data.data(), BLOCK_HEADER_SIZE, true) == hash) {
+      assert(hdr_view_.put(hash, entry->db_encode()));
+    } else if (hash != empty_hash) {
+      // N.B. a record with a malformed key can only be found by a rescan
+      assert(hdr_view_.erase(hash));
+    }
+    fixed++;
+  }
+  for (size_t height : result.bad_heights) {
+    if (height > tip_.height) {
+      bool found = false;
+      height_view_.find_hash(height, found);
+      if (found) {
+        assert(height_view_.erase(height));
+        fixed++;
+      }
+      continue;
+    }
+    // the chain may have moved on since the snapshot, so go by the index
+    bool found = false;
+    const hash_t hash = find_hash(height, found);
+    assert(found);
+    const IndexEntry *entry = index_.find(hash);
+    assert(height_view_.put(height, hash));
+    assert(hdr_view_.put(hash, entry->db_encode()));
+    fixed++;
+  }
+  commit_batch();
+  return fixed;
 }
 
 bool Chain::save_tip(bool check) {
@@ -172,11 +1977,50 @@ bool Chain::save_tip(bool check) {
     assert(!tip_.is_empty());
     assert(!tip_.is_orphan());
   }
-  auto s = db_->Put(write_opts, tip_key, encode_hash(tip_.block_hash));
-  log->debug("saved chain tip {}", tip_);
+  const std::string val = encode_hash(tip_.block_hash);
+  if (batch_ && tail_) {
+    tail_->Put(tip_key, val);
+  } else if (!batch_ && writer_) {
+    writer_->flush();  // so it lands after the headers it points to
+  }
+  auto s = batch_ ? batch_->Put(tip_key, val)
+                  : db_->Put(write_opts, tip_key, val);
+  LOG_DEBUG(log, "saved chain tip {}", tip_);
   if (check) {
     assert(s.ok());
   }
   return s.ok();
 }
+
+bool Chain::get_state(const std::string &key, std::string &val) const {
+  return db_->Get(read_opts, state_prefix + key, &val).ok();
+}
+
+void Chain::put_state(const std::string &key, const std::string &val) {
+  auto s = db_->Put(write_opts, state_prefix + key, val);
+  if (!s.ok()) {
+    log->error("failed to save {}: {}", key, s.ToString());
+  }
+}
+
+void Chain::erase_state(const std::string &key) {
+  auto s = db_->Delete(write_opts, state_prefix + key);
+  if (!s.ok()) {
+    log->error("failed to erase {}: {}", key, s.ToString());
+  }
+}
+
+void Chain::for_each_state(
+    const std::string &prefix,
+    const std::function<void(const std::string &key, const std::string &val)>
+        &fn) const {
+  const std::string start = state_prefix + prefix;
+  std::unique_ptr<rocksdb::Iterator> it(db_->NewIterator(read_opts));
+  for (it->Seek(start); it->Valid() && it->key().starts_with(start);
+       it->Next()) {
+    fn(it->key().ToString().substr(state_prefix.size()),
+       it->value().ToString());
+  }
+  assert(it->status().ok());
+}
 }  // namespace spv
@@ -16,50 +16,167 @@
 
 #pragma once
 
+#include <endian.h>
+#include <rocksdb/cache.h>
 #include <rocksdb/db.h>
-#include <rocksdb/utilities/optimistic_transaction_db.h>
+#include <rocksdb/utilities/write_batch_with_index.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "./fields.h"
+#include "./flyclient.h"
+#include "./header_cache.h"
+#include "./index.h"
+#include "./mmr.h"
+#include "./metrics.h"
+#include "./reply_cache.h"
+#include "./orphan.h"
+#include "./settings.h"
+#include "./store.h"
+#include "./timedata.h"
+#include "./tip_feed.h"
 
 namespace spv {
 class Client;
 class Chain;
+class ChainWriter;
+struct PresyncAnchor;
 
 extern rocksdb::ReadOptions read_opts;
 extern rocksdb::WriteOptions write_opts;
 
-inline std::string encode_hash(hash_t hash) {  // by value
-  std::reverse(hash.begin(), hash.end());
-  return {reinterpret_cast<const char *>(hash.data()), sizeof(hash_t)};
+// Known block hashes on the best chain, keyed by height, for the network
+// this thread selected (see network.h).
+const std::map<size_t, hash_t> &checkpoints();
+
+// Replace the built-in checkpoints with the ones in this file, which has a
+// height and a block hash (in hex, as logged) on each line. Blank lines and
+// lines starting with # are skipped. Returns false if the file can't be
+// read or parsed, leaving the checkpoints as they were.
+bool load_checkpoints(const std::string &path);
+
+inline std::string encode_hash(const hash_t &hash) {
+  char wire[sizeof(hash_t)];
+  reverse_hash(hash.data(), wire);
+  return {wire, sizeof wire};
 }
 
 inline hash_t decode_hash(const std::string &val) {
   assert(val.size() == sizeof(hash_t));
   hash_t out;
-  std::memmove(out.data(), val.data(), sizeof(hash_t));
-  std::reverse(out.begin(), out.end());
+  reverse_hash(val.data(), out.data());
   return out;
 }
 
+// A TableView key, built on the stack rather than in a std::string: the
+// view's prefix byte, then a hash in wire order or a big-endian height. It
+// converts to the rocksdb::Slice that every db call takes.
+class TableKey {
+ public:
+  TableKey(char prefix, const hash_t &hash) : size_(1 + sizeof hash) {
+    buf_[0] = prefix;
+    reverse_hash(hash.data(), buf_.data() + 1);
+  }
+
+  // Heights are fixed-width big-endian, so keys sort in height order.
+  TableKey(char prefix, size_t height) : size_(1 + sizeof(uint64_t)) {
+    const uint64_t be_height = htobe64(height);
+    buf_[0] = prefix;
+    std::memcpy(buf_.data() + 1, &be_height, sizeof be_height);
+  }
+
+  inline rocksdb::Slice slice() const { return {buf_.data(), size_}; }
+  inline operator rocksdb::Slice() const { return slice(); }  // NOLINT
+
+ private:
+  std::array<char, 1 + sizeof(hash_t)> buf_;
+  size_t size_;
+};
+
+// Problems found by one shard of a database verification; see DbVerifier.
+struct VerifyResult {
+  size_t checked;  // records looked at
+
+  // hdr_view_ records that don't hash to their key
+  std::vector<hash_t> bad_headers;
+
+  // height_view_ holes, bad links, and heights past the tip
+  std::vector<size_t> bad_heights;
+
+  // hdr_view_ records whose parent isn't in hdr_view_
+  std::vector<BlockHeader> parentless;
+
+  VerifyResult() : checked(0) {}
+
+  void merge(VerifyResult &&other);
+};
+
 class TableView {
   friend class Chain;
 
  public:
   TableView() = delete;
-  explicit TableView(char prefix) : db_(nullptr), prefix_(prefix) {}
-  TableView(rocksdb::DB *db, char prefix) : db_(db), prefix_(prefix) {}
+  explicit TableView(char prefix)
+      : db_(nullptr),
+        cf_(nullptr),
+        batch_(nullptr),
+        tail_(nullptr),
+        overlay_(nullptr),
+        prefix_(prefix) {}
+  TableView(rocksdb::DB *db, char prefix,
+            rocksdb::ColumnFamilyHandle *cf = nullptr)
+      : db_(db),
+        cf_(cf),
+        batch_(nullptr),
+        tail_(nullptr),
+        overlay_(nullptr),
+        prefix_(prefix) {}
+
+  // Reads pin the value where it lies, in the block cache or a memtable,
+  // rather than copying it out. N.B. while a batch is open, reads see the
+  // batch's pending writes, and with a ChainWriter, the overlay's.
+  inline bool get(const rocksdb::Slice &key, rocksdb::PinnableSlice *val,
+                  const rocksdb::ReadOptions &opts = read_opts) const {
+    ScopedLatency timer(metrics().db_read);
+    rocksdb::WriteBatchWithIndex *pending = reads();
+    auto s = pending ? pending->GetFromBatchAndDB(db_, opts, cf(), key, val)
+                     : db_->Get(opts, cf(), key, val);
+    return s.ok();
+  }
 
+  // The bloom filters usually answer for a missing key without a read;
+  // only a key that may exist is looked up.
   inline bool has_key(const hash_t &hash) const {
-    std::string val;
-    auto s = db_->Get(read_opts, encode_key(hash), &val);
-    return s.ok();
+    const TableKey key = encode_key(hash);
+    if (!reads()) {
+      std::string unused;
+      bool value_found = false;
+      if (!db_->KeyMayExist(read_opts, cf(), key, &unused, &value_found)) {
+        return false;
+      }
+      if (value_found) {
+        return true;
+      }
+    }
+    rocksdb::PinnableSlice val;
+    return get(key, &val);
   }
 
-  inline std::string find(const std::string &key, bool &found) const {
-    std::string val;
-    auto s = db_->Get(read_opts, key, &val);
-    found = s.ok();
-    return val;
+  inline std::string find(const rocksdb::Slice &key, bool &found) const {
+    rocksdb::PinnableSlice val;
+    found = get(key, &val);
+    return found ? val.ToString() : std::string();
   }
 
   inline std::string find(size_t height, bool &found) const {
@@ -70,17 +187,45 @@ class TableView {
     return find(encode_key(hash), found);
   }
 
-  inline bool erase(const hash_t &hash) {
-    auto s = db_->Delete(write_opts, encode_key(hash));
-    return s.ok();
+  // find a hash stored with put(height, hash)
+  inline hash_t find_hash(size_t height, bool &found) const {
+    rocksdb::PinnableSlice val;
+    found = get(encode_key(height), &val);
+    return found ? decode_key(val) : empty_hash;
   }
 
-  inline bool put(const std::string &key, const std::string &val) {
-    auto s = db_->Put(write_opts, key, val);
-    return s.ok();
+  // Look up many hashes with one MultiGet, which reads the blocks they
+  // share once and fetches the rest in parallel. found[i] says whether
+  // vals[i] holds the value for hashes[i].
+  void find_many(const std::vector<hash_t> &hashes,
+                 std::vector<rocksdb::PinnableSlice> &vals,
+                 std::vector<bool> &found,
+                 const rocksdb::ReadOptions &opts = read_opts) const;
+
+  inline bool erase(const rocksdb::Slice &key) {
+    if (batch_) {
+      return (!tail_ || tail_->Delete(cf(), key).ok()) &&
+             batch_->Delete(cf(), key).ok();
+    }
+    ScopedLatency timer(metrics().db_write);
+    return db_->Delete(write_opts, cf(), key).ok();
+  }
+
+  inline bool erase(const hash_t &hash) { return erase(encode_key(hash)); }
+
+  inline bool erase(size_t height) { return erase(encode_key(height)); }
+
+  // N.B. writes to a batch are only timed when it's committed
+  inline bool put(const rocksdb::Slice &key, const rocksdb::Slice &val) {
+    if (batch_) {
+      return (!tail_ || tail_->Put(cf(), key, val).ok()) &&
+             batch_->Put(cf(), key, val).ok();
+    }
+    ScopedLatency timer(metrics().db_write);
+    return db_->Put(write_opts, cf(), key, val).ok();
   }
 
-  inline bool put(const hash_t &hash, const std::string &data) {
+  inline bool put(const hash_t &hash, const rocksdb::Slice &data) {
     assert(hash != empty_hash);
     return put(encode_key(hash), data);
   }
@@ -89,93 +234,585 @@ class TableView {
     return put(encode_key(height), encode_key(hash));
   }
 
+  // call fn(height, hash) for every put(height, hash) entry in [from, to)
+  template <typename F>
+  void for_each_height(size_t from, size_t to, F fn) const {
+    if (from >= to) {
+      return;
+    }
+    const TableKey start = encode_key(from), stop = encode_key(to);
+    const rocksdb::Slice upper_bound = stop.slice();
+    rocksdb::ReadOptions opts(read_opts);
+    opts.iterate_upper_bound = &upper_bound;
+    std::unique_ptr<rocksdb::Iterator> it(db_->NewIterator(opts, cf()));
+    if (overlay_) {
+      // the overlay's own entries don't stop at the bound
+      it.reset(overlay_->NewIteratorWithBase(cf(), it.release()));
+    }
+    for (it->Seek(start);
+         it->Valid() && it->key().compare(upper_bound) < 0; it->Next()) {
+      fn(decode_height(it->key()), decode_key(it->value()));
+    }
+    assert(it->status().ok());
+  }
+
+  // call fn(key, value) for every entry in this view
+  template <typename F>
+  void for_each(F fn) const {
+    const std::string prefix(1, prefix_);
+    std::unique_ptr<rocksdb::Iterator> it(db_->NewIterator(read_opts, cf()));
+    for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix);
+         it->Next()) {
+      fn(it->key().ToString(), it->value().ToString());
+    }
+    assert(it->status().ok());
+  }
+
  private:
   rocksdb::DB *db_;
+  rocksdb::ColumnFamilyHandle *cf_;  // nullptr for the default family
+  rocksdb::WriteBatchWithIndex *batch_;
+  rocksdb::WriteBatch *tail_;  // gets a copy of batch_'s writes
+  rocksdb::WriteBatchWithIndex *overlay_;
   char prefix_;
 
-  inline std::string encode_key(const hash_t &hash) const {
-    return prefix_ + encode_hash(hash);
+  inline rocksdb::ColumnFamilyHandle *cf() const {
+    return cf_ ? cf_ : db_->DefaultColumnFamily();
+  }
+
+  // the pending writes that reads have to see, if any
+  inline rocksdb::WriteBatchWithIndex *reads() const {
+    return batch_ ? batch_ : overlay_;
+  }
+
+  inline TableKey encode_key(const hash_t &hash) const {
+    return {prefix_, hash};
+  }
+
+  inline TableKey encode_key(size_t height) const { return {prefix_, height}; }
+
+  inline size_t decode_height(const rocksdb::Slice &key) const {
+    assert(key.size() == sizeof(uint64_t) + 1);
+    uint64_t be_height;
+    std::memcpy(&be_height, key.data() + 1, sizeof be_height);
+    return be64toh(be_height);
   }
 
-  inline std::string encode_key(size_t height) const {
-    std::ostringstream os;
-    os << prefix_ << height;
-    return os.str();
+  inline hash_t decode_key(const rocksdb::Slice &key) const {
+    assert(key.size() == sizeof(hash_t) + 1);
+    hash_t out;
+    reverse_hash(key.data() + 1, out.data());
+    return out;
   }
 
  protected:
-  void set_db(rocksdb::DB *db) {
+  void set_db(rocksdb::DB *db, rocksdb::ColumnFamilyHandle *cf = nullptr) {
     assert(db_ == nullptr);
     db_ = db;
+    cf_ = cf;
+  }
+
+  // Route writes through a batch, or back to the db if batch is nullptr.
+  // With a tail, each write to the batch is also added to it.
+  void set_batch(rocksdb::WriteBatchWithIndex *batch,
+                 rocksdb::WriteBatch *tail = nullptr) {
+    batch_ = batch;
+    tail_ = tail;
+  }
+
+  // With a ChainWriter, the writes it hasn't finished yet, for reads and
+  // iterators to see when no batch is open; the open batch has them too.
+  void set_overlay(rocksdb::WriteBatchWithIndex *overlay) {
+    overlay_ = overlay;
   }
 };
 
 class Chain {
   friend Client;
+  friend class StallListener;
 
  public:
   Chain() = delete;
   Chain(const Chain &other) = delete;
-  ~Chain() { save_tip(true); }
-
-  // add a block header
-  void put_block_header(const BlockHeader &hdr, bool check_duplicate = true);
+  ~Chain();
+
+  // Save the tip with a single sync, covering every write before it, and
+  // close the database cleanly so the next start has no log to replay. The
+  // destructor does this if it hasn't been done; nothing else may be called
+  // after it.
+  void close();
+
+  // Load the header index on a thread of its own, calling done() on that
+  // thread once it's loaded. Until then the tip is the one read straight
+  // from the database, and anything else that needs the index waits for
+  // it, so callers should hold off until done() rather than block. Without
+  // this, whatever needs the index first loads it.
+  void load_index_async(std::function<void()> done);
+
+  // Finish loading the header index, waiting for load_index_async() if it's
+  // still going, and check the tip against it. Call this after done().
+  void wait_index() const;
+
+  // is the header index loaded? This only changes in wait_index()
+  inline bool index_loaded() const { return loaded_; }
+
+  // Write the loaded header index to index.dat in the data directory, for
+  // the next start to read instead of scanning the database, if it has at
+  // least min_new headers the last image didn't. Only the best chain's
+  // headers past the image are read from the database then, so headers
+  // off it added since are left for peers to send again. close() writes
+  // one with anything new.
+  void write_index_image(size_t min_new = 1);
+
+  // Add a block header. Returns false, adding nothing, if it fails
+  // check_header(): it's off a checkpoint, its nBits aren't what its
+  // parent's retarget interval requires, or its timestamp is out of
+  // bounds. Orphans are checked when their parent arrives, and dropped then
+  // if they fail.
+  bool put_block_header(const BlockHeader &hdr, bool check_duplicate = true);
+
+  // Add a run of headers (e.g. a whole headers message) along with the new
+  // tip, as a single atomic write. Returns false if a header fails its
+  // checks, in which case neither it nor the headers after it are added.
+  bool put_block_headers(const std::vector<BlockHeader> &hdrs);
 
   // save the tip
   bool save_tip(bool check = true);
 
+  // Small records for other subsystems, such as the rescan cursor, kept in
+  // the default column family next to the tip. Writes go around any open
+  // batch.
+  bool get_state(const std::string &key, std::string &val) const;
+  void put_state(const std::string &key, const std::string &val);
+  void erase_state(const std::string &key);
+
+  // call fn(key, val) for every state record whose key starts with prefix
+  void for_each_state(
+      const std::string &prefix,
+      const std::function<void(const std::string &key,
+                               const std::string &val)> &fn) const;
+
+  // Don't check the proof of work of headers at or below this height,
+  // which the caller has already checked against a checkpoint (see
+  // HeaderSync). Zero turns this off. ALL_VALID skips the check for every
+  // header, orphans too, and all of check_header() but the checkpoints as
+  // well, which is only for benchmarks of synthetic headers.
+  static constexpr size_t ALL_VALID = SIZE_MAX;
+  inline void set_assume_valid(size_t height) { assume_valid_ = height; }
+
+  // how many orphans to hold, see OrphanPool
+  inline void set_max_orphans(size_t n) { orphans_.set_max_size(n); }
+
+  // Choose how writes are synced. This changes write_opts for every view.
+  void set_durability(Durability durability,
+                      std::chrono::milliseconds sync_interval);
+  inline Durability durability() const { return durability_; }
+
+  // Commit header batches on a ChainWriter thread, or go back to writing
+  // them on the chain's own, after what's pending is written. While on,
+  // shared_tip() is the tip as of the last write to finish.
+  void set_writer(bool on);
+
+  // Resize the decoded header cache, emptying it, or the RocksDB block
+  // cache, which is shared by every chain in the process, to about this
+  // many bytes.
+  void resize_header_cache(size_t bytes);
+  void resize_block_cache(size_t bytes);
+  size_t block_cache_size() const;
+
+  // Set a RocksDB option by the name SetOptions() knows it by, on every
+  // column family, or failing that SetDBOptions(). While bulk loading, the
+  // options it holds are only changed for when it ends. False, with the
+  // reason, if RocksDB won't take it.
+  bool set_db_option(const std::string &name, const std::string &value,
+                     std::string &error);
+
+  // For the initial sync, while the tip is far behind: writes skip the WAL
+  // (after a crash the headers lost are just synced again) and compactions
+  // wait. Leaving it flushes the memtables, compacts each column family
+  // once and goes back to the options set_durability() chose.
+  void set_bulk_load(bool bulk);
+  inline bool bulk_load() const { return bulk_load_; }
+
+  // Are RocksDB writes being slowed or stopped while compactions catch up?
+  // Any thread may ask. stalled(true) is called, on one of RocksDB's
+  // threads, when they start to be, and stalled(false) when none are.
+  inline bool write_stalled() const {
+    return stalled_families_.load(std::memory_order_relaxed) > 0;
+  }
+  void set_stall_callback(std::function<void(bool)> stalled);
+
   // is the tip recent?
   inline bool tip_is_recent(uint32_t seconds_cutoff = 3600) const {
     return tip_.age() < seconds_cutoff;
   }
 
+  // N.B. only for the chain's own thread; see shared_tip() for the others
   inline const BlockHeader &tip() const { return tip_; }
 
   inline size_t height() const { return tip_.height; }
 
+  // Every change of the tip is published here as it happens, including
+  // each header of a run that extends it; see tip_feed.h.
+  inline TipFeed &tip_feed() { return feed_; }
+  inline const TipFeed &tip_feed() const { return feed_; }
+
+  // The tip and its chainwork for other threads, e.g. workers and servers
+  // on loops of their own, which read it without locks while sync advances
+  // it. It's set once the index has loaded.
+  inline const TipSnapshot &shared_tip() const { return shared_tip_; }
+
+  // is the best chain kept in a BestChainStore?
+  inline bool has_store() const { return store_ != nullptr; }
+
+  // total work on the best chain
+  inline const uint256 &chainwork() const {
+    wait_index();
+    return index_.find(tip_.block_hash)->chainwork;
+  }
+
+  // headers waiting for their parent
+  inline size_t orphan_count() const { return orphans_.size(); }
+
+  // Append the memory used by the header index, the orphan pool, the
+  // header cache and RocksDB (its block cache, memtables and index and
+  // filter blocks), by name.
+  void memory_usage(
+      std::vector<std::pair<const char *, size_t> > &out) const;
+
   inline bool has_block(const hash_t &hash) const {
-    return hdr_view_.has_key(hash) || orphan_view_.has_key(hash);
+    wait_index();
+    return index_.contains(hash) || orphans_.contains(hash);
   }
 
+  // has_block() for each of n hashes, into out[i], batched as in
+  // HeaderIndex::find_many(); returns how many are known
+  size_t has_blocks(const hash_t *hashes, size_t n, bool *out) const;
+
   BlockHeader find(const hash_t &hash) const;
 
+  // Lookups straight from the header index, which neither decode headers
+  // nor touch the cache or the database, for QueryServer. They return
+  // nullptr for headers that aren't known, or heights above the tip.
+  inline const IndexEntry *index_entry(const hash_t &hash) const {
+    wait_index();
+    return index_.find(hash);
+  }
+  const IndexEntry *best_entry(size_t height) const;
+  bool on_best_chain(const IndexEntry &entry) const;
+
+  // What HeaderPresync needs of this header to check a chain forking from
+  // it, or false if it isn't in the index.
+  bool presync_anchor(const hash_t &hash, PresyncAnchor &anchor) const;
+
+  // Keep a HeaderMmr over the best chain in this file, caught up with the
+  // best chain once the index has loaded.
+  void open_mmr(const std::string &path);
+
+  // With open_mmr(), the proof (see HeaderMmr::prove()) that the header at
+  // this height is on the best chain of leaves headers, under root. False
+  // without an mmr, or for a height above the tip.
+  bool mmr_proof(size_t height, size_t &leaves, hash_t &root,
+                 std::vector<hash_t> &proof) const;
+
+  // Keep the mmr of chain_proof_leaf()s for FlyClient proofs in this file,
+  // caught up like open_mmr()'s.
+  void open_work_mmr(const std::string &path);
+
+  // With open_work_mmr(), a ChainProof of the best chain drawn with this
+  // many samples; false without the mmr or any headers.
+  bool chain_proof(size_t samples, ChainProof &proof) const;
+
+  // The lowest height of the best chain where the header, or one below it,
+  // has a timestamp of at least time, e.g. to rescan from a wallet's
+  // birthday; above the tip if there's none.
+  size_t height_at_time(uint32_t time) const;
+
+  inline const HeaderCache &header_cache() const { return cache_; }
+
+  // Call fn(hdr) for each header indexed at heights [from, to), in height
+  // order, using a single range scan of height_view_.
+  template <typename F>
+  void headers_in_range(size_t from, size_t to, F fn) const {
+    wait_index();
+    if (store_) {
+      for (size_t h = from; h < std::min(to, store_->size()); h++) {
+        fn(store_->header(h));
+      }
+      return;
+    }
+    height_view_.for_each_height(from, to, [&](size_t, const hash_t &hash) {
+      const IndexEntry *entry = index_.find(hash);
+      assert(entry != nullptr);
+      fn(entry->header());
+    });
+  }
+
+  // Add the headers in a file written by export_headers(), which may also
+  // pick up from a header that's already in the chain. Headers are hashed
+  // on every core, and each must link to the one before it and match any
+  // checkpoint at its height. Returns false, after adding the headers up to
+  // the first bad chunk, if the file can't be read or doesn't check out.
+  bool import_headers(const std::string &path);
+
+  // Write the best chain, from the genesis block to the tip, as 80-byte
+  // wire headers.
+  bool export_headers(const std::string &path) const;
+
+  // Write the headers on the best chain at heights [from, to), up to the
+  // tip, as a stream of length-delimited spv.proto BlockHeader messages;
+  // see proto.h.
+  bool export_proto(const std::string &path, size_t from = 0,
+                    size_t to = SIZE_MAX) const;
+
+  // Verification works on a snapshot, so the client can keep writing. The
+  // verify_*() methods only read the snapshot, so they can run on any
+  // thread; the others must run on the thread that owns the chain.
+  // With a ChainWriter, taking one waits for its writes.
+  const rocksdb::Snapshot *snapshot() const;
+  inline void release(const rocksdb::Snapshot *snap) const {
+    db_->ReleaseSnapshot(snap);
+  }
+
+  // Check that the hdr_view_ records whose encoded key starts with a byte
+  // in [first, last] hash to their key, and have a parent.
+  void verify_headers(const rocksdb::Snapshot *snap, uint8_t first,
+                      uint8_t last, VerifyResult &result) const;
+
+  // Check that height_view_ has every height in [from, to), each pointing
+  // at a header with that height whose parent is the one below it. Heights
+  // at or above end shouldn't be there at all.
+  void verify_heights(const rocksdb::Snapshot *snap, size_t from, size_t to,
+                      size_t end, VerifyResult &result) const;
+
+  // Drop the parentless headers that the index can place; what's left
+  // isn't connected to anything.
+  void check_parentless(VerifyResult &result) const;
+
+  // Rewrite bad records from the index, which is the authoritative copy.
+  // Returns the number of records fixed.
+  size_t repair(const VerifyResult &result);
+
+  // Build a block locator for getheaders: hashes going back from the tip,
+  // one per block for the first ten and then exponentially spaced, always
+  // ending with the genesis block.
+  std::vector<hash_t> locator() const;
+
+  // The same, going back from a header in the index along its own branch,
+  // which needn't be the best chain; e.g. the last header sent to someone,
+  // so that what's sent next starts from the fork after a reorg.
+  std::vector<hash_t> locator(const hash_t &from) const;
+
+  // Answer a getheaders: the best chain after the first locator hash on it
+  // (or from the genesis block), up to max headers and stopping at stop.
+  // With an empty locator, just the stop header. Served from the index.
+  std::vector<BlockHeader> headers_after(
+      const std::vector<hash_t> &locator, const hash_t &stop,
+      size_t max = MAX_HEADERS_RESULTS) const;
+
+  // The same headers as a complete, encoded headers message. This is
+  // copied straight from the wire bytes in the index, and recent replies
+  // are cached.
+  ReplyCache::Message headers_message(const std::vector<hash_t> &locator,
+                                      const hash_t &stop) const;
+
  private:
-  // N.B. There's a lot of RocksDB stuff in valgrind when code shuts down via a
-  // signal handler. This should be a raw pointer because RocksDB somehow
-  // atuomatically deletes any open DB handles, but the code here needs to be
-  // cleaned up to clearnly pass valgrind.
+  // The database, or nullptr once close() has run. It's a raw pointer so
+  // close() can free the column family handles before it, as RocksDB
+  // requires.
   rocksdb::DB *db_;
-  rocksdb::Transaction *tx_;
+
+  // Handles for the column families opened by the constructor: the default
+  // family (the tip and version keys), then headers and heights. These are
+  // freed by close().
+  std::vector<rocksdb::ColumnFamilyHandle *> families_;
+  std::shared_ptr<rocksdb::Cache> block_cache_;  // shared_block_cache()
+
+  // The best chain when using HeaderBackend::MMAP or LMDB, or nullptr.
+  // Headers off the best chain are still kept in hdr_view_.
+  std::unique_ptr<BestChainStore> store_;
+
+  // Pending writes for put_block_headers(), or nullptr.
+  std::unique_ptr<rocksdb::WriteBatchWithIndex> batch_;
+
+  // With set_writer(): the thread that commits batches, the writes handed
+  // to it that reads still have to see once batch_ is closed (which only
+  // starts over once the writer is idle), and the writes since the last
+  // hand-off, which are all it gets.
+  std::unique_ptr<ChainWriter> writer_;
+  std::unique_ptr<rocksdb::WriteBatchWithIndex> overlay_;
+  std::unique_ptr<rocksdb::WriteBatch> tail_;
 
   // The tip of the blockchain
   BlockHeader tip_;
 
-  // TODO: this could benefit from some caching. We probably want to cache the
-  // last N non-orphan headers (where N could be pretty small, possibly even
-  // just 1) and probably all of the orphans.
+  // Every non-orphan header, loaded from hdr_view_ at startup. This is the
+  // authoritative copy; the views below just persist it.
+  HeaderIndex index_;
+
+  // the best chain in index_ by height, kept up with tip_ by sync_best()
+  BestChain best_;
+
+  // committed to best_'s hashes, with open_mmr()
+  std::unique_ptr<HeaderMmr> mmr_;
+
+  // committed to best_'s hashes and chainwork, with open_work_mmr()
+  std::unique_ptr<HeaderMmr> work_mmr_;
+
+  // Loads index_ (and repairs store_) for load_index_async(). Nothing else
+  // touches either until wait_index() has joined it and set loaded_.
+  std::thread loader_;
+  bool loaded_;
+
+  // index.dat, and how many of index_'s entries it has
+  std::string image_path_;
+  size_t image_entries_;
+
+  // headers that don't connect to the index yet
+  OrphanPool orphans_;
+
+  // encoded replies for headers_message()
+  mutable ReplyCache replies_;
+
+  // decoded headers from the index
+  mutable HeaderCache cache_;
+
+  // tip changes, for subscribers; see tip_feed()
+  TipFeed feed_;
+
+  // tip_ as of the last sync_best(); see shared_tip()
+  TipSnapshot shared_tip_;
+
+  // see set_assume_valid()
+  size_t assume_valid_;
+
+  // The median time past window, ending at window_tip_. It follows a run
+  // of headers as they're inserted, and is only refilled from the index
+  // when a header doesn't follow the last one checked.
+  MedianTime window_;
+  hash_t window_tip_;
+
+  // see set_durability()
+  Durability durability_;
+  std::chrono::milliseconds sync_interval_;
+  std::chrono::steady_clock::time_point last_sync_;
+
+  // see set_bulk_load(); the options it changed, per column family, to put
+  // back when it's done
+  bool bulk_load_;
+  std::vector<std::unordered_map<std::string, std::string> > bulk_saved_;
+
+  // column families with stalled writes, see write_stalled()
+  std::atomic<int> stalled_families_;
+  std::mutex stall_mutex_;
+  std::function<void(bool)> stall_callback_;
+
+  // from StallListener, as a column family's writes stall or recover
+  void stall_changed(const std::string &family, bool was, bool is);
+
   TableView hdr_view_;
-  TableView orphan_view_;
   TableView height_view_;
 
   void add_genesis_block();
 
+  // Upgrade the on-disk format of an existing database, if needed.
+  void migrate();
+
+  // The steps of migrate(), from versions 0, 1 and 2 respectively.
+  void migrate_height_keys();
+  void migrate_column_families();
+  void migrate_compact_headers();
+
+  // Delete orphans persisted by older versions; they're kept in memory now.
+  void drop_persisted_orphans();
+
+  // Populate the index from the image, or failing that from store_ (if
+  // any) and hdr_view_.
+  void load_index();
+
+  // Load the image and the best chain's headers past it, returning false
+  // if it's missing, bad, or no longer on the best chain.
+  bool read_index_image();
+
+  // The tip, read without the index: the last header in store_, or the one
+  // tip_key names. Returns an empty header if there isn't one.
+  BlockHeader read_tip() const;
+
+  // Copy the best chain from height_view_ into an empty store_.
+  void fill_store();
+
+  // The heights (start, last] of the best chain that answer a getheaders,
+  // see headers_after(). Returns the index slot at last, or no_slot if the
+  // range is empty.
+  HeaderIndex::slot_t reply_range(const std::vector<hash_t> &locator,
+                                  const hash_t &stop, size_t max,
+                                  size_t &start, size_t &last) const;
+
+  // Find the hash on the best chain at this height.
+  hash_t find_hash(size_t height, bool &found) const;
+
+  // Check a header with the header in this slot as its parent: its hash
+  // against any checkpoint at its height (even with ALL_VALID), its nBits
+  // against the retarget rules, and its timestamp against the median time
+  // past and MAX_FUTURE_BLOCK_TIME past adjusted_time(). Logs the header if
+  // it fails. If it passes, window_ moves on to it.
+  bool check_header(const BlockHeader &hdr, HeaderIndex::slot_t parent);
+
+  // Load window_ with the timestamps of the header in this slot and up to
+  // ten of its ancestors.
+  void fill_window(HeaderIndex::slot_t slot);
+
+  // Persist a header that has a known height, and add it to the index.
+  void add_header(const BlockHeader &hdr);
+
   // Get the block at the tip.
   BlockHeader find_tip();
 
-  // If there is an orphan of this header, attach it.
-  bool attach_orphan(const BlockHeader &hdr);
+  // Attach every orphan descending from this header, without recursing.
+  void attach_orphans(const BlockHeader &hdr);
+
+  // Bring best_ up to date with tip_, which only has to walk back as far
+  // as the fork of a reorg.
+  void sync_best();
 
-  // Try to update the tip.
+  // rewind mmr_ and work_mmr_ to where they agree with best_, and append
+  // the rest
+  void sync_mmr();
+
+  // Make this header the tip if its chain has more work than the tip's.
   void update_tip(const BlockHeader &hdr);
 
+  // Switch the best chain over to the branch ending at hdr, returning the
+  // height of the fork.
+  size_t reorganize(const BlockHeader &hdr);
+
+  // Start buffering all writes in batch_, which with a writer picks up
+  // where the overlay left off.
+  void begin_batch();
+
+  // Atomically write everything buffered since begin_batch(), or with a
+  // writer, hand it over to be written.
+  void commit_batch();
+
+  // Should the WAL be synced after this write? With Durability::PERIODIC,
+  // that's once per sync_interval_.
+  bool wal_sync_due();
+
+  // point the views' overlay at whichever of batch_ and overlay_ is open
+  void set_overlay();
+
   inline void initialize_views() {
     assert(db_ != nullptr);
-    hdr_view_.set_db(db_);
-    orphan_view_.set_db(db_);
-    height_view_.set_db(db_);
+    assert(families_.size() == 3);
+    hdr_view_.set_db(db_, families_[1]);
+    height_view_.set_db(db_, families_[2]);
   }
 
  protected:
-  Chain(const std::string &datadir);
+  Chain(const std::string &datadir,
+        HeaderBackend backend = HeaderBackend::ROCKSDB,
+        size_t block_cache_size = 32 << 20,
+        size_t header_cache_size = 4 << 20, size_t background_jobs = 2,
+        size_t write_rate = 0);
 };
 }  // namespace spv
@@ -0,0 +1,503 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+// A benchmark of the header storage in Chain, with synthetic workloads:
+//
+//   chain_bench [-n headers] [-r reorg depth] [-d dir] [-i prefix] [name]
+//
+// Each workload runs on a fresh chain with each header backend, rocksdb,
+// mmap (the flat file of the best chain) and, when built with --enable-lmdb,
+// lmdb:
+//
+//   linear    put_block_header() in order, as an initial sync adds them
+//   batch     the same in put_block_headers() calls of a headers message
+//   shuffled  headers-message sized runs arriving in random order within a
+//             window, so most headers are orphans until their parent shows up
+//   reorg     forks below the tip that overtake the best chain, again and
+//             again; the put that switches chains is also timed on its own
+//   lookup    find() and has_block() of random known hashes, has_block() of
+//             unknown ones, and headers_in_range() of single random heights
+//   reorgs    with -i, prefix.reorgs in headers-message sized runs, which
+//             switch chains at each fork and back; those puts are also
+//             timed on their own
+//
+// The best chain is -n headers made up here, or with -i, prefix.headers as
+// written by spv-gen-chain (see gen_chain.cc), for the default network.
+// Every call is timed, and the p50, p99 and worst latencies are printed.
+// Writes also get their write amplification: the bytes the process wrote to
+// storage (write_bytes in /proc/self/io, which counts pages as they are
+// dirtied, so RocksDB's background flushes and the mapped store are in it)
+// per 80 bytes of header added. A tmpfs doesn't count, so point -d at a real
+// disk to get it. The memtables RocksDB still has at the end aren't flushed,
+// since the chain never closes its database. With a name, only the
+// workloads whose names contain it are run.
+//
+// The headers aren't mined, so proof of work checks are off (see
+// Chain::ALL_VALID) and there are no checkpoints.
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "./chain.h"
+#include "./constants.h"
+#include "./fields.h"
+#include "./fs.h"
+#include "./hashmap.h"
+#include "./lmdb_store.h"
+#include "./logging.h"
+#include "./pow.h"
+#include "./settings.h"
+
+using namespace spv;
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+// headers-message sized runs are shuffled within this many of them, which
+// keeps the orphans well inside the OrphanPool
+const size_t shuffle_window = 8;
+
+// how many times the reorg workload switches chains
+const size_t reorg_rounds = 20;
+
+// the constructor is only open to subclasses (and the client)
+struct BenchChain : Chain {
+  BenchChain(const std::string &datadir, HeaderBackend backend)
+      : Chain(datadir, backend, 32 << 20, 4 << 20) {
+    set_assume_valid(ALL_VALID);
+  }
+};
+
+const char *backend_name(HeaderBackend backend) {
+  switch (backend) {
+    case HeaderBackend::ROCKSDB:
+      break;
+    case HeaderBackend::MMAP:
+      return "mmap";
+    case HeaderBackend::LMDB:
+      return "lmdb";
+  }
+  return "rocksdb";
+}
+
+// bytes written to storage so far, or 0 if the kernel doesn't say
+uint64_t written_bytes() {
+  std::ifstream io("/proc/self/io");
+  std::string key;
+  uint64_t val;
+  while (io >> key >> val) {
+    if (key == "write_bytes:") {
+      return val;
+    }
+  }
+  return 0;
+}
+
+uint64_t sink;  // lookups feed this, so they aren't optimized out
+
+// Latencies of one kind of call, in nanoseconds.
+class Samples {
+ public:
+  explicit Samples(const std::string &op) : op_(op) {}
+
+  template <typename F>
+  inline void time(F fn) {
+    const auto start = Clock::now();
+    fn();
+    const std::chrono::duration<double, std::nano> ns = Clock::now() - start;
+    ns_.push_back(ns.count());
+  }
+
+  // Print a row of the results. Writes have the header bytes they added,
+  // and the growth of written_bytes() while they ran.
+  void print(const char *backend, const char *workload,
+             uint64_t logical = 0, uint64_t written = 0) {
+    if (ns_.empty()) {
+      return;
+    }
+    std::sort(ns_.begin(), ns_.end());
+    auto at = [&](double q) {
+      return ns_[std::min(ns_.size() - 1, size_t(q * ns_.size()))] / 1e3;
+    };
+    std::printf("%-8s %-9s %-12s %8zu %9.2f %9.2f %10.1f", backend, workload,
+                op_.c_str(), ns_.size(), at(0.5), at(0.99), ns_.back() / 1e3);
+    if (logical && written) {
+      std::printf(" %9.2f", double(written) / logical);
+    } else if (logical) {
+      std::printf(" %9s", "-");
+    }
+    std::printf("\n");
+  }
+
+ private:
+  std::string op_;
+  std::vector<double> ns_;
+};
+
+// Make n headers extending parent. Forks are told apart by their salt,
+// which goes in the merkle root.
+std::vector<BlockHeader> make_headers(const BlockHeader &parent, size_t n,
+                                      uint32_t salt) {
+  std::vector<BlockHeader> hdrs(n);
+  const BlockHeader *prev = &parent;
+  char raw[BLOCK_HEADER_SIZE];
+  for (size_t i = 0; i < n; i++) {
+    BlockHeader &hdr = hdrs[i];
+    hdr.version = 0x20000000;
+    hdr.prev_block = prev->block_hash;
+    std::memcpy(hdr.merkle_root.data(), &salt, sizeof salt);
+    hdr.timestamp = prev->timestamp + 600;
+    hdr.difficulty = parent.difficulty;
+    hdr.nonce = static_cast<uint32_t>(i);
+    hdr.height = prev->height + 1;
+    hdr.pack(raw);
+    hdr.block_hash = pow_hash(raw, sizeof raw, true);
+    prev = &hdr;
+  }
+  return hdrs;
+}
+
+// Read a file of 80-byte headers that starts at the genesis block, and
+// give them their hashes and heights; a header's parent has to come before
+// it. The genesis block is left out.
+bool read_headers(const std::string &path, std::vector<BlockHeader> &hdrs) {
+  std::ifstream in(path, std::ios::binary);
+  std::string raw((std::istreambuf_iterator<char>(in)),
+                  std::istreambuf_iterator<char>());
+  const size_t n = raw.size() / BLOCK_HEADER_SIZE;
+  if (!in.eof() || n < 2 || raw.size() % BLOCK_HEADER_SIZE) {
+    std::fprintf(stderr, "%s isn't a file of 80-byte headers\n",
+                 path.c_str());
+    return false;
+  }
+  std::vector<hash_t> hashes(n);
+  pow_hash_batch(raw.data(), BLOCK_HEADER_SIZE, n, hashes.data());
+  if (hashes[0] != BlockHeader::genesis().block_hash) {
+    std::fprintf(stderr, "%s doesn't start at the genesis block\n",
+                 path.c_str());
+    return false;
+  }
+  FlatHashMap<hash_t, uint32_t> heights;
+  heights.reserve(n);
+  heights.emplace(hashes[0], 0);
+  hdrs.resize(n - 1);
+  for (size_t i = 1; i < n; i++) {
+    BlockHeader &hdr = hdrs[i - 1];
+    hdr.unpack(&raw[i * BLOCK_HEADER_SIZE]);
+    hdr.block_hash = hashes[i];
+    const uint32_t *parent = heights.find(hdr.prev_block);
+    if (parent == nullptr) {
+      std::fprintf(stderr, "header %zu of %s comes before its parent\n", i,
+                   path.c_str());
+      return false;
+    }
+    hdr.height = *parent + 1;
+    heights.emplace(hdr.block_hash, hdr.height);
+  }
+  return true;
+}
+
+// add hdrs to the chain a headers message at a time, untimed
+void fill(Chain &chain, const std::vector<BlockHeader> &hdrs) {
+  for (size_t i = 0; i < hdrs.size(); i += MAX_HEADERS_RESULTS) {
+    const size_t end = std::min(hdrs.size(), i + MAX_HEADERS_RESULTS);
+    chain.put_block_headers({hdrs.begin() + i, hdrs.begin() + end});
+  }
+}
+
+struct Options {
+  size_t headers = 100000;
+  size_t depth = 100;
+  std::string dir = "/tmp";
+  std::string input;  // prefix of spv-gen-chain files
+  const char *filter = nullptr;
+};
+
+class Bench {
+ public:
+  Bench(const Options &opts, const std::string &root,
+        std::vector<BlockHeader> &&main, std::vector<BlockHeader> &&reorgs)
+      : opts_(opts),
+        root_(root),
+        runs_(0),
+        rng_(1),
+        main_(std::move(main)),
+        reorgs_(std::move(reorgs)) {}
+
+  void run(HeaderBackend backend) {
+    backend_ = backend;
+    workload("linear", [&](Chain &chain) { linear(chain); });
+    workload("batch", [&](Chain &chain) { batch(chain); });
+    workload("shuffled", [&](Chain &chain) { shuffled(chain); });
+    workload("reorg", [&](Chain &chain) { reorg(chain); });
+    workload("lookup", [&](Chain &chain) { lookup(chain); });
+    if (!reorgs_.empty()) {
+      workload("reorgs", [&](Chain &chain) { reorgs(chain); });
+    }
+  }
+
+ private:
+  const Options &opts_;
+  const std::string root_;
+  size_t runs_;
+  std::mt19937_64 rng_;
+  std::vector<BlockHeader> main_;  // the best chain, after the genesis block
+  std::vector<BlockHeader> reorgs_;  // the same with forks, from -i
+  HeaderBackend backend_;
+  const char *name_;
+  uint64_t written_;  // written_bytes() when the workload started
+
+  // run fn on a fresh chain in its own directory
+  void workload(const char *name, const std::function<void(Chain &)> &fn) {
+    if (opts_.filter != nullptr && std::strstr(name, opts_.filter) == nullptr) {
+      return;
+    }
+    name_ = name;
+    // The chain doesn't close its database, so each run needs a new path.
+    const std::string datadir = root_ + "/run" + std::to_string(runs_++);
+    {
+      BenchChain chain(datadir, backend_);
+      written_ = written_bytes();
+      fn(chain);
+    }
+    recursive_delete(datadir);
+  }
+
+  // written_bytes() since the workload started
+  uint64_t written() const { return written_bytes() - written_; }
+
+  void linear(Chain &chain) {
+    Samples puts("put");
+    for (const auto &hdr : main_) {
+      puts.time([&] { chain.put_block_header(hdr); });
+    }
+    assert(chain.height() == main_.size());
+    puts.print(backend_name(backend_), name_,
+               main_.size() * BLOCK_HEADER_SIZE, written());
+  }
+
+  void batch(Chain &chain) {
+    Samples puts("put_batch");
+    for (size_t i = 0; i < main_.size(); i += MAX_HEADERS_RESULTS) {
+      const size_t end = std::min(main_.size(), i + MAX_HEADERS_RESULTS);
+      const std::vector<BlockHeader> msg(main_.begin() + i,
+                                         main_.begin() + end);
+      puts.time([&] { chain.put_block_headers(msg); });
+    }
+    assert(chain.height() == main_.size());
+    puts.print(backend_name(backend_), name_,
+               main_.size() * BLOCK_HEADER_SIZE, written());
+  }
+
+  void shuffled(Chain &chain) {
+    std::vector<size_t> runs;
+    for (size_t i = 0; i < main_.size(); i += MAX_HEADERS_RESULTS) {
+      runs.push_back(i);
+    }
+    for (size_t i = 0; i < runs.size(); i += shuffle_window) {
+      std::shuffle(runs.begin() + i,
+                   runs.begin() + std::min(runs.size(), i + shuffle_window),
+                   rng_);
+    }
+    Samples puts("put");
+    for (size_t start : runs) {
+      const size_t end = std::min(main_.size(), start + MAX_HEADERS_RESULTS);
+      for (size_t i = start; i < end; i++) {
+        puts.time([&] { chain.put_block_header(main_[i]); });
+      }
+    }
+    assert(chain.height() == main_.size());
+    puts.print(backend_name(backend_), name_,
+               main_.size() * BLOCK_HEADER_SIZE, written());
+  }
+
+  void reorg(Chain &chain) {
+    std::vector<BlockHeader> best = main_;
+    fill(chain, best);
+    const uint64_t base = written_bytes();
+    const size_t depth = std::min(opts_.depth, best.size() - 1);
+    Samples puts("put"), switches("switch");
+    size_t added = 0;
+    for (size_t round = 1; round <= reorg_rounds; round++) {
+      // Fork below the last depth headers. The fork's header at depth has
+      // more work than the tip, so adding it switches chains.
+      const size_t fork = best.size() - 1 - depth;
+      const auto hdrs = make_headers(best[fork], depth + 1, round);
+      for (size_t i = 0; i < hdrs.size(); i++) {
+        (i == depth ? switches : puts).time([&] {
+          chain.put_block_header(hdrs[i]);
+        });
+      }
+      assert(chain.tip().block_hash == hdrs.back().block_hash);
+      best.resize(fork + 1);
+      best.insert(best.end(), hdrs.begin(), hdrs.end());
+      added += hdrs.size();
+    }
+    puts.print(backend_name(backend_), name_, added * BLOCK_HEADER_SIZE,
+               written_bytes() - base);
+    switches.print(backend_name(backend_), name_);
+  }
+
+  void reorgs(Chain &chain) {
+    Samples puts("put_batch"), switches("switch");
+    for (size_t i = 0; i < reorgs_.size();) {
+      // a run ends where a fork starts or ends, or at a message's worth
+      size_t end = i + 1;
+      while (end < reorgs_.size() && end - i < MAX_HEADERS_RESULTS &&
+             reorgs_[end].prev_block == reorgs_[end - 1].block_hash) {
+        end++;
+      }
+      const std::vector<BlockHeader> msg(reorgs_.begin() + i,
+                                         reorgs_.begin() + end);
+      // one that doesn't extend the tip is a fork with more work than it,
+      // or the best chain overtaking the fork again
+      const bool extends = chain.tip().block_hash == msg.front().prev_block;
+      (extends ? puts : switches).time([&] {
+        chain.put_block_headers(msg);
+      });
+      i = end;
+    }
+    assert(chain.tip().block_hash == main_.back().block_hash);
+    puts.print(backend_name(backend_), name_,
+               reorgs_.size() * BLOCK_HEADER_SIZE, written());
+    switches.print(backend_name(backend_), name_);
+  }
+
+  void lookup(Chain &chain) {
+    fill(chain, main_);
+    const size_t n = std::max<size_t>(main_.size(), 100000);
+    std::uniform_int_distribution<size_t> pick(0, main_.size() - 1);
+    Samples finds("find"), hits("has_block"), misses("has_block_no"),
+        heights("by_height");
+    for (size_t i = 0; i < n; i++) {
+      const BlockHeader &hdr = main_[pick(rng_)];
+      finds.time([&] { sink += chain.find(hdr.block_hash).nonce; });
+    }
+    for (size_t i = 0; i < n; i++) {
+      const BlockHeader &hdr = main_[pick(rng_)];
+      hits.time([&] { sink += chain.has_block(hdr.block_hash); });
+    }
+    for (size_t i = 0; i < n; i++) {
+      hash_t hash;  // random, so as good as never a known one
+      for (auto &b : hash) {
+        b = static_cast<uint8_t>(rng_());
+      }
+      misses.time([&] { sink += chain.has_block(hash); });
+    }
+    for (size_t i = 0; i < n; i++) {
+      const size_t height = pick(rng_) + 1;
+      heights.time([&] {
+        chain.headers_in_range(height, height + 1,
+                               [&](const BlockHeader &hdr) {
+                                 sink += hdr.nonce;
+                               });
+      });
+    }
+    const char *backend = backend_name(backend_);
+    finds.print(backend, name_);
+    hits.print(backend, name_);
+    misses.print(backend, name_);
+    heights.print(backend, name_);
+  }
+};
+
+void usage(const char *prog) {
+  std::fprintf(stderr, "usage: %s [-n headers] [-r reorg depth] [-d dir] "
+               "[-i prefix] [name]\n", prog);
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options opts;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:d:i:h")) != -1) {
+    switch (opt) {
+      case 'n':
+        opts.headers = std::strtoul(optarg, nullptr, 10);
+        break;
+      case 'r':
+        opts.depth = std::strtoul(optarg, nullptr, 10);
+        break;
+      case 'd':
+        opts.dir = optarg;
+        break;
+      case 'i':
+        opts.input = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind < argc) {
+    opts.filter = argv[optind];
+  }
+  if (opts.headers < 2) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  // the reorg workload logs every switch
+  spdlog::set_level(spdlog::level::err);
+
+  std::vector<BlockHeader> main, reorgs;
+  if (opts.input.empty()) {
+    main = make_headers(BlockHeader::genesis(), opts.headers, 0);
+  } else {
+    const std::string forks = opts.input + ".reorgs";
+    if (!read_headers(opts.input + ".headers", main) ||
+        (access(forks.c_str(), F_OK) == 0 && !read_headers(forks, reorgs))) {
+      return 1;
+    }
+    opts.headers = main.size();
+  }
+
+  std::string root = opts.dir + "/chain-bench.XXXXXX";
+  if (mkdtemp(&root[0]) == nullptr) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  const std::string checkpoints = root + "/checkpoints";
+  std::ofstream(checkpoints).close();
+  if (!load_checkpoints(checkpoints)) {
+    std::fprintf(stderr, "failed to clear the checkpoints\n");
+    recursive_delete(root);
+    return 1;
+  }
+
+  std::printf("%zu headers, reorgs %zu deep\n", opts.headers, opts.depth);
+  std::printf("%-8s %-9s %-12s %8s %9s %9s %10s %9s\n", "backend", "workload",
+              "op", "calls", "p50 us", "p99 us", "max us", "write amp");
+  Bench bench(opts, root, std::move(main), std::move(reorgs));
+  bench.run(HeaderBackend::ROCKSDB);
+  bench.run(HeaderBackend::MMAP);
+  if (lmdb_available) {
+    bench.run(HeaderBackend::LMDB);
+  }
+  recursive_delete(root);
+  return 0;
+}
@@ -0,0 +1,162 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./chain_writer.h"
+
+#include <endian.h>
+
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "./affinity.h"
+#include "./cpu_time.h"
+#include "./memory.h"
+#include "./metrics.h"
+
+namespace spv {
+// A batch's serialized form, which is also its WAL record, is a sequence
+// number (filled in by Write()) and a count of the records, then the
+// records themselves.
+static const size_t batch_header_size = 12;
+static const size_t batch_count_offset = 8;
+
+// One batch with the records of all of these, in order.
+static std::unique_ptr<rocksdb::WriteBatch> concat(
+    std::vector<std::unique_ptr<rocksdb::WriteBatch> > &batches) {
+  if (batches.size() == 1) {
+    return std::move(batches[0]);
+  }
+  size_t size = batch_header_size;
+  uint32_t count = 0;
+  for (const auto &batch : batches) {
+    size += batch->GetDataSize() - batch_header_size;
+    count += batch->Count();
+  }
+  std::string rep;
+  rep.reserve(size);
+  rep.append(batches[0]->Data(), 0, batch_header_size);
+  for (const auto &batch : batches) {
+    rep.append(batch->Data(), batch_header_size, std::string::npos);
+  }
+  count = htole32(count);
+  std::memcpy(&rep[batch_count_offset], &count, sizeof count);
+  return std::unique_ptr<rocksdb::WriteBatch>(
+      new rocksdb::WriteBatch(std::move(rep)));
+}
+
+ChainWriter::ChainWriter(rocksdb::DB *db, TipSnapshot &tip)
+    : db_(db),
+      tip_(tip),
+      submitted_(0),
+      written_(0),
+      queued_(0),
+      stop_(false) {
+  thread_ = std::thread([this]() { run(); });
+}
+
+ChainWriter::~ChainWriter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wakeup_.notify_one();
+  thread_.join();
+}
+
+void ChainWriter::submit(std::unique_ptr<rocksdb::WriteBatch> batch,
+                         const BlockHeader &tip, const uint256 &chainwork,
+                         const rocksdb::WriteOptions &opts, bool sync_wal) {
+  Job job;
+  job.batch = std::move(batch);
+  job.tip = tip;
+  job.chainwork = chainwork;
+  job.opts = opts;
+  job.sync_wal = sync_wal;
+  jobs_.push(std::move(job));
+  submitted_++;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queued_++;
+  }
+  wakeup_.notify_one();
+}
+
+void ChainWriter::flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [this]() {
+    return written_.load(std::memory_order_acquire) == submitted_;
+  });
+}
+
+void ChainWriter::run() {
+  place_thread(ThreadGroup::CHAIN);
+  HeapScope scope(HeapTag::CHAIN);
+  CpuScope cpu(CpuTag::STORAGE);
+  uint64_t taken = 0;
+  std::vector<std::unique_ptr<rocksdb::WriteBatch> > batches;
+  for (;;) {
+    uint64_t queued;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      wakeup_.wait(lock, [&]() { return stop_ || queued_ != taken; });
+      if (queued_ == taken) {
+        return;  // stopping, and everything is written
+      }
+      queued = queued_;
+    }
+
+    // every job queued by now goes in this write, with the newest job's
+    // options, syncing if any of them asked to
+    Job job;
+    bool sync = false, sync_wal = false;
+    for (; taken < queued; taken++) {
+      // the push of every job counted in queued_ has finished
+      const bool popped = jobs_.pop(job);
+      assert(popped);
+      (void)popped;
+      batches.push_back(std::move(job.batch));
+      sync = sync || job.opts.sync;
+      sync_wal = sync_wal || job.sync_wal;
+    }
+    const size_t n = batches.size();
+    const std::unique_ptr<rocksdb::WriteBatch> batch = concat(batches);
+    batches.clear();
+    rocksdb::WriteOptions opts = job.opts;
+    opts.sync = sync;
+    rocksdb::Status s;
+    {
+      ScopedLatency timer(metrics().db_write);
+      s = db_->Write(opts, batch.get());
+      if (s.ok() && sync_wal) {
+        s = db_->SyncWAL();
+      }
+    }
+    assert(s.ok());
+    metrics().db_group_commits.add();
+    metrics().db_group_batches.add(n);
+
+    tip_.store(job.tip, job.chainwork);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      written_.store(taken, std::memory_order_release);
+    }
+    done_.notify_all();
+  }
+}
+}  // namespace spv
@@ -0,0 +1,94 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <rocksdb/db.h>
+#include <rocksdb/write_batch.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "./fields.h"
+#include "./io.h"
+#include "./tip_feed.h"
+#include "./uint256.h"
+
+namespace spv {
+// Commits a chain's header batches to RocksDB on a thread of its own (with
+// --chain-writer), so that the thread that owns the chain never waits on a
+// write or a WAL sync. The chain hands each batch over with submit() and
+// carries on, reading its writes back from an overlay until they're in the
+// database (see Chain::begin_batch()). Batches that queue up while a write
+// is in progress all go out in the next one, a group commit, so the number
+// of writes follows how fast the disk takes them rather than how many peers
+// are sending headers. After each write the chain's TipSnapshot gets the
+// tip it made durable, so other threads only see tips that are stored.
+class ChainWriter {
+ public:
+  ChainWriter(rocksdb::DB *db, TipSnapshot &tip);
+  ChainWriter(const ChainWriter &other) = delete;
+
+  // writes what's queued, then stops the thread
+  ~ChainWriter();
+
+  // Queue a batch, on the chain's thread. tip and chainwork are the
+  // chain's after it, opts are the write options to commit it with, and
+  // sync_wal says to sync the WAL once it's written.
+  void submit(std::unique_ptr<rocksdb::WriteBatch> batch,
+              const BlockHeader &tip, const uint256 &chainwork,
+              const rocksdb::WriteOptions &opts, bool sync_wal);
+
+  // Has everything submitted been written? On the chain's thread.
+  inline bool idle() const {
+    return written_.load(std::memory_order_acquire) == submitted_;
+  }
+
+  // wait until everything submitted has been written
+  void flush();
+
+ private:
+  struct Job {
+    std::unique_ptr<rocksdb::WriteBatch> batch;
+    BlockHeader tip;
+    uint256 chainwork;
+    rocksdb::WriteOptions opts;
+    bool sync_wal;
+  };
+
+  rocksdb::DB *const db_;
+  TipSnapshot &tip_;
+  MpscQueue<Job> jobs_;
+  uint64_t submitted_;  // only touched by the chain's thread
+  std::atomic<uint64_t> written_;
+
+  // The thread sleeps on wakeup_ until queued_ passes the jobs it has
+  // taken, and flush() on done_ until written_ catches up.
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::condition_variable done_;
+  uint64_t queued_;
+  bool stop_;
+  std::thread thread_;
+
+  void run();
+};
+}  // namespace spv
@@ -0,0 +1,101 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+// A micro-benchmark of the BIP324 cipher suite on header sync's traffic:
+//
+//   cipher_bench [messages] [message bytes]
+//
+// The default message is a full headers reply, 2000 headers of 81 bytes.
+// Sealing and opening it as a v2 packet are compared with the v1 checksum
+// of the same payload, which is what a v1 connection spends on it.
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "./chacha20.h"
+#include "./logging.h"
+#include "./sha256.h"
+
+using namespace spv;
+
+static double elapsed_ns(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+static void report(const char *name, double ns, size_t messages,
+                   size_t size) {
+  std::printf("%-12s %8.1f us/message, %6.2f GB/s\n", name,
+              ns / messages / 1000, double(messages) * size / ns);
+}
+
+int main(int argc, char **argv) {
+  const size_t messages = argc > 1 ? std::stoul(argv[1]) : 2000;
+  const size_t size = argc > 2 ? std::stoul(argv[2]) : 3 + 2000 * 81;
+  spdlog::set_level(spdlog::level::debug);  // show the chosen backend
+
+  std::mt19937_64 rng(1);
+  uint8_t key[ChaCha20::KEY_SIZE];
+  for (auto &b : key) {
+    b = static_cast<uint8_t>(rng());
+  }
+  std::vector<uint8_t> plain(size), sealed(size + Poly1305::TAG_SIZE);
+  for (auto &b : plain) {
+    b = static_cast<uint8_t>(rng());
+  }
+  std::printf("%zu messages of %zu bytes, chacha20 backend %s\n", messages,
+              size, chacha20_backend());
+
+  uint8_t digest[32];
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < messages; i++) {
+    sha256::double_hash(plain.data(), size, digest);
+  }
+  report("v1 checksum", elapsed_ns(start), messages, size);
+
+  ChaCha20 chacha(key);
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < messages; i++) {
+    chacha.crypt(plain.data(), sealed.data(), size);
+  }
+  report("chacha20", elapsed_ns(start), messages, size);
+
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < messages; i++) {
+    Poly1305 poly(key);
+    poly.update(plain.data(), size);
+    poly.finish(digest);
+  }
+  report("poly1305", elapsed_ns(start), messages, size);
+
+  FSChaCha20Poly1305 send(key), recv(key);
+  size_t failed = 0;
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < messages; i++) {
+    send.seal(nullptr, 0, plain.data(), size, sealed.data());
+    failed += !recv.open(nullptr, 0, sealed.data(), sealed.size(),
+                         sealed.data());
+  }
+  report("seal+open", elapsed_ns(start), messages, size);
+  if (failed) {
+    std::printf("%zu message(s) failed to open\n", failed);
+  }
+  return failed != 0 || digest[0] == 42;
+}
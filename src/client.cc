@@ -16,327 +16,2903 @@
 
 #include "./client.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
+#include <sstream>
 
+#include "./eventlog.h"
+#include "./eviction.h"
+#include "./gcs.h"
+#include "./hd_wallet.h"
 #include "./logging.h"
+#include "./memory.h"
+#include "./metrics.h"
+#include "./pow.h"
+#include "./presync.h"
+#include "./socks5.h"
 #include "./uvw.h"
 
 namespace spv {
 MODULE_LOGGER
 
-static const std::chrono::seconds HEADER_TIMEOUT{19};
-static const std::chrono::seconds NO_REPEAT{0};
+// bounds of the adaptive getheaders timeout, see header_timeout()
+static const std::chrono::milliseconds MIN_HEADER_TIMEOUT{2000};
+static const std::chrono::milliseconds HEADER_TIMEOUT{19000};
 
-// copied from chainparams.cpp
-static const std::vector<std::string> testSeeds = {
-    "testnet-seed.bitcoin.jonasschnelli.ch", "seed.tbtc.petertodd.org",
-    "testnet-seed.bluematt.me",
-};
+// how long a peer gets to answer a compact filter request
+static const std::chrono::seconds CF_TIMEOUT{30};
+
+// mirror jobs given up in a row before the peers sync on their own
+static const size_t MIRROR_MAX_FAILURES = 3;
+
+// how long the saved peers get to produce a connection before the DNS
+// seeds are queried anyway
+static const std::chrono::seconds SEED_FALLBACK{5};
+
+// how often the peer table is saved
+static const std::chrono::minutes PEERS_SAVE_INTERVAL{5};
+
+// new headers that make the save timer rewrite the header index image
+static const size_t INDEX_IMAGE_GROWTH = 100000;
+
+// random picks random_connection() tries before it scans the peers
+static const size_t RANDOM_CONNECTION_PICKS = 4;
+
+// how long a getaddr reply is reused for, see addr_message()
+static const std::chrono::minutes ADDR_CACHE_TIME{30};
+
+// how often the resident set is checked against --memory-budget-mb
+static const std::chrono::minutes MEMORY_CHECK_INTERVAL{1};
+
+// how long to wait before reconnecting to a --connect peer
+static const std::chrono::seconds CONNECT_RETRY{1};
+
+// how often the in-flight invs are checked, and how long a peer gets to
+// answer a getdata before another one is asked
+static const std::chrono::seconds INV_SWEEP{10};
+static const std::chrono::seconds GETDATA_TIMEOUT{60};
+
+// transactions waiting for the next getdata batch, past which the peers'
+// tx invs are dropped, so a flood of them can't grow the batch unbounded
+static const size_t MAX_WANTED_TXS = 10000;
+
+// How often the block download is checked for stalls, how long the peer
+// with the window's first block gets to send it once it holds up the rest,
+// and how long any block request gets.
+static const std::chrono::seconds BLOCK_SWEEP{1};
+static const std::chrono::seconds BLOCK_STALL{5};
+static const std::chrono::seconds BLOCK_TIMEOUT{60};
+
+// loose transactions kept for rebuilding compact blocks
+static const size_t MAX_POOL_TXS = 5000;
+
+// Our transactions are announced to BROADCAST_PEERS peers at a time, and
+// every BROADCAST_SWEEP the ones announced over BROADCAST_RETRY ago that
+// fewer than BROADCAST_MIN_PEERS peers have fetched or announced back are
+// announced to more.
+static const size_t MAX_BROADCAST_TXS = 1000;
+static const size_t BROADCAST_PEERS = 4;
+static const size_t BROADCAST_MIN_PEERS = 2;
+static const std::chrono::seconds BROADCAST_SWEEP{30};
+static const std::chrono::seconds BROADCAST_RETRY{60};
+
+// How often our tip is checked against the peers', how many peers are
+// asked for the headers after it, and how many have to disagree with it
+// for the headers to be synced again; see TipCheck.
+static const std::chrono::minutes TIP_CHECK_INTERVAL{2};
+static const size_t TIP_CHECK_PEERS = 3;
+static const size_t TIP_CHECK_QUORUM = 2;
+
+// the recent blocks whose announcements are timed, in case a few are found
+// close together
+static const size_t ANNOUNCE_BLOCKS = 16;
+
+// how often the sync rate is sampled to pick the outbound peer count, long
+// enough for a new peer to connect and show in the rate; see PeerScaler
+static const std::chrono::seconds PEER_SCALE_INTERVAL{10};
+
+// Select the settings' network, which has to happen before chain_ is opened
+// with its genesis block.
+static const Settings &with_network(const Settings &settings) {
+  select_network(settings.network);
+  return settings;
+}
 
 Client::Client(const Settings &settings, std::shared_ptr<uvw::Loop> loop)
-    : settings_(settings),
+    : settings_(with_network(settings)),
+      tuning_(socket_tuning(settings_)),
+      timers_(loop),
+      io_(settings.io_threads ? new IoPool(settings.io_threads, loop)
+                              : nullptr),
+      ring_(settings.io_uring ? Ring::open(*loop) : nullptr),
+      watch_(settings.watch),
+      utxos_(watch_),
+      cfilter_height_(settings.filter_scan_from),
+      cf_request_(CfRequest::NONE),
+      cf_stop_(empty_hash),
+      cf_stop_height_(0),
+      rescan_started_(false),
+      blocks_(settings.block_window, settings.blocks_per_peer),
+      block_timer_(timers_),
+      broadcasts_(MAX_BROADCAST_TXS),
+      broadcast_timer_(timers_),
+      tx_pool_(MAX_POOL_TXS),
+      evict_key_(rand64()),
+      inv_timer_(timers_),
+      wanted_txs_(0),
+      getdata_timer_(timers_, [this]() {
+        LoopScope scope("timer", "getdata");
+        send_getdata();
+      }),
       shutdown_(false),
+      replaying_(false),
       need_headers_(true),
-      chain_(settings.datadir),
-      us_(rand64(), 0, settings.version, settings.user_agent),
-      loop_(loop) {}
+      seeded_(false),
+      last_af_(AF_UNSPEC),
+      chain_(settings.datadir, settings.header_backend,
+             settings.db_cache_mb << 20, settings.header_cache_mb << 20,
+             settings.db_background_jobs, settings.db_write_rate_mb << 20),
+      tip_check_(TIP_CHECK_QUORUM),
+      tip_timer_(timers_),
+      announces_(ANNOUNCE_BLOCKS),
+      scaler_(settings.min_connections, settings.max_connections),
+      scale_timer_(timers_),
+      validator_(loop,
+                 [this](const Addr &addr, std::vector<BlockHeader> &hdrs,
+                        bool ok, bool checked) {
+                   notify_validated(addr, hdrs, ok, checked);
+                 }),
+      block_verifier_(loop,
+                      [this](const Addr &addr, Block &block, bool ok) {
+                        notify_block_verified(addr, block, ok);
+                      }),
+      seeds_(loop, port(),
+             [this](const std::vector<Addr> &addrs) {
+               for (const Addr &addr : addrs) {
+                 addrman_.add(addr, addr);
+               }
+               connect_to_new_peer();
+             }),
+      seed_timer_(timers_),
+      save_timer_(timers_),
+      memory_timer_(timers_),
+      over_budget_(false),
+      retry_timer_(timers_),
+      us_(rand64(),
+          (settings.serve_filters ? NODE_COMPACT_FILTERS : 0) |
+              (settings.v2_transport ? NODE_P2P_V2 : 0),
+          settings.version, settings.user_agent),
+      loop_(loop) {
+  tick_clock();
+  send_limit_.set_rate(settings_.max_upload << 10);
+  recv_limit_.set_rate(settings_.max_download << 10);
+  chain_.set_durability(settings.durability, settings.sync_interval);
+  chain_.set_writer(settings.chain_writer);
+  chain_.set_max_orphans(settings.max_orphans);
+  index_queue_.reset(new LoopQueue(loop));
+  stall_queue_.reset(new LoopQueue(loop));
+  chain_.set_stall_callback([this](bool) {
+    stall_queue_->post([this]() { notify_write_stall(); });
+  });
+  chain_.load_index_async([this]() {
+    index_queue_->post([this]() { notify_index_loaded(); });
+  });
+  progress_.set_height(chain_.height());
+  if (settings.event_log_mb) {
+    event_log().open(settings.datadir + "/events.dat",
+                     settings.event_log_mb << 20);
+  }
+  if (!settings.capture_file.empty()) {
+    capture_.reset(new CaptureWriter);
+    if (!capture_->open(settings.capture_file)) {
+      capture_.reset();
+    }
+  }
+  if (settings.assume_valid && !checkpoints().empty()) {
+    chain_.set_assume_valid(checkpoints().rbegin()->first);
+  }
+  addrman_.load(peers_path());
+  seeds_.load(settings.datadir + "/seeds.dat");
+  if (!settings.xpubs.empty()) {
+    watch_wallet();
+  }
+  // reorgs roll the watched outputs back to the fork, before the new
+  // chain's blocks are scanned
+  chain_.tip_feed().subscribe([this](const TipEvent &ev) {
+    if (ev.reorg && !utxos_.empty()) {
+      utxos_.disconnect_to(ev.fork_height);
+      log->info("rolled watched outputs back to height {}, balance {} sat",
+                ev.fork_height, utxos_.confirmed());
+    }
+  });
+  if (settings.block_store_mb) {
+    block_store_.reset(new BlockStore(settings.datadir, chain_,
+                                      settings.block_store_mb << 20));
+  }
+  if (settings.compact_filters) {
+    cfheaders_.reset(
+        new FilterHeaderChain(settings.datadir + "/cfheaders.dat"));
+    if (settings.filter_store_mb) {
+      filter_store_.reset(new FilterStore(settings.datadir,
+                                          settings.filter_store_mb << 20));
+      if (settings.serve_filters) {
+        filter_server_.reset(
+            new FilterServer(chain_, *cfheaders_, *filter_store_));
+      }
+    }
+    if (!watch_.empty()) {
+      rescan_.reset(new Rescan(loop, chain_, *cfheaders_, watch_,
+                               filter_store_.get()));
+      rescan_->callbacks.match = [this](size_t height, const hash_t &hash) {
+        notify_rescan_match(height, hash);
+      };
+      rescan_->callbacks.bad_peer = [this](const Addr &addr) {
+        auto it = connections_.find(addr);
+        if (it != connections_.end()) {
+          it->second->misbehaving(Connection::MISBEHAVIOR_LIMIT,
+                                  "bad cfilters");
+        }
+      };
+      rescan_->callbacks.progress = [this]() { sync_rescan(); };
+    }
+  } else if (!watch_.empty()) {
+    filter_.reset(
+        new BloomFilter(watch_.size(), settings.bloom_fp_rate, rand64()));
+    for (const auto &data : watch_.elements()) {
+      filter_->insert(data);
+    }
+    log->info("watching {} element(s) with a {} byte bloom filter",
+              watch_.size(), filter_->size());
+  }
+  if (settings.mempool_mb) {
+    mempool_.reset(new MempoolTracker(settings.mempool_mb << 20));
+  }
+  if (!settings.proxy.empty()) {
+    parse_peer(settings.proxy, SOCKS_PORT, proxy_);  // checked already
+    log->info("connecting to peers through SOCKS5 proxy {}", proxy_);
+  }
+  for (const auto &peer : settings.connect) {
+    Addr addr;
+    if (parse_peer(peer, port(), addr)) {
+      connect_.push_back(addr);
+    } else {
+      log->error("ignoring --connect {}, which isn't ip[:port]", peer);
+    }
+  }
+  for (const auto &hex : settings.broadcast) {
+    std::string raw;
+    if (!from_hex(hex, raw) || !broadcast(raw)) {
+      log->error("ignoring --broadcast {}, which isn't a transaction", hex);
+    }
+  }
+}
+
+void Client::watch_wallet() {
+  const auto start = std::chrono::steady_clock::now();
+  HdWallet wallet;
+  for (const auto &xpub : settings_.xpubs) {
+    if (!wallet.add_account(xpub)) {
+      log->error("ignoring --xpub {}, which isn't a key on the curve", xpub);
+    }
+  }
+  std::vector<DerivedKey> keys;
+  wallet.derive(0, settings_.xpub_lookahead, keys);
+  // Compact filters are of whole output scripts, while bloom filters match
+  // what the scripts push.
+  for (const auto &key : keys) {
+    watch_.add(settings_.compact_filters ? key.script : key.hash);
+  }
+  const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  log->info("watching {} keys of {} account(s), derived in {} ms",
+            keys.size(), wallet.accounts(), elapsed.count());
+}
+
+void Client::watch(const std::string &data) {
+  if (!watch_.add(data) || !filter_) {
+    return;
+  }
+  filter_->insert(data);
+  if (data.size() > MAX_FILTERADD_SIZE) {
+    log->warn("watched element is too big for filteradd, only new peers "
+              "will match it");
+    return;
+  }
+  FilterAdd msg;
+  msg.data = data;
+  for (auto &pr : connections_) {
+    if (pr.second->filter_loaded_) {
+      pr.second->send_msg(msg);
+    }
+  }
+}
+
+std::string Client::peers_path() const {
+  return settings_.datadir + "/peers.dat";
+}
+
+void Client::collect_metrics(std::string &out) const {
+  Metrics &m = metrics();
+  m.height.set(chain_.height());
+  m.orphans.set(chain_.orphan_count());
+  m.outbound.set(handshake_count());
+  m.inbound.set(inbound_.size());
+  progress_.expose(out);
+  announces_.expose(out);
+
+  std::vector<std::pair<const char *, size_t> > memory;
+  measure_memory(memory);
+  expose_memory(out, memory);
+  expose_header(out, "spv_resident_bytes", "gauge",
+                "Resident set size of the process");
+  expose_sample(out, "spv_resident_bytes", "", resident_bytes());
+  if (settings_.memory_budget_mb) {
+    expose_header(out, "spv_memory_budget_bytes", "gauge",
+                  "The resident set size allowed by --memory-budget-mb");
+    expose_sample(out, "spv_memory_budget_bytes", "",
+                  settings_.memory_budget_mb << 20);
+  }
+
+  // per peer, for the connections that are still open
+  auto labels = [](const Connection &conn) {
+    std::ostringstream os;
+    os << "peer=\"" << conn.peer().addr << "\",direction=\""
+       << (conn.inbound() ? "inbound" : "outbound") << '"';
+    return os.str();
+  };
+  auto expose = [&](const char *name, const char *type, const char *help,
+                    const std::function<double(const Connection &)> &get) {
+    expose_header(out, name, type, help);
+    for (const auto *conns : {&connections_, &inbound_}) {
+      for (const auto &pr : *conns) {
+        expose_sample(out, name, labels(*pr.second), get(*pr.second));
+      }
+    }
+  };
+  expose("spv_peer_received_bytes_total", "counter",
+         "Bytes received from each peer", &Connection::bytes_received);
+  expose("spv_peer_sent_bytes_total", "counter", "Bytes sent to each peer",
+         &Connection::bytes_sent);
+  expose("spv_peer_buffer_bytes", "gauge",
+         "Bytes allocated for each peer's read and write buffers",
+         &Connection::buffer_bytes);
+  expose("spv_peer_cpu_seconds_total", "counter",
+         "CPU time spent decoding and handling each peer's messages",
+         [](const Connection &c) { return c.cost().cpu_ns / 1e9; });
+  expose("spv_peer_useful_headers_total", "counter",
+         "Headers from each peer that extended the chain",
+         [](const Connection &c) { return c.cost().headers; });
+  expose("spv_peer_useful_blocks_total", "counter",
+         "Verified blocks and requested merkle blocks from each peer",
+         [](const Connection &c) { return c.cost().blocks; });
+  expose("spv_peer_cost", "gauge",
+         "CPU ms plus KiB received from each peer, per block delivered",
+         [](const Connection &c) { return c.cost().cost(); });
+
+  expose_header(out, "spv_peer_message_bytes_total", "counter",
+                "Bytes of each command received from and sent to each peer");
+  for (const auto *conns : {&connections_, &inbound_}) {
+    for (const auto &pr : *conns) {
+      const PeerCost &cost = pr.second->cost();
+      const std::string peer = labels(*pr.second);
+      for (size_t i = 0; i < PeerCost::num_commands; i++) {
+        for (const bool in : {true, false}) {
+          const uint64_t bytes = in ? cost.bytes_in[i] : cost.bytes_out[i];
+          if (bytes) {
+            expose_sample(out, "spv_peer_message_bytes_total",
+                          peer + ",command=\"" + command_name(Command(i)) +
+                              (in ? "\",flow=\"in\"" : "\",flow=\"out\""),
+                          bytes);
+          }
+        }
+      }
+    }
+  }
+}
+
+std::string Client::peer_info() const {
+  std::string out = "[";
+  for (const auto *conns : {&connections_, &inbound_}) {
+    for (const auto &pr : *conns) {
+      const Connection &conn = *pr.second;
+      std::ostringstream os;
+      os << "{\"addr\":\"" << pr.first << "\",\"inbound\":"
+         << (conn.inbound() ? "true" : "false")
+         << ",\"pingtime\":" << conn.rtt().count() / 1e3 << ',';
+      if (out.size() > 1) {
+        out += ',';
+      }
+      out += os.str();
+      conn.cost().json(out);
+      out += '}';
+    }
+  }
+  return out + ']';
+}
+
+void Client::measure_memory(
+    std::vector<std::pair<const char *, size_t> > &out) const {
+  chain_.memory_usage(out);
+  size_t inv = inv_tracker_.memory_usage() + wanted_inv_.memory_usage();
+  wanted_inv_.for_each([&](const Inv &, const std::vector<Addr> &peers) {
+    inv += peers.capacity() * sizeof(Addr);
+  });
+  out.emplace_back("inv", inv);
+  if (mempool_) {
+    out.emplace_back("mempool", mempool_->bytes());
+  }
+  out.emplace_back("log_queue", log_queue_bytes());
+}
+
+void Client::check_memory() {
+  const size_t rss = resident_bytes(), budget = settings_.memory_budget_mb;
+  if (rss <= budget << 20) {
+    if (over_budget_) {
+      log->info("resident memory is back under the {} MiB budget, at {} MiB",
+                budget, rss >> 20);
+      over_budget_ = false;
+    }
+    return;
+  }
+  if (over_budget_) {
+    return;  // warned already
+  }
+  over_budget_ = true;
+  std::vector<std::pair<const char *, size_t> > memory;
+  measure_memory(memory);
+  for (size_t i = 0; i < size_t(MemTag::NUM_TAGS); i++) {
+    memory.emplace_back(mem_tag_name(MemTag(i)), mem_usage(MemTag(i)));
+  }
+  std::sort(memory.begin(), memory.end(),
+            [](const auto &a, const auto &b) { return a.second > b.second; });
+  std::ostringstream largest;
+  for (size_t i = 0; i < memory.size() && i < 3; i++) {
+    largest << (i ? ", " : "") << memory[i].first << " "
+            << (memory[i].second >> 10) << " KiB";
+  }
+  log->warn("resident memory is {} MiB, over the {} MiB budget; largest: {}",
+            rss >> 20, budget, largest.str());
+}
+
+bool Client::run() {
+  if (settings_.verify_db) {
+    verifier_.reset(new DbVerifier(loop_, chain_, settings_.repair_db));
+    verifier_->start();
+  }
+  LOG_DEBUG(log, "connecting to network as {}", us_.user_agent);
+  if (settings_.listen) {
+    listen();
+  }
+  if (settings_.metrics_port) {
+    metrics_.reset(new MetricsServer(
+        loop_, [this](std::string &out) { collect_metrics(out); }));
+    metrics_->listen(settings_.metrics_address, settings_.metrics_port);
+  }
+  if (!settings_.status_socket.empty()) {
+    status_.reset(
+        new StatusServer(loop_, [this]() { return progress_.json(); }));
+    if (!status_->listen(settings_.status_socket)) {
+      shutdown();
+      return false;
+    }
+  }
+  if (!settings_.query_socket.empty()) {
+    chain_.open_mmr(settings_.datadir + "/mmr.dat");  // for PROOF queries
+    if (settings_.chain_proofs) {
+      chain_.open_work_mmr(settings_.datadir + "/workmmr.dat");
+    }
+    query_.reset(
+        new QueryServer(loop_, chain_, [this]() { return peer_info(); }));
+    if (!query_->listen(settings_.query_socket)) {
+      shutdown();
+      return false;
+    }
+  }
+  if (!settings_.tip_socket.empty()) {
+    tips_.reset(new TipServer(loop_, chain_.tip_feed()));
+    if (!tips_->listen(settings_.tip_socket)) {
+      shutdown();
+      return false;
+    }
+  }
+  if (!settings_.control_socket.empty()) {
+    control_.reset(new ControlServer(
+        loop_, [this](const std::string &line) {
+          return control_command(line);
+        }));
+    if (!control_->listen(settings_.control_socket)) {
+      shutdown();
+      return false;
+    }
+  }
+  if (settings_.electrum_port) {
+    scripts_.reset(new ScriptIndex(watch_));
+    electrum_.reset(
+        new ElectrumServer(loop_, chain_, chain_.tip_feed(), *scripts_));
+    scripts_->changed = [this](const hash_t &script_hash) {
+      electrum_->notify_script(script_hash);
+    };
+    electrum_->listen(settings_.electrum_address, settings_.electrum_port);
+  }
+  if (settings_.rpc_port) {
+    rpc_.reset(new RpcServer(loop_, chain_, chain_.tip_feed()));
+    rpc_->listen(settings_.rpc_address, settings_.rpc_port);
+  }
+  if (settings_.replicate_port) {
+    replication_.reset(
+        new ReplicationServer(loop_, chain_, chain_.tip_feed()));
+    replication_->listen(settings_.replicate_address,
+                         settings_.replicate_port);
+  }
+  if (!settings_.header_mirror.empty()) {
+    mirror_.reset(new HeaderMirror(loop_, settings_.header_mirror,
+                                   settings_.mirror_connections));
+    mirror_->callbacks.headers = [this](const Addr &job, std::string &&raw,
+                                        bool last) {
+      notify_mirror_headers(job, std::move(raw), last);
+    };
+    mirror_->callbacks.failed = [this](const Addr &job) {
+      notify_mirror_failed(job);
+    };
+  }
+  if (!settings_.follow.empty()) {
+    Addr leader;
+    parse_peer(settings_.follow, 0, leader);  // checked already
+    follower_.reset(new ReplicationFollower(
+        loop_, leader, [this]() { return chain_.locator(); },
+        [this, leader](std::string &&raw, uint32_t checksum) {
+          validator_.submit(leader, std::move(raw), true, &checksum);
+        },
+        [this](bool streaming) { notify_following(streaming); }));
+  }
+  start_timers();
+  if (!settings_.connect.empty()) {
+    log->info("connecting to {} fixed peer(s)", connect_.size());
+    connect_to_fixed_peers();
+    return true;
+  }
+  if (addrman_.empty()) {
+    seed();
+    return true;
+  }
+  log->info("connecting to saved peers ({} known)", addrman_.size());
+  connect_to_new_peer();
+  return true;
+}
+
+void Client::replay_start() {
+  log->info("replaying captured peer traffic");
+  replaying_ = true;
+  start_timers();
+}
+
+void Client::replay_open(const Addr &addr) {
+  if (shutdown_ || connections_.count(addr)) {
+    return;
+  }
+  Connection *conn = new Connection(this, addr);
+  connections_.emplace(addr, std::unique_ptr<Connection>(conn));
+  outbound_groups_[peer_group(addr)]++;
+  conn->connect_start_ = now();
+  conn->send_version();
+}
+
+void Client::replay_read(const Addr &addr, const char *data, size_t size) {
+  auto it = connections_.find(addr);
+  if (it != connections_.end()) {
+    it->second->read(data, size);
+  }
+}
+
+void Client::replay_close(const Addr &addr) {
+  auto it = connections_.find(addr);
+  if (it != connections_.end()) {
+    remove_connection(it->second.get(), "closed");
+  }
+}
+
+void Client::listen() {
+  listener_ = loop_->resource<uvw::TcpHandle>();
+  listener_->on<uvw::ErrorEvent>([](const auto &exc, auto &) {
+    log->error("error listening for peers: {}", exc.what());
+  });
+  listener_->on<uvw::ListenEvent>(
+      [this](const auto &, auto &server) { accept_peer(server); });
+  const std::string &host = settings_.listen_address;
+  if (host.find(':') != std::string::npos) {
+    listener_->bind<uvw::IPv6>(host, port());
+  } else {
+    listener_->bind<uvw::IPv4>(host, port());
+  }
+  listener_->listen();
+  log->info("listening for peers on {} port {}", host, port());
+}
+
+void Client::accept_peer(uvw::TcpHandle &server) {
+  auto tcp = loop_->resource<uvw::TcpHandle>();
+  server.accept(*tcp);
+
+  // an IPv6 listener sees IPv4 peers as mapped addresses, which is how
+  // Addr stores them anyway
+  const uvw::Addr peer = settings_.listen_address.find(':') != std::string::npos
+                             ? tcp->peer<uvw::IPv6>()
+                             : tcp->peer<uvw::IPv4>();
+  Addr addr;
+  if (!addr.set_ip(peer.ip)) {
+    log->warn("cannot parse inbound peer address {}", peer.ip);
+    tcp->close();
+    return;
+  }
+  addr.set_port(peer.port);
+  Addr ip = addr;
+  ip.set_port(0);
+  auto from_ip = inbound_ips_.find(ip);
+  if (shutdown_ || settings_.max_inbound == 0 ||
+      (from_ip != inbound_ips_.end() &&
+       from_ip->second >= settings_.max_inbound_per_ip) ||
+      inbound_.count(addr) || addrman_.banned(addr) ||
+      (inbound_.size() >= settings_.max_inbound && !evict_inbound())) {
+    log->info("rejecting inbound peer {}, {} inbound", addr, inbound_.size());
+    tcp->close();
+    return;
+  }
+
+  tune_socket(*tcp, tuning_);
+  Connection *conn = new Connection(this, addr, tcp);
+  inbound_.emplace(addr, std::unique_ptr<Connection>(conn));
+  inbound_ips_[ip]++;
+  log->info("accepted inbound peer {}, {} inbound", addr, inbound_.size());
+  event_log().peer(EventType::ACCEPT, addr, true);
+  if (capture_) {
+    conn->capture_id_ = capture_->open_peer(addr, true);
+  }
+
+  auto on_error = [=](int, const char *what) {
+    log->warn("error from inbound peer {}: {}", addr, what);
+    remove_connection(conn, "error");
+  };
+  auto on_end = [=]() {
+    log->info("inbound peer {} closed connection", addr);
+    remove_connection(conn, "closed");
+  };
+  tcp->once<uvw::ErrorEvent>(
+      [=](const auto &exc, auto &) { on_error(exc.code(), exc.what()); });
+  tcp->on<uvw::DataEvent>([=](const auto &data, auto &tcp) {
+    rearm_quickack(tcp, tuning_);
+    conn->read(data.data.get(), data.length);
+  });
+  tcp->once<uvw::EndEvent>([=](const auto &, auto &) { on_end(); });
+  conn->start_reading(on_error, on_end);
+}
+
+bool Client::evict_inbound() {
+  std::vector<EvictionCandidate> candidates;
+  candidates.reserve(inbound_.size());
+  for (const auto &pr : inbound_) {
+    const Connection *conn = pr.second.get();
+    if (conn->dropping()) {
+      continue;
+    }
+    const PeerCost &cost = conn->cost();
+    const double value = cost.headers || cost.blocks
+                             ? cost.cost()
+                             : std::numeric_limits<double>::infinity();
+    candidates.push_back(EvictionCandidate{pr.first, conn->rtt(),
+                                           conn->connect_time(),
+                                           conn->last_headers(), value});
+  }
+  Addr addr;
+  if (!select_eviction(std::move(candidates), evict_key_, addr)) {
+    return false;
+  }
+  log->info("evicting inbound peer {} to make room", addr);
+  remove_connection(inbound_.find(addr)->second.get(), "evicted", false);
+  return true;
+}
+
+Connection *Client::find_connection(const Addr &addr) {
+  auto it = connections_.find(addr);
+  if (it != connections_.end()) {
+    return it->second.get();
+  }
+  it = inbound_.find(addr);
+  return it != inbound_.end() ? it->second.get() : nullptr;
+}
+
+void Client::remove_inbound(Connection *conn) {
+  const Addr addr = conn->peer().addr;
+  auto it = inbound_.find(addr);
+  if (it == inbound_.end()) {
+    return;
+  }
+  Addr ip = addr;
+  ip.set_port(0);
+  auto count = inbound_ips_.find(ip);
+  if (count != inbound_ips_.end() && --count->second == 0) {
+    inbound_ips_.erase(count);
+  }
+  announces_.remove(addr);
+  inbound_.erase(it);
+}
+
+void Client::seed() {
+  if (seeded_ || shutdown_ || replaying_ || !settings_.connect.empty()) {
+    return;
+  }
+  seeded_ = true;
+  log->info("querying dns seeds for peers");
+  // full nodes with segwit, so they can serve compact blocks, and bloom
+  // filters if we'll load one
+  uint64_t services = NODE_NETWORK | NODE_WITNESS;
+  if (filter_) {
+    services |= NODE_BLOOM;
+  }
+  // enough to fill every slot a few times over
+  const size_t enough =
+      4 * scaler_.ceiling() * settings_.connect_race;
+  const NetworkParams &net = network();
+  seeds_.resolve(net.seeds, net.seed_count, services, enough);
+}
+
+void Client::start_timers() {
+  clock_tick_ = loop_->resource<uvw::PrepareHandle>();
+  clock_tick_->on<uvw::PrepareEvent>(
+      [](const auto &, auto &) { tick_clock(); });
+  clock_tick_->start();
+
+  if (settings_.slow_callback_ms) {
+    monitor_.reset(new LoopMonitor(
+        *loop_, std::chrono::milliseconds(settings_.slow_callback_ms)));
+  }
+
+  // The periodic ones start themselves again, after their work so that a
+  // slow run isn't followed right away by the next.
+  seed_timer_.set_callback([this]() {
+    LoopScope scope("timer", "seed");
+    for (const auto &pr : connections_) {
+      if (pr.second->connected()) {
+        return;
+      }
+    }
+    log->info("no saved peers connected after {} seconds",
+              SEED_FALLBACK.count());
+    seed();
+  });
+  seed_timer_.start(SEED_FALLBACK);
+
+  save_timer_.set_callback([this]() {
+    LoopScope scope("timer", "save");
+    addrman_.save(peers_path());
+    chain_.write_index_image(INDEX_IMAGE_GROWTH);
+    save_timer_.start(PEERS_SAVE_INTERVAL);
+  });
+  save_timer_.start(PEERS_SAVE_INTERVAL);
+
+  if (settings_.memory_budget_mb) {
+    memory_timer_.set_callback([this]() {
+      LoopScope scope("timer", "memory");
+      check_memory();
+      memory_timer_.start(MEMORY_CHECK_INTERVAL);
+    });
+    memory_timer_.start(MEMORY_CHECK_INTERVAL);
+  }
+
+  inv_timer_.set_callback([this]() {
+    LoopScope scope("timer", "inv");
+    std::vector<InvTracker::Retry> retries;
+    inv_tracker_.expire(now(), GETDATA_TIMEOUT, retries);
+    retry_invs(retries);
+    inv_timer_.start(INV_SWEEP);
+  });
+  inv_timer_.start(INV_SWEEP);
+
+  block_timer_.set_callback([this]() {
+    LoopScope scope("timer", "block");
+    sweep_blocks();
+    block_timer_.start(BLOCK_SWEEP);
+  });
+  block_timer_.start(BLOCK_SWEEP);
+
+  broadcast_timer_.set_callback([this]() {
+    LoopScope scope("timer", "broadcast");
+    std::vector<hash_t> txids;
+    broadcasts_.stale(now() - BROADCAST_RETRY, BROADCAST_MIN_PEERS, txids);
+    for (const auto &txid : txids) {
+      log->info("transaction {} isn't propagating, announcing it again",
+                to_hex(txid));
+      announce_tx(txid);
+    }
+    broadcast_timer_.start(BROADCAST_SWEEP);
+  });
+  broadcast_timer_.start(BROADCAST_SWEEP);
+
+  tip_timer_.set_callback([this]() {
+    LoopScope scope("timer", "tip");
+    check_tip();
+    tip_timer_.start(TIP_CHECK_INTERVAL);
+  });
+  tip_timer_.start(TIP_CHECK_INTERVAL);
+
+  scale_timer_.set_callback([this]() {
+    LoopScope scope("timer", "scale");
+    rescale_peers();
+    scale_timer_.start(PEER_SCALE_INTERVAL);
+  });
+  scale_timer_.start(PEER_SCALE_INTERVAL);
+
+  retry_timer_.set_callback([this]() {
+    LoopScope scope("timer", "retry");
+    connect_to_fixed_peers();
+  });
+}
+
+bool Client::select_peer(Addr &addr) const {
+  auto connected = [this](const Addr &a) {
+    return connections_.find(a) != connections_.end();
+  };
+  // Keep to one connection per network group, or per AS with --asmap, so
+  // that no one provider has all of them; only if every address left is
+  // in a group we have is that given up.
+  auto crowded = [&](const Addr &a) {
+    return connected(a) || outbound_groups_.count(peer_group(a)) != 0;
+  };
+  // Alternate address families, so that when one of them is broken (e.g.
+  // no IPv6 route) the other still connects quickly.
+  auto other_family = [&](const Addr &a) {
+    return crowded(a) || a.af() == last_af_;
+  };
+  if (!addrman_.select(addr, other_family, false) &&
+      !addrman_.select(addr, crowded) && !addrman_.select(addr, connected)) {
+    log->warn("select_peer() found no unconnected peers");
+    return false;
+  }
+  LOG_DEBUG(log, "select_peer() choosing peer {}", addr);
+  return true;
+}
+
+bool Client::is_connected_to_addr(const Addr &addr) const {
+  return connections_.count(addr) != 0;
+}
+
+void Client::connect_to_addr(const Addr &addr) {
+  LOG_DEBUG(log, "connecting to peer {}", addr);
+  addrman_.attempt(addr);
+  last_af_ = addr.af();
+  event_log().peer(EventType::CONNECT, addr, false);
+
+  Connection *conn = new Connection(this, addr);
+  auto pr = connections_.insert(std::make_pair(addr, conn));
+  assert(pr.second);
+  outbound_groups_[peer_group(addr)]++;
+  if (capture_) {
+    conn->capture_id_ = capture_->open_peer(addr, false);
+  }
+
+  auto on_error = [=](int code, const char *what) {
+    if (code == ECONNREFUSED) {
+      LOG_DEBUG(log, "peer {} refused our TCP request", conn->peer());
+    } else {
+      log->warn("error from peer {}: {} {}", conn->peer(), what, code);
+    }
+    remove_connection(conn, what);
+  };
+  auto on_close = [=]() {
+    log->info("close event for connection {}", addr);
+    connect_to_new_peer();
+  };
+  auto on_connect = [=]() {
+    log->info("connected to new peer {}, connections = {}", addr,
+              connections_.size());
+    conn->connect_timer_.stop();
+    conn->send_version();
+  };
+  auto on_end = [=]() {
+    log->info("remote peer {} closed connection", addr);
+    remove_connection(conn, "closed");
+  };
+  if (conn->socket_) {
+    // the I/O thread has already split the stream into whole messages
+    IoSocket::Callbacks &cb = conn->socket_->callbacks;
+    cb.error = [=](int code, const std::string &what) {
+      if (code == EBADMSG) {
+        conn->misbehavior_ += Connection::MISBEHAVIOR_LIMIT;
+      }
+      on_error(code, what.c_str());
+    };
+    cb.data = [=](std::string &&messages) {
+      conn->read(messages.data(), messages.size());
+    };
+    cb.closed = on_close;
+    cb.connected = on_connect;
+    cb.proxied = [=]() { conn->proxied(); };
+    cb.end = on_end;
+  } else {
+    conn->tcp_->once<uvw::ErrorEvent>([=](const auto &exc, auto &) {
+      on_error(exc.code(), exc.what());
+    });
+    conn->tcp_->on<uvw::DataEvent>([=](const auto &data, auto &tcp) {
+      rearm_quickack(tcp, tuning_);
+      conn->read(data.data.get(), data.length);
+    });
+    conn->tcp_->once<uvw::CloseEvent>(
+        [=](const auto &, auto &) { on_close(); });
+    conn->tcp_->once<uvw::ConnectEvent>([=](const auto &, auto &) {
+      conn->start_reading(on_error, on_end);
+      conn->proxy_connect();
+      on_connect();
+    });
+    conn->tcp_->once<uvw::EndEvent>([=](const auto &, auto &) { on_end(); });
+  }
+  conn->connect();
+
+  conn->connect_timer_.set_callback([=]() {
+    log->warn("connection to {} timed out", conn->peer());
+    remove_connection(conn, "timed out");
+  });
+  conn->connect_timer_.start(std::chrono::seconds(1));
+}
+
+void Client::connect_to_fixed_peers() {
+  if (shutdown_ || replaying_) {
+    return;
+  }
+  for (const auto &addr : connect_) {
+    if (!is_connected_to_addr(addr)) {
+      connect_to_addr(addr);
+    }
+  }
+}
+
+void Client::connect_to_new_peer() {
+  if (shutdown_ || replaying_) {
+    return;
+  }
+  if (!settings_.connect.empty()) {
+    // don't hammer a fixed peer that's down
+    if (!retry_timer_.active()) {
+      retry_timer_.start(CONNECT_RETRY);
+    }
+    return;
+  }
+  const size_t ready = handshake_count();
+  if (ready >= scaler_.target()) {
+    return;
+  }
+  // Race a few candidates for each free slot. The first to finish the
+  // handshake win, and notify_connected() cancels the rest.
+  const size_t want =
+      (scaler_.target() - ready) * settings_.connect_race;
+  Addr addr;
+  while (connections_.size() - ready < want) {
+    if (!select_peer(addr)) {
+      seed();  // out of addresses
+      return;
+    }
+    connect_to_addr(addr);
+  }
+}
+
+size_t Client::get_height() const { return chain_.height(); }
+
+void Client::cancel_pending_connections() {
+  std::vector<Connection *> pending;
+  for (const auto &pr : connections_) {
+    if (!pr.second->has_version()) {
+      pending.push_back(pr.second.get());
+    }
+  }
+  for (Connection *conn : pending) {
+    LOG_DEBUG(log, "cancelling connection attempt to {}", conn->peer());
+    remove_connection(conn, "cancelled", false);
+  }
+}
+
+void Client::remove_connection(Connection *conn, const char *why,
+                               bool penalize) {
+  event_log().peer(EventType::DISCONNECT, conn->peer().addr, conn->inbound(),
+                   why);
+  if (capture_) {
+    capture_->close_peer(conn->capture_id_);
+  }
+  if (conn->misbehaved() && settings_.ban_time && !shutdown_) {
+    log->warn("banning {} for {}s: {}", conn->peer().addr, settings_.ban_time,
+              why);
+    addrman_.ban(conn->peer().addr, settings_.ban_time);
+  }
+  if (conn->inbound()) {
+    remove_inbound(conn);
+    return;
+  }
+  const Addr &addr = conn->peer().addr;
+  log->warn("removing connection to {}", conn->peer());
+  auto it = connections_.find(addr);
+  if (it == connections_.end()) {
+    log->warn("connection {} was already removed", addr);
+    return;
+  }
+
+  // A peer that hung up on our v2 key likely doesn't know v2, and gets
+  // another try with v1 rather than counting as a failure.
+  const bool retry_v1 =
+      penalize && conn->v2_ && conn->v2_->refused() && !shutdown_;
+
+  // count it against the peer if it never got through the handshake
+  if (penalize && !retry_v1 && !conn->connected() && !shutdown_) {
+    addrman_.failed(addr);
+  }
+
+  // hand this peer's header segment to someone else
+  cancel_hdr_timeout(addr);
+  sync_.release(addr);
+  progress_.disconnected(addr);
+  tip_check_.remove(addr);
+  announces_.remove(addr);
+
+  if (addr == cf_peer_ && cf_request_ != CfRequest::NONE) {
+    cf_request_ = CfRequest::NONE;
+    cf_stop_ = empty_hash;
+  }
+  if (rescan_) {
+    rescan_->release(addr);
+  }
+  blocks_.release(addr);
+
+  for (auto cmpct = cmpct_blocks_.begin(); cmpct != cmpct_blocks_.end();) {
+    cmpct = cmpct->second.peer == addr ? cmpct_blocks_.erase(cmpct)
+                                       : std::next(cmpct);
+  }
+  if (!shutdown_) {
+    std::vector<InvTracker::Retry> retries;
+    inv_tracker_.release(addr, retries);
+    retry_invs(retries);
+  }
+
+  if (conn->handshaken_pos_ != Connection::not_handshaken) {
+    Connection *last = handshaken_.back();
+    last->handshaken_pos_ = conn->handshaken_pos_;
+    handshaken_[conn->handshaken_pos_] = last;
+    handshaken_.pop_back();
+  }
+
+  auto group = outbound_groups_.find(peer_group(addr));
+  if (--group->second == 0) {
+    outbound_groups_.erase(group);
+  }
+
+  // TODO: double check that the conn destructor actually shuts down its
+  // resources properly.
+  const Addr peer = addr;
+  connections_.erase(it);
+  if (retry_v1) {
+    log->info("redialing {} with v1", peer);
+    v1_peers_.insert(peer);
+    connect_to_addr(peer);
+  }
+  sync_more_headers();
+  sync_filters();
+  sync_rescan();
+  fetch_blocks();
+  update_hb_peers();
+}
+
+void Client::shutdown() {
+  if (!shutdown_) {
+    log->info("shutting down client");
+    shutdown_ = true;
+
+    if (listener_) {
+      listener_->close();
+      listener_.reset();
+    }
+    if (metrics_) {
+      metrics_->close();
+    }
+    if (status_) {
+      status_->close();
+    }
+    if (query_) {
+      query_->close();
+    }
+    if (electrum_) {
+      electrum_->close();
+    }
+    if (rpc_) {
+      rpc_->close();
+    }
+    if (tips_) {
+      tips_->close();
+    }
+    if (control_) {
+      control_->close();
+    }
+    if (replication_) {
+      replication_->close();
+    }
+    if (follower_) {
+      follower_->close();
+    }
+    if (mirror_) {
+      mirror_->cancel();
+    }
+    for (auto &pr : connections_) {
+      pr.second->shutdown();
+    }
+    for (auto &pr : inbound_) {
+      pr.second->shutdown();
+    }
+    cancel_hdr_timeouts();
+    index_queue_->close();
+    stall_queue_->close();
+    timers_.close();
+    seeds_.cancel();
+    for (Timer *timer :
+         {&seed_timer_, &save_timer_, &retry_timer_, &inv_timer_,
+          &block_timer_, &broadcast_timer_, &getdata_timer_, &tip_timer_,
+          &scale_timer_, &memory_timer_}) {
+      timer->stop();
+    }
+    if (clock_tick_) {
+      clock_tick_->stop();
+      clock_tick_->close();
+      clock_tick_.reset();
+    }
+    if (read_idle_) {
+      read_idle_->stop();
+      read_idle_->close();
+      read_idle_.reset();
+    }
+    if (monitor_) {
+      monitor_->close();
+    }
+    read_queue_.clear();
+    wanted_inv_.clear();
+    wanted_txs_ = 0;
+    inv_tracker_.clear();
+    blocks_.clear();
+    if (block_store_) {
+      block_store_->sync();
+    }
+    validator_.shutdown();
+    block_verifier_.shutdown();
+    if (rescan_) {
+      rescan_->shutdown();
+    }
+    if (io_) {
+      io_->shutdown();
+    }
+    if (ring_) {
+      ring_->close();
+    }
+    if (verifier_) {
+      verifier_->shutdown();
+    }
+    addrman_.save(peers_path());
+  }
+}
+
+void Client::notify_connected(Connection *conn) {
+  event_log().peer(EventType::HANDSHAKE, conn->peer().addr, conn->inbound());
+  if (conn->inbound()) {
+    return;  // we serve these; they don't take part in syncing
+  }
+  assert(conn->handshaken_pos_ == Connection::not_handshaken);
+  conn->handshaken_pos_ = handshaken_.size();
+  handshaken_.push_back(conn);
+  progress_.connected(conn->peer().addr, conn->peer().start_height);
+  addrman_.good(conn->peer().addr, conn->handshake_latency());
+  if (clock_.add(conn->peer().addr, conn->peer().time_offset)) {
+    set_time_offset(clock_.offset());
+  }
+  if (handshake_count() >= scaler_.target()) {
+    cancel_pending_connections();
+  }
+  // a new peer may get a transaction out that the others haven't
+  std::vector<hash_t> txids;
+  broadcasts_.stale(time_point::max(), BROADCAST_MIN_PEERS, txids);
+  for (const auto &txid : txids) {
+    conn->announce_tx(txid);
+    broadcasts_.told(txid, {conn->peer().addr}, now());
+  }
+  if (!chain_.index_loaded()) {
+    return;  // see notify_index_loaded()
+  }
+  if (need_headers_) {
+    if (sync_.finished()) {
+      log->info("starting header download");
+    }
+    sync_more_headers();
+  }
+  sync_filters();
+  sync_rescan();
+  fetch_blocks();
+}
+
+void Client::notify_write_stall() {
+  if (shutdown_) {
+    return;
+  }
+  // Stalls can end while this was queued, so this goes by the chain's
+  // current state.
+  if (chain_.write_stalled()) {
+    log->warn("chain writes are stalled, pausing header requests");
+    return;
+  }
+  log->info("chain writes caught up, resuming header requests");
+  sync_more_headers();
+}
+
+void Client::notify_index_loaded() {
+  index_queue_->close();
+  chain_.wait_index();
+  progress_.set_height(chain_.height());
+  if (follower_ && !shutdown_) {
+    follower_->start();  // its hello needs our locator
+  }
+  if (shutdown_ || handshake_count() == 0) {
+    return;  // the first handshake will start things
+  }
+  if (need_headers_) {
+    log->info("starting header download");
+    sync_more_headers();
+  }
+  sync_filters();
+  sync_rescan();
+}
+
+void Client::notify_following(bool streaming) {
+  if (streaming) {
+    // segments already asked of peers are left to finish
+    log->info("taking headers from leader {}", follower_->leader());
+    return;
+  }
+  log->warn("syncing headers from peers until leader {} is back",
+            follower_->leader());
+  need_headers_ = true;
+  sync_more_headers();
+}
+
+const std::string &Client::addr_message() {
+  const time_point t = now();
+  if (addr_msg_.empty() || t - addr_msg_time_ > ADDR_CACHE_TIME) {
+    AddrMsg msg;
+    addrman_.sample(MAX_ADDR_SIZE, msg.addrs);
+    size_t sz;
+    std::unique_ptr<char[]> data = msg.encode(sz);
+    addr_msg_.assign(data.get(), sz);
+    addr_msg_time_ = t;
+    LOG_DEBUG(log, "cached a getaddr reply of {} address(es)",
+              msg.addrs.size());
+  }
+  return addr_msg_;
+}
+
+void Client::notify_peer(Connection *conn, const NetAddr &addr) {
+  if (addrman_.add(addr.addr, conn->peer().addr)) {
+    log->info("added new peer {}, peer list size {}", addr, addrman_.size());
+    if (connections_.size() < scaler_.target() &&
+        !is_connected_to_addr(addr)) {
+      connect_to_addr(addr.addr);
+    }
+  } else {
+    LOG_DEBUG(log, "ignoring duplicate peer {}", addr);
+  }
+}
+
+void Client::notify_error(Connection *conn, const std::string &why) {
+  log->warn("error on connection to {}, reason: {}", conn->peer(), why);
+  remove_connection(conn, why.c_str());
+}
+
+Traffic Client::read_class(const Connection *conn) {
+  const Addr &addr = conn->peer().addr;
+  if ((cf_request_ != CfRequest::NONE && cf_peer_ == addr) ||
+      (rescan_ && rescan_->busy(addr))) {
+    return Traffic::BULK;
+  }
+  if (need_headers_ && sync_.find(addr) != nullptr) {
+    return Traffic::HEADERS;
+  }
+  return Traffic::RELAY;
+}
+
+void Client::schedule_read(Connection *conn) {
+  if (shutdown_) {
+    return;
+  }
+  read_queue_.push_back(conn->peer().addr);
+  if (!read_idle_) {
+    read_idle_ = loop_->resource<uvw::IdleHandle>();
+    read_idle_->on<uvw::IdleEvent>(
+        [this](const auto &, auto &) { run_reads(); });
+  }
+  if (!read_idle_->active()) {
+    read_idle_->start();
+  }
+}
+
+void Client::run_reads() {
+  // just the ones queued before this turn; the rest go next time
+  for (size_t n = read_queue_.size(); n > 0 && !shutdown_; n--) {
+    const Addr addr = read_queue_.front();
+    read_queue_.pop_front();
+    Connection *conn = find_connection(addr);
+    if (conn != nullptr && conn->run_backlog()) {
+      read_queue_.push_back(addr);
+    }
+  }
+  if (read_queue_.empty() && read_idle_) {
+    read_idle_->stop();  // shutdown() may have closed it already
+  }
+}
+
+// does this peer advertise that it serves headers?
+static bool serves_headers(const Connection *conn) {
+  return conn->peer().services & (NODE_NETWORK | NODE_NETWORK_LIMITED);
+}
+
+void Client::sync_more_headers() {
+  if (shutdown_ || !need_headers_ || !chain_.index_loaded() ||
+      chain_.write_stalled() || (follower_ && follower_->streaming())) {
+    return;
+  }
+  if (sync_.finished()) {
+    sync_.plan(chain_.tip(), settings_.assume_valid);
+  }
+  sync_mirror_headers();
+  // Peers that don't say they serve the chain (e.g. other SPV clients)
+  // only get segments when no one else is there to ask.
+  bool any_serve = false;
+  for (auto &pr : connections_) {
+    if (pr.second->ready() && serves_headers(pr.second.get())) {
+      any_serve = true;
+      break;
+    }
+  }
+  std::vector<Connection *> idle, busy;
+  for (auto &pr : connections_) {
+    Connection *conn = pr.second.get();
+    if (!conn->ready()) {
+      continue;
+    }
+    if (sync_.find(pr.first) != nullptr) {
+      busy.push_back(conn);
+    } else if (!conn->congested() && (serves_headers(conn) || !any_serve)) {
+      idle.push_back(conn);  // a congested peer gets no new segment
+    }
+  }
+
+  // the fastest peers get the next segments
+  std::sort(idle.begin(), idle.end(),
+            [](const Connection *a, const Connection *b) {
+              return a->header_rate() > b->header_rate();
+            });
+  for (Connection *conn : idle) {
+    HeaderSegment *seg = sync_.assign(conn->peer().addr);
+    if (seg == nullptr) {
+      seg = steal_segment(conn, busy);
+    }
+    if (seg == nullptr) {
+      break;
+    }
+    request_headers(conn, *seg);
+  }
+}
+
+void Client::sync_mirror_headers() {
+  if (!mirror_ || mirror_->failures() >= MIRROR_MAX_FAILURES) {
+    return;
+  }
+  for (const Addr &job : mirror_->idle()) {
+    if (sync_.find(job) != nullptr) {
+      continue;  // its last headers are still being validated
+    }
+    HeaderSegment *seg = sync_.assign(job);
+    if (seg == nullptr) {
+      break;
+    }
+    if (seg->is_open()) {
+      // past the last checkpoint, which is up to the peers
+      sync_.release(job);
+      break;
+    }
+    mirror_->fetch(job, seg->cursor_height + 1, seg->stop_height);
+  }
+}
+
+void Client::notify_mirror_headers(const Addr &job, std::string &&raw,
+                                   bool last) {
+  const HeaderSegment *seg = sync_.find(job);
+  const size_t count = raw.size() / HeadersView::stride;
+  std::deque<MirrorPart> &parts = mirror_parts_[job];
+  parts.push_back({{count, true, last}, false});
+  validator_.submit(job, std::move(raw), seg == nullptr || !seg->trusted);
+}
+
+void Client::notify_mirror_failed(const Addr &job) {
+  drop_mirror_job(job, false);
+  sync_.release(job, true);
+  if (mirror_->failures() == MIRROR_MAX_FAILURES) {
+    log->warn("header mirror {} keeps failing, syncing from peers only",
+              settings_.header_mirror);
+  }
+  sync_more_headers();
+}
+
+void Client::drop_mirror_job(const Addr &job, bool reject) {
+  if (reject) {
+    mirror_->reject(job);
+  }
+  for (auto &part : mirror_parts_[job]) {
+    part.stale = true;
+  }
+}
+
+void Client::check_tip() {
+  if (shutdown_ || replaying_ || !chain_.index_loaded() ||
+      (need_headers_ && !sync_.finished())) {
+    return;  // a sync under way will tell
+  }
+  std::vector<size_t> heights;
+  std::vector<Connection *> idle;
+  for (auto &pr : connections_) {
+    Connection *conn = pr.second.get();
+    if (!conn->ready()) {
+      continue;
+    }
+    heights.push_back(conn->peer().start_height);
+    if (serves_headers(conn) && !conn->congested() &&
+        conn->header_requests_.empty() && sync_.find(pr.first) == nullptr) {
+      idle.push_back(conn);
+    }
+  }
+  if (tip_check_.start(chain_.height(), heights)) {
+    log->warn("{} peer(s) advertise a height past our tip {}",
+              tip_check_.disagree(), chain_.tip());
+    resync_headers();
+    return;
+  }
+  shuffle(idle);
+  if (idle.size() > TIP_CHECK_PEERS) {
+    idle.resize(TIP_CHECK_PEERS);
+  }
+  const std::vector<hash_t> locator = chain_.locator();
+  for (Connection *conn : idle) {
+    LOG_DEBUG(log, "asking peer {} what follows our tip", conn->peer());
+    tip_check_.probed(conn->peer().addr);
+    conn->header_requests_.push_back({empty_hash, false});
+    conn->get_headers(locator, empty_hash);
+  }
+}
+
+void Client::resync_headers() {
+  log->warn("our tip {} may be stale, syncing headers from every peer",
+            chain_.tip());
+  need_headers_ = true;
+  progress_.set_synced(false);
+  sync_more_headers();
+}
+
+void Client::rescale_peers() {
+  if (shutdown_ || !settings_.connect.empty()) {
+    return;  // the fixed peers are all there is
+  }
+  const size_t before = scaler_.target();
+  const bool hold =
+      chain_.write_stalled() || (follower_ && follower_->streaming());
+  if (!scaler_.sample(progress_.rate(), chain_.tip_is_recent(), hold)) {
+    return;
+  }
+  log->info("outbound peer target is now {}, was {}, syncing {:.0f} "
+            "headers/s", scaler_.target(), before, progress_.rate());
+  retarget_peers(before);
+}
+
+void Client::retarget_peers(size_t before) {
+  if (scaler_.target() > before) {
+    connect_to_new_peer();
+    return;
+  }
+  cancel_pending_connections();
+  while (handshake_count() > scaler_.target()) {
+    // the costliest for what it's given (see PeerCost), then the slowest
+    // to answer, leaving any peer with a header segment
+    Connection *worst = nullptr;
+    for (Connection *conn : handshaken_) {
+      if (sync_.find(conn->peer().addr) != nullptr) {
+        continue;
+      }
+      if (worst == nullptr || conn->cost().cost() > worst->cost().cost() ||
+          (conn->cost().cost() == worst->cost().cost() &&
+           conn->rtt() > worst->rtt())) {
+        worst = conn;
+      }
+    }
+    if (worst == nullptr) {
+      break;
+    }
+    remove_connection(worst, "over the outbound peer target", false);
+  }
+}
+
+// {"error":"..."}, with the message escaped for a JSON string
+static std::string control_error(const std::string &message) {
+  std::string out = "{\"error\":\"";
+  for (char c : message) {
+    if (c == '"' || c == '\\') {
+      out.push_back('\\');
+    }
+    out.push_back(c == '\n' ? ' ' : c);
+  }
+  return out + "\"}";
+}
+
+// a whole decimal number, false if word is anything else
+static bool parse_count(const std::string &word, size_t &out) {
+  if (word.empty() || word.size() > 18 ||
+      word.find_first_not_of("0123456789") != std::string::npos) {
+    return false;
+  }
+  out = std::strtoull(word.c_str(), nullptr, 10);
+  return true;
+}
+
+std::string Client::control_command(const std::string &line) {
+  std::istringstream words(line);
+  std::string cmd, name, value, extra;
+  words >> cmd >> name >> value >> extra;
+  if (cmd == "get" && name.empty()) {
+    const HeaderCache &cache = chain_.header_cache();
+    std::ostringstream os;
+    os << "{\"min_connections\":" << scaler_.floor()
+       << ",\"max_connections\":" << scaler_.ceiling()
+       << ",\"target_connections\":" << scaler_.target()
+       << ",\"connections\":" << handshake_count()
+       << ",\"max_upload\":" << (send_limit_.rate() >> 10)
+       << ",\"max_download\":" << (recv_limit_.rate() >> 10)
+       << ",\"header_cache_entries\":" << cache.capacity()
+       << ",\"header_cache_bytes\":" << cache.memory_usage()
+       << ",\"db_cache_bytes\":" << chain_.block_cache_size()
+       << ",\"log_level\":\""
+       << spdlog::level::to_str(log->level())
+       << "\",\"durability\":\"" << durability_name(chain_.durability())
+       << "\"}";
+    return os.str();
+  }
+  if (cmd == "db") {
+    if (name.empty() || value.empty() || !extra.empty()) {
+      return control_error("usage: db OPTION VALUE");
+    }
+    std::string error;
+    if (!chain_.set_db_option(name, value, error)) {
+      return control_error(error);
+    }
+    return "{\"ok\":true}";
+  }
+  if (cmd != "set" || value.empty() || !extra.empty()) {
+    return control_error("usage: get, set NAME VALUE or db OPTION VALUE");
+  }
+
+  size_t n = 0;
+  const bool numeric = parse_count(value, n);
+  if (name == "log-level") {
+    int level = spdlog::level::trace;
+    while (level <= spdlog::level::off &&
+           value != spdlog::level::to_str(spdlog::level::level_enum(level))) {
+      level++;
+    }
+    if (level > spdlog::level::off) {
+      return control_error("unknown log level: " + value);
+    }
+    spdlog::set_level(spdlog::level::level_enum(level));
+  } else if (name == "durability") {
+    Durability durability;
+    if (!parse_durability(value, durability)) {
+      return control_error("unknown durability: " + value);
+    }
+    chain_.set_durability(durability, settings_.sync_interval);
+  } else if (!numeric) {
+    return control_error("not a number: " + value);
+  } else if (name == "max-connections" || name == "min-connections") {
+    const size_t floor = name == "min-connections" ? n : scaler_.floor();
+    const size_t ceiling = name == "max-connections" ? n : scaler_.ceiling();
+    if (floor == 0 || floor > ceiling) {
+      return control_error("need 0 < min-connections <= max-connections");
+    }
+    const size_t before = scaler_.target();
+    scaler_.set_bounds(floor, ceiling);
+    if (!shutdown_ && settings_.connect.empty() &&
+        scaler_.target() != before) {
+      retarget_peers(before);
+    }
+  } else if (name == "max-upload") {
+    send_limit_.set_rate(n << 10);
+  } else if (name == "max-download") {
+    recv_limit_.set_rate(n << 10);
+  } else if (name == "header-cache-mb") {
+    chain_.resize_header_cache(n << 20);
+  } else if (name == "db-cache-mb") {
+    chain_.resize_block_cache(n << 20);
+  } else {
+    return control_error("unknown setting: " + name);
+  }
+  log->info("control: set {} to {}", name, value);
+  return "{\"ok\":true}";
+}
+
+// How long a full headers reply should take from this peer: a round trip,
+// plus the transfer at the rate it has managed so far.
+static std::chrono::milliseconds expected_reply(const Connection *conn) {
+  const size_t rate = conn->byte_rate();
+  if (rate == 0) {
+    return HEADER_TIMEOUT;
+  }
+  const size_t bytes = MAX_HEADERS_RESULTS * HeadersView::stride;
+  return conn->rtt() + std::chrono::milliseconds(bytes * 1000 / rate);
+}
+
+std::chrono::milliseconds Client::header_timeout(const Connection *conn) {
+  return std::min(HEADER_TIMEOUT,
+                  std::max(MIN_HEADER_TIMEOUT, 3 * expected_reply(conn)));
+}
+
+HeaderSegment *Client::steal_segment(Connection *conn,
+                                     std::vector<Connection *> &busy) {
+  if (conn->header_rate() == 0) {
+    return nullptr;  // no idea whether it's any faster
+  }
+  const auto limit = 2 * expected_reply(conn);
+  auto slowest = busy.end();
+  for (auto it = busy.begin(); it != busy.end(); ++it) {
+    const auto waited = (*it)->since_getheaders();
+    if (waited > limit && (*it)->header_rate() < conn->header_rate() &&
+        (slowest == busy.end() ||
+         waited > (*slowest)->since_getheaders())) {
+      slowest = it;
+    }
+  }
+  if (slowest == busy.end()) {
+    return nullptr;
+  }
+  const Addr addr = (*slowest)->peer().addr;
+  log->info("reassigning header segment from slow peer {} to {}", addr,
+            conn->peer());
+  busy.erase(slowest);
+  cancel_hdr_timeout(addr);
+  sync_.release(addr, true);
+  return sync_.assign(conn->peer().addr);
+}
+
+void Client::request_headers(Connection *conn, const HeaderSegment &seg) {
+  assert(!conn->hdr_timer_.active());
+  conn->hdr_timer_.set_callback([this, conn]() {
+    log->warn("get headers timeout from peer {}", conn->peer());
+    conn->header_requests_.clear();
+    sync_.release(conn->peer().addr, true);
+    sync_more_headers();
+  });
+  conn->hdr_timer_.start(header_timeout(conn));
+
+  LOG_DEBUG(log, "fetching headers from peer {} after height {}", conn->peer(),
+            seg.cursor_height);
+  if (seg.cursor == chain_.tip().block_hash) {
+    // the peer may be on a fork of our tip, give it a full locator
+    conn->header_requests_.push_back({empty_hash, false});
+    conn->get_headers(chain_.locator(), seg.stop);
+  } else {
+    conn->header_requests_.push_back({seg.cursor, false});
+    conn->get_headers({seg.cursor}, seg.stop);
+  }
+}
+
+void Client::pipeline_headers(Connection *conn, const HeaderSegment &seg,
+                              size_t count, const std::string &raw_headers) {
+  const HeadersView view(raw_headers.data(),
+                         raw_headers.size() / HeadersView::stride);
+  const size_t validating =
+      std::count_if(conn->header_replies_.begin(), conn->header_replies_.end(),
+                    [](const auto &reply) { return reply.part.last; });
+  // a short reply ends the segment, and one that doesn't start where it
+  // was asked to won't be taken
+  const Connection::HeadersRequest &req = conn->reply_req_;
+  if (count < MAX_HEADERS_RESULTS || view.size() == 0 ||
+      req.from == empty_hash || conn->reply_start_ != req.from ||
+      !conn->header_requests_.empty() ||
+      validating > settings_.header_pipeline || chain_.write_stalled()) {
+    return;
+  }
+  const hash_t last = view.hash(view.size() - 1);
+  if (last == seg.stop) {
+    return;
+  }
+  LOG_DEBUG(log, "pipelining getheaders to peer {} after height {}",
+            conn->peer(), seg.cursor_height + count);
+  conn->hdr_timer_.start(header_timeout(conn));
+  conn->header_requests_.push_back({last, true});
+  conn->get_headers({last}, seg.stop);
+}
+
+// can this peer be asked for compact filters?
+static bool serves_filters(const Connection *conn) {
+  return conn->ready() && !conn->congested() && !conn->dropping() &&
+         (conn->peer().services & NODE_COMPACT_FILTERS);
+}
+
+void Client::sync_filters() {
+  if (!cfheaders_ || shutdown_ || need_headers_ ||
+      cf_request_ != CfRequest::NONE) {
+    return;
+  }
+  rewind_filter_headers();
+  const size_t tip = chain_.height();
+  if (cfheaders_->size() > tip) {
+    if (cfilter_height_ == 0) {
+      // no --filter-scan-from, so match the blocks from here on
+      cfilter_height_ = tip + 1;
+    }
+    if (cfilter_height_ > tip) {
+      return;  // caught up
+    }
+  }
+
+  // stick with one peer, since the checkpoints came from it
+  Connection *conn = nullptr;
+  auto it = connections_.find(cf_peer_);
+  if (it != connections_.end() && serves_filters(it->second.get()) &&
+      !(rescan_ && rescan_->busy(cf_peer_))) {
+    conn = it->second.get();
+  } else {
+    cf_checkpoints_.clear();
+    for (auto &pr : connections_) {
+      if (serves_filters(pr.second.get()) &&
+          !(rescan_ && rescan_->busy(pr.first))) {
+        conn = pr.second.get();
+        break;
+      }
+    }
+    if (conn == nullptr) {
+      return;  // notify_connected() tries again
+    }
+    cf_peer_ = conn->peer().addr;
+  }
+
+  bool found;
+  if (cf_checkpoints_.empty() &&
+      tip >= cfheaders_->size() + CFCHECKPT_INTERVAL) {
+    // far behind, so get checkpoints to check the peer's headers against
+    cf_request_ = CfRequest::CHECKPT;
+    cf_stop_height_ = tip;
+    cf_stop_ = chain_.tip().block_hash;
+    conn->get_cfcheckpt(cf_stop_);
+  } else if (cfheaders_->size() <= tip) {
+    const size_t start = cfheaders_->size();
+    cf_request_ = CfRequest::HEADERS;
+    cf_stop_height_ = std::min<size_t>(tip, start + MAX_GETCFHEADERS_SIZE - 1);
+    cf_stop_ = chain_.find_hash(cf_stop_height_, found);
+    assert(found);
+    conn->get_cfheaders(start, cf_stop_);
+  } else {
+    cf_request_ = CfRequest::FILTERS;
+    cf_stop_height_ =
+        std::min<size_t>(tip, cfilter_height_ + MAX_GETCFILTERS_SIZE - 1);
+    cf_stop_ = chain_.find_hash(cf_stop_height_, found);
+    assert(found);
+    conn->get_cfilters(cfilter_height_, cf_stop_);
+  }
+  LOG_DEBUG(log, "sent compact filter request to peer {}, stop height {}",
+            conn->peer(), cf_stop_height_);
+  conn->cf_timer_.set_callback([this, conn]() {
+    log->warn("compact filter request to peer {} timed out", conn->peer());
+    notify_error(conn, "compact filter timeout");
+  });
+  conn->cf_timer_.start(CF_TIMEOUT);
+}
+
+void Client::rewind_filter_headers() {
+  size_t height = std::min(cfheaders_->size(), chain_.height() + 1);
+  bool found = true;
+  while (height > 0 &&
+         chain_.find_hash(height - 1, found) !=
+             cfheaders_->block_hash(height - 1)) {
+    height--;
+  }
+  if (height < cfheaders_->size()) {
+    log->info("dropping filter headers above height {} after a reorg",
+              height - 1);
+    cfheaders_->truncate(height);
+    cf_checkpoints_.clear();
+    if (cfilter_height_ > height) {
+      cfilter_height_ = height;
+    }
+  }
+}
+
+bool Client::is_cf_reply(const Connection *conn, CfRequest type) const {
+  if (cf_request_ != type || conn->peer().addr != cf_peer_) {
+    LOG_DEBUG(log, "ignoring unsolicited compact filter message from peer {}",
+              conn->peer());
+    return false;
+  }
+  return true;
+}
+
+void Client::finish_cf_request(Connection *conn, const char *error) {
+  conn->cf_timer_.stop();
+  cf_request_ = CfRequest::NONE;
+  cf_stop_ = empty_hash;
+  if (error != nullptr) {
+    log->warn("peer {} sent a bad compact filter reply: {}", conn->peer(),
+              error);
+    cf_checkpoints_.clear();
+    conn->misbehaving(Connection::MISBEHAVIOR_LIMIT, error);
+  }
+  sync_filters();
+  sync_rescan();  // the rescan may be waiting on filter headers
+}
+
+void Client::notify_cfcheckpt(Connection *conn, const CFCheckpt &checkpt) {
+  if (!is_cf_reply(conn, CfRequest::CHECKPT) ||
+      checkpt.stop_hash != cf_stop_) {
+    return;
+  }
+  const auto &headers = checkpt.filter_headers;
+  if (checkpt.filter_type != BASIC_FILTER ||
+      headers.size() != cf_stop_height_ / CFCHECKPT_INTERVAL) {
+    finish_cf_request(conn, "bad cfcheckpt");
+    return;
+  }
+  // the peer has to agree with the filter headers we already have
+  for (size_t i = 0; i < headers.size(); i++) {
+    const size_t height = (i + 1) * CFCHECKPT_INTERVAL;
+    if (height < cfheaders_->size() &&
+        headers[i] != cfheaders_->header(height)) {
+      finish_cf_request(conn, "cfcheckpt conflicts with our filter headers");
+      return;
+    }
+  }
+  cf_checkpoints_ = headers;
+  finish_cf_request(conn);
+}
+
+void Client::notify_cfheaders(Connection *conn, const CFHeaders &headers) {
+  if (!is_cf_reply(conn, CfRequest::HEADERS) ||
+      headers.stop_hash != cf_stop_) {
+    return;
+  }
+  const size_t start = cfheaders_->size();
+  const auto &filter_hashes = headers.filter_hashes;
+  if (headers.filter_type != BASIC_FILTER ||
+      filter_hashes.size() != cf_stop_height_ - start + 1) {
+    finish_cf_request(conn, "bad cfheaders");
+    return;
+  }
+  std::vector<hash_t> block_hashes(filter_hashes.size());
+  for (size_t i = 0; i < block_hashes.size(); i++) {
+    bool found;
+    block_hashes[i] = chain_.find_hash(start + i, found);
+    if (!found) {
+      finish_cf_request(conn);  // our chain changed, try again
+      return;
+    }
+  }
+  if (block_hashes.back() != cf_stop_) {
+    finish_cf_request(conn);
+    return;
+  }
+  if (!cfheaders_->extend(headers.prev_filter_header, block_hashes,
+                          filter_hashes, cf_checkpoints_)) {
+    finish_cf_request(conn, "cfheaders don't connect or match checkpoints");
+    return;
+  }
+  log->info("synced filter headers to height {} via peer {}",
+            cfheaders_->size() - 1, conn->peer());
+  finish_cf_request(conn);
+}
+
+void Client::sync_rescan() {
+  if (!rescan_ || shutdown_ || need_headers_) {
+    return;
+  }
+  if (!rescan_started_) {
+    rescan_started_ = true;
+    const size_t to = settings_.rescan_to ? settings_.rescan_to : get_height();
+    size_t from = settings_.rescan_from;
+    if (settings_.rescan_since) {
+      // from 0 would resume the saved rescan instead
+      from = std::max<size_t>(chain_.height_at_time(settings_.rescan_since), 1);
+      log->info("rescanning from height {}, the first at or past {}", from,
+                settings_.rescan_since);
+    }
+    if (!rescan_->start(from, std::min(to, get_height()))) {
+      rescan_.reset();
+      return;
+    }
+  }
+  if (rescan_->finished()) {
+    return;
+  }
+  rescan_->scan_local();
 
-void Client::run() {
-  log->debug("connecting to network as {}", us_.user_agent);
-  for (const auto &seed : testSeeds) {
-    lookup_seed(seed);
+  // every filter peer that isn't busy gets a batch, up to our filter headers
+  for (auto &pr : connections_) {
+    Connection *conn = pr.second.get();
+    const bool syncing = pr.first == cf_peer_ && cf_request_ != CfRequest::NONE;
+    if (!serves_filters(conn) || syncing || rescan_->busy(pr.first)) {
+      continue;
+    }
+    size_t start, stop;
+    hash_t stop_hash;
+    if (!rescan_->assign(pr.first, cfheaders_->size(), start, stop,
+                         stop_hash)) {
+      break;
+    }
+    LOG_DEBUG(log, "rescanning heights {} to {} with peer {}", start, stop,
+              conn->peer());
+    conn->get_cfilters(start, stop_hash);
+    conn->cf_timer_.set_callback([this, conn]() {
+      log->warn("rescan request to peer {} timed out", conn->peer());
+      notify_error(conn, "compact filter timeout");
+    });
+    conn->cf_timer_.start(CF_TIMEOUT);
   }
 }
 
-void Client::lookup_seed(const std::string &seed) {
-  auto request = loop_->resource<uvw::GetAddrInfoReq>();
-  request->on<uvw::ErrorEvent>([=](const auto &, auto &req) {
-    log->warn("async dns resolution to {} failed", seed);
-  });
-  request->on<uvw::AddrInfoEvent>([=](const auto &event, auto &req) {
-    for (const addrinfo *p = event.data.get(); p != nullptr; p = p->ai_next) {
-      seed_peers_.emplace(p);
+void Client::notify_rescan_match(size_t height, const hash_t &hash) {
+  log->info("rescan: block {} at height {} matches a watched script",
+            to_hex(hash), height);
+  want_block(height, hash);
+}
+
+void Client::notify_cfilter(Connection *conn, const CFilter &filter) {
+  const Addr &addr = conn->peer().addr;
+  if (rescan_ && rescan_->busy(addr)) {
+    bool done;
+    if (filter.filter_type != BASIC_FILTER ||
+        !rescan_->add_filter(addr, filter.block_hash,
+                             std::string(filter.filter), done)) {
+      log->warn("peer {} sent an unexpected cfilter", conn->peer());
+      rescan_->release(addr);
+      conn->misbehaving(Connection::MISBEHAVIOR_LIMIT, "unexpected cfilter");
+    } else if (done) {
+      conn->cf_timer_.stop();
+      sync_rescan();  // the peer can start on the next batch
     }
-    connect_to_addr(select_peer());
-    remove_dns_request(&req);
-  });
-  request->nodeAddrInfo(seed);
-  dns_requests_.push_back(request);
+    return;
+  }
+  if (!is_cf_reply(conn, CfRequest::FILTERS)) {
+    return;
+  }
+  const size_t height = cfilter_height_;
+  if (filter.filter_type != BASIC_FILTER || height >= cfheaders_->size() ||
+      filter.block_hash != cfheaders_->block_hash(height)) {
+    finish_cf_request(conn, "unexpected cfilter");
+    return;
+  }
+  if (!cfheaders_->check_filter(height, filter.filter)) {
+    finish_cf_request(conn, "cfilter doesn't match its filter header");
+    return;
+  }
+  const GcsFilter gcs(filter.block_hash, filter.filter);
+  if (!gcs.valid()) {
+    finish_cf_request(conn, "malformed cfilter");
+    return;
+  }
+  if (filter_store_) {
+    filter_store_->put(height, filter.block_hash, filter.filter);
+  }
+  if (gcs.match_any(watch_.elements())) {
+    log->info("block {} at height {} matches a watched script",
+              to_hex(filter.block_hash), height);
+    want_block(height, filter.block_hash);
+  }
+  cfilter_height_++;
+  if (height == cf_stop_height_) {
+    log->info("checked compact filters to height {}", height);
+    finish_cf_request(conn);
+  }
 }
 
-Addr Client::select_peer() const {
-  // list of peers we are already connected to
-  std::unordered_set<Addr> connections;
-  for (const auto &pr : connections_) {
-    connections.insert(pr.first);
+void Client::notify_headers(Connection *conn, std::string &&raw_headers,
+                            const uint32_t *checksum,
+                            std::chrono::milliseconds elapsed,
+                            const Connection::HeadersPart &part) {
+  // trusted segments are checked against their checkpoint instead
+  const HeaderSegment *seg = sync_.find(conn->peer().addr);
+  const bool check_pow = seg == nullptr || !seg->trusted;
+  if (part.first) {
+    // the first headers past a recent tip end the bulk load, compacting
+    // before they're written
+    chain_.set_bulk_load(!chain_.tip_is_recent());
+  }
+  if (part.last) {
+    addrman_.headers(conn->peer().addr, part.count, elapsed);
   }
 
-  // first try to get a peer from the regular list
-  std::vector<Addr> peers;
-  for (const auto &peer : peers_) {
-    if (connections.find(peer.addr) == connections.end()) {
-      peers.push_back(peer.addr);
+  // Replies come in the order they were asked for, and unsolicited
+  // announcements are taken as unpipelined. The next request goes out
+  // before this is submitted, since small messages are validated right
+  // away.
+  if (part.first) {
+    conn->reply_req_ = {empty_hash, false};
+    if (!conn->header_requests_.empty()) {
+      conn->reply_req_ = conn->header_requests_.front();
+      conn->header_requests_.pop_front();
+    } else if (part.last && raw_headers.size() >= HeadersView::stride) {
+      // an announcement, timed by its last header
+      const HeadersView view(raw_headers.data(),
+                             raw_headers.size() / HeadersView::stride);
+      block_announced(conn, view.hash(view.size() - 1));
+    }
+    conn->reply_start_ = empty_hash;
+    if (raw_headers.size() >= HeadersView::stride) {
+      conn->reply_start_ = HeadersView(raw_headers.data(), 1).prev_block(0);
+    }
+  }
+  conn->header_replies_.push_back({conn->reply_req_, part});
+  if (seg != nullptr && part.last) {
+    pipeline_headers(conn, *seg, part.count, raw_headers);
+  }
+  validator_.submit(conn->peer().addr, std::move(raw_headers), check_pow,
+                    checksum);
+}
+
+void Client::notify_validated(const Addr &addr,
+                              std::vector<BlockHeader> &block_headers,
+                              bool ok, bool checked) {
+  if (shutdown_) {
+    return;
+  }
+  Connection *conn = find_connection(addr);
+  Connection::HeadersReply reply{{empty_hash, false},
+                                 {block_headers.size(), true, true}};
+  if (conn != nullptr && !conn->header_replies_.empty()) {
+    reply = conn->header_replies_.front();
+    conn->header_replies_.pop_front();
+  }
+  const bool mirrored = mirror_ && mirror_->owns(addr);
+  if (mirrored) {
+    std::deque<MirrorPart> &parts = mirror_parts_[addr];
+    if (parts.empty()) {
+      return;
+    }
+    const MirrorPart part = parts.front();
+    parts.pop_front();
+    if (part.stale) {
+      LOG_DEBUG(log, "dropping headers from cancelled mirror job {}", addr);
+      return;
     }
+    reply.part = part.part;
+  }
+  if (!ok) {
+    // drop the whole message, and let another peer try this segment
+    log->warn("headers from peer {} failed validation", addr);
+    if (conn != nullptr) {
+      conn->misbehaving(Connection::MISBEHAVIOR_LIMIT, "invalid headers");
+    }
+    if (mirrored) {
+      drop_mirror_job(addr, true);
+    }
+    cancel_hdr_timeout(addr);
+    sync_.release(addr, true);
+    sync_more_headers();
+    return;
+  }
+
+  std::vector<BlockHeader> ready;
+  bool stale_tip = false;
+  const bool synced = sync_.add_headers(addr, block_headers, ready,
+                                        reply.part.count, !reply.part.last);
+  if (conn != nullptr && reply.part.first) {
+    conn->reply_synced_ = synced;
+  }
+  if (mirrored && !synced) {
+    // the dump isn't the chain we're building on
+    log->warn("headers from mirror job {} don't extend its segment", addr);
+    drop_mirror_job(addr, true);
+    sync_.release(addr, true);
+    sync_more_headers();
+    return;
   }
-  if (peers.size()) {
-    auto it = random_choice(peers.begin(), peers.end());
-    log->debug("select_peer() choosing peer {} from peers", *it);
-    return *it;
+  if (synced && reply.part.last) {
+    // with the next batch already asked for, the peer keeps its segment
+    // if this batch ended where that request starts
+    const Connection::HeadersRequest *next = nullptr;
+    if (conn != nullptr && !conn->header_replies_.empty()) {
+      next = &conn->header_replies_.front().req;
+    } else if (conn != nullptr && !conn->header_requests_.empty()) {
+      next = &conn->header_requests_.front();
+    }
+    if (next == nullptr || !next->pipelined ||
+        !sync_.resume(addr, next->from)) {
+      cancel_hdr_timeout(addr);
+    }
+  } else if (synced) {
+    // the rest of the message is on its way, under the same deadline
+  } else if (reply.req.pipelined) {
+    // the batch before it was the segment's last, or was rejected
+    LOG_DEBUG(log, "dropping stale pipelined headers from peer {}", addr);
+    return;
+  } else if (!reply.part.first && conn != nullptr && conn->reply_synced_) {
+    // the segment took the start of the message, but not this part
+    LOG_DEBUG(log, "dropping the rest of a headers reply from peer {}", addr);
+    return;
+  } else if (!checked) {
+    // only a trusted segment may skip the proof of work
+    LOG_DEBUG(log, "dropping unchecked headers from peer {}", addr);
+    return;
+  } else {
+    // Not a reply to one of our segment requests, e.g. a new block
+    // announcement. If it doesn't connect we have a gap to fill.
+    ready = block_headers;
+    if (!ready.empty() && !chain_.has_block(ready.front().prev_block)) {
+      need_headers_ = true;
+      progress_.set_synced(false);
+    }
+    if (conn != nullptr && !presync_headers(conn, reply.part, ready)) {
+      conn->misbehaving(Connection::MISBEHAVIOR_LIMIT, "invalid headers");
+      return;
+    }
+    if (tip_check_.pending(addr)) {
+      // an answer to check_tip(), which counts the headers we're missing
+      std::vector<hash_t> hashes;
+      hashes.reserve(block_headers.size());
+      for (const auto &hdr : block_headers) {
+        hashes.push_back(hdr.block_hash);
+      }
+      std::unique_ptr<bool[]> known(new bool[hashes.size()]);
+      const size_t unknown =
+          hashes.size() - chain_.has_blocks(hashes.data(), hashes.size(),
+                                            known.get());
+      stale_tip = tip_check_.answered(addr, unknown);
+      if (stale_tip) {
+        log->warn("{} peers, last {}, are ahead of our tip {}",
+                  tip_check_.disagree(), addr, chain_.tip());
+      }
+    }
   }
+  LOG_DEBUG(log, "got {} header(s) from peer {}, {} ready to insert",
+            block_headers.size(), addr, ready.size());
 
-  // otherwise use the seed peer list
-  for (const auto &peer : seed_peers_) {
-    if (connections.find(peer) == connections.end()) {
-      peers.push_back(peer);
+  if (!ready.empty()) {
+    const hash_t old_tip = chain_.tip().block_hash;
+    if (!chain_.put_block_headers(ready)) {
+      // the headers past the tip may all be bad now, so plan again
+      log->warn("headers from peer {} failed validation", addr);
+      sync_.clear();
+      need_headers_ = true;
+      progress_.set_synced(false);
+      if (tip_cb_ && chain_.tip().block_hash != old_tip) {
+        tip_cb_(chain_.tip());
+      }
+      // small messages are validated while the connection is handling
+      // them, so it can't be deleted here
+      auto it = connections_.find(addr);
+      if (it != connections_.end()) {
+        it->second->misbehaving(Connection::MISBEHAVIOR_LIMIT,
+                                "invalid header");
+      }
+      return;
+    }
+    if (conn != nullptr) {
+      conn->last_headers_ = now();  // protects it from eviction
+      conn->cost_.headers += ready.size();
     }
+    progress_.added(addr, ready.size(), chain_.height(), now());
+    log->info("saved chain tip {} via peer {}, {} to go", chain_.tip(), addr,
+              progress_.remaining());
+    if (headers_cb_) {
+      headers_cb_(ready);
+    }
+    if (tip_cb_ && chain_.tip().block_hash != old_tip) {
+      tip_cb_(chain_.tip());
+    }
+  }
+  for (const auto &hdr : ready) {
+    if (inv_tracker_.finish(Inv(InvType::BLOCK, hdr.block_hash))) {
+      LOG_DEBUG(log, "de-queueing inv");
+    }
+  }
+
+  if (stale_tip) {
+    resync_headers();
+    sync_filters();
+    return;
+  }
+  if (need_headers_ && sync_.finished() && chain_.tip_is_recent()) {
+    log->info("header syncing finished, tip is {}", chain_.tip());
+    need_headers_ = false;
+    progress_.set_synced(true);
+    sync_filters();
+    sync_rescan();
+    return;
   }
-  assert(peers.size());
-  auto it = random_choice(peers.begin(), peers.end());
-  log->debug("select_peer() choosing peer {} from seed peers", *it);
-  return *it;
+  sync_more_headers();
+  sync_filters();
 }
 
-bool Client::is_connected_to_addr(const Addr &addr) const {
-  for (const auto &pr : connections_) {
-    if (pr.first == addr) return true;
+bool Client::presync_headers(Connection *conn,
+                             const Connection::HeadersPart &part,
+                             std::vector<BlockHeader> &ready) {
+  std::unique_ptr<HeaderPresync> &presync = conn->presync_;
+  if (presync == nullptr) {
+    PresyncAnchor anchor;
+    if (!part.first || ready.empty() ||
+        !chain_.presync_anchor(ready.front().prev_block, anchor)) {
+      return true;  // the orphan pool has a limit of its own
+    }
+    const uint256 min_work =
+        min_storable_work(chain_.chainwork(), chain_.tip().difficulty);
+    uint256 work = anchor.chainwork;
+    for (const auto &hdr : ready) {
+      work += block_work(hdr.difficulty);
+    }
+    if (work >= min_work) {
+      return true;
+    }
+    if (part.count < MAX_HEADERS_RESULTS) {
+      // that's all the peer has, e.g. a stale block
+      LOG_DEBUG(log, "ignoring {} low-work header(s) after height {} from "
+                "peer {}", ready.size(), anchor.height, conn->peer());
+      ready.clear();
+      return true;
+    }
+    log->info("presyncing a low-work chain after height {} from peer {}",
+              anchor.height, conn->peer());
+    presync.reset(new HeaderPresync(anchor, min_work, adjusted_time()));
+  }
+
+  const HeaderPresync::Phase before = presync->phase();
+  std::vector<BlockHeader> hdrs;
+  hdrs.swap(ready);
+  const char *error = nullptr;
+  const HeaderPresync::Result result =
+      presync->process(hdrs, part.first, adjusted_time(), ready, error);
+  if (result != HeaderPresync::Result::OK) {
+    ready.clear();
+    presync.reset();
+    if (result == HeaderPresync::Result::INVALID) {
+      log->warn("presynced headers from peer {} are invalid: {}",
+                conn->peer(), error);
+      return false;
+    }
+    LOG_DEBUG(log, "stopped presyncing peer {}: {}", conn->peer(), error);
+    return true;
+  }
+  if (!part.last) {
+    return true;
+  }
+  hash_t next = presync->cursor();
+  switch (presync->phase()) {
+    case HeaderPresync::Phase::PRESYNC:
+      if (part.count < MAX_HEADERS_RESULTS) {
+        LOG_DEBUG(log, "chain of peer {} ends at height {} with too little "
+                  "work", conn->peer(), presync->height());
+        presync.reset();
+        return true;
+      }
+      break;
+    case HeaderPresync::Phase::REDOWNLOAD:
+      if (before == HeaderPresync::Phase::PRESYNC) {
+        log->info("presynced chain of peer {} has the work at height {}, "
+                  "downloading it again", conn->peer(), presync->height());
+      } else if (part.count < MAX_HEADERS_RESULTS) {
+        LOG_DEBUG(log, "peer {} stopped short of its presynced chain",
+                  conn->peer());
+        presync.reset();
+        return true;
+      }
+      break;
+    case HeaderPresync::Phase::DONE:
+      presync.reset();
+      if (part.count < MAX_HEADERS_RESULTS || ready.empty()) {
+        return true;
+      }
+      next = ready.back().block_hash;  // carry on along the chain
+      break;
   }
-  return false;
+  conn->header_requests_.push_back({next, false});
+  conn->get_headers({next}, empty_hash);
+  return true;
 }
 
-void Client::connect_to_addr(const Addr &addr) {
-  log->debug("connecting to peer {}", addr);
+bool Client::need_inv(const Inv &inv, const bool *known) {
+  // did we get this recently, or are we already trying to?
+  if (inv_tracker_.recent(inv.hash) || inv_tracker_.inflight(inv)) {
+    return false;
+  }
+  const bool have = inv.type == InvType::TX
+                        ? mempool_ && mempool_->contains(inv.hash)
+                        : known ? *known : chain_.has_block(inv.hash);
+  if (have) {
+    inv_tracker_.remember(inv.hash);
+  }
+  return !have;
+}
 
-  Connection *conn = new Connection(this, addr);
-  auto pr = connections_.insert(std::make_pair(addr, conn));
-  assert(pr.second);
+Inv Client::request_for(const Connection *conn, const Inv &inv) {
+  Inv req = inv;
+  if (inv.type == InvType::BLOCK && conn->compact_blocks() &&
+      !conn->filter_loaded_) {
+    req.type = InvType::CMPCT_BLOCK;
+  }
+  return req;
+}
 
-  auto timer = loop_->resource<uvw::TimerHandle>();
-  auto weak_timer = timer->weak_from_this();
-  auto cancel_timer = [=]() {
-    if (auto t = weak_timer.lock()) t->close();
-  };
+void Client::notify_invs(Connection *conn, const std::vector<Inv> &invs) {
+  std::vector<hash_t> blocks;
+  for (const Inv &inv : invs) {
+    if (is_block(inv.type)) {
+      blocks.push_back(inv.hash);
+    }
+  }
+  if (blocks.size() < 2) {
+    for (const Inv &inv : invs) {
+      notify_inv(conn, inv);  // nothing to batch
+    }
+    return;
+  }
+  std::unique_ptr<bool[]> have(new bool[blocks.size()]);
+  chain_.has_blocks(blocks.data(), blocks.size(), have.get());
+  size_t i = 0;
+  for (const Inv &inv : invs) {
+    notify_inv(conn, inv, is_block(inv.type) ? &have[i++] : nullptr);
+  }
+}
 
-  conn->tcp_->once<uvw::ErrorEvent>([=](const auto &exc, auto &c) {
-    if (exc.code() == ECONNREFUSED) {
-      log->debug("peer {} refused our TCP request", conn->peer());
-    } else {
-      log->warn("error from peer {}: {} {} {}", conn->peer(), exc.what(),
-                exc.name(), exc.code());
+void Client::notify_inv(Connection *conn, const Inv &inv, const bool *have) {
+  HeapScope scope(HeapTag::INV);
+  const Addr &addr = conn->peer().addr;
+  if (is_block(inv.type)) {
+    block_announced(conn, inv.hash);
+  }
+  if (inv.type == InvType::TX && broadcasts_.seen(inv.hash, addr)) {
+    log->info("peer {} announced our transaction {}, {} peer(s) have it",
+              conn->peer(), to_hex(inv.hash),
+              broadcasts_.propagated(inv.hash));
+    return;
+  }
+  std::vector<Addr> *peers = wanted_inv_.find(inv);
+  if (peers != nullptr) {
+    // not requested yet, so this peer can share the work
+    if (std::find(peers->begin(), peers->end(), addr) == peers->end()) {
+      peers->push_back(addr);
     }
-    cancel_timer();
-    remove_connection(conn);
-  });
-  conn->tcp_->on<uvw::DataEvent>([=](const auto &data, auto &) {
-    conn->read(data.data.get(), data.length);
-  });
-  conn->tcp_->once<uvw::CloseEvent>([=](const auto &, auto &tcp) {
-    log->info("close event for connection {}", addr);
-    cancel_timer();
-    connect_to_new_peer();
-  });
-  conn->tcp_->once<uvw::ConnectEvent>([=](const auto &, auto &) {
-    log->info("connected to new peer {}, connections = {}", addr,
-              connections_.size());
-    cancel_timer();
-    conn->tcp_->read();
-    conn->send_version();
-  });
-  conn->tcp_->once<uvw::EndEvent>([=](const auto &, auto &c) {
-    log->info("remote peer {} closed connection", addr);
-    remove_connection(conn);
-  });
-  conn->connect();
+    return;
+  }
+  if (inv_tracker_.announce(inv, addr)) {
+    LOG_DEBUG(log, "inv {} is already in flight", to_hex(inv.hash));
+    return;
+  }
+  if (!need_inv(inv, have)) {
+    LOG_DEBUG(log, "skipping duplicate inv");
+    return;
+  }
+  if (is_block(inv.type) && !conn->congested()) {
+    // blocks don't wait for the batch; the first peer to announce one gets
+    // asked, and the others are its fallbacks as they announce it too
+    log->info("fetching new block {} from peer {}", to_hex(inv.hash),
+              conn->peer());
+    inv_tracker_.request(inv, addr, {addr}, now());
+    conn->get_data({request_for(conn, inv)});
+    return;
+  }
+  const bool tx = !is_block(inv.type);
+  if (tx && wanted_txs_ >= MAX_WANTED_TXS) {
+    LOG_DEBUG(log, "dropping inv {}, {} transactions are waiting already",
+              to_hex(inv.hash), wanted_txs_);
+    return;
+  }
+  log->warn("fetching new inv {} {}", to_string(inv.type), to_hex(inv.hash));
+  wanted_inv_.emplace(inv, std::vector<Addr>{addr});
+  wanted_txs_ += tx;
+  schedule_getdata();
+}
 
-  timer->once<uvw::ErrorEvent>(
-      [=](const auto &, auto &timer) { timer.close(); });
-  timer->on<uvw::TimerEvent>([=](const auto &, auto &timer) {
-    log->warn("connection to {} timed out", conn->peer());
-    remove_connection(conn);
-    timer.close();
-  });
-  timer->start(std::chrono::seconds(1), NO_REPEAT);
+void Client::notify_merkleblock(Connection *conn, const BlockHeader &hdr,
+                                const std::vector<hash_t> &matches) {
+  if (inv_tracker_.finish(Inv(InvType::BLOCK, hdr.block_hash))) {
+    conn->cost_.blocks++;
+  }
+  log->info("block {} from peer {} has {} matching transaction(s)",
+            to_hex(hdr.block_hash), conn->peer(), matches.size());
+  for (const auto &txid : matches) {
+    log->info("matched transaction {}", to_hex(txid));
+    confirm_tx(txid, hdr.block_hash);
+  }
 }
 
-void Client::connect_to_new_peer() {
-  if (!shutdown_ && connections_.size() < settings_.max_connections) {
-    connect_to_addr(select_peer());
+void Client::confirm_tx(const hash_t &txid, const hash_t &block_hash) {
+  if (mempool_ && mempool_->confirm(txid)) {
+    log->info("unconfirmed transaction {} was mined in block {}",
+              to_hex(txid), to_hex(block_hash));
+  }
+  if (broadcasts_.remove(txid)) {
+    log->info("our transaction {} was mined in block {}", to_hex(txid),
+              to_hex(block_hash));
   }
 }
 
-size_t Client::get_height() const { return chain_.height(); }
+bool Client::broadcast(const std::string &raw) {
+  hash_t txid;
+  if (!broadcasts_.add(raw, txid)) {
+    return false;
+  }
+  log->info("broadcasting transaction {}, {} byte(s)", to_hex(txid),
+            raw.size());
+  announce_tx(txid);
+  return true;
+}
 
-void Client::remove_connection(Connection *conn) {
-  const Addr &addr = conn->peer().addr;
-  log->warn("removing connection to {}", conn->peer());
-  auto it = connections_.find(addr);
-  if (it == connections_.end()) {
-    log->warn("connection {} was already removed", addr);
+void Client::announce_tx(const hash_t &txid) {
+  const TxBroadcast::Entry *entry = broadcasts_.find(txid);
+  if (entry == nullptr) {
     return;
   }
+  std::vector<Connection *> candidates;
+  for (auto &pr : connections_) {
+    Connection *conn = pr.second.get();
+    const auto &told = entry->told;
+    if (conn->ready() && !conn->dropping() &&
+        std::find(told.begin(), told.end(), pr.first) == told.end()) {
+      candidates.push_back(conn);
+    }
+  }
+  // a random few, so the same peers don't hear of everything first
+  const size_t n = std::min(candidates.size(), BROADCAST_PEERS);
+  std::vector<Addr> peers;
+  for (size_t i = 0; i < n; i++) {
+    std::swap(candidates[i],
+              candidates[i + rand64() % (candidates.size() - i)]);
+    candidates[i]->announce_tx(txid);
+    peers.push_back(candidates[i]->peer().addr);
+  }
+  if (!peers.empty()) {
+    broadcasts_.told(txid, peers, now());
+  }
+}
 
-  bool erased = false;
-  for (auto it = peers_.begin(); it != peers_.end(); ++it) {
-    if (it->addr == conn->peer().addr) {
-      peers_.erase(it);
-      erased = true;
-      break;
+const std::string *Client::serve_tx(Connection *conn, const hash_t &txid) {
+  const std::string *msg = broadcasts_.serve(txid, conn->peer().addr);
+  if (msg != nullptr) {
+    log->info("peer {} fetched our transaction {}", conn->peer(),
+              to_hex(txid));
+  }
+  return msg;
+}
+
+bool Client::want_tx_relay() const {
+  // a bloom filter turns relay on, for just the transactions that match it
+  return mempool_ && !filter_ && !watch_.empty();
+}
+
+void Client::notify_block(Connection *conn, Block &&block) {
+  inv_tracker_.finish(Inv(InvType::BLOCK, block.header.block_hash));
+  const bool checksum = !block.headers.sealed;
+  block_verifier_.submit(conn->peer().addr, std::move(block), checksum);
+}
+
+void Client::notify_block_verified(const Addr &addr, Block &block, bool ok) {
+  const hash_t &hash = block.header.block_hash;
+  auto it = connections_.find(addr);
+  if (rebuilt_.erase(hash) && !ok) {
+    // a short id probably matched the wrong pool transaction
+    log->info("rebuilt block {} has the wrong merkle root, fetching it",
+              to_hex(hash));
+    if (it != connections_.end()) {
+      it->second->get_data({Inv(InvType::BLOCK, hash)});
+    }
+    return;
+  }
+  if (!ok) {
+    log->warn("peer {} sent block {} with a bad checksum or merkle root",
+              addr, to_hex(hash));
+    blocks_.failed(addr, hash);
+    if (it != connections_.end()) {
+      it->second->misbehaving(Connection::MISBEHAVIOR_LIMIT, "bad block");
     }
+    fetch_blocks();
+    return;
+  }
+  if (it != connections_.end()) {
+    it->second->cost_.blocks++;
   }
-  if (!erased && !shutdown_) {
-    log->error("failed to remove peer {} after error", conn->peer());
+  if (!blocks_.requested(addr, hash)) {
+    log->info("block {} from peer {} has {} matching transaction(s)",
+              to_hex(hash), addr, scan_block(block));
+    return;
+  }
+  blocks_.received(addr, std::move(block));
+  size_t height;
+  Addr peer;
+  Block next;
+  while (blocks_.next(height, peer, next)) {
+    log->info("block {} at height {} from peer {} has {} matching "
+              "transaction(s)",
+              to_hex(next.header.block_hash), height, peer, scan_block(next));
+    if (block_store_) {
+      block_store_->put(height, next);
+    }
   }
+  fetch_blocks();
+}
 
-  // TODO: double check that the conn destructor actually shuts down its
-  // resources properly.
-  connections_.erase(it);
+size_t Client::scan_block(const Block &block) {
+  const hash_t &hash = block.header.block_hash;
+  // With unconfirmed transactions to resolve, every txid is needed, and the
+  // spent outputs evict double spends; ours being broadcast need every txid
+  // too. Otherwise just the matches are decoded.
+  const bool track = mempool_ && !mempool_->empty();
+  const bool ours = !broadcasts_.empty();
+  const char *base = block.raw.data();
+  std::vector<hash_t> conflicts;
+  size_t matched = 0;
+  const IndexEntry *entry = chain_.index_entry(hash);
+  const uint32_t height = entry != nullptr ? entry->height : 0;
+  const uint64_t balance = utxos_.confirmed();
+  for (size_t i = 0; i < block.txns.size(); i++) {
+    // spending a watched output needn't match, so check every input
+    if (!utxos_.empty() && entry != nullptr) {
+      block.txns[i].any_input(base, [&](const hash_t &prev, uint32_t index) {
+        utxos_.spend(prev, index, height);
+        return false;
+      });
+    }
+    const bool match = watch_.matches(base, block.txns[i]);
+    if (!match && !track && !ours) {
+      continue;
+    }
+    const hash_t txid = block.txid(i);
+    if (match) {
+      log->info("matched transaction {}", to_hex(txid));
+      matched++;
+      if (entry != nullptr) {
+        const Tx tx = block.tx(i);
+        utxos_.add_outputs(txid, tx, height);
+        if (scripts_) {
+          scripts_->add(txid, tx, height);
+        }
+      }
+    }
+    if (track || ours) {
+      confirm_tx(txid, hash);
+    }
+    if (track) {
+      block.txns[i].any_input(base, [&](const hash_t &prev, uint32_t index) {
+        mempool_->spend(Outpoint{prev, index}, txid, conflicts);
+        return false;
+      });
+    }
+  }
+  for (const auto &txid : conflicts) {
+    log->warn("unconfirmed transaction {} was double spent in block {}",
+              to_hex(txid), to_hex(hash));
+  }
+  if (utxos_.confirmed() != balance) {
+    log->info("confirmed balance {} sat in {} watched output(s)",
+              utxos_.confirmed(), utxos_.size());
+  }
+  return matched;
 }
 
-void Client::shutdown() {
-  if (!shutdown_) {
-    log->info("shutting down client");
-    shutdown_ = true;
+void Client::want_block(size_t height, const hash_t &hash) {
+  Block block;
+  if (block_store_ && block_store_->read(hash, &block)) {
+    log->info("stored block {} at height {} has {} matching transaction(s)",
+              to_hex(hash), height, scan_block(block));
+    return;
+  }
+  if (blocks_.want(height, hash)) {
+    fetch_blocks();
+  }
+}
 
-    for (auto &pr : connections_) {
-      pr.second->shutdown();
+void Client::fetch_blocks() {
+  if (shutdown_ || !blocks_.assignable()) {
+    return;
+  }
+  // old blocks, so a pruned peer probably doesn't have them
+  std::vector<Connection *> peers;
+  for (auto &pr : connections_) {
+    Connection *conn = pr.second.get();
+    if (conn->ready() && (conn->peer().services & NODE_NETWORK)) {
+      peers.push_back(conn);
+    }
+  }
+  std::sort(peers.begin(), peers.end(),
+            [this](const Connection *a, const Connection *b) {
+              return blocks_.inflight(a->peer().addr) <
+                     blocks_.inflight(b->peer().addr);
+            });
+  const time_point t = now();
+  for (Connection *conn : peers) {
+    std::vector<hash_t> hashes;
+    blocks_.assign(conn->peer().addr, t, hashes);
+    if (hashes.empty()) {
+      continue;
+    }
+    std::vector<Inv> invs;
+    invs.reserve(hashes.size());
+    for (const auto &hash : hashes) {
+      invs.emplace_back(InvType::BLOCK, hash);
     }
-    cancel_hdr_timeout();
-    cancel_dns_requests();
+    conn->get_data(invs);
   }
 }
 
-void Client::notify_connected(Connection *conn) {
-  if (need_headers_ && !hdr_timeout_) {
-    log->info("starting header download");
-    sync_more_headers(conn);
+void Client::sweep_blocks() {
+  if (blocks_.empty()) {
+    return;
+  }
+  std::vector<Addr> stalled;
+  blocks_.stalled(now(), BLOCK_STALL, BLOCK_TIMEOUT, stalled);
+  for (const Addr &addr : stalled) {
+    blocks_.release(addr);
+    auto it = connections_.find(addr);
+    if (it != connections_.end()) {
+      log->warn("peer {} stalled the block download", it->second->peer());
+      notify_error(it->second.get(), "block download stalled");
+    }
   }
+  fetch_blocks();
 }
 
-void Client::notify_peer(Connection *conn, const NetAddr &addr) {
-  auto pr = peers_.insert(addr);
-  if (pr.second) {
-    log->info("added new peer {}, peer list size {}", addr, peers_.size());
-    if (connections_.size() < settings_.max_connections &&
-        !is_connected_to_addr(addr)) {
-      connect_to_addr(addr.addr);
+void Client::notify_tx(Connection *conn, const TxMsg &msg) {
+  const hash_t txid = msg.txid();
+  inv_tracker_.finish(Inv(InvType::TX, txid));
+  const Tx tx = msg.parse();
+  log->info("transaction {} from peer {} has {} input(s) and {} output(s)",
+            to_hex(txid), conn->peer(), tx.inputs.size(), tx.outputs.size());
+  if (watch_.matches(msg.raw.data(), msg.span)) {
+    log->info("transaction {} matches a watched element", to_hex(txid));
+    if (scripts_) {
+      scripts_->add(txid, tx, 0);
+    }
+    for (const TxIn &in : tx.inputs) {
+      utxos_.spend(in.prev_hash, in.prev_index, 0);
+    }
+    utxos_.add_outputs(txid, tx, 0);
+    std::vector<hash_t> conflicts;
+    if (mempool_ && mempool_->add(txid, tx, msg.raw.size(), conflicts)) {
+      log->info("tracking unconfirmed transaction {}, {} in the mempool",
+                to_hex(txid), mempool_->size());
+    }
+    for (const auto &other : conflicts) {
+      log->warn("transaction {} double spends unconfirmed transaction {}",
+                to_hex(txid), to_hex(other));
     }
-  } else {
-    log->debug("ignoring duplicate peer {}", addr);
   }
+  tx_pool_.add(msg.wtxid(), std::string(msg.raw));
 }
 
-void Client::notify_error(Connection *conn, const std::string &why) {
-  log->warn("error on connection to {}, reason: {}", conn->peer(), why);
-  remove_connection(conn);
+void Client::notify_compact_peer(Connection *conn) {
+  LOG_DEBUG(log, "peer {} supports compact blocks", conn->peer());
+  update_hb_peers();
 }
 
-void Client::sync_more_headers(Connection *conn) {
-  if (conn == nullptr) {
-    conn = random_connection();
-    assert(conn != nullptr);
+void Client::update_hb_peers() {
+  if (shutdown_) {
+    return;
+  }
+  std::vector<Connection *> peers;
+  for (auto &pr : connections_) {
+    Connection *conn = pr.second.get();
+    if (conn->ready() && conn->compact_blocks() && !conn->dropping()) {
+      peers.push_back(conn);
+    }
+  }
+  const size_t hb = std::min<size_t>(peers.size(), MAX_HB_PEERS);
+  std::partial_sort(peers.begin(), peers.begin() + hb, peers.end(),
+                    [this](const Connection *a, const Connection *b) {
+                      const auto *x = announces_.find(a->peer().addr);
+                      const auto *y = announces_.find(b->peer().addr);
+                      if ((x == nullptr) != (y == nullptr)) {
+                        return x != nullptr;
+                      }
+                      if (x != nullptr && x->lag_ms != y->lag_ms) {
+                        return x->lag_ms < y->lag_ms;
+                      }
+                      return a->rtt() < b->rtt();
+                    });
+  for (size_t i = 0; i < peers.size(); i++) {
+    const bool want = i < hb;
+    if (peers[i]->cmpct_hb_ != want) {
+      log->info("{} high bandwidth compact blocks from peer {}",
+                want ? "requesting" : "stopping", peers[i]->peer());
+      peers[i]->send_cmpct(want);
+    }
   }
-  auto peer = conn->peer();  // captured by value
-  assert(!hdr_timeout_);
-  hdr_timeout_ = loop_->resource<uvw::TimerHandle>();
-  hdr_timeout_->once<uvw::ErrorEvent>([this](const auto &, auto &timer) {
-    log->error("got error from header timer");
-    hdr_timeout_.reset();
-    timer.close();
-  });
-  hdr_timeout_->on<uvw::TimerEvent>([this, peer](const auto &, auto &timer) {
-    log->warn("get headers timeout from peer {}", peer);
-    timer.close();
-    hdr_timeout_.reset();
-    sync_more_headers();
-  });
-  hdr_timeout_->start(HEADER_TIMEOUT, NO_REPEAT);
-  conn->get_headers(chain_.tip());
 }
 
-void Client::notify_headers(Connection *conn,
-                            const std::vector<BlockHeader> &block_headers) {
-  cancel_hdr_timeout();
-  if (block_headers.empty() && chain_.tip_is_recent()) {
-    log->info("header syncing finished, tip is {}", chain_.tip());
-    need_headers_ = false;
+void Client::block_announced(Connection *conn, const hash_t &hash) {
+  if (need_headers_ || !chain_.tip_is_recent()) {
+    return;  // catching up, so these are old blocks
+  }
+  std::chrono::milliseconds lag;
+  if (!announces_.announced(hash, conn->peer().addr, now(), lag)) {
     return;
   }
-  if (block_headers.size() < 2000) {
-    log->warn("got {} new headers, last is {}", block_headers.size(),
-              *block_headers.end());
+  LOG_DEBUG(log, "peer {} announced block {} {}ms after the first",
+            conn->peer(), to_hex(hash), lag.count());
+  addrman_.announced(conn->peer().addr, lag);
+  if (lag.count() == 0) {
+    update_hb_peers();  // a new block, so rank by the ones before it
   }
+}
 
-  for (const auto &hdr : block_headers) {
-    chain_.put_block_header(hdr);
+void Client::notify_cmpctblock(Connection *conn, CmpctBlock &msg) {
+  const hash_t &hash = msg.header.block_hash;
+  block_announced(conn, hash);
+  if (!need_headers_ && !chain_.has_block(hash)) {
+    // as if it had come in a headers message
+    std::string raw(HeadersView::stride, '\0');
+    msg.header.pack(&raw[0]);
+    validator_.submit(conn->peer().addr, std::move(raw));
+  }
 
-    Inv inv(InvType::BLOCK, hdr.block_hash);
-    auto pos = pending_inv_.find(inv);
-    if (pos != pending_inv_.end()) {
-      log->debug("de-queueing inv");
-      pending_inv_.erase(pos);
-    }
+  const bool requested = inv_tracker_.finish(Inv(InvType::BLOCK, hash));
+  if ((!requested && watch_.empty()) || cmpct_blocks_.count(hash) ||
+      rebuilt_.contains(hash)) {
+    return;
   }
-  chain_.save_tip();
-  log->info("saved chain tip {} via peer {}", chain_.tip(), conn->peer());
-  sync_more_headers();
+  std::unique_ptr<PartialBlock> partial(new PartialBlock);
+  switch (partial->init(msg, tx_pool_)) {
+    case PartialBlock::Status::OK:
+      break;
+    case PartialBlock::Status::INVALID:
+      log->warn("peer {} sent an invalid cmpctblock", conn->peer());
+      conn->misbehaving(Connection::MISBEHAVIOR_LIMIT, "bad cmpctblock");
+      return;
+    case PartialBlock::Status::COLLISION:
+      log->info("cmpctblock {} has colliding short ids, fetching the block",
+                to_hex(hash));
+      conn->get_data({Inv(InvType::BLOCK, hash)});
+      return;
+  }
+  if (partial->missing().empty()) {
+    finish_cmpctblock(conn, *partial);
+    return;
+  }
+  conn->get_block_txn(hash, partial->missing());
+  cmpct_blocks_[hash] = PendingCmpct{conn->peer().addr, std::move(partial)};
 }
 
-bool Client::need_inv(const Inv &inv) const {
-  // are we already trying to get this block?
-  if (pending_inv_.find(inv) != pending_inv_.end()) {
-    return false;
+void Client::notify_blocktxn(Connection *conn, BlockTxn &msg) {
+  auto it = cmpct_blocks_.find(msg.block_hash);
+  if (it == cmpct_blocks_.end() || it->second.peer != conn->peer().addr) {
+    conn->misbehaving(10, "unrequested blocktxn");
+    return;
+  }
+  std::unique_ptr<PartialBlock> partial = std::move(it->second.block);
+  cmpct_blocks_.erase(it);
+  if (!partial->fill(msg)) {
+    log->warn("peer {} sent a blocktxn with the wrong transactions",
+              conn->peer());
+    conn->misbehaving(Connection::MISBEHAVIOR_LIMIT, "bad blocktxn");
+    return;
   }
-  return !chain_.has_block(inv.hash);
+  finish_cmpctblock(conn, *partial);
 }
 
-void Client::notify_inv(Connection *conn, const Inv &inv) {
-  if (need_inv(inv)) {
-    log->warn("fetching new inv {} {}", to_string(inv.type), to_hex(inv.hash));
-    pending_inv_.insert(inv);
-    log->debug("added inv, pending list = {}", pending_inv_.size());
-    conn->get_data(inv);
-  } else {
-    log->debug("skipping duplicate inv");
+void Client::finish_cmpctblock(Connection *conn, const PartialBlock &partial) {
+  const hash_t &hash = partial.header().block_hash;
+  Block block;
+  if (!partial.finish(block)) {
+    conn->get_data({Inv(InvType::BLOCK, hash)});
+    return;
+  }
+  rebuilt_.insert(hash);
+  block_verifier_.submit(conn->peer().addr, std::move(block));
+}
+
+void Client::schedule_getdata() {
+  if (!getdata_timer_.active()) {
+    getdata_timer_.start(settings_.getdata_delay);
   }
 }
 
-Connection *Client::random_connection() {
-  std::vector<Connection *> conns;
-  for (auto &c : connections_) {
-    if (c.second->connected()) {
-      conns.push_back(c.second.get());
+void Client::retry_invs(std::vector<InvTracker::Retry> &retries) {
+  size_t queued = 0;
+  for (auto &retry : retries) {
+    if (retry.second.empty()) {
+      LOG_DEBUG(log, "no other peer announced inv {}",
+                to_hex(retry.first.hash));
+      continue;
+    }
+    auto wanted = wanted_inv_.emplace(retry.first);
+    if (wanted.second && !is_block(retry.first.type)) {
+      wanted_txs_++;
     }
+    std::vector<Addr> &peers = *wanted.first;
+    for (const Addr &addr : retry.second) {
+      if (std::find(peers.begin(), peers.end(), addr) == peers.end()) {
+        peers.push_back(addr);
+      }
+    }
+    queued++;
   }
-  if (conns.empty()) {
-    log->warn("no connected peers, return nullptr from random_connection()");
-    return nullptr;
+  if (queued) {
+    log->info("asking again for {} of {} inv(s)", queued, retries.size());
+    schedule_getdata();
+  }
+}
+
+void Client::send_getdata() {
+  const time_point sent = now();
+  std::unordered_map<Connection *, std::vector<Inv> > batches;
+  wanted_inv_.for_each([&](const Inv &inv, const std::vector<Addr> &peers) {
+    // ask whichever announcing peer has been given the fewest items so far,
+    // and a congested peer only if no one else has it
+    Connection *best = nullptr;
+    size_t best_load = 0;
+    for (const Addr &addr : peers) {
+      auto it = connections_.find(addr);
+      if (it == connections_.end()) {
+        continue;
+      }
+      auto batch = batches.find(it->second.get());
+      size_t load = inv_tracker_.count(addr);
+      load += batch == batches.end() ? 0 : batch->second.size();
+      if (it->second->congested()) {
+        load += MAX_INV_SIZE;
+      }
+      if (best == nullptr || load < best_load) {
+        best = it->second.get();
+        best_load = load;
+      }
+    }
+    if (best == nullptr) {
+      LOG_DEBUG(log, "no peer left to fetch inv {}", to_hex(inv.hash));
+      return;
+    }
+    batches[best].push_back(request_for(best, inv));
+    inv_tracker_.request(inv, best->peer().addr, std::vector<Addr>(peers),
+                         sent);
+  });
+  wanted_inv_.clear();
+  wanted_txs_ = 0;
+  LOG_DEBUG(log, "added invs, pending list = {}", inv_tracker_.size());
+
+  for (const auto &pr : batches) {
+    LOG_DEBUG(log, "fetching {} inv(s) from peer {}", pr.second.size(),
+              pr.first->peer());
+    pr.first->get_data(pr.second);
   }
-  return *random_choice(conns.begin(), conns.end());
 }
 
-void Client::cancel_hdr_timeout() {
-  if (hdr_timeout_) {
-    hdr_timeout_->stop();
-    hdr_timeout_->close();
-    hdr_timeout_.reset();
+Connection *Client::random_connection(uint64_t services) {
+  if (handshaken_.empty()) {
+    log->warn("no connected peers, return nullptr from random_connection()");
+    return nullptr;
+  }
+  // Most peers have the services asked for, so a few random picks almost
+  // always find one; only when they all miss are the peers scanned.
+  for (size_t i = 0; i < RANDOM_CONNECTION_PICKS; i++) {
+    Connection *conn = *random_choice(handshaken_.begin(), handshaken_.end());
+    if ((conn->peer().services & services) == services) {
+      return conn;
+    }
   }
+  std::vector<Connection *> capable;
+  for (Connection *conn : handshaken_) {
+    if ((conn->peer().services & services) == services) {
+      capable.push_back(conn);
+    }
+  }
+  return capable.empty()
+             ? *random_choice(handshaken_.begin(), handshaken_.end())
+             : *random_choice(capable.begin(), capable.end());
 }
 
-void Client::cancel_dns_requests() {
-  for (auto &sp : dns_requests_) {
-    sp->cancel();
+void Client::cancel_hdr_timeout(const Addr &addr) {
+  auto it = connections_.find(addr);
+  if (it != connections_.end()) {
+    it->second->hdr_timer_.stop();
   }
-  dns_requests_.clear();
 }
 
-void Client::remove_dns_request(uvw::GetAddrInfoReq *req) {
-  auto p = std::find_if(dns_requests_.begin(), dns_requests_.end(),
-                        [=](const auto &p) { return p.get() == req; });
-  if (p == dns_requests_.end()) {
-    log->warn("cannot cancel dns request {}, it is not in request list",
-              (void *)req);
-    return;
+void Client::cancel_hdr_timeouts() {
+  for (auto &pr : connections_) {
+    pr.second->hdr_timer_.stop();
   }
-  (*p)->cancel();
-  dns_requests_.erase(p);
 }
 }  // namespace spv
@@ -17,19 +17,62 @@
 #pragma once
 
 #include <cstddef>
+#include <deque>
+#include <functional>
 #include <memory>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
 
 #include "./addr.h"
+#include "./addrman.h"
+#include "./announce.h"
+#include "./asmap.h"
+#include "./bloom.h"
 #include "./buffer.h"
+#include "./capture.h"
+#include "./block_download.h"
+#include "./block_store.h"
+#include "./cfheaders.h"
 #include "./chain.h"
+#include "./cmpct.h"
 #include "./config.h"
 #include "./connection.h"
+#include "./control_server.h"
+#include "./electrum_server.h"
+#include "./filter_server.h"
+#include "./hashmap.h"
+#include "./header_mirror.h"
+#include "./inv_tracker.h"
+#include "./io.h"
+#include "./loop_monitor.h"
+#include "./mempool.h"
+#include "./metrics_server.h"
 #include "./peer.h"
+#include "./peer_scaler.h"
+#include "./progress.h"
+#include "./replication.h"
+#include "./rescan.h"
+#include "./rpc_server.h"
+#include "./script_index.h"
+#include "./seed_resolver.h"
 #include "./settings.h"
+#include "./shaper.h"
+#include "./sockopt.h"
+#include "./query_server.h"
+#include "./status_server.h"
+#include "./tip_server.h"
+#include "./sync.h"
+#include "./timedata.h"
+#include "./timer_wheel.h"
+#include "./tip_check.h"
+#include "./tx_broadcast.h"
+#include "./uring.h"
 #include "./util.h"
+#include "./utxo_tracker.h"
+#include "./validate.h"
+#include "./verify.h"
+#include "./watch.h"
 
 namespace uvw {
 class Loop;
@@ -47,49 +90,346 @@ class Client {
   Client() = delete;
   Client(const Client &other) = delete;
 
-  // Send the version message to these seeds.
-  void run();
+  // Send the version message to these seeds. Returns false, having shut
+  // the client down, if one of its unix socket servers couldn't start.
+  bool run();
 
   void shutdown();
 
+  // get the current block height
+  size_t get_height() const;
+
+  // Load a file of consecutive 80-byte headers into the chain, or write
+  // the best chain to one, starting from the genesis block.
+  inline bool import_headers(const std::string &path) {
+    return chain_.import_headers(path);
+  }
+  inline bool export_headers(const std::string &path) const {
+    return chain_.export_headers(path);
+  }
+  inline bool export_proto(const std::string &path, size_t from,
+                           size_t to) const {
+    return chain_.export_proto(path, from, to);
+  }
+
+  inline const SyncProgress &progress() const { return progress_; }
+  inline const Chain &chain() const { return chain_; }
+
+  // Hooks for programs that embed the client, called on its loop: with
+  // every batch of headers handed to the chain, in order (some may have
+  // been duplicates or orphans), and then with the new tip if the best
+  // chain changed, which includes reorgs.
+  typedef std::function<void(const std::vector<BlockHeader> &)>
+      HeadersCallback;
+  typedef std::function<void(const BlockHeader &)> TipCallback;
+  inline void on_headers(HeadersCallback &&cb) { headers_cb_ = std::move(cb); }
+  inline void on_tip(TipCallback &&cb) { tip_cb_ = std::move(cb); }
+
+  // Start watching for another element, e.g. when a wallet adds an address.
+  // It's added to the bloom filter of every peer that has one loaded; with
+  // compact filters, past blocks need a rescan to find it.
+  void watch(const std::string &data);
+
+  // Push a serialized transaction to the network: it's announced to a few
+  // peers, served to the ones that ask for it, and announced to more until
+  // enough peers have it or it's mined. Returns false if it doesn't parse.
+  bool broadcast(const std::string &raw);
+
+  // For spv-replay, which feeds a capture written with --capture-file back
+  // through these in place of run(), on the client's loop. replay_start()
+  // starts the timers but connects to no one; replay_open() makes a
+  // connection to addr with no socket under it and sends our version;
+  // replay_read() hands it bytes as the peer sent them and replay_close()
+  // drops it.
+  void replay_start();
+  void replay_open(const Addr &addr);
+  void replay_read(const Addr &addr, const char *data, size_t size);
+  void replay_close(const Addr &addr);
+
+  // Called with what those connections write, which is otherwise dropped,
+  // e.g. for peers simulated on the loop. It mustn't call back into the
+  // client before it returns.
+  typedef std::function<void(const Addr &, const char *, size_t)>
+      ReplayWriteCallback;
+  inline void on_replay_write(ReplayWriteCallback &&cb) {
+    replay_write_cb_ = std::move(cb);
+  }
+
  private:
   const Settings &settings_;
-  std::unordered_set<Addr> seed_peers_;
-  std::unordered_set<NetAddr> peers_;
+
+  // options for every peer socket, from --socket-profile
+  const SocketTuning tuning_;
+
+  // --max-upload and --max-download, shared by every connection
+  TokenBucket send_limit_;
+  TokenBucket recv_limit_;
+
+  // declared before the connections and the client's own timers, which
+  // are all on it
+  TimerWheel timers_;
+
+  // the port peers listen on: --protocol-port, or the network's
+  inline uint16_t port() const {
+    return settings_.port ? settings_.port : network().port;
+  }
+  std::unique_ptr<IoPool> io_;               // set with --io-threads
+  std::unique_ptr<Ring> ring_;               // set with --io-uring
+  std::unique_ptr<LoopMonitor> monitor_;     // unless --slow-callback-ms=0
+  std::unique_ptr<CaptureWriter> capture_;   // set with --capture-file
+  WatchList watch_;                          // from --watch, plus watch()
+  UtxoTracker utxos_;                        // the outputs paying watch_
+  std::unique_ptr<BloomFilter> filter_;      // set with --watch
+  std::unique_ptr<MempoolTracker> mempool_;  // set with --mempool-mb
+  std::unique_ptr<MetricsServer> metrics_;   // set with --metrics-port
+  std::unique_ptr<StatusServer> status_;     // set with --status-socket
+  std::unique_ptr<QueryServer> query_;       // set with --query-socket
+  HeadersCallback headers_cb_;
+  TipCallback tip_cb_;
+  ReplayWriteCallback replay_write_cb_;
+
+  // BIP157 filter sync, set with --compact-filters: one peer at a time is
+  // asked for checkpoints, then filter headers up to our tip, then the
+  // filters from cfilter_height_ on. cf_stop_ is the last block of the
+  // outstanding request (all zeros if there isn't one), at cf_stop_height_.
+  enum class CfRequest { NONE, CHECKPT, HEADERS, FILTERS };
+  std::unique_ptr<FilterHeaderChain> cfheaders_;
+
+  // the filters kept on disk, with --filter-store-mb; before rescan_
+  std::unique_ptr<FilterStore> filter_store_;
+  std::unique_ptr<FilterServer> filter_server_;  // with --serve-filters
+  std::vector<hash_t> cf_checkpoints_;
+  size_t cfilter_height_;
+  CfRequest cf_request_;
+  Addr cf_peer_;
+  hash_t cf_stop_;
+  size_t cf_stop_height_;
+
+  // set with --rescan-from, or to resume a saved rescan; it starts once
+  // the headers are synced, see sync_rescan()
+  std::unique_ptr<Rescan> rescan_;
+  bool rescan_started_;
+
+  // The blocks that matched a compact filter, fetched a window at a time
+  // across the peers, and matched in height order once checked; see
+  // fetch_blocks(). block_timer_ gives up on the peers that stall it.
+  BlockDownload blocks_;
+  Timer block_timer_;
+
+  // our transactions being broadcast, and the timer that announces the
+  // ones that aren't propagating to more peers
+  TxBroadcast broadcasts_;
+  Timer broadcast_timer_;
+
+  // keeps the downloaded blocks, with --block-store-mb
+  std::unique_ptr<BlockStore> block_store_;
+
+  // Compact blocks (BIP152): recent loose transactions to rebuild them
+  // from, the blocks waiting on a blocktxn reply, and the rebuilt blocks
+  // being verified, which are fetched in full if their merkle root is wrong.
+  struct PendingCmpct {
+    Addr peer;
+    std::unique_ptr<PartialBlock> block;
+  };
+  TxPool tx_pool_;
+  std::unordered_map<hash_t, PendingCmpct, BlockHashHasher> cmpct_blocks_;
+  FlatHashSet<hash_t> rebuilt_;
+
+  AddrManager addrman_;
+  std::string addr_msg_;  // see addr_message()
+  time_point addr_msg_time_;
   std::unordered_map<Addr, std::unique_ptr<Connection> > connections_;
-  std::unordered_set<Inv> pending_inv_;
+
+  // The connections_ that have finished the handshake, in no order, so
+  // counting them and picking one at random take constant time. Each knows
+  // its place, so it's swapped out in constant time too.
+  std::vector<Connection *> handshaken_;
+
+  // connections_ in each peer_group(), for select_peer() to spread them
+  // over networks
+  std::unordered_map<uint64_t, size_t> outbound_groups_;
+
+  // the outbound peers' clocks, for the limit on header timestamps
+  AdjustedTime clock_;
+
+  // With --v2-transport, the peers that hung up on a v2 handshake; they're
+  // redialed, and from then on dialed, with v1. See V2Session::refused().
+  std::unordered_set<Addr> v1_peers_;
+
+  // peers that connected to us, kept apart from the outbound connections so
+  // they don't take up sync slots; counted per IP (with port 0)
+  std::shared_ptr<uvw::TcpHandle> listener_;
+  std::unordered_map<Addr, std::unique_ptr<Connection> > inbound_;
+  std::unordered_map<Addr, size_t> inbound_ips_;
+  uint64_t evict_key_;  // see select_eviction()
+
+  // Items we've sent a getdata for, and the ones that arrived recently.
+  // inv_timer_ asks again for the ones that take too long.
+  InvTracker inv_tracker_;
+  Timer inv_timer_;
+
+  // Wanted items that haven't been requested yet, with the peers that
+  // announced them. getdata_timer_ sends them out in batches. Blocks only
+  // wait here if their peer is congested; see notify_inv().
+  FlatHashMap<Inv, std::vector<Addr>, InvHasher> wanted_inv_;
+  size_t wanted_txs_;  // the transactions in wanted_inv_
+  Timer getdata_timer_;
   Buffer read_buf_;
   bool shutdown_;
+  bool replaying_;  // see replay_start()
   bool need_headers_;
+  bool seeded_;  // DNS seeds have been queried
+  int last_af_;  // address family of the last connection attempt
+
+  // Brings the word that the chain's header index has loaded back to the
+  // loop; see notify_index_loaded(). It outlives chain_, which joins the
+  // thread loading it.
+  std::unique_ptr<LoopQueue> index_queue_;
+
+  // Brings RocksDB's write stalls to the loop, which stops asking for
+  // headers until they pass rather than block in the writes; see
+  // notify_write_stall(). It outlives chain_ too.
+  std::unique_ptr<LoopQueue> stall_queue_;
   Chain chain_;
+  HeaderSync sync_;
+  SyncProgress progress_;
+
+  // asks a few peers every so often whether our tip is theirs; see
+  // check_tip()
+  TipCheck tip_check_;
+  Timer tip_timer_;
+
+  // which peers announce new blocks first, ranking them for addrman_ and
+  // for high bandwidth compact blocks; see block_announced()
+  AnnounceTracker announces_;
+
+  // the outbound peers to keep, between --min-connections and
+  // --connections, sampled every so often; see rescale_peers()
+  PeerScaler scaler_;
+  Timer scale_timer_;
+  HeaderValidator validator_;
+  BlockVerifier block_verifier_;
+  std::unique_ptr<DbVerifier> verifier_;
+  std::unique_ptr<TipServer> tips_;  // set with --tip-socket; after chain_
+  std::unique_ptr<ControlServer> control_;  // set with --control-socket
+
+  // With --electrum-port, the watched scripts' histories, and the server
+  // answering from them and chain_.
+  std::unique_ptr<ScriptIndex> scripts_;
+  std::unique_ptr<ElectrumServer> electrum_;
+  std::unique_ptr<RpcServer> rpc_;  // set with --rpc-port
+
+  // With --replicate-port, serves our headers to followers; with --follow,
+  // takes them from a leader, and peers aren't asked for header segments
+  // while it's streaming.
+  std::unique_ptr<ReplicationServer> replication_;
+  std::unique_ptr<ReplicationFollower> follower_;
+
+  // With --header-mirror, fetches the checkpointed segments over HTTP.
+  // Each of its jobs has the parts of what it delivered queued here, in
+  // the order the validator hands them back; a part is stale once its job
+  // has been cancelled.
+  struct MirrorPart {
+    Connection::HeadersPart part;
+    bool stale;
+  };
+  std::unique_ptr<HeaderMirror> mirror_;
+  std::unordered_map<Addr, std::deque<MirrorPart>> mirror_parts_;
+
+  SeedResolver seeds_;
+
+  // falls back to the DNS seeds if the saved peers don't work out
+  Timer seed_timer_;
 
-  std::vector<std::shared_ptr<uvw::GetAddrInfoReq> > dns_requests_;
+  // runs tick_clock() as the loop goes to wait each iteration
+  std::shared_ptr<uvw::PrepareHandle> clock_tick_;
 
-  std::shared_ptr<uvw::TimerHandle> hdr_timeout_;
+  // Connections with a backlog of messages to handle, see schedule_read(),
+  // in the order they get their next turn, and the handle that runs them.
+  std::deque<Addr> read_queue_;
+  std::shared_ptr<uvw::IdleHandle> read_idle_;
 
-  // cancel the hdr timeout
-  void cancel_hdr_timeout();
+  // saves addrman_ every so often, so a crash doesn't lose it
+  Timer save_timer_;
 
-  // cancel all outstanding dns requests
-  void cancel_dns_requests();
+  // runs check_memory(), with --memory-budget-mb
+  Timer memory_timer_;
+  bool over_budget_;
 
-  // mark this request as completed
-  void remove_dns_request(uvw::GetAddrInfoReq *req);
+  // With --connect, the only peers to use, and a timer to reconnect to them
+  // when they drop.
+  std::vector<Addr> connect_;
+  Timer retry_timer_;
 
-  bool need_inv(const Inv &inv) const;
+  // the --proxy outbound connections go through, or unset (af() is -1)
+  Addr proxy_;
+
+  // cancel the hdr timeout for a peer
+  void cancel_hdr_timeout(const Addr &addr);
+
+  // cancel all of the hdr timeouts
+  void cancel_hdr_timeouts();
+
+  // is the inv new to us? have is whether we have the block, if that's
+  // been looked up already
+  bool need_inv(const Inv &inv, const bool *have = nullptr);
+
+  // put requests that timed out or lost their peer back in wanted_inv_,
+  // for the peers that also announced them
+  void retry_invs(std::vector<InvTracker::Retry> &retries);
+
+  // start getdata_timer_, unless it's already running
+  void schedule_getdata();
+
+  // what to ask a peer for to get an inv: a compact block is a fraction of
+  // the size, if the peer has them
+  static Inv request_for(const Connection *conn, const Inv &inv);
+
+  // request everything in wanted_inv_, spread across the announcing peers
+  void send_getdata();
 
  protected:
   Peer us_;
   std::shared_ptr<uvw::Loop> loop_;
 
   // Connections call this method to notify the client that they've finished
-  // connecting (meaning they've finished the version handshake). Then the
-  // client will ask the connections for more block headers.
+  // connecting (meaning they have the peer's version and have sent our
+  // verack, see Connection::ready()). Then the client will ask the
+  // connections for more block headers, without waiting for the peer's
+  // verack.
   void notify_connected(Connection *conn);
 
-  // Add headers to the local copy of the chain.
-  void notify_headers(Connection *conn,
-                      const std::vector<BlockHeader> &block_headers);
+  // add the keys of the --xpub accounts to watch_, before the filters are
+  // built from it
+  void watch_wallet();
+
+  // The chain loads its header index while the first peers connect, and
+  // header sync starts once it's done.
+  void notify_index_loaded();
+
+  // The chain's writes stalled or recovered.
+  void notify_write_stall();
+
+  // The leader's stream started, or stopped, in which case header sync
+  // falls back to peers until it's back.
+  void notify_following(bool streaming);
+
+  // Queue the headers of a headers message for validation, along with the
+  // message's checksum and the time since our getheaders (0 if there was
+  // none). A BIP130 announcement of a few headers is validated right away.
+  // A big message may come in parts as it's read, without the checksum,
+  // and with the time on its last part.
+  void notify_headers(Connection *conn, std::string &&raw_headers,
+                      const uint32_t *checksum,
+                      std::chrono::milliseconds elapsed,
+                      const Connection::HeadersPart &part);
+
+  // The validator calls this method, in order, once a headers message has
+  // been hashed and checked. Valid headers are added to the local copy of
+  // the chain.
+  void notify_validated(const Addr &addr,
+                        std::vector<BlockHeader> &block_headers, bool ok,
+                        bool checked);
 
   // Connections call this method to notify the client of a new peer.
   void notify_peer(Connection *conn, const NetAddr &addr);
@@ -97,18 +437,149 @@ class Client {
   // notify that there was an error
   void notify_error(Connection *conn, const std::string &why);
 
-  // notify of a new inv message
-  void notify_inv(Connection *conn, const Inv &inv);
+  // Connections call this when they've read more messages than they may
+  // handle in one loop turn. Each loop iteration, every queued connection
+  // runs one budget of its backlog, round-robin, so one busy peer can't
+  // hold up the others' pings and replies.
+  void schedule_read(Connection *conn);
+
+  // Notify of an inv the peer hadn't sent before. A block is asked for
+  // right away; a transaction waits for the next getdata batch, and is
+  // dropped if too many already are. have is as for need_inv().
+  void notify_inv(Connection *conn, const Inv &inv,
+                  const bool *have = nullptr);
+
+  // notify_inv() for each of an inv message's new items, having looked up
+  // the blocks all at once with Chain::has_blocks()
+  void notify_invs(Connection *conn, const std::vector<Inv> &invs);
+
+  // A filtered block arrived, and these of its transactions matched the
+  // filter; the transactions themselves follow in tx messages.
+  void notify_merkleblock(Connection *conn, const BlockHeader &hdr,
+                          const std::vector<hash_t> &matches);
+
+  // a full block arrived, to have its merkle root checked by verifier_
+  void notify_block(Connection *conn, Block &&block);
+
+  // Called by verifier_ with the checked block. Blocks being downloaded by
+  // blocks_ wait there to be scanned in order; the rest are scanned now.
+  void notify_block_verified(const Addr &addr, Block &block, bool ok);
+
+  // Match a block's transactions against watch_ without decoding them,
+  // returning the number that matched.
+  size_t scan_block(const Block &block);
+
+  // queue a block that matched a compact filter, and fetch it unless it's
+  // in block_store_
+  void want_block(size_t height, const hash_t &hash);
+
+  // Ask the ready full nodes, the least busy first, for the blocks in
+  // blocks_' window that are not in flight yet.
+  void fetch_blocks();
+
+  // disconnect the peers that stall blocks_, taking back their blocks
+  void sweep_blocks();
+
+  // A transaction arrived, e.g. one that matched the bloom filter. Watched
+  // ones go in mempool_ until a block confirms them.
+  void notify_tx(Connection *conn, const TxMsg &tx);
+
+  // announce one of broadcasts_ to up to BROADCAST_PEERS ready outbound
+  // peers that haven't been told of it yet
+  void announce_tx(const hash_t &txid);
+
+  // a peer asked for a transaction; ours are answered, or nullptr
+  const std::string *serve_tx(Connection *conn, const hash_t &txid);
+
+  // remove a confirmed transaction from mempool_ and broadcasts_, if it's
+  // there
+  void confirm_tx(const hash_t &txid, const hash_t &block_hash);
+
+  // do we want peers to announce every transaction to us?
+  bool want_tx_relay() const;
+
+  // the peer can send compact blocks, so it may be worth high bandwidth mode
+  void notify_compact_peer(Connection *conn);
+
+  // Compact block messages. The header of a cmpctblock is treated like a
+  // headers announcement; the block itself is only rebuilt if we asked for
+  // it or are watching for transactions.
+  void notify_cmpctblock(Connection *conn, CmpctBlock &msg);
+  void notify_blocktxn(Connection *conn, BlockTxn &msg);
+
+  // verify a compact block that has all its transactions
+  void finish_cmpctblock(Connection *conn, const PartialBlock &partial);
+
+  // Ask the MAX_HB_PEERS compact block peers that announce new blocks
+  // soonest after the first announcer (then by round trip time, for peers
+  // that haven't announced any) to push new blocks to us, and the rest not
+  // to.
+  void update_hb_peers();
+
+  // A peer announced a block by inv, headers or cmpctblock. Once synced,
+  // this times it against the block's first announcer for announces_ and
+  // addrman_, and re-ranks the high bandwidth peers on each new block.
+  void block_announced(Connection *conn, const hash_t &hash);
+
+  // Replies to the requests sync_filters() sends; anything unsolicited is
+  // ignored, and a peer whose reply doesn't check out is dropped.
+  void notify_cfcheckpt(Connection *conn, const CFCheckpt &checkpt);
+  void notify_cfheaders(Connection *conn, const CFHeaders &headers);
+  void notify_cfilter(Connection *conn, const CFilter &filter);
 
   // find a new addr and connect to it
   void connect_to_new_peer();
 
-  // get the current block height
-  size_t get_height() const;
+  // connect to each --connect peer that we're not connected to
+  void connect_to_fixed_peers();
+
+  // the encoded headers message to answer a getheaders with, see
+  // Chain::headers_message()
+  inline ReplyCache::Message headers_message(
+      const std::vector<hash_t> &locator, const hash_t &stop) const {
+    return chain_.headers_message(locator, stop);
+  }
+
+  // answers BIP157 requests, or nullptr without --serve-filters
+  inline FilterServer *filter_server() { return filter_server_.get(); }
+
+  // The encoded addr message to answer an inbound peer's getaddr with. It's
+  // sampled from addrman_ again once it's ADDR_CACHE_TIME old, so everyone
+  // asking in the meantime gets the same one, and no one can map out the
+  // table by reconnecting.
+  const std::string &addr_message();
 
  private:
-  // get peers from a dns seed
-  void lookup_seed(const std::string &seed);
+  // query all of the dns seeds, unless that's already been done
+  void seed();
+
+  // accept inbound peers on settings_.port
+  void listen();
+
+  // accept a pending inbound connection, within the inbound limits
+  void accept_peer(uvw::TcpHandle &server);
+
+  // drop an inbound connection
+  void remove_inbound(Connection *conn);
+
+  // at --max-inbound, drop an inbound peer to make room for a new one;
+  // returns false if they're all worth keeping
+  bool evict_inbound();
+
+  // the outbound or inbound connection to addr, or nullptr
+  Connection *find_connection(const Addr &addr);
+
+  // give each connection in read_queue_ its turn, see schedule_read()
+  void run_reads();
+
+  // The class of what a peer is sending us, for the receive limits: bulk
+  // while it's fetching compact filters for us, headers while it has a
+  // header segment, and relay otherwise.
+  Traffic read_class(const Connection *conn);
+
+  // start clock_tick_ and the client's timers, and set up retry_timer_ for
+  // --connect
+  void start_timers();
 
   // connect to a specific address
   void connect_to_addr(const Addr &addr);
@@ -116,16 +587,127 @@ class Client {
     return connect_to_addr(addr.addr);
   }
 
-  // enqueue connections
-  void remove_connection(Connection *conn);
+  // Drop a connection, saying why in the event log. Unless penalize is
+  // false, a peer that never finished the handshake is marked as failed.
+  void remove_connection(Connection *conn, const char *why,
+                         bool penalize = true);
+
+  // the number of connections that have finished the version handshake
+  inline size_t handshake_count() const { return handshaken_.size(); }
+
+  // drop the connection attempts that lost the race to fill the slots
+  void cancel_pending_connections();
+
+  // select a random connection, one with all of these service bits if
+  // there is one
+  Connection *random_connection(uint64_t services = 0);
+
+  // hand out header segments to every idle connected peer
+  void sync_more_headers();
+
+  // Headers from outside the segments are only stored on a chain with the
+  // work min_storable_work() asks for. A peer whose chain doesn't have it
+  // yet is presynced (see HeaderPresync), taking ready and giving back the
+  // headers that may now be stored. False if the headers were invalid.
+  bool presync_headers(Connection *conn, const Connection::HeadersPart &part,
+                       std::vector<BlockHeader> &ready);
+
+  // hand the next checkpointed segments to the idle mirror jobs
+  void sync_mirror_headers();
+
+  // a mirror job's headers came in, or it couldn't fetch them
+  void notify_mirror_headers(const Addr &job, std::string &&raw, bool last);
+  void notify_mirror_failed(const Addr &job);
+
+  // mark the parts of a mirror job still being validated stale, rejecting
+  // the job itself if its headers were bad
+  void drop_mirror_job(const Addr &job, bool reject);
+
+  // Start a round of the tip check: count the peers advertising a height
+  // past ours and ask a few of the others what follows our tip. If enough
+  // of them disagree, see resync_headers().
+  void check_tip();
+
+  // we may be on a stale tip, so sync the headers again from every peer
+  void resync_headers();
+
+  // Sample the sync rate for scaler_, connecting to more peers if its
+  // target went up, and dropping the costliest if it went down.
+  void rescale_peers();
+
+  // after scaler_'s target moved from before: connect to another peer if
+  // it went up, or drop the peers that cost the most for what they've
+  // given (see PeerCost) down to it
+  void retarget_peers(size_t before);
+
+  // Run one --control-socket command line, returning its JSON answer. The
+  // values reported are read back from the objects they tune, not from
+  // settings_, so they show what a "set" actually did.
+  std::string control_command(const std::string &line);
+
+  // send a getheaders for this segment
+  void request_headers(Connection *conn, const HeaderSegment &seg);
+
+  // Send the getheaders after a full reply to a segment request before the
+  // reply is validated, from its last header. Up to --header-pipeline
+  // replies can be validating while the next is on its way. The reply has
+  // count headers, and raw_headers is its last part.
+  void pipeline_headers(Connection *conn, const HeaderSegment &seg,
+                        size_t count, const std::string &raw_headers);
+
+  // Once headers are synced, ask a peer that serves compact filters for
+  // the next batch of filter checkpoints, headers or filters.
+  void sync_filters();
+
+  // drop the filter headers of blocks that are no longer on the best chain
+  void rewind_filter_headers();
+
+  // give every idle filter peer a batch of the rescan
+  void sync_rescan();
+
+  // a block in the rescan matched, so fetch it
+  void notify_rescan_match(size_t height, const hash_t &hash);
+
+  // is this the peer and type of the outstanding filter request?
+  bool is_cf_reply(const Connection *conn, CfRequest type) const;
+
+  // The filter request is done. With an error, the peer (which sent a bad
+  // reply) is dropped.
+  void finish_cf_request(Connection *conn, const char *error = nullptr);
+
+  // how long to wait for a headers reply from this peer, from its round
+  // trip time and header throughput
+  static std::chrono::milliseconds header_timeout(const Connection *conn);
+
+  // Take the segment of the slowest busy peer that has been waiting much
+  // longer than this idle peer would need, and assign it to this peer.
+  // Returns nullptr if no busy peer is lagging behind it.
+  HeaderSegment *steal_segment(Connection *conn,
+                               std::vector<Connection *> &busy);
+
+  // pick a peer we aren't connected to; returns false if there are none
+  bool select_peer(Addr &addr) const;
+
+  // where addrman_ is saved
+  std::string peers_path() const;
+
+  // Set the gauges metrics() reads from the client, and add the bytes to
+  // and from each connected peer and its other costs, for a scrape of
+  // metrics_.
+  void collect_metrics(std::string &out) const;
 
-  // select a random connection
-  Connection *random_connection();
+  // every connected peer and its PeerCost, as a JSON array in the style
+  // of getpeerinfo, for QueryOp::PEER_INFO
+  std::string peer_info() const;
 
-  // try to get more headers
-  void sync_more_headers(Connection *conn = nullptr);
+  // append the bytes held by the subsystems that are measured rather than
+  // counted, see expose_memory()
+  void measure_memory(std::vector<std::pair<const char *, size_t> > &out) const;
 
-  Addr select_peer() const;
+  // With --memory-budget-mb, warn once the resident set goes over the
+  // budget, naming the subsystems holding the most, and again each time it
+  // goes back over after dropping under.
+  void check_memory();
 
   // are we connected to this addr?
   bool is_connected_to_addr(const Addr &addr) const;
@@ -0,0 +1,172 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./cmpct.h"
+
+#include <endian.h>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "./decoder.h"
+#include "./encoder.h"
+#include "./gcs.h"
+#include "./logging.h"
+#include "./sha256.h"
+
+namespace spv {
+MODULE_LOGGER
+
+// no block has more transactions than this, as in message.cc
+static const size_t max_block_txs = 1000000 / 60;
+
+// short ids are SipHash outputs, so like block hashes they're used as is
+struct ShortIdHasher {
+  inline std::size_t operator()(uint64_t id) const noexcept { return id; }
+};
+
+ShortIdKey::ShortIdKey(const BlockHeader &hdr, uint64_t nonce) {
+  uint8_t data[BLOCK_HEADER_SIZE + sizeof nonce];
+  hdr.pack(reinterpret_cast<char *>(data));
+  const uint64_t le_nonce = htole64(nonce);
+  std::memcpy(data + BLOCK_HEADER_SIZE, &le_nonce, sizeof le_nonce);
+  uint8_t digest[32];
+  sha256::hash(data, sizeof data, digest);
+  std::memcpy(&k0, digest, sizeof k0);
+  std::memcpy(&k1, digest + sizeof k0, sizeof k1);
+  k0 = le64toh(k0);
+  k1 = le64toh(k1);
+}
+
+uint64_t ShortIdKey::short_id(const hash_t &wtxid) const {
+  hash_t wire;
+  std::reverse_copy(wtxid.begin(), wtxid.end(), wire.begin());
+  return siphash24(k0, k1, wire.data(), wire.size()) & 0xffffffffffff;
+}
+
+void TxPool::add(const hash_t &wtxid, std::string &&raw) {
+  if (!wtxids_.insert(wtxid)) {
+    return;
+  }
+  txs_.emplace_back(wtxid, std::move(raw));
+  if (txs_.size() > capacity_) {
+    wtxids_.erase(txs_.front().first);
+    txs_.pop_front();
+  }
+}
+
+PartialBlock::Status PartialBlock::init(CmpctBlock &msg, const TxPool &pool) {
+  header_ = msg.header;
+  const size_t n = msg.short_ids.size() + msg.prefilled.size();
+  if (n == 0 || n > max_block_txs) {
+    return Status::INVALID;
+  }
+  txs_.assign(n, std::string());
+  std::vector<bool> filled(n);
+  for (auto &tx : msg.prefilled) {
+    if (tx.index >= n) {
+      return Status::INVALID;
+    }
+    filled[tx.index] = true;
+    txs_[tx.index] = std::move(tx.raw);
+  }
+
+  // the short ids go in the slots that aren't prefilled, in order
+  FlatHashMap<uint64_t, uint32_t, ShortIdHasher> slots;
+  slots.reserve(msg.short_ids.size());
+  uint32_t slot = 0;
+  for (uint64_t id : msg.short_ids) {
+    while (filled[slot]) {
+      slot++;
+    }
+    if (!slots.emplace(id, slot).second) {
+      return Status::COLLISION;
+    }
+    slot++;
+  }
+
+  // A short id can match two pool transactions; then the slot is left for
+  // getblocktxn, since either of them could be the wrong one.
+  std::vector<bool> from_pool(n), ambiguous(n);
+  const ShortIdKey key(header_, msg.nonce);
+  pool.for_each([&](const hash_t &wtxid, const std::string &raw) {
+    const uint32_t *found = slots.find(key.short_id(wtxid));
+    if (found == nullptr || ambiguous[*found]) {
+      return;
+    }
+    if (from_pool[*found]) {
+      ambiguous[*found] = true;
+      txs_[*found].clear();
+    } else {
+      from_pool[*found] = true;
+      txs_[*found] = raw;
+    }
+  });
+
+  missing_.clear();
+  size_t have = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (filled[i]) {
+      continue;
+    }
+    if (from_pool[i] && !ambiguous[i]) {
+      have++;
+    } else {
+      missing_.push_back(i);
+    }
+  }
+  LOG_DEBUG(log, "block {}: {} prefilled, {} from the pool, {} missing",
+            to_hex(header_.block_hash), msg.prefilled.size(), have,
+            missing_.size());
+  return Status::OK;
+}
+
+bool PartialBlock::fill(BlockTxn &reply) {
+  if (reply.txs.size() != missing_.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < missing_.size(); i++) {
+    txs_[missing_[i]] = std::move(reply.txs[i]);
+  }
+  missing_.clear();
+  return true;
+}
+
+bool PartialBlock::finish(Block &block) const {
+  assert(missing_.empty());
+  Encoder enc;
+  enc.push(header_, false);
+  enc.push_varint(txs_.size());
+  size_t total = enc.size();
+  for (const auto &tx : txs_) {
+    total += tx.size();
+  }
+  block.raw.reserve(total);
+  block.raw.assign(enc.data(), enc.size());
+  for (const auto &tx : txs_) {
+    block.raw.append(tx);
+  }
+  try {
+    block.index();
+  } catch (const DecodeError &exc) {
+    log->warn("rebuilt block {} is invalid: {}", to_hex(header_.block_hash),
+              exc.what());
+    return false;
+  }
+  return true;
+}
+}  // namespace spv
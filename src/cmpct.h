@@ -0,0 +1,108 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "./constants.h"
+#include "./fields.h"
+#include "./hashmap.h"
+#include "./message.h"
+
+namespace spv {
+// The SipHash key for a cmpctblock's short ids: the first two words of
+// SHA256(header || nonce).
+struct ShortIdKey {
+  uint64_t k0, k1;
+
+  ShortIdKey(const BlockHeader &hdr, uint64_t nonce);
+
+  // the short id of a transaction, from its wtxid (in display order)
+  uint64_t short_id(const hash_t &wtxid) const;
+};
+
+// TxPool keeps the last few thousand transactions we were sent, which for
+// an SPV client are mostly the ones that matched our filter, so that
+// compact blocks can be rebuilt without fetching them again. The oldest
+// transaction is evicted first.
+class TxPool {
+ public:
+  explicit TxPool(size_t capacity) : capacity_(capacity) {}
+  TxPool(const TxPool &other) = delete;
+
+  inline size_t size() const { return txs_.size(); }
+
+  // add a serialized transaction (with any witnesses) unless it's here
+  void add(const hash_t &wtxid, std::string &&raw);
+
+  template <typename F>
+  inline void for_each(F fn) const {
+    for (const auto &tx : txs_) {
+      fn(tx.first, tx.second);
+    }
+  }
+
+ private:
+  size_t capacity_;
+  std::deque<std::pair<hash_t, std::string> > txs_;  // oldest first
+  FlatHashSet<hash_t> wtxids_;
+};
+
+// PartialBlock rebuilds a block from a cmpctblock: the prefilled
+// transactions go in their slots, each short id is looked up in the pool,
+// and the rest have to be fetched with getblocktxn.
+class PartialBlock {
+ public:
+  enum class Status {
+    OK,         // see missing() for what's left to fetch
+    INVALID,    // the message is malformed, the peer misbehaved
+    COLLISION,  // two short ids are the same, so get the full block
+  };
+
+  PartialBlock() {}
+  PartialBlock(const PartialBlock &other) = delete;
+
+  // Fill in the slots from the message, whose prefilled transactions are
+  // moved out, and the pool.
+  Status init(CmpctBlock &msg, const TxPool &pool);
+
+  inline const BlockHeader &header() const { return header_; }
+
+  // positions of the transactions still needed, ascending
+  inline const std::vector<uint32_t> &missing() const { return missing_; }
+
+  // Fill the missing slots with the transactions of a blocktxn reply;
+  // returns false if it has the wrong number of them.
+  bool fill(BlockTxn &reply);
+
+  // Assemble and index the block once nothing is missing. Returns false if
+  // the transactions don't make a valid block. This doesn't check the
+  // merkle root: if a short id matched the wrong transaction from the pool
+  // the root is wrong, and the block should be fetched in full.
+  bool finish(Block &block) const;
+
+ private:
+  BlockHeader header_;
+  std::vector<std::string> txs_;  // the ones in missing_ are empty
+  std::vector<uint32_t> missing_;
+};
+}  // namespace spv
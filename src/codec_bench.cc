@@ -0,0 +1,305 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+// Micro-benchmarks of the codec and hashing hot paths:
+//
+//   codec_bench [--save-baseline FILE] [--compare FILE] [name]
+//
+// Each case runs until it has taken a fraction of a second, split into
+// several timed samples, and prints the median time per call, plus the
+// throughput for the ones that process a buffer. With a name, only the cases
+// whose names contain it are run. The samples can be saved as a baseline or
+// checked against one; see bench_baseline.h.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "./arena.h"
+#include "./bench_baseline.h"
+#include "./buffer.h"
+#include "./decoder.h"
+#include "./encoder.h"
+#include "./fields.h"
+#include "./logging.h"
+#include "./message.h"
+#include "./pow.h"
+
+using namespace spv;
+
+// how long each sample of a case runs for, at least, and how many there are
+static const double min_ns = 3e7;
+static size_t samples = 7;
+
+static uint64_t sink;  // results feed this, so they aren't optimized out
+
+static const char *filter;
+
+static Baseline results;
+
+static double elapsed_ns(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// time fn, which processes bytes bytes per call (or 0 if that's not useful)
+static void bench(const std::string &name, size_t bytes,
+                  const std::function<void()> &fn) {
+  if (filter != nullptr && name.find(filter) == std::string::npos) {
+    return;
+  }
+  size_t iters = 1;
+  std::vector<double> per_call;  // the first is the last calibration run
+  while (per_call.size() < samples) {
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iters; i++) {
+      fn();
+    }
+    const double ns = elapsed_ns(start);
+    if (!per_call.empty() || ns >= min_ns) {
+      per_call.push_back(ns / iters);
+      results.add(name, ns / iters);
+    } else {
+      iters *= ns < min_ns / 16 ? 8 : 2;
+    }
+  }
+  std::sort(per_call.begin(), per_call.end());
+  const double ns = per_call[samples / 2];
+  std::printf("%-28s %10.1f ns", name.c_str(), ns);
+  if (bytes) {
+    std::printf(" %9.1f MB/s", bytes * 1e3 / ns);
+  }
+  std::printf("\n");
+}
+
+static void random_hash(hash_t &hash, uint64_t &seed) {
+  for (auto &b : hash) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    b = static_cast<uint8_t>(seed >> 56);
+  }
+}
+
+static std::vector<BlockHeader> random_headers(size_t n) {
+  std::vector<BlockHeader> hdrs(n);
+  uint64_t seed = 1;
+  for (size_t i = 0; i < n; i++) {
+    hdrs[i].version = 0x20000000;
+    random_hash(hdrs[i].prev_block, seed);
+    random_hash(hdrs[i].merkle_root, seed);
+    hdrs[i].timestamp = 1500000000 + i * 600;
+    hdrs[i].difficulty = 0x1d00ffff;
+    hdrs[i].nonce = static_cast<uint32_t>(seed);
+    hdrs[i].height = i + 1;
+  }
+  return hdrs;
+}
+
+// time decoding a full message, header and checksum included
+static void bench_parse(const std::string &name, const Message &msg) {
+  size_t sz;
+  const std::unique_ptr<char[]> data = msg.encode(sz);
+  Arena arena;
+  bench("parse " + name, sz, [&]() {
+    size_t used;
+    auto parsed = decode_message(data.get(), sz, &used, arena);
+    sink += used + (parsed != nullptr);
+  });
+}
+
+static void bench_encode(const Message &msg) {
+  size_t sz;
+  msg.encode(sz);
+  bench("encode " + msg.headers.command, sz, [&]() {
+    size_t n;
+    sink += msg.encode(n)[HEADER_SIZE - 1];
+  });
+}
+
+int main(int argc, char **argv) {
+  BaselineOptions baseline;
+  if (!parse_baseline_options(argc, argv, baseline)) {
+    return 1;
+  }
+  if (baseline.samples) {
+    samples = baseline.samples;
+  }
+  filter = argc > 1 ? argv[1] : nullptr;
+  const std::vector<BlockHeader> hdrs = random_headers(MAX_HEADERS_RESULTS);
+  char raw_hdr[BLOCK_HEADER_SIZE];
+  hdrs[0].pack(raw_hdr);
+
+  // show the chosen sha256 backend, but not the parsers' debug logging
+  spdlog::set_level(spdlog::level::debug);
+  sink += pow_hash(raw_hdr, sizeof raw_hdr)[0];
+  spdlog::set_level(spdlog::level::warn);
+
+  // hashing
+  bench("pow_hash", BLOCK_HEADER_SIZE, [&]() {
+    sink += pow_hash(raw_hdr, sizeof raw_hdr)[0];
+  });
+  for (size_t size : {32, 1024, 1 << 20}) {
+    const std::string payload(size, 'x');
+    bench("checksum " + std::to_string(size), size, [&]() {
+      std::array<char, 4> cksum;
+      checksum(payload.data(), payload.size(), cksum);
+      sink += cksum[0];
+    });
+  }
+
+  // headers, as they're pulled out of a headers message
+  HeadersMsg headers;
+  headers.block_headers = hdrs;
+  size_t headers_size;
+  const std::unique_ptr<char[]> headers_data = headers.encode(headers_size);
+  bench("Decoder::pull(BlockHeader)", BLOCK_HEADER_SIZE + 1, [&]() {
+    Decoder dec(headers_data.get() + HEADER_SIZE + 3,
+                headers_size - HEADER_SIZE - 3);
+    BlockHeader hdr;
+    dec.pull(hdr);
+    sink += hdr.nonce;
+  });
+  bench("BlockHeader::db_encode", 0, [&]() {
+    sink += hdrs[0].db_encode().size();
+  });
+  const std::string record = hdrs[0].db_encode();
+  bench("BlockHeader::db_decode", 0, [&]() {
+    BlockHeader hdr;
+    hdr.db_decode(record);
+    sink += hdr.nonce;
+  });
+
+  // parsers
+  bench_parse("headers", headers);
+  InvMsg inv;
+  uint64_t seed = 2;
+  inv.invs.resize(1000);
+  for (auto &item : inv.invs) {
+    item.type = InvType::TX;
+    random_hash(item.hash, seed);
+  }
+  bench_parse("inv", inv);
+  AddrMsg addr;
+  addr.addrs.resize(1000);  // the most an addr message holds
+  for (size_t i = 0; i < addr.addrs.size(); i++) {
+    addr.addrs[i].addr.set_ip("10.0." + std::to_string(i / 256) + "." +
+                              std::to_string(i % 256));
+    addr.addrs[i].addr.set_port(18333);
+  }
+  bench_parse("addr", addr);
+
+  // every encoder, with typical contents
+  std::vector<std::unique_ptr<Message> > msgs;
+  msgs.emplace_back(new AddrMsg(addr));
+  Block *block = new Block;
+  block->raw.assign(BLOCK_HEADER_SIZE, '\0');
+  block->raw.append(1, 1);
+  block->raw.append(250, 'x');
+  msgs.emplace_back(block);
+  BlockTxn *blocktxn = new BlockTxn;
+  blocktxn->txs.assign(10, std::string(250, 'x'));
+  msgs.emplace_back(blocktxn);
+  CmpctBlock *cmpct = new CmpctBlock;
+  cmpct->header = hdrs[0];
+  cmpct->short_ids.assign(2000, 0x123456789abc);
+  cmpct->prefilled.push_back({0, std::string(200, 'x')});
+  msgs.emplace_back(cmpct);
+  CFCheckpt *checkpt = new CFCheckpt;
+  checkpt->filter_headers.resize(100);
+  msgs.emplace_back(checkpt);
+  CFHeaders *cfheaders = new CFHeaders;
+  cfheaders->filter_hashes.resize(MAX_GETCFHEADERS_SIZE);
+  msgs.emplace_back(cfheaders);
+  CFilter *cfilter = new CFilter;
+  cfilter->filter.assign(5000, 'x');
+  msgs.emplace_back(cfilter);
+  FilterAdd *filteradd = new FilterAdd;
+  filteradd->data.assign(20, 'x');
+  msgs.emplace_back(filteradd);
+  msgs.emplace_back(new FilterClear);
+  FilterLoad *filterload = new FilterLoad;
+  filterload->filter.assign(1000, 'x');
+  msgs.emplace_back(filterload);
+  msgs.emplace_back(new GetAddr);
+  GetBlocks *getblocks = new GetBlocks;
+  getblocks->locator_hashes.resize(30);
+  msgs.emplace_back(getblocks);
+  GetBlockTxn *getblocktxn = new GetBlockTxn;
+  for (uint32_t i = 0; i < 100; i++) {
+    getblocktxn->indexes.push_back(i * 3);
+  }
+  msgs.emplace_back(getblocktxn);
+  msgs.emplace_back(new GetCFCheckpt);
+  msgs.emplace_back(new GetCFHeaders);
+  msgs.emplace_back(new GetCFilters);
+  GetData *getdata = new GetData;
+  getdata->invs = inv.invs;
+  msgs.emplace_back(getdata);
+  GetHeaders *getheaders = new GetHeaders;
+  getheaders->locator_hashes.resize(30);
+  msgs.emplace_back(getheaders);
+  msgs.emplace_back(new HeadersMsg(headers));
+  msgs.emplace_back(new InvMsg(inv));
+  msgs.emplace_back(new Mempool);
+  MerkleBlock *merkleblock = new MerkleBlock;
+  merkleblock->header = hdrs[0];
+  merkleblock->total_txs = 2000;
+  merkleblock->hashes.resize(12);
+  merkleblock->flags.assign(3, '\xff');
+  msgs.emplace_back(merkleblock);
+  msgs.emplace_back(new Ping);
+  msgs.emplace_back(new Pong);
+  Reject *reject = new Reject;
+  reject->message = "tx";
+  reject->reason = "bad-txns-inputs-missingorspent";
+  msgs.emplace_back(reject);
+  msgs.emplace_back(new SendCmpct);
+  msgs.emplace_back(new SendHeaders);
+  TxMsg *tx = new TxMsg;
+  tx->raw.assign(250, 'x');
+  msgs.emplace_back(tx);
+  msgs.emplace_back(new VerAck);
+  Version *version = new Version;
+  version->user_agent = "/Satoshi:0.21.0/";
+  msgs.emplace_back(version);
+  for (const auto &msg : msgs) {
+    bench_encode(*msg);
+  }
+
+  // socket buffers: a message arrives and is consumed
+  Buffer buf;
+  const std::string chunk(1024, 'x');
+  bench("Buffer::append+consume", chunk.size(), [&]() {
+    buf.append(chunk.data(), chunk.size());
+    sink += buf.data()[0];
+    buf.consume(chunk.size());
+  });
+  bench("Buffer::append small", HEADER_SIZE, [&]() {
+    buf.append(chunk.data(), HEADER_SIZE);
+    if (buf.size() >= 1 << 16) {
+      buf.consume(buf.size());
+    }
+  });
+  if (baseline.enabled() && finish_baseline(results, baseline) != 0) {
+    return 1;
+  }
+  return sink == 42;
+}
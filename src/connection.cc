@@ -16,10 +16,21 @@
 
 #include "./connection.h"
 
+#include <algorithm>
+#include <cmath>
+
 #include "./client.h"
 #include "./constants.h"
+#include "./cpu_time.h"
+#include "./eventlog.h"
+#include "./io.h"
 #include "./logging.h"
+#include "./loop_monitor.h"
+#include "./memory.h"
 #include "./message.h"
+#include "./metrics.h"
+#include "./trace.h"
+#include "./uring.h"
 #include "./uvw.h"
 
 namespace spv {
@@ -27,111 +38,903 @@ MODULE_LOGGER
 
 const static std::chrono::seconds ping_interval(60);
 
+// the mean time between transaction announcements, which is longer for
+// inbound peers since an attacker can make many connections to us
+const static double trickle_outbound_ms = 2000;
+const static double trickle_inbound_ms = 5000;
+
+// Initial size of the output queue, enough for the usual handful of small
+// messages per loop iteration.
+const static size_t out_queue_size = 4 << 10;
+
+// A peer's read buffer starts at this size and grows from the slab pool for
+// bigger messages. After a ping interval with nothing left buffered, it's
+// shrunk back, see shrink_buffers().
+const static size_t read_buffer_size = 4 << 10;
+
+// Messages at least this big are written directly instead of being copied
+// into the output queue.
+const static size_t coalesce_limit = 64 << 10;
+
+// Stop reading from a peer once this much of our output to it is unsent,
+// and resume below the low watermark. A peer that lets the backlog reach
+// the hard limit is dropped.
+const static size_t unsent_high_watermark = 4 << 20;
+const static size_t unsent_low_watermark = 1 << 20;
+const static size_t unsent_limit = 16 << 20;
+
+// A streamed headers message goes to the client in parts of at least this
+// many headers, so each is worth a trip to the validator's thread pool.
+const static size_t headers_part = 250;
+
+// Messages read in one go from a peer, after which the rest of what it sent
+// waits for the next loop turn, see Client::schedule_read(). This keeps a
+// peer that sends a lot from holding up the others.
+const static size_t read_budget_messages = 64;
+const static std::chrono::microseconds read_budget(2000);
+
 inline void toggle_on(bool& value) {
   assert(!value);
   value = true;
 }
 
-Connection::Connection(Client* client, const Addr& addr)
+Connection::Connection(Client* client, const Addr& addr,
+                       std::shared_ptr<uvw::TcpHandle> tcp)
     : loop_(client->loop_),
       client_(client),
+      buf_(read_buffer_size),
       peer_(addr),
       have_version_(false),
       have_verack_(false),
-      tcp_(client->loop_->resource<uvw::TcpHandle>()),
-      ping_nonce_(0) {
-  assert(!addr.ip().empty() && addr.port());
-
-  // Start this buffer at 256k bytes. A large value is chosen because as a
-  // baseline, a full getheaders message will be 80 bytes per header * 2000
-  // headers = 160k bytes.
-  buf_.reserve(256 << 10);
+      sent_verack_(false),
+      inbound_(tcp != nullptr),
+      replay_(client->replaying_),
+      capture_id_(0),
+      handshaken_pos_(not_handshaken),
+      unsent_(0),
+      paused_(false),
+      reads_stopped_(false),
+      bytes_in_(0),
+      bytes_out_(0),
+      buffered_(false),
+      drop_reason_(nullptr),
+      misbehavior_(0),
+      filter_loaded_(false),
+      peer_cmpct_(false),
+      cmpct_hb_(false),
+      trickle_(client->timers_, [this]() { trickle(); }),
+      proxy_ready_(true),
+      v2_contents_(std::string::npos),
+      handshake_latency_(0),
+      rtt_(0),
+      reply_synced_(false),
+      hdr_count_(0),
+      hdr_bytes_(0),
+      hdr_elapsed_(0),
+      connect_timer_(client->timers_),
+      hdr_timer_(client->timers_),
+      cf_timer_(client->timers_),
+      ping_nonce_(0),
+      ping_(client->timers_, [this]() { send_ping(); }),
+      pong_(client->timers_),
+      verack_(client->timers_),
+      getaddr_(client->timers_),
+      sent_addrs_(false),
+      send_wait_(client->timers_, [this]() { flush(); }),
+      recv_wait_(client->timers_, [this]() { check_reads(); }),
+      throttled_(false) {
+  assert(addr.af() != -1 && addr.port());
+  send_bucket_.set_rate(client->settings_.peer_max_upload << 10);
+  recv_bucket_.set_rate(client->settings_.peer_max_download << 10);
+  addr_bucket_.set_rate(client->settings_.addr_rate, MAX_ADDR_SIZE);
+  // The protocol's timeouts are bound once, here, so arming one as a
+  // message goes out is just a wheel insert.
+  pong_.set_callback([this]() {
+    log->warn("peer {} did not send pong in time", peer_);
+    shutdown();
+  });
+  verack_.set_callback(
+      [this]() { client_->notify_error(this, "verack timeout"); });
+  getaddr_.set_callback([this]() {
+    log->info(
+        "peer {} failed to respond to getaddr, asking client to connect to "
+        "new seed peer",
+        peer_);
+    client_->connect_to_new_peer();
+  });
+  if (inbound_) {
+    // the peer speaks first, see handle_version()
+    tcp_ = tcp;
+    connect_start_ = now();
+  } else if (replay_) {
+    // Client::replay_open() sends our version right away
+  } else if (client->io_) {
+    socket_ = std::make_shared<IoSocket>(client->io_->next(),
+                                         client->io_->owner());
+    socket_->callbacks.written = [this](size_t sz) { wrote(sz); };
+  } else {
+    // made for the address family, so the socket exists to be tuned
+    const Addr& proxy = client->proxy_;
+    tcp_ = client->loop_->resource<uvw::TcpHandle>(
+        proxy.af() != -1 ? proxy.af() : addr.af());
+    tune_socket(*tcp_, client->tuning_);
+  }
+  // the settings keep v2 off with an IoSocket or a capture
+  if (client->settings_.v2_transport && !replay_ &&
+      (inbound_ || !client->v1_peers_.count(addr))) {
+    v2_.reset(new V2Session(!inbound_));
+  }
+  if (tcp_) {
+    tcp_->on<uvw::WriteEvent>([this](const auto&, auto&) {
+      wrote(writes_.front());
+      writes_.pop_front();
+    });
+  }
+  out_.reserve(out_queue_size);
 }
 
 void Connection::connect() {
-  log->debug("connecting to peer {}", peer_);
-  uvw::Addr uvw_addr;
-  uvw_addr.ip = peer_.addr.ip();
-  uvw_addr.port = peer_.addr.port();
-  tcp_->connect(uvw_addr);
+  LOG_DEBUG(log, "connecting to peer {}", peer_);
+  connect_start_ = now();
+  const Addr& proxy = client_->proxy_;
+  const bool proxied = proxy.af() != -1;
+  proxy_ready_ = !proxied || !client_->settings_.proxy_wait;
+  if (socket_) {
+    socket_->connect(peer_.addr, client_->tuning_,
+                     proxied ? &proxy : nullptr);
+    return;
+  }
+  if (proxied) {
+    socks_.reset(new Socks5Handshake(peer_.addr));
+  }
+  sockaddr_storage sa;
+  (proxied ? proxy : peer_.addr).to_sockaddr(sa);
+  tcp_->connect(reinterpret_cast<const sockaddr&>(sa));
+}
+
+void Connection::start_reading(
+    std::function<void(int code, const char* what)> error,
+    std::function<void()> end) {
+  if (!client_->ring_) {
+    tcp_->read();
+    return;
+  }
+  ring_ = client_->ring_->socket(tcp_->fileno());
+  RingSocket::Callbacks& cb = ring_->callbacks;
+  cb.data = [this](const char* data, size_t sz) {
+    rearm_quickack(*tcp_, client_->tuning_);
+    read(data, sz);
+  };
+  cb.written = [this](size_t sz) { wrote(sz); };
+  cb.error = std::move(error);
+  cb.end = std::move(end);
+  ring_->pause(reads_stopped_);
+}
+
+void Connection::proxy_connect() {
+  if (socks_) {
+    size_t sz;
+    std::unique_ptr<char[]> data = socks_->request(sz);
+    write(std::move(data), sz);
+  }
+}
+
+void Connection::proxied() {
+  LOG_DEBUG(log, "proxy connected us to peer {}", peer_);
+  if (!proxy_ready_) {
+    proxy_ready_ = true;
+    schedule_flush();
+  }
+}
+
+std::chrono::milliseconds Connection::since_getheaders() const {
+  if (getheaders_sent_ == time_point()) {
+    return std::chrono::milliseconds(0);
+  }
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      now() - getheaders_sent_);
+}
+
+size_t Connection::header_rate() const {
+  const auto ms = hdr_elapsed_.count();
+  return ms > 0 ? hdr_count_ * 1000 / ms : 0;
+}
+
+size_t Connection::byte_rate() const {
+  const auto ms = hdr_elapsed_.count();
+  return ms > 0 ? hdr_bytes_ * 1000 / ms : 0;
 }
 
 void Connection::read(const char* data, size_t sz) {
-#if 0
-  log->debug("read {} bytes from peer {}", sz, peer_);
-#endif
-  buf_.append(data, sz);
-  for (bool ok = true; ok; ok = read_message())
-    ;
+  HeapScope scope(HeapTag::NETWORK);
+  CpuScope cpu(CpuTag::NETWORK);
+  LOG_TRACE(log, "read {} bytes from peer {}", sz, peer_);
+  if (drop_reason_) {
+    return;
+  }
+  bytes_in_ += sz;
+  metrics().bytes_in.add(sz);
+  recv_bucket_.take(sz);
+  client_->recv_limit_.take(sz);
+  TraceSpan span("read", nullptr, 0, sz);
+  if (client_->capture_) {
+    client_->capture_->recv(capture_id_, data, sz);
+  }
+  if (socks_) {
+    // the proxy's answers come first, right where the peer's data starts
+    const size_t used = socks_->consume(data, sz);
+    if (socks_->error() != nullptr) {
+      drop_later(socks_->error());
+      return;
+    }
+    data += used;
+    sz -= used;
+    if (!socks_->done()) {
+      return;
+    }
+    socks_.reset();
+    proxied();
+  }
+  std::string rest;
+  if (v2_ && !v2_->done()) {
+    v2_->read(data, sz);
+    if (v2_->has_output()) {
+      schedule_flush();
+    }
+    if (v2_->error() != nullptr) {
+      drop_later(v2_->error());
+      return;
+    }
+    if (!v2_->done()) {
+      return;
+    }
+    // what came after the handshake, or all of a v1 peer's stream so far
+    rest = v2_->take_input();
+    data = rest.data();
+    sz = rest.size();
+    if (v2_->v1()) {
+      LOG_DEBUG(log, "peer {} speaks v1", peer_);
+      v2_.reset();
+    }
+  }
+  if (backlog_.size()) {
+    // reading is paused, but this was already on its way
+    backlog_.append(data, sz);
+    return;
+  }
+  const size_t used = process(data, sz);
+  if (used < sz) {
+    // the rest waits for the other peers to have their turn
+    backlog_.append(data + used, sz - used);
+    set_reading();
+    client_->schedule_read(this);
+  }
+  if (buf_.size() || backlog_.size()) {
+    buffered_ = true;
+  }
+  if (recv_bucket_.limited() || client_->recv_limit_.limited()) {
+    check_reads();
+  }
 }
 
-bool Connection::read_message() {
-  if (buf_.size() < HEADER_SIZE) {
+bool Connection::run_backlog() {
+  HeapScope scope(HeapTag::NETWORK);
+  if (drop_reason_) {
+    backlog_.consume(backlog_.size());
     return false;
   }
+  backlog_.consume(process(backlog_.data(), backlog_.size()));
+  if (backlog_.size()) {
+    return true;
+  }
+  set_reading();
+  return false;
+}
 
-  bool ret = false;
-  size_t bytes_consumed = 0;
-  std::unique_ptr<Message> msg =
-      decode_message(buf_.data(), buf_.size(), &bytes_consumed);
-  if (bytes_consumed != 0) {
-    ret = true;
-    buf_.consume(bytes_consumed);
+size_t Connection::process(const char* data, const size_t size) {
+  if (v2_) {
+    return process_v2(data, size);
+  }
+  size_t sz = size;
+  if (headers_in_.active()) {
+    const size_t used = headers_in_.consume(data, sz);
+    data += used;
+    sz -= used;
+    stream_headers();
+  }
+  // If a message was split across reads, copy just enough to finish it.
+  while (buf_.size() && sz) {
+    const size_t n = std::min(sz, buffered_message_size() - buf_.size());
+    buf_.append(data, n);
+    data += n;
+    sz -= n;
+    if (buffered_message_size() > MAX_MESSAGE_SIZE) {
+      buf_.consume(buf_.size());
+      misbehaving(MISBEHAVIOR_LIMIT, "oversized message");
+      return size;
+    }
+    if (buf_.size() >= HEADER_SIZE && buf_.size() == buffered_message_size()) {
+      read_message(buf_.data(), buf_.size());
+      buf_.consume(buf_.size());
+    }
   }
 
-  // TODO: use a hash table for this, like in the decoder
-  if (msg.get() != nullptr) {
+  // Everything else is decoded in place, straight out of libuv's read buffer,
+  // until this turn's budget is spent; only a trailing partial message is
+  // copied.
+  const auto deadline = std::chrono::steady_clock::now() + read_budget;
+  for (size_t count = 0; sz; count++) {
+    if (count == read_budget_messages ||
+        (count && std::chrono::steady_clock::now() >= deadline)) {
+      arena_.reset();
+      return size - sz;
+    }
+    const size_t used = read_message(data, sz);
+    if (used == 0) {
+      break;
+    }
+    data += used;
+    sz -= used;
+  }
+  if (sz) {
+    buf_.append(data, sz);
+    if (buffered_message_size() > MAX_MESSAGE_SIZE) {
+      buf_.consume(buf_.size());
+      misbehaving(MISBEHAVIOR_LIMIT, "oversized message");
+    }
+  }
+  maybe_stream_headers();
+  arena_.reset();
+  return size;
+}
+
+size_t Connection::process_v2(const char* data, const size_t size) {
+  // Unlike v1 messages, packets are copied to buf_ whole, to be decrypted
+  // in place. Big headers messages aren't streamed either.
+  size_t sz = size;
+  const auto deadline = std::chrono::steady_clock::now() + read_budget;
+  for (size_t count = 0; sz;) {
+    if (v2_contents_ == std::string::npos) {
+      const size_t n = std::min(sz, V2_LENGTH_SIZE - buf_.size());
+      buf_.append(data, n);
+      data += n;
+      sz -= n;
+      if (buf_.size() < V2_LENGTH_SIZE) {
+        break;
+      }
+      v2_contents_ = v2_->cipher().open_length(buf_.data());
+      if (v2_contents_ > MAX_MESSAGE_SIZE) {
+        buf_.consume(buf_.size());
+        misbehaving(MISBEHAVIOR_LIMIT, "oversized message");
+        return size;
+      }
+    }
+    const size_t packet = V2_EXPANSION + v2_contents_;
+    const size_t n = std::min(sz, packet - buf_.size());
+    buf_.append(data, n);
+    data += n;
+    sz -= n;
+    if (buf_.size() < packet) {
+      break;
+    }
+
+    PeerCpuScope cpu(cost_);
+    const auto start = std::chrono::steady_clock::now();
+    char* contents = buf_.mutable_data() + V2_LENGTH_SIZE;
+    const size_t contents_size = v2_contents_;
+    v2_contents_ = std::string::npos;
+    if (!v2_->cipher().open(contents, contents_size)) {
+      buf_.consume(buf_.size());
+      drop_later("v2 packet failed authentication");
+      return size;
+    }
+    if ((uint8_t(contents[0]) & V2_IGNORE) == 0) {
+      V2Message packet_msg;
+      Arena::Ptr<Message> msg;
+      bool malformed = !parse_v2_packet(contents, contents_size, &packet_msg);
+      if (!malformed) {
+        HeapScope scope(HeapTag::MESSAGES);
+        LoopScope decode("decode");
+        msg = decode_v2_message(packet_msg.type, packet_msg.command,
+                                packet_msg.payload, packet_msg.size, arena_,
+                                &malformed);
+      }
+      if (malformed) {
+        misbehaving(50, "malformed message");
+      }
+      dispatch(msg.get(), packet, start);
+    }
+    buf_.consume(buf_.size());
+
+    if (sz && (++count == read_budget_messages ||
+               std::chrono::steady_clock::now() >= deadline)) {
+      arena_.reset();
+      return size - sz;
+    }
+  }
+  arena_.reset();
+  return size;
+}
+
+void Connection::maybe_stream_headers() {
+  // Until the handshake is done, the message is rejected as a whole.
+  if (buf_.size() < HEADER_SIZE || !connected() ||
+      !HeadersStream::wanted(buf_.data())) {
+    return;
+  }
+  LOG_DEBUG(log, "streaming {} byte headers message from peer {}",
+            buffered_message_size(), peer_);
+  headers_in_.start(buf_.data());
+  headers_in_.consume(buf_.data() + HEADER_SIZE, buf_.size() - HEADER_SIZE);
+  buf_.consume(buf_.size());
+  stream_headers();
+}
+
+void Connection::stream_headers() {
+  if (headers_in_.error() != nullptr) {
+    if (!dropping()) {
+      misbehaving(MISBEHAVIOR_LIMIT, headers_in_.error());
+    }
+    if (headers_in_.done()) {
+      headers_in_.reset();
+    }
+    return;
+  }
+  const bool last = headers_in_.done();
+  if (!last && headers_in_.ready() < headers_part) {
+    return;
+  }
+  const HeadersPart part{headers_in_.count(), !headers_in_.taken(), last};
+  std::string raw_headers = headers_in_.take();
+  std::chrono::milliseconds elapsed(0);
+  if (last) {
+    headers_in_.reset();
+    const size_t bytes = part.count * HeadersView::stride;
+    cost_.bytes_in[size_t(Command::HEADERS)] += HEADER_SIZE + bytes;
+    metrics().messages_in[size_t(Command::HEADERS)].add();
+    event_log().message(EventType::MSG_IN, peer_.addr, inbound_,
+                        Command::HEADERS, HEADER_SIZE + bytes);
+    LOG_DEBUG(log, "headers message with {} block headers", part.count);
+    elapsed = finish_getheaders(part.count, bytes);
+  }
+  PeerCpuScope cpu(cost_);
+  client_->notify_headers(this, std::move(raw_headers), nullptr, elapsed,
+                          part);
+}
+
+size_t Connection::buffered_message_size() const {
+  if (buf_.size() < HEADER_SIZE) {
+    return HEADER_SIZE;
+  }
+  return message_size(buf_.data());
+}
+
+size_t Connection::read_message(const char* data, size_t sz) {
+  if (sz < HEADER_SIZE) {
+    return 0;
+  }
+
+  size_t ret = 0;
+  PeerCpuScope cpu(cost_);
+  const auto start = std::chrono::steady_clock::now();
+  Arena::Ptr<Message> msg;
+  bool malformed = false;
+  {
+    HeapScope scope(HeapTag::MESSAGES);
+    LoopScope decode("decode");
+    msg = decode_message(data, sz, &ret, arena_, &malformed);
+  }
+  if (malformed) {
+    misbehaving(50, "malformed message");
+  }
+  if (ret) {
+    dispatch(msg.get(), ret, start);
+  }
+  return ret;
+}
+
+void Connection::dispatch(Message* msg, size_t size,
+                          std::chrono::steady_clock::time_point start) {
+  const auto end = std::chrono::steady_clock::now();
+  metrics().decode_time.record(end - start);
+  uint64_t trace_msg = 0;
+  if (tracing()) {
+    // the frame was complete when decoding started
+    const char* command = msg ? command_name(msg->headers.type) : nullptr;
+    trace_msg = next_trace_msg();
+    trace_event({"frame", command, trace_ns(start), TraceEvent::INSTANT,
+                 trace_msg, size});
+    trace_event({"decode", command, trace_ns(start),
+                 trace_ns(end) - trace_ns(start), trace_msg, size});
+  }
+
+  if (msg != nullptr) {
     const std::string& cmd = msg->headers.command;
-    log->debug("message '{}' from peer {}", cmd, peer_);
+    const Command type = msg->headers.type;
+    cost_.bytes_in[size_t(type)] += size;
+    metrics().messages_in[size_t(type)].add();
+    event_log().message(EventType::MSG_IN, peer_.addr, inbound_, type, size);
+    LOG_DEBUG(log, "message '{}' from peer {}", cmd, peer_);
+    TraceSpan span("dispatch", command_name(type), trace_msg, size);
+    LoopScope scope("message", command_name(type));
 
-    if (cmd != "version" && cmd != "verack" && !connected()) {
+    // sendaddrv2 comes between version and verack
+    if (type != Command::VERSION && type != Command::VERACK &&
+        type != Command::SENDADDRV2 && !connected()) {
       log->error(
           "unexpectedly received message '{}' from peer {} in unconnected "
           "state, have_version = {}, have_verack = {}",
           cmd, peer_, have_version_, have_verack_);
       client_->notify_error(this, "protocol error");
-      return ret;
+      return;
     }
 
-    if (cmd == "addr") {
-      handle_addr(dynamic_cast<AddrMsg*>(msg.get()));
-    } else if (cmd == "getaddr") {
-      handle_getaddr(dynamic_cast<GetAddr*>(msg.get()));
-    } else if (cmd == "getblocks") {
-      handle_getblocks(dynamic_cast<GetBlocks*>(msg.get()));
-    } else if (cmd == "getheaders") {
-      handle_getheaders(dynamic_cast<GetHeaders*>(msg.get()));
-    } else if (cmd == "headers") {
-      handle_headers(dynamic_cast<HeadersMsg*>(msg.get()));
-    } else if (cmd == "inv") {
-      handle_inv(dynamic_cast<InvMsg*>(msg.get()));
-    } else if (cmd == "mempool") {
-      handle_mempool(dynamic_cast<Mempool*>(msg.get()));
-    } else if (cmd == "ping") {
-      handle_ping(dynamic_cast<Ping*>(msg.get()));
-    } else if (cmd == "pong") {
-      handle_pong(dynamic_cast<Pong*>(msg.get()));
-    } else if (cmd == "reject") {
-      handle_reject(dynamic_cast<Reject*>(msg.get()));
-    } else if (cmd == "sendheaders") {
-      handle_sendheaders(dynamic_cast<SendHeaders*>(msg.get()));
-    } else if (cmd == "verack") {
-      handle_verack(dynamic_cast<VerAck*>(msg.get()));
-    } else if (cmd == "version") {
-      handle_version(dynamic_cast<Version*>(msg.get()));
-    } else {
-      handle_unknown(cmd);
+    // the decoder set type from the command, so the casts are safe
+    Message* m = msg;
+    switch (type) {
+      case Command::ADDR:
+        handle_addr(static_cast<AddrMsg*>(m));
+        break;
+      case Command::ADDRV2:
+        handle_addrv2(static_cast<AddrV2Msg*>(m));
+        break;
+      case Command::BLOCK:
+        handle_block(static_cast<Block*>(m));
+        break;
+      case Command::BLOCKTXN:
+        handle_blocktxn(static_cast<BlockTxn*>(m));
+        break;
+      case Command::CFCHECKPT:
+        handle_cfcheckpt(static_cast<CFCheckpt*>(m));
+        break;
+      case Command::CFHEADERS:
+        handle_cfheaders(static_cast<CFHeaders*>(m));
+        break;
+      case Command::CFILTER:
+        handle_cfilter(static_cast<CFilter*>(m));
+        break;
+      case Command::CMPCTBLOCK:
+        handle_cmpctblock(static_cast<CmpctBlock*>(m));
+        break;
+      case Command::FILTERADD:
+      case Command::FILTERCLEAR:
+      case Command::FILTERLOAD:
+        LOG_DEBUG(log, "ignoring {} message, we don't relay transactions", cmd);
+        break;
+      case Command::GETADDR:
+        handle_getaddr(static_cast<GetAddr*>(m));
+        break;
+      case Command::GETBLOCKS:
+        handle_getblocks(static_cast<GetBlocks*>(m));
+        break;
+      case Command::GETBLOCKTXN:
+        LOG_DEBUG(log, "ignoring {} message, we don't serve blocks", cmd);
+        break;
+      case Command::GETCFCHECKPT:
+        handle_getcfcheckpt(static_cast<GetCFCheckpt*>(m));
+        break;
+      case Command::GETCFHEADERS:
+        handle_getcfheaders(static_cast<GetCFHeaders*>(m));
+        break;
+      case Command::GETCFILTERS:
+        handle_getcfilters(static_cast<GetCFilters*>(m));
+        break;
+      case Command::GETHEADERS:
+        handle_getheaders(static_cast<GetHeaders*>(m));
+        break;
+      case Command::HEADERS:
+        handle_headers(static_cast<HeadersMsg*>(m));
+        break;
+      case Command::INV:
+        handle_inv(static_cast<InvMsg*>(m));
+        break;
+      case Command::MEMPOOL:
+        handle_mempool(static_cast<Mempool*>(m));
+        break;
+      case Command::MERKLEBLOCK:
+        handle_merkleblock(static_cast<MerkleBlock*>(m));
+        break;
+      case Command::PING:
+        handle_ping(static_cast<Ping*>(m));
+        break;
+      case Command::PONG:
+        handle_pong(static_cast<Pong*>(m));
+        break;
+      case Command::REJECT:
+        handle_reject(static_cast<Reject*>(m));
+        break;
+      case Command::SENDADDRV2:
+        handle_sendaddrv2(static_cast<SendAddrV2*>(m));
+        break;
+      case Command::SENDCMPCT:
+        handle_sendcmpct(static_cast<SendCmpct*>(m));
+        break;
+      case Command::SENDHEADERS:
+        handle_sendheaders(static_cast<SendHeaders*>(m));
+        break;
+      case Command::TX:
+        handle_tx(static_cast<TxMsg*>(m));
+        break;
+      case Command::VERACK:
+        handle_verack(static_cast<VerAck*>(m));
+        break;
+      case Command::VERSION:
+        handle_version(static_cast<Version*>(m));
+        break;
+      case Command::GETDATA:
+        handle_getdata(static_cast<GetData*>(m));
+        break;
+      case Command::UNKNOWN:
+        handle_unknown(cmd);
+        break;
     }
   }
-  return ret;
 }
 
 void Connection::send_msg(const Message& msg) {
-  size_t sz;
-  std::unique_ptr<char[]> data = msg.encode(sz);
+  if (!tcp_ && !socket_ && !replay_) {
+    return;
+  }
   const std::string& cmd = msg.headers.command;
-  log->debug("sending '{}' to {}", cmd, peer_);
-  tcp_->write(std::move(data), sz);
+  LOG_DEBUG(log, "sending '{}' to {}", cmd, peer_);
+  metrics().messages_out[size_t(msg.headers.type)].add();
+  const size_t size = msg.encoded_size();
+  cost_.bytes_out[size_t(msg.headers.type)] += size;
+  event_log().message(EventType::MSG_OUT, peer_.addr, inbound_,
+                      msg.headers.type, size);
+  if (ShapedQueue* queue = shaped_queue(msg.headers.type)) {
+    msg.encode(queue->data);
+    queue->sizes.push_back(size);
+    schedule_flush();
+    return;
+  }
+  // v2 packets are sealed from out_
+  if (size >= coalesce_limit && proxy_ready_ && !v2_) {
+    flush();  // keep messages in order
+    size_t sz;
+    std::unique_ptr<char[]> data = msg.encode(sz);
+    assert(sz == size);
+    write(std::move(data), sz);
+    return;
+  }
+
+  const size_t start = out_.size();
+  msg.encode(out_);
+  assert(out_.size() - start == size);
+  schedule_flush();
+}
+
+void Connection::send_encoded(const char* data, size_t size) {
+  if (!tcp_ && !socket_ && !replay_) {
+    return;
+  }
+  // the command follows the magic
+  const Command type = to_command(load_command_key(data + sizeof(uint32_t)));
+  LOG_DEBUG(log, "sending '{}' to {}", command_name(type), peer_);
+  metrics().messages_out[size_t(type)].add();
+  cost_.bytes_out[size_t(type)] += size;
+  event_log().message(EventType::MSG_OUT, peer_.addr, inbound_, type, size);
+  if (ShapedQueue* queue = shaped_queue(type)) {
+    queue->data.append(data, size);
+    queue->sizes.push_back(size);
+    schedule_flush();
+    return;
+  }
+  // v2 packets are sealed from out_
+  if (size >= coalesce_limit && proxy_ready_ && !v2_) {
+    flush();  // keep messages in order
+    std::unique_ptr<char[]> copy(new char[size]);
+    std::memcpy(copy.get(), data, size);
+    write(std::move(copy), size);
+    return;
+  }
+  out_.append(data, size);
+  schedule_flush();
+}
+
+void Connection::schedule_flush() {
+  if (!flush_) {
+    flush_ = loop_->resource<uvw::IdleHandle>();
+    flush_->on<uvw::IdleEvent>([this](const auto&, auto& idle) {
+      idle.stop();
+      flush();
+    });
+  }
+  if (!flush_->active()) {
+    flush_->start();
+  }
+}
+
+void Connection::drop_later(const char* why) {
+  if (!drop_reason_) {
+    drop_reason_ = why;
+    schedule_flush();
+  }
+}
+
+void Connection::misbehaving(int score, const char* why) {
+  const int old = misbehavior_;
+  misbehavior_ += score;
+  log->warn("peer {} misbehaving ({} -> {}): {}", peer_, old, misbehavior_,
+            why);
+  if (misbehaved()) {
+    drop_later(why);
+  }
+}
+
+void Connection::flush() {
+  if (drop_reason_) {
+    client_->notify_error(this, drop_reason_);  // deletes this
+    return;
+  }
+  if ((!tcp_ && !socket_ && !replay_) || !proxy_ready_) {
+    return;
+  }
+  if (v2_ && v2_->has_output()) {
+    write(v2_->take_output());
+  }
+  if (v2_ && !v2_->keyed()) {
+    return;  // packets have to wait for the peer's key
+  }
+  if (shaping()) {
+    release_shaped();
+  }
+  if (!out_.size()) {
+    return;
+  }
+  if (v2_) {
+    write(seal_queued());
+    return;
+  }
+  size_t sz;
+  std::unique_ptr<char[]> data = out_.serialize(sz, false);
+  out_.reserve(out_queue_size);
+  write(std::move(data), sz);
+}
+
+std::string Connection::seal_queued() {
+  std::string sealed;
+  sealed.reserve(out_.size() + out_queue_size);
+  const char* p = out_.data();
+  const char* end = p + out_.size();
+  for (; p < end; p += message_size(p)) {
+    v2_->cipher().seal_message(p, &sealed);
+  }
+  out_.consume(out_.size());
+  return sealed;
+}
+
+bool Connection::shaping() const {
+  return send_bucket_.limited() || client_->send_limit_.limited();
+}
+
+Connection::ShapedQueue* Connection::shaped_queue(Command type) {
+  return shaping() ? &shaped_[size_t(traffic_class(type))] : nullptr;
+}
+
+void Connection::release_shaped() {
+  TokenBucket& global = client_->send_limit_;
+  for (size_t i = 0; i < num_traffic_classes; i++) {
+    const Traffic cls = Traffic(i);
+    ShapedQueue& queue = shaped_[i];
+    while (!queue.sizes.empty()) {
+      if (!send_bucket_.allows(cls) || !global.allows(cls)) {
+        // the classes after this one wait too, so they can't overtake it
+        send_wait_.start(std::max(send_bucket_.wait(cls), global.wait(cls)));
+        return;
+      }
+      const size_t size = queue.sizes.front();
+      queue.sizes.pop_front();
+      out_.append(queue.data.data(), size);
+      queue.data.consume(size);
+      send_bucket_.take(size);
+      global.take(size);
+    }
+  }
+}
+
+size_t Connection::buffer_bytes() const {
+  size_t bytes = buf_.capacity() + backlog_.capacity() + out_.capacity();
+  for (const ShapedQueue& queue : shaped_) {
+    bytes += queue.data.capacity();
+  }
+  return bytes;
+}
+
+void Connection::write(std::unique_ptr<char[]> data, size_t sz) {
+  unsent_ += sz;
+  bytes_out_ += sz;
+  metrics().bytes_out.add(sz);
+  if (tracing()) {
+    write_starts_.push_back(trace_now());
+  }
+  if (client_->capture_) {
+    client_->capture_->send(capture_id_, data.get(), sz);
+  }
+  if (replay_) {
+    if (client_->replay_write_cb_) {
+      client_->replay_write_cb_(peer_.addr, data.get(), sz);
+    }
+    wrote(sz);
+    return;
+  }
+  if (socket_) {
+    socket_->write(std::move(data), sz);
+  } else if (ring_) {
+    ring_->write(std::move(data), sz);
+  } else {
+    writes_.push_back(sz);
+    tcp_->write(std::move(data), sz);
+  }
+  if (unsent_ > unsent_limit) {
+    drop_later("peer isn't reading");
+  } else if (unsent_ > unsent_high_watermark && !paused_) {
+    log->info("peer {} has {} bytes unsent, pausing reads", peer_, unsent_);
+    pause_reading(true);
+  }
+}
+
+void Connection::write(const std::string& data) {
+  std::unique_ptr<char[]> copy(new char[data.size()]);
+  std::memcpy(copy.get(), data.data(), data.size());
+  write(std::move(copy), data.size());
+}
+
+void Connection::wrote(size_t sz) {
+  assert(unsent_ >= sz);
+  unsent_ -= sz;
+  if (!write_starts_.empty()) {
+    const uint64_t start = write_starts_.front();
+    write_starts_.pop_front();
+    trace_event({"write", nullptr, start, trace_now() - start, 0, sz});
+  }
+  if (paused_ && unsent_ <= unsent_low_watermark) {
+    LOG_DEBUG(log, "peer {} caught up, resuming reads", peer_);
+    pause_reading(false);
+  }
+}
+
+void Connection::pause_reading(bool paused) {
+  paused_ = paused;
+  set_reading();
+}
+
+void Connection::shrink_buffers() {
+  if (!buffered_) {
+    buf_.shrink(read_buffer_size);
+    backlog_.shrink(0);
+  }
+  buffered_ = false;
+}
+
+void Connection::check_reads() {
+  const Traffic cls = client_->read_class(this);
+  const std::chrono::milliseconds wait =
+      std::max(recv_bucket_.wait(cls), client_->recv_limit_.wait(cls));
+  throttled_ = wait.count() > 0;
+  set_reading();
+  if (throttled_) {
+    recv_wait_.start(wait);
+  }
+}
+
+void Connection::set_reading() {
+  const bool stop = paused_ || throttled_ || backlog_.size();
+  if (stop == reads_stopped_) {
+    return;
+  }
+  reads_stopped_ = stop;
+  if (socket_) {
+    socket_->pause(stop);
+  } else if (ring_) {
+    ring_->pause(stop);
+  } else if (tcp_) {
+    if (stop) {
+      tcp_->stop();
+    } else {
+      tcp_->read();
+    }
+  }
 }
 
 void Connection::send_version() {
@@ -142,19 +945,27 @@ void Connection::send_version() {
   ver.nonce = client_->us_.nonce;
   ver.user_agent = client_->us_.user_agent;
   ver.start_height = client_->get_height();
+  ver.relay = client_->want_tx_relay();
   send_msg(ver);
+  if (!inbound_ && client_->settings_.optimistic_handshake) {
+    send_verack();  // ahead of the peer's version
+  }
 
-  // expect a verack msg within 5 seconds
-  verack_ = client_->loop_->resource<uvw::TimerHandle>();
-  verack_->once<uvw::ErrorEvent>([](const auto&, auto& timer) {
-    log->error("got error from verack timer");
-    timer.close();
-  });
-  verack_->on<uvw::TimerEvent>([this](const auto&, auto& timer) {
-    client_->notify_error(this, "verack timeout");
-    timer.close();
-  });
-  verack_->start(std::chrono::seconds(5), std::chrono::seconds(0));
+  // expect a verack msg within 5 seconds, unless it came first
+  if (!have_verack_) {
+    verack_.start(std::chrono::seconds(5));
+  }
+}
+
+void Connection::send_verack() {
+  toggle_on(sent_verack_);
+  // addrv2 has to be asked for before verack, which may go out before the
+  // peer's version says whether it understands it
+  if (!have_version_ || peer_.version >= MIN_ADDRV2_VERSION) {
+    send_encoded(empty_message(Command::SENDADDRV2), HEADER_SIZE);
+  }
+  send_encoded(empty_message(Command::VERACK), HEADER_SIZE);
+  send_encoded(empty_message(Command::SENDHEADERS), HEADER_SIZE);
 }
 
 void Connection::get_headers(const std::vector<hash_t>& locator_hashes,
@@ -164,84 +975,309 @@ void Connection::get_headers(const std::vector<hash_t>& locator_hashes,
   req.locator_hashes = locator_hashes;
   req.hash_stop = hash_stop;
   send_msg(req);
+  getheaders_sent_ = now();
 }
 
-void Connection::get_headers(const BlockHeader& start_hdr) {
-  log->debug("fetching headers from peer {} starting at block {}", peer_,
-             start_hdr);
-  std::vector<hash_t> needed{start_hdr.block_hash};
-  return get_headers(needed);
+void Connection::get_data(const std::vector<Inv>& invs) {
+  for (size_t i = 0; i < invs.size(); i += MAX_INV_SIZE) {
+    const size_t n = std::min<size_t>(invs.size() - i, MAX_INV_SIZE);
+    GetData req;
+    req.invs.assign(invs.begin() + i, invs.begin() + i + n);
+    for (const auto& inv : req.invs) {
+      known_invs_.insert(inv.hash);
+    }
+    if (filter_loaded_) {
+      // get just the transactions that match our filter
+      for (auto& inv : req.invs) {
+        if (inv.type == InvType::BLOCK) {
+          inv.type = InvType::FILTERED_BLOCK;
+        }
+      }
+    }
+    send_msg(req);
+  }
 }
 
-void Connection::get_data(const Inv& inv) {
-  GetData req;
-  req.invs.push_back(inv);
+void Connection::announce_tx(const hash_t& txid) {
+  if (!known_invs_.insert(txid)) {
+    return;
+  }
+  tx_invs_.emplace_back(InvType::TX, txid);
+  if (!trickle_.active()) {
+    // exponential, for a Poisson process
+    const double u = (rand64() >> 11) * (1.0 / (1ULL << 53));
+    const double mean = inbound_ ? trickle_inbound_ms : trickle_outbound_ms;
+    trickle_.start(std::chrono::milliseconds(
+        static_cast<int64_t>(-std::log1p(-u) * mean)));
+  }
+}
+
+void Connection::trickle() {
+  for (size_t i = 0; i < tx_invs_.size(); i += MAX_INV_SIZE) {
+    const size_t n = std::min<size_t>(tx_invs_.size() - i, MAX_INV_SIZE);
+    InvMsg msg;
+    msg.invs.assign(tx_invs_.begin() + i, tx_invs_.begin() + i + n);
+    send_msg(msg);
+  }
+  tx_invs_.clear();
+}
+
+void Connection::send_cmpct(bool high_bandwidth) {
+  SendCmpct msg;
+  msg.announce = high_bandwidth;
+  send_msg(msg);
+  cmpct_hb_ = high_bandwidth;
+}
+
+void Connection::get_block_txn(const hash_t& block_hash,
+                               const std::vector<uint32_t>& indexes) {
+  GetBlockTxn req;
+  req.block_hash = block_hash;
+  req.indexes = indexes;
+  send_msg(req);
+}
+
+void Connection::get_cfcheckpt(const hash_t& stop_hash) {
+  GetCFCheckpt req;
+  req.stop_hash = stop_hash;
+  send_msg(req);
+}
+
+void Connection::get_cfheaders(uint32_t start_height,
+                               const hash_t& stop_hash) {
+  GetCFHeaders req;
+  req.start_height = start_height;
+  req.stop_hash = stop_hash;
+  send_msg(req);
+}
+
+void Connection::get_cfilters(uint32_t start_height,
+                              const hash_t& stop_hash) {
+  GetCFilters req;
+  req.start_height = start_height;
+  req.stop_hash = stop_hash;
   send_msg(req);
 }
 
 void Connection::shutdown() {
   bool did_shutdown = false;
-  if (ping_) {
-    ping_->stop();
-    ping_->close();
-    ping_.reset();
-    did_shutdown = true;
+  if (flush_) {
+    flush_->stop();
+    flush_->close();
+    flush_.reset();
   }
-  if (pong_) {
-    pong_->stop();
-    pong_->close();
-    pong_.reset();
-    did_shutdown = true;
+  ping_.stop();
+  pong_.stop();
+  verack_.stop();
+  getaddr_.stop();
+  trickle_.stop();
+  connect_timer_.stop();
+  hdr_timer_.stop();
+  cf_timer_.stop();
+  send_wait_.stop();
+  recv_wait_.stop();
+  if (ring_) {
+    ring_->close();
+    ring_.reset();
   }
   if (tcp_) {
     tcp_->close();
     tcp_.reset();
     did_shutdown = true;
   }
+  if (socket_) {
+    socket_->close();
+    socket_.reset();
+    did_shutdown = true;
+  }
   if (did_shutdown) {
-    log->debug("shutdown connection to peer {}", peer_);
+    LOG_DEBUG(log, "shutdown connection to peer {}", peer_);
   }
 }
 
-void Connection::handle_addr(AddrMsg* addrs) {
+void Connection::handle_addr(AddrMsg* addrs) { add_addrs(addrs->addrs); }
+
+void Connection::handle_addrv2(AddrV2Msg* addrs) {
+  if (addrs->unreachable) {
+    LOG_DEBUG(log, "skipped {} addrv2 address(es) we can't reach from {}",
+              addrs->unreachable, peer_);
+  }
+  add_addrs(addrs->addrs);
+}
+
+void Connection::add_addrs(const std::vector<NetAddr>& addrs) {
+  // An addr flood is cut down to the peer's rate, before any of it can
+  // set off connections.
+  size_t n = addrs.size();
+  if (addr_bucket_.limited()) {
+    n = std::min<size_t>(n, std::max<int64_t>(addr_bucket_.tokens(), 0));
+    addr_bucket_.take(n);
+    if (n < addrs.size()) {
+      LOG_DEBUG(log, "skipping {} of {} address(es) from peer {}, over rate",
+                addrs.size() - n, addrs.size(), peer_);
+    }
+  }
   bool new_peers = false;
-  for (const auto& addr : addrs->addrs) {
+  for (size_t i = 0; i < n; i++) {
+    const NetAddr& addr = addrs[i];
     client_->notify_peer(this, addr);
     if (addr.addr != peer_.addr) {
       new_peers = true;
     }
   }
-  if (new_peers && getaddr_) {
-    getaddr_->stop();
-    getaddr_->close();
-    getaddr_.reset();
+  if (new_peers) {
+    getaddr_.stop();
   }
 }
+
+void Connection::handle_cfcheckpt(CFCheckpt* checkpt) {
+  client_->notify_cfcheckpt(this, *checkpt);
+}
+
+void Connection::handle_cfheaders(CFHeaders* headers) {
+  client_->notify_cfheaders(this, *headers);
+}
+
+void Connection::handle_cfilter(CFilter* filter) {
+  client_->notify_cfilter(this, *filter);
+}
+
 void Connection::handle_getaddr(GetAddr* addr) {
-  log->debug("ignoring getaddr message");
+  // an outbound peer could map our table out by asking over and over
+  if (!inbound_ || sent_addrs_) {
+    LOG_DEBUG(log, "ignoring getaddr message from peer {}", peer_);
+    return;
+  }
+  sent_addrs_ = true;
+  send_encoded(client_->addr_message());
 }
 
 void Connection::handle_getblocks(GetBlocks* blocks) {
-  log->debug("ignoring getblocks message");
+  LOG_DEBUG(log, "ignoring getblocks message");
 }
 
-void Connection::handle_getheaders(GetHeaders* headers) {
-  log->debug("ignoring getheaders message");
+void Connection::handle_getcfcheckpt(GetCFCheckpt* req) {
+  FilterServer* server = client_->filter_server();
+  ReplyCache::Message reply;
+  if (server != nullptr && req->filter_type == BASIC_FILTER) {
+    reply = server->cfcheckpt(req->stop_hash);
+  }
+  send_filter_reply("getcfcheckpt", reply);
+}
+
+void Connection::handle_getcfheaders(GetCFHeaders* req) {
+  FilterServer* server = client_->filter_server();
+  ReplyCache::Message reply;
+  if (server != nullptr && req->filter_type == BASIC_FILTER) {
+    reply = server->cfheaders(req->start_height, req->stop_hash);
+  }
+  send_filter_reply("getcfheaders", reply);
+}
+
+void Connection::handle_getcfilters(GetCFilters* req) {
+  FilterServer* server = client_->filter_server();
+  ReplyCache::Message reply;
+  if (server != nullptr && req->filter_type == BASIC_FILTER) {
+    reply = server->cfilters(req->start_height, req->stop_hash);
+  }
+  send_filter_reply("getcfilters", reply);
+}
+
+void Connection::send_filter_reply(const char* cmd,
+                                   const ReplyCache::Message& reply) {
+  if (!reply) {
+    LOG_DEBUG(log, "can't answer {} message from peer {}", cmd, peer_);
+    return;
+  }
+  LOG_DEBUG(log, "sending {} byte {} reply to peer {}", reply->size(), cmd,
+            peer_);
+  send_encoded(*reply);
+}
+
+void Connection::handle_getheaders(GetHeaders* req) {
+  ReplyCache::Message reply =
+      client_->headers_message(req->locator_hashes, req->hash_stop);
+  LOG_DEBUG(log, "sending {} byte headers reply to peer {}", reply->size(),
+            peer_);
+  send_encoded(*reply);
 }
 
 void Connection::handle_headers(HeadersMsg* msg) {
-  log->debug("headers message with {} block headers",
-             msg->block_headers.size());
-  client_->notify_headers(this, msg->block_headers);
+  const size_t count = msg->view().size();
+  LOG_DEBUG(log, "headers message with {} block headers", count);
+  const std::chrono::milliseconds elapsed =
+      finish_getheaders(count, msg->raw_headers.size());
+  const uint32_t* checksum =
+      msg->headers.sealed ? nullptr : &msg->headers.checksum;
+  client_->notify_headers(this, std::move(msg->raw_headers), checksum,
+                          elapsed, {count, true, true});
+}
+
+std::chrono::milliseconds Connection::finish_getheaders(size_t count,
+                                                         size_t bytes) {
+  const std::chrono::milliseconds elapsed = since_getheaders();
+  if (getheaders_sent_ != time_point()) {
+    hdr_count_ += count;
+    hdr_bytes_ += bytes;
+    hdr_elapsed_ += elapsed;
+  }
+  // cleared first, since the client may ask for more headers right away
+  getheaders_sent_ = time_point();
+  return elapsed;
 }
 
 void Connection::handle_mempool(Mempool* pool) {
-  log->debug("ignoring mempool message");
+  LOG_DEBUG(log, "ignoring mempool message");
+}
+
+void Connection::handle_block(Block* block) {
+  client_->notify_block(this, std::move(*block));
+}
+
+void Connection::handle_blocktxn(BlockTxn* txn) {
+  client_->notify_blocktxn(this, *txn);
+}
+
+void Connection::handle_cmpctblock(CmpctBlock* block) {
+  client_->notify_cmpctblock(this, *block);
+}
+
+void Connection::handle_merkleblock(MerkleBlock* block) {
+  std::vector<hash_t> matches;
+  if (!block->extract_matches(matches)) {
+    log->warn("peer {} sent a bad merkleblock for {}", peer_,
+              to_hex(block->header.block_hash));
+    misbehaving(MISBEHAVIOR_LIMIT, "bad merkleblock");
+    return;
+  }
+  client_->notify_merkleblock(this, block->header, matches);
 }
 
 void Connection::handle_inv(InvMsg* inv) {
-  for (const auto& inv : inv->invs) {
-    client_->notify_inv(this, inv);
+  // blocks first, so that a flood of transactions doesn't hold them up;
+  // just the ones this peer hasn't announced before, handed over together
+  // so that the blocks are looked up in one batch
+  auto& invs = inv->invs;
+  invs.erase(std::remove_if(invs.begin(), invs.end(),
+                            [this](const Inv& item) {
+                              return !known_invs_.insert(item.hash);
+                            }),
+             invs.end());
+  if (!invs.empty()) {
+    client_->notify_invs(this, invs);
+  }
+}
+
+void Connection::handle_getdata(GetData* getdata) {
+  // we only have our own transactions to give
+  for (const auto& inv : getdata->invs) {
+    if (inv.type != InvType::TX && inv.type != InvType::WITNESS_TX) {
+      continue;
+    }
+    const std::string* msg = client_->serve_tx(this, inv.hash);
+    if (msg != nullptr) {
+      send_encoded(*msg);
+    }
   }
 }
 
@@ -252,7 +1288,8 @@ void Connection::handle_ping(Ping* ping) {
 }
 
 void Connection::handle_pong(Pong* pong) {
-  if (pong_) {
+  if (pong_.active()) {
+    pong_.stop();
     if (pong->nonce != ping_nonce_) {
       log->warn(
           "peer {} sent invalid pong nonce, they sent {}, we expected {}, "
@@ -260,9 +1297,11 @@ void Connection::handle_pong(Pong* pong) {
           peer_, pong->nonce, ping_nonce_);
       shutdown();
     } else {
-      pong_->close();
+      // weight the old estimate 7:1, like TCP's srtt
+      const auto sample = std::chrono::duration_cast<std::chrono::milliseconds>(
+          now() - ping_sent_);
+      rtt_ = (7 * rtt_ + sample) / 8;
     }
-    pong_.reset();
   } else {
     log->warn("peer {} sent pong when one was not expected", peer_);
     shutdown();
@@ -275,80 +1314,94 @@ void Connection::handle_reject(Reject* rej) {
              rej->message, ccode, rej->reason);
 }
 
+void Connection::handle_sendcmpct(SendCmpct* send) {
+  // version 1 short ids are of txids, which we can't use for segwit blocks
+  if (send->version != CMPCT_VERSION || peer_cmpct_) {
+    return;
+  }
+  peer_cmpct_ = true;
+  client_->notify_compact_peer(this);
+}
+
+void Connection::handle_sendaddrv2(SendAddrV2* send) {
+  LOG_DEBUG(log, "ignoring sendaddrv2 message, we don't relay addresses");
+}
+
 void Connection::handle_sendheaders(SendHeaders* send) {
-  log->debug("ignoring sendheaders message");
+  LOG_DEBUG(log, "ignoring sendheaders message");
 }
 
+void Connection::handle_tx(TxMsg* tx) { client_->notify_tx(this, *tx); }
+
 void Connection::handle_unknown(const std::string& cmd) {
   log->error("decoder returned unknown p2p message '{}'", cmd);
 }
 
 void Connection::handle_verack(VerAck* ack) {
   toggle_on(have_verack_);
-  assert(verack_);
-  verack_->stop();
-  verack_->close();
-  verack_.reset();
+  // an optimistic inbound peer may send it before we've sent our version
+  verack_.stop();
 }
 
 void Connection::handle_version(Version* ver) {
   toggle_on(have_version_);
+  if (inbound_) {
+    send_version();
+  }
 
   peer_.nonce = ver->nonce;
   peer_.services = ver->services;
   peer_.user_agent = ver->user_agent;
   peer_.version = ver->version;
+  peer_.start_height = ver->start_height;
+  peer_.time_offset = int64_t(ver->timestamp) - int64_t(cached_time());
   peer_.time = now();
+  handshake_latency_ = std::chrono::duration_cast<std::chrono::milliseconds>(
+      peer_.time - connect_start_);
+  rtt_ = handshake_latency_ / 2;  // the TCP handshake, then version
   log->info("finished handshake with peer {}, blocks={}", peer_,
             ver->start_height);
-  send_msg(VerAck{});       // send required verack
-  send_msg(SendHeaders{});  // request new headers
-  get_new_addrs();          // ask for more peers
-
-  // set up a ping timer
-  ping_ = client_->loop_->resource<uvw::TimerHandle>();
-  ping_->once<uvw::ErrorEvent>([](const auto&, auto& timer) {
-    log->error("got error from ping timer");
-    timer.close();
-  });
-  ping_->on<uvw::TimerEvent>([this](const auto&, auto&) {
-    Ping ping;
-    ping.nonce = ping_nonce_ = rand64();
-    send_msg(ping);
-
-    pong_ = client_->loop_->resource<uvw::TimerHandle>();
-    pong_->once<uvw::ErrorEvent>([this](const auto&, auto& timer) {
-      log->error("got error from pong timer");
-      pong_->close();
-    });
-    pong_->on<uvw::TimerEvent>([this](const auto&, auto&) {
-      log->warn("peer {} did not send pong in time", peer_);
-      shutdown();
-    });
-    pong_->start(std::chrono::seconds(5), std::chrono::seconds(0));
-  });
-  ping_->start(ping_interval, ping_interval);
+  // unless it went out with our version, send the required verack and ask
+  // for new headers
+  if (!sent_verack_) {
+    send_verack();
+  }
+  if (peer_.version >= MIN_CMPCT_VERSION && peer_.services & NODE_WITNESS) {
+    send_msg(SendCmpct{});  // low bandwidth until the client picks peers
+  }
+  if (client_->filter_ &&
+      (peer_.version < NO_BLOOM_VERSION || peer_.services & NODE_BLOOM)) {
+    send_msg(client_->filter_->message());
+    filter_loaded_ = true;
+    if (client_->mempool_) {
+      // BIP35: announce what already matches
+      send_encoded(empty_message(Command::MEMPOOL), HEADER_SIZE);
+    }
+  }
+  if (!inbound_) {
+    get_new_addrs();  // ask for more peers
+  }
 
-  // tell the client that we're ready to fetch headers
+  ping_.start(ping_interval);
+
+  // Tell the client that we're ready to fetch headers. Its getheaders goes
+  // out in the same write as our verack, without waiting for the peer's.
   client_->notify_connected(this);
 }
 
+void Connection::send_ping() {
+  Ping ping;
+  ping.nonce = ping_nonce_ = rand64();
+  send_msg(ping);
+  ping_sent_ = now();
+  ping_.start(ping_interval);
+  shrink_buffers();
+  pong_.start(std::chrono::seconds(5));
+}
+
 void Connection::get_new_addrs() {
-  assert(!getaddr_);
-  getaddr_ = client_->loop_->resource<uvw::TimerHandle>();
-  getaddr_->once<uvw::ErrorEvent>([](const auto&, auto& timer) {
-    log->error("got error from getaddr timer");
-    timer.close();
-  });
-  getaddr_->on<uvw::TimerEvent>([this](const auto&, auto& timer) {
-    log->info(
-        "peer {} failed to respond to getaddr, asking client to connect to "
-        "new seed peer",
-        peer_);
-    client_->connect_to_new_peer();
-    timer.close();
-  });
-  getaddr_->start(std::chrono::seconds(5), std::chrono::seconds(0));
+  assert(!getaddr_.active());
+  getaddr_.start(std::chrono::seconds(5));
 }
 }  // namespace spv
 
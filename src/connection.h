@@ -16,19 +16,35 @@
 
 #pragma once
 
+#include <array>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <limits>
 #include <memory>
 #include <utility>
 
 #include "./addr.h"
+#include "./arena.h"
 #include "./buffer.h"
 #include "./config.h"
+#include "./encoder.h"
+#include "./headers_stream.h"
+#include "./inv_tracker.h"
 #include "./message.h"
 #include "./peer.h"
+#include "./peer_cost.h"
+#include "./presync.h"
+#include "./reply_cache.h"
+#include "./shaper.h"
+#include "./socks5.h"
+#include "./timer_wheel.h"
 #include "./util.h"
+#include "./v2_transport.h"
 
 namespace uvw {
+class IdleHandle;
 class TcpHandle;
-class TimerHandle;
 class Loop;
 class Addr;
 }  // namespace uvw
@@ -36,12 +52,30 @@ class Addr;
 namespace spv {
 
 class Client;
+class IoSocket;
+class RingSocket;
+
 class Connection {
   friend Client;
 
  public:
+  // the misbehavior score at which a peer is dropped and banned
+  static const int MISBEHAVIOR_LIMIT = 100;
+
+  // Where a batch of headers handed to Client::notify_headers() sits in its
+  // message, which may be streamed in parts: the count of headers in the
+  // whole message, and whether this is its first and its last part.
+  struct HeadersPart {
+    size_t count;
+    bool first;
+    bool last;
+  };
+
   Connection() = delete;
-  Connection(Client* client_, const Addr& addr);
+  // An outbound connection to addr, or an inbound one from addr that has
+  // already been accepted on tcp.
+  Connection(Client* client_, const Addr& addr,
+             std::shared_ptr<uvw::TcpHandle> tcp = nullptr);
   Connection(const Connection& other) = delete;
   ~Connection() { shutdown(); }
 
@@ -50,24 +84,224 @@ class Connection {
   // establish the connection
   void connect();
 
-  // read data
+  // Read data. Messages past the per-turn budget are kept in a backlog, and
+  // reading pauses until the client has run it, see run_backlog().
   void read(const char* data, size_t sz);
 
+  // Handle another turn's worth of the backlog, returning true if some of
+  // it is left for the next turn.
+  bool run_backlog();
+
   void _version();
 
   inline bool connected() const { return have_version_ && have_verack_; }
 
+  // has the peer sent its version message?
+  inline bool has_version() const { return have_version_; }
+
+  // Can requests go to the peer? That's once its version is in and our
+  // verack is sent, since the peer reads them after the verack; its own
+  // verack needn't have arrived.
+  inline bool ready() const { return have_version_ && sent_verack_; }
+
+  // did the peer connect to us?
+  inline bool inbound() const { return inbound_; }
+
+  // Is the peer slow to read what we send? Reading from it is paused until
+  // it catches up, and it shouldn't be given more work.
+  inline bool congested() const { return paused_; }
+
+  // can the peer send us version 2 compact blocks? see BIP152
+  inline bool compact_blocks() const { return peer_cmpct_; }
+
+  // is the peer about to be dropped? see drop_later()
+  inline bool dropping() const { return drop_reason_ != nullptr; }
+
+  // has the peer broken the protocol badly enough to be banned? see
+  // misbehaving()
+  inline bool misbehaved() const { return misbehavior_ >= MISBEHAVIOR_LIMIT; }
+
+  // bytes handed to libuv that haven't been written yet
+  inline size_t unsent() const { return unsent_; }
+
+  // bytes read from and written to the peer, ever
+  inline size_t bytes_received() const { return bytes_in_; }
+  inline size_t bytes_sent() const { return bytes_out_; }
+
+  // bytes allocated for the read, backlog and write buffers
+  size_t buffer_bytes() const;
+
+  // what the peer has cost us and given back; see PeerCost
+  inline const PeerCost &cost() const { return cost_; }
+
+  // time from connect() to the peer's version message
+  inline std::chrono::milliseconds handshake_latency() const {
+    return handshake_latency_;
+  }
+
+  // when the connection was started or accepted
+  inline time_point connect_time() const { return connect_start_; }
+
+  // when the peer last sent headers that extended the chain, if ever
+  inline time_point last_headers() const { return last_headers_; }
+
+  // time since the outstanding getheaders was sent, or zero if there isn't
+  // one
+  std::chrono::milliseconds since_getheaders() const;
+
+  // Smoothed round trip time from pings, estimated from the handshake until
+  // the first pong. Zero before the handshake.
+  inline std::chrono::milliseconds rtt() const { return rtt_; }
+
+  // Observed getheaders throughput, in headers and bytes per second, or 0
+  // if no headers have arrived yet.
+  size_t header_rate() const;
+  size_t byte_rate() const;
+
  private:
   std::shared_ptr<uvw::Loop> loop_;
   Client* client_;
   Buffer buf_;
+  Buffer backlog_;  // read but not yet handled, see read()
   Peer peer_;
 
+  // messages decoded by read(), which resets it when it's done
+  Arena arena_;
+
+  // Messages waiting to be written; everything sent during one loop
+  // iteration goes out as a single write from the flush_ idle handle.
+  Encoder out_;
+  std::shared_ptr<uvw::IdleHandle> flush_;
+
   bool have_version_;
   bool have_verack_;
+  bool sent_verack_;
+  bool inbound_;
+
+  // Made by Client::replay_open(), with no socket: writes complete at once
+  // and reads come from the capture. capture_id_ numbers the peer in
+  // Client::capture_, with --capture-file.
+  bool replay_;
+  uint32_t capture_id_;
+
+  // where an outbound connection is in Client::handshaken_ once it's
+  // finished the handshake, and not_handshaken until then
+  static const size_t not_handshaken = std::numeric_limits<size_t>::max();
+  size_t handshaken_pos_;
+
+  // see congested(); writes_ has the size of each write in flight (only
+  // for tcp_ itself, IoSocket and RingSocket keep their own), and
+  // reads_stopped_ is set while
+  // set_reading() has reads stopped
+  size_t unsent_;
+  bool paused_;
+  bool reads_stopped_;
+  std::deque<size_t> writes_;
+
+  // see bytes_received() and bytes_sent()
+  size_t bytes_in_;
+  size_t bytes_out_;
+
+  // see cost(); the client counts the useful headers and blocks
+  PeerCost cost_;
+
+  // has anything been left in buf_ or backlog_ since the last ping? if not,
+  // send_ping() shrinks them
+  bool buffered_;
+
+  // when each write in flight started, when tracing
+  std::deque<uint64_t> write_starts_;
+
+  // set when the peer should be dropped; that happens from the flush idle
+  // handler, since the client deletes the connection right away
+  const char* drop_reason_;
+
+  // the sum of the peer's misbehaving() scores
+  int misbehavior_;
+
+  // did we send the client's bloom filter?
+  bool filter_loaded_;
+
+  // did the peer send sendcmpct for CMPCT_VERSION, and have we asked it to
+  // push new blocks to us as cmpctblock (high bandwidth mode)?
+  bool peer_cmpct_;
+  bool cmpct_hb_;
+
+  // what the peer announced or we asked it for, so repeat announcements
+  // don't reach the client
+  KnownInvs known_invs_;
+
+  // the transactions to announce when trickle_ fires, see announce_tx()
+  std::vector<Inv> tx_invs_;
+  Timer trickle_;
+
+  // With --proxy, the SOCKS5 handshake that read() takes off the front of
+  // tcp_'s stream (IoSocket has its own). Until the proxy has connected us,
+  // with --proxy-wait, nothing is written to the peer.
+  std::unique_ptr<Socks5Handshake> socks_;
+  bool proxy_ready_;
+
+  // With --v2-transport, the BIP324 session, which read() hands the
+  // handshake to and then decrypts packets with, see process_v2(); flush()
+  // seals what's queued. v2_contents_ is the contents size of the packet in
+  // buf_ once its length has been read, and npos before. Reset when the
+  // peer turns out to speak v1.
+  std::unique_ptr<V2Session> v2_;
+  size_t v2_contents_;
+
+  time_point connect_start_;
+  std::chrono::milliseconds handshake_latency_;
+  time_point getheaders_sent_;
+  time_point last_headers_;
+  time_point ping_sent_;
+  std::chrono::milliseconds rtt_;
+
+  // Header pipelining, see Client::pipeline_headers(): the getheaders
+  // requests waiting for a reply, oldest first, and for each batch of
+  // headers still being validated, the request its message answered.
+  struct HeadersRequest {
+    hash_t from;     // the locator's hash, if it had just the one
+    bool pipelined;  // sent before the previous reply was validated
+  };
+  struct HeadersReply {
+    HeadersRequest req;
+    HeadersPart part;
+  };
+  std::deque<HeadersRequest> header_requests_;
+  std::deque<HeadersReply> header_replies_;
+
+  // The headers message being streamed, see stream_headers(), and for the
+  // client, the request it answers, the prev_block of its first header and
+  // whether the peer's segment took its first part.
+  HeadersStream headers_in_;
+  HeadersRequest reply_req_;
+  hash_t reply_start_;
+  bool reply_synced_;
+
+  // checking the peer's low-work chain before storing it, see
+  // Client::presync_headers()
+  std::unique_ptr<HeaderPresync> presync_;
+
+  // totals over all headers replies, for header_rate() and byte_rate()
+  size_t hdr_count_;
+  size_t hdr_bytes_;
+  std::chrono::milliseconds hdr_elapsed_;
 
  protected:
+  // Exactly one of these is set until shutdown: the socket is on an I/O
+  // thread when the client has an IoPool.
   std::shared_ptr<uvw::TcpHandle> tcp_;
+  std::shared_ptr<IoSocket> socket_;
+
+  // with --io-uring, tcp_'s reads and writes once it's connected
+  std::shared_ptr<RingSocket> ring_;
+
+  // deadlines the client sets, for the TCP connect and for a getheaders
+  // or compact filter reply; these live here so that they go away with the
+  // connection
+  Timer connect_timer_;
+  Timer hdr_timer_;
+  Timer cf_timer_;
 
   // close this connection (e.g. because we have a bad peer)
   void shutdown();
@@ -75,40 +309,208 @@ class Connection {
   // request headers
   void get_headers(const std::vector<hash_t>& locator_hashes,
                    const hash_t& hash_stop = empty_hash);
-  void get_headers(const BlockHeader& start_hdr);
-  void get_data(const Inv& inv);
+  void get_data(const std::vector<Inv>& invs);
   void send_version();
 
+  // Queue a transaction to announce at the peer's next trickle, unless it
+  // knows about it already. Trickles are Poisson timed, as in bitcoind, so
+  // that the peers that hear of a transaction first don't give away where
+  // it came from, and everything queued by then goes in one inv.
+  void announce_tx(const hash_t& txid);
+
+  // Send verack, along with the messages that have to come just before or
+  // after it.
+  void send_verack();
+
+  // request BIP157 basic filter checkpoints, filter headers or filters
+  void get_cfcheckpt(const hash_t& stop_hash);
+  void get_cfheaders(uint32_t start_height, const hash_t& stop_hash);
+  void get_cfilters(uint32_t start_height, const hash_t& stop_hash);
+
+  // switch the peer in or out of BIP152 high bandwidth mode
+  void send_cmpct(bool high_bandwidth);
+
+  // request the transactions of a compact block we couldn't fill in
+  void get_block_txn(const hash_t& block_hash,
+                     const std::vector<uint32_t>& indexes);
+
  private:
   // heartbeat information
   uint64_t ping_nonce_;
-  std::shared_ptr<uvw::TimerHandle> ping_;
-  std::shared_ptr<uvw::TimerHandle> pong_;
-  std::shared_ptr<uvw::TimerHandle> verack_;
-  std::shared_ptr<uvw::TimerHandle> getaddr_;
+  Timer ping_;
+  Timer pong_;
+  Timer verack_;
+  Timer getaddr_;
+
+  // the addresses the peer may still send us, with --addr-rate, and
+  // whether we've answered its getaddr, which only an inbound peer gets,
+  // once
+  TokenBucket addr_bucket_;
+  bool sent_addrs_;
+
+  // Bandwidth shaping, with --max-upload and the like. Limits are kept per
+  // peer here and for all peers in the client. While a send limit is set,
+  // messages wait in a queue for their Traffic class, and flush() moves
+  // them to out_ in class order as the buckets allow, see release_shaped().
+  // Reads pause while the peer's read class can't draw on the receive
+  // buckets, see check_reads().
+  struct ShapedQueue {
+    Encoder data;
+    std::deque<size_t> sizes;  // of each message in data
+  };
+  TokenBucket send_bucket_;
+  TokenBucket recv_bucket_;
+  std::array<ShapedQueue, num_traffic_classes> shaped_;
+  Timer send_wait_;
+  Timer recv_wait_;
+  bool throttled_;
+
+  // is a send limit set?
+  bool shaping() const;
+
+  // the queue for a message with this command, or nullptr without shaping
+  ShapedQueue* shaped_queue(Command type);
+
+  // move queued messages to out_ while the send buckets allow, and wait for
+  // them to refill if some are left
+  void release_shaped();
+
+  // pause reads while the receive buckets are short, and resume them once
+  // they've refilled
+  void check_reads();
+
+  // Decode and handle one message, returning the number of bytes it used,
+  // or 0 if the data doesn't hold a whole message yet.
+  size_t read_message(const char* data, size_t sz);
+
+  // Handle a message that took size bytes and started decoding at start,
+  // or count a frame that didn't decode if msg is null.
+  void dispatch(Message* msg, size_t size,
+                std::chrono::steady_clock::time_point start);
+
+  // Handle the messages in data, up to the per-turn budget, returning the
+  // bytes used; a trailing partial message is copied to buf_.
+  size_t process(const char* data, size_t size);
+
+  // process() for a v2 session: each packet is gathered in buf_, decrypted
+  // there and dispatched by its short id or command.
+  size_t process_v2(const char* data, size_t size);
 
-  // returns true if a message was actually read
-  bool read_message();
+  // size of the (partial) message in buf_, or of its header if that hasn't
+  // been fully read yet
+  size_t buffered_message_size() const;
 
-  // send a message to our peer
+  // queue a message to our peer
   void send_msg(const Message& msg);
 
+  // queue a message that's already encoded, headers and all
+  void send_encoded(const char* data, size_t size);
+  void send_encoded(const std::string& msg) {
+    send_encoded(msg.data(), msg.size());
+  }
+
+  // flush() on the next loop iteration
+  void schedule_flush();
+
+  // write out everything queued by send_msg()
+  void flush();
+
+  // write to whichever socket we have
+  void write(std::unique_ptr<char[]> data, size_t sz);
+  void write(const std::string& data);
+
+  // seal the messages in out_ as v2 packets, emptying it
+  std::string seal_queued();
+
+  // Start reading from the connected tcp_, through the client's Ring if it
+  // has one, which then also reports the errors and the end of the stream
+  // that tcp_'s events would.
+  void start_reading(std::function<void(int code, const char* what)> error,
+                     std::function<void()> end);
+
+  // Once tcp_ is connected, send the CONNECT request if it's to a proxy;
+  // the proxy's answer is read back in read().
+  void proxy_connect();
+
+  // the proxy has connected us to the peer
+  void proxied();
+
+  // a write of this size finished
+  void wrote(size_t sz);
+
+  // stop or resume reading from the peer
+  void pause_reading(bool paused);
+
+  // give an idle peer's read buffers back to the slab pool
+  void shrink_buffers();
+
+  // stop reading while the peer is congested or has a backlog, and resume
+  // once neither holds
+  void set_reading();
+
+  // disconnect on the next loop iteration
+  void drop_later(const char* why);
+
+  // Count a protocol violation against the peer: 100 for something no
+  // honest peer sends (invalid headers, a block that doesn't match its
+  // merkle root), less for what a buggy or lagging one might (a malformed
+  // message, an unsolicited reply). At MISBEHAVIOR_LIMIT it's dropped, and
+  // the client bans its address.
+  void misbehaving(int score, const char* why);
+
+  // hand an addr or addrv2 message's addresses to the client
+  void add_addrs(const std::vector<NetAddr>& addrs);
+
   void handle_addr(AddrMsg* addrs);
+  void handle_addrv2(AddrV2Msg* addrs);
+  void handle_block(Block* block);
+  void handle_blocktxn(BlockTxn* txn);
+  void handle_cfcheckpt(CFCheckpt* checkpt);
+  void handle_cfheaders(CFHeaders* headers);
+  void handle_cfilter(CFilter* filter);
+  void handle_cmpctblock(CmpctBlock* block);
   void handle_getaddr(GetAddr* getaddr);
   void handle_getblocks(GetBlocks* getblocks);
-  void handle_getheaders(GetHeaders* getheaders);
+  void handle_getdata(GetData* getdata);
+  void handle_getcfcheckpt(GetCFCheckpt* req);
+  void handle_getcfheaders(GetCFHeaders* req);
+  void handle_getcfilters(GetCFilters* req);
+  void handle_getheaders(GetHeaders* req);
   void handle_headers(HeadersMsg* headers);
+
+  // Count a headers reply towards header_rate() and byte_rate(), returning
+  // the time since its getheaders.
+  std::chrono::milliseconds finish_getheaders(size_t count, size_t bytes);
+
+  // send a FilterServer reply, or log that we couldn't answer
+  void send_filter_reply(const char* cmd, const ReplyCache::Message& reply);
+
+  // Stream the message buffered in buf_ if it's a big headers message, see
+  // HeadersStream.
+  void maybe_stream_headers();
+
+  // Hand headers_in_'s complete entries to the client, in parts of a few
+  // hundred, and the rest once the message is done.
+  void stream_headers();
   void handle_inv(InvMsg* inv);
   void handle_mempool(Mempool* pool);
+  void handle_merkleblock(MerkleBlock* block);
   void handle_ping(Ping* ping);
   void handle_pong(Pong* pong);
   void handle_reject(Reject* rej);
+  void handle_sendaddrv2(SendAddrV2* send);
+  void handle_sendcmpct(SendCmpct* send);
   void handle_sendheaders(SendHeaders* send);
+  void handle_tx(TxMsg* tx);
   void handle_unknown(const std::string& msg);
   void handle_verack(VerAck* ack);
   void handle_version(Version* ver);
 
   void get_new_addrs();
+
+  // send a ping, which the peer has 5 seconds to answer
+  void send_ping();
+  void trickle();
 };
 }  // namespace spv
 
@@ -19,5 +19,7 @@
 #include "./util.h"
 
 std::ostream &operator<<(std::ostream &o, const spv::hash_t &h) {
-  return o << spv::to_hex(h);
+  char buf[2 * sizeof h];
+  spv::hex_encode(h.data(), h.size(), buf);
+  return o.write(buf, sizeof buf);
 }
@@ -17,6 +17,11 @@
 #pragma once
 
 #include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <ostream>
 
 namespace spv {
 // constants related to message headers
@@ -25,12 +30,16 @@ enum {
   HEADER_SIZE = 24,
   HEADER_LEN_OFFSET = 16,
   HEADER_CHECKSUM_OFFSET = 20,
+
+  // the largest message a peer may send, like MAX_SIZE in Bitcoin Core
+  MAX_MESSAGE_SIZE = 32 << 20,
 };
 
 // netaddr constants
 enum {
   ADDR_SIZE = 16,
   PORT_SIZE = 2,
+  MAX_ADDR_SIZE = 1000,  // max addresses in an addr or addrv2 message
 };
 
 // constants related to version messages
@@ -38,6 +47,78 @@ enum {
   COMMAND_SIZE = 12,
 };
 
+// constants related to block headers
+enum {
+  BLOCK_HEADER_SIZE = 80,  // wire size, not including the tx count
+
+  // The database record for a header: the wire encoding, then a 32-bit
+  // height and a 32-bit flags word, little endian.
+  HEADER_RECORD_SIZE = BLOCK_HEADER_SIZE + 8,
+
+  // A best chain header's record may leave out prev_block, which is the
+  // hash of the header a height below it, and set HEADER_FLAG_COMPACT.
+  COMPACT_RECORD_SIZE = HEADER_RECORD_SIZE - 32,
+  HEADER_FLAG_COMPACT = 1,
+};
+
+// constants related to inventory
+enum {
+  MAX_INV_SIZE = 50000,  // max items in an inv or getdata message
+};
+
+// constants related to bloom filters, see BIP37
+enum {
+  MAX_BLOOM_FILTER_SIZE = 36000,  // bytes
+  MAX_BLOOM_HASH_FUNCS = 50,
+  MAX_FILTERADD_SIZE = 520,  // the largest script push
+
+  // Peers that take filterload set this service bit, except that ones older
+  // than NO_BLOOM_VERSION all do without it.
+  NODE_BLOOM = 1 << 2,
+  NO_BLOOM_VERSION = 70011,
+};
+
+// constants related to compact block filters, see BIP157 and BIP158
+enum {
+  NODE_COMPACT_FILTERS = 1 << 6,
+  BASIC_FILTER = 0,  // the only filter type there is
+  MAX_GETCFILTERS_SIZE = 1000,
+  MAX_GETCFHEADERS_SIZE = 2000,
+
+  // blocks between the filter headers in a cfcheckpt
+  CFCHECKPT_INTERVAL = 1000,
+};
+
+// constants related to compact blocks, see BIP152
+enum {
+  NODE_WITNESS = 1 << 3,
+  CMPCT_VERSION = 2,  // short ids of wtxids, and txs sent with witnesses
+  MIN_CMPCT_VERSION = 70014,  // the lowest protocol version that has it
+  SHORT_ID_SIZE = 6,
+
+  // peers asked to send new blocks as cmpctblock without an inv first
+  MAX_HB_PEERS = 3,
+};
+
+// constants related to addrv2, see BIP155
+enum {
+  // the lowest protocol version that's sent sendaddrv2, as some older
+  // clients drop peers over messages they don't know
+  MIN_ADDRV2_VERSION = 70016,
+};
+
+// constants related to the v2 transport, see BIP324
+enum {
+  NODE_P2P_V2 = 1 << 11,
+};
+
+// constants related to header sync
+enum {
+  NODE_NETWORK = 1 << 0,  // serves the whole chain
+  NODE_NETWORK_LIMITED = 1 << 10,  // the headers and recent blocks (BIP159)
+  MAX_HEADERS_RESULTS = 2000,  // max headers a peer sends per getheaders
+};
+
 typedef std::array<uint8_t, 32> hash_t;
 static_assert(sizeof(hash_t) == 32);
 
@@ -45,15 +126,23 @@ static_assert(sizeof(hash_t) == 32);
 const hash_t empty_hash{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                         0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 
-// the raw testnet genesis block header data
-const std::array<uint8_t, 80> genesis_block_hdr{
-    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x3b, 0xa3, 0xed, 0xfd, 0x7a, 0x7b, 0x12, 0xb2, 0x7a, 0xc7, 0x2c, 0x3e,
-    0x67, 0x76, 0x8f, 0x61, 0x7f, 0xc8, 0x1b, 0xc3, 0x88, 0x8a, 0x51, 0x32,
-    0x3a, 0x9f, 0xb8, 0xaa, 0x4b, 0x1e, 0x5e, 0x4a, 0xda, 0xe5, 0x49, 0x4d,
-    0xff, 0xff, 0x00, 0x1d, 0x1a, 0xa4, 0xae, 0x18};
+// Is the wire's little-endian layout the host's? Then fixed-size records
+// can be copied whole, rather than converted a field at a time.
+static constexpr bool host_is_wire_order =
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+
+// Copy 32 bytes reversed, e.g. a hash between the wire's byte order and the
+// display order hash_t keeps. This is four byte-swapped words rather than
+// a loop over bytes. in and out may be the same but mustn't otherwise
+// overlap.
+inline void reverse_hash(const void *in, void *out) {
+  uint64_t words[4], swapped[4];
+  std::memcpy(words, in, sizeof words);
+  for (int i = 0; i < 4; i++) {
+    swapped[i] = __builtin_bswap64(words[3 - i]);
+  }
+  std::memcpy(out, swapped, sizeof swapped);
+}
 }  // namespace spv
 
 std::ostream &operator<<(std::ostream &o, const spv::hash_t &h);
@@ -62,11 +151,10 @@ namespace std {
 template <>
 struct hash<spv::hash_t> {
   std::size_t operator()(const spv::hash_t &input) const noexcept {
-    std::size_t h = 0;
-    const size_t *data = reinterpret_cast<const size_t *>(input.data());
-    for (size_t i = 0; i < sizeof(spv::hash_t) / sizeof(size_t); i++) {
-      h |= std::hash<size_t>{}(*(data + i));
-    }
+    // N.B. or-ing the words together would push every bit towards one; the
+    // low-order word of a digest is already uniformly distributed
+    std::size_t h;
+    std::memcpy(&h, input.data() + sizeof(spv::hash_t) - sizeof h, sizeof h);
     return h;
   }
 };
@@ -0,0 +1,81 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./control_server.h"
+
+#include <cstring>
+
+#include "./logging.h"
+#include "./unix_socket.h"
+
+namespace spv {
+MODULE_LOGGER
+
+// a connection that doesn't send a newline within this much is closed
+static const size_t max_line = 4096;
+
+ControlServer::ControlServer(std::shared_ptr<uvw::Loop> loop,
+                             Handler &&handler)
+    : loop_(loop), handler_(std::move(handler)) {}
+
+bool ControlServer::listen(const std::string &path) {
+  listener_ = listen_unix(*loop_, path, "control commands",
+                          [this](uvw::PipeHandle &server) { accept(server); });
+  if (!listener_) {
+    return false;
+  }
+  path_ = path;
+  log->info("taking control commands on {}", path);
+  return true;
+}
+
+void ControlServer::close() { close_unix(listener_, path_); }
+
+void ControlServer::accept(uvw::PipeHandle &server) {
+  auto pipe = loop_->resource<uvw::PipeHandle>();
+  server.accept(*pipe);
+  auto partial = std::make_shared<std::string>();
+  pipe->once<uvw::ErrorEvent>([](const auto &, auto &pipe) { pipe.close(); });
+  pipe->once<uvw::EndEvent>([](const auto &, auto &pipe) { pipe.close(); });
+  pipe->on<uvw::DataEvent>([this, partial](const auto &data, auto &pipe) {
+    partial->append(data.data.get(), data.length);
+    std::string out;
+    size_t start = 0;
+    for (size_t nl; (nl = partial->find('\n', start)) != std::string::npos;
+         start = nl + 1) {
+      std::string line = partial->substr(start, nl - start);
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      if (!line.empty()) {
+        out += handler_(line);
+        out += '\n';
+      }
+    }
+    partial->erase(0, start);
+    if (!out.empty()) {
+      std::unique_ptr<char[]> buf(new char[out.size()]);
+      std::memcpy(buf.get(), out.data(), out.size());
+      pipe.write(std::move(buf), out.size());
+    }
+    if (partial->size() > max_line) {
+      pipe.close();
+    }
+  });
+  pipe->read();
+}
+}  // namespace spv
@@ -0,0 +1,57 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "./uvw.h"
+
+namespace spv {
+// Takes tuning commands on a Unix socket, on the client's loop, so that
+// settings that would otherwise need a restart can be changed without
+// losing the warm caches and connections. Commands are lines of words,
+// e.g. "set max-connections 16" or "db max_write_buffer_number 4", and
+// each is answered in order with one line of JSON from the handler. A
+// client may send as many as it likes on one connection.
+class ControlServer {
+ public:
+  // the JSON answer to one command line, without its newline
+  typedef std::function<std::string(const std::string &line)> Handler;
+
+  ControlServer(std::shared_ptr<uvw::Loop> loop, Handler &&handler);
+  ControlServer(const ControlServer &other) = delete;
+  ~ControlServer() { close(); }
+
+  // Listen at path, replacing a socket left there by an earlier run; false
+  // if something else is there, see listen_unix().
+  bool listen(const std::string &path);
+
+  // stop listening and remove the socket
+  void close();
+
+ private:
+  std::shared_ptr<uvw::Loop> loop_;
+  Handler handler_;
+  std::shared_ptr<uvw::PipeHandle> listener_;
+  std::string path_;
+
+  void accept(uvw::PipeHandle &server);
+};
+}  // namespace spv
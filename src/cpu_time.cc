@@ -0,0 +1,77 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./cpu_time.h"
+
+#include <time.h>
+
+#include <atomic>
+
+namespace spv {
+uint64_t thread_cpu_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+const char *cpu_tag_name(CpuTag tag) {
+  switch (tag) {
+    case CpuTag::OTHER:
+      return "other";
+    case CpuTag::NETWORK:
+      return "network";
+    case CpuTag::DECODING:
+      return "decoding";
+    case CpuTag::HASHING:
+      return "hashing";
+    case CpuTag::STORAGE:
+      return "storage";
+    case CpuTag::LOGGING:
+      return "logging";
+    case CpuTag::TIMERS:
+      return "timers";
+    case CpuTag::NUM_TAGS:
+      break;
+  }
+  return "unknown";
+}
+
+#ifdef SPV_CPU_ACCOUNTING
+thread_local CpuTag current_cpu_tag = CpuTag::OTHER;
+
+namespace {
+std::atomic<uint64_t> cpu_ns[size_t(CpuTag::NUM_TAGS)];
+
+// the thread's CPU clock at its last switch, or 0 before its first, whose
+// time until then isn't charged to anything
+thread_local uint64_t last_switch = 0;
+}  // namespace
+
+void switch_cpu_tag(CpuTag tag) {
+  const uint64_t now = thread_cpu_ns();
+  if (last_switch) {
+    cpu_ns[size_t(current_cpu_tag)].fetch_add(now - last_switch,
+                                              std::memory_order_relaxed);
+  }
+  last_switch = now;
+  current_cpu_tag = tag;
+}
+
+uint64_t cpu_usage(CpuTag tag) {
+  return cpu_ns[size_t(tag)].load(std::memory_order_relaxed);
+}
+#endif
+}  // namespace spv
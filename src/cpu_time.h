@@ -0,0 +1,81 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstdint>
+
+#include "./config.h"
+
+namespace spv {
+// the CPU time the calling thread has used, in nanoseconds
+uint64_t thread_cpu_ns();
+
+// With --enable-cpu-accounting, the thread's CPU clock is sampled at the
+// boundaries of each CpuScope and the time in between is charged to the
+// innermost scope's tag, so a tag's total doesn't include the scopes nested
+// in it; time outside any scope goes to OTHER. Reported as
+// spv_cpu_seconds_total. Each boundary is a clock_gettime() system call,
+// since the thread CPU clock isn't served from the vDSO, so the scopes go
+// around whole messages and batches rather than single hashes.
+enum class CpuTag : uint8_t {
+  OTHER,
+  NETWORK,   // socket reads and message dispatch
+  DECODING,  // decoding messages
+  HASHING,   // header, merkle and checksum hashing
+  STORAGE,   // inserting headers, RocksDB reads and batch commits
+  LOGGING,   // the log sink and its writer thread
+  TIMERS,    // expiring timer wheels
+  NUM_TAGS,
+};
+
+const char *cpu_tag_name(CpuTag tag);
+
+#ifdef SPV_CPU_ACCOUNTING
+static const bool cpu_accounting = true;
+
+extern thread_local CpuTag current_cpu_tag;
+
+// Charge the CPU time since the thread's last switch to the current tag,
+// and make tag the current one.
+void switch_cpu_tag(CpuTag tag);
+
+// CPU nanoseconds charged to this tag, across all threads
+uint64_t cpu_usage(CpuTag tag);
+
+class CpuScope {
+ public:
+  explicit CpuScope(CpuTag tag) : prev_(current_cpu_tag) {
+    switch_cpu_tag(tag);
+  }
+  CpuScope(const CpuScope &other) = delete;
+  ~CpuScope() { switch_cpu_tag(prev_); }
+
+ private:
+  const CpuTag prev_;
+};
+#else
+static const bool cpu_accounting = false;
+
+inline uint64_t cpu_usage(CpuTag) { return 0; }
+
+class CpuScope {
+ public:
+  explicit CpuScope(CpuTag) {}
+  CpuScope(const CpuScope &other) = delete;
+};
+#endif
+}  // namespace spv
@@ -16,38 +16,24 @@
 
 #include "./decoder.h"
 
+#include <cstring>
+
 #include "./logging.h"
 
 namespace spv {
 MODULE_LOGGER
 
-bool Decoder::validate_msg(const Message *msg) const {
-  if (msg == nullptr) {
-    return false;
-  }
-  if (off_ != cap_) {
-    log->warn("failed to pull enough bytes");
-    return false;
-  }
-  uint32_t cksum = checksum(data_, cap_);
-  if (cksum != msg->headers.checksum) {
-    log->warn("invalid checksum!");
-    return false;
-  }
-  return true;
-}
-
 void Decoder::pull(Headers &headers) {
   std::array<char, COMMAND_SIZE> cmd_buf{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
   pull(headers.magic);
-  if (headers.magic != PROTOCOL_MAGIC) {
+  if (headers.magic != network().magic) {
     log->warn("peer sent wrong magic bytes");
   }
   pull_buf(cmd_buf.data(), COMMAND_SIZE);
-  if (cmd_buf[COMMAND_SIZE - 1] != '\0') {
-    throw BadMessage("command is not null terminated");
-  }
-  headers.command = cmd_buf.data();
+  // a twelve character command (e.g. getcfcheckpt) fills the whole field
+  headers.type = to_command(load_command_key(cmd_buf.data()));
+  headers.command.assign(cmd_buf.data(),
+                         strnlen(cmd_buf.data(), COMMAND_SIZE));
   pull(headers.payload_size);
   pull(headers.checksum);
 }
@@ -15,6 +15,7 @@
 // SPV. If not, see <http://www.gnu.org/licenses/>.
 
 #include <cassert>
+#include <cstring>
 #include <sstream>
 #include <stdexcept>
 
@@ -39,6 +40,80 @@ struct BadMessage : DecodeError {
   BadMessage(const std::string &why) : DecodeError(why) {}
 };
 
+// What Decoder::reserve() found; unlike the pull methods it doesn't throw.
+enum class DecodeStatus {
+  OK,
+  TRUNCATED,  // fewer bytes left than were asked for
+};
+
+// The longest a varint can be: a prefix byte and then a uint64_t.
+static const size_t MAX_VARINT_SIZE = 9;
+
+// Decode the varint at p, which must have MAX_VARINT_SIZE bytes readable,
+// returning how many bytes it took. Every prefix above 0xfc reads the same
+// 8 bytes and then masks off what isn't its, so there's one branch, not four.
+inline size_t load_varint(const char *p, uint64_t &out) {
+  const uint8_t prefix = static_cast<uint8_t>(*p);
+  if (prefix < 0xfd) {
+    out = prefix;
+    return 1;
+  }
+  uint64_t val;
+  std::memcpy(&val, p + 1, sizeof val);
+  val = le64toh(val);
+  const unsigned width = 1u << (prefix - 0xfc);  // 2, 4 or 8 bytes
+  out = width == sizeof val ? val : val & ((uint64_t(1) << 8 * width) - 1);
+  return 1 + width;
+}
+
+// An unchecked cursor over bytes that Decoder::reserve() has already
+// bounds-checked, for runs of fixed-size fields such as the entries of an
+// addr or inv message. The loads are memcpy into a register, which compile
+// to plain moves, so a run costs one check rather than one per field.
+struct Cursor {
+  const char *pos;
+
+  explicit Cursor(const char *pos = nullptr) : pos(pos) {}
+
+  inline void skip(size_t sz) { pos += sz; }
+
+  inline uint16_t u16_be() { return be16toh(load<uint16_t>()); }
+  inline uint16_t u16() { return le16toh(load<uint16_t>()); }
+  inline uint32_t u32() { return le32toh(load<uint32_t>()); }
+  inline uint64_t u64() { return le64toh(load<uint64_t>()); }
+
+  // in display order, reversed from the wire
+  inline void hash(hash_t &out) {
+    reverse_hash(pos, out.data());
+    pos += sizeof out;
+  }
+
+  // 18 bytes: the address and the port, in network byte order
+  inline void addr(Addr &out) {
+    addrbuf_t buf;
+    std::memcpy(buf.data(), pos, ADDR_SIZE);
+    pos += ADDR_SIZE;
+    out.set_addr(buf);
+    out.set_port(u16_be());
+  }
+
+  // 30 bytes, as in addr messages
+  inline void net_addr(NetAddr &out) {
+    out.time = u32();
+    out.services = u64();
+    addr(out.addr);
+  }
+
+ private:
+  template <typename T>
+  inline T load() {
+    T val;
+    std::memcpy(&val, pos, sizeof val);
+    pos += sizeof val;
+    return val;
+  }
+};
+
 struct Decoder {
   const char *data_;
   size_t cap_;
@@ -55,7 +130,27 @@ struct Decoder {
 
   inline size_t bytes_remaining() { return cap_ - off_; }
 
-  bool validate_msg(const Message *msg) const;
+  inline void skip(size_t sz) {
+    if (sz > bytes_remaining()) {
+      std::ostringstream os;
+      os << "failed to skip " << sz << " bytes, offset = " << off_
+         << ", capacity = " << cap_;
+      throw IncompleteParse(os.str());
+    }
+    off_ += sz;
+  }
+
+  // Take the next sz bytes to read with an unchecked Cursor, e.g. count *
+  // 36 for the entries of an inv message, checking the bounds just once.
+  // Returns TRUNCATED, and doesn't move, if there aren't that many left.
+  inline DecodeStatus reserve(size_t sz, Cursor &cur) {
+    if (sz > bytes_remaining()) {
+      return DecodeStatus::TRUNCATED;
+    }
+    cur.pos = data_ + off_;
+    off_ += sz;
+    return DecodeStatus::OK;
+  }
 
   inline void pull_buf(void *out, size_t sz) {
     if (sz + off_ > cap_) {
@@ -64,11 +159,17 @@ struct Decoder {
          << ", capacity = " << cap_;
       throw IncompleteParse(os.str());
     }
-    std::memmove(out, data_ + off_, sz);
+    std::memcpy(out, data_ + off_, sz);
     off_ += sz;
   }
 
+  // Near the end of the data there might not be MAX_VARINT_SIZE bytes to
+  // read, so that falls back to checking each field.
   inline void pull_varint(uint64_t &out) {
+    if (bytes_remaining() >= MAX_VARINT_SIZE) {
+      off_ += load_varint(data_ + off_, out);
+      return;
+    }
     uint8_t prefix;
     pull(prefix);
     if (prefix < 0xfd) {
@@ -95,6 +196,31 @@ struct Decoder {
     assert(false);  // not reached
   }
 
+  // Pull the count that starts a list, which mustn't be more than max.
+  inline size_t pull_count(size_t max, const char *what) {
+    uint64_t count;
+    pull_varint(count);
+    if (count > max) {
+      std::ostringstream os;
+      os << what << " count " << count << " is too large, ignoring";
+      throw BadMessage(os.str());
+    }
+    return count;
+  }
+
+  // Pull the count of a list of entry_size byte entries and reserve() them
+  // all for cur, as in addr and inv messages.
+  inline size_t pull_entries(size_t max, size_t entry_size, Cursor &cur,
+                             const char *what) {
+    const size_t count = pull_count(max, what);
+    if (reserve(count * entry_size, cur) != DecodeStatus::OK) {
+      std::ostringstream os;
+      os << what << " entries are truncated";
+      throw IncompleteParse(os.str());
+    }
+    return count;
+  }
+
   void pull(uint8_t &out) { pull_buf(&out, sizeof out); }
 
   void pull(uint16_t &out) {
@@ -137,15 +263,17 @@ struct Decoder {
       os << "string size " << sz << " exceeds valid range";
       throw BadMessage(os.str());
     }
-    out.append(data_ + off_, sz);
+    if (sz > bytes_remaining()) {
+      throw IncompleteParse("string is truncated");
+    }
+    out.assign(data_ + off_, sz);
     off_ += sz;
   }
 
   void pull(Headers &headers);
 
   void pull(Addr &addr) {
-    // TODO: need to actually use addr_buf
-    addrbuf_t addr_buf{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    addrbuf_t addr_buf;
     pull_buf(addr_buf.data(), ADDR_SIZE);
     addr.set_addr(addr_buf);
 
@@ -168,17 +296,21 @@ struct Decoder {
 
   void pull(hash_t &hash) {
     pull_buf(hash.data(), sizeof hash);
-    std::reverse(hash.begin(), hash.end());
+    reverse_hash(hash.data(), hash.data());
+  }
+
+  // pull the header fields without hashing them
+  void pull_fields(BlockHeader &hdr) {
+    if (BLOCK_HEADER_SIZE > bytes_remaining()) {
+      throw IncompleteParse("block header is truncated");
+    }
+    hdr.unpack(data_ + off_);
+    off_ += BLOCK_HEADER_SIZE;
   }
 
   void pull(BlockHeader &hdr, bool pull_tx = true) {
     size_t start = off_;
-    pull(hdr.version);
-    pull(hdr.prev_block);
-    pull(hdr.merkle_root);
-    pull(hdr.timestamp);
-    pull(hdr.difficulty);
-    pull(hdr.nonce);
+    pull_fields(hdr);
 
     // calculate the hash of this block
     hdr.block_hash = pow_hash(data_ + start, off_ - start, true);
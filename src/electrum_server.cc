@@ -0,0 +1,423 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./electrum_server.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "./config.h"
+#include "./json.h"
+#include "./logging.h"
+#include "./util.h"
+
+namespace spv {
+MODULE_LOGGER
+
+static const size_t max_sessions = 64;
+static const size_t max_line_size = 64 << 10;
+static const size_t max_subscriptions = 20000;
+
+// A session that sends requests faster than it reads the answers is
+// disconnected once this much is waiting to be written to it.
+static const size_t max_queued_bytes = 16 << 20;
+
+// the most headers blockchain.block.headers returns, as ElectrumX does
+static const size_t max_headers = 2016;
+
+static const char protocol_version[] = "1.4";
+
+static void append_hex(const void *data, size_t size, std::string &out) {
+  const size_t start = out.size();
+  out.resize(start + 2 * size);
+  hex_encode(data, size, &out[start]);
+}
+
+static void append_hash(const hash_t &hash, std::string &out) {
+  out += '"';
+  append_hex(hash.data(), hash.size(), out);
+  out += '"';
+}
+
+ElectrumServer::ElectrumServer(std::shared_ptr<uvw::Loop> loop,
+                               const Chain &chain, TipFeed &feed,
+                               const ScriptIndex &scripts)
+    : loop_(loop),
+      chain_(chain),
+      feed_(feed),
+      scripts_(scripts),
+      feed_id_(0),
+      announced_(empty_hash) {}
+
+void ElectrumServer::listen(const std::string &host, uint16_t port) {
+  listener_ = loop_->resource<uvw::TcpHandle>();
+  listener_->on<uvw::ErrorEvent>([](const auto &exc, auto &) {
+    log->error("error serving electrum: {}", exc.what());
+  });
+  listener_->on<uvw::ListenEvent>(
+      [this](const auto &, auto &server) { accept(server); });
+  if (host.find(':') != std::string::npos) {
+    listener_->bind<uvw::IPv6>(host, port);
+  } else {
+    listener_->bind<uvw::IPv4>(host, port);
+  }
+  listener_->listen();
+  announced_ = chain_.tip().block_hash;
+  feed_id_ = feed_.subscribe([this](const TipEvent &) { schedule_pump(); });
+  log->info("serving electrum on {} port {}", host, port);
+}
+
+void ElectrumServer::close() {
+  if (!listener_) {
+    return;
+  }
+  feed_.unsubscribe(feed_id_);
+  listener_->close();
+  listener_.reset();
+  if (pump_) {
+    pump_->close();
+    pump_.reset();
+  }
+  for (auto &session : sessions_) {
+    session->tcp->close();
+  }
+  sessions_.clear();
+}
+
+void ElectrumServer::accept(uvw::TcpHandle &server) {
+  auto tcp = loop_->resource<uvw::TcpHandle>();
+  server.accept(*tcp);
+  if (sessions_.size() >= max_sessions) {
+    tcp->close();
+    return;
+  }
+  tcp->noDelay(true);
+  auto session = std::make_shared<Session>();
+  session->tcp = tcp;
+  session->queued = 0;
+  session->headers = false;
+  sessions_.push_back(session);
+
+  Session *raw = session.get();
+  tcp->once<uvw::ErrorEvent>([this, raw](const auto &, auto &) { drop(raw); });
+  tcp->once<uvw::EndEvent>([this, raw](const auto &, auto &) { drop(raw); });
+  tcp->on<uvw::WriteEvent>([raw](const auto &, auto &) {
+    raw->queued -= raw->writes.front();
+    raw->writes.pop_front();
+  });
+  tcp->on<uvw::DataEvent>([this, raw](const auto &data, auto &) {
+    std::string out;
+    if (!read(*raw, data.data.get(), data.length, out) ||
+        (!out.empty() && !send(*raw, out))) {
+      drop(raw);
+    }
+  });
+  tcp->read();
+}
+
+void ElectrumServer::drop(Session *session) {
+  auto it =
+      std::find_if(sessions_.begin(), sessions_.end(),
+                   [session](const auto &s) { return s.get() == session; });
+  if (it == sessions_.end()) {
+    return;
+  }
+  // closing cancels the writes in flight, so no WriteEvent can see session
+  (*it)->tcp->close();
+  sessions_.erase(it);
+}
+
+bool ElectrumServer::read(Session &session, const char *data, size_t len,
+                          std::string &out) {
+  session.partial.append(data, len);
+  size_t start = 0;
+  for (size_t nl; (nl = session.partial.find('\n', start)) != std::string::npos;
+       start = nl + 1) {
+    handle(session, session.partial.substr(start, nl - start), out);
+  }
+  session.partial.erase(0, start);
+  if (session.partial.size() > max_line_size) {
+    log->warn("closing an electrum session with a {} byte request",
+              session.partial.size());
+    return false;
+  }
+  return true;
+}
+
+void ElectrumServer::handle(Session &session, const std::string &line,
+                            std::string &out) {
+  JsonCursor cur(line.data(), line.size());
+  if (cur.done()) {
+    return;
+  }
+  const bool batch = cur.eat('[');
+  if (batch) {
+    out += '[';
+  }
+  bool first = true;
+  do {
+    JsonRequest req;
+    if (!parse_json_request(cur, req)) {
+      if (!first) {
+        out += ',';
+      }
+      out += "{\"jsonrpc\":\"2.0\",\"error\":{\"code\":" +
+             std::to_string(RPC_PARSE_ERROR) +
+             ",\"message\":\"parse error\"},\"id\":null}";
+      break;
+    }
+    if (!first) {
+      out += ',';
+    }
+    first = false;
+    int error = 0;
+    const std::string result = call(session, req, error);
+    out += "{\"jsonrpc\":\"2.0\",";
+    if (error) {
+      out += "\"error\":{\"code\":" + std::to_string(error) +
+             ",\"message\":\"" + result + "\"}";
+    } else {
+      out += "\"result\":" + result;
+    }
+    out += ",\"id\":" + req.id + "}";
+  } while (batch && cur.eat(','));
+  if (batch) {
+    out += ']';
+  }
+  out += '\n';
+}
+
+bool ElectrumServer::header_json(size_t height, std::string &out) const {
+  const IndexEntry *entry = chain_.best_entry(height);
+  if (entry == nullptr) {
+    return false;
+  }
+  out += "{\"height\":" + std::to_string(height) + ",\"hex\":\"";
+  append_hex(entry->data.data(), entry->data.size(), out);
+  out += "\"}";
+  return true;
+}
+
+std::string ElectrumServer::call(Session &session, const JsonRequest &req,
+                                 int &error) {
+  const std::string &m = req.method;
+  const auto &params = req.params;
+  std::string out;
+
+  // the script hash in the first param
+  hash_t sh;
+  const bool scripthash = m.compare(0, 21, "blockchain.scripthash") == 0;
+  if (scripthash && !req.hex32_param(0, sh.data())) {
+    error = RPC_INVALID_PARAMS;
+    return "expected a script hash";
+  }
+
+  if (m == "server.version") {
+    return "[\"" PACKAGE_STRING "\",\"" + std::string(protocol_version) +
+           "\"]";
+  } else if (m == "server.banner") {
+    return "\"" PACKAGE_STRING "\"";
+  } else if (m == "server.ping") {
+    return "null";
+  } else if (m == "blockchain.headers.subscribe") {
+    session.headers = true;
+    if (!header_json(chain_.height(), out)) {
+      error = RPC_INVALID_REQUEST;
+      return "no headers yet";
+    }
+    return out;
+  } else if (m == "blockchain.block.header") {
+    size_t height, cp_height = 0;
+    if (!req.size_param(0, height) ||
+        (params.size() > 1 && !req.size_param(1, cp_height))) {
+      error = RPC_INVALID_PARAMS;
+      return "expected a height";
+    }
+    if (cp_height != 0) {
+      error = RPC_INVALID_PARAMS;
+      return "checkpoint proofs aren't supported";
+    }
+    const IndexEntry *entry = chain_.best_entry(height);
+    if (entry == nullptr) {
+      error = RPC_INVALID_PARAMS;
+      return "height out of range";
+    }
+    out += '"';
+    append_hex(entry->data.data(), entry->data.size(), out);
+    out += '"';
+    return out;
+  } else if (m == "blockchain.block.headers") {
+    size_t start, count, cp_height = 0;
+    if (!req.size_param(0, start) || !req.size_param(1, count) ||
+        (params.size() > 2 && !req.size_param(2, cp_height))) {
+      error = RPC_INVALID_PARAMS;
+      return "expected a height and a count";
+    }
+    if (cp_height != 0) {
+      error = RPC_INVALID_PARAMS;
+      return "checkpoint proofs aren't supported";
+    }
+    const size_t tip = chain_.height();
+    count = start > tip ? 0 : std::min({count, max_headers, tip - start + 1});
+    out.reserve(64 + count * 2 * BLOCK_HEADER_SIZE);
+    out += "{\"count\":" + std::to_string(count) + ",\"hex\":\"";
+    for (size_t i = 0; i < count; i++) {
+      const IndexEntry *entry = chain_.best_entry(start + i);
+      assert(entry != nullptr);
+      append_hex(entry->data.data(), entry->data.size(), out);
+    }
+    out += "\",\"max\":" + std::to_string(max_headers) + "}";
+    return out;
+  } else if (m == "blockchain.scripthash.subscribe") {
+    if (session.scripts.size() >= max_subscriptions &&
+        !session.scripts.count(sh)) {
+      error = RPC_INVALID_REQUEST;
+      return "too many subscriptions";
+    }
+    session.scripts.insert(sh);
+    hash_t status;
+    if (!scripts_.status(sh, status)) {
+      return "null";
+    }
+    append_hash(status, out);
+    return out;
+  } else if (m == "blockchain.scripthash.unsubscribe") {
+    return session.scripts.erase(sh) ? "true" : "false";
+  }
+
+  const ScriptIndex::Entry *entry = scripthash ? scripts_.find(sh) : nullptr;
+  if (m == "blockchain.scripthash.get_history" ||
+      m == "blockchain.scripthash.get_mempool") {
+    const bool mempool = m == "blockchain.scripthash.get_mempool";
+    out += '[';
+    if (entry != nullptr) {
+      for (const auto &item : entry->history) {
+        if (mempool && item.height) {
+          continue;
+        }
+        if (out.size() > 1) {
+          out += ',';
+        }
+        out += "{\"height\":" + std::to_string(item.height) + ",\"tx_hash\":";
+        append_hash(item.txid, out);
+        out += '}';
+      }
+    }
+    out += ']';
+    return out;
+  } else if (m == "blockchain.scripthash.get_balance") {
+    uint64_t confirmed = 0, unconfirmed = 0;
+    if (entry != nullptr) {
+      for (const auto &utxo : entry->utxos) {
+        (utxo.height ? confirmed : unconfirmed) += utxo.value;
+      }
+    }
+    return "{\"confirmed\":" + std::to_string(confirmed) +
+           ",\"unconfirmed\":" + std::to_string(unconfirmed) + "}";
+  } else if (m == "blockchain.scripthash.listunspent") {
+    out += '[';
+    if (entry != nullptr) {
+      for (const auto &utxo : entry->utxos) {
+        if (out.size() > 1) {
+          out += ',';
+        }
+        out += "{\"height\":" + std::to_string(utxo.height) + ",\"tx_hash\":";
+        append_hash(utxo.outpoint.hash, out);
+        out += ",\"tx_pos\":" + std::to_string(utxo.outpoint.index) +
+               ",\"value\":" + std::to_string(utxo.value) + "}";
+      }
+    }
+    out += ']';
+    return out;
+  }
+  error = RPC_METHOD_NOT_FOUND;
+  return "unknown method";
+}
+
+bool ElectrumServer::send(Session &session, const std::string &out) {
+  if (session.queued + out.size() > max_queued_bytes) {
+    log->warn("closing an electrum session that isn't reading its answers");
+    return false;
+  }
+  std::unique_ptr<char[]> buf(new char[out.size()]);
+  std::memcpy(buf.get(), out.data(), out.size());
+  session.writes.push_back(out.size());
+  session.queued += out.size();
+  session.tcp->write(std::move(buf), out.size());
+  return true;
+}
+
+void ElectrumServer::notify_script(const hash_t &script_hash) {
+  std::string note;
+  // a session that can't take it is dropped, so go over a copy
+  const std::vector<std::shared_ptr<Session> > sessions(sessions_);
+  for (const auto &session : sessions) {
+    if (!session->scripts.count(script_hash)) {
+      continue;
+    }
+    if (note.empty()) {
+      hash_t status;
+      note = "{\"jsonrpc\":\"2.0\",\"method\":"
+             "\"blockchain.scripthash.subscribe\",\"params\":[";
+      append_hash(script_hash, note);
+      note += ',';
+      if (scripts_.status(script_hash, status)) {
+        append_hash(status, note);
+      } else {
+        note += "null";
+      }
+      note += "]}\n";
+    }
+    if (!send(*session, note)) {
+      drop(session.get());
+    }
+  }
+}
+
+void ElectrumServer::schedule_pump() {
+  if (!pump_) {
+    pump_ = loop_->resource<uvw::IdleHandle>();
+    pump_->on<uvw::IdleEvent>([this](const auto &, auto &idle) {
+      idle.stop();
+      announce_tip();
+    });
+  }
+  if (!pump_->active()) {
+    pump_->start();
+  }
+}
+
+void ElectrumServer::announce_tip() {
+  if (chain_.tip().block_hash == announced_) {
+    return;
+  }
+  announced_ = chain_.tip().block_hash;
+  std::string note =
+      "{\"jsonrpc\":\"2.0\",\"method\":\"blockchain.headers.subscribe\","
+      "\"params\":[";
+  if (!header_json(chain_.height(), note)) {
+    return;
+  }
+  note += "]}\n";
+  const std::vector<std::shared_ptr<Session> > sessions(sessions_);
+  for (const auto &session : sessions) {
+    if (session->headers && !send(*session, note)) {
+      drop(session.get());
+    }
+  }
+}
+}  // namespace spv
@@ -0,0 +1,110 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "./chain.h"
+#include "./hashmap.h"
+#include "./json.h"
+#include "./script_index.h"
+#include "./tip_feed.h"
+#include "./uvw.h"
+
+namespace spv {
+// Speaks enough of the Electrum protocol (1.4) over TCP, on the client's
+// loop, for wallets to follow the chain and the watched scripts without an
+// ElectrumX in between. Requests are JSON-RPC objects, one per line or
+// several in a batch array, and may be pipelined: the answers to whatever
+// arrived in one read go out in one write, in order. The methods are
+//
+//   server.version, server.banner, server.ping
+//   blockchain.headers.subscribe
+//   blockchain.block.header, blockchain.block.headers (without checkpoint
+//     proofs, so cp_height must be 0)
+//   blockchain.scripthash.subscribe, .unsubscribe, .get_history,
+//     .get_mempool, .get_balance, .listunspent
+//
+// Headers are hex encoded straight from the in-memory index into the
+// response, and script histories come from ScriptIndex, so a script that
+// isn't watched just has none. A run of new tips is announced once, with
+// each notification serialized once for all its subscribers.
+class ElectrumServer {
+ public:
+  ElectrumServer(std::shared_ptr<uvw::Loop> loop, const Chain &chain,
+                 TipFeed &feed, const ScriptIndex &scripts);
+  ElectrumServer(const ElectrumServer &other) = delete;
+  ~ElectrumServer() { close(); }
+
+  void listen(const std::string &host, uint16_t port);
+
+  // stop listening and disconnect everyone
+  void close();
+
+  // the script's history changed, so tell its subscribers
+  void notify_script(const hash_t &script_hash);
+
+ private:
+  struct Session {
+    std::shared_ptr<uvw::TcpHandle> tcp;
+    std::string partial;        // a request line that isn't complete yet
+    std::deque<size_t> writes;  // sizes of the writes still in flight
+    size_t queued;              // their total
+    bool headers;               // subscribed to new tips
+    std::unordered_set<hash_t, BlockHashHasher> scripts;
+  };
+
+  std::shared_ptr<uvw::Loop> loop_;
+  const Chain &chain_;
+  TipFeed &feed_;
+  const ScriptIndex &scripts_;
+  size_t feed_id_;
+  std::shared_ptr<uvw::TcpHandle> listener_;
+  std::shared_ptr<uvw::IdleHandle> pump_;
+  std::vector<std::shared_ptr<Session> > sessions_;
+  hash_t announced_;  // the last tip sent to the subscribers
+
+  void accept(uvw::TcpHandle &server);
+  void drop(Session *session);
+
+  // Answer the complete lines in data, appending to out. Returns false if
+  // the session should be dropped.
+  bool read(Session &session, const char *data, size_t len, std::string &out);
+
+  // answer one line, a request or a batch of them
+  void handle(Session &session, const std::string &line, std::string &out);
+
+  // the result of a request, as JSON, or an error with its code set
+  std::string call(Session &session, const JsonRequest &req, int &error);
+
+  // write out, or return false if too much is waiting already
+  bool send(Session &session, const std::string &out);
+
+  // {"height": ..., "hex": ...} for the header at height, or false
+  bool header_json(size_t height, std::string &out) const;
+
+  // announce the tip on the next loop iteration
+  void schedule_pump();
+  void announce_tip();
+};
+}  // namespace spv
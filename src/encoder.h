@@ -20,15 +20,42 @@
 #include "./fields.h"
 #include "./pow.h"
 
+#include <cstring>
 #include <memory>
 
 namespace spv {
+// the number of bytes push_varint(val) writes
+inline size_t varint_size(uint64_t val) {
+  return val < 0xfd ? 1 : val <= 0xffff ? 3 : val <= 0xffffffff ? 5 : 9;
+}
+
+// Write val as a varint at out, which must have room for 9 bytes, returning
+// how many of them it used. The value is always stored as 8 bytes and the
+// length decides how many are kept.
+inline size_t store_varint(uint64_t val, char *out) {
+  if (val < 0xfd) {
+    out[0] = static_cast<char>(val);
+    return 1;
+  }
+  const size_t sz = varint_size(val);
+  out[0] = static_cast<char>(sz == 3 ? 0xfd : sz == 5 ? 0xfe : 0xff);
+  const uint64_t le_val = htole64(val);
+  std::memcpy(out + 1, &le_val, sizeof le_val);
+  return sz;
+}
+
 class Encoder : public Buffer {
  public:
   Encoder() : Buffer() {}
   Encoder(const Encoder &other) = delete;
   explicit Encoder(const Headers &headers) : Buffer() { push(headers); }
 
+  // For a message whose total encoded size is known up front, so that the
+  // buffer is allocated exactly once.
+  Encoder(const Headers &headers, size_t size) : Buffer(size) {
+    push(headers);
+  }
+
   template <typename T>
   void push_int(T val) {
     push(val);
@@ -61,6 +88,11 @@ class Encoder : public Buffer {
 
   void push(InvType inv) { push(static_cast<uint32_t>(inv)); }
 
+  void push(const Inv &inv) {
+    push(inv.type);
+    push(inv.hash);
+  }
+
   void push(const Addr &addr) {
     addrbuf_t buf;
     addr.encode_addrbuf(buf);
@@ -80,20 +112,8 @@ class Encoder : public Buffer {
   }
 
   void push_varint(size_t val) {
-    if (val < 0xfd) {
-      push_int<uint8_t>(val);
-      return;
-    } else if (val <= 0xffff) {
-      push_int<uint8_t>(0xfd);
-      push_int<uint16_t>(val);
-      return;
-    } else if (val <= 0xffffffff) {
-      push_int<uint8_t>(0xfe);
-      push_int<uint32_t>(val);
-      return;
-    }
-    push_int<uint8_t>(0xff);
-    push_int<uint64_t>(val);
+    char buf[9];
+    append(buf, store_varint(val, buf));
   }
 
   void push(const std::string &s) {
@@ -101,31 +121,38 @@ class Encoder : public Buffer {
     append(s.c_str(), s.size());
   }
 
-  // N.B. argument is passed by value
-  void push(hash_t hash) {
-    std::reverse(hash.begin(), hash.end());
-    append(hash.data(), sizeof hash);
+  void push(const hash_t &hash) {
+    char wire[sizeof hash];
+    reverse_hash(hash.data(), wire);
+    append(wire, sizeof wire);
   }
 
   void push(const BlockHeader &hdr, bool push_tx_count = true) {
-    push(hdr.version);
-    push(hdr.prev_block);
-    push(hdr.merkle_root);
-    push(hdr.timestamp);
-    push(hdr.difficulty);
-    push(hdr.nonce);
+    char wire[BLOCK_HEADER_SIZE];
+    hdr.pack(wire);
+    append(wire, sizeof wire);
     if (push_tx_count) push_varint(0);
   }
 
-  void finish_headers() {
+  // Start another message at the end of the buffer, returning its offset
+  // for finish_headers().
+  size_t begin_message(const Headers &headers) {
+    const size_t start = size();
+    push(headers);
+    return start;
+  }
+
+  // fill in the length and checksum of the message starting at start
+  void finish_headers(size_t start = 0) {
     // insert the length
-    uint32_t len = htole32(size() - HEADER_SIZE);
-    insert(&len, sizeof len, HEADER_LEN_OFFSET);
+    const size_t payload_size = size() - start - HEADER_SIZE;
+    uint32_t len = htole32(payload_size);
+    insert(&len, sizeof len, start + HEADER_LEN_OFFSET);
 
     // insert the checksum
     std::array<char, 4> cksum{0, 0, 0, 0};
-    checksum(data() + HEADER_SIZE, size() - HEADER_SIZE, cksum);
-    insert(&cksum, sizeof cksum, HEADER_CHECKSUM_OFFSET);
+    checksum(data() + start + HEADER_SIZE, payload_size, cksum);
+    insert(&cksum, sizeof cksum, start + HEADER_CHECKSUM_OFFSET);
   }
 
   std::unique_ptr<char[]> serialize(size_t &sz, bool finish = true) {
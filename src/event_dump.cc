@@ -0,0 +1,156 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+// Print the event log written with spv --event-log-mb, oldest first:
+//
+//   spv-events [-n count] .spv/events.dat
+//
+// With -n only the last count events are printed. Records that were being
+// written when the process died, and so don't match their slot, are
+// skipped.
+
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+#include "./addr.h"
+#include "./eventlog.h"
+#include "./fields.h"
+#include "./util.h"
+
+using namespace spv;
+
+namespace {
+void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [-n count] FILE\n", prog);
+  exit(1);
+}
+
+std::string format_time(uint64_t ns) {
+  const time_t secs = ns / 1000000000;
+  struct tm tm;
+  gmtime_r(&secs, &tm);
+  char buf[32];
+  strftime(buf, sizeof buf, "%Y-%m-%dT%H:%M:%S", &tm);
+  char frac[16];
+  snprintf(frac, sizeof frac, ".%06uZ", unsigned(ns % 1000000000 / 1000));
+  return std::string(buf) + frac;
+}
+
+std::string format_peer(const EventRecord &rec) {
+  Addr addr;
+  addrbuf_t buf;
+  std::memcpy(buf.data(), rec.data, buf.size());
+  addr.set_addr(buf);
+  addr.set_port(rec.port);
+  std::string out = addr.ip() + ":" + std::to_string(rec.port);
+  out += rec.inbound ? " in" : " out";
+  return out;
+}
+
+void print(const EventRecord &rec) {
+  printf("%s %8llu %-10s ", format_time(rec.time).c_str(),
+         static_cast<unsigned long long>(rec.seq - 1), event_name(rec.type));
+  switch (rec.type) {
+    case EventType::CONNECT:
+    case EventType::ACCEPT:
+    case EventType::HANDSHAKE:
+      printf("%s\n", format_peer(rec).c_str());
+      break;
+    case EventType::DISCONNECT: {
+      const char *reason = reinterpret_cast<const char *>(rec.data) + 16;
+      printf("%s %.*s\n", format_peer(rec).c_str(), 16, reason);
+      break;
+    }
+    case EventType::MSG_IN:
+    case EventType::MSG_OUT:
+      printf("%s %s %u\n", format_peer(rec).c_str(),
+             command_name(Command(rec.command)), rec.size);
+      break;
+    case EventType::HEADER:
+    case EventType::ORPHAN: {
+      hash_t hash;
+      std::memcpy(hash.data(), rec.data, hash.size());
+      printf("%u %s\n", rec.height, to_hex(hash).c_str());
+      break;
+    }
+    default:
+      printf("\n");
+      break;
+  }
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  uint64_t count = UINT64_MAX;
+  for (int c; (c = getopt(argc, argv, "n:")) != -1;) {
+    if (c != 'n') {
+      usage(argv[0]);
+    }
+    count = std::strtoull(optarg, nullptr, 10);
+  }
+  if (optind + 1 != argc) {
+    usage(argv[0]);
+  }
+
+  std::ifstream in(argv[optind], std::ios::binary);
+  if (!in) {
+    fprintf(stderr, "cannot open %s\n", argv[optind]);
+    return 1;
+  }
+  const std::string data((std::istreambuf_iterator<char>(in)),
+                         std::istreambuf_iterator<char>());
+  EventLogHeader hdr;
+  if (data.size() < sizeof hdr) {
+    fprintf(stderr, "%s is not an event log\n", argv[optind]);
+    return 1;
+  }
+  std::memcpy(&hdr, data.data(), sizeof hdr);
+  if (std::memcmp(hdr.magic, EVENT_LOG_MAGIC, sizeof hdr.magic) != 0 ||
+      hdr.version != EVENT_LOG_VERSION ||
+      hdr.record_size != sizeof(EventRecord) || hdr.capacity == 0 ||
+      data.size() != sizeof hdr + hdr.capacity * sizeof(EventRecord)) {
+    fprintf(stderr, "%s is not an event log\n", argv[optind]);
+    return 1;
+  }
+
+  const uint64_t kept = std::min(hdr.next, hdr.capacity);
+  uint64_t seq = hdr.next - std::min(kept, count);
+  size_t torn = 0;
+  for (; seq < hdr.next; seq++) {
+    EventRecord rec;
+    std::memcpy(&rec,
+                data.data() + sizeof hdr +
+                    (seq % hdr.capacity) * sizeof(EventRecord),
+                sizeof rec);
+    if (rec.seq != seq + 1) {
+      torn++;
+      continue;
+    }
+    print(rec);
+  }
+  if (torn) {
+    fprintf(stderr, "skipped %zu incomplete record(s)\n", torn);
+  }
+  return 0;
+}
@@ -0,0 +1,174 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./eventlog.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#include "./logging.h"
+#include "./network.h"
+
+namespace spv {
+MODULE_LOGGER
+
+static EventLog event_logs[NETWORK_COUNT];
+
+EventLog &event_log() { return event_logs[size_t(network().id)]; }
+
+const char *event_name(EventType type) {
+  switch (type) {
+    case EventType::NONE:
+      break;
+    case EventType::CONNECT:
+      return "connect";
+    case EventType::ACCEPT:
+      return "accept";
+    case EventType::HANDSHAKE:
+      return "handshake";
+    case EventType::DISCONNECT:
+      return "disconnect";
+    case EventType::MSG_IN:
+      return "msg_in";
+    case EventType::MSG_OUT:
+      return "msg_out";
+    case EventType::HEADER:
+      return "header";
+    case EventType::ORPHAN:
+      return "orphan";
+  }
+  return "unknown";
+}
+
+bool EventLog::open(const std::string &path, size_t bytes) {
+  close();
+  const uint64_t capacity = std::max<size_t>(bytes / sizeof(EventRecord), 1);
+  const size_t len = sizeof(EventLogHeader) + capacity * sizeof(EventRecord);
+  fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd_ == -1) {
+    log->error("failed to open event log {}: {}", path, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd_, &st) != 0 ||
+      (size_t(st.st_size) != len && ftruncate(fd_, len) != 0)) {
+    log->error("failed to size event log {}: {}", path, strerror(errno));
+    close();
+    return false;
+  }
+  void *addr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (addr == MAP_FAILED) {
+    log->error("failed to mmap event log {}: {}", path, strerror(errno));
+    close();
+    return false;
+  }
+  header_ = static_cast<EventLogHeader *>(addr);
+  records_ = reinterpret_cast<EventRecord *>(header_ + 1);
+  capacity_ = capacity;
+
+  const bool resume =
+      size_t(st.st_size) == len &&
+      std::memcmp(header_->magic, EVENT_LOG_MAGIC, sizeof EVENT_LOG_MAGIC) ==
+          0 &&
+      header_->version == EVENT_LOG_VERSION &&
+      header_->record_size == sizeof(EventRecord) &&
+      header_->capacity == capacity;
+  if (resume) {
+    log->info("appending to event log {} after {} events", path,
+              header_->next);
+  } else {
+    std::memset(addr, 0, len);
+    std::memcpy(header_->magic, EVENT_LOG_MAGIC, sizeof EVENT_LOG_MAGIC);
+    header_->version = EVENT_LOG_VERSION;
+    header_->record_size = sizeof(EventRecord);
+    header_->capacity = capacity;
+    header_->next = 0;
+    log->info("started event log {} with room for {} events", path, capacity);
+  }
+  return true;
+}
+
+void EventLog::close() {
+  if (header_ != nullptr) {
+    munmap(header_, sizeof(EventLogHeader) + capacity_ * sizeof(EventRecord));
+    header_ = nullptr;
+    records_ = nullptr;
+    capacity_ = 0;
+  }
+  if (fd_ != -1) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+EventRecord &EventLog::append(EventType type) {
+  const uint64_t seq = header_->next++;
+  EventRecord &rec = records_[seq % capacity_];
+  std::memset(&rec, 0, sizeof rec);
+  rec.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::system_clock::now().time_since_epoch())
+                 .count();
+  rec.seq = seq + 1;
+  rec.type = type;
+  return rec;
+}
+
+void EventLog::peer(EventType type, const Addr &addr, bool inbound,
+                    const char *reason) {
+  if (!is_open()) {
+    return;
+  }
+  EventRecord &rec = append(type);
+  rec.inbound = inbound;
+  rec.port = addr.port();
+  const addrbuf_t &buf = addr.addrbuf();
+  std::memcpy(rec.data, buf.data(), buf.size());
+  if (reason != nullptr) {
+    std::strncpy(reinterpret_cast<char *>(rec.data) + buf.size(), reason,
+                 sizeof rec.data - buf.size());
+  }
+}
+
+void EventLog::message(EventType type, const Addr &addr, bool inbound,
+                       Command cmd, size_t size) {
+  if (!is_open()) {
+    return;
+  }
+  EventRecord &rec = append(type);
+  rec.command = uint8_t(cmd);
+  rec.inbound = inbound;
+  rec.port = addr.port();
+  rec.size = static_cast<uint32_t>(std::min<size_t>(size, UINT32_MAX));
+  const addrbuf_t &buf = addr.addrbuf();
+  std::memcpy(rec.data, buf.data(), buf.size());
+}
+
+void EventLog::header(EventType type, const BlockHeader &hdr) {
+  if (!is_open()) {
+    return;
+  }
+  EventRecord &rec = append(type);
+  rec.height = static_cast<uint32_t>(hdr.height);
+  std::memcpy(rec.data, hdr.block_hash.data(), sizeof rec.data);
+}
+}  // namespace spv
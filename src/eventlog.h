@@ -0,0 +1,117 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "./addr.h"
+#include "./fields.h"
+
+namespace spv {
+// A binary history of peer and chain events for post-mortems, enabled with
+// --event-log-mb: fixed-size records in a memory-mapped ring file in the
+// data directory, overwriting the oldest. Recording an event is a few
+// stores, with no formatting; since the mapping is shared, the history
+// survives the process crashing. spv-events decodes the file.
+//
+// The file is a 64-byte EventLogHeader followed by the records, all in host
+// byte order.
+enum class EventType : uint8_t {
+  NONE = 0,
+  CONNECT,     // an outbound connection attempt
+  ACCEPT,      // an inbound connection
+  HANDSHAKE,   // the version handshake finished
+  DISCONNECT,  // with the reason, cut to fit
+  MSG_IN,
+  MSG_OUT,
+  HEADER,  // a header was added to the chain
+  ORPHAN,  // a header went to the orphan pool
+};
+
+// the name of the type, or "unknown"
+const char *event_name(EventType type);
+
+struct EventLogHeader {
+  char magic[8];  // EVENT_LOG_MAGIC
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t capacity;  // in records
+  uint64_t next;      // sequence number of the next record
+  uint8_t unused[32];
+};
+
+struct EventRecord {
+  uint64_t time;  // ns since the epoch
+  uint64_t seq;   // one more than the sequence number; 0 if never written
+  EventType type;
+  uint8_t command;  // a Command, for messages
+  uint8_t inbound;  // for peer events, did the peer connect to us?
+  uint8_t unused;
+  uint16_t port;    // of the peer
+  uint16_t unused2;
+  uint32_t size;    // message size in bytes
+  uint32_t height;  // of a header
+  // Peer events have the address (as in Addr) followed by up to 16 bytes
+  // of the disconnect reason; header events the block hash.
+  uint8_t data[32];
+};
+
+static_assert(sizeof(EventLogHeader) == 64, "");
+static_assert(sizeof(EventRecord) == 64, "");
+
+static const char EVENT_LOG_MAGIC[8] = {'S', 'P', 'V', 'E', 'V', 'E', 'N', 'T'};
+// 2: addrv2 and sendaddrv2 renumbered the commands after them
+static const uint32_t EVENT_LOG_VERSION = 2;
+
+class EventLog {
+ public:
+  EventLog() : fd_(-1), header_(nullptr), records_(nullptr), capacity_(0) {}
+  EventLog(const EventLog &other) = delete;
+  ~EventLog() { close(); }
+
+  // Map a ring of about this many bytes at path, continuing an existing one
+  // that has the same size, or starting over. Logs and returns false if the
+  // file can't be mapped.
+  bool open(const std::string &path, size_t bytes);
+  void close();
+
+  inline bool is_open() const { return records_ != nullptr; }
+
+  // These do nothing unless the log is open. Only the client's loop thread
+  // records events.
+  void peer(EventType type, const Addr &addr, bool inbound,
+            const char *reason = nullptr);
+  void message(EventType type, const Addr &addr, bool inbound, Command cmd,
+               size_t size);
+  void header(EventType type, const BlockHeader &hdr);
+
+ private:
+  int fd_;
+  EventLogHeader *header_;
+  EventRecord *records_;
+  uint64_t capacity_;
+
+  // claim the next record, filled in with the time and sequence number
+  EventRecord &append(EventType type);
+};
+
+// the event log of the network this thread selected (see network.h), so
+// each client in a process logs to its own
+EventLog &event_log();
+}  // namespace spv
@@ -0,0 +1,123 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./eviction.h"
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+
+namespace spv {
+static const size_t protect_by_group = 4;
+static const size_t protect_by_rtt = 8;
+static const size_t protect_by_headers = 4;
+static const size_t protect_by_cost = 4;
+
+// splitmix64's finalizer, as in addrman.cc
+static inline uint64_t mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// drop the n candidates that come first by better from the running
+template <typename Better>
+static void protect(std::vector<EvictionCandidate> &candidates, size_t n,
+                    Better better) {
+  n = std::min(n, candidates.size());
+  if (n == 0) {
+    return;
+  }
+  std::nth_element(candidates.begin(), candidates.begin() + (n - 1),
+                   candidates.end(), better);
+  candidates.erase(candidates.begin(), candidates.begin() + n);
+}
+
+bool select_eviction(std::vector<EvictionCandidate> candidates, uint64_t key,
+                     Addr &out) {
+  auto group_key = [key](const EvictionCandidate &c) {
+    return mix(key ^ mix(net_group(c.addr)));
+  };
+  protect(candidates, protect_by_group,
+          [&](const EvictionCandidate &a, const EvictionCandidate &b) {
+            return group_key(a) > group_key(b);
+          });
+
+  // an unknown round trip time counts as the slowest
+  auto rtt = [](const EvictionCandidate &c) {
+    return c.rtt.count() > 0 ? c.rtt : std::chrono::milliseconds::max();
+  };
+  protect(candidates, protect_by_rtt,
+          [&](const EvictionCandidate &a, const EvictionCandidate &b) {
+            return rtt(a) < rtt(b);
+          });
+
+  protect(candidates, protect_by_headers,
+          [](const EvictionCandidate &a, const EvictionCandidate &b) {
+            if (a.last_headers != b.last_headers) {
+              return a.last_headers > b.last_headers;
+            }
+            return a.connected < b.connected;
+          });
+
+  // only those that have given anything, or the cheapest would just be
+  // the newest
+  const size_t useful = std::count_if(
+      candidates.begin(), candidates.end(),
+      [](const EvictionCandidate &c) { return std::isfinite(c.cost); });
+  protect(candidates, std::min(protect_by_cost, useful),
+          [](const EvictionCandidate &a, const EvictionCandidate &b) {
+            return a.cost < b.cost;
+          });
+
+  protect(candidates, candidates.size() / 2,
+          [](const EvictionCandidate &a, const EvictionCandidate &b) {
+            return a.connected < b.connected;
+          });
+  if (candidates.empty()) {
+    return false;
+  }
+
+  // the newest peer in the biggest group, preferring the group whose
+  // newest peer is newer
+  struct Group {
+    size_t count;
+    const EvictionCandidate *newest;
+  };
+  std::unordered_map<uint64_t, Group> groups;
+  for (const auto &c : candidates) {
+    Group &g = groups.emplace(net_group(c.addr), Group{0, &c}).first->second;
+    g.count++;
+    if (c.connected > g.newest->connected) {
+      g.newest = &c;
+    }
+  }
+  const Group *worst = nullptr;
+  for (const auto &pr : groups) {
+    const Group &g = pr.second;
+    if (worst == nullptr || g.count > worst->count ||
+        (g.count == worst->count &&
+         g.newest->connected > worst->newest->connected)) {
+      worst = &g;
+    }
+  }
+  out = worst->newest->addr;
+  return true;
+}
+}  // namespace spv
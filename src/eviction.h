@@ -0,0 +1,48 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "./addr.h"
+#include "./util.h"
+
+namespace spv {
+// What inbound eviction knows about a connected peer.
+struct EvictionCandidate {
+  Addr addr;
+  std::chrono::milliseconds rtt;  // zero if it's unknown
+  time_point connected;
+  time_point last_headers;  // when it last sent headers we kept, if ever
+  double cost;  // PeerCost::cost(), or infinity if it gave us nothing
+};
+
+// Pick an inbound peer to make room for a new one, as Bitcoin Core does.
+// The peers that would be hardest for an attacker to imitate are
+// protected: 4 from distinct-looking network groups (picked by a hash
+// keyed with key, so which ones can't be predicted), the 8 with the lowest
+// round trip times, the 4 that sent useful headers most recently, the 4
+// that gave us the most for what they cost, and then the longest connected
+// half of the rest. Out of what's left, the newest
+// peer from the network group with the most connections is picked. Returns
+// false if everyone is protected. Each step is a linear-time selection, so
+// this is O(n) on average.
+bool select_eviction(std::vector<EvictionCandidate> candidates, uint64_t key,
+                     Addr &out);
+}  // namespace spv
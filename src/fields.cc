@@ -18,9 +18,12 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
 
 #include "./decoder.h"
-#include "./encoder.h"
+#include "./pow.h"
 
 std::ostream &operator<<(std::ostream &o, const spv::BlockHeader &hdr) {
   struct tm *tmp;
@@ -43,34 +46,149 @@ std::ostream &operator<<(std::ostream &o, const spv::NetAddr &addr) {
 }
 
 namespace spv {
-std::string BlockHeader::db_encode() const {
-  Encoder enc;
-  enc.push(*this, false);
-  enc.push(this->height);
+// by Command
+static const char *const command_names[] = {
+    "unknown",      "addr",         "addrv2",      "block",
+    "blocktxn",     "cfcheckpt",    "cfheaders",   "cfilter",
+    "cmpctblock",   "filteradd",    "filterclear", "filterload",
+    "getaddr",      "getblocks",    "getblocktxn", "getcfcheckpt",
+    "getcfheaders", "getcfilters",  "getdata",     "getheaders",
+    "headers",      "inv",          "mempool",     "merkleblock",
+    "ping",         "pong",         "reject",      "sendaddrv2",
+    "sendcmpct",    "sendheaders",  "tx",          "verack",
+    "version"};
+static_assert(sizeof command_names / sizeof command_names[0] ==
+                  size_t(Command::VERSION) + 1,
+              "a command is missing a name");
+
+const char *command_name(Command type) {
+  return command_names[size_t(type)];
+}
+
+// hashes are stored reversed on the wire
+static inline void pack_hash(const hash_t &hash, char *out) {
+  reverse_hash(hash.data(), out);
+}
+
+static inline hash_t unpack_hash(const char *in) {
+  hash_t out;
+  reverse_hash(in, out.data());
+  return out;
+}
+
+// BlockHeader's fields are laid out just as on the wire, so on a
+// little-endian host pack() and unpack() are a copy of the 80 bytes and a
+// swap of the two hashes.
+static_assert(std::is_trivially_copyable<BlockHeader>::value &&
+                  offsetof(BlockHeader, prev_block) == 4 &&
+                  offsetof(BlockHeader, merkle_root) == 36 &&
+                  offsetof(BlockHeader, timestamp) == 68 &&
+                  offsetof(BlockHeader, difficulty) == 72 &&
+                  offsetof(BlockHeader, nonce) == BLOCK_HEADER_SIZE - 4,
+              "BlockHeader doesn't match the wire layout");
 
-  size_t sz;
-  std::unique_ptr<char[]> data = enc.serialize(sz, false);
-  return {data.get(), sz};
+static inline void pack32(uint32_t val, char *out) {
+  val = htole32(val);
+  std::memcpy(out, &val, sizeof val);
+}
+
+static inline uint32_t unpack32(const char *in) {
+  uint32_t val;
+  std::memcpy(&val, in, sizeof val);
+  return le32toh(val);
+}
+
+void BlockHeader::pack(char *out) const {
+  if constexpr (host_is_wire_order) {
+    std::memcpy(out, reinterpret_cast<const char *>(this), BLOCK_HEADER_SIZE);
+    pack_hash(prev_block, out + 4);
+    pack_hash(merkle_root, out + 36);
+    return;
+  }
+  pack32(version, out);
+  pack_hash(prev_block, out + 4);
+  pack_hash(merkle_root, out + 36);
+  pack32(timestamp, out + 68);
+  pack32(difficulty, out + 72);
+  pack32(nonce, out + 76);
+}
+
+void BlockHeader::unpack(const char *in) {
+  if constexpr (host_is_wire_order) {
+    std::memcpy(reinterpret_cast<char *>(this), in, BLOCK_HEADER_SIZE);
+    reverse_hash(prev_block.data(), prev_block.data());
+    reverse_hash(merkle_root.data(), merkle_root.data());
+    return;
+  }
+  version = unpack32(in);
+  prev_block = unpack_hash(in + 4);
+  merkle_root = unpack_hash(in + 36);
+  timestamp = unpack32(in + 68);
+  difficulty = unpack32(in + 72);
+  nonce = unpack32(in + 76);
+}
+
+std::string encode_header_record(const char *raw, size_t height,
+                                 bool compact) {
+  assert(height <= UINT32_MAX);
+  char record[HEADER_RECORD_SIZE];
+  if (!compact) {
+    std::memcpy(record, raw, BLOCK_HEADER_SIZE);
+    pack32(height, record + BLOCK_HEADER_SIZE);
+    pack32(0, record + BLOCK_HEADER_SIZE + 4);  // flags
+    return {record, HEADER_RECORD_SIZE};
+  }
+  // the version, then everything after prev_block
+  std::memcpy(record, raw, 4);
+  std::memcpy(record + 4, raw + 36, BLOCK_HEADER_SIZE - 36);
+  pack32(height, record + BLOCK_HEADER_SIZE - 32);
+  pack32(HEADER_FLAG_COMPACT, record + BLOCK_HEADER_SIZE - 28);
+  return {record, COMPACT_RECORD_SIZE};
+}
+
+std::string BlockHeader::db_encode() const {
+  char raw[BLOCK_HEADER_SIZE];
+  pack(raw);
+  return encode_header_record(raw, height);
 }
 
 BlockHeader BlockHeader::genesis() {
   BlockHeader hdr;
-  Decoder dec(reinterpret_cast<const char *>(genesis_block_hdr.data()),
-              genesis_block_hdr.size());
+  const auto &raw = network().genesis_header;
+  Decoder dec(reinterpret_cast<const char *>(raw.data()), raw.size());
   dec.pull(hdr, false);
   assert(hdr.is_genesis());
   return hdr;
 }
 
 void BlockHeader::db_decode(const std::string &s) {
-  Decoder dec(s.c_str(), s.size());
-  dec.pull(*this, false);
-  dec.pull(height);
-  assert(!dec.bytes_remaining());
+  if (is_compact_record(s)) {
+    char raw[BLOCK_HEADER_SIZE];
+    std::memcpy(raw, s.data(), 4);
+    std::memset(raw + 4, 0, 32);
+    std::memcpy(raw + 36, s.data() + 4, BLOCK_HEADER_SIZE - 36);
+    unpack(raw);
+    height = unpack32(s.data() + BLOCK_HEADER_SIZE - 32);
+    return;
+  }
+  assert(s.size() == HEADER_RECORD_SIZE);
+  unpack(s.data());
+  height = unpack32(s.data() + BLOCK_HEADER_SIZE);
+}
+
+hash_t HeadersView::hash(size_t i) const {
+  return pow_hash(raw(i), BLOCK_HEADER_SIZE, true);
+}
+
+BlockHeader HeadersView::header(size_t i, const hash_t &block_hash) const {
+  BlockHeader hdr;
+  hdr.unpack(raw(i));
+  hdr.block_hash = block_hash;
+  return hdr;
 }
 
 uint32_t BlockHeader::age() const {
-  uint32_t now = time32();
+  uint32_t now = adjusted_time();
   if (now <= timestamp) {
     return 0;
   }
@@ -16,7 +16,12 @@
 
 #pragma once
 
+#include <endian.h>
+
+#include <algorithm>
+#include <array>
 #include <cstddef>
+#include <cstring>
 #include <ostream>
 #include <sstream>
 #include <string>
@@ -24,6 +29,7 @@
 #include "./addr.h"
 #include "./config.h"
 #include "./constants.h"
+#include "./network.h"
 #include "./util.h"
 
 namespace spv {
@@ -51,6 +57,20 @@ enum class InvType : uint32_t {
   FILTERED_WITNESS_BLOCK = FILTERED_BLOCK | WITNESS_FLAG,
 };
 
+// does the inv name a block, in any of its forms?
+inline bool is_block(InvType type) {
+  switch (type) {
+    case InvType::BLOCK:
+    case InvType::FILTERED_BLOCK:
+    case InvType::CMPCT_BLOCK:
+    case InvType::WITNESS_BLOCK:
+    case InvType::FILTERED_WITNESS_BLOCK:
+      return true;
+    default:
+      return false;
+  }
+}
+
 inline std::string to_string(const InvType &inv) {
   switch (inv) {
     case InvType::ERROR:
@@ -87,20 +107,175 @@ struct Inv {
   }
 };
 
+// the commands that have a Message type
+enum class Command : uint8_t {
+  UNKNOWN = 0,
+  ADDR,
+  ADDRV2,
+  BLOCK,
+  BLOCKTXN,
+  CFCHECKPT,
+  CFHEADERS,
+  CFILTER,
+  CMPCTBLOCK,
+  FILTERADD,
+  FILTERCLEAR,
+  FILTERLOAD,
+  GETADDR,
+  GETBLOCKS,
+  GETBLOCKTXN,
+  GETCFCHECKPT,
+  GETCFHEADERS,
+  GETCFILTERS,
+  GETDATA,
+  GETHEADERS,
+  HEADERS,
+  INV,
+  MEMPOOL,
+  MERKLEBLOCK,
+  PING,
+  PONG,
+  REJECT,
+  SENDADDRV2,
+  SENDCMPCT,
+  SENDHEADERS,
+  TX,
+  VERACK,
+  VERSION,
+};
+
+// The null padded command field of a message header as two little-endian
+// words, so that commands are compared with two integer loads rather than
+// with strcmp.
+struct CommandKey {
+  uint64_t lo;
+  uint32_t hi;
+};
+
+// the key for a command name, at compile time
+template <size_t N>
+constexpr CommandKey command_key(const char (&name)[N]) {
+  static_assert(N <= COMMAND_SIZE + 1, "command name is too long");
+  CommandKey key{0, 0};
+  for (size_t i = 0; i + 1 < N; i++) {
+    if (i < sizeof key.lo) {
+      key.lo |= uint64_t(uint8_t(name[i])) << (8 * i);
+    } else {
+      key.hi |= uint32_t(uint8_t(name[i])) << (8 * (i - sizeof key.lo));
+    }
+  }
+  return key;
+}
+
+// the key for a COMMAND_SIZE byte command field
+inline CommandKey load_command_key(const char *field) {
+  CommandKey key;
+  std::memcpy(&key.lo, field, sizeof key.lo);
+  std::memcpy(&key.hi, field + sizeof key.lo, sizeof key.hi);
+  return {le64toh(key.lo), le32toh(key.hi)};
+}
+
+// N.B. The low word alone selects the case (duplicate case labels would
+// not compile), and the high word just has to be checked. The first eight
+// bytes of every known command are distinct, except for getblocks and
+// getblocktxn, which share a case.
+#define COMMAND_CASE(name, cmd) \
+  case command_key(name).lo:    \
+    return key.hi == command_key(name).hi ? cmd : Command::UNKNOWN;
+
+#define COMMAND_CASE2(name_a, cmd_a, name_b, cmd_b)                      \
+  case command_key(name_a).lo:                                           \
+    static_assert(command_key(name_a).lo == command_key(name_b).lo, ""); \
+    return key.hi == command_key(name_a).hi                              \
+               ? cmd_a                                                   \
+               : key.hi == command_key(name_b).hi ? cmd_b : Command::UNKNOWN;
+
+inline Command to_command(const CommandKey &key) {
+  switch (key.lo) {
+    COMMAND_CASE("addr", Command::ADDR)
+    COMMAND_CASE("addrv2", Command::ADDRV2)
+    COMMAND_CASE("block", Command::BLOCK)
+    COMMAND_CASE("blocktxn", Command::BLOCKTXN)
+    COMMAND_CASE("cfcheckpt", Command::CFCHECKPT)
+    COMMAND_CASE("cfheaders", Command::CFHEADERS)
+    COMMAND_CASE("cfilter", Command::CFILTER)
+    COMMAND_CASE("cmpctblock", Command::CMPCTBLOCK)
+    COMMAND_CASE("filteradd", Command::FILTERADD)
+    COMMAND_CASE("filterclear", Command::FILTERCLEAR)
+    COMMAND_CASE("filterload", Command::FILTERLOAD)
+    COMMAND_CASE("getaddr", Command::GETADDR)
+    COMMAND_CASE2("getblocks", Command::GETBLOCKS, "getblocktxn",
+                  Command::GETBLOCKTXN)
+    COMMAND_CASE("getcfcheckpt", Command::GETCFCHECKPT)
+    COMMAND_CASE("getcfheaders", Command::GETCFHEADERS)
+    COMMAND_CASE("getcfilters", Command::GETCFILTERS)
+    COMMAND_CASE("getdata", Command::GETDATA)
+    COMMAND_CASE("getheaders", Command::GETHEADERS)
+    COMMAND_CASE("headers", Command::HEADERS)
+    COMMAND_CASE("inv", Command::INV)
+    COMMAND_CASE("mempool", Command::MEMPOOL)
+    COMMAND_CASE("merkleblock", Command::MERKLEBLOCK)
+    COMMAND_CASE("ping", Command::PING)
+    COMMAND_CASE("pong", Command::PONG)
+    COMMAND_CASE("reject", Command::REJECT)
+    COMMAND_CASE("sendaddrv2", Command::SENDADDRV2)
+    COMMAND_CASE("sendcmpct", Command::SENDCMPCT)
+    COMMAND_CASE("sendheaders", Command::SENDHEADERS)
+    COMMAND_CASE("tx", Command::TX)
+    COMMAND_CASE("verack", Command::VERACK)
+    COMMAND_CASE("version", Command::VERSION)
+  }
+  return Command::UNKNOWN;
+}
+
+#undef COMMAND_CASE
+#undef COMMAND_CASE2
+
+inline Command to_command(const std::string &name) {
+  if (name.size() > COMMAND_SIZE) {
+    return Command::UNKNOWN;
+  }
+  std::array<char, COMMAND_SIZE> field{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  std::memcpy(field.data(), name.data(), name.size());
+  return to_command(load_command_key(field.data()));
+}
+
+// the command name for a type, or "unknown"
+const char *command_name(Command type);
+
 struct Headers {
   uint32_t magic;
   std::string command;
   uint32_t payload_size;
   uint32_t checksum;
 
-  Headers() : magic(PROTOCOL_MAGIC), payload_size(0), checksum(0) {}
+  // not encoded, the decoded command
+  Command type;
+
+  // not encoded, set when the message came in a BIP324 packet, whose tag
+  // stands in for the checksum
+  bool sealed;
+
+  Headers()
+      : magic(network().magic),
+        payload_size(0),
+        checksum(0),
+        type(Command::UNKNOWN),
+        sealed(false) {}
   explicit Headers(const std::string &command)
-      : magic(PROTOCOL_MAGIC), command(command), payload_size(0), checksum(0) {}
+      : magic(network().magic),
+        command(command),
+        payload_size(0),
+        checksum(0),
+        type(to_command(command)),
+        sealed(false) {}
   Headers(const Headers &other)
       : magic(other.magic),
         command(other.command),
         payload_size(other.payload_size),
-        checksum(other.checksum) {}
+        checksum(other.checksum),
+        type(other.type),
+        sealed(other.sealed) {}
 };
 
 struct BlockHeader {
@@ -124,30 +299,28 @@ struct BlockHeader {
         nonce(0),
         height(0),
         block_hash(empty_hash) {}
-  BlockHeader(const BlockHeader &other)
-      : version(other.version),
-        prev_block(other.prev_block),
-        merkle_root(other.merkle_root),
-        timestamp(other.timestamp),
-        difficulty(other.difficulty),
-        nonce(other.nonce),
-        height(other.height),
-        block_hash(other.block_hash) {}
+  BlockHeader(const BlockHeader &other) = default;  // trivially, see pack()
 
+  // the selected network's genesis block
   static BlockHeader genesis();
 
   inline bool is_empty() const { return block_hash == empty_hash; }
 
+  // is this the selected network's genesis block?
   inline bool is_genesis() const {
-    return block_hash == hash_t{0x00, 0x00, 0x00, 0x00, 0x09, 0x33, 0xea, 0x01,
-                                0xad, 0x0e, 0xe9, 0x84, 0x20, 0x97, 0x79, 0xba,
-                                0xae, 0xc3, 0xce, 0xd9, 0x0f, 0xa3, 0xf4, 0x08,
-                                0x71, 0x95, 0x26, 0xf8, 0xd7, 0x7f, 0x49, 0x43};
+    return block_hash == network().genesis_hash;
   }
 
   inline bool is_orphan() const { return height == 0 && !is_genesis(); }
 
-  // decode from db
+  // Copy the fields to or from the 80-byte wire encoding (without the tx
+  // count). unpack() doesn't touch height or block_hash.
+  void pack(char *out) const;
+  void unpack(const char *in);
+
+  // Decode a HEADER_RECORD_SIZE or COMPACT_RECORD_SIZE record from the db.
+  // The hash isn't part of the record, so block_hash isn't set, and neither
+  // is prev_block for a compact record; see is_compact_record().
   void db_decode(const std::string &s);
 
   // encode to db format
@@ -157,6 +330,69 @@ struct BlockHeader {
   uint32_t age() const;
 };
 
+// Build a db record (see BlockHeader::db_encode) from a header's 80-byte
+// wire encoding and its height, leaving out prev_block if compact.
+std::string encode_header_record(const char *raw, size_t height,
+                                 bool compact = false);
+
+// Compact records are only written for the best chain, where the header a
+// height below is the parent, and are rewritten in full when a reorg takes
+// them off it.
+inline bool is_compact_record(const std::string &s) {
+  return s.size() == COMPACT_RECORD_SIZE;
+}
+
+// A view of the headers in a headers message payload, which are evenly
+// spaced: each one is its 80-byte wire encoding followed by a zero tx count.
+// Fields are read straight out of the payload, so nothing is decoded or
+// hashed until it's needed. The view doesn't own the data.
+class HeadersView {
+ public:
+  static const size_t stride = BLOCK_HEADER_SIZE + 1;
+
+  HeadersView() : data_(nullptr), size_(0) {}
+  HeadersView(const char *data, size_t size) : data_(data), size_(size) {}
+
+  // number of headers
+  inline size_t size() const { return size_; }
+
+  // the 80-byte wire encoding of a header
+  inline const char *raw(size_t i) const { return data_ + i * stride; }
+
+  inline uint32_t version(size_t i) const { return load32(i, 0); }
+  inline hash_t prev_block(size_t i) const { return load_hash(i, 4); }
+  inline hash_t merkle_root(size_t i) const { return load_hash(i, 36); }
+  inline uint32_t timestamp(size_t i) const { return load32(i, 68); }
+  inline uint32_t difficulty(size_t i) const { return load32(i, 72); }
+  inline uint32_t nonce(size_t i) const { return load32(i, 76); }
+
+  // compute the block hash of a header
+  hash_t hash(size_t i) const;
+
+  // decode a header whose hash is already known
+  BlockHeader header(size_t i, const hash_t &block_hash) const;
+
+  // decode and hash a header
+  BlockHeader header(size_t i) const { return header(i, hash(i)); }
+
+ private:
+  const char *data_;
+  size_t size_;
+
+  inline uint32_t load32(size_t i, size_t off) const {
+    uint32_t val;
+    std::memcpy(&val, raw(i) + off, sizeof val);
+    return le32toh(val);
+  }
+
+  // hashes are stored reversed on the wire
+  inline hash_t load_hash(size_t i, size_t off) const {
+    hash_t out;
+    reverse_hash(raw(i) + off, out.data());
+    return out;
+  }
+};
+
 struct VersionNetAddr {
   uint64_t services;
   Addr addr;
@@ -171,7 +407,7 @@ struct NetAddr {
   uint64_t services;
   Addr addr;
 
-  NetAddr() : time(time32()), services(0) {}
+  NetAddr() : time(adjusted_time()), services(0) {}
   NetAddr(const NetAddr &other)
       : time(other.time), services(other.services), addr(other.addr) {}
 
@@ -0,0 +1,153 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./filter_server.h"
+
+#include <memory>
+#include <string>
+
+#include "./encoder.h"
+#include "./logging.h"
+#include "./pow.h"
+
+namespace spv {
+MODULE_LOGGER
+
+// A cfilters reply runs to tens of megabytes, so only a couple are kept;
+// the common case is peers following the tip asking for the same few.
+static const size_t filter_cache_size = 2;
+static const size_t header_cache_size = 16;
+static const size_t checkpoint_cache_size = 4;
+
+FilterServer::FilterServer(const Chain &chain,
+                           const FilterHeaderChain &cfheaders,
+                           const FilterStore &store)
+    : chain_(chain),
+      cfheaders_(cfheaders),
+      store_(store),
+      filters_(filter_cache_size),
+      headers_(header_cache_size),
+      checkpoints_(checkpoint_cache_size) {}
+
+bool FilterServer::stop_height(uint32_t start_height, const hash_t &stop_hash,
+                               size_t limit, size_t *height) const {
+  const IndexEntry *entry = chain_.index_entry(stop_hash);
+  if (entry == nullptr || entry->height >= cfheaders_.size() ||
+      cfheaders_.block_hash(entry->height) != stop_hash) {
+    return false;
+  }
+  if (start_height > entry->height || entry->height - start_height >= limit) {
+    return false;
+  }
+  *height = entry->height;
+  return true;
+}
+
+ReplyCache::Message FilterServer::cfilters(uint32_t start_height,
+                                           const hash_t &stop_hash) {
+  size_t stop = 0;
+  if (!stop_height(start_height, stop_hash, MAX_GETCFILTERS_SIZE, &stop)) {
+    return nullptr;
+  }
+  ReplyCache::Message msg = filters_.find(start_height, stop_hash);
+  if (msg) {
+    return msg;
+  }
+
+  Encoder enc;
+  for (size_t height = start_height; height <= stop; height++) {
+    const hash_t &block_hash = cfheaders_.block_hash(height);
+    const char *data;
+    size_t size;
+    if (!store_.get(height, block_hash, &data, &size)) {
+      log->debug("no stored filter at height {}", height);
+      return nullptr;
+    }
+    const size_t start = enc.begin_message(Headers("cfilter"));
+    enc.push(static_cast<uint8_t>(BASIC_FILTER));
+    enc.push(block_hash);
+    enc.push_varint(size);
+    enc.append(data, size);
+    enc.finish_headers(start);
+  }
+  msg = std::make_shared<const std::string>(enc.data(), enc.size());
+  filters_.put(start_height, stop_hash, msg);
+  return msg;
+}
+
+ReplyCache::Message FilterServer::cfheaders(uint32_t start_height,
+                                            const hash_t &stop_hash) {
+  size_t stop = 0;
+  if (!stop_height(start_height, stop_hash, MAX_GETCFHEADERS_SIZE, &stop)) {
+    return nullptr;
+  }
+  ReplyCache::Message msg = headers_.find(start_height, stop_hash);
+  if (msg) {
+    return msg;
+  }
+
+  // the filter header chain keeps headers, not filter hashes, so those come
+  // from hashing the stored filters
+  const size_t count = stop - start_height + 1;
+  Encoder enc(Headers("cfheaders"),
+              HEADER_SIZE + 1 + 2 * sizeof(hash_t) + varint_size(count) +
+                  count * sizeof(hash_t));
+  enc.push(static_cast<uint8_t>(BASIC_FILTER));
+  enc.push(stop_hash);
+  enc.push(cfheaders_.prev_header(start_height));
+  enc.push_varint(count);
+  for (size_t height = start_height; height <= stop; height++) {
+    const char *data;
+    size_t size;
+    if (!store_.get(height, cfheaders_.block_hash(height), &data, &size)) {
+      log->debug("no stored filter at height {}", height);
+      return nullptr;
+    }
+    enc.push(pow_hash(data, size, true));
+  }
+  enc.finish_headers();
+  msg = std::make_shared<const std::string>(enc.data(), enc.size());
+  headers_.put(start_height, stop_hash, msg);
+  return msg;
+}
+
+ReplyCache::Message FilterServer::cfcheckpt(const hash_t &stop_hash) {
+  size_t stop = 0;
+  if (!stop_height(0, stop_hash, cfheaders_.size(), &stop)) {
+    return nullptr;
+  }
+  ReplyCache::Message msg = checkpoints_.find(0, stop_hash);
+  if (msg) {
+    return msg;
+  }
+
+  const size_t count = stop / CFCHECKPT_INTERVAL;
+  Encoder enc(Headers("cfcheckpt"), HEADER_SIZE + 1 + sizeof(hash_t) +
+                                        varint_size(count) +
+                                        count * sizeof(hash_t));
+  enc.push(static_cast<uint8_t>(BASIC_FILTER));
+  enc.push(stop_hash);
+  enc.push_varint(count);
+  for (size_t i = 1; i <= count; i++) {
+    enc.push(cfheaders_.header(i * CFCHECKPT_INTERVAL));
+  }
+  enc.finish_headers();
+  msg = std::make_shared<const std::string>(enc.data(), enc.size());
+  checkpoints_.put(0, stop_hash, msg);
+  return msg;
+}
+}  // namespace spv
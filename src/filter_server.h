@@ -0,0 +1,67 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "./cfheaders.h"
+#include "./chain.h"
+#include "./filter_store.h"
+#include "./reply_cache.h"
+
+namespace spv {
+// Answers BIP157 requests from peers, with --serve-filters. We can't build
+// basic filters without the previous outputs of every block, so what we
+// serve is the filters we fetched and checked against our filter header
+// chain, as kept in the FilterStore; a request is only answered if every
+// filter it covers is stored. Replies come encoded and ready to send, and
+// recent ones are cached, as Chain::headers_message() does for headers.
+class FilterServer {
+ public:
+  FilterServer() = delete;
+  FilterServer(const FilterServer &other) = delete;
+  FilterServer(const Chain &chain, const FilterHeaderChain &cfheaders,
+               const FilterStore &store);
+
+  // The cfilter messages (concatenated) for the blocks from start_height
+  // up to stop_hash, which must be on the best chain, or nullptr if we
+  // can't answer.
+  ReplyCache::Message cfilters(uint32_t start_height, const hash_t &stop_hash);
+
+  // the cfheaders message for the same kind of range, or nullptr
+  ReplyCache::Message cfheaders(uint32_t start_height,
+                                const hash_t &stop_hash);
+
+  // the cfcheckpt message up to stop_hash, or nullptr
+  ReplyCache::Message cfcheckpt(const hash_t &stop_hash);
+
+ private:
+  const Chain &chain_;
+  const FilterHeaderChain &cfheaders_;
+  const FilterStore &store_;
+  ReplyCache filters_;
+  ReplyCache headers_;
+  ReplyCache checkpoints_;
+
+  // the height of stop_hash if our filter header chain reaches it, at most
+  // limit blocks from start_height, else false
+  bool stop_height(uint32_t start_height, const hash_t &stop_hash,
+                   size_t limit, size_t *height) const;
+};
+}  // namespace spv
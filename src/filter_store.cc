@@ -0,0 +1,239 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./filter_store.h"
+
+#include <dirent.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+
+#include "./logging.h"
+
+namespace spv {
+MODULE_LOGGER
+
+// a record never spans two files
+static const size_t max_file_size = 64 << 20;
+
+// a record's height and filter size, then the block hash
+static const size_t record_header = 2 * sizeof(uint32_t) + sizeof(hash_t);
+
+FilterStore::FilterStore(const std::string &datadir, size_t limit)
+    : datadir_(datadir), limit_(limit), bytes_(0), count_(0) {
+  std::vector<uint32_t> numbers;
+  DIR *dir = opendir(datadir.c_str());
+  if (dir != nullptr) {
+    while (struct dirent *ent = readdir(dir)) {
+      unsigned number;
+      char tail;
+      if (std::sscanf(ent->d_name, "cf%5u.da%c", &number, &tail) == 2 &&
+          tail == 't' && std::strlen(ent->d_name) == 11) {
+        numbers.push_back(number);
+      }
+    }
+    closedir(dir);
+  }
+  std::sort(numbers.begin(), numbers.end());
+  for (uint32_t number : numbers) {
+    open_file(number, number == numbers.back());
+  }
+  log->info("filter store has {} filters in {} files ({} MiB)", count_,
+            files_.size(), bytes_ >> 20);
+  prune();
+}
+
+FilterStore::~FilterStore() {
+  for (auto &pr : files_) {
+    close_file(pr.second);
+  }
+}
+
+std::string FilterStore::path(uint32_t file) const {
+  char name[16];
+  std::snprintf(name, sizeof name, "cf%05u.dat", file);
+  return datadir_ + "/" + name;
+}
+
+bool FilterStore::open_file(uint32_t file, bool last) {
+  const std::string name = path(file);
+  const int fd = open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    log->error("failed to open filter file {}: {}", name, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    log->error("failed to stat filter file {}: {}", name, strerror(errno));
+    close(fd);
+    return false;
+  }
+  // a file that's only read is mapped as far as it was written
+  size_t len = st.st_size;
+  if (last && len < max_file_size) {
+    if (ftruncate(fd, max_file_size) == -1) {
+      log->error("failed to size filter file {}: {}", name, strerror(errno));
+      close(fd);
+      return false;
+    }
+    len = max_file_size;
+  }
+  char *base = nullptr;
+  if (len) {
+    void *addr = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      log->error("failed to mmap filter file {}: {}", name, strerror(errno));
+      close(fd);
+      return false;
+    }
+    base = static_cast<char *>(addr);
+  }
+
+  // walk the records, up to the zeros past the last one
+  size_t used = 0;
+  while (used + record_header <= len) {
+    uint32_t fields[2];
+    std::memcpy(fields, base + used, sizeof fields);
+    const size_t height = le32toh(fields[0]), size = le32toh(fields[1]);
+    if (size == 0 || used + record_header + size > len) {
+      break;
+    }
+    if (height >= index_.size()) {
+      index_.resize(height + 1, Location{0, 0, 0});
+    }
+    count_ += index_[height].size == 0;
+    index_[height] = Location{file, static_cast<uint32_t>(size), used};
+    used += record_header + size;
+  }
+  files_[file] = File{fd, base, len, used};
+  bytes_ += used;
+  return true;
+}
+
+void FilterStore::close_file(File &file) {
+  if (file.base != nullptr) {
+    munmap(file.base, file.mapped);
+  }
+  if (file.mapped > file.used && ftruncate(file.fd, file.used) == -1) {
+    log->warn("failed to trim a filter file: {}", strerror(errno));
+  }
+  close(file.fd);
+}
+
+bool FilterStore::put(size_t height, const hash_t &block_hash,
+                      const std::string &filter) {
+  const char *data;
+  size_t size;
+  if (get(height, block_hash, &data, &size)) {
+    return true;
+  }
+  const size_t record = record_header + filter.size();
+  if (filter.empty() || record > max_file_size ||
+      height > std::numeric_limits<uint32_t>::max()) {
+    return false;
+  }
+  if (files_.empty() ||
+      files_.rbegin()->second.used + record > files_.rbegin()->second.mapped) {
+    const uint32_t next = files_.empty() ? 0 : files_.rbegin()->first + 1;
+    if (!open_file(next, true)) {
+      return false;
+    }
+  }
+  const uint32_t number = files_.rbegin()->first;
+  File &file = files_.rbegin()->second;
+  const uint32_t fields[2] = {htole32(static_cast<uint32_t>(height)),
+                              htole32(static_cast<uint32_t>(filter.size()))};
+  struct iovec iov[3] = {
+      {const_cast<uint32_t *>(fields), sizeof fields},
+      {const_cast<uint8_t *>(block_hash.data()), block_hash.size()},
+      {const_cast<char *>(filter.data()), filter.size()}};
+  if (pwritev(file.fd, iov, 3, file.used) != ssize_t(record)) {
+    log->error("failed to write the filter at height {} to {}: {}", height,
+               path(number), strerror(errno));
+    return false;
+  }
+  if (height >= index_.size()) {
+    index_.resize(height + 1, Location{0, 0, 0});
+  }
+  count_ += index_[height].size == 0;
+  index_[height] = Location{number, static_cast<uint32_t>(filter.size()),
+                            file.used};
+  file.used += record;
+  bytes_ += record;
+  prune();
+  return true;
+}
+
+bool FilterStore::get(size_t height, const hash_t &block_hash,
+                      const char **data, size_t *size) const {
+  if (height >= index_.size() || index_[height].size == 0) {
+    return false;
+  }
+  const Location &loc = index_[height];
+  auto it = files_.find(loc.file);
+  if (it == files_.end()) {
+    return false;
+  }
+  // an old branch's filter is as good as none
+  const char *record = it->second.base + loc.offset;
+  if (std::memcmp(record + 2 * sizeof(uint32_t), block_hash.data(),
+                  block_hash.size()) != 0) {
+    return false;
+  }
+  *data = record + record_header;
+  *size = loc.size;
+  return true;
+}
+
+void FilterStore::forget(size_t height) {
+  if (height < index_.size() && index_[height].size != 0) {
+    index_[height].size = 0;
+    count_--;
+  }
+}
+
+void FilterStore::prune() {
+  while (limit_ && bytes_ > limit_ && files_.size() > 1) {
+    auto oldest = files_.begin();
+    size_t pruned = 0;
+    for (auto &loc : index_) {
+      if (loc.size != 0 && loc.file == oldest->first) {
+        loc.size = 0;
+        pruned++;
+      }
+    }
+    count_ -= pruned;
+    close_file(oldest->second);
+    bytes_ -= oldest->second.used;
+    const std::string name = path(oldest->first);
+    if (unlink(name.c_str()) == -1) {
+      log->warn("failed to delete filter file {}: {}", name, strerror(errno));
+    }
+    log->info("pruned {} filters in {}", pruned, name);
+    files_.erase(oldest);
+  }
+}
+}  // namespace spv
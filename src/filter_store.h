@@ -0,0 +1,100 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "./constants.h"
+
+namespace spv {
+// FilterStore keeps downloaded BIP158 basic filters in append-only files in
+// the data directory, cf00000.dat, cf00001.dat and so on, so that matching
+// new scripts against past blocks needs no peers. Each record is the
+// height and the payload's length as 4-byte little-endian integers, the
+// block hash, and the filter. Files are created at their full size and
+// mapped whole, as in BlockStore, and reads point into the mappings, so the
+// page cache is the store's memory tier.
+//
+// Records describe themselves, so the index, a Location per height, is
+// rebuilt by walking the files at open rather than kept anywhere; a torn
+// record at the end of the last file just ends the walk. Filters are
+// checked against the filter header chain where they're used, as they are
+// from peers. With a limit, the oldest files are deleted once the filters
+// take up more than that, the file being written excepted.
+class FilterStore {
+ public:
+  FilterStore() = delete;
+  FilterStore(const FilterStore &other) = delete;
+  FilterStore(const std::string &datadir, size_t limit);
+  ~FilterStore();
+
+  // Append the filter of the block at this height, unless it's there
+  // already. This may prune the oldest file. Returns false if it couldn't
+  // be written.
+  bool put(size_t height, const hash_t &block_hash, const std::string &filter);
+
+  // Find the stored filter of this block, at this height, pointing data at
+  // it until the next put() or forget().
+  bool get(size_t height, const hash_t &block_hash, const char **data,
+           size_t *size) const;
+
+  // drop a stored filter, e.g. one that didn't match its filter header
+  void forget(size_t height);
+
+  // number of filters stored, and the bytes of the files holding them
+  inline size_t size() const { return count_; }
+  inline size_t bytes() const { return bytes_; }
+
+ private:
+  struct Location {
+    uint32_t file;
+    uint32_t size;    // of the filter, or 0 if none is stored
+    uint64_t offset;  // of the record
+  };
+
+  struct File {
+    int fd;
+    char *base;
+    size_t mapped;
+    size_t used;  // where the next record goes
+  };
+
+  std::string datadir_;
+  size_t limit_;
+  size_t bytes_;
+  size_t count_;
+  std::vector<Location> index_;     // by height
+  std::map<uint32_t, File> files_;  // oldest first
+
+  std::string path(uint32_t file) const;
+
+  // Open and map a file, creating it if need be, and index its records.
+  // The last one is mapped at its full size, to be appended to.
+  bool open_file(uint32_t file, bool last);
+
+  // unmap and close a file, trimming it to what's been written
+  void close_file(File &file);
+
+  // delete the oldest files until the filters fit in limit_
+  void prune();
+};
+}  // namespace spv
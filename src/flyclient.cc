@@ -0,0 +1,200 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./flyclient.h"
+
+#include <endian.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "./mmr.h"
+#include "./pow.h"
+
+namespace spv {
+// The distance of a draw from the tip is a fraction of the total work in
+// [2^-(k+1), 2^-k), for k uniform below this, so a few samples land in
+// every power-of-two span back from the tip.
+static const unsigned sample_depth = 24;
+
+static const size_t proof_head_size = 72;
+static const size_t sample_head_size = 120;
+
+static void put32(std::string &out, uint32_t val) {
+  val = htole32(val);
+  out.append(reinterpret_cast<const char *>(&val), sizeof val);
+}
+
+static void put_hash(std::string &out, const hash_t &hash) {
+  out.append(reinterpret_cast<const char *>(hash.data()), hash.size());
+}
+
+static uint32_t get32(const char *p) {
+  uint32_t val;
+  std::memcpy(&val, p, sizeof val);
+  return le32toh(val);
+}
+
+static hash_t get_hash(const char *p) {
+  hash_t hash;
+  std::memcpy(hash.data(), p, hash.size());
+  return hash;
+}
+
+void ChainProof::encode(std::string &out) const {
+  put32(out, leaves);
+  put32(out, samples.size());
+  put_hash(out, root);
+  put_hash(out, chainwork.to_hash());
+  for (const auto &sample : samples) {
+    put32(out, sample.height);
+    put32(out, sample.branch.size());
+    put_hash(out, sample.chainwork.to_hash());
+    out.append(sample.header.data(), sample.header.size());
+    for (const auto &hash : sample.branch) {
+      put_hash(out, hash);
+    }
+  }
+}
+
+bool ChainProof::decode(const char *data, size_t size) {
+  if (size < proof_head_size) {
+    return false;
+  }
+  leaves = get32(data);
+  const size_t count = get32(data + 4);
+  root = get_hash(data + 8);
+  chainwork = uint256::from_hash(get_hash(data + 40));
+  if (count > MAX_CHAIN_PROOF_SAMPLES + 1) {
+    return false;
+  }
+  samples.clear();
+  samples.reserve(count);
+  size_t pos = proof_head_size;
+  for (size_t i = 0; i < count; i++) {
+    if (size - pos < sample_head_size) {
+      return false;
+    }
+    const char *p = data + pos;
+    Sample sample;
+    sample.height = get32(p);
+    const size_t branch_size = get32(p + 4);
+    sample.chainwork = uint256::from_hash(get_hash(p + 8));
+    std::memcpy(sample.header.data(), p + 40, sample.header.size());
+    pos += sample_head_size;
+    // a branch is at most a leaf-to-peak path plus the other peaks
+    if (branch_size > 128 || size - pos < branch_size * sizeof(hash_t)) {
+      return false;
+    }
+    for (size_t j = 0; j < branch_size; j++) {
+      sample.branch.push_back(get_hash(data + pos));
+      pos += sizeof(hash_t);
+    }
+    samples.push_back(std::move(sample));
+  }
+  return pos == size;
+}
+
+hash_t chain_proof_leaf(const hash_t &block_hash, const uint256 &chainwork) {
+  char buf[2 * sizeof(hash_t)];
+  const hash_t work = chainwork.to_hash();
+  std::memcpy(buf, block_hash.data(), block_hash.size());
+  std::memcpy(buf + sizeof(hash_t), work.data(), work.size());
+  return pow_hash(buf, sizeof buf);
+}
+
+std::vector<uint256> chain_proof_points(uint32_t leaves, const hash_t &root,
+                                        const uint256 &chainwork,
+                                        size_t samples) {
+  // the seed commits to everything the proof claims about the chain
+  char buf[2 * sizeof(hash_t) + 4];
+  const uint32_t n = htole32(leaves);
+  const hash_t work = chainwork.to_hash();
+  std::memcpy(buf, root.data(), root.size());
+  std::memcpy(buf + sizeof(hash_t), work.data(), work.size());
+  std::memcpy(buf + 2 * sizeof(hash_t), &n, sizeof n);
+  const hash_t seed = pow_hash(buf, sizeof buf);
+
+  std::vector<uint256> points;
+  points.reserve(samples);
+  for (size_t i = 0; i < samples; i++) {
+    const uint32_t index = htole32(i);
+    std::memcpy(buf, seed.data(), seed.size());
+    std::memcpy(buf + sizeof(hash_t), &index, sizeof index);
+    const hash_t draw = pow_hash(buf, sizeof(hash_t) + sizeof index);
+    const unsigned k = uint8_t(draw[0]) % sample_depth;
+    const uint32_t frac = get32(reinterpret_cast<const char *>(&draw[1]));
+
+    // a distance in [span, 2 * span) back from the tip
+    const uint256 span = chainwork >> (k + 1);
+    uint256 distance = span + ((span * frac) >> 32);
+    if (distance.is_zero()) {
+      distance = 1;
+    }
+    points.push_back(distance < chainwork ? chainwork - distance : 0);
+  }
+  return points;
+}
+
+bool verify_chain_proof(const ChainProof &proof, size_t samples) {
+  if (proof.leaves == 0 || proof.samples.empty() ||
+      proof.samples.back().height != proof.leaves - 1 ||
+      proof.samples.back().chainwork != proof.chainwork) {
+    return false;
+  }
+
+  // each sample on its own: its work, and its branch to the root
+  std::vector<uint256> before;  // the work up to each sample's parent
+  before.reserve(proof.samples.size());
+  for (size_t i = 0; i < proof.samples.size(); i++) {
+    const ChainProof::Sample &sample = proof.samples[i];
+    if (sample.height >= proof.leaves ||
+        (i > 0 && sample.height <= proof.samples[i - 1].height)) {
+      return false;
+    }
+    const uint32_t bits = get32(sample.header.data() + 72);
+    const hash_t hash =
+        pow_hash(sample.header.data(), sample.header.size(), true);
+    const uint256 work = block_work(bits);
+    if (!check_pow(hash, bits) || sample.chainwork < work ||
+        !HeaderMmr::verify(chain_proof_leaf(hash, sample.chainwork),
+                           sample.height, proof.leaves, sample.branch,
+                           proof.root)) {
+      return false;
+    }
+    before.push_back(sample.chainwork - work);
+    if (i > 0 && before[i] < proof.samples[i - 1].chainwork) {
+      return false;
+    }
+  }
+
+  // then that each point fell in the work of one of the samples
+  for (const uint256 &point :
+       chain_proof_points(proof.leaves, proof.root, proof.chainwork, samples)) {
+    auto it = std::upper_bound(
+        proof.samples.begin(), proof.samples.end(), point,
+        [](const uint256 &w, const ChainProof::Sample &s) {
+          return w < s.chainwork;
+        });
+    if (it == proof.samples.end() ||
+        point < before[it - proof.samples.begin()]) {
+      return false;
+    }
+  }
+  return true;
+}
+}  // namespace spv
@@ -0,0 +1,95 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "./constants.h"
+#include "./uint256.h"
+
+namespace spv {
+// FlyClient succinct proofs of the best chain's work. Rather than every
+// header, a client checks a few hundred sampled at random by cumulative
+// work, each with a HeaderMmr branch to a root over the whole chain. The
+// leaves of that mmr commit to the total work as well as the hash at each
+// height (see chain_proof_leaf()), which is what lets the client check
+// that each sample really is the header holding the work it was drawn at.
+// The draws come from hashing the root, so they can't be picked until the
+// chain they sample is fixed; they're spread log-uniformly over the
+// distance from the tip, so most land in the last few percent of the work,
+// where a fork would have to be.
+//
+// Proofs go over the query socket (see query_server.h) in this encoding,
+// with integers little-endian and hashes in display order:
+//
+//   0   u32  leaves: the headers the root covers, the tip's height + 1
+//   4   u32  samples
+//   8   u8   root[32]
+//   40  u8   chainwork[32]: the total work at the tip
+//
+// then each sample, in increasing height, the tip last:
+//
+//   0   u32  height
+//   4   u32  branch_size: the number of branch hashes
+//   8   u8   chainwork[32]: the total work up to and including it
+//   40  u8   header[80], in the wire encoding
+//   120 u8   branch[32 * branch_size], as from HeaderMmr::prove()
+
+// samples drawn for a proof when the request doesn't say, and the most
+static const size_t CHAIN_PROOF_SAMPLES = 256;
+static const size_t MAX_CHAIN_PROOF_SAMPLES = 4096;
+
+struct ChainProof {
+  struct Sample {
+    uint32_t height;
+    uint256 chainwork;
+    std::array<char, BLOCK_HEADER_SIZE> header;
+    std::vector<hash_t> branch;
+  };
+
+  uint32_t leaves = 0;
+  hash_t root = empty_hash;
+  uint256 chainwork;
+  std::vector<Sample> samples;
+
+  void encode(std::string &out) const;
+
+  // decode a whole proof, returning false if it's malformed
+  bool decode(const char *data, size_t size);
+};
+
+// the mmr leaf for a header with this hash and total work
+hash_t chain_proof_leaf(const hash_t &block_hash, const uint256 &chainwork);
+
+// The points of work to sample in a chain of this many headers, root and
+// total work, each below chainwork; the sample for a point is the header
+// whose work takes the chain past it.
+std::vector<uint256> chain_proof_points(uint32_t leaves, const hash_t &root,
+                                        const uint256 &chainwork,
+                                        size_t samples);
+
+// Check a proof drawn with this many samples: the proof of work of every
+// sample, its branch to the root, and that it holds the work of each point
+// it was drawn for. The proof then shows about chainwork of work on a chain
+// of leaves headers, ending in the last sample.
+bool verify_chain_proof(const ChainProof &proof, size_t samples);
+}  // namespace spv
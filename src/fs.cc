@@ -81,7 +81,7 @@ FileLock::~FileLock() {
     if (close(fd_) == 0) {
       break;
     } else if (errno == EBADF) {
-      log->debug("ignoring EBADF from close");
+      LOG_DEBUG(log, "ignoring EBADF from close");
       break;
     }
   }
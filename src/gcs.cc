@@ -0,0 +1,679 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./gcs.h"
+
+#include <endian.h>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define HAVE_X86 1
+#endif
+
+#include "./logging.h"
+#include "./pow.h"
+#include "./sha256.h"
+
+namespace spv {
+MODULE_LOGGER
+
+#define GCS_INLINE __attribute__((always_inline)) inline
+
+// a macro, so that it works on the vectors below as well as on scalars
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND       \
+  do {                 \
+    v0 += v1;          \
+    v1 = ROTL(v1, 13); \
+    v1 ^= v0;          \
+    v0 = ROTL(v0, 32); \
+    v2 += v3;          \
+    v3 = ROTL(v3, 16); \
+    v3 ^= v2;          \
+    v0 += v3;          \
+    v3 = ROTL(v3, 21); \
+    v3 ^= v0;          \
+    v2 += v1;          \
+    v1 = ROTL(v1, 17); \
+    v1 ^= v2;          \
+    v2 = ROTL(v2, 32); \
+  } while (0)
+
+static const uint64_t sip_c0 = 0x736f6d6570736575ULL;
+static const uint64_t sip_c1 = 0x646f72616e646f6dULL;
+static const uint64_t sip_c2 = 0x6c7967656e657261ULL;
+static const uint64_t sip_c3 = 0x7465646279746573ULL;
+
+static GCS_INLINE uint64_t load_le64(const uint8_t *p) {
+  uint64_t x;
+  std::memcpy(&x, p, sizeof x);
+  return le64toh(x);
+}
+
+// the last len % 8 bytes of a message, with the length in the top byte
+static GCS_INLINE uint64_t sip_tail(const uint8_t *in, size_t len) {
+  const size_t rem = len & 7;
+  uint64_t b = uint64_t(len) << 56;
+  if (rem == 0) {
+    return b;
+  }
+  if (len >= 8) {
+    // one load of the last 8 bytes, overlapping the last block
+    return b | (load_le64(in + len - 8) >> (64 - 8 * rem));
+  }
+  for (size_t i = 0; i < rem; i++) {
+    b |= uint64_t(in[i]) << (8 * i);
+  }
+  return b;
+}
+
+uint64_t siphash24(uint64_t k0, uint64_t k1, const void *data, size_t len) {
+  const uint8_t *in = static_cast<const uint8_t *>(data);
+  uint64_t v0 = sip_c0 ^ k0, v1 = sip_c1 ^ k1, v2 = sip_c2 ^ k0,
+           v3 = sip_c3 ^ k1;
+  for (size_t i = 0; i < len / 8; i++) {
+    const uint64_t m = load_le64(in + 8 * i);
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+  }
+  const uint64_t b = sip_tail(in, len);
+  v3 ^= b;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= b;
+
+  v2 ^= 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#ifdef HAVE_X86
+// SipHash is a long dependency chain of adds, rotates and xors, so hashing
+// one message at a time leaves most of the core idle. Instead each 64-bit
+// lane of a vector holds the state of a different message, all with the
+// same number of 8-byte blocks. Without AVX2 this is slower than hashing
+// one at a time, and AVX-512VL's vprolq makes the rotates single ops.
+typedef uint64_t v4u64 __attribute__((vector_size(32)));
+
+static const size_t sip_lanes = 4;
+
+template <typename V>
+static GCS_INLINE void siphash_lanes(uint64_t k0, uint64_t k1,
+                                     const std::string *const *msgs,
+                                     uint64_t *out) {
+  const size_t blocks = msgs[0]->size() / 8;
+  V v0 = V{} + (sip_c0 ^ k0), v1 = V{} + (sip_c1 ^ k1),
+    v2 = V{} + (sip_c2 ^ k0), v3 = V{} + (sip_c3 ^ k1);
+  V m;
+  for (size_t i = 0; i < blocks; i++) {
+    for (size_t l = 0; l < sip_lanes; l++) {
+      m[l] = load_le64(reinterpret_cast<const uint8_t *>(msgs[l]->data()) +
+                       8 * i);
+    }
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+  }
+  for (size_t l = 0; l < sip_lanes; l++) {
+    m[l] = sip_tail(reinterpret_cast<const uint8_t *>(msgs[l]->data()),
+                    msgs[l]->size());
+  }
+  v3 ^= m;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= m;
+
+  v2 ^= V{} + 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  const V h = v0 ^ v1 ^ v2 ^ v3;
+  for (size_t l = 0; l < sip_lanes; l++) {
+    out[l] = h[l];
+  }
+}
+
+__attribute__((target("avx2"))) static void siphash4_avx2(
+    uint64_t k0, uint64_t k1, const std::string *const *msgs,
+    uint64_t *out) {
+  siphash_lanes<v4u64>(k0, k1, msgs, out);
+}
+
+__attribute__((target("avx512f,avx512vl"))) static void siphash4_avx512(
+    uint64_t k0, uint64_t k1, const std::string *const *msgs,
+    uint64_t *out) {
+  siphash_lanes<v4u64>(k0, k1, msgs, out);
+}
+#endif
+
+#undef SIPROUND
+#undef ROTL
+
+typedef void (*siphash4_fn)(uint64_t k0, uint64_t k1,
+                            const std::string *const *msgs, uint64_t *out);
+
+// Reads a bit stream most significant bit first, a word at a time: peek()
+// loads the 64 bits at the current position, so that a run of ones is one
+// count of leading zeros and a remainder one shift.
+class BitReader {
+ public:
+  BitReader(const uint8_t *data, size_t len)
+      : data_(data), len_(len), pos_(0), end_(len * 8) {}
+
+  // read nbits (1 to 57) bits; false if the stream runs out
+  GCS_INLINE bool read(unsigned nbits, uint64_t &out) {
+    if (end_ - pos_ < nbits) {
+      return false;
+    }
+    out = peek() >> (64 - nbits);
+    pos_ += nbits;
+    return true;
+  }
+
+  // count ones up to the next zero, and skip past it
+  GCS_INLINE bool read_unary(uint64_t &out) {
+    out = 0;
+    for (;;) {
+      const size_t valid = std::min<size_t>(peek_bits, end_ - pos_);
+      const unsigned ones = count_ones(peek());
+      if (ones < valid) {
+        out += ones;
+        pos_ += ones + 1;
+        return true;
+      }
+      if (valid == end_ - pos_) {
+        return false;
+      }
+      out += valid;
+      pos_ += valid;
+    }
+  }
+
+  // read a Golomb-Rice coded value with a P-bit remainder
+  template <unsigned P>
+  GCS_INLINE bool read_golomb(uint64_t &value) {
+    // usually the quotient is tiny, and the whole code is in one word
+    const uint64_t word = peek();
+    const unsigned ones = count_ones(word);
+    const size_t used = ones + 1 + P;
+    if (used <= peek_bits && used <= end_ - pos_) {
+      value = (uint64_t(ones) << P) | ((word << (ones + 1)) >> (64 - P));
+      pos_ += used;
+      return true;
+    }
+    uint64_t q, r;
+    if (!read_unary(q) || !read(P, r)) {
+      return false;
+    }
+    value = (q << P) | r;
+    return true;
+  }
+
+ private:
+  // bits of peek() that are always real, unless the stream ends first
+  static constexpr size_t peek_bits = 57;
+
+  const uint8_t *data_;
+  size_t len_;
+  size_t pos_;  // in bits
+  size_t end_;
+
+  // leading ones; this is a single lzcnt where the target has it
+  static GCS_INLINE unsigned count_ones(uint64_t word) {
+    return ~word ? __builtin_clzll(~word) : 64;
+  }
+
+  // the 64 bits from pos_ on, zero filled past the end of the stream
+  GCS_INLINE uint64_t peek() const {
+    const size_t byte = pos_ / 8;
+    uint64_t word;
+    if (byte + sizeof word <= len_) {
+      std::memcpy(&word, data_ + byte, sizeof word);
+      word = be64toh(word);
+    } else {
+      word = 0;
+      for (size_t i = byte; i < len_; i++) {
+        word |= uint64_t(data_[i]) << (56 - 8 * (i - byte));
+      }
+    }
+    return word << (pos_ % 8);
+  }
+};
+
+// Walk the coded set and the sorted queries together, stopping at the
+// first value they share.
+static GCS_INLINE bool match_sorted(const uint8_t *data, size_t len,
+                                    uint64_t n, const uint64_t *queries,
+                                    size_t nqueries) {
+  BitReader reader(data, len);
+  const uint64_t *query = queries, *end = queries + nqueries;
+  uint64_t value = 0;
+  for (uint64_t i = 0; i < n; i++) {
+    uint64_t delta;
+    if (!reader.read_golomb<GcsFilter::P>(delta)) {
+      return false;  // truncated
+    }
+    value += delta;
+    while (*query < value) {
+      if (++query == end) {
+        return false;
+      }
+    }
+    if (*query == value) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The same walk, through the whole set, writing the position of every
+// query that's in it to hits. Returns how many there were.
+static GCS_INLINE size_t collect_sorted(const uint8_t *data, size_t len,
+                                        uint64_t n, const uint64_t *queries,
+                                        size_t nqueries, uint32_t *hits) {
+  BitReader reader(data, len);
+  size_t query = 0, found = 0;
+  uint64_t value = 0;
+  for (uint64_t i = 0; i < n && query < nqueries; i++) {
+    uint64_t delta;
+    if (!reader.read_golomb<GcsFilter::P>(delta)) {
+      break;  // truncated
+    }
+    value += delta;
+    while (query < nqueries && queries[query] < value) {
+      query++;
+    }
+    while (query < nqueries && queries[query] == value) {
+      hits[found++] = query++;
+    }
+  }
+  return found;
+}
+
+typedef bool (*match_fn)(const uint8_t *data, size_t len, uint64_t n,
+                         const uint64_t *queries, size_t nqueries);
+typedef size_t (*collect_fn)(const uint8_t *data, size_t len, uint64_t n,
+                             const uint64_t *queries, size_t nqueries,
+                             uint32_t *hits);
+
+static bool match_generic(const uint8_t *data, size_t len, uint64_t n,
+                          const uint64_t *queries, size_t nqueries) {
+  return match_sorted(data, len, n, queries, nqueries);
+}
+
+static size_t collect_generic(const uint8_t *data, size_t len, uint64_t n,
+                              const uint64_t *queries, size_t nqueries,
+                              uint32_t *hits) {
+  return collect_sorted(data, len, n, queries, nqueries, hits);
+}
+
+#ifdef HAVE_X86
+// the same loop, with lzcnt for the runs and BMI2's flag-free shifts
+__attribute__((target("bmi2,lzcnt"))) static bool match_bmi2(
+    const uint8_t *data, size_t len, uint64_t n, const uint64_t *queries,
+    size_t nqueries) {
+  return match_sorted(data, len, n, queries, nqueries);
+}
+
+__attribute__((target("bmi2,lzcnt"))) static size_t collect_bmi2(
+    const uint8_t *data, size_t len, uint64_t n, const uint64_t *queries,
+    size_t nqueries, uint32_t *hits) {
+  return collect_sorted(data, len, n, queries, nqueries, hits);
+}
+
+// sha256 checks that the OS saves the vector registers
+static bool have_avx512vl() {
+  unsigned eax, ebx, ecx, edx;
+  return sha256::have_avx512() &&
+         __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+         (ebx & bit_AVX512VL);
+}
+
+static bool have_bmi2() {
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) || !(ebx & bit_BMI2)) {
+    return false;
+  }
+  return __get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) &&
+         (ecx & (1 << 5));  // LZCNT
+}
+#endif
+
+struct GcsBackend {
+  const char *siphash_name;
+  siphash4_fn siphash4;  // hashes four messages at once, or nullptr
+  const char *match_name;
+  match_fn match;
+  collect_fn collect;
+};
+
+static GcsBackend select_gcs_backend() {
+  GcsBackend b{"scalar", nullptr, "generic", match_generic,
+               collect_generic};
+#ifdef HAVE_X86
+  if (have_avx512vl()) {
+    b.siphash_name = "avx512vl";
+    b.siphash4 = siphash4_avx512;
+  } else if (sha256::have_avx2()) {
+    b.siphash_name = "avx2";
+    b.siphash4 = siphash4_avx2;
+  }
+  if (have_bmi2()) {
+    b.match_name = "bmi2";
+    b.match = match_bmi2;
+    b.collect = collect_bmi2;
+  }
+#endif
+  return b;
+}
+
+static const GcsBackend &get_gcs_backend() {
+  static const GcsBackend backend = [] {
+    const GcsBackend b = select_gcs_backend();
+    LOG_DEBUG(log, "using {} siphash and {} golomb-rice decoder",
+              b.siphash_name, b.match_name);
+    return b;
+  }();
+  return backend;
+}
+
+void siphash24_batch(uint64_t k0, uint64_t k1, const std::string *elements,
+                     size_t n, uint64_t *out) {
+  const siphash4_fn siphash4 = get_gcs_backend().siphash4;
+#ifdef HAVE_X86
+  if (siphash4 != nullptr && n >= sip_lanes) {
+    // Lanes need the same number of blocks, so group the elements by that
+    // with a counting sort; the rare longer ones are hashed right away.
+    static const size_t max_blocks = 64;
+    size_t starts[max_blocks + 1] = {0};
+    for (size_t i = 0; i < n; i++) {
+      const size_t blocks = elements[i].size() / 8;
+      if (blocks < max_blocks) {
+        starts[blocks + 1]++;
+      } else {
+        out[i] = siphash24(k0, k1, elements[i].data(), elements[i].size());
+      }
+    }
+    for (size_t b = 1; b <= max_blocks; b++) {
+      starts[b] += starts[b - 1];
+    }
+    const size_t grouped = starts[max_blocks];
+    std::vector<size_t> order(grouped);
+    for (size_t i = 0; i < n; i++) {
+      const size_t blocks = elements[i].size() / 8;
+      if (blocks < max_blocks) {
+        order[starts[blocks]++] = i;
+      }
+    }
+
+    // starts[b] is now where the group after b begins
+    size_t i = 0;
+    for (size_t b = 0; b < max_blocks; b++) {
+      const size_t end = starts[b];
+      for (; i + sip_lanes <= end; i += sip_lanes) {
+        const std::string *msgs[sip_lanes];
+        uint64_t hashes[sip_lanes];
+        for (size_t l = 0; l < sip_lanes; l++) {
+          msgs[l] = &elements[order[i + l]];
+        }
+        siphash4(k0, k1, msgs, hashes);
+        for (size_t l = 0; l < sip_lanes; l++) {
+          out[order[i + l]] = hashes[l];
+        }
+      }
+      for (; i < end; i++) {
+        const std::string &elem = elements[order[i]];
+        out[order[i]] = siphash24(k0, k1, elem.data(), elem.size());
+      }
+    }
+    return;
+  }
+#endif
+  for (size_t i = 0; i < n; i++) {
+    out[i] = siphash24(k0, k1, elements[i].data(), elements[i].size());
+  }
+}
+
+class BitWriter {
+ public:
+  explicit BitWriter(std::string &out) : out_(out), byte_(0), used_(0) {}
+
+  void write(uint64_t value, unsigned nbits) {
+    while (nbits--) {
+      byte_ |= ((value >> nbits) & 1) << (7 - used_);
+      if (++used_ == 8) {
+        out_.push_back(static_cast<char>(byte_));
+        byte_ = used_ = 0;
+      }
+    }
+  }
+
+  // write out a partial byte, zero padded
+  void flush() {
+    if (used_) {
+      out_.push_back(static_cast<char>(byte_));
+      byte_ = used_ = 0;
+    }
+  }
+
+ private:
+  std::string &out_;
+  unsigned byte_;
+  unsigned used_;
+};
+
+static inline void golomb_encode(BitWriter &out, uint64_t value) {
+  for (uint64_t q = value >> GcsFilter::P; q > 0; q--) {
+    out.write(1, 1);
+  }
+  out.write(0, 1);
+  out.write(value, GcsFilter::P);
+}
+
+// parse the varint at the start of data, returning its size or 0
+static size_t get_varint(const uint8_t *data, size_t len, uint64_t &value) {
+  if (len == 0) {
+    return 0;
+  }
+  const size_t sz = data[0] < 0xfd ? 1 : 1 + (2 << (data[0] - 0xfd));
+  if (sz > len) {
+    return 0;
+  }
+  if (sz == 1) {
+    value = data[0];
+    return 1;
+  }
+  value = 0;
+  for (size_t i = sz - 1; i > 0; i--) {
+    value = (value << 8) | data[i];
+  }
+  return sz;
+}
+
+static void put_varint(std::string &out, uint64_t value) {
+  size_t sz = 0;
+  if (value < 0xfd) {
+    out.push_back(static_cast<char>(value));
+    return;
+  } else if (value <= 0xffff) {
+    out.push_back('\xfd');
+    sz = 2;
+  } else if (value <= 0xffffffff) {
+    out.push_back('\xfe');
+    sz = 4;
+  } else {
+    out.push_back('\xff');
+    sz = 8;
+  }
+  for (size_t i = 0; i < sz; i++) {
+    out.push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+// the SipHash key is the first 16 bytes of the block hash, in wire order
+static void filter_key(const hash_t &block_hash, uint64_t &k0, uint64_t &k1) {
+  k0 = k1 = 0;
+  for (size_t i = 0; i < 8; i++) {
+    k0 |= uint64_t(block_hash[31 - i]) << (8 * i);
+    k1 |= uint64_t(block_hash[23 - i]) << (8 * i);
+  }
+}
+
+static std::vector<uint64_t> hash_to_range(
+    uint64_t k0, uint64_t k1, uint64_t n,
+    const std::vector<std::string> &elements) {
+  const uint64_t range = n * GcsFilter::M;
+  std::vector<uint64_t> hashes(elements.size());
+  siphash24_batch(k0, k1, elements.data(), elements.size(), hashes.data());
+  for (auto &h : hashes) {
+    h = static_cast<uint64_t>((static_cast<__uint128_t>(h) * range) >> 64);
+  }
+  std::sort(hashes.begin(), hashes.end());
+  return hashes;
+}
+
+GcsFilter::GcsFilter(const hash_t &block_hash, const std::string &encoded)
+    : n_(0), valid_(false), data_(nullptr), len_(0) {
+  filter_key(block_hash, k0_, k1_);
+  const uint8_t *data = reinterpret_cast<const uint8_t *>(encoded.data());
+  const size_t sz = get_varint(data, encoded.size(), n_);
+  // N * M has to fit in 64 bits
+  valid_ = sz != 0 && n_ < (uint64_t(1) << 32);
+  if (valid_) {
+    data_ = data + sz;
+    len_ = encoded.size() - sz;
+  } else {
+    n_ = 0;
+  }
+}
+
+std::string GcsFilter::build(const hash_t &block_hash,
+                             std::vector<std::string> elements) {
+  // the filter is of a set, so duplicates only count once
+  std::sort(elements.begin(), elements.end());
+  elements.erase(std::unique(elements.begin(), elements.end()),
+                 elements.end());
+
+  uint64_t k0, k1;
+  filter_key(block_hash, k0, k1);
+  std::string out;
+  put_varint(out, elements.size());
+  BitWriter writer(out);
+  uint64_t last = 0;
+  for (uint64_t value : hash_to_range(k0, k1, elements.size(), elements)) {
+    golomb_encode(writer, value - last);
+    last = value;
+  }
+  writer.flush();
+  return out;
+}
+
+std::vector<uint64_t> GcsFilter::hash_elements(
+    const std::vector<std::string> &elements) const {
+  return hash_to_range(k0_, k1_, n_, elements);
+}
+
+bool GcsFilter::match_any(const std::vector<std::string> &elements) const {
+  if (n_ == 0 || elements.empty()) {
+    return false;
+  }
+  const std::vector<uint64_t> queries = hash_elements(elements);
+  return get_gcs_backend().match(data_, len_, n_, queries.data(),
+                                 queries.size());
+}
+
+void GcsFilter::match_each(const std::vector<std::string> &elements,
+                           std::vector<uint32_t> &hits) const {
+  hits.clear();
+  if (n_ == 0 || elements.empty()) {
+    return;
+  }
+  // hash_to_range(), keeping track of which element each hash is of
+  const uint64_t range = n_ * M;
+  std::vector<uint64_t> hashes(elements.size());
+  siphash24_batch(k0_, k1_, elements.data(), elements.size(), hashes.data());
+  std::vector<std::pair<uint64_t, uint32_t> > order(elements.size());
+  for (size_t i = 0; i < hashes.size(); i++) {
+    const uint64_t h = static_cast<uint64_t>(
+        (static_cast<__uint128_t>(hashes[i]) * range) >> 64);
+    order[i] = {h, static_cast<uint32_t>(i)};
+  }
+  std::sort(order.begin(), order.end());
+  for (size_t i = 0; i < order.size(); i++) {
+    hashes[i] = order[i].first;
+  }
+
+  hits.resize(elements.size());
+  const size_t found = get_gcs_backend().collect(
+      data_, len_, n_, hashes.data(), hashes.size(), hits.data());
+  hits.resize(found);
+  for (auto &hit : hits) {
+    hit = order[hit].second;
+  }
+  std::sort(hits.begin(), hits.end());
+}
+
+uint32_t FilterMatcher::add_wallet(const std::vector<std::string> &elements) {
+  const uint32_t wallet = wallets_++;
+  elements_.insert(elements_.end(), elements.begin(), elements.end());
+  owners_.insert(owners_.end(), elements.size(), wallet);
+  return wallet;
+}
+
+void FilterMatcher::add(uint32_t wallet, const std::string &element) {
+  assert(wallet < wallets_);
+  elements_.push_back(element);
+  owners_.push_back(wallet);
+}
+
+void FilterMatcher::match(const GcsFilter &filter,
+                          std::vector<uint32_t> &wallets) const {
+  wallets.clear();
+  std::vector<uint32_t> hits;
+  filter.match_each(elements_, hits);
+  for (uint32_t hit : hits) {
+    wallets.push_back(owners_[hit]);
+  }
+  std::sort(wallets.begin(), wallets.end());
+  wallets.erase(std::unique(wallets.begin(), wallets.end()), wallets.end());
+}
+
+hash_t filter_hash(const std::string &encoded) {
+  return pow_hash(encoded.data(), encoded.size(), true);
+}
+
+hash_t filter_header(const hash_t &filter_hash, const hash_t &prev) {
+  // both hashes go in wire order, filter hash first
+  std::array<char, 2 * sizeof(hash_t)> buf;
+  std::reverse_copy(filter_hash.begin(), filter_hash.end(), buf.begin());
+  std::reverse_copy(prev.begin(), prev.end(), buf.begin() + sizeof(hash_t));
+  return pow_hash(buf.data(), buf.size(), true);
+}
+}  // namespace spv
@@ -0,0 +1,116 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "./constants.h"
+
+namespace spv {
+// SipHash-2-4 of data with the 128-bit key (k0, k1)
+uint64_t siphash24(uint64_t k0, uint64_t k1, const void *data, size_t len);
+
+// SipHash-2-4 of each of n elements with the same key into out; elements
+// with the same number of 8-byte blocks are hashed four at a time
+void siphash24_batch(uint64_t k0, uint64_t k1, const std::string *elements,
+                     size_t n, uint64_t *out);
+
+// A BIP158 basic filter: the Golomb-Rice coded set of the scripts a block
+// creates and spends, each hashed to a number below N * M with a key taken
+// from the block hash. The encoded form is what a cfilter message carries,
+// N as a varint followed by the coded deltas between sorted hashes.
+class GcsFilter {
+ public:
+  // the basic filter type's parameters
+  static constexpr unsigned P = 19;
+  static constexpr uint64_t M = 784931;
+
+  // N.B. the filter points into encoded, which has to outlive it
+  GcsFilter() = delete;
+  GcsFilter(const hash_t &block_hash, const std::string &encoded);
+
+  // encode a filter of these elements for the block with this hash
+  static std::string build(const hash_t &block_hash,
+                           std::vector<std::string> elements);
+
+  // number of elements in the set
+  inline uint64_t size() const { return n_; }
+
+  // does the encoded filter look well formed?
+  inline bool valid() const { return valid_; }
+
+  // Is any of these elements (probably) in the set? The elements are all
+  // hashed first and sorted, so the set is decoded just once, however many
+  // there are.
+  bool match_any(const std::vector<std::string> &elements) const;
+
+  // The indices of the elements (probably) in the set, in order. This
+  // decodes the whole set, once, where match_any() can stop at a hit.
+  void match_each(const std::vector<std::string> &elements,
+                  std::vector<uint32_t> &hits) const;
+
+ private:
+  uint64_t k0_, k1_;
+  uint64_t n_;
+  bool valid_;
+  const uint8_t *data_;  // the coded set, after N
+  size_t len_;
+
+  // the elements hashed into [0, N * M), sorted
+  std::vector<uint64_t> hash_elements(
+      const std::vector<std::string> &elements) const;
+};
+
+// Matches many wallets against each filter in one pass. Matching them one
+// at a time decodes every filter once per wallet. This hashes every
+// wallet's elements with the filter's key, sorts them together, decodes
+// the set once against all of them, and sorts the hits out by wallet. A
+// filter then costs about as much as one wallet with all the elements.
+class FilterMatcher {
+ public:
+  FilterMatcher() : wallets_(0) {}
+  FilterMatcher(const FilterMatcher &other) = delete;
+
+  // add a wallet with these elements, returning its id; ids count up from 0
+  uint32_t add_wallet(const std::vector<std::string> &elements = {});
+
+  // add an element to a wallet, e.g. a new address
+  void add(uint32_t wallet, const std::string &element);
+
+  inline uint32_t wallets() const { return wallets_; }
+  inline size_t size() const { return elements_.size(); }
+
+  // the ids of the wallets with an element (probably) in the filter, in
+  // order
+  void match(const GcsFilter &filter, std::vector<uint32_t> &wallets) const;
+
+ private:
+  uint32_t wallets_;
+  std::vector<std::string> elements_;  // of every wallet
+  std::vector<uint32_t> owners_;       // the wallet of each element
+};
+
+// the hash of an encoded filter, which is what a cfheaders message lists
+hash_t filter_hash(const std::string &encoded);
+
+// the filter header following prev for a block with this filter hash
+hash_t filter_header(const hash_t &filter_hash, const hash_t &prev);
+}  // namespace spv
@@ -0,0 +1,144 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+// A micro-benchmark of compact filter matching, the inner loop of a rescan:
+//
+//   gcs_bench [filters] [elements per filter] [watched scripts] [wallets]
+//
+// It builds random filters, and then times hashing the watched scripts and
+// matching them against each filter. The scripts never match, so every
+// filter is decoded to the end, as most are during a rescan. Then it splits
+// the scripts among the wallets, and times matching each wallet in turn
+// against a FilterMatcher doing them all at once.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "./gcs.h"
+#include "./logging.h"
+
+using namespace spv;
+
+// the lengths of P2WPKH, P2SH, P2PKH and P2WSH/P2TR output scripts
+static const size_t script_sizes[] = {22, 23, 25, 34};
+
+static std::vector<std::string> random_scripts(std::mt19937_64 &rng,
+                                               size_t n) {
+  std::vector<std::string> out(n);
+  for (auto &script : out) {
+    script.resize(script_sizes[rng() % 4]);
+    for (auto &c : script) {
+      c = static_cast<char>(rng());
+    }
+  }
+  return out;
+}
+
+static double elapsed_ns(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+int main(int argc, char **argv) {
+  const size_t filters = argc > 1 ? std::stoul(argv[1]) : 1000;
+  const size_t elements = argc > 2 ? std::stoul(argv[2]) : 5000;
+  const size_t watched = argc > 3 ? std::stoul(argv[3]) : 100;
+  const size_t wallets = argc > 4 ? std::max(std::stoul(argv[4]), 1UL) : 100;
+  spdlog::set_level(spdlog::level::debug);  // show the chosen backends
+
+  std::mt19937_64 rng(1);
+  std::vector<hash_t> block_hashes(filters);
+  std::vector<std::string> encoded(filters);
+  size_t total_bytes = 0;
+  for (size_t i = 0; i < filters; i++) {
+    for (auto &b : block_hashes[i]) {
+      b = static_cast<uint8_t>(rng());
+    }
+    encoded[i] =
+        GcsFilter::build(block_hashes[i], random_scripts(rng, elements));
+    total_bytes += encoded[i].size();
+  }
+  const std::vector<std::string> scripts = random_scripts(rng, watched);
+  std::printf("%zu filters of %zu elements (%zu bytes each), %zu scripts\n",
+              filters, elements, total_bytes / filters, watched);
+
+  // hashing, one at a time and batched
+  std::vector<uint64_t> hashes(watched);
+  uint64_t sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < filters; i++) {
+    for (size_t j = 0; j < watched; j++) {
+      hashes[j] = siphash24(i, j, scripts[j].data(), scripts[j].size());
+    }
+    sink += hashes[0];
+  }
+  std::printf("siphash24:       %6.1f ns/script\n",
+              elapsed_ns(start) / (filters * watched));
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < filters; i++) {
+    siphash24_batch(i, 0, scripts.data(), watched, hashes.data());
+    sink += hashes[0];
+  }
+  std::printf("siphash24_batch: %6.1f ns/script\n",
+              elapsed_ns(start) / (filters * watched));
+
+  // matching, which is the hashing plus one pass over the filter
+  size_t matches = 0;
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < filters; i++) {
+    const GcsFilter filter(block_hashes[i], encoded[i]);
+    matches += filter.match_any(scripts);
+  }
+  const double ns = elapsed_ns(start);
+  std::printf("match_any:       %6.1f us/filter, %.2f ns/element\n",
+              ns / filters / 1000, ns / (filters * elements));
+  std::printf("%zu false positive(s)\n", matches);
+
+  // the same scripts as separate wallets
+  std::vector<std::vector<std::string> > split(wallets);
+  FilterMatcher matcher;
+  for (size_t j = 0; j < watched; j++) {
+    split[j % wallets].push_back(scripts[j]);
+  }
+  for (const auto &wallet : split) {
+    matcher.add_wallet(wallet);
+  }
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < filters; i++) {
+    const GcsFilter filter(block_hashes[i], encoded[i]);
+    for (const auto &wallet : split) {
+      sink += filter.match_any(wallet);
+    }
+  }
+  std::printf("%zu wallets, one at a time: %7.1f us/filter\n", wallets,
+              elapsed_ns(start) / filters / 1000);
+  std::vector<uint32_t> hit;
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < filters; i++) {
+    const GcsFilter filter(block_hashes[i], encoded[i]);
+    matcher.match(filter, hit);
+    sink += hit.size();
+  }
+  std::printf("%zu wallets, FilterMatcher: %7.1f us/filter\n", wallets,
+              elapsed_ns(start) / filters / 1000);
+  return sink == 42;  // keep the hashing from being optimized out
+}
@@ -0,0 +1,590 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+// Writes a synthetic chain of headers, as long as a benchmark needs:
+//
+//   spv-gen-chain [-n headers] [-N network] [-s spacing] [-b] [-f forks]
+//                 [-r reorg depth] [-c checkpoint interval] [-p]
+//                 [-g gap us] prefix
+//
+// The headers aren't mined: each is built on the last at the network's
+// proof-of-work limit, with the nBits the difficulty rules give it, and
+// nothing else about it is checked before it's written. The files are
+//
+//   prefix.headers      the chain from the genesis block, 80 bytes a header,
+//                       as written by spv --export-headers
+//   prefix.checkpoints  a checkpoint every -c headers (100000, or 0 for
+//                       none) and at the tip, for --checkpoints
+//   prefix.reorgs       with -f, the same chain with forks spliced in
+//   prefix.capture      with -p, a replay capture of a peer serving it
+//
+// so that a client can sync without proof-of-work checks (--assume-valid
+// trusts the headers below the last checkpoint):
+//
+//   spv-bench-sync prefix.headers -- --checkpoints prefix.checkpoints
+//                  --assume-valid
+//   spv-replay prefix.capture -- --checkpoints prefix.checkpoints
+//              --assume-valid
+//   chain_bench -i prefix
+//
+// Headers are -s seconds apart (1 to TARGET_SPACING, and by default
+// whatever fits between the genesis block and now), except for the last
+// header of each retarget interval, which is dated a whole timespan after
+// its first so that the difficulty stays at the limit. With -b, every
+// other interval goes without that, so the difficulty goes up as far as
+// the retarget allows and comes back down in the next one.
+//
+// The -f forks branch off at even spacing along the chain, each one header
+// longer than the -r headers above its fork point. In prefix.reorgs a fork
+// comes right after the last of those, so a chain that takes the headers
+// in order switches to the fork, and then back once the main chain has
+// grown past it. Forks share the main chain's times and nBits, and are told
+// apart by their merkle roots. The capture has only the main chain, since
+// the forks aren't checkpointed, and it sends a headers message every -g
+// microseconds (1000), split at the checkpoints the way a client asks for
+// them; spv-replay then has to run without --max-speed.
+//
+// The main chain is hashed a header at a time, since each header has its
+// parent's hash in it. The forks are hashed in lockstep with
+// double_hash80_batch(), and the capture's messages are encoded on the
+// worker pool.
+
+#include <endian.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "./addr.h"
+#include "./capture.h"
+#include "./constants.h"
+#include "./fields.h"
+#include "./message.h"
+#include "./network.h"
+#include "./pow.h"
+#include "./scheduler.h"
+#include "./sha256.h"
+#include "./util.h"
+
+using namespace spv;
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+// headers written or read back at a time, 8 MB worth
+static const size_t chunk_size = 100000;
+
+// headers messages encoded in one go on the workers
+static const size_t capture_batch = 64;
+
+// the capture's first headers message comes this long after the handshake,
+// when the client has picked its segments
+static const uint64_t capture_lead_ns = 100000000;
+
+// How far before now the schedule has to end: the latest header of an
+// interval with -b is dated four timespans after its first.
+static const uint32_t schedule_margin = 5 * TARGET_TIMESPAN;
+
+// with less than a second between them, the first few headers would tie
+// with the median time past of the ones before
+static const double min_spacing = 1;
+
+struct Options {
+  size_t headers = 1000000;
+  double spacing = 0;  // 0 for what fits before now
+  bool transitions = false;
+  size_t forks = 0;
+  size_t depth = 100;
+  size_t checkpoint_interval = 100000;
+  bool capture = false;
+  uint64_t gap_ns = 1000000;
+  std::string prefix;
+};
+
+// The time of every header, a function of its height alone, so that forks
+// can share it with the main chain.
+class Schedule {
+ public:
+  Schedule(uint32_t start, double spacing, bool transitions)
+      : start_(start), spacing_(spacing), transitions_(transitions) {}
+
+  uint32_t time(size_t height) const {
+    const uint32_t plain = at(height);
+    if ((height + 1) % RETARGET_INTERVAL != 0) {
+      return plain;
+    }
+    const size_t interval = height / RETARGET_INTERVAL;
+    if (transitions_ && interval % 2 == 0) {
+      return plain;  // the difficulty goes up
+    }
+    // A timespan of four brings the difficulty back down after one that
+    // went up, and more is clamped anyway.
+    const uint32_t span = (transitions_ ? 4 : 1) * TARGET_TIMESPAN;
+    return std::max(plain, at(interval * RETARGET_INTERVAL) + span);
+  }
+
+ private:
+  const uint32_t start_;
+  const double spacing_;
+  const bool transitions_;
+
+  inline uint32_t at(size_t height) const {
+    return start_ + uint32_t(height * spacing_);
+  }
+};
+
+inline void put32(uint8_t *p, uint32_t val) {
+  val = htole32(val);
+  std::memcpy(p, &val, sizeof val);
+}
+
+inline uint32_t get32(const uint8_t *p) {
+  uint32_t val;
+  std::memcpy(&val, p, sizeof val);
+  return le32toh(val);
+}
+
+// A fork's headers, a copy of the main chain's above the fork point until
+// they're rehashed onto the fork.
+struct Fork {
+  size_t point;  // the height it branches off at
+  std::vector<uint8_t> raw;
+};
+
+class Generator {
+ public:
+  explicit Generator(const Options &opts)
+      : opts_(opts),
+        schedule_(BlockHeader::genesis().timestamp, opts.spacing,
+                  opts.transitions) {
+    for (size_t k = 0; k < opts.forks; k++) {
+      Fork fork;
+      fork.point = (k + 1) * opts.headers / (opts.forks + 1);
+      fork.raw.resize((opts.depth + 1) * BLOCK_HEADER_SIZE);
+      forks_.push_back(std::move(fork));
+    }
+  }
+
+  // write prefix.headers and prefix.checkpoints, and fill in the forks
+  bool main_chain();
+
+  // rehash the forks onto themselves
+  void forks();
+
+  // write prefix.reorgs from prefix.headers and the forks
+  bool reorgs();
+
+  // write prefix.capture from prefix.headers
+  bool capture();
+
+ private:
+  const Options &opts_;
+  const Schedule schedule_;
+  std::vector<Fork> forks_;
+  std::vector<size_t> checkpoints_;  // heights, ascending
+
+  inline std::string path(const char *ext) const {
+    return opts_.prefix + ext;
+  }
+
+  // the last height of the headers message that starts at this height
+  size_t message_end(size_t start) const {
+    size_t end = std::min(opts_.headers, start + MAX_HEADERS_RESULTS - 1);
+    auto it = std::lower_bound(checkpoints_.begin(), checkpoints_.end(),
+                               start);
+    if (it != checkpoints_.end()) {
+      end = std::min(end, *it);
+    }
+    return end;
+  }
+};
+
+bool Generator::main_chain() {
+  std::FILE *out = std::fopen(path(".headers").c_str(), "wb");
+  if (out == nullptr) {
+    std::perror(path(".headers").c_str());
+    return false;
+  }
+  std::ofstream checkpoints(path(".checkpoints"));
+  checkpoints << "# " << opts_.headers << " synthetic headers\n";
+
+  // each chunk starts with the last header of the one before, whose hash
+  // is the next one's prev_block
+  std::vector<uint8_t> chunk((chunk_size + 1) * BLOCK_HEADER_SIZE);
+  std::memcpy(chunk.data(), network().genesis_header.data(),
+              BLOCK_HEADER_SIZE);
+  std::fwrite(chunk.data(), BLOCK_HEADER_SIZE, 1, out);
+  const uint8_t *genesis = chunk.data();
+  uint32_t parent_bits = get32(genesis + 72);
+  uint32_t parent_time = get32(genesis + 68);
+  uint32_t first_bits = parent_bits, first_time = parent_time;
+  size_t next_fork = 0;
+
+  for (size_t height = 1; height <= opts_.headers;) {
+    const size_t n = std::min(chunk_size, opts_.headers + 1 - height);
+    for (size_t i = 1; i <= n; i++, height++) {
+      const uint8_t *prev = &chunk[(i - 1) * BLOCK_HEADER_SIZE];
+      uint8_t *hdr = &chunk[i * BLOCK_HEADER_SIZE];
+      const uint32_t time = schedule_.time(height);
+      const uint32_t bits =
+          next_difficulty(height - 1, parent_bits, parent_time, first_bits,
+                          first_time, time);
+      put32(hdr, 0x20000000);
+      sha256::double_hash80(prev, hdr + 4);
+      std::memset(hdr + 36, 0, 32);  // merkle root
+      put32(hdr + 68, time);
+      put32(hdr + 72, bits);
+      put32(hdr + 76, 0);  // nonce
+      if (height % RETARGET_INTERVAL == 0) {
+        first_bits = bits;
+        first_time = time;
+      }
+      parent_bits = bits;
+      parent_time = time;
+
+      while (next_fork < forks_.size() &&
+             forks_[next_fork].point + opts_.depth + 1 < height) {
+        next_fork++;
+      }
+      for (size_t k = next_fork;
+           k < forks_.size() && forks_[k].point < height; k++) {
+        std::memcpy(&forks_[k].raw[(height - forks_[k].point - 1) *
+                                   BLOCK_HEADER_SIZE],
+                    hdr, BLOCK_HEADER_SIZE);
+      }
+    }
+    if (std::fwrite(&chunk[BLOCK_HEADER_SIZE], BLOCK_HEADER_SIZE, n, out) !=
+        n) {
+      std::perror(path(".headers").c_str());
+      std::fclose(out);
+      return false;
+    }
+
+    // checkpoints in this chunk, and the tip
+    for (size_t h = height - n; h < height; h++) {
+      if ((opts_.checkpoint_interval && h % opts_.checkpoint_interval == 0) ||
+          h == opts_.headers) {
+        const hash_t hash = pow_hash(
+            reinterpret_cast<const char *>(
+                &chunk[(h + n + 1 - height) * BLOCK_HEADER_SIZE]),
+            BLOCK_HEADER_SIZE, true);
+        checkpoints << h << " " << to_hex(hash) << "\n";
+        checkpoints_.push_back(h);
+      }
+    }
+    std::memcpy(chunk.data(), &chunk[n * BLOCK_HEADER_SIZE],
+                BLOCK_HEADER_SIZE);
+  }
+  if (std::fclose(out) != 0 || !checkpoints.flush()) {
+    std::perror(opts_.prefix.c_str());
+    return false;
+  }
+  return true;
+}
+
+void Generator::forks() {
+  if (forks_.empty()) {
+    return;
+  }
+  // Step s of every fork at once, in lanes of double_hash80_batch(), which
+  // wants the headers at a fixed stride; so copy them in side by side,
+  // hash them, and put the hashes in the next step's prev_block.
+  const size_t n = forks_.size();
+  std::vector<uint8_t> step(n * BLOCK_HEADER_SIZE), hashes(n * 32);
+  for (size_t s = 0; s <= opts_.depth; s++) {
+    for (size_t k = 0; k < n; k++) {
+      uint8_t *hdr = &forks_[k].raw[s * BLOCK_HEADER_SIZE];
+      if (s > 0) {
+        std::memcpy(hdr + 4, &hashes[k * 32], 32);
+      }
+      put32(hdr + 36, k + 1);  // the fork's salt, in the merkle root
+      std::memcpy(&step[k * BLOCK_HEADER_SIZE], hdr, BLOCK_HEADER_SIZE);
+    }
+    sha256::double_hash80_batch(step.data(), BLOCK_HEADER_SIZE, n,
+                                hashes.data());
+  }
+}
+
+bool Generator::reorgs() {
+  std::FILE *in = std::fopen(path(".headers").c_str(), "rb");
+  std::FILE *out = std::fopen(path(".reorgs").c_str(), "wb");
+  if (in == nullptr || out == nullptr) {
+    std::perror(opts_.prefix.c_str());
+    if (in != nullptr) {
+      std::fclose(in);
+    }
+    if (out != nullptr) {
+      std::fclose(out);
+    }
+    return false;
+  }
+  // copy the main chain, stopping after each fork's last main header
+  std::vector<uint8_t> buf(chunk_size * BLOCK_HEADER_SIZE);
+  size_t height = 0;  // of the next header to copy
+  bool ok = true;
+  for (size_t k = 0; k <= forks_.size() && ok; k++) {
+    const size_t stop =
+        k < forks_.size() ? forks_[k].point + opts_.depth + 1
+                          : opts_.headers + 1;
+    while (height < stop && ok) {
+      const size_t n = std::min(chunk_size, stop - height);
+      ok = std::fread(buf.data(), BLOCK_HEADER_SIZE, n, in) == n &&
+           std::fwrite(buf.data(), BLOCK_HEADER_SIZE, n, out) == n;
+      height += n;
+    }
+    if (k < forks_.size() && ok) {
+      ok = std::fwrite(forks_[k].raw.data(), forks_[k].raw.size(), 1, out) ==
+           1;
+    }
+  }
+  std::fclose(in);
+  if (std::fclose(out) != 0 || !ok) {
+    std::fprintf(stderr, "failed to write %s\n", path(".reorgs").c_str());
+    return false;
+  }
+  return true;
+}
+
+// a record of peer 0, the only one
+void put_record(std::FILE *out, uint64_t time, CaptureType type,
+                const char *data, size_t size) {
+  CaptureRecord rec;
+  std::memset(&rec, 0, sizeof rec);
+  rec.time = time;
+  rec.type = type;
+  rec.size = size;
+  std::fwrite(&rec, sizeof rec, 1, out);
+  if (size) {
+    std::fwrite(data, size, 1, out);
+  }
+}
+
+void put_message(std::FILE *out, uint64_t time, const Message &msg) {
+  size_t size;
+  const auto data = msg.encode(size);
+  put_record(out, time, CaptureType::RECV, data.get(), size);
+}
+
+bool Generator::capture() {
+  std::FILE *in = std::fopen(path(".headers").c_str(), "rb");
+  std::FILE *out = std::fopen(path(".capture").c_str(), "wb");
+  if (in == nullptr || out == nullptr) {
+    std::perror(opts_.prefix.c_str());
+    if (in != nullptr) {
+      std::fclose(in);
+    }
+    if (out != nullptr) {
+      std::fclose(out);
+    }
+    return false;
+  }
+  std::fwrite(CAPTURE_MAGIC, sizeof CAPTURE_MAGIC, 1, out);
+
+  // a loopback peer that says it has the whole chain
+  Addr addr;
+  addr.set_ip("127.0.0.1");
+  char payload[sizeof(addrbuf_t) + sizeof(uint16_t)];
+  const uint16_t port = network().port;
+  std::memcpy(payload, addr.addrbuf().data(), sizeof(addrbuf_t));
+  std::memcpy(payload + sizeof(addrbuf_t), &port, sizeof port);
+  put_record(out, 0, CaptureType::OPEN, payload, sizeof payload);
+  Version version;
+  version.version = 70016;
+  version.services = NODE_NETWORK;
+  version.timestamp = std::time(nullptr);
+  version.nonce = 1;
+  version.user_agent = "/spv-gen-chain/";
+  version.start_height = opts_.headers;
+  put_message(out, 0, version);
+  put_message(out, 0, VerAck{});
+
+  // a batch of messages at a time, read in, encoded on the workers and
+  // written out in order
+  std::fseek(in, BLOCK_HEADER_SIZE, SEEK_SET);  // past the genesis block
+  std::vector<char> raw;
+  std::vector<size_t> starts;
+  std::vector<std::unique_ptr<char[]>> encoded(capture_batch);
+  std::vector<size_t> sizes(capture_batch);
+  uint64_t time = capture_lead_ns;
+  bool ok = true;
+  for (size_t height = 1; height <= opts_.headers && ok;) {
+    starts.clear();
+    for (size_t h = height; h <= opts_.headers && starts.size() < capture_batch;
+         h = message_end(h) + 1) {
+      starts.push_back(h);
+    }
+    const size_t last = message_end(starts.back());
+    raw.resize((last + 1 - height) * BLOCK_HEADER_SIZE);
+    if (std::fread(raw.data(), raw.size(), 1, in) != 1) {
+      ok = false;
+      break;
+    }
+    {
+      TaskGroup group;
+      for (size_t i = 0; i < starts.size(); i++) {
+        group.run([&, i, net = &network()]() {
+          NetworkScope scope(*net);
+          HeadersMsg msg;
+          msg.block_headers.resize(message_end(starts[i]) + 1 - starts[i]);
+          const char *p = &raw[(starts[i] - height) * BLOCK_HEADER_SIZE];
+          for (auto &hdr : msg.block_headers) {
+            hdr.unpack(p);
+            p += BLOCK_HEADER_SIZE;
+          }
+          encoded[i] = msg.encode(sizes[i]);
+        });
+      }
+    }
+    for (size_t i = 0; i < starts.size(); i++) {
+      put_record(out, time, CaptureType::RECV, encoded[i].get(), sizes[i]);
+      time += opts_.gap_ns;
+    }
+    height = last + 1;
+  }
+  std::fclose(in);
+  if (std::fclose(out) != 0 || !ok) {
+    std::fprintf(stderr, "failed to write %s\n", path(".capture").c_str());
+    return false;
+  }
+  return true;
+}
+
+void usage(const char *prog) {
+  std::fprintf(stderr,
+               "usage: %s [-n headers] [-N network] [-s spacing] [-b] "
+               "[-f forks]\n"
+               "       [-r reorg depth] [-c checkpoint interval] [-p] "
+               "[-g gap us] prefix\n",
+               prog);
+}
+
+double elapsed(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options opts;
+  Network net = Network::TESTNET;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:N:s:bf:r:c:pg:h")) != -1) {
+    switch (opt) {
+      case 'n':
+        opts.headers = std::strtoul(optarg, nullptr, 10);
+        break;
+      case 'N':
+        if (!find_network(optarg, net)) {
+          std::fprintf(stderr, "unknown network %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 's':
+        opts.spacing = std::strtod(optarg, nullptr);
+        break;
+      case 'b':
+        opts.transitions = true;
+        break;
+      case 'f':
+        opts.forks = std::strtoul(optarg, nullptr, 10);
+        break;
+      case 'r':
+        opts.depth = std::strtoul(optarg, nullptr, 10);
+        break;
+      case 'c':
+        opts.checkpoint_interval = std::strtoul(optarg, nullptr, 10);
+        break;
+      case 'p':
+        opts.capture = true;
+        break;
+      case 'g':
+        opts.gap_ns = std::strtoull(optarg, nullptr, 10) * 1000;
+        break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind + 1 != argc || opts.headers < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  opts.prefix = argv[optind];
+  select_network(net);
+
+  // the schedule has to end well before now, or the last headers would be
+  // too far in the future
+  const uint32_t genesis_time = BlockHeader::genesis().timestamp;
+  const double room = double(std::time(nullptr)) - genesis_time -
+                      schedule_margin;
+  if (opts.spacing == 0) {
+    opts.spacing = std::min<double>(TARGET_SPACING, room / opts.headers);
+  } else if (opts.spacing > TARGET_SPACING) {
+    std::fprintf(stderr, "headers can be at most %u s apart\n",
+                 TARGET_SPACING);
+    return 1;
+  }
+  if (opts.spacing < min_spacing || opts.spacing * opts.headers > room) {
+    std::fprintf(stderr,
+                 "%zu headers %.2f s apart don't fit between the genesis "
+                 "block and now\n",
+                 opts.headers, opts.spacing);
+    return 1;
+  }
+  // each fork needs its depth of main chain above it, and one more header
+  // for the main chain to take back over
+  if (opts.forks &&
+      opts.forks * opts.headers / (opts.forks + 1) + opts.depth + 2 >
+          opts.headers) {
+    std::fprintf(stderr, "%zu forks %zu deep don't fit in %zu headers\n",
+                 opts.forks, opts.depth, opts.headers);
+    return 1;
+  }
+
+  const auto begin = Clock::now();
+  Generator gen(opts);
+  if (!gen.main_chain()) {
+    return 1;
+  }
+  std::printf("%zu headers %.2f s apart in %.2f s\n", opts.headers,
+              opts.spacing, elapsed(begin));
+  if (opts.forks) {
+    const auto forks_begin = Clock::now();
+    gen.forks();
+    if (!gen.reorgs()) {
+      return 1;
+    }
+    std::printf("%zu forks of %zu headers in %.2f s\n", opts.forks,
+                opts.depth + 1, elapsed(forks_begin));
+  }
+  if (opts.capture) {
+    const auto capture_begin = Clock::now();
+    if (!gen.capture()) {
+      return 1;
+    }
+    std::printf("capture in %.2f s\n", elapsed(capture_begin));
+  }
+  return 0;
+}
@@ -0,0 +1,327 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "./constants.h"
+#include "./fields.h"
+
+namespace spv {
+// Block hashes are already uniformly distributed, so there's no point in
+// hashing them again. N.B. hash_t is stored most significant byte first,
+// which means the leading bytes are the proof-of-work zeros; the low-order
+// bytes are used instead.
+struct BlockHashHasher {
+  inline std::size_t operator()(const hash_t &hash) const noexcept {
+    std::size_t h;
+    std::memcpy(&h, hash.data() + sizeof(hash_t) - sizeof h, sizeof h);
+    return h;
+  }
+};
+
+struct InvHasher {
+  inline std::size_t operator()(const Inv &inv) const noexcept {
+    return BlockHashHasher{}(inv.hash) ^ static_cast<uint32_t>(inv.type);
+  }
+};
+
+// A blocked bloom filter of block hashes, which answers most lookups of
+// hashes that aren't in a set from one cache line. Each hash sets
+// bits_per_hash bits in a single 64-byte block, so a lookup touches one
+// line even when the set's own table is far out of cache; at 16 bits per
+// hash about 0.1% of absent hashes get through. Like BlockHashHasher it
+// uses the hash bytes directly: the block comes from the high half of the
+// hasher's word, so it's independent of a FlatHashMap's slot, and the bits
+// from the eight bytes before it.
+class HashFilter {
+ public:
+  HashFilter() : mask_(0), capacity_(0) {}
+
+  // how many hashes it's sized for, before the rate starts to degrade
+  inline size_t capacity() const { return capacity_; }
+
+  inline size_t memory_usage() const {
+    return blocks_.capacity() * sizeof(Block);
+  }
+
+  // size the filter for n hashes, dropping the ones already added
+  void reset(size_t n) {
+    size_t blocks = 1;
+    while (blocks * bits_per_block < n * bits_per_slot) {
+      blocks *= 2;
+    }
+    blocks_.assign(blocks, Block{});
+    mask_ = blocks - 1;
+    capacity_ = blocks * bits_per_block / bits_per_slot;
+  }
+
+  inline void add(const hash_t &hash) {
+    uint64_t bits;
+    uint64_t *words = blocks_[locate(hash, &bits)].words;
+    for (size_t i = 0; i < bits_per_hash; i++, bits >>= 9) {
+      words[(bits >> 6) & 7] |= uint64_t(1) << (bits & 63);
+    }
+  }
+
+  // false if the hash was never added; an empty filter has nothing in it
+  inline bool may_contain(const hash_t &hash) const {
+    if (blocks_.empty()) {
+      return false;
+    }
+    uint64_t bits;
+    const uint64_t *words = blocks_[locate(hash, &bits)].words;
+    for (size_t i = 0; i < bits_per_hash; i++, bits >>= 9) {
+      if (!(words[(bits >> 6) & 7] & (uint64_t(1) << (bits & 63)))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // start loading the line may_contain(hash) reads, for a batch of lookups
+  inline void prefetch(const hash_t &hash) const {
+    if (!blocks_.empty()) {
+      uint64_t bits;
+      __builtin_prefetch(&blocks_[locate(hash, &bits)]);
+    }
+  }
+
+ private:
+  struct alignas(64) Block {
+    uint64_t words[8];
+  };
+
+  const static size_t bits_per_block = sizeof(Block) * 8;
+  const static size_t bits_per_slot = 16;
+  const static size_t bits_per_hash = 6;  // 9 bits of the word each
+
+  // the block for a hash, and the word its bit positions are taken from
+  inline size_t locate(const hash_t &hash, uint64_t *bits) const {
+    uint32_t block;
+    std::memcpy(&block, hash.data() + sizeof(hash_t) - sizeof block,
+                sizeof block);
+    std::memcpy(bits, hash.data() + sizeof(hash_t) - 2 * sizeof *bits,
+                sizeof *bits);
+    return block & mask_;
+  }
+
+  std::vector<Block> blocks_;
+  size_t mask_;
+  size_t capacity_;
+};
+
+// An open addressing hash map that stores its entries inline and uses
+// linear probing, for keys whose hashes are already well distributed. The
+// table is kept at most 3/4 full, and erase() shifts the following entries
+// back rather than leaving tombstones, so probe sequences stay short. Keys
+// and values must be default constructible. N.B. a pointer returned by
+// find() or emplace() is only valid until the next insert or erase. The
+// table is allocated with (a rebinding of) Alloc.
+template <typename K, typename V, typename Hasher = BlockHashHasher,
+          typename Alloc = std::allocator<char> >
+class FlatHashMap {
+ public:
+  FlatHashMap() : size_(0) {}
+
+  inline size_t size() const { return size_; }
+  inline bool empty() const { return size_ == 0; }
+
+  // the bytes of the table itself, not counting anything the values own
+  inline size_t memory_usage() const {
+    return slots_.capacity() * sizeof(Slot);
+  }
+
+  void clear() {
+    slots_.clear();
+    size_ = 0;
+  }
+
+  // make room for n entries without rehashing
+  void reserve(size_t n) {
+    size_t capacity = min_capacity;
+    while (capacity * 3 / 4 < n) {
+      capacity *= 2;
+    }
+    if (capacity > slots_.size()) {
+      rehash(capacity);
+    }
+  }
+
+  inline bool contains(const K &key) const { return lookup(key) != npos; }
+
+  // Start loading the slot a lookup of key starts probing at. For a batch
+  // of independent lookups, prefetching every key before probing any
+  // overlaps their cache misses instead of taking them one at a time.
+  inline void prefetch(const K &key) const {
+    if (!slots_.empty()) {
+      __builtin_prefetch(&slots_[probe_start(key)]);
+    }
+  }
+
+  inline V *find(const K &key) {
+    const size_t i = lookup(key);
+    return i == npos ? nullptr : &slots_[i].value;
+  }
+
+  inline const V *find(const K &key) const {
+    const size_t i = lookup(key);
+    return i == npos ? nullptr : &slots_[i].value;
+  }
+
+  // Insert the key if it's missing. Returns its value, and whether it was
+  // inserted.
+  std::pair<V *, bool> emplace(const K &key, V value = V()) {
+    const size_t i = lookup(key);
+    if (i != npos) {
+      return {&slots_[i].value, false};
+    }
+    if ((size_ + 1) * 4 > slots_.size() * 3) {
+      rehash(slots_.empty() ? min_capacity : slots_.size() * 2);
+    }
+    return {&insert_new(key, std::move(value)), true};
+  }
+
+  inline V &operator[](const K &key) { return *emplace(key).first; }
+
+  bool erase(const K &key) {
+    size_t hole = lookup(key);
+    if (hole == npos) {
+      return false;
+    }
+    for (size_t i = next(hole); slots_[i].full; i = next(i)) {
+      // move this entry into the hole unless its probe sequence starts
+      // after the hole
+      const size_t home = probe_start(slots_[i].key);
+      if (((i - home) & mask()) >= ((i - hole) & mask())) {
+        slots_[hole] = std::move(slots_[i]);
+        hole = i;
+      }
+    }
+    slots_[hole] = Slot();
+    size_--;
+    return true;
+  }
+
+  // call fn(key, value) for every entry, in no particular order
+  template <typename F>
+  void for_each(F fn) const {
+    for (const auto &slot : slots_) {
+      if (slot.full) {
+        fn(slot.key, slot.value);
+      }
+    }
+  }
+
+ private:
+  struct Slot {
+    K key;
+    V value;
+    bool full;
+
+    Slot() : key(), value(), full(false) {}
+  };
+
+  typedef std::vector<
+      Slot, typename std::allocator_traits<Alloc>::template rebind_alloc<Slot> >
+      Slots;
+
+  static constexpr size_t npos = static_cast<size_t>(-1);
+  static constexpr size_t min_capacity = 16;
+
+  Slots slots_;  // the size is always zero or a power of two
+  size_t size_;
+
+  inline size_t mask() const { return slots_.size() - 1; }
+  inline size_t next(size_t i) const { return (i + 1) & mask(); }
+
+  inline size_t probe_start(const K &key) const {
+    return Hasher{}(key) & mask();
+  }
+
+  size_t lookup(const K &key) const {
+    if (slots_.empty()) {
+      return npos;
+    }
+    for (size_t i = probe_start(key);; i = next(i)) {
+      if (!slots_[i].full) {
+        return npos;
+      }
+      if (slots_[i].key == key) {
+        return i;
+      }
+    }
+  }
+
+  // insert a key that isn't in the table, which must have a free slot
+  V &insert_new(const K &key, V &&value) {
+    size_t i = probe_start(key);
+    while (slots_[i].full) {
+      i = next(i);
+    }
+    slots_[i].key = key;
+    slots_[i].value = std::move(value);
+    slots_[i].full = true;
+    size_++;
+    return slots_[i].value;
+  }
+
+  void rehash(size_t capacity) {
+    Slots old(capacity);
+    old.swap(slots_);
+    size_ = 0;
+    for (auto &slot : old) {
+      if (slot.full) {
+        insert_new(slot.key, std::move(slot.value));
+      }
+    }
+  }
+};
+
+// A set version of FlatHashMap.
+template <typename K, typename Hasher = BlockHashHasher>
+class FlatHashSet {
+ public:
+  inline size_t size() const { return map_.size(); }
+  inline bool empty() const { return map_.empty(); }
+  inline void clear() { map_.clear(); }
+  inline void reserve(size_t n) { map_.reserve(n); }
+  inline size_t memory_usage() const { return map_.memory_usage(); }
+  inline bool contains(const K &key) const { return map_.contains(key); }
+
+  // returns true if the key wasn't already in the set
+  inline bool insert(const K &key) { return map_.emplace(key).second; }
+
+  inline bool erase(const K &key) { return map_.erase(key); }
+
+  // call fn(key) for every key, in no particular order
+  template <typename F>
+  void for_each(F fn) const {
+    map_.for_each([&](const K &key, const Empty &) { fn(key); });
+  }
+
+ private:
+  struct Empty {};
+
+  FlatHashMap<K, Empty, Hasher> map_;
+};
+}  // namespace spv
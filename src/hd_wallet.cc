@@ -0,0 +1,250 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./hd_wallet.h"
+
+#include <endian.h>
+#include <secp256k1.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#include "./ripemd160.h"
+#include "./scheduler.h"
+#include "./sha256.h"
+#include "./sha512.h"
+
+namespace spv {
+// indexes of a chain that one thread derives at a time
+static const uint32_t batch_size = 1024;
+
+static const size_t payload_size = 78;
+
+static bool base58_decode(const std::string &str, std::vector<uint8_t> &out) {
+  static const char alphabet[] =
+      "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+  size_t zeros = 0;
+  while (zeros < str.size() && str[zeros] == '1') {
+    zeros++;
+  }
+  std::vector<uint8_t> num;  // big-endian
+  for (size_t i = zeros; i < str.size(); i++) {
+    const char *p = std::strchr(alphabet, str[i]);
+    if (p == nullptr || str[i] == '\0') {
+      return false;
+    }
+    uint32_t carry = p - alphabet;
+    for (auto it = num.rbegin(); it != num.rend(); ++it) {
+      carry += 58 * uint32_t(*it);
+      *it = carry & 0xff;
+      carry >>= 8;
+    }
+    for (; carry; carry >>= 8) {
+      num.insert(num.begin(), carry & 0xff);
+    }
+  }
+  out.assign(zeros, 0);
+  out.insert(out.end(), num.begin(), num.end());
+  return true;
+}
+
+bool ExtPubKey::parse(const std::string &str) {
+  std::vector<uint8_t> raw;
+  if (!base58_decode(str, raw) || raw.size() != payload_size + 4) {
+    return false;
+  }
+  uint8_t check[32];
+  sha256::double_hash(raw.data(), payload_size, check);
+  if (std::memcmp(check, raw.data() + payload_size, 4) != 0) {
+    return false;
+  }
+  uint32_t version;
+  std::memcpy(&version, raw.data(), sizeof version);
+  switch (be32toh(version)) {
+    case 0x0488b21e:  // xpub
+    case 0x043587cf:  // tpub
+      script = Script::P2PKH;
+      break;
+    case 0x049d7cb2:  // ypub
+    case 0x044a5262:  // upub
+      script = Script::P2SH_P2WPKH;
+      break;
+    case 0x04b24746:  // zpub
+    case 0x045f1cf6:  // vpub
+      script = Script::P2WPKH;
+      break;
+    default:
+      return false;
+  }
+  const uint32_t v = be32toh(version);
+  mainnet = v == 0x0488b21e || v == 0x049d7cb2 || v == 0x04b24746;
+  depth = raw[4];
+  uint32_t be_child;
+  std::memcpy(&be_child, raw.data() + 9, sizeof be_child);
+  child = be32toh(be_child);
+  std::memcpy(chain_code, raw.data() + 13, sizeof chain_code);
+  std::memcpy(key, raw.data() + 45, sizeof key);
+  return key[0] == 0x02 || key[0] == 0x03;
+}
+
+// the output script paying to a compressed key, and the hash it pushes
+static void key_script(ExtPubKey::Script type, const uint8_t *key,
+                       DerivedKey &out) {
+  uint8_t hash[20];
+  ripemd160::hash160(key, 33, hash);
+  const char *h = reinterpret_cast<const char *>(hash);
+  switch (type) {
+    case ExtPubKey::Script::P2PKH:
+      out.script.assign("\x76\xa9\x14", 3);
+      out.script.append(h, sizeof hash);
+      out.script.append("\x88\xac", 2);
+      out.hash.assign(h, sizeof hash);
+      break;
+    case ExtPubKey::Script::P2SH_P2WPKH: {
+      // the script hash of the P2WPKH redeem script
+      uint8_t redeem[22] = {0x00, 0x14};
+      std::memcpy(redeem + 2, hash, sizeof hash);
+      uint8_t script_hash[20];
+      ripemd160::hash160(redeem, sizeof redeem, script_hash);
+      const char *sh = reinterpret_cast<const char *>(script_hash);
+      out.script.assign("\xa9\x14", 2);
+      out.script.append(sh, sizeof script_hash);
+      out.script.push_back('\x87');
+      out.hash.assign(sh, sizeof script_hash);
+      break;
+    }
+    case ExtPubKey::Script::P2WPKH:
+      out.script.assign("\x00\x14", 2);
+      out.script.append(h, sizeof hash);
+      out.hash.assign(h, sizeof hash);
+      break;
+  }
+}
+
+HdWallet::HdWallet(size_t threads)
+    : ctx_(secp256k1_context_create(SECP256K1_CONTEXT_VERIFY)),
+      threads_(threads ? threads : scheduler().threads()) {}
+
+HdWallet::~HdWallet() { secp256k1_context_destroy(ctx_); }
+
+bool HdWallet::add_account(const std::string &xpub) {
+  ExtPubKey ext;
+  secp256k1_pubkey pub;
+  if (!ext.parse(xpub) ||
+      !secp256k1_ec_pubkey_parse(ctx_, &pub, ext.key, sizeof ext.key)) {
+    return false;
+  }
+  ChainKey chains[2];
+  for (uint32_t i = 0; i < 2; i++) {
+    chains[i].script = ext.script;
+    if (!child(ext.key, ext.chain_code, i, chains[i].key,
+               chains[i].chain_code)) {
+      return false;
+    }
+  }
+  chains_.push_back(chains[0]);
+  chains_.push_back(chains[1]);
+  return true;
+}
+
+bool HdWallet::child(const uint8_t *key, const uint8_t *chain_code,
+                     uint32_t i, uint8_t *child_key,
+                     uint8_t *child_code) const {
+  secp256k1_pubkey pub;
+  if (!secp256k1_ec_pubkey_parse(ctx_, &pub, key, 33)) {
+    return false;
+  }
+  uint8_t data[37], tweak[64];
+  std::memcpy(data, key, 33);
+  const uint32_t be_i = htobe32(i);
+  std::memcpy(data + 33, &be_i, sizeof be_i);
+  sha512::hmac(chain_code, 32, data, sizeof data, tweak);
+  if (!secp256k1_ec_pubkey_tweak_add(ctx_, &pub, tweak)) {
+    return false;
+  }
+  size_t len = 33;
+  secp256k1_ec_pubkey_serialize(ctx_, child_key, &len, &pub,
+                                SECP256K1_EC_COMPRESSED);
+  std::memcpy(child_code, tweak + 32, 32);
+  return true;
+}
+
+void HdWallet::derive(uint32_t from, uint32_t to,
+                      std::vector<DerivedKey> &out) const {
+  if (to <= from || chains_.empty()) {
+    return;
+  }
+  const size_t per_chain = to - from;
+  const size_t batches_per_chain = (per_chain + batch_size - 1) / batch_size;
+  const size_t nbatches = chains_.size() * batches_per_chain;
+
+  // every key has its slot, so the threads never share one; skipped keys
+  // are left with an empty script
+  std::vector<DerivedKey> keys(chains_.size() * per_chain);
+  std::atomic<size_t> next(0);
+  auto work = [&]() {
+    for (size_t b; (b = next.fetch_add(1)) < nbatches;) {
+      const size_t c = b / batches_per_chain;
+      const ChainKey &chain = chains_[c];
+      secp256k1_pubkey parent;
+      if (!secp256k1_ec_pubkey_parse(ctx_, &parent, chain.key,
+                                     sizeof chain.key)) {
+        continue;  // checked when the account was added
+      }
+      uint8_t data[37];
+      std::memcpy(data, chain.key, sizeof chain.key);
+      const size_t begin = (b % batches_per_chain) * batch_size;
+      const size_t end = std::min(per_chain, begin + batch_size);
+      for (size_t j = begin; j < end; j++) {
+        const uint32_t i = from + j;
+        const uint32_t be_i = htobe32(i);
+        std::memcpy(data + 33, &be_i, sizeof be_i);
+        uint8_t tweak[64];
+        sha512::hmac(chain.chain_code, sizeof chain.chain_code, data,
+                     sizeof data, tweak);
+        secp256k1_pubkey pub = parent;
+        if (!secp256k1_ec_pubkey_tweak_add(ctx_, &pub, tweak)) {
+          continue;
+        }
+        uint8_t key[33];
+        size_t len = sizeof key;
+        secp256k1_ec_pubkey_serialize(ctx_, key, &len, &pub,
+                                      SECP256K1_EC_COMPRESSED);
+        DerivedKey &dk = keys[c * per_chain + j];
+        dk.account = c / 2;
+        dk.chain = c % 2;
+        dk.index = i;
+        key_script(chain.script, key, dk);
+      }
+    }
+  };
+  const size_t nthreads = std::min(threads_, nbatches);
+  TaskGroup group;
+  for (size_t t = 1; t < nthreads; t++) {
+    group.run(work);
+  }
+  work();
+  group.wait();
+
+  out.reserve(out.size() + keys.size());
+  for (auto &key : keys) {
+    if (!key.script.empty()) {
+      out.push_back(std::move(key));
+    }
+  }
+}
+}  // namespace spv
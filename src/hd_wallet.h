@@ -0,0 +1,95 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct secp256k1_context_struct;
+
+namespace spv {
+// An extended public key as BIP32 serializes it, normally an account's
+// (m/44'/0'/0' and the like). Its version says which scripts its keys pay
+// to: xpub and tpub are BIP44 P2PKH, ypub and upub BIP49 P2SH-P2WPKH, and
+// zpub and vpub BIP84 P2WPKH.
+struct ExtPubKey {
+  enum class Script : uint8_t { P2PKH, P2SH_P2WPKH, P2WPKH };
+
+  Script script;
+  bool mainnet;  // xpub, ypub or zpub
+  uint8_t depth;
+  uint32_t child;
+  uint8_t chain_code[32];
+  uint8_t key[33];  // compressed
+
+  // Decode the base58check string. This doesn't check that the key is on
+  // the curve; HdWallet::add_account() does.
+  bool parse(const std::string &str);
+};
+
+// a key derived from an account, and what to watch for it
+struct DerivedKey {
+  uint32_t account;    // in the order they were added
+  uint32_t chain;      // 0 for receiving, 1 for change
+  uint32_t index;      // in the chain
+  std::string script;  // the output script that pays to it
+  std::string hash;    // the 20-byte hash that script pushes
+};
+
+// Derives the keys of accounts' receiving and change chains, e.g. the
+// first gap limit's worth of each to watch. Each key is a CKDpub: an
+// HMAC-SHA512 of its chain's key and the index, and a tweak of the chain's
+// key by the result with libsecp256k1, which is a multiplication of the
+// generator and a point addition. The keys are independent, so derive()
+// splits every chain into batches and runs them on the Scheduler,
+// each parsing the chains' keys once per batch and hashing straight into
+// the output.
+class HdWallet {
+ public:
+  // with threads 0, derive on every worker
+  explicit HdWallet(size_t threads = 0);
+  HdWallet(const HdWallet &other) = delete;
+  ~HdWallet();
+
+  // add an account's extended public key; returns false if it's malformed
+  bool add_account(const std::string &xpub);
+
+  inline size_t accounts() const { return chains_.size() / 2; }
+
+  // Append the keys [from, to) of every account's two chains to out, by
+  // account, then chain, then index. The rare index that BIP32 says to
+  // skip (with odds of about 1 in 2^127) is left out.
+  void derive(uint32_t from, uint32_t to, std::vector<DerivedKey> &out) const;
+
+ private:
+  struct ChainKey {
+    ExtPubKey::Script script;
+    uint8_t chain_code[32];
+    uint8_t key[33];
+  };
+
+  secp256k1_context_struct *ctx_;
+  size_t threads_;
+  std::vector<ChainKey> chains_;  // two per account, receiving first
+
+  // CKDpub of the non-hardened child i, false if it's to be skipped
+  bool child(const uint8_t *key, const uint8_t *chain_code, uint32_t i,
+             uint8_t *child_key, uint8_t *child_code) const;
+};
+}  // namespace spv
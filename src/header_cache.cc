@@ -0,0 +1,120 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./header_cache.h"
+
+#include <cassert>
+#include <utility>
+
+namespace spv {
+size_t HeaderCache::capacity_for(size_t bytes) {
+  // slots_ is reserved up front, so it stays at most 3/4 full and needs up
+  // to two slots per entry
+  const size_t per_entry = sizeof(Entry) + sizeof(uint32_t) +
+                           2 * sizeof(std::pair<hash_t, uint32_t>);
+  return bytes / per_entry;
+}
+
+HeaderCache::HeaderCache(size_t capacity)
+    : entries_(capacity),
+      heights_(capacity, no_entry),
+      hand_(0),
+      hits_(0),
+      misses_(0) {
+  assert(capacity < no_entry);
+  slots_.reserve(capacity);
+}
+
+void HeaderCache::resize(size_t capacity) {
+  assert(capacity < no_entry);
+  // assigning from fresh vectors gives back the old memory
+  std::vector<Entry>(capacity).swap(entries_);
+  std::vector<uint32_t>(capacity, no_entry).swap(heights_);
+  slots_.clear();
+  slots_.reserve(capacity);
+  hand_ = 0;
+}
+
+const BlockHeader *HeaderCache::find(const hash_t &hash) {
+  const uint32_t *slot = slots_.find(hash);
+  if (slot == nullptr) {
+    misses_++;
+    return nullptr;
+  }
+  hits_++;
+  entries_[*slot].ref = true;
+  return &entries_[*slot].hdr;
+}
+
+const BlockHeader *HeaderCache::find(size_t height) {
+  const uint32_t slot =
+      heights_.empty() ? no_entry : heights_[height % heights_.size()];
+  // the entry may have been reused since, so check that it still matches
+  if (slot == no_entry || !entries_[slot].best ||
+      entries_[slot].hdr.height != height) {
+    misses_++;
+    return nullptr;
+  }
+  hits_++;
+  entries_[slot].ref = true;
+  return &entries_[slot].hdr;
+}
+
+void HeaderCache::put(const BlockHeader &hdr, bool best) {
+  if (entries_.empty()) {
+    return;
+  }
+  const uint32_t *existing = slots_.find(hdr.block_hash);
+  const uint32_t slot = existing ? *existing : evict();
+  Entry &entry = entries_[slot];
+  if (existing == nullptr) {
+    entry.hdr = hdr;
+    entry.used = true;
+    entry.best = false;
+    slots_.emplace(hdr.block_hash, slot);
+  }
+  entry.ref = true;
+  if (best) {
+    entry.best = true;
+    heights_[hdr.height % heights_.size()] = slot;
+  }
+}
+
+void HeaderCache::unwind(size_t height) {
+  for (auto &entry : entries_) {
+    if (entry.hdr.height > height) {
+      entry.best = false;
+    }
+  }
+}
+
+uint32_t HeaderCache::evict() {
+  // give every referenced entry a second chance
+  while (entries_[hand_].used && entries_[hand_].ref) {
+    entries_[hand_].ref = false;
+    hand_ = (hand_ + 1) % entries_.size();
+  }
+  const uint32_t slot = hand_;
+  hand_ = (hand_ + 1) % entries_.size();
+  Entry &entry = entries_[slot];
+  if (entry.used) {
+    slots_.erase(entry.hdr.block_hash);
+    entry.used = entry.best = false;
+  }
+  return slot;
+}
+}  // namespace spv
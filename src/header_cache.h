@@ -0,0 +1,88 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "./fields.h"
+#include "./hashmap.h"
+
+namespace spv {
+// HeaderCache keeps recently used headers decoded, keyed by hash, and for
+// headers on the best chain also by height. It has a fixed number of
+// entries, all allocated up front; when it's full the CLOCK algorithm picks
+// an entry to reuse, which approximates LRU without reordering anything on
+// a hit.
+class HeaderCache {
+ public:
+  // a cache using roughly this many bytes
+  static size_t capacity_for(size_t bytes);
+
+  explicit HeaderCache(size_t capacity);
+  HeaderCache(const HeaderCache &other) = delete;
+
+  inline size_t capacity() const { return entries_.size(); }
+  inline size_t memory_usage() const {
+    return entries_.capacity() * sizeof(Entry) +
+           heights_.capacity() * sizeof(uint32_t) + slots_.memory_usage();
+  }
+  inline size_t hits() const { return hits_; }
+  inline size_t misses() const { return misses_; }
+
+  // find a header by hash, or nullptr; valid until the next put()
+  const BlockHeader *find(const hash_t &hash);
+
+  // find the header at this height on the best chain, or nullptr
+  const BlockHeader *find(size_t height);
+
+  // Add a header, or refresh it if it's already cached. Pass best if the
+  // header is on the best chain, so it can be found by height.
+  void put(const BlockHeader &hdr, bool best = false);
+
+  // Forget which of the cached headers above this height are on the best
+  // chain, e.g. because of a reorg.
+  void unwind(size_t height);
+
+  // drop everything and hold capacity headers from now on
+  void resize(size_t capacity);
+
+ private:
+  struct Entry {
+    BlockHeader hdr;
+    bool used;  // holds a header
+    bool ref;   // used since the clock hand last passed
+    bool best;  // on the best chain
+
+    Entry() : used(false), ref(false), best(false) {}
+  };
+
+  static constexpr uint32_t no_entry = static_cast<uint32_t>(-1);
+
+  std::vector<Entry> entries_;
+  std::vector<uint32_t> heights_;  // entry by height % capacity
+  FlatHashMap<hash_t, uint32_t> slots_;
+  size_t hand_;
+  size_t hits_;
+  size_t misses_;
+
+  // pick an entry to reuse, and drop whatever it held
+  uint32_t evict();
+};
+}  // namespace spv
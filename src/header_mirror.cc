@@ -0,0 +1,371 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./header_mirror.h"
+
+#include <netdb.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+#include "./fields.h"
+#include "./logging.h"
+
+namespace spv {
+MODULE_LOGGER
+
+// a request that takes longer than this is given up and tried again
+static const std::chrono::seconds mirror_timeout{30};
+
+// tries after the first before a chunk fails its job
+static const unsigned mirror_retries = 2;
+
+// the most response headers we'll read before the body
+static const size_t max_response_head = 16 << 10;
+
+HeaderMirror::HeaderMirror(std::shared_ptr<uvw::Loop> loop,
+                           const std::string &url, size_t connections)
+    : loop_(loop),
+      url_(url),
+      port_(80),
+      connections_(std::max<size_t>(connections, 1)),
+      in_flight_(0),
+      failures_(0),
+      jobs_(connections_) {
+  parse_url(url, host_, port_, path_);
+  for (size_t i = 0; i < jobs_.size(); i++) {
+    jobs_[i].addr.set_ip("0.0.0.0");
+    jobs_[i].addr.set_port(i + 1);
+  }
+  if (server_.set_ip(host_)) {
+    server_.set_port(port_);
+  }
+}
+
+bool HeaderMirror::parse_url(const std::string &url, std::string &host,
+                             uint16_t &port, std::string &path) {
+  static const std::string scheme = "http://";
+  if (url.compare(0, scheme.size(), scheme) != 0) {
+    return false;
+  }
+  const size_t slash = url.find('/', scheme.size());
+  if (slash == std::string::npos || slash == scheme.size()) {
+    return false;
+  }
+  path = url.substr(slash);
+  host = url.substr(scheme.size(), slash - scheme.size());
+  port = 80;
+  const size_t colon = host.rfind(':');
+  if (colon != std::string::npos &&
+      host.find(']', colon) == std::string::npos) {
+    const std::string digits = host.substr(colon + 1);
+    if (digits.empty() || digits.size() > 5 ||
+        !std::all_of(digits.begin(), digits.end(), ::isdigit) ||
+        std::stoul(digits) == 0 || std::stoul(digits) > 65535) {
+      return false;
+    }
+    port = std::stoul(digits);
+    host.resize(colon);
+  }
+  if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+    host = host.substr(1, host.size() - 2);
+  }
+  return !host.empty();
+}
+
+HeaderMirror::Job *HeaderMirror::find(const Addr &addr) {
+  for (auto &job : jobs_) {
+    if (job.addr == addr) {
+      return &job;
+    }
+  }
+  return nullptr;
+}
+
+bool HeaderMirror::owns(const Addr &addr) const {
+  return std::any_of(jobs_.begin(), jobs_.end(),
+                     [&](const Job &job) { return job.addr == addr; });
+}
+
+bool HeaderMirror::busy(const Addr &addr) const {
+  return std::any_of(jobs_.begin(), jobs_.end(), [&](const Job &job) {
+    return job.addr == addr && !job.chunks.empty();
+  });
+}
+
+std::vector<Addr> HeaderMirror::idle() const {
+  std::vector<Addr> out;
+  for (const auto &job : jobs_) {
+    if (job.chunks.empty()) {
+      out.push_back(job.addr);
+    }
+  }
+  return out;
+}
+
+void HeaderMirror::fetch(const Addr &addr, size_t from, size_t to) {
+  Job *job = find(addr);
+  if (job == nullptr || from > to) {
+    return;
+  }
+  job->generation++;
+  job->chunks.clear();
+  for (size_t height = from; height <= to; height += MIRROR_CHUNK_HEADERS) {
+    Chunk chunk;
+    chunk.from = height;
+    chunk.count = std::min(MIRROR_CHUNK_HEADERS, to - height + 1);
+    job->chunks.push_back(std::move(chunk));
+  }
+  LOG_DEBUG(log, "mirror job {} fetching heights {} to {}", addr, from, to);
+  pump();
+}
+
+void HeaderMirror::cancel(const Addr &addr) {
+  Job *job = find(addr);
+  if (job != nullptr) {
+    job->generation++;
+    job->chunks.clear();
+  }
+}
+
+void HeaderMirror::reject(const Addr &addr) {
+  cancel(addr);
+  failures_++;
+}
+
+void HeaderMirror::cancel() {
+  for (auto &job : jobs_) {
+    job.generation++;
+    job.chunks.clear();
+  }
+  for (auto &pr : open_) {
+    pr.first->clear();
+    pr.first->close();
+    pr.second->clear();
+    pr.second->close();
+  }
+  open_.clear();
+  in_flight_ = 0;
+  if (resolving_) {
+    resolving_->clear();
+    resolving_->cancel();
+    resolving_.reset();
+  }
+}
+
+void HeaderMirror::resolve() {
+  resolving_ = loop_->resource<uvw::GetAddrInfoReq>();
+  resolving_->once<uvw::ErrorEvent>([this](const auto &, auto &) {
+    log->warn("couldn't resolve header mirror {}", host_);
+    resolving_.reset();
+    for (auto &job : jobs_) {
+      if (!job.chunks.empty()) {
+        job.generation++;
+        job.chunks.clear();
+        failures_++;
+        callbacks.failed(job.addr);
+      }
+    }
+  });
+  resolving_->once<uvw::AddrInfoEvent>([this](const auto &event, auto &) {
+    resolving_.reset();
+    for (const addrinfo *p = event.data.get(); p != nullptr; p = p->ai_next) {
+      const Addr addr(p, port_);
+      if (addr.af() != -1) {
+        server_ = addr;
+        break;
+      }
+    }
+    log->info("fetching headers from mirror {} at {}", url_, server_);
+    pump();
+  });
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  resolving_->nodeAddrInfo(host_, &hints);
+}
+
+void HeaderMirror::pump() {
+  if (server_.af() == -1) {
+    if (!resolving_) {
+      resolve();
+    }
+    return;
+  }
+  // a chunk from each busy job in turn, only looking a window ahead of what
+  // each has delivered so that finished chunks don't pile up behind a slow
+  // one
+  bool more = true;
+  while (more && in_flight_ < connections_) {
+    more = false;
+    for (auto &job : jobs_) {
+      if (in_flight_ >= connections_) {
+        break;
+      }
+      const size_t window = std::min(job.chunks.size(), connections_);
+      for (size_t i = 0; i < window; i++) {
+        Chunk &chunk = job.chunks[i];
+        if (!chunk.done && !chunk.requested) {
+          request(job, chunk);
+          more = true;
+          break;
+        }
+      }
+    }
+  }
+}
+
+void HeaderMirror::request(Job &job, Chunk &chunk) {
+  chunk.requested = true;
+  in_flight_++;
+  const size_t index = &job - jobs_.data();
+  const uint64_t generation = job.generation;
+  const size_t from = chunk.from;
+  const size_t expected = chunk.count * BLOCK_HEADER_SIZE;
+
+  auto tcp = loop_->resource<uvw::TcpHandle>();
+  auto timer = loop_->resource<uvw::TimerHandle>();
+  struct State {
+    std::string in;
+    bool finished = false;
+  };
+  auto state = std::make_shared<State>();
+  open_.emplace_back(tcp, timer);
+
+  // every way a request ends comes here, once
+  std::weak_ptr<uvw::TcpHandle> weak_tcp = tcp;
+  std::weak_ptr<uvw::TimerHandle> weak_timer = timer;
+  auto finish = [this, weak_tcp, weak_timer, state, index, generation, from,
+                 expected](bool ended) {
+    if (state->finished) {
+      return;
+    }
+    state->finished = true;
+    auto tcp = weak_tcp.lock();
+    auto timer = weak_timer.lock();
+    if (tcp) {
+      tcp->close();
+    }
+    if (timer) {
+      timer->close();
+    }
+    open_.erase(std::remove_if(open_.begin(), open_.end(),
+                               [&](const auto &pr) { return pr.first == tcp; }),
+                open_.end());
+    bool ok = false;
+    std::string body;
+    const std::string &in = state->in;
+    const size_t head_end = in.find("\r\n\r\n");
+    if (ended && head_end != std::string::npos) {
+      const std::string status = in.substr(0, in.find("\r\n"));
+      body = in.substr(head_end + 4);
+      ok = status.compare(0, 7, "HTTP/1.") == 0 && status.size() >= 12 &&
+           status.compare(9, 3, "206") == 0 && body.size() == expected;
+      if (!ok) {
+        log->warn("header mirror answered {} with {} body bytes for height {}",
+                  status, body.size(), from);
+      }
+    }
+    answered(index, generation, from, ok, std::move(body));
+  };
+  timer->once<uvw::TimerEvent>([finish](const auto &, auto &) {
+    log->warn("header mirror request timed out");
+    finish(false);
+  });
+  tcp->once<uvw::ErrorEvent>([finish](const auto &exc, auto &) {
+    log->warn("header mirror request failed: {}", exc.what());
+    finish(false);
+  });
+  tcp->once<uvw::EndEvent>([finish](const auto &, auto &) { finish(true); });
+  tcp->on<uvw::DataEvent>([finish, state, expected](const auto &data,
+                                                    auto &) {
+    state->in.append(data.data.get(), data.length);
+    if (state->in.size() > expected + max_response_head) {
+      finish(false);
+    }
+  });
+  tcp->once<uvw::ConnectEvent>(
+      [this, from, expected](const auto &, auto &tcp) {
+        const std::string req =
+            "GET " + path_ + " HTTP/1.1\r\nHost: " + host_ +
+            "\r\nRange: bytes=" + std::to_string(from * BLOCK_HEADER_SIZE) +
+            "-" + std::to_string(from * BLOCK_HEADER_SIZE + expected - 1) +
+            "\r\nConnection: close\r\n\r\n";
+        std::unique_ptr<char[]> buf(new char[req.size()]);
+        std::memcpy(buf.get(), req.data(), req.size());
+        tcp.write(std::move(buf), req.size());
+        tcp.read();
+      });
+  timer->start(mirror_timeout, std::chrono::seconds(0));
+  sockaddr_storage sa;
+  server_.to_sockaddr(sa);
+  tcp->connect(reinterpret_cast<const sockaddr &>(sa));
+}
+
+void HeaderMirror::answered(size_t index, uint64_t generation, size_t from,
+                            bool ok, std::string &&body) {
+  in_flight_--;
+  Job &job = jobs_[index];
+  if (job.generation != generation) {
+    pump();  // cancelled, but the connection is free again
+    return;
+  }
+  auto it = std::find_if(job.chunks.begin(), job.chunks.end(),
+                         [from](const Chunk &c) { return c.from == from; });
+  if (it == job.chunks.end()) {
+    pump();
+    return;
+  }
+  if (!ok) {
+    it->requested = false;
+    if (++it->tries > mirror_retries) {
+      log->warn("giving up on headers from height {} from mirror {}", from,
+                url_);
+      job.generation++;
+      job.chunks.clear();
+      failures_++;
+      callbacks.failed(job.addr);
+    }
+    pump();
+    return;
+  }
+
+  // a zero tx count after each header, as in a headers message
+  it->raw.assign(it->count * HeadersView::stride, '\0');
+  for (size_t i = 0; i < it->count; i++) {
+    std::memcpy(&it->raw[i * HeadersView::stride],
+                body.data() + i * BLOCK_HEADER_SIZE, BLOCK_HEADER_SIZE);
+  }
+  it->done = true;
+  deliver(job);
+  pump();
+}
+
+void HeaderMirror::deliver(Job &job) {
+  const uint64_t generation = job.generation;
+  while (!job.chunks.empty() && job.chunks.front().done) {
+    std::string raw = std::move(job.chunks.front().raw);
+    job.chunks.pop_front();
+    // the callback may cancel the job, or start it on the next segment
+    callbacks.headers(job.addr, std::move(raw), job.chunks.empty());
+    if (job.generation != generation) {
+      break;
+    }
+  }
+}
+}  // namespace spv
@@ -0,0 +1,136 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "./addr.h"
+#include "./uvw.h"
+
+namespace spv {
+// headers asked for in one range request
+static const size_t MIRROR_CHUNK_HEADERS = 10000;
+
+// HeaderMirror fetches headers over plain HTTP from a dump of a best chain:
+// the 80-byte wire headers back to back from the genesis block, so that the
+// header at height h starts at byte 80h, as a CDN can serve any static file.
+// It's the source the client hands header segments to ahead of its peers;
+// each of its jobs stands in for a peer in HeaderSync under an address of
+// its own (0.0.0.0, with the job's number as the port), and the headers go
+// through the HeaderValidator like any peer's.
+//
+// A job's range is asked for in chunks of MIRROR_CHUNK_HEADERS with Range
+// requests, up to connections of them in flight at once across every job,
+// each on a connection of its own. The chunks of a job are delivered in
+// order, laid out as HeadersView expects. A chunk that fails is asked for
+// again a couple of times before the job is given up.
+class HeaderMirror {
+ public:
+  struct Callbacks {
+    // the next headers of a job, last set on its final chunk
+    std::function<void(const Addr &job, std::string &&raw, bool last)>
+        headers;
+    // the job couldn't be fetched, after its retries
+    std::function<void(const Addr &job)> failed;
+  };
+  Callbacks callbacks;
+
+  HeaderMirror() = delete;
+  HeaderMirror(const HeaderMirror &other) = delete;
+  HeaderMirror(std::shared_ptr<uvw::Loop> loop, const std::string &url,
+               size_t connections);
+  ~HeaderMirror() { cancel(); }
+
+  // split http://host[:port]/path, returning false for anything else
+  static bool parse_url(const std::string &url, std::string &host,
+                        uint16_t &port, std::string &path);
+
+  // is this address one of our jobs, and is that job fetching?
+  bool owns(const Addr &addr) const;
+  bool busy(const Addr &job) const;
+
+  // the jobs not fetching anything, to take a segment each
+  std::vector<Addr> idle() const;
+
+  // Fetch the headers at heights from to to inclusive for an idle job.
+  void fetch(const Addr &job, size_t from, size_t to);
+
+  // drop what a job is fetching, or with no job everything
+  void cancel(const Addr &job);
+  void cancel();
+
+  // cancel a job whose headers were bad, counting it as a failure
+  void reject(const Addr &job);
+
+  // Jobs given up or rejected so far. The client stops using a mirror that
+  // fails too often.
+  inline size_t failures() const { return failures_; }
+
+ private:
+  struct Chunk {
+    size_t from;
+    size_t count;
+    std::string raw;  // once it's in
+    bool done = false;
+    bool requested = false;
+    unsigned tries = 0;
+  };
+
+  struct Job {
+    Addr addr;
+    std::deque<Chunk> chunks;  // not yet delivered, in height order
+    uint64_t generation = 0;   // bumped to ignore a cancelled fetch
+  };
+
+  std::shared_ptr<uvw::Loop> loop_;
+  std::string url_;
+  std::string host_;
+  uint16_t port_;
+  std::string path_;
+  Addr server_;  // once resolved
+  std::shared_ptr<uvw::GetAddrInfoReq> resolving_;
+  size_t connections_;
+  size_t in_flight_;
+  size_t failures_;
+  std::vector<Job> jobs_;
+  std::vector<std::pair<std::shared_ptr<uvw::TcpHandle>,
+                        std::shared_ptr<uvw::TimerHandle>>>
+      open_;  // the requests in flight, and their timeouts
+
+  Job *find(const Addr &addr);
+  void resolve();
+
+  // start as many chunk requests as connections_ allows
+  void pump();
+  void request(Job &job, Chunk &chunk);
+
+  // a request finished, with the body, or failed with ok false
+  void answered(size_t index, uint64_t generation, size_t from, bool ok,
+                std::string &&body);
+
+  // hand a job's chunks that have come in, in order, to the callback
+  void deliver(Job &job);
+};
+}  // namespace spv
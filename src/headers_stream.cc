@@ -0,0 +1,133 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./headers_stream.h"
+
+#include <endian.h>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "./constants.h"
+#include "./encoder.h"
+#include "./logging.h"
+
+namespace spv {
+MODULE_LOGGER
+
+bool HeadersStream::wanted(const char *data) {
+  uint32_t payload_size;
+  std::memcpy(&payload_size, data + HEADER_LEN_OFFSET, sizeof payload_size);
+  return le32toh(payload_size) >= MIN_PAYLOAD &&
+         to_command(load_command_key(data + sizeof(uint32_t))) ==
+             Command::HEADERS;
+}
+
+void HeadersStream::start(const char *data) {
+  assert(!active_);
+  reset();
+  active_ = true;
+  std::memcpy(&payload_size_, data + HEADER_LEN_OFFSET, sizeof payload_size_);
+  payload_size_ = le32toh(payload_size_);
+  left_ = payload_size_;
+}
+
+size_t HeadersStream::consume(const char *data, size_t size) {
+  assert(active_);
+  const size_t n = std::min<size_t>(size, left_);
+  left_ -= n;
+  if (error_ != nullptr) {
+    return n;
+  }
+  size_t used = 0;
+  if (!have_count_) {
+    used = consume_count(data, n);
+    if (error_ != nullptr) {
+      return n;
+    }
+  }
+  entries_.append(data + used, n - used);
+  for (; checked_ + HeadersView::stride <= entries_.size();
+       checked_ += HeadersView::stride) {
+    if (entries_[checked_ + BLOCK_HEADER_SIZE] != 0) {
+      fail("headers message has a non-zero tx count");
+      break;
+    }
+  }
+  return n;
+}
+
+size_t HeadersStream::consume_count(const char *data, size_t size) {
+  size_t used = 0;
+  while (used < size) {
+    varint_[varint_have_++] = uint8_t(data[used++]);
+    const uint8_t tag = varint_[0];
+    const size_t need = tag < 0xfd ? 1 : tag == 0xfd ? 3 : tag == 0xfe ? 5 : 9;
+    if (varint_have_ < need) {
+      continue;
+    }
+    count_ = need == 1 ? tag : 0;
+    for (size_t i = need - 1; i > 0; i--) {
+      count_ = (count_ << 8) | varint_[i];
+    }
+    have_count_ = true;
+    // The checksum goes unchecked, so only a payload that's exactly the
+    // count and the entries is taken; see the headers parser.
+    if (count_ > MAX_COUNT) {
+      fail("headers message has too many headers");
+    } else if (need != varint_size(count_) ||
+               payload_size_ != need + count_ * HeadersView::stride) {
+      fail("headers message has an unexpected size");
+    } else {
+      entries_.reserve(std::min<size_t>(count_ * HeadersView::stride,
+                                        payload_size_));
+    }
+    break;
+  }
+  return used;
+}
+
+std::string HeadersStream::take() {
+  taken_ = true;
+  std::string out;
+  out.swap(entries_);
+  entries_.assign(out, checked_, std::string::npos);
+  out.resize(checked_);
+  checked_ = 0;
+  return out;
+}
+
+void HeadersStream::reset() {
+  active_ = false;
+  taken_ = false;
+  error_ = nullptr;
+  left_ = 0;
+  payload_size_ = 0;
+  varint_have_ = 0;
+  have_count_ = false;
+  count_ = 0;
+  entries_.clear();
+  checked_ = 0;
+}
+
+void HeadersStream::fail(const char *why) {
+  log->warn("{}", why);
+  error_ = why;
+  entries_.clear();
+  checked_ = 0;
+}
+}  // namespace spv
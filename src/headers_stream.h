@@ -0,0 +1,104 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "./fields.h"
+
+namespace spv {
+// A headers message taken as it arrives, rather than once all of it is in.
+// A full reply is 2000 headers, 162k bytes, which takes many reads; its
+// entries are checked as they complete and can be handed on for validation
+// in parts, so the hashing overlaps the transfer. The checksum covers the
+// whole payload and isn't checked: proof of work and each header's link to
+// the one before it cover the headers instead.
+class HeadersStream {
+ public:
+  // incomplete headers messages with at least this much payload are
+  // streamed, about a hundred headers
+  static const size_t MIN_PAYLOAD = 8 << 10;
+
+  // the most headers a message may have, as in message.cc
+  static const size_t MAX_COUNT = 10000;
+
+  HeadersStream() { reset(); }
+  HeadersStream(const HeadersStream &other) = delete;
+
+  // Should the message whose HEADER_SIZE byte header is at data be
+  // streamed?
+  static bool wanted(const char *data);
+
+  // start on the message whose header is at data
+  void start(const char *data);
+
+  // Take the message's payload off the front of data, returning the number
+  // of bytes used, which stops at the end of the message.
+  size_t consume(const char *data, size_t size);
+
+  // is a message being read?
+  inline bool active() const { return active_; }
+
+  // is all of the message in?
+  inline bool done() const { return active_ && left_ == 0; }
+
+  // why the message is malformed, or nullptr; the rest of it is skipped
+  inline const char *error() const { return error_; }
+
+  // the message's count of headers, once that much is in
+  inline size_t count() const { return count_; }
+
+  // the complete entries that haven't been taken
+  inline size_t ready() const { return checked_ / HeadersView::stride; }
+
+  // has take() been called since start()?
+  inline bool taken() const { return taken_; }
+
+  // Move out the complete entries, laid out as HeadersView expects.
+  std::string take();
+
+  // forget the message, e.g. once it's done
+  void reset();
+
+ private:
+  bool active_;
+  bool taken_;
+  const char *error_;
+  uint32_t left_;  // payload bytes still to come
+  uint32_t payload_size_;
+
+  // the count, which may be split across reads
+  std::array<uint8_t, 9> varint_;
+  size_t varint_have_;
+  bool have_count_;
+  size_t count_;
+
+  // the entries read, the last one perhaps incomplete, and how many bytes
+  // of them are complete entries with a zero tx count
+  std::string entries_;
+  size_t checked_;
+
+  void fail(const char *why);
+
+  // take the count from the front of data, returning the bytes used
+  size_t consume_count(const char *data, size_t size);
+};
+}  // namespace spv
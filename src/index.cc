@@ -0,0 +1,276 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./index.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <limits>
+
+#include "./network.h"
+#include "./pow.h"
+
+namespace spv {
+BlockHeader IndexEntry::header() const {
+  BlockHeader hdr;
+  hdr.unpack(data.data());
+  hdr.height = height;
+  hdr.block_hash = hash;
+  return hdr;
+}
+
+std::string IndexEntry::db_encode(bool compact) const {
+  return encode_header_record(data.data(), height, compact);
+}
+
+const IndexEntry *HeaderIndex::find(const hash_t &hash) const {
+  if (!filter_.may_contain(hash)) {
+    return nullptr;
+  }
+  const slot_t *slot = slots_.find(hash);
+  return slot == nullptr ? nullptr : &entries_[*slot];
+}
+
+// Lookups in flight at once in probe_many(): enough to hide a miss, and few
+// enough that a group's lines are still cached when they're probed.
+static const size_t probe_group = 16;
+
+template <typename F>
+void HeaderIndex::probe_many(const hash_t *hashes, size_t n, F found) const {
+  bool maybe[probe_group];
+  for (size_t base = 0; base < n; base += probe_group) {
+    const size_t count = std::min(probe_group, n - base);
+    const hash_t *group = hashes + base;
+    for (size_t i = 0; i < count; i++) {
+      filter_.prefetch(group[i]);
+    }
+    // the filter turns away most unknown hashes before they cost a miss
+    for (size_t i = 0; i < count; i++) {
+      maybe[i] = filter_.may_contain(group[i]);
+      if (maybe[i]) {
+        slots_.prefetch(group[i]);
+      }
+    }
+    for (size_t i = 0; i < count; i++) {
+      const slot_t *slot = maybe[i] ? slots_.find(group[i]) : nullptr;
+      if (slot != nullptr) {
+        found(base + i, *slot);
+      }
+    }
+  }
+}
+
+void HeaderIndex::find_many(const hash_t *hashes, size_t n,
+                            const IndexEntry **out) const {
+  std::fill(out, out + n, nullptr);
+  probe_many(hashes, n,
+             [&](size_t i, slot_t slot) { out[i] = &entries_[slot]; });
+}
+
+size_t HeaderIndex::contains_many(const hash_t *hashes, size_t n,
+                                  bool *out) const {
+  size_t hits = 0;
+  std::fill(out, out + n, false);
+  probe_many(hashes, n, [&](size_t i, slot_t) {
+    out[i] = true;
+    hits++;
+  });
+  return hits;
+}
+
+// Pick the height each skip pointer goes back to, like GetSkipHeight() in
+// Bitcoin Core: any number strictly lower than height would work, but these
+// make ancestor() take O(log n) steps.
+static inline uint32_t invert_lowest_one(uint32_t n) { return n & (n - 1); }
+
+static inline uint32_t skip_height(uint32_t height) {
+  if (height < 2) {
+    return 0;
+  }
+  return (height & 1) ? invert_lowest_one(invert_lowest_one(height - 1)) + 1
+                      : invert_lowest_one(height);
+}
+
+HeaderIndex::slot_t HeaderIndex::slot(const hash_t &hash) const {
+  const slot_t *slot = slots_.find(hash);
+  assert(slot != nullptr);
+  return *slot;
+}
+
+HeaderIndex::slot_t HeaderIndex::ancestor(slot_t slot, size_t height) const {
+  assert(height <= entries_[slot].height);
+  size_t walk = entries_[slot].height;
+  while (walk > height) {
+    const IndexEntry &entry = entries_[slot];
+    const size_t skip = skip_height(walk);
+    const size_t skip_prev = skip_height(walk - 1);
+    // Take the skip pointer unless it overshoots, or following the parent's
+    // skip pointer would get much closer.
+    if (entry.skip != no_slot &&
+        (skip == height ||
+         (skip > height && !(skip_prev + 2 < skip && skip_prev >= height)))) {
+      slot = entry.skip;
+      walk = skip;
+    } else {
+      slot = entry.parent;
+      walk--;
+    }
+  }
+  return slot;
+}
+
+HeaderIndex::slot_t HeaderIndex::last_common_ancestor(slot_t a,
+                                                      slot_t b) const {
+  if (entries_[a].height > entries_[b].height) {
+    a = ancestor(a, entries_[b].height);
+  } else if (entries_[b].height > entries_[a].height) {
+    b = ancestor(b, entries_[a].height);
+  }
+  while (a != b) {
+    a = entries_[a].parent;
+    b = entries_[b].parent;
+    assert(a != no_slot && b != no_slot);
+  }
+  return a;
+}
+
+uint32_t HeaderIndex::next_difficulty(slot_t slot, uint32_t timestamp) const {
+  const IndexEntry &parent = entries_[slot];
+  const IndexEntry &first = entries_[parent.epoch];
+  return spv::next_difficulty(parent.height, parent.difficulty(),
+                              parent.timestamp(), first.difficulty(),
+                              first.timestamp(), timestamp);
+}
+
+const IndexEntry &HeaderIndex::insert(const BlockHeader &hdr) {
+  const IndexEntry *existing = find(hdr.block_hash);
+  if (existing != nullptr) {
+    return *existing;
+  }
+  assert(entries_.size() < std::numeric_limits<slot_t>::max());
+
+  const slot_t *parent_slot = slots_.find(hdr.prev_block);
+  const IndexEntry *parent = parent_slot ? &entries_[*parent_slot] : nullptr;
+  assert(parent != nullptr || hdr.is_genesis());
+  assert(parent == nullptr || hdr.height == parent->height + 1);
+
+  IndexEntry entry;
+  hdr.pack(entry.data.data());
+  entry.hash = hdr.block_hash;
+  entry.height = hdr.height;
+  entry.parent = entry.skip = no_slot;
+  entry.epoch = entries_.size();
+  entry.chainwork = block_work(hdr.difficulty);
+  if (parent != nullptr) {
+    entry.parent = *parent_slot;
+    entry.skip = ancestor(*parent_slot, skip_height(hdr.height));
+    entry.chainwork += parent->chainwork;
+    if (hdr.height % RETARGET_INTERVAL) {
+      entry.epoch = parent->epoch;
+    }
+  }
+
+  if (entries_.size() >= filter_.capacity()) {
+    // doubling keeps the rebuilds amortized constant per insert
+    rebuild_filter(std::max<size_t>(2 * entries_.size(), 1 << 16));
+  }
+  filter_.add(hdr.block_hash);
+  slots_.emplace(hdr.block_hash, entries_.size());
+  entries_.push_back(entry);
+  return entries_.back();
+}
+
+void HeaderIndex::clear() {
+  entries_.clear();
+  slots_.clear();
+  filter_.reset(0);
+}
+
+// the image is the entries' bytes, without padding to leave undefined
+static_assert(sizeof(IndexEntry) ==
+                  BLOCK_HEADER_SIZE + sizeof(hash_t) + 4 * sizeof(uint32_t) +
+                      sizeof(uint256),
+              "IndexEntry has padding");
+static_assert(sizeof(IndexEntry) % sizeof(uint64_t) == 0,
+              "IndexEntry isn't a whole number of words");
+
+bool HeaderIndex::write_image(std::FILE *file) const {
+  return std::fwrite(entries_.data(), sizeof(IndexEntry), entries_.size(),
+                     file) == entries_.size();
+}
+
+bool HeaderIndex::read_image(std::FILE *file, size_t n) {
+  clear();
+  if (n >= no_slot) {
+    return false;
+  }
+  entries_.resize(n);
+  if (std::fread(entries_.data(), sizeof(IndexEntry), n, file) != n) {
+    clear();
+    return false;
+  }
+  slots_.reserve(n);
+  for (slot_t slot = 0; slot < n; slot++) {
+    slots_.emplace(entries_[slot].hash, slot);
+  }
+  rebuild_filter(std::max<size_t>(2 * n, 1 << 16));
+  return true;
+}
+
+// A multiply-xorshift over each word, which runs at memory speed. It only
+// has to catch torn and truncated files, not anyone forging one.
+uint64_t HeaderIndex::checksum() const {
+  const char *bytes = reinterpret_cast<const char *>(entries_.data());
+  const size_t words = entries_.size() * sizeof(IndexEntry) / sizeof(uint64_t);
+  uint64_t sum = words;
+  for (size_t i = 0; i < words; i++) {
+    uint64_t word;
+    std::memcpy(&word, bytes + i * sizeof word, sizeof word);
+    sum = (sum ^ word) * 0x9e3779b97f4a7c15;
+    sum ^= sum >> 29;
+  }
+  return sum;
+}
+
+void HeaderIndex::rebuild_filter(size_t n) {
+  filter_.reset(n);
+  for (const IndexEntry &entry : entries_) {
+    filter_.add(entry.hash);
+  }
+}
+
+size_t BestChain::first_at_time(uint32_t time) const {
+  return std::lower_bound(max_times_.begin(), max_times_.end(), time) -
+         max_times_.begin();
+}
+
+void BestChain::push(slot_t slot, uint32_t timestamp) {
+  slots_.push_back(slot);
+  times_.push_back(timestamp);
+  max_times_.push_back(max_times_.empty()
+                           ? timestamp
+                           : std::max(max_times_.back(), timestamp));
+}
+
+void BestChain::truncate(size_t height) {
+  if (height < slots_.size()) {
+    slots_.resize(height);
+    times_.resize(height);
+    max_times_.resize(height);
+  }
+}
+}  // namespace spv
@@ -0,0 +1,207 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <endian.h>
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "./constants.h"
+#include "./fields.h"
+#include "./hashmap.h"
+#include "./memory.h"
+#include "./uint256.h"
+
+namespace spv {
+// A header in the index, kept in its 80-byte wire encoding.
+struct IndexEntry {
+  std::array<char, BLOCK_HEADER_SIZE> data;
+  hash_t hash;
+  uint32_t height;
+  uint32_t parent;    // slot of the parent, or HeaderIndex::no_slot
+  uint32_t skip;      // slot of an earlier ancestor, to speed up ancestor()
+  uint32_t epoch;     // slot of the first header of its retarget interval
+  uint256 chainwork;  // total work up to and including this header
+
+  inline uint32_t timestamp() const { return load32(68); }
+  inline uint32_t difficulty() const { return load32(72); }
+
+  // decode the full header
+  BlockHeader header() const;
+
+  // the same encoding as BlockHeader::db_encode(), from the stored bytes,
+  // or the compact one (see is_compact_record())
+  std::string db_encode(bool compact = false) const;
+
+ private:
+  inline uint32_t load32(size_t off) const {
+    uint32_t val;
+    std::memcpy(&val, data.data() + off, sizeof val);
+    return le32toh(val);
+  }
+};
+
+// HeaderIndex keeps every non-orphan header in memory so that lookups by
+// hash never touch the database. RocksDB is only used to persist it. The
+// entries form a tree, since all forks are kept; besides its parent each
+// entry has a skip pointer, as in Bitcoin Core, which makes finding an
+// ancestor at some height take O(log n) steps. Both tables are on huge
+// pages with --huge-pages; see HugePageAllocator. A HashFilter of every
+// hash in front of the table answers most lookups of unknown hashes, as
+// from inv announcements and headers replies, without the cache misses of
+// probing it.
+class HeaderIndex {
+ public:
+  typedef uint32_t slot_t;
+
+  static constexpr slot_t no_slot = std::numeric_limits<slot_t>::max();
+
+  HeaderIndex() {}
+  HeaderIndex(const HeaderIndex &other) = delete;
+
+  inline size_t size() const { return entries_.size(); }
+
+  inline size_t memory_usage() const {
+    return entries_.capacity() * sizeof(IndexEntry) + slots_.memory_usage() +
+           filter_.memory_usage();
+  }
+
+  inline void reserve(size_t n) {
+    entries_.reserve(n);
+    slots_.reserve(n);
+    if (n > filter_.capacity()) {
+      rebuild_filter(n);
+    }
+  }
+
+  inline bool contains(const hash_t &hash) const {
+    return filter_.may_contain(hash) && slots_.contains(hash);
+  }
+
+  // Find a header by hash; returns nullptr if it's not in the index. The
+  // pointer is only valid until the next insert.
+  const IndexEntry *find(const hash_t &hash) const;
+
+  // Like find() and contains() for each of n hashes, into out[i], for
+  // lookups that don't depend on each other (an inv, a locator). They go
+  // in groups, as in a group-prefetching hash join: every hash's filter
+  // block is prefetched, then every hash that passes the filter has its
+  // table slot prefetched, then those are probed, so the misses overlap.
+  // contains_many() returns how many were found.
+  void find_many(const hash_t *hashes, size_t n,
+                 const IndexEntry **out) const;
+  size_t contains_many(const hash_t *hashes, size_t n, bool *out) const;
+
+  inline const IndexEntry &at(slot_t slot) const { return entries_[slot]; }
+
+  // the slot of a header, which must be in the index
+  slot_t slot(const hash_t &hash) const;
+
+  // the ancestor of the header in this slot at this height, which must not
+  // be above the header's own height
+  slot_t ancestor(slot_t slot, size_t height) const;
+
+  // the latest header that both of these headers descend from
+  slot_t last_common_ancestor(slot_t a, slot_t b) const;
+
+  // The nBits that a header with this timestamp needs to follow the header
+  // in this slot. Each entry knows the first header of its interval, so
+  // this takes constant time instead of a walk back through the ancestors.
+  uint32_t next_difficulty(slot_t parent, uint32_t timestamp) const;
+
+  // Add a header whose height is already known. Its parent must already be
+  // in the index (unless this is the genesis block), since the chainwork is
+  // accumulated from it. Inserting a duplicate returns the existing entry.
+  const IndexEntry &insert(const BlockHeader &hdr);
+
+  // drop every entry
+  void clear();
+
+  // The entries as they are in memory, for a file that read_image() can
+  // load much faster than inserting every header again. read_image()
+  // replaces the index with n entries read from the file, rebuilding the
+  // hash table and filter; either returns false on a short read or write.
+  // The checksum covers the entries' bytes, to catch a torn image.
+  bool write_image(std::FILE *file) const;
+  bool read_image(std::FILE *file, size_t n);
+  uint64_t checksum() const;
+
+ private:
+  std::vector<IndexEntry, HugePageAllocator<IndexEntry> > entries_;
+  FlatHashMap<hash_t, slot_t, BlockHashHasher, HugePageAllocator<char> >
+      slots_;
+  HashFilter filter_;
+
+  // size the filter for n entries and add all of them again
+  void rebuild_filter(size_t n);
+
+  // call found(i, slot) for each of the n hashes in the index, as
+  // described at find_many()
+  template <typename F>
+  void probe_many(const hash_t *hashes, size_t n, F found) const;
+};
+
+// BestChain lays the best chain out by height, as parallel arrays: each
+// header's slot in the HeaderIndex, its timestamp, and the latest timestamp
+// up to it. Looking up a height is then an array read rather than a walk
+// back from the tip, and scans over the timestamps stay in a few cache
+// lines. The HeaderIndex maps hashes to slots, which have their heights.
+class BestChain {
+ public:
+  typedef HeaderIndex::slot_t slot_t;
+
+  BestChain() {}
+  BestChain(const BestChain &other) = delete;
+
+  inline size_t size() const { return slots_.size(); }
+  inline bool empty() const { return slots_.empty(); }
+
+  inline size_t memory_usage() const {
+    return (slots_.capacity() + times_.capacity() + max_times_.capacity()) *
+           sizeof(uint32_t);
+  }
+
+  inline slot_t slot(size_t height) const { return slots_[height]; }
+  inline uint32_t timestamp(size_t height) const { return times_[height]; }
+
+  // is the header in this slot, at this height, on the best chain?
+  inline bool contains(slot_t slot, size_t height) const {
+    return height < slots_.size() && slots_[height] == slot;
+  }
+
+  // the lowest height with a timestamp, or one below it, at least time, or
+  // size() if there's none; like FindEarliestAtLeast() in Bitcoin Core
+  size_t first_at_time(uint32_t time) const;
+
+  // append the header after the last one
+  void push(slot_t slot, uint32_t timestamp);
+
+  // drop the headers from this height up
+  void truncate(size_t height);
+
+ private:
+  std::vector<slot_t> slots_;
+  std::vector<uint32_t> times_;
+  std::vector<uint32_t> max_times_;  // never decreases, for first_at_time()
+};
+}  // namespace spv
@@ -0,0 +1,243 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./inv_tracker.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+namespace spv {
+RollingBloom::RollingBloom(size_t n, double fp_rate)
+    : capacity_(n), count_(0), current_(0), tweak_(rand64()) {
+  // the usual sizing, for n per generation; checking both about doubles
+  // the false positive rate
+  const double ln2 = std::log(2.0);
+  const double bits = -double(n) * std::log(fp_rate / 2) / (ln2 * ln2);
+  nbits_ = std::max<size_t>(1, (size_t(bits) + 63) / 64) * 64;
+  hash_funcs_ = std::max(1u, unsigned(std::lround(bits / n * ln2)));
+  for (auto &gen : bits_) {
+    gen.assign(nbits_ / 64, 0);
+  }
+}
+
+// splitmix64's finalizer, so the tweak reaches every bit
+static inline uint64_t mix(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+  return x ^ (x >> 31);
+}
+
+inline std::pair<uint64_t, uint64_t> RollingBloom::seeds(
+    const hash_t &hash) const {
+  // the low-order bytes, as in BlockHashHasher; the step is odd so it's
+  // never zero
+  uint64_t a, b;
+  std::memcpy(&a, hash.data() + 16, sizeof a);
+  std::memcpy(&b, hash.data() + 24, sizeof b);
+  return {mix(a ^ tweak_), mix(b + tweak_) | 1};
+}
+
+void RollingBloom::insert(const hash_t &hash) {
+  if (count_ == capacity_) {
+    current_ ^= 1;
+    std::fill(bits_[current_].begin(), bits_[current_].end(), 0);
+    count_ = 0;
+  }
+  count_++;
+  std::vector<uint64_t> &gen = bits_[current_];
+  const auto s = seeds(hash);
+  for (unsigned i = 0; i < hash_funcs_; i++) {
+    const size_t bit = (s.first + i * s.second) % nbits_;
+    gen[bit / 64] |= uint64_t(1) << (bit % 64);
+  }
+}
+
+bool RollingBloom::contains(const hash_t &hash) const {
+  const auto s = seeds(hash);
+  for (const auto &gen : bits_) {
+    unsigned i = 0;
+    for (; i < hash_funcs_; i++) {
+      const size_t bit = (s.first + i * s.second) % nbits_;
+      if (!(gen[bit / 64] & uint64_t(1) << (bit % 64))) {
+        break;
+      }
+    }
+    if (i == hash_funcs_) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void RollingBloom::clear() {
+  for (auto &gen : bits_) {
+    std::fill(gen.begin(), gen.end(), 0);
+  }
+  count_ = 0;
+}
+
+KnownInvs::KnownInvs() : count_(0), current_(0), tweak_(rand64()) {
+  std::memset(lines_, 0, sizeof lines_);
+}
+
+// The line, and HASH_FUNCS bit offsets in it nine bits each, all from one
+// mix of the hash. Returns the line index.
+static inline size_t known_bits(const hash_t &hash, uint64_t tweak,
+                                size_t lines, uint64_t &bits) {
+  uint64_t a, b;
+  std::memcpy(&a, hash.data() + 16, sizeof a);
+  std::memcpy(&b, hash.data() + 24, sizeof b);
+  bits = mix(b ^ tweak);
+  return mix(a + tweak) % lines;
+}
+
+bool KnownInvs::insert(const hash_t &hash) {
+  uint64_t bits;
+  const size_t line = known_bits(hash, tweak_, LINES, bits);
+  uint64_t mask[LINE_WORDS] = {};
+  for (unsigned i = 0; i < HASH_FUNCS; i++, bits >>= 9) {
+    mask[(bits & 511) / 64] |= uint64_t(1) << (bits % 64);
+  }
+  for (const auto &gen : lines_) {
+    const uint64_t *words = gen[line].words;
+    size_t i = 0;
+    while (i < LINE_WORDS && (words[i] & mask[i]) == mask[i]) {
+      i++;
+    }
+    if (i == LINE_WORDS) {
+      return false;
+    }
+  }
+  if (count_ == CAPACITY) {
+    current_ ^= 1;
+    std::memset(lines_[current_], 0, sizeof lines_[current_]);
+    count_ = 0;
+  }
+  count_++;
+  uint64_t *words = lines_[current_][line].words;
+  for (size_t i = 0; i < LINE_WORDS; i++) {
+    words[i] |= mask[i];
+  }
+  return true;
+}
+
+bool KnownInvs::contains(const hash_t &hash) const {
+  uint64_t bits;
+  const size_t line = known_bits(hash, tweak_, LINES, bits);
+  for (const auto &gen : lines_) {
+    const uint64_t *words = gen[line].words;
+    uint64_t b = bits;
+    unsigned i = 0;
+    for (; i < HASH_FUNCS; i++, b >>= 9) {
+      if (!(words[(b & 511) / 64] & uint64_t(1) << (b % 64))) {
+        break;
+      }
+    }
+    if (i == HASH_FUNCS) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void InvTracker::request(const Inv &inv, const Addr &peer,
+                         std::vector<Addr> &&alternates, time_point now) {
+  alternates.erase(std::remove(alternates.begin(), alternates.end(), peer),
+                   alternates.end());
+  auto slot = inflight_.emplace(inv);
+  Request &req = *slot.first;
+  if (!slot.second) {
+    uncount(req.peer);
+  }
+  per_peer_[peer]++;
+  req.peer = peer;
+  req.alternates = std::move(alternates);
+  req.sent = now;
+}
+
+bool InvTracker::announce(const Inv &inv, const Addr &peer) {
+  Request *req = inflight_.find(inv);
+  if (req == nullptr) {
+    return false;
+  }
+  if (req->peer != peer && std::find(req->alternates.begin(),
+                                     req->alternates.end(),
+                                     peer) == req->alternates.end()) {
+    req->alternates.push_back(peer);
+  }
+  return true;
+}
+
+bool InvTracker::finish(const Inv &inv) {
+  recent_.insert(inv.hash);
+  const Request *req = inflight_.find(inv);
+  if (req == nullptr) {
+    return false;
+  }
+  uncount(req->peer);
+  inflight_.erase(inv);
+  return true;
+}
+
+void InvTracker::uncount(const Addr &peer) {
+  auto it = per_peer_.find(peer);
+  assert(it != per_peer_.end());
+  if (--it->second == 0) {
+    per_peer_.erase(it);
+  }
+}
+
+template <typename F>
+void InvTracker::take(std::vector<Retry> &out, F match) {
+  const size_t start = out.size();
+  inflight_.for_each([&](const Inv &inv, const Request &req) {
+    if (match(req)) {
+      out.emplace_back(inv, req.alternates);
+      uncount(req.peer);
+    }
+  });
+  // the map can't change while it's being walked
+  for (size_t i = start; i < out.size(); i++) {
+    inflight_.erase(out[i].first);
+  }
+}
+
+void InvTracker::expire(time_point now, std::chrono::milliseconds timeout,
+                        std::vector<Retry> &out) {
+  take(out, [&](const Request &req) { return now - req.sent >= timeout; });
+}
+
+void InvTracker::release(const Addr &peer, std::vector<Retry> &out) {
+  take(out, [&](const Request &req) { return req.peer == peer; });
+}
+
+void InvTracker::clear() {
+  inflight_.clear();
+  per_peer_.clear();
+  recent_.clear();
+}
+
+size_t InvTracker::memory_usage() const {
+  size_t bytes = inflight_.memory_usage() + recent_.memory_usage() +
+                 per_peer_.size() * (sizeof(Addr) + sizeof(size_t));
+  inflight_.for_each([&](const Inv &, const Request &req) {
+    bytes += req.alternates.capacity() * sizeof(Addr);
+  });
+  return bytes;
+}
+}  // namespace spv
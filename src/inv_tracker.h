@@ -0,0 +1,178 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "./addr.h"
+#include "./fields.h"
+#include "./hashmap.h"
+#include "./util.h"
+
+namespace spv {
+// A bloom filter of the last hashes inserted, as in Core's
+// CRollingBloomFilter: two generations of bits, each sized for n hashes.
+// Inserts go into the current one, and once it's full the older one is
+// cleared and takes its place, so the last n to 2n hashes are remembered
+// in constant space. Hashes are already uniform, so the bit positions come
+// from their words mixed with a random tweak, not from hashing them again.
+class RollingBloom {
+ public:
+  RollingBloom(size_t n, double fp_rate);
+
+  void insert(const hash_t &hash);
+
+  bool contains(const hash_t &hash) const;
+
+  void clear();
+
+  inline size_t memory_usage() const {
+    return 2 * bits_[0].capacity() * sizeof(uint64_t);
+  }
+
+ private:
+  std::vector<uint64_t> bits_[2];
+  size_t nbits_;
+  unsigned hash_funcs_;
+  size_t capacity_;  // hashes per generation
+  size_t count_;     // in the current generation
+  unsigned current_;
+  uint64_t tweak_;
+
+  // the two halves of the double hashing that picks hash_t's bits
+  inline std::pair<uint64_t, uint64_t> seeds(const hash_t &hash) const;
+};
+
+// The hashes a peer is known to have, because it announced them or we
+// asked it for them, as in Core's m_tx_inventory_known_filter. It's fixed
+// size so every connection can have one: two generations of CAPACITY
+// hashes, rotated like RollingBloom. A hash's bits all fall in one cache
+// line, so a check touches at most two lines. At 64 bits a hash the odds
+// of a false positive are a few in a million.
+class KnownInvs {
+ public:
+  static constexpr size_t CAPACITY = 1000;  // hashes per generation
+
+  KnownInvs();
+
+  // Add hash, returning false if it was (probably) already there.
+  bool insert(const hash_t &hash);
+
+  bool contains(const hash_t &hash) const;
+
+ private:
+  static constexpr size_t LINE_WORDS = 8;  // 64 byte cache lines
+  static constexpr size_t LINES = CAPACITY * 64 / 512;
+  static constexpr unsigned HASH_FUNCS = 7;
+
+  struct alignas(64) Line {
+    uint64_t words[LINE_WORDS];
+  };
+
+  Line lines_[2][LINES];
+  size_t count_;  // in the current generation
+  unsigned current_;
+  uint64_t tweak_;
+};
+
+// InvTracker keeps the items we've sent a getdata for, keyed by inv, with
+// the peer each was asked of, when, and any other peers that announced it
+// since, so that one which doesn't arrive can be asked of someone else.
+// Items that arrived or were found to be had already go into a rolling
+// bloom filter, so repeat announcements of them are dropped without a
+// database lookup. N.B. a false positive there skips an inv we'd want, at
+// FP_RATE odds; a later announcement of it after the filter rolls over is
+// still fetched.
+class InvTracker {
+ public:
+  // an item to ask for again, with the peers that can be asked
+  typedef std::pair<Inv, std::vector<Addr> > Retry;
+
+  static constexpr size_t RECENT = 50000;
+  static constexpr double FP_RATE = 0.000001;
+
+  InvTracker() : recent_(RECENT, FP_RATE) {}
+
+  inline size_t size() const { return inflight_.size(); }
+
+  inline bool inflight(const Inv &inv) const {
+    return inflight_.find(inv) != nullptr;
+  }
+
+  // note that a getdata for inv went to peer at now; the alternates are
+  // the other peers that announced it
+  void request(const Inv &inv, const Addr &peer, std::vector<Addr> &&alternates,
+               time_point now);
+
+  // Another announcement of inv. If it's in flight, peer is kept as an
+  // alternate and this returns true.
+  bool announce(const Inv &inv, const Addr &peer);
+
+  // Take inv out of flight, because it arrived or isn't wanted any more,
+  // and remember its hash. Returns whether it was in flight.
+  bool finish(const Inv &inv);
+
+  // remember a hash that turned out to be had without it being requested
+  inline void remember(const hash_t &hash) { recent_.insert(hash); }
+
+  // whether hash arrived or was found to be had recently
+  inline bool recent(const hash_t &hash) const {
+    return recent_.contains(hash);
+  }
+
+  // Take out the requests sent before now - timeout, adding them to out
+  // with the alternates they can be asked of instead.
+  void expire(time_point now, std::chrono::milliseconds timeout,
+              std::vector<Retry> &out);
+
+  // take out everything asked of peer, e.g. as it disconnected
+  void release(const Addr &peer, std::vector<Retry> &out);
+
+  // number of items in flight from peer
+  inline size_t count(const Addr &peer) const {
+    auto it = per_peer_.find(peer);
+    return it == per_peer_.end() ? 0 : it->second;
+  }
+
+  void clear();
+
+  size_t memory_usage() const;
+
+ private:
+  struct Request {
+    Addr peer;
+    std::vector<Addr> alternates;
+    time_point sent;
+  };
+
+  FlatHashMap<Inv, Request, InvHasher> inflight_;
+  std::unordered_map<Addr, size_t> per_peer_;
+  RollingBloom recent_;
+
+  // one less item in flight from peer
+  void uncount(const Addr &peer);
+
+  // take out the requests that match, adding them to out
+  template <typename F>
+  void take(std::vector<Retry> &out, F match);
+};
+}  // namespace spv
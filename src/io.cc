@@ -0,0 +1,257 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./io.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#include "./affinity.h"
+#include "./constants.h"
+#include "./message.h"
+#include "./pow.h"
+
+namespace spv {
+LoopQueue::LoopQueue(std::shared_ptr<uvw::Loop> loop)
+    : wakeup_(loop->resource<uvw::AsyncHandle>()), closed_(false) {
+  wakeup_->on<uvw::AsyncEvent>([this](const auto &, auto &) {
+    Task task;
+    while (tasks_.pop(task)) {
+      task();
+    }
+  });
+}
+
+void LoopQueue::post(Task &&task) {
+  if (!closed_.load(std::memory_order_acquire)) {
+    tasks_.push(std::move(task));
+    wakeup_->send();
+  }
+}
+
+void LoopQueue::close() {
+  closed_.store(true, std::memory_order_release);
+  wakeup_->close();
+}
+
+IoLoop::IoLoop()
+    : loop_(uvw::Loop::create()), queue_(new LoopQueue(loop_)) {
+  thread_ = std::thread([loop = loop_]() {
+    place_thread(ThreadGroup::NETWORK);
+    loop->run();
+  });
+}
+
+IoLoop::~IoLoop() {
+  // closing every handle, the queue's included, lets run() return
+  post([this]() {
+    queue_->close();
+    loop_->walk([](uvw::BaseHandle &h) {
+      if (!h.closing()) {
+        h.close();
+      }
+    });
+  });
+  thread_.join();
+  loop_->close();
+}
+
+IoPool::IoPool(size_t threads, std::shared_ptr<uvw::Loop> owner)
+    : owner_(new LoopQueue(owner)), next_(0) {
+  assert(threads > 0);
+  for (size_t i = 0; i < threads; i++) {
+    loops_.emplace_back(new IoLoop());
+  }
+}
+
+IoLoop &IoPool::next() { return *loops_[next_++ % loops_.size()]; }
+
+void IoPool::shutdown() {
+  // the I/O threads must be gone before the owner stops taking reports
+  loops_.clear();
+  owner_->close();
+}
+
+void IoSocket::connect(const Addr &addr, const SocketTuning &tuning,
+                       const Addr *proxy) {
+  auto self = shared_from_this();
+  const Addr dest = proxy != nullptr ? *proxy : addr;
+  if (proxy != nullptr) {
+    socks_.reset(new Socks5Handshake(addr));  // not used until connected
+  }
+  io_.post([self, dest, tuning]() {
+    // The handlers keep the socket alive until the handle is closed; the
+    // CloseEvent handler breaks the cycle.
+    auto tcp = self->io_.loop()->resource<uvw::TcpHandle>(dest.af());
+    tune_socket(*tcp, tuning);
+    self->tcp_ = tcp;
+    tcp->on<uvw::ErrorEvent>([self](const auto &exc, auto &) {
+      self->report([code = exc.code(), what = std::string(exc.what())](
+                       Callbacks &cb) { cb.error(code, what); });
+    });
+    tcp->on<uvw::WriteEvent>([self](const auto &, auto &) {
+      const size_t size = self->writes_.front();
+      self->writes_.pop_front();
+      if (size) {  // 0 for the proxy handshake, which the owner didn't send
+        self->report([size](Callbacks &cb) { cb.written(size); });
+      }
+    });
+    tcp->once<uvw::ConnectEvent>([self](const auto &, auto &tcp) {
+      if (!self->paused_) {
+        tcp.read();
+      }
+      if (self->socks_) {
+        size_t size;
+        self->writes_.push_back(0);
+        tcp.write(self->socks_->request(size), size);
+      }
+      self->report([](Callbacks &cb) { cb.connected(); });
+    });
+    tcp->on<uvw::DataEvent>([self, tuning](const auto &data, auto &tcp) {
+      rearm_quickack(tcp, tuning);
+      self->on_data(data.data.get(), data.length);
+    });
+    tcp->once<uvw::EndEvent>([self](const auto &, auto &) {
+      self->report([](Callbacks &cb) { cb.end(); });
+    });
+    tcp->once<uvw::CloseEvent>([self](const auto &, auto &) {
+      self->tcp_.reset();
+      self->report([](Callbacks &cb) { cb.closed(); }, true);
+    });
+
+    sockaddr_storage sa;
+    dest.to_sockaddr(sa);
+    tcp->connect(reinterpret_cast<const sockaddr &>(sa));
+  });
+}
+
+void IoSocket::write(std::unique_ptr<char[]> data, size_t size) {
+  // std::function needs a copyable task
+  auto buf = std::make_shared<std::unique_ptr<char[]> >(std::move(data));
+  auto self = shared_from_this();
+  io_.post([self, buf, size]() {
+    if (self->tcp_) {
+      self->writes_.push_back(size);
+      self->tcp_->write(std::move(*buf), size);
+    }
+  });
+}
+
+void IoSocket::pause(bool paused) {
+  auto self = shared_from_this();
+  io_.post([self, paused]() {
+    if (self->paused_ == paused) {
+      return;
+    }
+    self->paused_ = paused;
+    if (self->tcp_ && !self->broken_) {
+      if (paused) {
+        self->tcp_->stop();
+      } else {
+        self->tcp_->read();
+      }
+    }
+  });
+}
+
+void IoSocket::close() {
+  if (closing_) {
+    return;
+  }
+  closing_ = true;
+  auto self = shared_from_this();
+  io_.post([self]() {
+    if (self->tcp_) {
+      self->tcp_->close();
+    } else {
+      self->report([](Callbacks &cb) { cb.closed(); }, true);
+    }
+  });
+}
+
+void IoSocket::report(std::function<void(Callbacks &)> &&fn, bool always) {
+  auto self = shared_from_this();
+  owner_.post([self, fn = std::move(fn), always]() {
+    if (always || !self->closing_) {
+      fn(self->callbacks);
+    }
+  });
+}
+
+void IoSocket::on_data(const char *data, size_t size) {
+  if (broken_) {
+    return;  // already gave up on this stream
+  }
+  if (socks_) {
+    const size_t used = socks_->consume(data, size);
+    if (socks_->error() != nullptr) {
+      broken_ = true;
+      tcp_->stop();
+      report([why = socks_->error()](Callbacks &cb) { cb.error(EPROTO, why); });
+      return;
+    }
+    data += used;
+    size -= used;
+    if (!socks_->done()) {
+      return;
+    }
+    socks_.reset();
+    report([](Callbacks &cb) { cb.proxied(); });
+  }
+  partial_.append(data, size);
+  size_t off = 0;
+  while (partial_.size() - off >= HEADER_SIZE) {
+    const char *msg = partial_.data() + off;
+    const size_t msg_size = message_size(msg);
+    const char *why = nullptr;
+    if (msg_size > MAX_MESSAGE_SIZE) {
+      why = "oversized message";
+    } else if (partial_.size() - off < msg_size) {
+      break;
+    } else {
+      std::array<char, 4> sum;
+      checksum(msg + HEADER_SIZE, msg_size - HEADER_SIZE, sum);
+      if (std::memcmp(sum.data(), msg + HEADER_CHECKSUM_OFFSET, 4) != 0) {
+        why = "bad message checksum";
+      }
+    }
+    if (why != nullptr) {
+      broken_ = true;
+      tcp_->stop();
+      partial_.clear();
+      report([why](Callbacks &cb) { cb.error(EBADMSG, why); });
+      return;
+    }
+    off += msg_size;
+  }
+  if (off == 0) {
+    return;
+  }
+
+  std::string batch;
+  if (off == partial_.size()) {
+    batch.swap(partial_);
+  } else {
+    batch.assign(partial_, 0, off);
+    partial_.erase(0, off);
+  }
+  report([batch = std::move(batch)](Callbacks &cb) mutable {
+    cb.data(std::move(batch));
+  });
+}
+}  // namespace spv
@@ -0,0 +1,217 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./addr.h"
+#include "./sockopt.h"
+#include "./socks5.h"
+#include "./uvw.h"
+
+namespace spv {
+// A lock-free multi-producer, single-consumer queue, after Dmitry Vyukov's
+// intrusive MPSC design. push() may be called from any thread, pop() only
+// from the one consumer.
+template <typename T>
+class MpscQueue {
+ public:
+  MpscQueue() : head_(&stub_), tail_(&stub_) {}
+  MpscQueue(const MpscQueue &other) = delete;
+  ~MpscQueue() {
+    T val;
+    while (pop(val)) {
+    }
+  }
+
+  void push(T &&val) { push(new Node(std::move(val))); }
+
+  // Take the oldest item. Returns false if the queue is empty, or if a push
+  // hasn't finished linking its item in yet.
+  bool pop(T &out) {
+    Node *tail = tail_;
+    Node *next = tail->next.load(std::memory_order_acquire);
+    if (tail == &stub_) {
+      if (next == nullptr) {
+        return false;
+      }
+      tail_ = tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if (next == nullptr) {
+      if (tail != head_.load(std::memory_order_acquire)) {
+        return false;
+      }
+      push(&stub_);
+      next = tail->next.load(std::memory_order_acquire);
+      if (next == nullptr) {
+        return false;
+      }
+    }
+    tail_ = next;
+    out = std::move(tail->val);
+    delete tail;
+    return true;
+  }
+
+ private:
+  struct Node {
+    T val;
+    std::atomic<Node *> next;
+
+    Node() : next(nullptr) {}
+    explicit Node(T &&val) : val(std::move(val)), next(nullptr) {}
+  };
+
+  Node stub_;
+  std::atomic<Node *> head_;  // last pushed
+  Node *tail_;                // next to pop, only touched by the consumer
+
+  void push(Node *node) {
+    node->next.store(nullptr, std::memory_order_relaxed);
+    Node *prev = head_.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+  }
+};
+
+// Runs tasks posted from any thread on a loop's own thread.
+class LoopQueue {
+ public:
+  typedef std::function<void()> Task;
+
+  // must be called on the loop's thread
+  explicit LoopQueue(std::shared_ptr<uvw::Loop> loop);
+  LoopQueue(const LoopQueue &other) = delete;
+
+  // Queue a task from any thread. Tasks posted after close() are dropped.
+  void post(Task &&task);
+
+  // stop running tasks and release the loop; on the loop's thread
+  void close();
+
+ private:
+  MpscQueue<Task> tasks_;
+  std::shared_ptr<uvw::AsyncHandle> wakeup_;
+  std::atomic<bool> closed_;
+};
+
+// An event loop running on its own thread.
+class IoLoop {
+ public:
+  IoLoop();
+  IoLoop(const IoLoop &other) = delete;
+  ~IoLoop();
+
+  // run a task on the loop's thread
+  inline void post(LoopQueue::Task &&task) { queue_->post(std::move(task)); }
+
+  // only to be used from the loop's thread
+  inline std::shared_ptr<uvw::Loop> loop() const { return loop_; }
+
+ private:
+  std::shared_ptr<uvw::Loop> loop_;
+  std::unique_ptr<LoopQueue> queue_;
+  std::thread thread_;
+};
+
+// IoPool shards socket I/O across a few IoLoops. Sockets report back to the
+// owner loop, where the client and the chain live, through owner().
+class IoPool {
+ public:
+  IoPool(size_t threads, std::shared_ptr<uvw::Loop> owner);
+  IoPool(const IoPool &other) = delete;
+
+  inline size_t size() const { return loops_.size(); }
+
+  // the loop for the next socket, round robin
+  IoLoop &next();
+
+  inline LoopQueue &owner() { return *owner_; }
+
+  // close every socket and join the threads; on the owner loop
+  void shutdown();
+
+ private:
+  std::unique_ptr<LoopQueue> owner_;
+  std::vector<std::unique_ptr<IoLoop> > loops_;
+  size_t next_;
+};
+
+// A TCP connection whose socket lives on an IoLoop. Calls made on the owner
+// loop are forwarded to the I/O thread. That thread reads the stream, splits
+// it into whole p2p messages and checks their checksums, and then hands
+// them back to the owner loop in batches.
+class IoSocket : public std::enable_shared_from_this<IoSocket> {
+ public:
+  // Run on the owner loop. Except for closed, none of these are called
+  // after close().
+  struct Callbacks {
+    std::function<void()> connected;
+    std::function<void()> proxied;  // see connect()
+    std::function<void(std::string &&messages)> data;
+    // code is EBADMSG when the peer broke the framing (an oversized
+    // message or a bad checksum), and EPROTO for a failed proxy handshake
+    std::function<void(int code, const std::string &what)> error;
+    std::function<void()> end;
+    std::function<void()> closed;
+    std::function<void(size_t bytes)> written;
+  };
+
+  IoSocket(IoLoop &io, LoopQueue &owner) : io_(io), owner_(owner) {}
+  IoSocket(const IoSocket &other) = delete;
+
+  Callbacks callbacks;
+
+  // Connect to addr, or with a proxy, to addr through it. The peer's
+  // messages can be written once connected, or with --proxy-wait once
+  // proxied; the proxy's answers aren't passed on as data.
+  void connect(const Addr &addr, const SocketTuning &tuning,
+               const Addr *proxy = nullptr);
+  void write(std::unique_ptr<char[]> data, size_t size);
+  void close();
+
+  // stop or resume reading from the peer
+  void pause(bool paused);
+
+ private:
+  IoLoop &io_;
+  LoopQueue &owner_;
+  bool closing_ = false;  // owner loop only
+
+  // I/O thread only
+  std::shared_ptr<uvw::TcpHandle> tcp_;
+  std::string partial_;
+  bool broken_ = false;  // sent something that isn't a valid message
+  bool paused_ = false;
+  std::deque<size_t> writes_;  // sizes of the writes in flight
+  std::unique_ptr<Socks5Handshake> socks_;  // until the proxy connects us
+
+  // run a callback on the owner loop, unless the socket has been closed
+  void report(std::function<void(Callbacks &)> &&fn, bool always = false);
+
+  // I/O thread: frame the bytes read
+  void on_data(const char *data, size_t size);
+};
+}  // namespace spv
@@ -0,0 +1,189 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./json.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+
+#include "./util.h"
+
+namespace spv {
+bool JsonCursor::string(std::string &out) {
+  if (!eat('"')) {
+    return false;
+  }
+  out.clear();
+  while (p < end && *p != '"') {
+    char c = *p++;
+    if (c == '\\') {
+      if (p == end) {
+        return false;
+      }
+      switch (c = *p++) {
+        case 'b':
+          c = '\b';
+          break;
+        case 'f':
+          c = '\f';
+          break;
+        case 'n':
+          c = '\n';
+          break;
+        case 'r':
+          c = '\r';
+          break;
+        case 't':
+          c = '\t';
+          break;
+        case 'u':
+          // nothing asked of us needs more than ASCII
+          if (end - p < 4) {
+            return false;
+          }
+          p += 4;
+          c = '?';
+          break;
+        default:
+          break;  // \" \\ \/
+      }
+    }
+    out.push_back(c);
+  }
+  return eat('"');
+}
+
+bool JsonCursor::skip_nested() {
+  int depth = 0;
+  do {
+    if (p == end) {
+      return false;
+    }
+    if (*p == '"') {
+      std::string ignored;
+      if (!string(ignored)) {
+        return false;
+      }
+      continue;
+    }
+    if (*p == '{' || *p == '[') {
+      depth++;
+    } else if (*p == '}' || *p == ']') {
+      depth--;
+    }
+    p++;
+  } while (depth > 0);
+  return true;
+}
+
+bool JsonCursor::value(std::string &out, bool &is_string) {
+  ws();
+  if (p == end) {
+    return false;
+  }
+  is_string = *p == '"';
+  if (is_string) {
+    return string(out);
+  }
+  const char *start = p;
+  if (*p == '{' || *p == '[') {
+    if (!skip_nested()) {
+      return false;
+    }
+  } else {
+    while (p < end && (std::isalnum(static_cast<unsigned char>(*p)) ||
+                       *p == '-' || *p == '+' || *p == '.')) {
+      p++;
+    }
+  }
+  out.assign(start, p);
+  return p > start;
+}
+
+bool JsonRequest::size_param(size_t i, size_t &out) const {
+  if (i >= params.size() || is_string[i]) {
+    return false;
+  }
+  const std::string &text = params[i];
+  if (text.empty() || text.size() > 10 ||
+      !std::all_of(text.begin(), text.end(),
+                   [](char c) { return c >= '0' && c <= '9'; })) {
+    return false;
+  }
+  out = std::strtoul(text.c_str(), nullptr, 10);
+  return true;
+}
+
+bool JsonRequest::hex32_param(size_t i, void *out) const {
+  return i < params.size() && is_string[i] && params[i].size() == 64 &&
+         hex_decode(params[i].data(), 32, out);
+}
+
+bool parse_json_request(JsonCursor &cur, JsonRequest &req) {
+  if (!cur.eat('{')) {
+    return false;
+  }
+  req.id = "null";
+  if (cur.eat('}')) {
+    return true;
+  }
+  do {
+    std::string key, val;
+    bool quoted;
+    if (!cur.string(key) || !cur.eat(':')) {
+      return false;
+    }
+    if (key == "params") {
+      if (!cur.eat('[')) {
+        return false;
+      }
+      if (!cur.eat(']')) {
+        do {
+          if (!cur.value(val, quoted)) {
+            return false;
+          }
+          req.params.push_back(val);
+          req.is_string.push_back(quoted);
+        } while (cur.eat(','));
+        if (!cur.eat(']')) {
+          return false;
+        }
+      }
+      continue;
+    }
+    if (!cur.value(val, quoted)) {
+      return false;
+    }
+    if (key == "method") {
+      req.method = val;
+    } else if (key == "id") {
+      // a string id is echoed back quoted, so only plain ones are taken
+      if (quoted) {
+        if (std::any_of(val.begin(), val.end(), [](char c) {
+              return c == '"' || c == '\\' || (c >= 0 && c < ' ');
+            })) {
+          return false;
+        }
+        req.id = '"' + val + '"';
+      } else {
+        req.id = val;
+      }
+    }
+  } while (cur.eat(','));
+  return cur.eat('}');
+}
+}  // namespace spv
@@ -0,0 +1,88 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace spv {
+// JSON-RPC error codes
+enum JsonRpcError : int {
+  RPC_PARSE_ERROR = -32700,
+  RPC_INVALID_REQUEST = -32600,
+  RPC_METHOD_NOT_FOUND = -32601,
+  RPC_INVALID_PARAMS = -32602,
+};
+
+// Just enough of a JSON reader for the JSON-RPC requests that
+// ElectrumServer and RpcServer answer: values other than strings are kept
+// as their text, and nested ones are skipped over whole.
+struct JsonCursor {
+  const char *p;
+  const char *end;
+
+  JsonCursor(const char *data, size_t size) : p(data), end(data + size) {}
+
+  inline void ws() {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+      p++;
+    }
+  }
+
+  inline bool done() {
+    ws();
+    return p == end;
+  }
+
+  inline bool eat(char c) {
+    ws();
+    if (p < end && *p == c) {
+      p++;
+      return true;
+    }
+    return false;
+  }
+
+  // read a string, unescaped
+  bool string(std::string &out);
+
+  // skip a string, object or array, starting at its first character
+  bool skip_nested();
+
+  // Read any value: a string into out unquoted, anything else as its text.
+  bool value(std::string &out, bool &is_string);
+};
+
+// A request, with positional params kept as their JSON text, or for
+// strings, unquoted. The id is kept as JSON to be echoed back, and is null
+// if the request has none.
+struct JsonRequest {
+  std::string id;
+  std::string method;
+  std::vector<std::string> params;
+  std::vector<bool> is_string;
+
+  // Parse param i as an unsigned integer, or a string param of 64 hex
+  // digits as their 32 bytes.
+  bool size_param(size_t i, size_t &out) const;
+  bool hex32_param(size_t i, void *out) const;
+};
+
+// Parse the request object at the cursor; named params aren't supported.
+bool parse_json_request(JsonCursor &cur, JsonRequest &req);
+}  // namespace spv
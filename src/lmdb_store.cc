@@ -0,0 +1,190 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./lmdb_store.h"
+
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef SPV_LMDB
+#include <lmdb.h>
+#endif
+
+#include "./logging.h"
+#include "./pow.h"
+
+namespace spv {
+MODULE_LOGGER
+
+#ifdef SPV_LMDB
+// The map is only address space until it's written, so reserve plenty;
+// mainnet's headers take well under 200 MiB with the tree's overhead.
+static const size_t map_size = size_t(4) << 30;
+
+// the key for a height, which MDB_INTEGERKEY orders numerically
+static inline MDB_val height_key(uint32_t *height) {
+  return MDB_val{sizeof *height, height};
+}
+
+static void check(int rc, const char *what) {
+  if (rc != MDB_SUCCESS) {
+    log->error("lmdb {} failed: {}", what, mdb_strerror(rc));
+    std::abort();
+  }
+}
+
+LmdbStore::LmdbStore(const std::string &path)
+    : env_(nullptr),
+      dbi_(0),
+      write_(nullptr),
+      read_(nullptr),
+      count_(0),
+      last_(empty_hash) {
+  check(mdb_env_create(&env_), "env_create");
+  check(mdb_env_set_mapsize(env_, map_size), "env_set_mapsize");
+  // MDB_NOTLS lets the read transaction live beside the write one on the
+  // chain's thread; durability comes from sync(true) instead of every
+  // commit.
+  check(mdb_env_open(env_, path.c_str(), MDB_NOSUBDIR | MDB_NOTLS | MDB_NOSYNC,
+                     0644),
+        "env_open");
+
+  MDB_txn *txn;
+  check(mdb_txn_begin(env_, nullptr, 0, &txn), "txn_begin");
+  check(mdb_dbi_open(txn, nullptr, MDB_CREATE | MDB_INTEGERKEY, &dbi_),
+        "dbi_open");
+  MDB_cursor *cursor;
+  check(mdb_cursor_open(txn, dbi_, &cursor), "cursor_open");
+  MDB_val key, val;
+  if (mdb_cursor_get(cursor, &key, &val, MDB_LAST) == MDB_SUCCESS) {
+    uint32_t height;
+    assert(key.mv_size == sizeof height);
+    std::memcpy(&height, key.mv_data, sizeof height);
+    count_ = height + 1;
+  }
+  mdb_cursor_close(cursor);
+  check(mdb_txn_commit(txn), "txn_commit");
+
+  check(mdb_txn_begin(env_, nullptr, MDB_RDONLY, &read_), "txn_begin");
+  mdb_txn_reset(read_);
+  if (count_) {
+    last_ = header(count_ - 1).block_hash;
+  }
+  log->info("opened lmdb header store {} with {} headers", path, count_);
+}
+
+LmdbStore::~LmdbStore() {
+  sync(true);
+  mdb_txn_abort(read_);
+  mdb_env_close(env_);
+}
+
+MDB_txn *LmdbStore::batch() {
+  if (write_ == nullptr) {
+    check(mdb_txn_begin(env_, nullptr, 0, &write_), "txn_begin");
+  }
+  return write_;
+}
+
+BlockHeader LmdbStore::header(size_t height) const {
+  assert(height < count_);
+  // the batch sees its own writes; otherwise read the last commit
+  MDB_txn *txn = write_;
+  if (txn == nullptr) {
+    check(mdb_txn_renew(read_), "txn_renew");
+    txn = read_;
+  }
+  uint32_t h = height;
+  MDB_val key = height_key(&h), val;
+  check(mdb_get(txn, dbi_, &key, &val), "get");
+  assert(val.mv_size == BLOCK_HEADER_SIZE);
+  const char *raw = static_cast<const char *>(val.mv_data);
+  BlockHeader hdr;
+  hdr.unpack(raw);
+  hdr.block_hash = pow_hash(raw, BLOCK_HEADER_SIZE, true);
+  hdr.height = height;
+  if (txn == read_) {
+    mdb_txn_reset(read_);  // raw points into the map until here
+  }
+  return hdr;
+}
+
+void LmdbStore::append(const BlockHeader &hdr, const char *raw) {
+  assert(extends(hdr));
+  uint32_t height = count_;
+  MDB_val key = height_key(&height);
+  MDB_val val{BLOCK_HEADER_SIZE, const_cast<char *>(raw)};
+  // keys only ever go on the end, so skip the search from the root
+  check(mdb_put(batch(), dbi_, &key, &val, MDB_APPEND), "put");
+  count_++;
+  last_ = hdr.block_hash;
+}
+
+void LmdbStore::truncate(size_t height) {
+  if (height >= count_) {
+    return;
+  }
+  MDB_cursor *cursor;
+  check(mdb_cursor_open(batch(), dbi_, &cursor), "cursor_open");
+  // from the end, since a reorg only drops the last few
+  for (size_t n = count_ - height; n > 0; n--) {
+    MDB_val key, val;
+    check(mdb_cursor_get(cursor, &key, &val, MDB_LAST), "cursor_get");
+    check(mdb_cursor_del(cursor, 0), "cursor_del");
+  }
+  mdb_cursor_close(cursor);
+  count_ = height;
+  last_ = count_ ? header(count_ - 1).block_hash : empty_hash;
+}
+
+void LmdbStore::sync(bool wait) {
+  if (write_ != nullptr) {
+    check(mdb_txn_commit(write_), "txn_commit");
+    write_ = nullptr;
+  }
+  if (wait) {
+    check(mdb_env_sync(env_, 1), "env_sync");
+  }
+}
+#else
+// without --enable-lmdb, settings refuse --header-store lmdb
+LmdbStore::LmdbStore(const std::string &path)
+    : env_(nullptr),
+      dbi_(0),
+      write_(nullptr),
+      read_(nullptr),
+      count_(0),
+      last_(empty_hash) {
+  log->error("can't open {}: built without lmdb", path);
+  std::abort();
+}
+
+LmdbStore::~LmdbStore() {}
+
+MDB_txn *LmdbStore::batch() { return nullptr; }
+
+BlockHeader LmdbStore::header(size_t) const { std::abort(); }
+
+void LmdbStore::append(const BlockHeader &, const char *) { std::abort(); }
+
+void LmdbStore::truncate(size_t) { std::abort(); }
+
+void LmdbStore::sync(bool) {}
+#endif
+}  // namespace spv
@@ -0,0 +1,80 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "./config.h"
+#include "./fields.h"
+#include "./store.h"
+
+struct MDB_env;
+struct MDB_txn;
+
+namespace spv {
+#ifdef SPV_LMDB
+static const bool lmdb_available = true;
+#else
+static const bool lmdb_available = false;
+#endif
+
+// LmdbStore keeps the best chain in an LMDB B+tree keyed by height, one
+// 80-byte header per key, for --header-store lmdb. The file is this
+// process's alone; nothing else here opens it. header() decodes straight
+// out of LMDB's read-only map, in a read transaction renewed for each call,
+// and hashes the header again, since only its 80 bytes are stored.
+// Appends and truncations go into one write transaction, which sync()
+// commits; Chain syncs once per batch of headers, so each batch costs one
+// commit. Commits don't fsync unless sync() is asked to wait.
+class LmdbStore : public BestChainStore {
+ public:
+  LmdbStore() = delete;
+  LmdbStore(const LmdbStore &other) = delete;
+
+  // open (or create) the store at this path, e.g. .spv/headers.mdb, which
+  // gets a -lock file next to it
+  explicit LmdbStore(const std::string &path);
+  ~LmdbStore() override;
+
+  size_t size() const override { return count_; }
+
+  BlockHeader header(size_t height) const override;
+
+  bool extends(const BlockHeader &hdr) const override {
+    return hdr.height == count_ && (count_ == 0 || hdr.prev_block == last_);
+  }
+
+  void append(const BlockHeader &hdr, const char *raw) override;
+
+  void truncate(size_t height) override;
+
+  void sync(bool wait = false) override;
+
+ private:
+  MDB_env *env_;
+  unsigned int dbi_;
+  MDB_txn *write_;  // the uncommitted batch, or nullptr
+  MDB_txn *read_;   // reset between reads, and renewed for the next one
+  size_t count_;
+  hash_t last_;  // hash of the header at count_ - 1
+
+  // the write transaction, beginning one if need be
+  MDB_txn *batch();
+};
+}  // namespace spv
@@ -0,0 +1,181 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./logging.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "spdlog/sinks/ansicolor_sink.h"
+
+#include "./cpu_time.h"
+#include "./memory.h"
+
+namespace spv {
+// Writes to stdout, either on the logging thread or, once started, from a
+// queue on a thread of its own. Holding mutex_ never means waiting for the
+// output, except while logging synchronously.
+class LogSink : public spdlog::sinks::sink {
+ public:
+  LogSink()
+      : out_(std::make_shared<spdlog::sinks::ansicolor_stdout_sink_mt>()),
+        formatter_(std::make_shared<spdlog::pattern_formatter>("%+")),
+        name_("logging"),
+        async_(false),
+        stop_(false),
+        capacity_(0),
+        dropped_(0) {}
+  LogSink(const LogSink &other) = delete;
+  ~LogSink() { stop(); }
+
+  void log(const spdlog::details::log_msg &msg) override {
+    HeapScope scope(HeapTag::LOG);
+    CpuScope cpu(CpuTag::LOGGING);
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!async_) {
+      lock.unlock();
+      out_->log(msg);
+      return;
+    }
+    if (queue_.size() >= capacity_) {
+      dropped_++;
+      return;
+    }
+    queue_.push_back({msg.logger_name, msg.level, msg.time, msg.thread_id,
+                      msg.formatted.str()});
+    lock.unlock();
+    wakeup_.notify_one();
+  }
+
+  void flush() override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!async_) {
+      out_->flush();
+    }
+  }
+
+  void start(size_t queue_size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (async_ || queue_size == 0) {
+      return;
+    }
+    capacity_ = queue_size;
+    async_ = true;
+    thread_ = std::thread([this]() { run(); });
+  }
+
+  // the memory the queued messages take up
+  size_t queued_bytes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t bytes = 0;
+    for (const auto &entry : queue_) {
+      bytes += sizeof entry + entry.text.capacity();
+    }
+    return bytes;
+  }
+
+  // write out what's queued, and go back to logging synchronously
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!async_) {
+        return;
+      }
+      stop_ = true;
+    }
+    wakeup_.notify_one();
+    thread_.join();
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = false;
+  }
+
+ private:
+  // a message, already formatted
+  struct Entry {
+    const std::string *name;
+    spdlog::level::level_enum level;
+    spdlog::log_clock::time_point time;
+    size_t thread_id;
+    std::string text;
+  };
+
+  std::shared_ptr<spdlog::sinks::sink> out_;
+  std::shared_ptr<spdlog::formatter> formatter_;  // for our own messages
+  const std::string name_;
+
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::deque<Entry> queue_;
+  bool async_;
+  bool stop_;
+  size_t capacity_;
+  size_t dropped_;
+  std::thread thread_;
+
+  // Write out the queue until stop() is called and it's empty.
+  void run() {
+    HeapScope scope(HeapTag::LOG);
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      wakeup_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        async_ = false;  // stopping, so anything later is logged directly
+        return;
+      }
+      std::deque<Entry> batch;
+      batch.swap(queue_);
+      const size_t dropped = dropped_;
+      dropped_ = 0;
+      lock.unlock();
+      CpuScope cpu(CpuTag::LOGGING);  // charged a batch at a time
+      for (const auto &entry : batch) {
+        spdlog::details::log_msg msg(entry.name, entry.level);
+        msg.time = entry.time;
+        msg.thread_id = entry.thread_id;
+        msg.formatted << entry.text;
+        out_->log(msg);
+      }
+      if (dropped) {
+        spdlog::details::log_msg msg(&name_, spdlog::level::warn);
+        msg.raw << "dropped " << dropped << " log messages, the queue was full";
+        formatter_->format(msg);
+        out_->log(msg);
+      }
+      out_->flush();
+      lock.lock();
+    }
+  }
+};
+
+// N.B. loggers are made during static initialization, so the sink has to
+// be made on first use
+static const std::shared_ptr<LogSink> &shared_sink() {
+  static const std::shared_ptr<LogSink> sink = std::make_shared<LogSink>();
+  return sink;
+}
+
+std::shared_ptr<spdlog::logger> make_logger(const std::string &name) {
+  return spdlog::create(name, shared_sink());
+}
+
+void start_async_logging(size_t queue_size) {
+  shared_sink()->start(queue_size);
+}
+
+size_t log_queue_bytes() { return shared_sink()->queued_bytes(); }
+}  // namespace spv
@@ -16,15 +16,55 @@
 
 #pragma once
 
+#include <cstddef>
 #include <memory>
+#include <string>
 
 #include "spdlog/fmt/ostr.h"
 #include "spdlog/spdlog.h"
 
+#include "./config.h"
+
+// The lowest spdlog::level compiled in, set with ./configure
+// --with-log-level. LOG_*() calls below it are compiled out, arguments and
+// all; the others only evaluate their arguments if the logger's level lets
+// them through, unlike calling the logger directly.
+#ifndef SPV_LOG_LEVEL
+#define SPV_LOG_LEVEL 1  // debug
+#endif
+
+#define SPV_LOG(logger, lvl, method, ...)         \
+  do {                                            \
+    if (spdlog::level::lvl >= SPV_LOG_LEVEL &&    \
+        logger->should_log(spdlog::level::lvl)) { \
+      logger->method(__VA_ARGS__);                \
+    }                                             \
+  } while (0)
+
+#define LOG_TRACE(logger, ...) SPV_LOG(logger, trace, trace, __VA_ARGS__)
+#define LOG_DEBUG(logger, ...) SPV_LOG(logger, debug, debug, __VA_ARGS__)
+#define LOG_INFO(logger, ...) SPV_LOG(logger, info, info, __VA_ARGS__)
+#define LOG_WARN(logger, ...) SPV_LOG(logger, warn, warn, __VA_ARGS__)
+#define LOG_ERROR(logger, ...) SPV_LOG(logger, err, error, __VA_ARGS__)
+
 #define EXTERN_LOGGER(name) extern std::shared_ptr<spdlog::logger> name##_log;
 
-#define DECLARE_LOGGER(name)                    \
-  static std::shared_ptr<spdlog::logger> name = \
-      spdlog::stdout_color_st(__FILE__);
+#define DECLARE_LOGGER(name) \
+  static std::shared_ptr<spdlog::logger> name = spv::make_logger(__FILE__);
 
 #define MODULE_LOGGER DECLARE_LOGGER(log)
+
+namespace spv {
+// Create and register the logger for a module. Every logger writes to
+// stdout through one shared sink.
+std::shared_ptr<spdlog::logger> make_logger(const std::string &name);
+
+// From now on, hand log messages to a background thread that writes them,
+// through a queue of up to queue_size messages, so that logging never waits
+// on the terminal. Messages that don't fit are dropped, and the number
+// dropped is logged once there's room. The queue is written out at exit.
+void start_async_logging(size_t queue_size);
+
+// the memory used by messages waiting for the logging thread
+size_t log_queue_bytes();
+}  // namespace spv
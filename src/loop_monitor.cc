@@ -0,0 +1,120 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./loop_monitor.h"
+
+#include <cassert>
+#include <sstream>
+
+#include "./logging.h"
+#include "./metrics.h"
+
+namespace spv {
+MODULE_LOGGER
+
+thread_local LoopMonitor *loop_monitor = nullptr;
+
+// how often the timer that measures timer lag fires
+static const std::chrono::milliseconds tick_interval(100);
+
+// scopes shorter than this aren't worth naming
+static const uint64_t min_scope_ns = 1000 * 1000;
+
+LoopMonitor::LoopMonitor(uvw::Loop &loop, std::chrono::milliseconds slow)
+    : slow_ns_(std::chrono::duration_cast<std::chrono::nanoseconds>(slow)
+                   .count()),
+      check_(loop.resource<uvw::CheckHandle>()),
+      prepare_(loop.resource<uvw::PrepareHandle>()),
+      tick_(loop.resource<uvw::TimerHandle>()),
+      busy_start_(0),
+      last_tick_(0),
+      num_scopes_(0) {
+  assert(loop_monitor == nullptr);
+  loop_monitor = this;
+  check_->on<uvw::CheckEvent>(
+      [this](const auto &, auto &) { busy_start_ = trace_now(); });
+  check_->start();
+  prepare_->on<uvw::PrepareEvent>(
+      [this](const auto &, auto &) { iteration_done(); });
+  prepare_->start();
+  tick_->on<uvw::TimerEvent>([this](const auto &, auto &) {
+    const uint64_t now = trace_now();
+    if (last_tick_) {
+      const uint64_t due = last_tick_ + tick_interval.count() * 1000000;
+      metrics().loop_timer_lag.record(now > due ? now - due : 0);
+    }
+    last_tick_ = now;
+  });
+  tick_->start(tick_interval, tick_interval);
+}
+
+LoopMonitor::~LoopMonitor() { close(); }
+
+void LoopMonitor::close() {
+  if (loop_monitor == this) {
+    loop_monitor = nullptr;
+  }
+  if (check_) {
+    check_->stop();
+    check_->close();
+    check_.reset();
+  }
+  if (prepare_) {
+    prepare_->stop();
+    prepare_->close();
+    prepare_.reset();
+  }
+  if (tick_) {
+    tick_->stop();
+    tick_->close();
+    tick_.reset();
+  }
+}
+
+void LoopMonitor::record(const char *tag, const char *detail, uint64_t ns) {
+  if (ns < min_scope_ns ||
+      (num_scopes_ == MAX_SCOPES && ns <= scopes_[MAX_SCOPES - 1].ns)) {
+    return;
+  }
+  size_t i = num_scopes_ < MAX_SCOPES ? num_scopes_++ : MAX_SCOPES - 1;
+  for (; i > 0 && scopes_[i - 1].ns < ns; i--) {
+    scopes_[i] = scopes_[i - 1];
+  }
+  scopes_[i] = Scope{tag, detail, ns};
+}
+
+void LoopMonitor::iteration_done() {
+  const uint64_t busy = busy_start_ ? trace_now() - busy_start_ : 0;
+  if (busy_start_) {
+    metrics().loop_busy.record(busy);
+    busy_start_ = 0;
+  }
+  if (busy && busy >= slow_ns_) {
+    std::ostringstream slowest;
+    for (size_t i = 0; i < num_scopes_; i++) {
+      const Scope &scope = scopes_[i];
+      slowest << (i ? ", " : "") << scope.tag;
+      if (scope.detail != nullptr) {
+        slowest << ' ' << scope.detail;
+      }
+      slowest << ' ' << scope.ns / 1000000 << " ms";
+    }
+    log->warn("loop ran callbacks for {} ms without polling; slowest: {}",
+              busy / 1000000, num_scopes_ ? slowest.str() : "untagged");
+  }
+  num_scopes_ = 0;
+}
+}  // namespace spv
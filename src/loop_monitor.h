@@ -0,0 +1,100 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "./trace.h"
+#include "./uvw.h"
+
+namespace spv {
+class LoopMonitor;
+
+// the monitor of this thread's loop, if it has one
+extern thread_local LoopMonitor *loop_monitor;
+
+// LoopMonitor watches an event loop for stalls. A check handle notes when
+// polling returns and a prepare handle when the loop is about to poll
+// again, so the time between them is what one iteration spent running
+// callbacks; a repeating timer measures how late timers fire. Both go into
+// histograms, spv_loop_busy_seconds and spv_loop_timer_lag_seconds. The
+// scopes the callbacks mark with LoopScope are timed too, and when an
+// iteration runs for longer than the slow threshold, the slowest of them
+// are logged by tag, which is the first place to look during a stall.
+class LoopMonitor {
+ public:
+  LoopMonitor(uvw::Loop &loop, std::chrono::milliseconds slow);
+  LoopMonitor(const LoopMonitor &other) = delete;
+  ~LoopMonitor();
+
+  void close();
+
+ private:
+  friend class LoopScope;
+
+  struct Scope {
+    const char *tag;
+    const char *detail;
+    uint64_t ns;
+  };
+
+  // the slowest scopes kept per iteration
+  static const size_t MAX_SCOPES = 4;
+
+  const uint64_t slow_ns_;
+  std::shared_ptr<uvw::CheckHandle> check_;
+  std::shared_ptr<uvw::PrepareHandle> prepare_;
+  std::shared_ptr<uvw::TimerHandle> tick_;
+  uint64_t busy_start_;  // when polling last returned, or 0
+  uint64_t last_tick_;   // when tick_ last fired, or 0
+
+  // slowest first
+  std::array<Scope, MAX_SCOPES> scopes_;
+  size_t num_scopes_;
+
+  void record(const char *tag, const char *detail, uint64_t ns);
+
+  // the loop is about to poll; log the iteration if it was slow
+  void iteration_done();
+};
+
+// Marks a scope on a monitored loop, e.g. LoopScope("message", "headers")
+// around dispatching a headers message. Without a monitor it does nothing.
+class LoopScope {
+ public:
+  explicit LoopScope(const char *tag, const char *detail = nullptr)
+      : tag_(tag),
+        detail_(detail),
+        start_(loop_monitor != nullptr ? trace_now() : 0) {}
+  LoopScope(const LoopScope &other) = delete;
+
+  ~LoopScope() {
+    if (start_ && loop_monitor != nullptr) {
+      loop_monitor->record(tag_, detail_, trace_now() - start_);
+    }
+  }
+
+ private:
+  const char *tag_;
+  const char *detail_;
+  const uint64_t start_;
+};
+}  // namespace spv
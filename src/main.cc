@@ -16,28 +16,51 @@
 
 #include <signal.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
 #include <cstring>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "./client.h"
+#include "./affinity.h"
+#include "./asmap.h"
 #include "./fs.h"
+#include "./io.h"
 #include "./logging.h"
+#include "./memory.h"
+#include "./network.h"
+#include "./profiler.h"
+#include "./scheduler.h"
 #include "./settings.h"
+#include "./trace.h"
 #include "./util.h"
 #include "./uvw.h"
 
 namespace {
 DECLARE_LOGGER(main_log)
 std::unique_ptr<spv::Client> client;
+
+// With more than one network, each chain gets a client, loop and thread of
+// its own, and the default loop only waits for signals.
+struct NetworkThread {
+  spv::Settings settings;
+  std::shared_ptr<uvw::Loop> loop;
+  std::unique_ptr<spv::LoopQueue> queue;
+  std::unique_ptr<spv::Client> client;
+  std::thread thread;
+};
+std::vector<std::unique_ptr<NetworkThread>> networks;
 }
 
-static void shutdown(void) {
-  client->shutdown();
-  auto loop = uvw::Loop::getDefault();
-  loop->walk([](uvw::BaseHandle& h) {
+static void close_handles(uvw::Loop& loop) {
+  loop.walk([](uvw::BaseHandle& h) {
     if (h.closing()) {
-      main_log->debug("loop handle {} already closing", (void*)&h);
+      LOG_DEBUG(main_log, "loop handle {} already closing", (void*)&h);
     } else {
       main_log->info("closing pending handle {}", (void*)&h);
       h.close();
@@ -45,23 +68,130 @@ static void shutdown(void) {
   });
 }
 
-static void install_shutdown(int signum) {
+// If the clients haven't closed their databases and exited in time, exit
+// anyway. Everything synced so far is safe, and the chain resumes from its
+// last synced tip.
+static void start_deadline(unsigned seconds) {
+  static bool started = false;
+  if (seconds == 0 || started) {
+    return;
+  }
+  started = true;
+  std::thread([seconds]() {
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    std::fprintf(stderr, "shutdown took longer than %us, exiting\n", seconds);
+    std::_Exit(EXIT_FAILURE);
+  }).detach();
+}
+
+// Shutting down stops the clients taking new work and closes their handles,
+// so the loops run out. Then the clients are destroyed, which closes their
+// chains with the tip synced, all under the --shutdown-timeout deadline.
+static void shutdown(const spv::Settings& settings) {
+  start_deadline(settings.shutdown_timeout);
+  if (client) {
+    client->shutdown();
+  }
+  for (auto& net : networks) {
+    NetworkThread* t = net.get();
+    t->queue->post([t]() {
+      t->client->shutdown();
+      t->queue->close();
+      close_handles(*t->loop);
+    });
+  }
+  close_handles(*uvw::Loop::getDefault());
+}
+
+static void install_shutdown(const spv::Settings& settings, int signum) {
   auto loop = uvw::Loop::getDefault();
   auto handle = loop->resource<uvw::SignalHandle>();
-  handle->on<uvw::SignalEvent>([=](const auto&, auto& h) {
+  handle->on<uvw::SignalEvent>([=, &settings](const auto&, auto& h) {
     main_log->info("received signal {}", signum);
-    shutdown();
+    shutdown(settings);
     h.close();
   });
   handle->start(signum);
 }
 
+// SIGUSR2 profiles the process for --profile-seconds, or until the next
+// SIGUSR2, and writes the stacks to a file in the data directory.
+static void install_profiler(const spv::Settings& settings) {
+  auto loop = uvw::Loop::getDefault();
+  auto timer = loop->resource<uvw::TimerHandle>();
+  auto path = std::make_shared<std::string>();
+  auto stop = [=]() {
+    timer->stop();
+    spv::stop_profiling(*path);
+  };
+  timer->on<uvw::TimerEvent>([=](const auto&, auto&) { stop(); });
+
+  auto handle = loop->resource<uvw::SignalHandle>();
+  handle->on<uvw::SignalEvent>([=, &settings](const auto&, auto&) {
+    if (spv::profiling()) {
+      stop();
+      return;
+    }
+    // room for every thread to be busy the whole time
+    const unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+    const size_t max_samples =
+        size_t(settings.profile_hz) * settings.profile_seconds * threads;
+    *path = settings.datadir + "/profile-" +
+            std::to_string(std::time(nullptr)) + ".folded";
+    if (spv::start_profiling(settings.profile_hz, max_samples)) {
+      timer->start(std::chrono::seconds(settings.profile_seconds),
+                   std::chrono::seconds(0));
+    }
+  });
+  handle->start(SIGUSR2);
+}
+
+// Start a thread per network; the tasks the queues run are on those threads,
+// after the clients are made, so shutdown() can be called at any point.
+static void start_networks(const spv::Settings& settings) {
+  for (size_t i = 0; i < settings.networks.size(); i++) {
+    std::unique_ptr<NetworkThread> t(new NetworkThread);
+    t->settings = spv::settings_for_network(settings, i);
+    t->loop = uvw::Loop::create();
+    t->queue.reset(new spv::LoopQueue(t->loop));
+    NetworkThread* raw = t.get();
+    t->thread = std::thread([raw]() {
+      spv::place_thread(spv::ThreadGroup::NETWORK);
+      spv::select_network(raw->settings.network);
+      main_log->info("starting {} in {}", spv::network().name,
+                     raw->settings.datadir);
+      raw->client.reset(new spv::Client(raw->settings, raw->loop));
+      raw->client->run();
+      raw->loop->run();
+      raw->client.reset();
+      raw->loop->close();
+    });
+    networks.push_back(std::move(t));
+  }
+}
+
+static void join_networks() {
+  for (auto& t : networks) {
+    t->thread.join();
+  }
+  networks.clear();
+}
+
 int main(int argc, char** argv) {
   int ret = -1;
   const spv::Settings& settings = spv::parse_settings(argc, argv, &ret);
   if (ret != -1) {
     return ret;
   }
+  if (!settings.checkpoints_file.empty() &&
+      !spv::load_checkpoints(settings.checkpoints_file)) {
+    return 1;
+  }
+  if (!settings.asmap_file.empty() && !spv::load_asmap(settings.asmap_file)) {
+    return 1;
+  }
+  spv::set_huge_pages(settings.huge_pages);
+  spv::start_async_logging(settings.log_queue);
   spv::FileLock lock;
   if (lock.lock(settings.lockfile)) {
     main_log->error("failed to acquire lock on lock file: {}",
@@ -69,13 +199,62 @@ int main(int argc, char** argv) {
     return 1;
   }
 
+  spv::set_group_cpus(spv::ThreadGroup::NETWORK, settings.network_cpus);
+  spv::set_group_cpus(spv::ThreadGroup::WORKERS, settings.worker_cpus);
+  spv::set_group_cpus(spv::ThreadGroup::CHAIN, settings.chain_cpus);
+  spv::place_thread(spv::ThreadGroup::NETWORK);
+
+  // Validation and hashing run on the scheduler's workers, one per CPU (of
+  // --worker-cpus if set) unless --worker-threads says otherwise, which
+  // every network's client shares.
+  spv::start_scheduler(settings.worker_threads
+                           ? settings.worker_threads
+                           : settings.worker_cpus.size());
+
+  if (!settings.trace_file.empty()) {
+    spv::start_tracing(settings.trace_events);
+  }
   auto loop = uvw::Loop::getDefault();
+  if (settings.networks.size() > 1) {
+    install_shutdown(settings, SIGINT);
+    install_shutdown(settings, SIGTERM);
+    install_profiler(settings);
+    start_networks(settings);
+    loop->run();
+    join_networks();
+    loop->close();
+    if (!settings.trace_file.empty() &&
+        !spv::dump_trace(settings.trace_file)) {
+      return 1;
+    }
+    return 0;
+  }
+
   client.reset(new spv::Client(settings, loop));
-  install_shutdown(SIGINT);
-  install_shutdown(SIGTERM);
-  client->run();
+  if (!settings.export_headers.empty()) {
+    return client->export_headers(settings.export_headers) ? 0 : 1;
+  }
+  if (!settings.export_proto.empty()) {
+    const size_t to = settings.export_to ? settings.export_to : SIZE_MAX;
+    return client->export_proto(settings.export_proto, settings.export_from,
+                                to)
+               ? 0
+               : 1;
+  }
+  if (!settings.import_headers.empty() &&
+      !client->import_headers(settings.import_headers)) {
+    return 1;
+  }
+  install_shutdown(settings, SIGINT);
+  install_shutdown(settings, SIGTERM);
+  install_profiler(settings);
+  const bool started = client->run();
 
   loop->run();
+  client.reset();  // closes the chain
   loop->close();
-  return 0;
+  if (!settings.trace_file.empty() && !spv::dump_trace(settings.trace_file)) {
+    return 1;
+  }
+  return started ? 0 : 1;
 }
@@ -0,0 +1,256 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./memory.h"
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+
+namespace spv {
+std::atomic<int64_t> mem_bytes[size_t(MemTag::NUM_TAGS)];
+
+const char *mem_tag_name(MemTag tag) {
+  switch (tag) {
+    case MemTag::BUFFERS:
+      return "buffers";
+    case MemTag::ARENAS:
+      return "arenas";
+    case MemTag::SLAB_CACHE:
+      return "slab_cache";
+    case MemTag::NUM_TAGS:
+      break;
+  }
+  return "unknown";
+}
+
+namespace {
+std::atomic<bool> huge_pages(false);
+std::atomic<int64_t> page_bytes[size_t(PageType::NUM_TYPES)];
+
+// the mapped allocations, which free_pages() has to unmap
+std::mutex mappings_mutex;
+std::unordered_map<void *, PageType> mappings;
+
+inline size_t round_huge(size_t size) {
+  return (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+}
+
+// Map len bytes aligned to a huge page, since transparent huge pages only
+// back whole aligned 2 MiB ranges: map a huge page more than needed, and
+// unmap the ragged ends.
+void *map_aligned(size_t len) {
+  const size_t over = len + HUGE_PAGE_SIZE;
+  void *mem = mmap(nullptr, over, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    return nullptr;
+  }
+  char *base = static_cast<char *>(mem);
+  char *start = reinterpret_cast<char *>(
+      round_huge(reinterpret_cast<uintptr_t>(base)));
+  if (start > base) {
+    munmap(base, start - base);
+  }
+  const size_t tail = (base + over) - (start + len);
+  if (tail) {
+    munmap(start + len, tail);
+  }
+  return start;
+}
+}  // namespace
+
+void set_huge_pages(bool enabled) {
+  huge_pages.store(enabled, std::memory_order_relaxed);
+}
+
+void *allocate_pages(size_t size) {
+  if (size < HUGE_PAGE_SIZE || !huge_pages.load(std::memory_order_relaxed)) {
+    void *ptr = ::operator new(size);
+    page_bytes[size_t(PageType::HEAP)].fetch_add(size,
+                                                 std::memory_order_relaxed);
+    return ptr;
+  }
+  const size_t len = round_huge(size);
+  PageType type = PageType::HUGETLB;
+  void *ptr = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (ptr == MAP_FAILED) {
+    // no hugetlb pages reserved, or not enough of them left
+    type = PageType::TRANSPARENT;
+    ptr = map_aligned(len);
+    if (ptr == nullptr) {
+      throw std::bad_alloc();
+    }
+    madvise(ptr, len, MADV_HUGEPAGE);
+  }
+  {
+    std::lock_guard<std::mutex> lock(mappings_mutex);
+    mappings.emplace(ptr, type);
+  }
+  page_bytes[size_t(type)].fetch_add(size, std::memory_order_relaxed);
+  return ptr;
+}
+
+void free_pages(void *ptr, size_t size) {
+  PageType type = PageType::HEAP;
+  if (size >= HUGE_PAGE_SIZE) {
+    std::lock_guard<std::mutex> lock(mappings_mutex);
+    auto it = mappings.find(ptr);
+    if (it != mappings.end()) {
+      type = it->second;
+      mappings.erase(it);
+    }
+  }
+  page_bytes[size_t(type)].fetch_sub(size, std::memory_order_relaxed);
+  if (type == PageType::HEAP) {
+    ::operator delete(ptr);
+  } else {
+    munmap(ptr, round_huge(size));
+  }
+}
+
+int64_t page_usage(PageType type) {
+  return page_bytes[size_t(type)].load(std::memory_order_relaxed);
+}
+
+size_t resident_bytes() {
+  std::ifstream statm("/proc/self/statm");
+  size_t pages = 0, resident = 0;
+  statm >> pages >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+size_t peak_resident_bytes() {
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  return size_t(usage.ru_maxrss) << 10;  // in KiB on Linux
+}
+
+const char *page_type_name(PageType type) {
+  switch (type) {
+    case PageType::HEAP:
+      return "heap";
+    case PageType::TRANSPARENT:
+      return "transparent";
+    case PageType::HUGETLB:
+      return "hugetlb";
+    case PageType::NUM_TYPES:
+      break;
+  }
+  return "unknown";
+}
+
+const char *heap_tag_name(HeapTag tag) {
+  switch (tag) {
+    case HeapTag::OTHER:
+      return "other";
+    case HeapTag::NETWORK:
+      return "network";
+    case HeapTag::MESSAGES:
+      return "messages";
+    case HeapTag::CHAIN:
+      return "chain";
+    case HeapTag::ORPHANS:
+      return "orphans";
+    case HeapTag::INV:
+      return "inv";
+    case HeapTag::LOG:
+      return "log";
+    case HeapTag::NUM_TAGS:
+      break;
+  }
+  return "unknown";
+}
+
+#ifdef SPV_ALLOC_TRACKING
+thread_local HeapTag current_heap_tag = HeapTag::OTHER;
+
+namespace {
+std::atomic<int64_t> heap_bytes[size_t(HeapTag::NUM_TAGS)];
+
+// in front of every allocation; 16 bytes keeps the memory after it aligned
+// for anything operator new has to support
+struct alignas(16) AllocHeader {
+  size_t size;
+  HeapTag tag;
+};
+
+static_assert(sizeof(AllocHeader) == 16, "");
+
+void *tracked_alloc(size_t sz) noexcept {
+  auto *hdr = static_cast<AllocHeader *>(std::malloc(sizeof(AllocHeader) + sz));
+  if (hdr == nullptr) {
+    return nullptr;
+  }
+  hdr->size = sz;
+  hdr->tag = current_heap_tag;
+  heap_bytes[size_t(hdr->tag)].fetch_add(sz, std::memory_order_relaxed);
+  return hdr + 1;
+}
+
+void tracked_free(void *ptr) noexcept {
+  if (ptr == nullptr) {
+    return;
+  }
+  AllocHeader *hdr = static_cast<AllocHeader *>(ptr) - 1;
+  heap_bytes[size_t(hdr->tag)].fetch_sub(hdr->size, std::memory_order_relaxed);
+  std::free(hdr);
+}
+
+void *tracked_new(size_t sz) {
+  void *ptr = tracked_alloc(sz);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+}  // namespace
+
+int64_t heap_usage(HeapTag tag) {
+  return heap_bytes[size_t(tag)].load(std::memory_order_relaxed);
+}
+#endif
+}  // namespace spv
+
+#ifdef SPV_ALLOC_TRACKING
+void *operator new(size_t sz) { return spv::tracked_new(sz); }
+void *operator new[](size_t sz) { return spv::tracked_new(sz); }
+void *operator new(size_t sz, const std::nothrow_t &) noexcept {
+  return spv::tracked_alloc(sz);
+}
+void *operator new[](size_t sz, const std::nothrow_t &) noexcept {
+  return spv::tracked_alloc(sz);
+}
+void operator delete(void *ptr) noexcept { spv::tracked_free(ptr); }
+void operator delete[](void *ptr) noexcept { spv::tracked_free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { spv::tracked_free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { spv::tracked_free(ptr); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  spv::tracked_free(ptr);
+}
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+  spv::tracked_free(ptr);
+}
+#endif
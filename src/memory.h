@@ -0,0 +1,158 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#include "./config.h"
+
+namespace spv {
+// Memory accounting, reported as spv_memory_bytes. The byte buffers that
+// come from the slab pool are counted where they're allocated and freed:
+// the capacity of live Buffers (connection read buffers and encoders), the
+// chunks of arenas (decoded messages), and the blocks cached on the slab
+// free lists. Containers are measured when metrics are scraped instead;
+// see expose_memory() in metrics.h.
+enum class MemTag {
+  BUFFERS,
+  ARENAS,
+  SLAB_CACHE,
+  NUM_TAGS,
+};
+
+extern std::atomic<int64_t> mem_bytes[size_t(MemTag::NUM_TAGS)];
+
+inline void mem_add(MemTag tag, int64_t bytes) {
+  mem_bytes[size_t(tag)].fetch_add(bytes, std::memory_order_relaxed);
+}
+
+inline int64_t mem_usage(MemTag tag) {
+  return mem_bytes[size_t(tag)].load(std::memory_order_relaxed);
+}
+
+const char *mem_tag_name(MemTag tag);
+
+// With --huge-pages, the big tables that lookups probe at random (the
+// header index and its hash table) are backed by 2 MiB pages, so that they
+// take a fraction of the TLB entries. An allocation of at least a huge page
+// is mapped from the reserved hugetlb pool (vm.nr_hugepages) if it has room,
+// and otherwise mapped normally and madvised for transparent huge pages,
+// which the kernel may or may not provide; anything smaller, or everything
+// without --huge-pages, comes from the heap. The bytes in each are reported
+// as spv_page_bytes.
+enum class PageType {
+  HEAP,
+  TRANSPARENT,  // MADV_HUGEPAGE
+  HUGETLB,
+  NUM_TYPES,
+};
+
+static const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+// call before allocating anything with HugePageAllocator
+void set_huge_pages(bool enabled);
+
+void *allocate_pages(size_t size);  // throws std::bad_alloc
+void free_pages(void *ptr, size_t size);
+
+// bytes allocated by allocate_pages() and held in each kind of page
+int64_t page_usage(PageType type);
+
+const char *page_type_name(PageType type);
+
+// the process's resident set size, in bytes, or 0 if it can't be read
+size_t resident_bytes();
+
+// the largest resident_bytes() has been since the process started
+size_t peak_resident_bytes();
+
+template <typename T>
+struct HugePageAllocator {
+  typedef T value_type;
+
+  HugePageAllocator() = default;
+  template <typename U>
+  HugePageAllocator(const HugePageAllocator<U> &) {}
+
+  inline T *allocate(size_t n) {
+    return static_cast<T *>(allocate_pages(n * sizeof(T)));
+  }
+  inline void deallocate(T *ptr, size_t n) { free_pages(ptr, n * sizeof(T)); }
+
+  template <typename U>
+  inline bool operator==(const HugePageAllocator<U> &) const {
+    return true;
+  }
+  template <typename U>
+  inline bool operator!=(const HugePageAllocator<U> &) const {
+    return false;
+  }
+};
+
+// With --enable-alloc-tracking, operator new itself is replaced to count
+// every heap allocation under the tag of the innermost HeapScope on the
+// thread that makes it, reported as spv_heap_bytes. Each allocation carries
+// a 16-byte header with its size and tag, so it's for finding where memory
+// goes rather than for production.
+enum class HeapTag : uint8_t {
+  OTHER,
+  NETWORK,   // reading and dispatching messages
+  MESSAGES,  // decoding them
+  CHAIN,
+  ORPHANS,
+  INV,
+  LOG,
+  NUM_TAGS,
+};
+
+const char *heap_tag_name(HeapTag tag);
+
+#ifdef SPV_ALLOC_TRACKING
+static const bool alloc_tracking = true;
+
+extern thread_local HeapTag current_heap_tag;
+
+// live heap bytes allocated under this tag
+int64_t heap_usage(HeapTag tag);
+
+class HeapScope {
+ public:
+  explicit HeapScope(HeapTag tag) : prev_(current_heap_tag) {
+    current_heap_tag = tag;
+  }
+  HeapScope(const HeapScope &other) = delete;
+  ~HeapScope() { current_heap_tag = prev_; }
+
+ private:
+  const HeapTag prev_;
+};
+#else
+static const bool alloc_tracking = false;
+
+inline int64_t heap_usage(HeapTag) { return 0; }
+
+class HeapScope {
+ public:
+  explicit HeapScope(HeapTag) {}
+  HeapScope(const HeapScope &other) = delete;
+};
+#endif
+
+}  // namespace spv
@@ -0,0 +1,122 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./mempool.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "./logging.h"
+#include "./tx.h"
+
+namespace spv {
+MODULE_LOGGER
+
+MempoolTracker::MempoolTracker(size_t max_bytes)
+    : max_bytes_(max_bytes), bytes_(0), seq_(0) {}
+
+bool MempoolTracker::add(const hash_t &txid, const Tx &tx, size_t size,
+                  std::vector<hash_t> &conflicts) {
+  if (contains(txid)) {
+    return false;
+  }
+  Entry entry;
+  entry.seq = seq_++;
+  entry.size = size;
+  entry.spends.reserve(tx.inputs.size());
+  for (const auto &in : tx.inputs) {
+    const Outpoint op{in.prev_hash, in.prev_index};
+    auto pr = spenders_.emplace(op);
+    for (const auto &other : *pr.first) {
+      if (std::find(conflicts.begin(), conflicts.end(), other) ==
+          conflicts.end()) {
+        conflicts.push_back(other);
+      }
+    }
+    pr.first->push_back(txid);
+    entry.spends.push_back(op);
+  }
+  order_.emplace_back(entry.seq, txid);
+  txs_.emplace(txid, std::move(entry));
+  bytes_ += size;
+  evict();
+  return true;
+}
+
+bool MempoolTracker::confirm(const hash_t &txid) {
+  if (!contains(txid)) {
+    return false;
+  }
+  remove(txid);
+  return true;
+}
+
+void MempoolTracker::spend(const Outpoint &op, const hash_t &txid,
+                    std::vector<hash_t> &conflicts) {
+  const std::vector<hash_t> *spenders = spenders_.find(op);
+  if (spenders == nullptr) {
+    return;
+  }
+  // remove() changes the list, so go through a copy
+  const std::vector<hash_t> others = *spenders;
+  for (const auto &other : others) {
+    if (other != txid) {
+      remove(other);
+      conflicts.push_back(other);
+    }
+  }
+}
+
+void MempoolTracker::remove(const hash_t &txid) {
+  Entry *entry = txs_.find(txid);
+  assert(entry != nullptr);
+  bytes_ -= entry->size;
+  for (const auto &op : entry->spends) {
+    std::vector<hash_t> *spenders = spenders_.find(op);
+    assert(spenders != nullptr);
+    spenders->erase(std::find(spenders->begin(), spenders->end(), txid));
+    if (spenders->empty()) {
+      spenders_.erase(op);
+    }
+  }
+  txs_.erase(txid);
+
+  // confirmed transactions leave stale items behind, so compact sometimes
+  if (order_.size() > 2 * txs_.size() + 64) {
+    std::deque<std::pair<uint64_t, hash_t> > live;
+    for (const auto &item : order_) {
+      const Entry *e = txs_.find(item.second);
+      if (e != nullptr && e->seq == item.first) {
+        live.push_back(item);
+      }
+    }
+    order_.swap(live);
+  }
+}
+
+void MempoolTracker::evict() {
+  while (bytes_ > max_bytes_ && !order_.empty()) {
+    const auto item = order_.front();
+    order_.pop_front();
+    const Entry *entry = txs_.find(item.second);
+    if (entry != nullptr && entry->seq == item.first) {
+      LOG_DEBUG(log, "mempool is full, evicting transaction {}",
+                to_hex(item.second));
+      remove(item.second);
+    }
+  }
+}
+}  // namespace spv
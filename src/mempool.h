@@ -0,0 +1,104 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "./constants.h"
+#include "./hashmap.h"
+
+namespace spv {
+struct Tx;
+
+// an output of an earlier transaction, as named by an input
+struct Outpoint {
+  hash_t hash;
+  uint32_t index;
+
+  inline bool operator==(const Outpoint &other) const {
+    return index == other.index && hash == other.hash;
+  }
+};
+
+struct OutpointHasher {
+  inline std::size_t operator()(const Outpoint &op) const noexcept {
+    return BlockHashHasher()(op.hash) ^ op.index;
+  }
+};
+
+// MempoolTracker follows the unconfirmed transactions that match the watch
+// list, so a payment is seen when it's relayed rather than when it's mined.
+// The transactions are indexed by txid, to resolve each transaction of a
+// block with one lookup, and by the outputs they spend, so that a block
+// spending the same output evicts a double spend. The raw transactions
+// aren't kept, but their sizes count against the limit; past it the oldest
+// ones go.
+class MempoolTracker {
+ public:
+  MempoolTracker() = delete;
+  MempoolTracker(const MempoolTracker &other) = delete;
+  explicit MempoolTracker(size_t max_bytes);
+
+  inline bool empty() const { return txs_.empty(); }
+  inline size_t size() const { return txs_.size(); }
+  inline size_t bytes() const { return bytes_; }
+
+  inline bool contains(const hash_t &txid) const {
+    return txs_.contains(txid);
+  }
+
+  // Add a watched transaction of size bytes; returns false if it's already
+  // here. The pool transactions it double spends are appended to conflicts
+  // and kept, since either one could be mined.
+  bool add(const hash_t &txid, const Tx &tx, size_t size,
+           std::vector<hash_t> &conflicts);
+
+  // A block confirmed this transaction; returns false if it wasn't here.
+  bool confirm(const hash_t &txid);
+
+  // A block transaction, txid, spent this output. Any other pool
+  // transaction spending it can never confirm, so it's removed and its
+  // txid appended to conflicts.
+  void spend(const Outpoint &op, const hash_t &txid,
+             std::vector<hash_t> &conflicts);
+
+ private:
+  struct Entry {
+    uint64_t seq;  // when it was added, to tell stale order_ items apart
+    size_t size;
+    std::vector<Outpoint> spends;
+  };
+
+  size_t max_bytes_;
+  size_t bytes_;
+  uint64_t seq_;
+  FlatHashMap<hash_t, Entry> txs_;
+  FlatHashMap<Outpoint, std::vector<hash_t>, OutpointHasher> spenders_;
+
+  // txids oldest first, for eviction; confirmed ones are skipped lazily
+  std::deque<std::pair<uint64_t, hash_t> > order_;
+
+  void remove(const hash_t &txid);
+
+  // drop the oldest transactions until the pool is under max_bytes_
+  void evict();
+};
+}  // namespace spv
@@ -18,307 +18,902 @@
 
 #include <endian.h>
 
+#include <algorithm>
 #include <array>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <limits>
 #include <string>
+#include <type_traits>
+#include <vector>
 
 #include "./addr.h"
 #include "./buffer.h"
 #include "./constants.h"
+#include "./cpu_time.h"
 #include "./decoder.h"
 #include "./encoder.h"
 #include "./logging.h"
+#include "./network.h"
 #include "./peer.h"
 #include "./pow.h"
+#include "./profiler.h"
+#include "./sha256.h"
 
-#define DECLARE_ENCODE(cls) \
-  std::unique_ptr<char[]> cls::encode(size_t &sz) const
+#define DECLARE_ENCODE(cls) void cls::encode_payload(Encoder &enc) const
+
+#define DECLARE_ENCODED_SIZE(cls) size_t cls::encoded_size() const
 
 namespace spv {
 MODULE_LOGGER
 
-DECLARE_ENCODE(AddrMsg) {
-  Encoder enc(headers);
+// wire sizes of the variable and compound fields, as pushed by Encoder
+static const size_t addr_size = ADDR_SIZE + sizeof(uint16_t);  // with port
+static const size_t netaddr_size =
+    sizeof(uint32_t) + sizeof(uint64_t) + addr_size;
+static const size_t version_netaddr_size = sizeof(uint64_t) + addr_size;
+static const size_t inv_size = sizeof(uint32_t) + sizeof(hash_t);
+
+static inline size_t string_size(const std::string &s) {
+  return varint_size(s.size()) + s.size();
+}
+
+// Most payloads are just a list of fields, each pushed as is and a vector
+// pushed as a count and then its items. ENCODE_FIELDS derives both
+// encoded_size() and encode_payload() from that list, so that the two can't
+// disagree. wire_size() has an overload for each kind of field.
+template <typename T>
+constexpr size_t wire_size(const T &) {
+  static_assert(std::is_integral<T>::value || std::is_enum<T>::value,
+                "no wire_size() for this field type");
+  return sizeof(T);
+}
+
+inline size_t wire_size(const hash_t &) { return sizeof(hash_t); }
+inline size_t wire_size(const std::string &s) { return string_size(s); }
+inline size_t wire_size(const NetAddr &) { return netaddr_size; }
+inline size_t wire_size(const VersionNetAddr &) { return version_netaddr_size; }
+inline size_t wire_size(const Inv &) { return inv_size; }
+
+template <typename T>
+inline size_t wire_size(const std::vector<T> &items) {
+  size_t size = varint_size(items.size());
+  for (const auto &item : items) {
+    size += wire_size(item);
+  }
+  return size;
+}
+
+template <typename T>
+inline void push_field(Encoder &enc, const T &field) {
+  enc.push(field);
+}
+
+template <typename T>
+inline void push_field(Encoder &enc, const std::vector<T> &items) {
+  enc.push_varint(items.size());
+  for (const auto &item : items) {
+    push_field(enc, item);
+  }
+}
+
+template <typename... Ts>
+inline size_t fields_size(const Ts &... fields) {
+  return (wire_size(fields) + ... + 0);
+}
+
+template <typename... Ts>
+inline void push_fields(Encoder &enc, const Ts &... fields) {
+  (push_field(enc, fields), ...);
+}
+
+#define ENCODE_FIELDS(cls, ...)                    \
+  DECLARE_ENCODED_SIZE(cls) {                      \
+    return HEADER_SIZE + fields_size(__VA_ARGS__); \
+  }                                                \
+  DECLARE_ENCODE(cls) { push_fields(enc, __VA_ARGS__); }
+
+#define ENCODE_EMPTY(cls)                           \
+  DECLARE_ENCODED_SIZE(cls) { return HEADER_SIZE; } \
+  DECLARE_ENCODE(cls) {}
+
+// a block can't hold more transactions than this, each being at least 60
+// bytes (or 240 weight units)
+static const uint32_t max_block_txs = 1000000 / 60;
+
+std::unique_ptr<char[]> Message::encode(size_t &sz) const {
+  Encoder enc(headers, encoded_size());
+  encode_payload(enc);
+  return enc.serialize(sz);
+}
+
+void Message::encode(Encoder &enc) const {
+  const size_t start = enc.begin_message(headers);
+  encode_payload(enc);
+  enc.finish_headers(start);
+}
+
+ENCODE_FIELDS(AddrMsg, addrs)
+
+// the size of a BIP155 address entry for addr, with the time and services
+static inline size_t addrv2_size(const NetAddr &addr) {
+  const size_t n = netid_size(uint8_t(addr.addr.netid()));
+  return sizeof(uint32_t) + varint_size(addr.services) + sizeof(uint8_t) +
+         varint_size(n) + n + sizeof(uint16_t);
+}
+
+DECLARE_ENCODED_SIZE(AddrV2Msg) {
+  size_t size = HEADER_SIZE + varint_size(addrs.size());
+  for (const auto &addr : addrs) {
+    size += addrv2_size(addr);
+  }
+  return size;
+}
+
+DECLARE_ENCODE(AddrV2Msg) {
   enc.push_varint(addrs.size());
   for (const auto &addr : addrs) {
-    enc.push(addr);
+    const NetId id = addr.addr.netid();
+    const size_t n = netid_size(uint8_t(id));
+    enc.push(addr.time);
+    enc.push_varint(addr.services);
+    enc.push(uint8_t(id));
+    enc.push_varint(n);
+    enc.append(addr.addr.bip155_data(), n);
+    enc.push_be(addr.addr.port());
   }
-  return enc.serialize(sz);
 }
 
-DECLARE_ENCODE(GetAddr) { return Encoder(headers).serialize(sz); }
+DECLARE_ENCODED_SIZE(Block) { return HEADER_SIZE + raw.size(); }
+
+DECLARE_ENCODE(Block) {
+  enc.append(raw.data(), raw.size());
+}
 
-DECLARE_ENCODE(GetBlocks) {
-  Encoder enc(headers);
-  enc.push(version);
-  enc.push_varint(locator_hashes.size());
-  for (const auto &locator : locator_hashes) {
-    enc.push(locator);
+namespace {
+struct LeafScratch {
+  std::vector<sha256::Range> ranges;
+  std::vector<size_t> first;
+};
+
+thread_local LeafScratch leaf_scratch;
+}  // namespace
+
+PROFILE_BOUNDARY void Block::leaf_hashes(size_t begin, size_t end,
+                                          hash_t *out) const {
+  assert(begin <= end && end <= txns.size());
+  LeafScratch &s = leaf_scratch;
+  s.ranges.resize(3 * (end - begin));
+  s.first.resize(end - begin + 1);
+  size_t used = 0;
+  for (size_t i = begin; i < end; i++) {
+    s.first[i - begin] = used;
+    used += txns[i].txid_ranges(raw.data(), s.ranges.data() + used);
   }
-  enc.push(hash_stop);
-  return enc.serialize(sz);
+  s.first[end - begin] = used;
+  sha256::double_hash_ranges_batch(s.ranges.data(), s.first.data(),
+                                   end - begin,
+                                   reinterpret_cast<uint8_t *>(out));
 }
 
-DECLARE_ENCODE(GetData) {
-  Encoder enc(headers);
-  enc.push_varint(invs.size());
-  for (const auto &inv : invs) {
-    enc.push(inv.type);
-    enc.push(inv.hash);
+PROFILE_BOUNDARY void Block::index() {
+  Decoder body(raw.data(), raw.size());
+  body.pull(header, false);
+  uint64_t count;
+  body.pull_varint(count);
+  if (count == 0 || count > max_block_txs) {
+    std::ostringstream os;
+    os << "block tx count " << count << " is invalid, ignoring";
+    throw BadMessage(os.str());
+  }
+  txns.clear();
+  txns.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    txns.push_back(TxSpan::pull(body));
+  }
+  if (body.bytes_remaining()) {
+    throw BadMessage("block has data after its last transaction");
   }
-  return enc.serialize(sz);
 }
 
-DECLARE_ENCODE(GetHeaders) {
-  Encoder enc(headers);
-  enc.push(version);
-  enc.push_varint(locator_hashes.size());
-  for (const auto &locator : locator_hashes) {
-    enc.push(locator);
+bool Block::check_merkle_root() const {
+  std::vector<hash_t> leaves(txns.size());
+  leaf_hashes(0, txns.size(), leaves.data());
+  return check_merkle_root(leaves);
+}
+
+bool Block::check_merkle_root(std::vector<hash_t> &level) const {
+  assert(level.size() == txns.size());
+  if (level.empty()) {
+    return false;
+  }
+
+  // each level is hashed from the one below in one batch, like the second
+  // pass of check_partial_tree()
+  bool mutated = false;
+  while (level.size() > 1) {
+    for (size_t i = 0; i + 1 < level.size(); i += 2) {
+      mutated = mutated || level[i] == level[i + 1];
+    }
+    if (level.size() & 1) {
+      level.push_back(level.back());
+    }
+    merkle_hash_batch(level.data(), level.size() / 2, level.data());
+    level.resize(level.size() / 2);
+  }
+  hash_t root;
+  std::reverse_copy(header.merkle_root.begin(), header.merkle_root.end(),
+                    root.begin());
+  return !mutated && level[0] == root;
+}
+
+DECLARE_ENCODED_SIZE(BlockTxn) {
+  size_t size = HEADER_SIZE + sizeof block_hash + varint_size(txs.size());
+  for (const auto &tx : txs) {
+    size += tx.size();
+  }
+  return size;
+}
+
+DECLARE_ENCODE(BlockTxn) {
+  enc.push(block_hash);
+  enc.push_varint(txs.size());
+  for (const auto &tx : txs) {
+    enc.append(tx.data(), tx.size());
+  }
+}
+
+// BIP152 sends ascending indexes as the gaps between them
+template <typename T, typename F>
+static size_t differential_size(const std::vector<T> &items, F index) {
+  size_t size = 0;
+  uint32_t next = 0;
+  for (const auto &item : items) {
+    size += varint_size(index(item) - next);
+    next = index(item) + 1;
+  }
+  return size;
+}
+
+static inline uint32_t pull_differential(Decoder &dec, uint32_t &next) {
+  uint64_t diff;
+  dec.pull_varint(diff);
+  if (diff + next > std::numeric_limits<uint16_t>::max()) {
+    throw BadMessage("compact block index overflowed 16 bits");
+  }
+  const uint32_t index = diff + next;
+  next = index + 1;
+  return index;
+}
+
+DECLARE_ENCODED_SIZE(CmpctBlock) {
+  size_t size = HEADER_SIZE + BLOCK_HEADER_SIZE + sizeof nonce +
+                varint_size(short_ids.size()) +
+                short_ids.size() * SHORT_ID_SIZE +
+                varint_size(prefilled.size()) +
+                differential_size(prefilled,
+                                  [](const Prefilled &p) { return p.index; });
+  for (const auto &tx : prefilled) {
+    size += tx.raw.size();
+  }
+  return size;
+}
+
+DECLARE_ENCODE(CmpctBlock) {
+  enc.push(header, false);
+  enc.push(nonce);
+  enc.push_varint(short_ids.size());
+  for (uint64_t id : short_ids) {
+    enc.push(static_cast<uint32_t>(id));
+    enc.push(static_cast<uint16_t>(id >> 32));
+  }
+  enc.push_varint(prefilled.size());
+  uint32_t next = 0;
+  for (const auto &tx : prefilled) {
+    enc.push_varint(tx.index - next);
+    enc.append(tx.raw.data(), tx.raw.size());
+    next = tx.index + 1;
   }
-  enc.push(hash_stop);
-  return enc.serialize(sz);
+}
+
+ENCODE_FIELDS(CFCheckpt, filter_type, stop_hash, filter_headers)
+
+ENCODE_FIELDS(CFHeaders,
+              filter_type, stop_hash, prev_filter_header, filter_hashes)
+
+ENCODE_FIELDS(CFilter, filter_type, block_hash, filter)
+
+ENCODE_FIELDS(FilterAdd, data)
+
+ENCODE_EMPTY(FilterClear)
+
+ENCODE_FIELDS(FilterLoad, filter, hash_funcs, tweak, flags)
+
+ENCODE_EMPTY(GetAddr)
+
+ENCODE_FIELDS(GetBlocks, version, locator_hashes, hash_stop)
+
+DECLARE_ENCODED_SIZE(GetBlockTxn) {
+  return HEADER_SIZE + sizeof block_hash + varint_size(indexes.size()) +
+         differential_size(indexes, [](uint32_t i) { return i; });
+}
+
+DECLARE_ENCODE(GetBlockTxn) {
+  enc.push(block_hash);
+  enc.push_varint(indexes.size());
+  uint32_t next = 0;
+  for (uint32_t index : indexes) {
+    enc.push_varint(index - next);
+    next = index + 1;
+  }
+}
+
+ENCODE_FIELDS(GetCFCheckpt, filter_type, stop_hash)
+
+ENCODE_FIELDS(GetCFHeaders, filter_type, start_height, stop_hash)
+
+ENCODE_FIELDS(GetCFilters, filter_type, start_height, stop_hash)
+
+ENCODE_FIELDS(GetData, invs)
+
+ENCODE_FIELDS(GetHeaders, version, locator_hashes, hash_stop)
+
+DECLARE_ENCODED_SIZE(HeadersMsg) {
+  // each header is followed by a zero tx count
+  return HEADER_SIZE + varint_size(block_headers.size()) +
+         block_headers.size() * (BLOCK_HEADER_SIZE + 1);
 }
 
 DECLARE_ENCODE(HeadersMsg) {
-  Encoder enc(headers);
   enc.push_varint(block_headers.size());
   for (const auto &hdr : block_headers) {
     enc.push(hdr);
   }
-  return enc.serialize(sz);
 }
 
-DECLARE_ENCODE(InvMsg) {
-  Encoder enc(headers);
-  enc.push_varint(invs.size());
-  for (const auto &inv : invs) {
-    enc.push(inv.type);
-    enc.push(inv.hash);
+ENCODE_FIELDS(InvMsg, invs)
+
+ENCODE_EMPTY(Mempool)
+
+DECLARE_ENCODED_SIZE(MerkleBlock) {
+  return HEADER_SIZE + BLOCK_HEADER_SIZE + sizeof total_txs +
+         varint_size(hashes.size()) + hashes.size() * sizeof(hash_t) +
+         string_size(flags);
+}
+
+DECLARE_ENCODE(MerkleBlock) {
+  enc.push(header, false);
+  enc.push(total_txs);
+  enc.push_varint(hashes.size());
+  for (const auto &hash : hashes) {
+    enc.push(hash);
   }
-  return enc.serialize(sz);
+  enc.push(flags);
 }
 
-DECLARE_ENCODE(Mempool) { return Encoder(headers).serialize(sz); }
+// the number of nodes at this height of a merkle tree, counting the leaves
+// as height 0
+static inline size_t tree_width(uint32_t total_txs, unsigned height) {
+  return (total_txs + (size_t(1) << height) - 1) >> height;
+}
 
-DECLARE_ENCODE(Ping) {
-  Encoder enc(headers);
-  enc.push(nonce);
-  return enc.serialize(sz);
+namespace {
+// How a node of a partial merkle tree gets its hash: it's in the message,
+// it's the hash of its children, or it's a copy of its left sibling (the
+// last node of a level with an odd width is paired with itself).
+enum class NodeKind : uint8_t { GIVEN, COMPUTED, COPY };
+
+struct MerkleNode {
+  uint32_t height;
+  NodeKind kind;
+  uint32_t index;  // into MerkleBlock::hashes when GIVEN, else the position
+};
+
+// max_block_txs leaves make a tree this tall
+const unsigned max_tree_height = 15;
+
+// Scratch space for extract_matches(), kept so that checking a block
+// doesn't allocate once the vectors have grown.
+struct MerkleScratch {
+  std::vector<MerkleNode> stack;
+  std::vector<MerkleNode> visited;  // in the order of the flag bits
+  std::vector<hash_t> hashes;       // grouped by height, in wire byte order
+  std::vector<NodeKind> kinds;
+};
+
+thread_local MerkleScratch scratch;
+}  // namespace
+
+// Checking the tree takes two passes, neither of them recursive. The first
+// walks the flag bits depth first with an explicit stack, as BIP37 lays
+// them out, and records each node it reaches. Grouping those by height puts
+// every computed node's children side by side, in order, so the second pass
+// can compute each level from the one below with a single batched hash of
+// all its pairs.
+static bool check_partial_tree(const MerkleBlock &msg,
+                               std::vector<hash_t> &matches) {
+  unsigned height = 0;
+  while (tree_width(msg.total_txs, height) > 1) {
+    height++;
+  }
+  assert(height <= max_tree_height);
+
+  MerkleScratch &s = scratch;
+  s.stack.clear();
+  s.visited.clear();
+  s.stack.push_back({height, NodeKind::COMPUTED, 0});
+  size_t bits_used = 0, hashes_used = 0;
+  while (!s.stack.empty()) {
+    const MerkleNode node = s.stack.back();
+    s.stack.pop_back();
+    if (node.kind == NodeKind::COPY) {
+      s.visited.push_back(node);
+      continue;
+    }
+    if (bits_used >= 8 * msg.flags.size()) {
+      return false;
+    }
+    const bool flag = (msg.flags[bits_used / 8] >> (bits_used % 8)) & 1;
+    bits_used++;
+    if (node.height == 0 || !flag) {
+      if (hashes_used >= msg.hashes.size()) {
+        return false;
+      }
+      if (node.height == 0 && flag) {
+        matches.push_back(msg.hashes[hashes_used]);
+      }
+      s.visited.push_back({node.height, NodeKind::GIVEN,
+                           static_cast<uint32_t>(hashes_used++)});
+      continue;
+    }
+    s.visited.push_back(node);
+
+    // the right child goes on the stack first, so the left one is walked
+    // first
+    const uint32_t child = node.height - 1, left = node.index * 2;
+    if (left + 1 < tree_width(msg.total_txs, child)) {
+      s.stack.push_back({child, NodeKind::COMPUTED, left + 1});
+    } else {
+      s.stack.push_back({child, NodeKind::COPY, left + 1});
+    }
+    s.stack.push_back({child, NodeKind::COMPUTED, left});
+  }
+  // every hash and every byte of flags must have been used
+  if (hashes_used != msg.hashes.size() ||
+      (bits_used + 7) / 8 != msg.flags.size()) {
+    return false;
+  }
+
+  // group the nodes by height, keeping their order
+  std::array<size_t, max_tree_height + 2> start{};
+  for (const MerkleNode &node : s.visited) {
+    start[node.height + 1]++;
+  }
+  for (unsigned h = 0; h <= height; h++) {
+    start[h + 1] += start[h];
+  }
+  std::array<size_t, max_tree_height + 1> next;
+  std::copy(start.begin(), start.begin() + height + 1, next.begin());
+  s.hashes.resize(s.visited.size());
+  s.kinds.resize(s.visited.size());
+  for (const MerkleNode &node : s.visited) {
+    const size_t i = next[node.height]++;
+    s.kinds[i] = node.kind;
+    if (node.kind == NodeKind::GIVEN) {
+      const hash_t &hash = msg.hashes[node.index];
+      std::reverse_copy(hash.begin(), hash.end(), s.hashes[i].begin());
+    }
+  }
+
+  for (unsigned h = 0; h < height; h++) {
+    // each node at this height is one of a pair under a computed parent
+    const size_t begin = start[h], end = start[h + 1];
+    assert((end - begin) % 2 == 0);
+    for (size_t i = begin; i < end; i += 2) {
+      if (s.kinds[i + 1] == NodeKind::COPY) {
+        s.hashes[i + 1] = s.hashes[i];
+      } else if (s.hashes[i + 1] == s.hashes[i]) {
+        return false;  // a duplicated subtree, see CVE-2012-2459
+      }
+    }
+    // hash the pairs in place, then hand them to their parents
+    const size_t pairs = (end - begin) / 2;
+    merkle_hash_batch(&s.hashes[begin], pairs, &s.hashes[begin]);
+    size_t parent = start[h + 1];
+    for (size_t i = 0; i < pairs; i++, parent++) {
+      while (s.kinds[parent] != NodeKind::COMPUTED) {
+        parent++;
+      }
+      s.hashes[parent] = s.hashes[begin + i];
+    }
+  }
+
+  assert(start[height + 1] - start[height] == 1);
+  hash_t root;
+  std::reverse_copy(msg.header.merkle_root.begin(),
+                    msg.header.merkle_root.end(), root.begin());
+  return s.hashes[start[height]] == root;
 }
 
-DECLARE_ENCODE(Pong) {
-  Encoder enc(headers);
-  enc.push(nonce);
-  return enc.serialize(sz);
+bool MerkleBlock::extract_matches(std::vector<hash_t> &matches) const {
+  if (total_txs == 0 || total_txs > max_block_txs ||
+      hashes.size() > total_txs || 8 * flags.size() < hashes.size()) {
+    return false;
+  }
+  const size_t matched = matches.size();
+  if (!check_partial_tree(*this, matches)) {
+    matches.resize(matched);
+    return false;
+  }
+  return true;
+}
+
+ENCODE_FIELDS(Ping, nonce)
+
+ENCODE_FIELDS(Pong, nonce)
+
+DECLARE_ENCODED_SIZE(Reject) {
+  return HEADER_SIZE + string_size(message) + sizeof ccode +
+         string_size(reason) + (data != empty_hash ? sizeof(hash_t) : 0);
 }
 
 DECLARE_ENCODE(Reject) {
-  Encoder enc(headers);
   enc.push(message);
   enc.push(ccode);
   enc.push(reason);
   if (data != empty_hash) {
     enc.push(data);
   }
-  return enc.serialize(sz);
 }
 
-DECLARE_ENCODE(SendHeaders) { return Encoder(headers).serialize(sz); }
+ENCODE_FIELDS(SendCmpct, announce, version)
 
-DECLARE_ENCODE(VerAck) { return Encoder(headers).serialize(sz); }
+ENCODE_EMPTY(SendAddrV2)
 
-DECLARE_ENCODE(Version) {
-  Encoder enc(headers);
-  enc.push(version);
-  enc.push(services);
-  enc.push(timestamp);
-  enc.push(addr_recv);
-  enc.push(addr_from);
-  enc.push(nonce);
-  enc.push(user_agent);
-  enc.push(start_height);
-  enc.push(relay);
-  return enc.serialize(sz);
+ENCODE_EMPTY(SendHeaders)
+
+DECLARE_ENCODED_SIZE(TxMsg) { return HEADER_SIZE + raw.size(); }
+
+DECLARE_ENCODE(TxMsg) {
+  enc.append(raw.data(), raw.size());
 }
 
-typedef std::function<std::unique_ptr<Message>(Decoder &, const Headers &)>
-    handler_t;
+ENCODE_EMPTY(VerAck)
+
+ENCODE_FIELDS(Version, version, services, timestamp, addr_recv, addr_from,
+              nonce, user_agent, start_height, relay)
 
-class HandlerRegistry {
- public:
-  HandlerRegistry() {}
-  HandlerRegistry(const HandlerRegistry &other) = delete;
+#define DECLARE_PARSER(cmd)                                                 \
+  static Arena::Ptr<Message> parse_##cmd(Decoder &dec, const Headers &hdrs, \
+                                         Arena &arena)
 
-  void add_handler(const std::string &command, handler_t handler) {
-    handlers_.insert(std::make_pair(command, handler));
+DECLARE_PARSER(addr) {
+  auto msg = arena.make<AddrMsg>(hdrs);
+  Cursor cur;
+  const size_t count = dec.pull_entries(MAX_ADDR_SIZE, netaddr_size, cur,
+                                        "addr");
+  LOG_DEBUG(log, "peer is sending us {} addr(s)", count);
+  msg->addrs.resize(count);
+  for (auto &addr : msg->addrs) {
+    cur.net_addr(addr);
   }
+  return msg;
+}
 
-  std::unique_ptr<Message> parse(Decoder &dec, const Headers &hdrs) {
-    const std::string &cmd = hdrs.command;
-    const auto it = handlers_.find(cmd);
-    if (it == handlers_.end()) {
-      throw UnknownMessage(cmd);
+// BIP155's limit on the length of an address, whatever its network
+static const size_t max_addrv2_size = 512;
+
+DECLARE_PARSER(addrv2) {
+  auto msg = arena.make<AddrV2Msg>(hdrs);
+  const size_t count = dec.pull_count(MAX_ADDR_SIZE, "addrv2");
+  LOG_DEBUG(log, "peer is sending us {} addrv2 address(es)", count);
+  msg->addrs.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    NetAddr addr;
+    uint8_t id;
+    uint64_t len;
+    dec.pull(addr.time);
+    dec.pull_varint(addr.services);
+    dec.pull(id);
+    dec.pull_varint(len);
+    const size_t expected = netid_size(id);
+    if (len > max_addrv2_size || (expected != 0 && len != expected)) {
+      std::ostringstream os;
+      os << "addrv2 address of network " << int(id) << " has length " << len;
+      throw BadMessage(os.str());
     }
-    return std::unique_ptr<Message>(it->second(dec, hdrs));
+    Cursor cur;
+    if (dec.reserve(len + sizeof(uint16_t), cur) != DecodeStatus::OK) {
+      throw IncompleteParse("addrv2 entries are truncated");
+    }
+    // unknown networks are skipped, as BIP155 asks
+    if (expected == 0 ||
+        !addr.addr.set_bip155(NetId(id),
+                              reinterpret_cast<const uint8_t *>(cur.pos))) {
+      msg->unreachable++;
+      continue;
+    }
+    cur.skip(len);
+    addr.addr.set_port(cur.u16_be());
+    msg->addrs.push_back(addr);
   }
+  return msg;
+}
 
- private:
-  std::unordered_map<std::string, handler_t> handlers_;
-};
+// pull a count of hashes, and then the hashes
+static void pull_hashes(Decoder &dec, std::vector<hash_t> &hashes,
+                        size_t max, const char *what) {
+  Cursor cur;
+  hashes.resize(dec.pull_entries(max, sizeof(hash_t), cur, what));
+  for (auto &hash : hashes) {
+    cur.hash(hash);
+  }
+}
 
-static HandlerRegistry registry_;
+// pull a count of inv entries, and then the entries, for inv and getdata
+static void pull_invs(Decoder &dec, std::vector<Inv> &invs, const char *what) {
+  Cursor cur;
+  const size_t count = dec.pull_entries(MAX_INV_SIZE, inv_size, cur, what);
+  invs.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    const InvType type = static_cast<InvType>(cur.u32());
+    hash_t hash;
+    cur.hash(hash);
+    invs.emplace_back(type, hash);
+  }
+}
 
-struct MessageParser {
-  MessageParser() = delete;
-  MessageParser(const MessageParser &other) = delete;
-  MessageParser(const std::string &cmd, handler_t callback) {
-    registry_.add_handler(cmd, callback);
+// The raw bytes are copied out of the connection's read buffer once. The
+// spans are offsets into the copy, which is why it's indexed rather than dec.
+DECLARE_PARSER(block) {
+  auto msg = arena.make<Block>(hdrs);
+  msg->raw.assign(dec.data_ + dec.off_, dec.bytes_remaining());
+  msg->index();
+  return msg;
+}
+
+// pull n transactions, copying each one out of the message
+static void pull_txs(Decoder &dec, size_t n, std::vector<std::string> &txs) {
+  for (size_t i = 0; i < n; i++) {
+    const TxSpan span = TxSpan::pull(dec);
+    txs.emplace_back(dec.data_ + span.offset, span.size);
   }
-};
+}
 
-#define DECLARE_PARSER(cmd, callback) \
-  static MessageParser cmd##_parser(#cmd, callback);
+DECLARE_PARSER(blocktxn) {
+  auto msg = arena.make<BlockTxn>(hdrs);
+  dec.pull(msg->block_hash);
+  const size_t count = dec.pull_count(max_block_txs, "blocktxn tx");
+  msg->txs.reserve(count);
+  pull_txs(dec, count, msg->txs);
+  return msg;
+}
 
-DECLARE_PARSER(addr, [](auto &dec, const auto &hdrs) {
-  auto msg = std::make_unique<AddrMsg>(hdrs);
-  uint64_t count;
-  dec.pull_varint(count);
-  if (count > 1000) {
-    std::ostringstream os;
-    os << "addr count " << count << " is too large, ignoring";
-    throw BadMessage(os.str());
+DECLARE_PARSER(cmpctblock) {
+  auto msg = arena.make<CmpctBlock>(hdrs);
+  dec.pull(msg->header, false);
+  dec.pull(msg->nonce);
+  Cursor cur;
+  msg->short_ids.resize(dec.pull_entries(max_block_txs, SHORT_ID_SIZE, cur,
+                                         "cmpctblock short id"));
+  for (auto &id : msg->short_ids) {
+    const uint32_t lo = cur.u32();
+    id = uint64_t(cur.u16()) << 32 | lo;
   }
-  log->debug("peer is sending us {} addr(s)", count);
-  for (size_t i = 0; i < count; i++) {
-    NetAddr addr;
-    dec.pull(addr);
-    msg->addrs.push_back(addr);
+  msg->prefilled.resize(dec.pull_count(
+      max_block_txs - msg->short_ids.size(), "cmpctblock prefilled tx"));
+  uint32_t next = 0;
+  for (auto &tx : msg->prefilled) {
+    tx.index = pull_differential(dec, next);
+    const TxSpan span = TxSpan::pull(dec);
+    tx.raw.assign(dec.data_ + span.offset, span.size);
   }
   return msg;
-});
+}
 
-DECLARE_PARSER(getaddr, [](auto &dec, const auto &hdrs) {
-  return std::make_unique<GetAddr>(hdrs);
-});
+DECLARE_PARSER(cfcheckpt) {
+  auto msg = arena.make<CFCheckpt>(hdrs);
+  dec.pull(msg->filter_type);
+  dec.pull(msg->stop_hash);
+  pull_hashes(dec, msg->filter_headers, MAX_INV_SIZE, "cfcheckpt header");
+  return msg;
+}
 
-DECLARE_PARSER(getblocks, [](auto &dec, const auto &hdrs) {
-  auto msg = std::make_unique<GetBlocks>(hdrs);
-  dec.pull(msg->version);
-  uint64_t count;
-  dec.pull_varint(count);
-  if (count > 2000) {
-    std::ostringstream os;
-    os << "getblocks hash_count " << count << " is too large, ignoring";
-    throw BadMessage(os.str());
+DECLARE_PARSER(cfheaders) {
+  auto msg = arena.make<CFHeaders>(hdrs);
+  dec.pull(msg->filter_type);
+  dec.pull(msg->stop_hash);
+  dec.pull(msg->prev_filter_header);
+  pull_hashes(dec, msg->filter_hashes, MAX_GETCFHEADERS_SIZE,
+              "cfheaders hash");
+  return msg;
+}
+
+DECLARE_PARSER(cfilter) {
+  auto msg = arena.make<CFilter>(hdrs);
+  dec.pull(msg->filter_type);
+  dec.pull(msg->block_hash);
+  // a filter can be bigger than Decoder::pull(std::string) allows
+  uint64_t size;
+  dec.pull_varint(size);
+  if (size > dec.bytes_remaining()) {
+    throw BadMessage("cfilter filter is truncated");
   }
-  log->debug("peer wants {} block(s)", count);
-  for (size_t i = 0; i < count; i++) {
-    hash_t locator_hash;
-    dec.pull(locator_hash);
-    msg->locator_hashes.push_back(locator_hash);
+  msg->filter.resize(size);
+  dec.pull_buf(&msg->filter[0], size);
+  return msg;
+}
+
+DECLARE_PARSER(filteradd) {
+  auto msg = arena.make<FilterAdd>(hdrs);
+  dec.pull(msg->data);
+  if (msg->data.size() > MAX_FILTERADD_SIZE) {
+    throw BadMessage("filteradd data is too large");
   }
-  dec.pull(msg->hash_stop);
   return msg;
-});
+}
 
-DECLARE_PARSER(getdata, [](auto &dec, const auto &hdrs) {
-  auto msg = std::make_unique<GetData>(hdrs);
-  uint64_t count;
-  dec.pull_varint(count);
-  if (count > 50000) {
-    std::ostringstream os;
-    os << "getdata inv count " << count << " is too large, ignoring";
-    throw BadMessage(os.str());
+DECLARE_PARSER(filterclear) {
+  return arena.make<FilterClear>(hdrs);
+}
+
+DECLARE_PARSER(filterload) {
+  auto msg = arena.make<FilterLoad>(hdrs);
+  dec.pull(msg->filter);
+  if (msg->filter.size() > MAX_BLOOM_FILTER_SIZE) {
+    throw BadMessage("filterload filter is too large");
   }
-  for (size_t i = 0; i < count; i++) {
-    InvType type;
-    hash_t hash;
-    dec.pull(type);
-    dec.pull(hash);
-    msg->invs.emplace_back(type, hash);
+  dec.pull(msg->hash_funcs);
+  if (msg->hash_funcs > MAX_BLOOM_HASH_FUNCS) {
+    throw BadMessage("filterload has too many hash functions");
   }
+  dec.pull(msg->tweak);
+  dec.pull(msg->flags);
   return msg;
-});
+}
 
-DECLARE_PARSER(getheaders, [](auto &dec, const auto &hdrs) {
-  auto msg = std::make_unique<GetHeaders>(hdrs);
+DECLARE_PARSER(getaddr) {
+  return arena.make<GetAddr>(hdrs);
+}
+
+DECLARE_PARSER(getblocks) {
+  auto msg = arena.make<GetBlocks>(hdrs);
   dec.pull(msg->version);
-  uint64_t count;
-  dec.pull_varint(count);
-  if (count > 2000) {
-    std::ostringstream os;
-    os << "getheaders hash_count " << count << " is too large, ignoring";
-    throw BadMessage(os.str());
-  }
-  log->debug("peer wants {} header(s)", count);
-  for (size_t i = 0; i < count; i++) {
-    hash_t locator_hash;
-    dec.pull(locator_hash);
-    msg->locator_hashes.push_back(locator_hash);
+  Cursor cur;
+  const size_t count =
+      dec.pull_entries(2000, sizeof(hash_t), cur, "getblocks locator");
+  LOG_DEBUG(log, "peer wants {} block(s)", count);
+  msg->locator_hashes.resize(count);
+  for (auto &hash : msg->locator_hashes) {
+    cur.hash(hash);
   }
   dec.pull(msg->hash_stop);
   return msg;
-});
+}
 
-DECLARE_PARSER(headers, [](auto &dec, const auto &hdrs) {
-  auto msg = std::make_unique<HeadersMsg>(hdrs);
-  uint64_t count;
-  dec.pull_varint(count);
-  if (count > 10000) {
-    std::ostringstream os;
-    os << "headers count " << count << " is too large, ignoring";
-    throw BadMessage(os.str());
+DECLARE_PARSER(getblocktxn) {
+  auto msg = arena.make<GetBlockTxn>(hdrs);
+  dec.pull(msg->block_hash);
+  // each index is at least a byte
+  msg->indexes.resize(
+      dec.pull_count(dec.bytes_remaining(), "getblocktxn index"));
+  uint32_t next = 0;
+  for (auto &index : msg->indexes) {
+    index = pull_differential(dec, next);
   }
-  for (size_t i = 0; i < count; i++) {
-    BlockHeader hdr;
-    dec.pull(hdr);
-    msg->block_headers.push_back(hdr);
+  return msg;
+}
+
+DECLARE_PARSER(getcfcheckpt) {
+  auto msg = arena.make<GetCFCheckpt>(hdrs);
+  dec.pull(msg->filter_type);
+  dec.pull(msg->stop_hash);
+  return msg;
+}
+
+DECLARE_PARSER(getcfheaders) {
+  auto msg = arena.make<GetCFHeaders>(hdrs);
+  dec.pull(msg->filter_type);
+  dec.pull(msg->start_height);
+  dec.pull(msg->stop_hash);
+  return msg;
+}
+
+DECLARE_PARSER(getcfilters) {
+  auto msg = arena.make<GetCFilters>(hdrs);
+  dec.pull(msg->filter_type);
+  dec.pull(msg->start_height);
+  dec.pull(msg->stop_hash);
+  return msg;
+}
+
+DECLARE_PARSER(getdata) {
+  auto msg = arena.make<GetData>(hdrs);
+  pull_invs(dec, msg->invs, "getdata inv");
+  return msg;
+}
+
+DECLARE_PARSER(getheaders) {
+  auto msg = arena.make<GetHeaders>(hdrs);
+  dec.pull(msg->version);
+  Cursor cur;
+  const size_t count =
+      dec.pull_entries(2000, sizeof(hash_t), cur, "getheaders locator");
+  LOG_DEBUG(log, "peer wants {} header(s)", count);
+  msg->locator_hashes.resize(count);
+  for (auto &hash : msg->locator_hashes) {
+    cur.hash(hash);
   }
+  dec.pull(msg->hash_stop);
   return msg;
-});
+}
 
-DECLARE_PARSER(inv, [](auto &dec, const auto &hdrs) {
-  auto msg = std::make_unique<InvMsg>(hdrs);
-  uint64_t count;
-  dec.pull_varint(count);
-  if (count > 50000) {
-    std::ostringstream os;
-    os << "inv count " << count << " is too large, ignoring";
-    throw BadMessage(os.str());
+DECLARE_PARSER(headers) {
+  auto msg = arena.make<HeadersMsg>(hdrs);
+  const size_t count_start = dec.off_;
+  const size_t count = dec.pull_count(10000, "headers");
+  const size_t count_size = dec.off_ - count_start;
+  // Each entry is an 80-byte header and a zero tx count, so the headers are
+  // evenly spaced and can be decoded and hashed later; see HeadersView.
+  const size_t sz = count * HeadersView::stride;
+  if (dec.bytes_remaining() < sz) {
+    throw BadMessage("headers message is truncated");
   }
+  const char *base = dec.data_ + dec.off_;
   for (size_t i = 0; i < count; i++) {
-    InvType inv_type;
-    hash_t hash;
-    dec.pull(inv_type);
-    dec.pull(hash);
-    msg->invs.emplace_back(inv_type, hash);
+    if (base[i * HeadersView::stride + BLOCK_HEADER_SIZE] != 0) {
+      throw BadMessage("headers message has a non-zero tx count");
+    }
+  }
+  msg->raw_headers.assign(base, sz);
+  dec.off_ += sz;
+  // HeaderValidator checks the checksum with the count encoded again, so a
+  // payload that isn't just that and the headers is checked here instead.
+  if ((count_size != varint_size(count) || dec.bytes_remaining()) &&
+      !hdrs.sealed && !check_checksum(dec.data_, dec.cap_, hdrs.checksum)) {
+    throw BadMessage("headers message has a bad checksum");
   }
   return msg;
-});
+}
 
-DECLARE_PARSER(mempool, [](auto &dec, const auto &hdrs) {
-  return std::make_unique<Mempool>(hdrs);
-});
+DECLARE_PARSER(inv) {
+  auto msg = arena.make<InvMsg>(hdrs);
+  pull_invs(dec, msg->invs, "inv");
+  std::stable_partition(msg->invs.begin(), msg->invs.end(),
+                        [](const Inv &inv) { return is_block(inv.type); });
+  return msg;
+}
 
-DECLARE_PARSER(ping, [](auto &dec, const auto &hdrs) {
-  auto msg = std::make_unique<Ping>(hdrs);
+DECLARE_PARSER(mempool) {
+  return arena.make<Mempool>(hdrs);
+}
+
+DECLARE_PARSER(merkleblock) {
+  auto msg = arena.make<MerkleBlock>(hdrs);
+  dec.pull(msg->header, false);
+  dec.pull(msg->total_txs);
+  pull_hashes(dec, msg->hashes, msg->total_txs, "merkleblock hash");
+  dec.pull(msg->flags);
+  return msg;
+}
+
+DECLARE_PARSER(ping) {
+  auto msg = arena.make<Ping>(hdrs);
   dec.pull(msg->nonce);
   return msg;
-});
+}
 
-DECLARE_PARSER(pong, [](auto &dec, const auto &hdrs) {
-  auto msg = std::make_unique<Pong>(hdrs);
+DECLARE_PARSER(pong) {
+  auto msg = arena.make<Pong>(hdrs);
   dec.pull(msg->nonce);
   return msg;
-});
+}
 
-DECLARE_PARSER(reject, [](auto &dec, const auto &hdrs) {
-  auto msg = std::make_unique<Reject>(hdrs);
+DECLARE_PARSER(reject) {
+  auto msg = arena.make<Reject>(hdrs);
   dec.pull(msg->message);
   dec.pull(msg->ccode);
   dec.pull(msg->reason);
@@ -339,18 +934,40 @@ DECLARE_PARSER(reject, [](auto &dec, const auto &hdrs) {
   // this branch not reached
   assert(false);
   return msg;
-});
+}
 
-DECLARE_PARSER(sendheaders, [](auto &dec, const auto &hdrs) {
-  return std::make_unique<SendHeaders>(hdrs);
-});
+DECLARE_PARSER(sendcmpct) {
+  auto msg = arena.make<SendCmpct>(hdrs);
+  dec.pull(msg->announce);
+  dec.pull(msg->version);
+  return msg;
+}
 
-DECLARE_PARSER(verack, [](auto &dec, const auto &hdrs) {
-  return std::make_unique<VerAck>(hdrs);
-});
+DECLARE_PARSER(sendaddrv2) {
+  return arena.make<SendAddrV2>(hdrs);
+}
 
-DECLARE_PARSER(version, [](auto &dec, const auto &hdrs) {
-  auto msg = std::make_unique<Version>(hdrs);
+DECLARE_PARSER(sendheaders) {
+  return arena.make<SendHeaders>(hdrs);
+}
+
+DECLARE_PARSER(tx) {
+  auto msg = arena.make<TxMsg>(hdrs);
+  msg->raw.assign(dec.data_ + dec.off_, dec.bytes_remaining());
+  Decoder body(msg->raw.data(), msg->raw.size());
+  msg->span = TxSpan::pull(body);
+  if (body.bytes_remaining()) {
+    throw BadMessage("tx has data after the transaction");
+  }
+  return msg;
+}
+
+DECLARE_PARSER(verack) {
+  return arena.make<VerAck>(hdrs);
+}
+
+DECLARE_PARSER(version) {
+  auto msg = arena.make<Version>(hdrs);
   dec.pull(msg->version);
   dec.pull(msg->services);
   dec.pull(msg->timestamp);
@@ -365,50 +982,177 @@ DECLARE_PARSER(version, [](auto &dec, const auto &hdrs) {
     }
   }
   return msg;
-});
+}
+
+#define PARSE_CASE(cmd, name)              \
+  case Command::cmd:                       \
+    return parse_##name(dec, hdrs, arena);
+
+static Arena::Ptr<Message> parse_payload(Decoder &dec, const Headers &hdrs,
+                                         Arena &arena) {
+  switch (hdrs.type) {
+    PARSE_CASE(ADDR, addr)
+    PARSE_CASE(ADDRV2, addrv2)
+    PARSE_CASE(BLOCK, block)
+    PARSE_CASE(BLOCKTXN, blocktxn)
+    PARSE_CASE(CFCHECKPT, cfcheckpt)
+    PARSE_CASE(CFHEADERS, cfheaders)
+    PARSE_CASE(CFILTER, cfilter)
+    PARSE_CASE(CMPCTBLOCK, cmpctblock)
+    PARSE_CASE(FILTERADD, filteradd)
+    PARSE_CASE(FILTERCLEAR, filterclear)
+    PARSE_CASE(FILTERLOAD, filterload)
+    PARSE_CASE(GETADDR, getaddr)
+    PARSE_CASE(GETBLOCKS, getblocks)
+    PARSE_CASE(GETBLOCKTXN, getblocktxn)
+    PARSE_CASE(GETCFCHECKPT, getcfcheckpt)
+    PARSE_CASE(GETCFHEADERS, getcfheaders)
+    PARSE_CASE(GETCFILTERS, getcfilters)
+    PARSE_CASE(GETDATA, getdata)
+    PARSE_CASE(GETHEADERS, getheaders)
+    PARSE_CASE(HEADERS, headers)
+    PARSE_CASE(INV, inv)
+    PARSE_CASE(MEMPOOL, mempool)
+    PARSE_CASE(MERKLEBLOCK, merkleblock)
+    PARSE_CASE(PING, ping)
+    PARSE_CASE(PONG, pong)
+    PARSE_CASE(REJECT, reject)
+    PARSE_CASE(SENDADDRV2, sendaddrv2)
+    PARSE_CASE(SENDCMPCT, sendcmpct)
+    PARSE_CASE(SENDHEADERS, sendheaders)
+    PARSE_CASE(TX, tx)
+    PARSE_CASE(VERACK, verack)
+    PARSE_CASE(VERSION, version)
+    case Command::UNKNOWN:
+      break;
+  }
+  throw UnknownMessage(hdrs.command);
+}
+
+#undef PARSE_CASE
+
+size_t message_size(const char *data) {
+  uint32_t payload_size;
+  std::memcpy(&payload_size, data + HEADER_LEN_OFFSET, sizeof payload_size);
+  return HEADER_SIZE + le32toh(payload_size);
+}
+
+namespace {
+const Command empty_commands[] = {Command::FILTERCLEAR, Command::GETADDR,
+                                  Command::MEMPOOL,     Command::SENDADDRV2,
+                                  Command::SENDHEADERS, Command::VERACK};
+const size_t empty_count = sizeof empty_commands / sizeof empty_commands[0];
+
+typedef std::array<std::array<char, HEADER_SIZE>, empty_count> EmptyMessages;
+
+// the magic is all that differs between the networks' copies
+std::array<EmptyMessages, NETWORK_COUNT> encode_empty_messages() {
+  std::array<EmptyMessages, NETWORK_COUNT> out;
+  for (size_t net = 0; net < NETWORK_COUNT; net++) {
+    const NetworkScope scope(network_params(Network(net)));
+    for (size_t i = 0; i < empty_count; i++) {
+      Encoder enc(Headers(command_name(empty_commands[i])), HEADER_SIZE);
+      size_t sz;
+      const std::unique_ptr<char[]> data = enc.serialize(sz);
+      assert(sz == HEADER_SIZE);
+      std::memcpy(out[net][i].data(), data.get(), sz);
+    }
+  }
+  return out;
+}
+}  // namespace
 
-static std::unique_ptr<Message> internal_decode_message(
-    const char *data, size_t size, size_t *bytes_consumed) {
+const char *empty_message(Command type) {
+  static const std::array<EmptyMessages, NETWORK_COUNT> messages =
+      encode_empty_messages();
+  const EmptyMessages &ours = messages[size_t(network().id)];
+  for (size_t i = 0; i < empty_count; i++) {
+    if (empty_commands[i] == type) {
+      return ours[i].data();
+    }
+  }
+  assert(false);  // not a payload-less message
+  return nullptr;
+}
+
+PROFILE_BOUNDARY static Arena::Ptr<Message> internal_decode_message(
+    const char *data, size_t size, Arena &arena) {
   Decoder dec(data, size);
   Headers hdrs;
   dec.pull(hdrs);
+  dec.reset(data + HEADER_SIZE, hdrs.payload_size);
+  LOG_TRACE(log, "pulling {} byte payload for command '{}'", hdrs.payload_size,
+            hdrs.command);
 
-  size_t total_size = HEADER_SIZE + hdrs.payload_size;
-#if 0
-  log->debug("pulled headers for command '{}', payload size {}, total_size {}",
-             hdrs.command, hdrs.payload_size, total_size);
-#endif
-  if (total_size > size) {
+  // The big payloads are checked on the thread pool, next to the hashing of
+  // their headers or transactions; see HeaderValidator and BlockVerifier.
+  if (hdrs.type != Command::HEADERS && hdrs.type != Command::BLOCK &&
+      !check_checksum(dec.data_, dec.cap_, hdrs.checksum)) {
     std::ostringstream os;
-    os << "payload for message '" << hdrs.command << "' not ready yet, we need "
-       << total_size << " bytes, we have " << size << " bytes";
-    throw IncompleteParse(os.str());
+    os << hdrs.command << " message has a bad checksum";
+    throw BadMessage(os.str());
   }
 
-  *bytes_consumed = total_size;
-  dec.reset(data + HEADER_SIZE, hdrs.payload_size);
-#if 0
-  log->debug("pulling {} byte payload for command '{}'", hdrs.payload_size,
-             hdrs.command);
-#endif
-
-  return registry_.parse(dec, hdrs);
+  return parse_payload(dec, hdrs, arena);
 }
 
-std::unique_ptr<Message> decode_message(const char *data, size_t size,
-                                        size_t *bytes_consumed) {
+// Run decode, logging why a message is rejected rather than throwing.
+template <typename F>
+static Arena::Ptr<Message> catch_decode(F decode, bool *malformed) {
+  CpuScope cpu(CpuTag::DECODING);
   try {
-    return internal_decode_message(data, size, bytes_consumed);
+    return decode();
   } catch (const IncompleteParse &exc) {
-#if 0
-    log->debug("incomplete parse: {}", exc.what());
-#endif
+    // the frame is complete, so the payload is too short for its contents
+    log->warn("truncated p2p message: {}", exc.what());
+    if (malformed != nullptr) {
+      *malformed = true;
+    }
   } catch (const UnknownMessage &exc) {
     std::string msg(exc.what());
     if (msg != "alert") log->warn("unhandled p2p message: '{}'", msg);
   } catch (const BadMessage &exc) {
     log->warn("bad p2p message parse: {}", exc.what());
+    if (malformed != nullptr) {
+      *malformed = true;
+    }
   }
   return nullptr;
 }
+
+Arena::Ptr<Message> decode_message(const char *data, size_t size,
+                                   size_t *bytes_consumed, Arena &arena,
+                                   bool *malformed) {
+  // Framing is checked up front, so a partial message costs two compares
+  // rather than a thrown exception. Once the frame is complete it's always
+  // consumed, even if the payload turns out to be bad.
+  *bytes_consumed = 0;
+  if (size < HEADER_SIZE || message_size(data) > size) {
+    return nullptr;
+  }
+  const size_t consumed = *bytes_consumed = message_size(data);
+  return catch_decode(
+      [&]() { return internal_decode_message(data, consumed, arena); },
+      malformed);
+}
+
+Arena::Ptr<Message> decode_v2_message(Command type, const char *command,
+                                      const char *payload, size_t size,
+                                      Arena &arena, bool *malformed) {
+  Headers hdrs;
+  hdrs.type = type;
+  if (command != nullptr) {
+    hdrs.command.assign(command, strnlen(command, COMMAND_SIZE));
+  } else {
+    hdrs.command = command_name(type);
+  }
+  hdrs.payload_size = uint32_t(size);
+  hdrs.sealed = true;
+  return catch_decode(
+      [&]() {
+        Decoder dec(payload, size);
+        return parse_payload(dec, hdrs, arena);
+      },
+      malformed);
+}
 }
@@ -23,23 +23,40 @@
 #include <string>
 
 #include "./addr.h"
+#include "./arena.h"
 #include "./config.h"
 #include "./constants.h"
 #include "./fields.h"
+#include "./tx.h"
 #include "./util.h"
 
 namespace spv {
+class Encoder;
+
 struct Message {
   Headers headers;
 
   Message() {}
   explicit Message(const std::string &command) : headers(command) {}
   explicit Message(const Headers &hdrs) : headers(hdrs) {}
+  virtual ~Message() {}
+
+  std::unique_ptr<char[]> encode(size_t &sz) const;
+
+  // append the encoded message to the end of enc
+  void encode(Encoder &enc) const;
 
-  virtual std::unique_ptr<char[]> encode(size_t &sz) const = 0;
+  // the exact size of encode(), including the message header
+  virtual size_t encoded_size() const = 0;
+
+ protected:
+  // push everything that follows the message header
+  virtual void encode_payload(Encoder &enc) const = 0;
 };
 
-#define FINAL_ENCODE std::unique_ptr<char[]> encode(size_t &sz) const final;
+#define FINAL_ENCODE                             \
+  void encode_payload(Encoder &enc) const final; \
+  size_t encoded_size() const final;
 
 struct AddrMsg : Message {
   std::vector<NetAddr> addrs;
@@ -49,22 +66,151 @@ struct AddrMsg : Message {
   FINAL_ENCODE
 };
 
-#if 0
-  // need to add Tx
+// BIP155 addresses, which can be of networks other than IPv4 and IPv6.
+// Only the ones we could connect to are kept, as NetAddrs; unreachable
+// counts the rest.
+struct AddrV2Msg : Message {
+  std::vector<NetAddr> addrs;
+  size_t unreachable;
+
+  AddrV2Msg() : AddrV2Msg(Headers("addrv2")) {}
+  explicit AddrV2Msg(const Headers &hdrs) : Message(hdrs), unreachable(0) {}
+  FINAL_ENCODE
+};
+
+// A full block. The payload is kept as it was sent, and the transactions
+// are only indexed when it's parsed; see TxSpan. It's encoded from raw, so
+// the other fields are just for reading.
 struct Block : Message {
-  uint32_t version;
-  hash_t prev_block;
-  hash_t merkle_root;
-  uint32_t timestamp;
-  uint32_t difficulty;
-  uint32_t nonce;
-  std::vector<Tx> txns;
+  BlockHeader header;
+  std::string raw;  // the payload: the header, the tx count and the txs
+  std::vector<TxSpan> txns;
 
   Block() : Block(Headers("block")) {}
   explicit Block(const Headers &hdrs) : Message(hdrs) {}
+
+  inline hash_t txid(size_t i) const { return txns[i].txid(raw.data()); }
+  inline Tx tx(size_t i) const { return txns[i].parse(raw.data()); }
+
+  // the txids of transactions [begin, end) in wire byte order, which is
+  // how the merkle tree uses them; see sha256::double_hash_ranges_batch()
+  void leaf_hashes(size_t begin, size_t end, hash_t *out) const;
+
+  // Is the header's merkle root the root of the txids? This also fails if
+  // the tree has two identical siblings, since then a different list of
+  // transactions has the same root (CVE-2012-2459).
+  bool check_merkle_root() const;
+
+  // the same, given leaf_hashes() of every transaction; leaves is used up
+  bool check_merkle_root(std::vector<hash_t> &leaves) const;
+
+  // Fill in header and txns from raw, as parsing does. Throws
+  // IncompleteParse or BadMessage if raw isn't a valid block.
+  void index();
+
+  FINAL_ENCODE
+};
+
+// the transactions a getblocktxn asked for, in the same order (BIP152)
+struct BlockTxn : Message {
+  hash_t block_hash;
+  std::vector<std::string> txs;  // each serialized with its witnesses
+
+  BlockTxn() : BlockTxn(Headers("blocktxn")) {}
+  explicit BlockTxn(const Headers &hdrs)
+      : Message(hdrs), block_hash(empty_hash) {}
+  FINAL_ENCODE
+};
+
+// Filter headers at every CFCHECKPT_INTERVAL blocks up to stop_hash, so
+// that peers' filter header chains can be compared cheaply; see BIP157.
+struct CFCheckpt : Message {
+  uint8_t filter_type;
+  hash_t stop_hash;
+  std::vector<hash_t> filter_headers;
+
+  CFCheckpt() : CFCheckpt(Headers("cfcheckpt")) {}
+  explicit CFCheckpt(const Headers &hdrs)
+      : Message(hdrs), filter_type(BASIC_FILTER), stop_hash(empty_hash) {}
+  FINAL_ENCODE
+};
+
+// the filter hashes for a run of blocks ending at stop_hash, and the filter
+// header of the block before the first of them
+struct CFHeaders : Message {
+  uint8_t filter_type;
+  hash_t stop_hash;
+  hash_t prev_filter_header;
+  std::vector<hash_t> filter_hashes;
+
+  CFHeaders() : CFHeaders(Headers("cfheaders")) {}
+  explicit CFHeaders(const Headers &hdrs)
+      : Message(hdrs),
+        filter_type(BASIC_FILTER),
+        stop_hash(empty_hash),
+        prev_filter_header(empty_hash) {}
+  FINAL_ENCODE
+};
+
+// the compact filter for one block, see gcs.h
+struct CFilter : Message {
+  uint8_t filter_type;
+  hash_t block_hash;
+  std::string filter;
+
+  CFilter() : CFilter(Headers("cfilter")) {}
+  explicit CFilter(const Headers &hdrs)
+      : Message(hdrs), filter_type(BASIC_FILTER), block_hash(empty_hash) {}
+  FINAL_ENCODE
+};
+
+// A block as a header and the short ids of its transactions, for the
+// receiver to rebuild from transactions it already has; see BIP152 and
+// cmpct.h. Usually only the coinbase is sent in full.
+struct CmpctBlock : Message {
+  struct Prefilled {
+    uint32_t index;   // the position in the block, not the wire's offset
+    std::string raw;  // the transaction, with its witnesses
+  };
+
+  BlockHeader header;
+  uint64_t nonce;
+  std::vector<uint64_t> short_ids;  // the low SHORT_ID_SIZE bytes of each
+  std::vector<Prefilled> prefilled;
+
+  CmpctBlock() : CmpctBlock(Headers("cmpctblock")) {}
+  explicit CmpctBlock(const Headers &hdrs) : Message(hdrs), nonce(0) {}
+  FINAL_ENCODE
+};
+
+// add one element to the peer's bloom filter, see BIP37
+struct FilterAdd : Message {
+  std::string data;
+
+  FilterAdd() : FilterAdd(Headers("filteradd")) {}
+  explicit FilterAdd(const Headers &hdrs) : Message(hdrs) {}
+  FINAL_ENCODE
+};
+
+struct FilterClear : Message {
+  FilterClear() : FilterClear(Headers("filterclear")) {}
+  explicit FilterClear(const Headers &hdrs) : Message(hdrs) {}
+  FINAL_ENCODE
+};
+
+// a bloom filter for the peer to match transactions against; see bloom.h,
+// which builds these
+struct FilterLoad : Message {
+  std::string filter;
+  uint32_t hash_funcs;
+  uint32_t tweak;
+  uint8_t flags;
+
+  FilterLoad() : FilterLoad(Headers("filterload")) {}
+  explicit FilterLoad(const Headers &hdrs)
+      : Message(hdrs), hash_funcs(0), tweak(0), flags(0) {}
   FINAL_ENCODE
 };
-#endif
 
 struct GetAddr : Message {
   GetAddr() : GetAddr(Headers("getaddr")) {}
@@ -83,6 +229,57 @@ struct GetBlocks : Message {
   FINAL_ENCODE
 };
 
+// ask for the transactions of a cmpctblock that couldn't be filled in
+struct GetBlockTxn : Message {
+  hash_t block_hash;
+  std::vector<uint32_t> indexes;  // positions in the block, ascending
+
+  GetBlockTxn() : GetBlockTxn(Headers("getblocktxn")) {}
+  explicit GetBlockTxn(const Headers &hdrs)
+      : Message(hdrs), block_hash(empty_hash) {}
+  FINAL_ENCODE
+};
+
+struct GetCFCheckpt : Message {
+  uint8_t filter_type;
+  hash_t stop_hash;
+
+  GetCFCheckpt() : GetCFCheckpt(Headers("getcfcheckpt")) {}
+  explicit GetCFCheckpt(const Headers &hdrs)
+      : Message(hdrs), filter_type(BASIC_FILTER), stop_hash(empty_hash) {}
+  FINAL_ENCODE
+};
+
+// ask for the cfheaders of the blocks from start_height to stop_hash
+struct GetCFHeaders : Message {
+  uint8_t filter_type;
+  uint32_t start_height;
+  hash_t stop_hash;
+
+  GetCFHeaders() : GetCFHeaders(Headers("getcfheaders")) {}
+  explicit GetCFHeaders(const Headers &hdrs)
+      : Message(hdrs),
+        filter_type(BASIC_FILTER),
+        start_height(0),
+        stop_hash(empty_hash) {}
+  FINAL_ENCODE
+};
+
+// ask for a cfilter for each block from start_height to stop_hash
+struct GetCFilters : Message {
+  uint8_t filter_type;
+  uint32_t start_height;
+  hash_t stop_hash;
+
+  GetCFilters() : GetCFilters(Headers("getcfilters")) {}
+  explicit GetCFilters(const Headers &hdrs)
+      : Message(hdrs),
+        filter_type(BASIC_FILTER),
+        start_height(0),
+        stop_hash(empty_hash) {}
+  FINAL_ENCODE
+};
+
 struct GetData : Message {
   std::vector<Inv> invs;
 
@@ -103,13 +300,24 @@ struct GetHeaders : Message {
 };
 
 struct HeadersMsg : Message {
+  // the headers to encode; not filled in when a message is parsed
   std::vector<BlockHeader> block_headers;
 
+  // The payload of a parsed message, after the count. Headers are decoded
+  // and hashed from it on demand, see view().
+  std::string raw_headers;
+
   HeadersMsg() : HeadersMsg(Headers("headers")) {}
   explicit HeadersMsg(const Headers &hdrs) : Message(hdrs) {}
+
+  inline HeadersView view() const {
+    return {raw_headers.data(), raw_headers.size() / HeadersView::stride};
+  }
+
   FINAL_ENCODE
 };
 
+// Parsed, the block invs come first, each group in the order it was sent.
 struct InvMsg : Message {
   std::vector<Inv> invs;
 
@@ -124,6 +332,26 @@ struct Mempool : Message {
   FINAL_ENCODE
 };
 
+// A block header with the part of its merkle tree that proves which of its
+// transactions matched our filter. The matching transactions themselves
+// follow as separate tx messages.
+struct MerkleBlock : Message {
+  BlockHeader header;
+  uint32_t total_txs;
+  std::vector<hash_t> hashes;
+  std::string flags;  // one bit per tree node, least significant first
+
+  MerkleBlock() : MerkleBlock(Headers("merkleblock")) {}
+  explicit MerkleBlock(const Headers &hdrs) : Message(hdrs), total_txs(0) {}
+
+  // Walk the partial merkle tree, appending the txids it marks as matched.
+  // Returns false if the tree is malformed or its root isn't the header's
+  // merkle root.
+  bool extract_matches(std::vector<hash_t> &matches) const;
+
+  FINAL_ENCODE
+};
+
 struct Ping : Message {
   uint64_t nonce;
 
@@ -151,12 +379,46 @@ struct Reject : Message {
   FINAL_ENCODE
 };
 
+// Which compact block version the sender supports, and whether it wants
+// new blocks pushed as cmpctblock messages (high bandwidth mode).
+struct SendCmpct : Message {
+  uint8_t announce;
+  uint64_t version;
+
+  SendCmpct() : SendCmpct(Headers("sendcmpct")) {}
+  explicit SendCmpct(const Headers &hdrs)
+      : Message(hdrs), announce(0), version(CMPCT_VERSION) {}
+  FINAL_ENCODE
+};
+
+// asks for addrv2 rather than addr messages; sent before verack (BIP155)
+struct SendAddrV2 : Message {
+  SendAddrV2() : SendAddrV2(Headers("sendaddrv2")) {}
+  explicit SendAddrV2(const Headers &hdrs) : Message(hdrs) {}
+  FINAL_ENCODE
+};
+
 struct SendHeaders : Message {
   SendHeaders() : SendHeaders(Headers("sendheaders")) {}
   explicit SendHeaders(const Headers &hdrs) : Message(hdrs) {}
   FINAL_ENCODE
 };
 
+// a loose transaction, kept as it was sent like the ones in a Block
+struct TxMsg : Message {
+  std::string raw;
+  TxSpan span;
+
+  TxMsg() : TxMsg(Headers("tx")) {}
+  explicit TxMsg(const Headers &hdrs) : Message(hdrs), span{0, 0, 0, 0} {}
+
+  inline hash_t txid() const { return span.txid(raw.data()); }
+  inline hash_t wtxid() const { return span.wtxid(raw.data()); }
+  inline Tx parse() const { return span.parse(raw.data()); }
+
+  FINAL_ENCODE
+};
+
 struct Version : Message {
   uint32_t version;
   uint64_t services;
@@ -186,6 +448,31 @@ struct VerAck : Message {
   FINAL_ENCODE
 };
 
-std::unique_ptr<Message> decode_message(const char *data, size_t size,
-                                        size_t *bytes_consumed);
+// The total size of the message whose header is at data, which must hold at
+// least HEADER_SIZE bytes.
+size_t message_size(const char *data);
+
+// The whole encoding of a message with no payload (filterclear, getaddr,
+// mempool, sendaddrv2, sendheaders or verack) for this thread's network:
+// HEADER_SIZE bytes, checksum and all. They're encoded once for every
+// network, so sending one is a copy from static storage.
+const char *empty_message(Command type);
+
+// Decode a message from data, allocating it from arena. Returns nullptr if
+// there's no complete, valid message; bytes_consumed is 0 if the message is
+// still incomplete. If malformed is given, it's set when a complete message
+// was rejected for its contents (a bad checksum, a truncated payload or an
+// oversized count) rather than for an unknown command.
+Arena::Ptr<Message> decode_message(const char *data, size_t size,
+                                   size_t *bytes_consumed, Arena &arena,
+                                   bool *malformed = nullptr);
+
+// Decode the payload of a BIP324 packet, see parse_v2_packet(), as a message
+// of this type. command is the name it came with, or nullptr for a short
+// id. There's no checksum to check, the packet's tag having authenticated
+// it. Returns nullptr, setting malformed as decode_message() does, if it
+// isn't a valid message.
+Arena::Ptr<Message> decode_v2_message(Command type, const char *command,
+                                      const char *payload, size_t size,
+                                      Arena &arena, bool *malformed = nullptr);
 }  // namespace spv
@@ -0,0 +1,194 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./metrics.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include "./cpu_time.h"
+#include "./memory.h"
+
+namespace spv {
+static Metrics metrics_;
+
+Metrics &metrics() { return metrics_; }
+
+void expose_header(std::string &out, const char *name, const char *type,
+                   const char *help) {
+  out += "# HELP ";
+  out += name;
+  out += ' ';
+  out += help;
+  out += "\n# TYPE ";
+  out += name;
+  out += ' ';
+  out += type;
+  out += '\n';
+}
+
+void expose_sample(std::string &out, const char *name,
+                   const std::string &labels, double val) {
+  char num[32];
+  std::snprintf(num, sizeof num, "%.17g", val);
+  out += name;
+  if (!labels.empty()) {
+    out += '{';
+    out += labels;
+    out += '}';
+  }
+  out += ' ';
+  out += num;
+  out += '\n';
+}
+
+Histogram::Histogram() : count_(0), sum_(0) {
+  for (auto &b : buckets_) {
+    b.store(0, std::memory_order_relaxed);
+  }
+}
+
+uint64_t Histogram::upper_bound(size_t i) {
+  if (i == 0) {
+    return uint64_t(1) << min_bits;
+  }
+  const unsigned exp = min_bits + (i - 1) / sub_buckets;
+  const uint64_t sub = (i - 1) % sub_buckets;
+  return (uint64_t(1) << exp) + ((sub + 1) << (exp - sub_bits));
+}
+
+void Histogram::expose(std::string &out, const char *name,
+                       const char *help) const {
+  expose_header(out, name, "histogram", help);
+  const std::string bucket = std::string(name) + "_bucket";
+  char le[48];
+  uint64_t total = 0;
+  for (size_t i = 0; i < num_buckets; i++) {
+    total += buckets_[i].load(std::memory_order_relaxed);
+    std::snprintf(le, sizeof le, "le=\"%.9g\"", upper_bound(i) / 1e9);
+    expose_sample(out, bucket.c_str(), le, total);
+  }
+  // Read separately from the buckets, the count can be behind a concurrent
+  // record(); the +Inf bucket has to be at least the others.
+  const uint64_t count =
+      std::max(total, count_.load(std::memory_order_relaxed));
+  expose_sample(out, bucket.c_str(), "le=\"+Inf\"", count);
+  expose_sample(out, (std::string(name) + "_sum").c_str(), "",
+                sum_.load(std::memory_order_relaxed) / 1e9);
+  expose_sample(out, (std::string(name) + "_count").c_str(), "", count);
+}
+
+static void expose_commands(std::string &out, const char *name,
+                            const char *help, const Counter *counters) {
+  expose_header(out, name, "counter", help);
+  for (size_t i = 0; i < Metrics::num_commands; i++) {
+    expose_sample(out, name,
+                  std::string("command=\"") + command_name(Command(i)) + '"',
+                  counters[i].value());
+  }
+}
+
+static void expose_counter(std::string &out, const char *name,
+                           const char *help, const Counter &counter) {
+  expose_header(out, name, "counter", help);
+  expose_sample(out, name, "", counter.value());
+}
+
+static void expose_gauge(std::string &out, const char *name,
+                         const char *help, const Gauge &gauge) {
+  expose_header(out, name, "gauge", help);
+  expose_sample(out, name, "", gauge.value());
+}
+
+void Metrics::expose(std::string &out) const {
+  expose_commands(out, "spv_messages_received_total",
+                  "P2P messages received, by command", messages_in);
+  expose_commands(out, "spv_messages_sent_total",
+                  "P2P messages sent, by command", messages_out);
+  expose_counter(out, "spv_received_bytes_total",
+                 "Bytes received from peers", bytes_in);
+  expose_counter(out, "spv_sent_bytes_total", "Bytes sent to peers",
+                 bytes_out);
+  decode_time.expose(out, "spv_decode_seconds",
+                     "Time to decode a received message");
+  header_insert.expose(out, "spv_header_insert_seconds",
+                       "Time to add a headers message to the chain");
+  db_read.expose(out, "spv_db_read_seconds", "Latency of RocksDB reads");
+  db_write.expose(out, "spv_db_write_seconds",
+                  "Latency of RocksDB writes and batch commits");
+  loop_busy.expose(out, "spv_loop_busy_seconds",
+                   "Time each loop iteration spent running callbacks");
+  loop_timer_lag.expose(out, "spv_loop_timer_lag_seconds",
+                        "How late the loop ran a timer");
+  expose_gauge(out, "spv_height", "Height of the best chain", height);
+  expose_gauge(out, "spv_orphans", "Headers in the orphan pool", orphans);
+  expose_gauge(out, "spv_outbound_peers",
+               "Outbound peers that finished the handshake", outbound);
+  expose_gauge(out, "spv_inbound_peers", "Inbound peers", inbound);
+  expose_counter(out, "spv_db_write_stalls_total",
+                 "Times RocksDB slowed or stopped writes", db_write_stalls);
+  expose_gauge(out, "spv_db_write_stalled",
+               "Whether RocksDB writes are stalled", db_write_stalled);
+  expose_counter(out, "spv_db_group_commits_total",
+                 "Writes by the chain writer threads", db_group_commits);
+  expose_counter(out, "spv_db_group_batches_total",
+                 "Header batches grouped into those writes", db_group_batches);
+  if (!cpu_accounting) {
+    return;
+  }
+  expose_header(out, "spv_cpu_seconds_total", "counter",
+                "Thread CPU time charged to each subsystem");
+  for (size_t i = 0; i < size_t(CpuTag::NUM_TAGS); i++) {
+    expose_sample(out, "spv_cpu_seconds_total",
+                  std::string("subsystem=\"") + cpu_tag_name(CpuTag(i)) + '"',
+                  cpu_usage(CpuTag(i)) / 1e9);
+  }
+}
+
+void expose_memory(
+    std::string &out,
+    const std::vector<std::pair<const char *, size_t> > &measured) {
+  expose_header(out, "spv_memory_bytes", "gauge",
+                "Bytes held by each subsystem");
+  for (size_t i = 0; i < size_t(MemTag::NUM_TAGS); i++) {
+    expose_sample(out, "spv_memory_bytes",
+                  std::string("subsystem=\"") + mem_tag_name(MemTag(i)) + '"',
+                  mem_usage(MemTag(i)));
+  }
+  for (const auto &pr : measured) {
+    expose_sample(out, "spv_memory_bytes",
+                  std::string("subsystem=\"") + pr.first + '"', pr.second);
+  }
+  expose_header(out, "spv_page_bytes", "gauge",
+                "Bytes of the huge page backed tables, by page type");
+  for (size_t i = 0; i < size_t(PageType::NUM_TYPES); i++) {
+    expose_sample(out, "spv_page_bytes",
+                  std::string("type=\"") + page_type_name(PageType(i)) + '"',
+                  page_usage(PageType(i)));
+  }
+  if (!alloc_tracking) {
+    return;
+  }
+  expose_header(out, "spv_heap_bytes", "gauge",
+                "Live heap bytes allocated under each tag");
+  for (size_t i = 0; i < size_t(HeapTag::NUM_TAGS); i++) {
+    expose_sample(out, "spv_heap_bytes",
+                  std::string("tag=\"") + heap_tag_name(HeapTag(i)) + '"',
+                  heap_usage(HeapTag(i)));
+  }
+}
+
+}  // namespace spv
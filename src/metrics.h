@@ -0,0 +1,183 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "./fields.h"
+
+namespace spv {
+// Counters, gauges and histograms for the --metrics-port endpoint. Each is
+// a few relaxed atomics, so they can be updated from any thread without a
+// lock, and reading them for a scrape doesn't stop the writers.
+class Counter {
+ public:
+  Counter() : val_(0) {}
+  Counter(const Counter &other) = delete;
+
+  inline void add(uint64_t n = 1) {
+    val_.fetch_add(n, std::memory_order_relaxed);
+  }
+  inline uint64_t value() const { return val_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint64_t> val_;
+};
+
+class Gauge {
+ public:
+  Gauge() : val_(0) {}
+  Gauge(const Gauge &other) = delete;
+
+  inline void set(int64_t val) { val_.store(val, std::memory_order_relaxed); }
+  inline int64_t value() const { return val_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> val_;
+};
+
+// A histogram of durations in nanoseconds, in the style of HdrHistogram:
+// every power of two from min_bits to max_bits is split into sub_buckets
+// linear buckets, so a bucket is never wider than a quarter of its lower
+// bound. Anything shorter goes in the first bucket, anything longer only
+// in the count. Recording is an index computation and two atomic adds.
+class Histogram {
+ public:
+  static const unsigned min_bits = 7;   // 128 ns
+  static const unsigned max_bits = 34;  // about 17 s
+  static const unsigned sub_bits = 2;
+  static const size_t sub_buckets = 1 << sub_bits;
+  static const size_t num_buckets = 1 + (max_bits - min_bits) * sub_buckets;
+
+  Histogram();
+  Histogram(const Histogram &other) = delete;
+
+  inline void record(uint64_t ns) {
+    const size_t i = bucket(ns);
+    if (i < num_buckets) {
+      buckets_[i].fetch_add(1, std::memory_order_relaxed);
+    }
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(ns, std::memory_order_relaxed);
+  }
+
+  inline void record(std::chrono::steady_clock::duration elapsed) {
+    record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+               .count());
+  }
+
+  // Append the histogram in the Prometheus text format, in seconds, with a
+  // cumulative le bucket for each upper bound.
+  void expose(std::string &out, const char *name, const char *help) const;
+
+  // The bucket for ns, i.e. the first whose upper bound is at least ns, or
+  // num_buckets if ns is past the last one.
+  static inline size_t bucket(uint64_t ns) {
+    const uint64_t x = ns ? ns - 1 : 0;
+    if (x < (uint64_t(1) << min_bits)) {
+      return 0;
+    }
+    const unsigned exp = 63 - __builtin_clzll(x);
+    if (exp >= max_bits) {
+      return num_buckets;
+    }
+    const size_t sub = (x >> (exp - sub_bits)) & (sub_buckets - 1);
+    return 1 + (exp - min_bits) * sub_buckets + sub;
+  }
+
+  // the largest value in this bucket, in nanoseconds
+  static uint64_t upper_bound(size_t i);
+
+ private:
+  std::atomic<uint64_t> buckets_[num_buckets];
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_;
+};
+
+// Times a scope into a histogram.
+class ScopedLatency {
+ public:
+  explicit ScopedLatency(Histogram &hist)
+      : hist_(hist), start_(std::chrono::steady_clock::now()) {}
+  ScopedLatency(const ScopedLatency &other) = delete;
+  ~ScopedLatency() { hist_.record(std::chrono::steady_clock::now() - start_); }
+
+ private:
+  Histogram &hist_;
+  const std::chrono::steady_clock::time_point start_;
+};
+
+// Every metric the client keeps. Values that are cheaper to read when
+// scraped, like the connection count, are gauges set by the collector that
+// MetricsServer runs first.
+struct Metrics {
+  static const size_t num_commands = size_t(Command::VERSION) + 1;
+
+  // p2p messages by command, and their bytes on the wire
+  Counter messages_in[num_commands];
+  Counter messages_out[num_commands];
+  Counter bytes_in;
+  Counter bytes_out;
+
+  Histogram decode_time;    // decode_message()
+  Histogram header_insert;  // Chain::put_block_headers()
+  Histogram db_read;        // RocksDB gets
+  Histogram db_write;       // RocksDB writes, a whole batch at a time
+  Histogram loop_busy;      // callbacks run per loop iteration, see LoopMonitor
+  Histogram loop_timer_lag;
+
+  Gauge height;
+  Gauge orphans;
+  Gauge outbound;  // connections that finished the handshake
+  Gauge inbound;
+
+  // RocksDB write stalls, and whether writes are stalled now; see
+  // Chain::write_stalled()
+  Counter db_write_stalls;
+  Gauge db_write_stalled;
+
+  // writes by the ChainWriter threads, and the batches grouped into them
+  Counter db_group_commits;
+  Counter db_group_batches;
+
+  // Append every metric in the Prometheus text format.
+  void expose(std::string &out) const;
+};
+
+// the process wide metrics
+Metrics &metrics();
+
+// Append the HELP and TYPE lines of a metric, or a sample of one, in the
+// Prometheus text format. labels is e.g. peer="1.2.3.4:18333", or empty.
+void expose_header(std::string &out, const char *name, const char *type,
+                   const char *help);
+void expose_sample(std::string &out, const char *name,
+                   const std::string &labels, double val);
+
+// Append spv_memory_bytes, for the counted tags and then the measured
+// subsystems, and spv_heap_bytes with allocation tracking, in the
+// Prometheus text format.
+void expose_memory(
+    std::string &out,
+    const std::vector<std::pair<const char *, size_t> > &measured);
+}  // namespace spv
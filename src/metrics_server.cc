@@ -0,0 +1,135 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./metrics_server.h"
+
+#include <cstring>
+
+#include "./logging.h"
+
+namespace spv {
+MODULE_LOGGER
+
+// limits on scrapers, which shouldn't need more than one connection each
+static const size_t max_clients = 16;
+static const size_t max_request_size = 8192;
+static const std::chrono::seconds request_timeout{10};
+
+MetricsServer::MetricsServer(std::shared_ptr<uvw::Loop> loop,
+                             Collector &&collect)
+    : loop_(loop), collect_(std::move(collect)), clients_(new size_t(0)) {}
+
+void MetricsServer::listen(const std::string &host, uint16_t port) {
+  listener_ = loop_->resource<uvw::TcpHandle>();
+  listener_->on<uvw::ErrorEvent>([](const auto &exc, auto &) {
+    log->error("error serving metrics: {}", exc.what());
+  });
+  listener_->on<uvw::ListenEvent>(
+      [this](const auto &, auto &server) { accept(server); });
+  if (host.find(':') != std::string::npos) {
+    listener_->bind<uvw::IPv6>(host, port);
+  } else {
+    listener_->bind<uvw::IPv4>(host, port);
+  }
+  listener_->listen();
+  log->info("serving metrics on {} port {}", host, port);
+}
+
+void MetricsServer::close() {
+  if (listener_) {
+    listener_->close();
+    listener_.reset();
+  }
+}
+
+void MetricsServer::accept(uvw::TcpHandle &server) {
+  auto tcp = loop_->resource<uvw::TcpHandle>();
+  server.accept(*tcp);
+  if (*clients_ >= max_clients) {
+    tcp->close();
+    return;
+  }
+  ++*clients_;
+
+  // The handles only refer to each other weakly; the loop keeps them alive
+  // until they're closed.
+  auto timer = loop_->resource<uvw::TimerHandle>();
+  std::weak_ptr<uvw::TcpHandle> weak_tcp = tcp;
+  timer->once<uvw::TimerEvent>([weak_tcp](const auto &, auto &timer) {
+    timer.close();
+    if (auto tcp = weak_tcp.lock()) {
+      tcp->close();
+    }
+  });
+  timer->start(request_timeout, std::chrono::seconds(0));
+
+  std::weak_ptr<uvw::TimerHandle> weak_timer = timer;
+  std::shared_ptr<size_t> clients = clients_;
+  tcp->once<uvw::CloseEvent>([weak_timer, clients](const auto &, auto &) {
+    --*clients;
+    if (auto timer = weak_timer.lock()) {
+      timer->close();
+    }
+  });
+  tcp->once<uvw::ErrorEvent>([](const auto &, auto &tcp) { tcp.close(); });
+  tcp->once<uvw::EndEvent>([](const auto &, auto &tcp) { tcp.close(); });
+
+  // Read up to the end of the request head; a body, if any, is ignored.
+  auto request = std::make_shared<std::string>();
+  tcp->on<uvw::DataEvent>([this, request](const auto &data, auto &tcp) {
+    if (request->find("\r\n\r\n") != std::string::npos) {
+      return;  // already answered
+    }
+    request->append(data.data.get(), data.length);
+    if (request->find("\r\n\r\n") == std::string::npos) {
+      if (request->size() > max_request_size) {
+        tcp.close();
+      }
+      return;
+    }
+    const std::string response = respond(*request);
+    std::unique_ptr<char[]> buf(new char[response.size()]);
+    std::memcpy(buf.get(), response.data(), response.size());
+    tcp.write(std::move(buf), response.size());
+    tcp.template once<uvw::ShutdownEvent>(
+        [](const auto &, auto &tcp) { tcp.close(); });
+    tcp.shutdown();
+  });
+  tcp->read();
+}
+
+std::string MetricsServer::respond(const std::string &request) {
+  const std::string line = request.substr(0, request.find("\r\n"));
+  const size_t path_end = line.find(' ', 4);
+  const std::string path = line.compare(0, 4, "GET ") == 0
+                               ? line.substr(4, path_end - 4)
+                               : std::string();
+  if (path != "/metrics" && path.compare(0, 9, "/metrics?") != 0) {
+    static const char not_found[] = "not found\n";
+    return "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\n"
+           "Content-Length: " +
+           std::to_string(sizeof not_found - 1) +
+           "\r\nConnection: close\r\n\r\n" + not_found;
+  }
+
+  std::string body;
+  collect_(body);
+  metrics().expose(body);
+  return "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+         "Content-Length: " +
+         std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+}
+}  // namespace spv
@@ -0,0 +1,59 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "./metrics.h"
+#include "./uvw.h"
+
+namespace spv {
+// Serves metrics() to Prometheus over HTTP, on the client's loop. GET
+// /metrics gets the text format and anything else a 404; every response
+// closes its connection. There's no more to HTTP than that, so it should
+// only listen on an address that scrapers can reach.
+class MetricsServer {
+ public:
+  // Runs on each scrape before metrics() is read, to set the gauges that
+  // are read when scraped, and to append any metrics of its own.
+  typedef std::function<void(std::string &out)> Collector;
+
+  MetricsServer(std::shared_ptr<uvw::Loop> loop, Collector &&collect);
+  MetricsServer(const MetricsServer &other) = delete;
+  ~MetricsServer() { close(); }
+
+  void listen(const std::string &host, uint16_t port);
+
+  // stop listening; requests being answered still finish
+  void close();
+
+ private:
+  std::shared_ptr<uvw::Loop> loop_;
+  Collector collect_;
+  std::shared_ptr<uvw::TcpHandle> listener_;
+  std::shared_ptr<size_t> clients_;  // open connections, shared with them
+
+  void accept(uvw::TcpHandle &server);
+
+  // the response to a complete request head
+  std::string respond(const std::string &request);
+};
+}  // namespace spv
@@ -0,0 +1,275 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./mmr.h"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "./logging.h"
+#include "./sha256.h"
+
+namespace spv {
+MODULE_LOGGER
+
+static const char mmr_magic[8] = {'S', 'P', 'V', 'M', 'M', 'R', '0', '1'};
+
+// The file starts with a header of the magic, the number of leaves as of
+// the last sync() and a clean flag, then the nodes 32 bytes apiece.
+static const size_t header_size = 32;
+static const size_t leaves_offset = 8;
+static const size_t clean_offset = 16;
+
+static inline off_t node_offset(size_t pos) {
+  return header_size + pos * sizeof(hash_t);
+}
+
+// the number of nodes in a range with n leaves
+static inline size_t mmr_size(size_t n) {
+  return 2 * n - __builtin_popcountll(n);
+}
+
+static inline hash_t hash_pair(const hash_t &left, const hash_t &right) {
+  uint8_t buf[64];
+  std::memcpy(buf, left.data(), 32);
+  std::memcpy(buf + 32, right.data(), 32);
+  hash_t out;
+  sha256::double_hash64(buf, out.data());
+  return out;
+}
+
+// the heights of the peaks with n leaves, from left to right
+static std::vector<size_t> peak_heights(size_t n) {
+  std::vector<size_t> heights;
+  for (int b = 63; b >= 0; b--) {
+    if ((n >> b) & 1) {
+      heights.push_back(b);
+    }
+  }
+  return heights;
+}
+
+static hash_t bag(const std::vector<hash_t> &peaks) {
+  if (peaks.empty()) {
+    return empty_hash;
+  }
+  hash_t root = peaks.back();
+  for (size_t k = peaks.size() - 1; k-- > 0;) {
+    root = hash_pair(peaks[k], root);
+  }
+  return root;
+}
+
+HeaderMmr::HeaderMmr(const std::string &path)
+    : fd_(-1), leaves_(0), nodes_(0), clean_(false) {
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd_ == -1) {
+    log->error("failed to open header mmr {}: {}", path, strerror(errno));
+    assert(false);
+  }
+  struct stat st;
+  assert(fstat(fd_, &st) == 0);
+  char header[header_size];
+  uint64_t leaves = 0;
+  bool ok = st.st_size >= off_t(header_size) &&
+            pread(fd_, header, sizeof header, 0) == sizeof header &&
+            std::memcmp(header, mmr_magic, sizeof mmr_magic) == 0 &&
+            header[clean_offset] == 1;
+  if (ok) {
+    std::memcpy(&leaves, header + leaves_offset, sizeof leaves);
+    leaves = le64toh(leaves);
+    ok = st.st_size >= node_offset(mmr_size(leaves));
+  }
+  if (!ok) {
+    if (st.st_size > 0) {
+      log->warn("header mmr {} wasn't closed cleanly, rebuilding it", path);
+    }
+    std::memset(header, 0, sizeof header);
+    std::memcpy(header, mmr_magic, sizeof mmr_magic);
+    assert(ftruncate(fd_, header_size) == 0);
+    assert(pwrite(fd_, header, sizeof header, 0) == sizeof header);
+    leaves = 0;
+  }
+  clean_ = ok;
+  leaves_ = leaves;
+  nodes_ = mmr_size(leaves_);
+  assert(ftruncate(fd_, node_offset(nodes_)) == 0);
+  size_t pos = 0;
+  for (size_t height : peak_heights(leaves_)) {
+    pos += (size_t(2) << height) - 1;
+    peaks_.push_back({node(pos - 1), height});
+  }
+  log->info("opened header mmr {} with {} leaves", path, leaves_);
+}
+
+HeaderMmr::~HeaderMmr() {
+  if (fd_ != -1) {
+    sync();
+    close(fd_);
+  }
+}
+
+hash_t HeaderMmr::node(size_t pos) const {
+  assert(pos < nodes_);
+  hash_t hash;
+  assert(pread(fd_, hash.data(), hash.size(), node_offset(pos)) ==
+         ssize_t(hash.size()));
+  return hash;
+}
+
+void HeaderMmr::put(size_t pos, const hash_t &hash) {
+  if (clean_) {
+    mark_clean(false);
+  }
+  assert(pwrite(fd_, hash.data(), hash.size(), node_offset(pos)) ==
+         ssize_t(hash.size()));
+}
+
+void HeaderMmr::mark_clean(bool clean) {
+  if (clean) {
+    const uint64_t leaves = htole64(leaves_);
+    assert(pwrite(fd_, &leaves, sizeof leaves, leaves_offset) ==
+           sizeof leaves);
+  }
+  // The flag has to be on disk before the nodes it covers change, and
+  // after the ones it vouches for.
+  assert(fdatasync(fd_) == 0);
+  const char flag = clean;
+  assert(pwrite(fd_, &flag, 1, clean_offset) == 1);
+  assert(fdatasync(fd_) == 0);
+  clean_ = clean;
+}
+
+hash_t HeaderMmr::leaf(size_t i) const {
+  assert(i < leaves_);
+  return node(mmr_size(i));
+}
+
+hash_t HeaderMmr::root() const {
+  std::vector<hash_t> peaks;
+  for (const Peak &peak : peaks_) {
+    peaks.push_back(peak.hash);
+  }
+  return bag(peaks);
+}
+
+void HeaderMmr::append(const hash_t &leaf) {
+  put(nodes_++, leaf);
+  peaks_.push_back({leaf, 0});
+  while (peaks_.size() >= 2 &&
+         peaks_.back().height == peaks_[peaks_.size() - 2].height) {
+    const Peak right = peaks_.back();
+    peaks_.pop_back();
+    Peak &left = peaks_.back();
+    left.hash = hash_pair(left.hash, right.hash);
+    left.height++;
+    put(nodes_++, left.hash);
+  }
+  leaves_++;
+}
+
+void HeaderMmr::truncate(size_t n) {
+  if (n >= leaves_) {
+    return;
+  }
+  if (clean_) {
+    mark_clean(false);
+  }
+  leaves_ = n;
+  nodes_ = mmr_size(n);
+  assert(ftruncate(fd_, node_offset(nodes_)) == 0);
+  peaks_.clear();
+  size_t pos = 0;
+  for (size_t height : peak_heights(n)) {
+    pos += (size_t(2) << height) - 1;
+    peaks_.push_back({node(pos - 1), height});
+  }
+}
+
+std::vector<hash_t> HeaderMmr::prove(size_t i) const {
+  assert(i < leaves_);
+  std::vector<hash_t> proof;
+  size_t first_leaf = 0, first_node = 0, own = 0;
+  for (; own < peaks_.size(); own++) {
+    const size_t height = peaks_[own].height;
+    if (i < first_leaf + (size_t(1) << height)) {
+      break;
+    }
+    first_leaf += size_t(1) << height;
+    first_node += (size_t(2) << height) - 1;
+  }
+  // down from the peak, picking up the sibling at each level
+  size_t j = i - first_leaf, off = first_node;
+  for (size_t height = peaks_[own].height; height > 0; height--) {
+    const size_t half = (size_t(1) << height) - 1;  // nodes in a child
+    const size_t left = off + half - 1, right = off + 2 * half - 1;
+    if (j < (size_t(1) << (height - 1))) {
+      proof.push_back(node(right));
+    } else {
+      proof.push_back(node(left));
+      off += half;
+      j -= size_t(1) << (height - 1);
+    }
+  }
+  std::reverse(proof.begin(), proof.end());
+  for (size_t k = 0; k < peaks_.size(); k++) {
+    if (k != own) {
+      proof.push_back(peaks_[k].hash);
+    }
+  }
+  return proof;
+}
+
+bool HeaderMmr::verify(const hash_t &leaf, size_t i, size_t n,
+                       const std::vector<hash_t> &proof, const hash_t &root) {
+  if (i >= n) {
+    return false;
+  }
+  const std::vector<size_t> heights = peak_heights(n);
+  size_t first_leaf = 0, own = 0;
+  for (; own < heights.size(); own++) {
+    if (i < first_leaf + (size_t(1) << heights[own])) {
+      break;
+    }
+    first_leaf += size_t(1) << heights[own];
+  }
+  const size_t height = heights[own];
+  if (proof.size() != height + heights.size() - 1) {
+    return false;
+  }
+  const size_t j = i - first_leaf;
+  hash_t acc = leaf;
+  for (size_t level = 0; level < height; level++) {
+    acc = ((j >> level) & 1) ? hash_pair(proof[level], acc)
+                             : hash_pair(acc, proof[level]);
+  }
+  std::vector<hash_t> peaks(proof.begin() + height, proof.end());
+  peaks.insert(peaks.begin() + own, acc);
+  return bag(peaks) == root;
+}
+
+void HeaderMmr::sync() {
+  if (!clean_) {
+    mark_clean(true);
+  }
+}
+}  // namespace spv
@@ -0,0 +1,87 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "./constants.h"
+
+namespace spv {
+// HeaderMmr is a Merkle Mountain Range over the best chain's block hashes,
+// leaf h being the hash at height h, so that a client holding the root can
+// check that a header is on our chain from a proof of about 2 log n hashes
+// rather than the headers themselves. Each node is SHA256d of its two
+// children's 32 bytes; the leaves are the hashes as spv prints them. The
+// root bags the peaks from right to left: the last peak, then
+// SHA256d(peak || root) for each peak before it.
+//
+// The nodes are kept in a file in postorder, so appending a leaf writes it
+// and its new parents after everything else, and rewinding for a reorg is
+// a truncate. Only the peaks stay in memory. A file that wasn't closed
+// cleanly is started over, since its tail may be torn.
+class HeaderMmr {
+ public:
+  HeaderMmr() = delete;
+  HeaderMmr(const HeaderMmr &other) = delete;
+  explicit HeaderMmr(const std::string &path);
+  ~HeaderMmr();
+
+  // number of leaves
+  inline size_t size() const { return leaves_; }
+
+  // the leaf at index i, which must be below size()
+  hash_t leaf(size_t i) const;
+
+  // the bagged peaks, or empty_hash with no leaves
+  hash_t root() const;
+
+  void append(const hash_t &leaf);
+
+  // keep just the first n leaves
+  void truncate(size_t n);
+
+  // The inclusion proof of leaf i in root(): the siblings from the leaf
+  // up to its peak, then the other peaks from left to right.
+  std::vector<hash_t> prove(size_t i) const;
+
+  // check a proof from prove() for leaf i of n against a root
+  static bool verify(const hash_t &leaf, size_t i, size_t n,
+                     const std::vector<hash_t> &proof, const hash_t &root);
+
+  // write the file back to disk and mark it clean
+  void sync();
+
+ private:
+  struct Peak {
+    hash_t hash;
+    size_t height;  // 0 for a leaf
+  };
+
+  int fd_;
+  size_t leaves_;
+  size_t nodes_;
+  std::vector<Peak> peaks_;
+  bool clean_;  // as marked in the file
+
+  hash_t node(size_t pos) const;
+  void put(size_t pos, const hash_t &hash);
+  void mark_clean(bool clean);
+};
+}  // namespace spv
@@ -0,0 +1,161 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./network.h"
+
+#include <cassert>
+#include <iterator>
+
+namespace spv {
+namespace {
+constexpr uint8_t hex_nibble(char c) {
+  return c >= 'a' ? c - 'a' + 10 : c >= 'A' ? c - 'A' + 10 : c - '0';
+}
+
+// bytes from a hex string, in the order written, at compile time
+template <size_t N>
+constexpr std::array<uint8_t, N> hex(const char (&str)[2 * N + 1]) {
+  std::array<uint8_t, N> out{};
+  for (size_t i = 0; i < N; i++) {
+    out[i] = hex_nibble(str[2 * i]) << 4 | hex_nibble(str[2 * i + 1]);
+  }
+  return out;
+}
+
+constexpr hash_t h(const char (&str)[65]) { return hex<32>(str); }
+
+// Chain parameters, from Bitcoin Core's chainparams.cpp. Hashes are in
+// display order, like hash_t; headers are in the wire encoding.
+
+// The checkpoints, main_checkpoints and so on, generated from the files in
+// checkpoints/ by scripts/gen_checkpoints.py, which sorts them.
+#include "./checkpoints.inc"
+
+template <size_t N>
+constexpr bool ascending(const Checkpoint (&checkpoints)[N]) {
+  for (size_t i = 1; i < N; i++) {
+    if (checkpoints[i - 1].height >= checkpoints[i].height) {
+      return false;
+    }
+  }
+  return true;
+}
+static_assert(ascending(main_checkpoints) && ascending(testnet_checkpoints),
+              "checkpoints out of order");
+
+constexpr const char *main_seeds[] = {
+    "seed.bitcoin.sipa.be",          "dnsseed.bluematt.me",
+    "dnsseed.bitcoin.dashjr.org",    "seed.bitcoinstats.com",
+    "seed.bitcoin.jonasschnelli.ch", "seed.btc.petertodd.org",
+};
+
+constexpr const char *testnet_seeds[] = {
+    "testnet-seed.bitcoin.jonasschnelli.ch", "seed.tbtc.petertodd.org",
+    "testnet-seed.bluematt.me",
+};
+
+constexpr const char *signet_seeds[] = {
+    "seed.signet.bitcoin.sprovoost.nl", "seed.signet.achownodes.xyz",
+};
+
+constexpr NetworkParams main_params{
+    Network::MAIN,
+    "main",
+    ".spv-main",
+    0xd9b4bef9,
+    8333,
+    hex<BLOCK_HEADER_SIZE>(
+        "0100000000000000000000000000000000000000000000000000000000000000000000"
+        "003ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa4b1e5e4a29ab"
+        "5f49ffff001d1dac2b7c"),
+    h("000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f"),
+    0x1d00ffff,
+    false,
+    main_checkpoints,
+    std::size(main_checkpoints),
+    main_seeds,
+    std::size(main_seeds),
+};
+
+constexpr NetworkParams testnet_params{
+    Network::TESTNET,
+    "testnet",
+    ".spv",
+    0x0709110b,
+    18333,
+    hex<BLOCK_HEADER_SIZE>(
+        "0100000000000000000000000000000000000000000000000000000000000000000000"
+        "003ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa4b1e5e4adae5"
+        "494dffff001d1aa4ae18"),
+    h("000000000933ea01ad0ee984209779baaec3ced90fa3f408719526f8d77f4943"),
+    0x1d00ffff,
+    true,
+    testnet_checkpoints,
+    std::size(testnet_checkpoints),
+    testnet_seeds,
+    std::size(testnet_seeds),
+};
+
+constexpr NetworkParams signet_params{
+    Network::SIGNET,
+    "signet",
+    ".spv-signet",
+    0x40cf030a,
+    38333,
+    hex<BLOCK_HEADER_SIZE>(
+        "0100000000000000000000000000000000000000000000000000000000000000000000"
+        "003ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa4b1e5e4a008f"
+        "4d5fae77031e8ad22203"),
+    h("00000008819873e925422c1ff0f99f7cc9bbb232af63a077a480a3633bee1ef6"),
+    0x1e0377ae,
+    false,
+    nullptr,
+    0,
+    signet_seeds,
+    std::size(signet_seeds),
+};
+
+constexpr const NetworkParams *all_networks[] = {&main_params, &testnet_params,
+                                                 &signet_params};
+}  // namespace
+
+thread_local const NetworkParams *selected_network = &testnet_params;
+
+static_assert(std::size(all_networks) == NETWORK_COUNT,
+              "every network needs parameters");
+
+const NetworkParams &network_params(Network net) {
+  for (const NetworkParams *params : all_networks) {
+    if (params->id == net) {
+      return *params;
+    }
+  }
+  assert(false);
+  return testnet_params;
+}
+
+void select_network(Network net) { selected_network = &network_params(net); }
+
+bool find_network(const std::string &name, Network &net) {
+  for (const NetworkParams *params : all_networks) {
+    if (name == params->name) {
+      net = params->id;
+      return true;
+    }
+  }
+  return false;
+}
+}  // namespace spv
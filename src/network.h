@@ -0,0 +1,101 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "./constants.h"
+
+namespace spv {
+enum class Network {
+  MAIN,
+  TESTNET,  // testnet3
+  SIGNET,   // the default signet
+};
+
+static const size_t NETWORK_COUNT = 3;
+
+// a known block on a network's best chain
+struct Checkpoint {
+  size_t height;
+  hash_t hash;
+};
+
+// Everything that differs between the networks spv can sync. Each network's
+// table is a constexpr in network.cc. A thread selects one of them, and
+// network() is just a load of a thread-local pointer to it, so nothing on the
+// message or header paths branches on which network it is. Several clients
+// can follow different networks in one process as long as each runs on a
+// thread of its own; work they hand to other threads carries the network
+// along in a NetworkScope.
+struct NetworkParams {
+  Network id;
+  const char *name;     // as given to --network
+  const char *datadir;  // the default --data-dir
+  uint32_t magic;       // message start bytes, read as a little-endian word
+  uint16_t port;
+
+  std::array<uint8_t, BLOCK_HEADER_SIZE> genesis_header;  // wire encoding
+  hash_t genesis_hash;
+
+  // nBits of the easiest target a header may have
+  uint32_t pow_limit;
+
+  // Testnet's rule that a header more than twice the target spacing after
+  // its parent may have the proof-of-work limit's difficulty.
+  bool min_difficulty_blocks;
+
+  const Checkpoint *checkpoints;  // by height
+  size_t checkpoint_count;
+
+  const char *const *seeds;  // DNS seeds
+  size_t seed_count;
+};
+
+extern thread_local const NetworkParams *selected_network;
+
+// the parameters of this thread's network, testnet unless select_network()
+// was called
+inline const NetworkParams &network() { return *selected_network; }
+
+// the parameters of any network
+const NetworkParams &network_params(Network net);
+
+// Make this the network for everything else on this thread. This has to
+// happen before the thread opens a chain or first uses the checkpoints.
+void select_network(Network net);
+
+// Select a network on this thread while in scope, e.g. in a job on the
+// Scheduler task that checks proof of work for a client.
+class NetworkScope {
+ public:
+  explicit NetworkScope(const NetworkParams &net) : saved_(selected_network) {
+    selected_network = &net;
+  }
+  NetworkScope(const NetworkScope &other) = delete;
+  ~NetworkScope() { selected_network = saved_; }
+
+ private:
+  const NetworkParams *saved_;
+};
+
+// Look up a network by name, returning false if there's no such network.
+bool find_network(const std::string &name, Network &net);
+}  // namespace spv
@@ -0,0 +1,91 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./orphan.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "./logging.h"
+
+namespace spv {
+MODULE_LOGGER
+
+bool OrphanPool::add(const BlockHeader &hdr) {
+  if (orphans_.contains(hdr.block_hash)) {
+    return false;
+  }
+  while (orphans_.size() >= max_size_) {
+    evict();
+  }
+  if (order_.size() >= 2 * max_size_) {
+    // drop the hashes of orphans that have already been taken
+    order_.erase(std::remove_if(order_.begin(), order_.end(),
+                                [this](const hash_t &hash) {
+                                  return !orphans_.contains(hash);
+                                }),
+                 order_.end());
+  }
+  orphans_.emplace(hdr.block_hash, hdr);
+  children_[hdr.prev_block].push_back(hdr.block_hash);
+  order_.push_back(hdr.block_hash);
+  return true;
+}
+
+std::vector<BlockHeader> OrphanPool::take_children(const hash_t &parent) {
+  std::vector<BlockHeader> out;
+  const std::vector<hash_t> *children = children_.find(parent);
+  if (children == nullptr) {
+    return out;
+  }
+  out.reserve(children->size());
+  for (const auto &hash : *children) {
+    const BlockHeader *hdr = orphans_.find(hash);
+    assert(hdr != nullptr);
+    out.push_back(*hdr);
+  }
+  for (const auto &hdr : out) {
+    orphans_.erase(hdr.block_hash);
+  }
+  children_.erase(parent);
+  return out;
+}
+
+void OrphanPool::evict() {
+  while (!order_.empty()) {
+    const hash_t hash = order_.front();
+    order_.pop_front();
+    const BlockHeader *hdr = orphans_.find(hash);
+    if (hdr != nullptr) {
+      LOG_DEBUG(log, "orphan pool is full, evicting {}", *hdr);
+      unlink(*hdr);
+      orphans_.erase(hash);
+      return;
+    }
+  }
+}
+
+void OrphanPool::unlink(const BlockHeader &hdr) {
+  std::vector<hash_t> *children = children_.find(hdr.prev_block);
+  assert(children != nullptr);
+  children->erase(
+      std::remove(children->begin(), children->end(), hdr.block_hash),
+      children->end());
+  if (children->empty()) {
+    children_.erase(hdr.prev_block);
+  }
+}
+}  // namespace spv
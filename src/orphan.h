@@ -0,0 +1,76 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+#include "./constants.h"
+#include "./fields.h"
+#include "./hashmap.h"
+
+namespace spv {
+// OrphanPool holds headers whose parent isn't known yet, indexed by the
+// parent's hash so that every child of a block is found with one lookup.
+// The pool is bounded: once it's full the oldest orphan is evicted. Orphans
+// are only kept in memory, since they're cheap to download again.
+class OrphanPool {
+ public:
+  explicit OrphanPool(size_t max_size = 10 * MAX_HEADERS_RESULTS)
+      : max_size_(max_size) {}
+  OrphanPool(const OrphanPool &other) = delete;
+
+  inline size_t size() const { return orphans_.size(); }
+  inline bool empty() const { return orphans_.empty(); }
+
+  // a smaller pool evicts down to its size as orphans are added
+  inline void set_max_size(size_t max_size) { max_size_ = max_size; }
+
+  // roughly; each orphan is in one list of children and once in order_
+  inline size_t memory_usage() const {
+    return orphans_.memory_usage() + children_.memory_usage() +
+           orphans_.size() * sizeof(hash_t) + order_.size() * sizeof(hash_t);
+  }
+
+  // is this block (by its own hash) in the pool?
+  inline bool contains(const hash_t &hash) const {
+    return orphans_.contains(hash);
+  }
+
+  // add an orphan; returns false if it was already in the pool
+  bool add(const BlockHeader &hdr);
+
+  // remove and return every orphan whose parent has this hash
+  std::vector<BlockHeader> take_children(const hash_t &parent);
+
+ private:
+  size_t max_size_;
+  FlatHashMap<hash_t, BlockHeader> orphans_;             // by block hash
+  FlatHashMap<hash_t, std::vector<hash_t> > children_;  // by parent hash
+
+  // Block hashes in the order they were added, for eviction. This can also
+  // have hashes that were already taken; they're skipped.
+  std::deque<hash_t> order_;
+
+  // remove the oldest orphan
+  void evict();
+
+  // remove an orphan from its parent's list of children
+  void unlink(const BlockHeader &hdr);
+};
+}  // namespace spv
@@ -25,22 +25,37 @@
 namespace spv {
 
 struct Peer {
-  uint32_t nonce;
-  uint32_t services;
+  uint64_t nonce;
+  uint64_t services;  // as in its version message, all 64 bits
   uint32_t version;
+  uint32_t start_height;  // the height of the peer's chain when it connected
+  int64_t time_offset;    // its clock minus ours, in seconds, per its version
   std::string user_agent;
   Addr addr;
   time_point time;
 
-  Peer() : nonce(0), services(0), version(0) {}
+  Peer()
+      : nonce(0), services(0), version(0), start_height(0), time_offset(0) {}
   explicit Peer(const Addr& addr)
-      : nonce(0), services(0), version(0), addr(addr) {}
-  Peer(uint32_t n, uint32_t s, uint32_t v, const std::string& ua)
-      : nonce(n), services(s), version(v), user_agent(ua) {}
+      : nonce(0),
+        services(0),
+        version(0),
+        start_height(0),
+        time_offset(0),
+        addr(addr) {}
+  Peer(uint64_t n, uint64_t s, uint32_t v, const std::string& ua)
+      : nonce(n),
+        services(s),
+        version(v),
+        start_height(0),
+        time_offset(0),
+        user_agent(ua) {}
   Peer(const Peer& other)
       : nonce(other.nonce),
         services(other.services),
         version(other.version),
+        start_height(other.start_height),
+        time_offset(other.time_offset),
         user_agent(other.user_agent),
         addr(other.addr),
         time(other.time) {}
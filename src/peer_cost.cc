@@ -0,0 +1,77 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./peer_cost.h"
+
+#include <cstdio>
+
+namespace spv {
+uint64_t PeerCost::total_in() const {
+  uint64_t total = 0;
+  for (uint64_t bytes : bytes_in) {
+    total += bytes;
+  }
+  return total;
+}
+
+uint64_t PeerCost::total_out() const {
+  uint64_t total = 0;
+  for (uint64_t bytes : bytes_out) {
+    total += bytes;
+  }
+  return total;
+}
+
+double PeerCost::cost() const {
+  const double spent = cpu_ns / 1e6 + total_in() / 1024.0;
+  return spent / (1 + blocks + headers / 2000.0);
+}
+
+static void commands_json(std::string &out, const uint64_t *bytes) {
+  bool first = true;
+  out += '{';
+  for (size_t i = 0; i < PeerCost::num_commands; i++) {
+    if (bytes[i]) {
+      if (!first) {
+        out += ',';
+      }
+      first = false;
+      out += '"';
+      out += command_name(Command(i));
+      out += "\":";
+      out += std::to_string(bytes[i]);
+    }
+  }
+  out += '}';
+}
+
+void PeerCost::json(std::string &out) const {
+  char buf[64];
+  out += "\"bytes_recv\":" + std::to_string(total_in()) +
+         ",\"bytes_sent\":" + std::to_string(total_out()) +
+         ",\"bytes_recv_per_msg\":";
+  commands_json(out, bytes_in);
+  out += ",\"bytes_sent_per_msg\":";
+  commands_json(out, bytes_out);
+  std::snprintf(buf, sizeof buf, ",\"cpu_seconds\":%.6f", cpu_ns / 1e9);
+  out += buf;
+  out += ",\"useful_headers\":" + std::to_string(headers) +
+         ",\"useful_blocks\":" + std::to_string(blocks);
+  std::snprintf(buf, sizeof buf, ",\"cost\":%.3f", cost());
+  out += buf;
+}
+}  // namespace spv
@@ -0,0 +1,68 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "./cpu_time.h"
+#include "./fields.h"
+
+namespace spv {
+// What a peer has cost us, in bytes by command and in CPU time spent
+// decoding and handling its messages, against the useful headers and
+// blocks it gave back. Reported per peer like getpeerinfo, and used to
+// pick the peers to keep.
+struct PeerCost {
+  static const size_t num_commands = size_t(Command::VERSION) + 1;
+
+  uint64_t bytes_in[num_commands];  // whole messages, headers and all
+  uint64_t bytes_out[num_commands];
+  uint64_t cpu_ns;   // of the loop thread, in read_message()
+  uint64_t headers;  // that extended our chain
+  uint64_t blocks;   // verified blocks, and the merkle blocks we asked for
+
+  PeerCost() : bytes_in(), bytes_out(), cpu_ns(0), headers(0), blocks(0) {}
+
+  uint64_t total_in() const;
+  uint64_t total_out() const;
+
+  // CPU milliseconds plus KiB received, per block (or 2000 headers, a full
+  // headers message) delivered; a peer that delivered nothing costs
+  // everything it took.
+  double cost() const;
+
+  // Append the cost as members of a JSON object, for the caller to wrap
+  // with the peer's own, with the bytes of each command that has any.
+  void json(std::string &out) const;
+};
+
+// Adds the calling thread's CPU time over a scope to a PeerCost.
+class PeerCpuScope {
+ public:
+  explicit PeerCpuScope(PeerCost &cost)
+      : cost_(cost), start_(thread_cpu_ns()) {}
+  PeerCpuScope(const PeerCpuScope &other) = delete;
+  ~PeerCpuScope() { cost_.cpu_ns += thread_cpu_ns() - start_; }
+
+ private:
+  PeerCost &cost_;
+  const uint64_t start_;
+};
+}  // namespace spv
@@ -0,0 +1,51 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./peer_scaler.h"
+
+#include <algorithm>
+
+namespace spv {
+PeerScaler::PeerScaler(size_t floor, size_t ceiling)
+    : floor_(0), ceiling_(0), target_(0), best_(0) {
+  set_bounds(floor, ceiling);
+  target_ = floor_;
+}
+
+void PeerScaler::set_bounds(size_t floor, size_t ceiling) {
+  ceiling_ = std::max<size_t>(ceiling, 1);
+  floor_ = std::min(std::max<size_t>(floor, 1), ceiling_);
+  target_ = std::min(std::max(target_, floor_), ceiling_);
+}
+
+bool PeerScaler::sample(double rate, bool synced, bool hold) {
+  const size_t before = target_;
+  if (synced) {
+    target_ = floor_;
+    best_ = 0;
+    return target_ != before;
+  }
+  if (hold || rate <= 0) {
+    return false;
+  }
+  if (best_ == 0 || rate >= best_ * (1 + GAIN)) {
+    target_ = std::min(target_ + 1, ceiling_);
+    best_ = rate;
+  }
+  return target_ != before;
+}
+}  // namespace spv
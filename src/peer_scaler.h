@@ -0,0 +1,58 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstddef>
+
+namespace spv {
+// How many outbound peers to keep, between a floor and a ceiling. Once the
+// tip is recent that's the floor, enough to hear about blocks and check our
+// tip against. While syncing, each peer answers one getheaders per round
+// trip, so more peers can mean more headers a second, until validation or
+// the database is what holds sync back. So every sample of the sync rate
+// adds a peer if the rate grew by GAIN since the last one was added, and
+// otherwise holds, up to the ceiling.
+class PeerScaler {
+ public:
+  // the fraction a peer has to raise the sync rate by for another to be
+  // worth adding
+  static constexpr double GAIN = 0.05;
+
+  PeerScaler(size_t floor, size_t ceiling);
+  PeerScaler(const PeerScaler &other) = delete;
+
+  inline size_t target() const { return target_; }
+  inline size_t floor() const { return floor_; }
+  inline size_t ceiling() const { return ceiling_; }
+
+  // change the bounds, clamping the target to them
+  void set_bounds(size_t floor, size_t ceiling);
+
+  // Sample the sync rate, in headers a second, with whether the tip is
+  // recent. With hold, e.g. while the database is stalled, the rate says
+  // nothing about the peers and the target stays where it is. Returns
+  // whether the target changed.
+  bool sample(double rate, bool synced, bool hold = false);
+
+ private:
+  size_t floor_;
+  size_t ceiling_;
+  size_t target_;
+  double best_;  // the rate when the last peer was added, or 0
+};
+}  // namespace spv
@@ -17,25 +17,60 @@
 #include "./pow.h"
 
 #include <endian.h>
+#include <algorithm>
 #include <cstring>
 
-#include "picosha2/picosha2.h"
+#include "./cpu_time.h"
+#include "./network.h"
+#include "./profiler.h"
+#include "./sha256.h"
 
 namespace spv {
-hash_t pow_hash(const char *data, size_t sz, bool big_endian) {
-  hash_t hash1, hash2;
-  picosha2::hash256(data, data + sz, hash1);
-  picosha2::hash256(hash1, hash2);
+PROFILE_BOUNDARY hash_t pow_hash(const char *data, size_t sz,
+                                 bool big_endian) {
+  hash_t hash;
+  const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data);
+  if (sz == BLOCK_HEADER_SIZE) {
+    sha256::double_hash80(bytes, hash.data());
+  } else if (sz == 2 * sizeof(hash_t)) {
+    sha256::double_hash64(bytes, hash.data());
+  } else {
+    sha256::double_hash(bytes, sz, hash.data());
+  }
 
   // XXX: technically we should only call this if we know we're on a LE host
   if (__BYTE_ORDER == __LITTLE_ENDIAN && big_endian) {
-    std::reverse(hash2.begin(), hash2.end());
+    reverse_hash(hash.data(), hash.data());
+  }
+
+  return hash;
+}
+
+void pow_hash_batch(const char *base, size_t stride, size_t n, hash_t *out) {
+  static_assert(sizeof(hash_t) == 32, "hash_t must be a sha256 digest");
+  CpuScope cpu(CpuTag::HASHING);
+  sha256::double_hash80_batch(reinterpret_cast<const uint8_t *>(base), stride,
+                              n, reinterpret_cast<uint8_t *>(out));
+  if (__BYTE_ORDER == __LITTLE_ENDIAN) {
+    for (size_t i = 0; i < n; i++) {
+      reverse_hash(out[i].data(), out[i].data());
+    }
   }
+}
 
-  return hash2;
+void merkle_hash_batch(const hash_t *nodes, size_t n, hash_t *out) {
+  CpuScope cpu(CpuTag::HASHING);
+  sha256::double_hash64_batch(reinterpret_cast<const uint8_t *>(nodes), n,
+                              reinterpret_cast<uint8_t *>(out));
 }
 
 void checksum(const char *data, size_t sz, std::array<char, 4> &out) {
+  // verack, getaddr, sendheaders and the like have no payload
+  if (sz == 0) {
+    out = {'\x5d', '\xf6', '\xe0', '\xe2'};
+    return;
+  }
+  CpuScope cpu(CpuTag::HASHING);
   hash_t hash = pow_hash(data, sz);
   std::memcpy(out.data(), hash.data(), 4);
 }
@@ -47,4 +82,100 @@ uint32_t checksum(const char *data, size_t sz) {
   std::memmove(&out, arr.data(), sizeof out);
   return out;
 }
+
+// Headers::checksum is the wire bytes read as a little-endian word
+static inline bool same_checksum(const uint8_t *digest, uint32_t expected) {
+  const uint32_t wire = htole32(expected);
+  return std::memcmp(digest, &wire, sizeof wire) == 0;
+}
+
+bool check_checksum(const char *payload, size_t sz, uint32_t expected) {
+  std::array<char, 4> sum;
+  checksum(payload, sz, sum);
+  return same_checksum(reinterpret_cast<const uint8_t *>(sum.data()),
+                       expected);
+}
+
+bool check_checksum(const sha256::Range *ranges, size_t n,
+                    uint32_t expected) {
+  uint8_t digest[32];
+  CpuScope cpu(CpuTag::HASHING);
+  sha256::double_hash_ranges(ranges, n, digest);
+  return same_checksum(digest, expected);
+}
+
+uint32_t target_to_compact(const uint256 &target) {
+  unsigned size = (target.bits() + 7) / 8;
+  uint32_t compact = size <= 3 ? target.low64() << (8 * (3 - size))
+                               : (target >> (8 * (size - 3))).low64();
+  // the mantissa's top bit is a sign bit, so keep it clear
+  if (compact & 0x00800000) {
+    compact >>= 8;
+    size++;
+  }
+  return compact | (size << 24);
+}
+
+uint32_t retarget(uint32_t bits, int64_t timespan) {
+  timespan = std::max<int64_t>(timespan, TARGET_TIMESPAN / 4);
+  timespan = std::min<int64_t>(timespan, TARGET_TIMESPAN * 4);
+  // a target at any network's limit times 4 * TARGET_TIMESPAN fits
+  const uint256 limit = compact_to_target(network().pow_limit);
+  const uint256 target =
+      compact_to_target(bits) * uint32_t(timespan) / TARGET_TIMESPAN;
+  return target_to_compact(std::min(target, limit));
+}
+
+uint32_t next_difficulty(size_t parent_height, uint32_t parent_bits,
+                         uint32_t parent_time, uint32_t first_bits,
+                         uint32_t first_time, uint32_t timestamp) {
+  if ((parent_height + 1) % RETARGET_INTERVAL == 0) {
+    return retarget(parent_bits, int64_t(parent_time) - first_time);
+  }
+  if (!network().min_difficulty_blocks) {
+    return parent_bits;
+  }
+  if (timestamp > int64_t(parent_time) + 2 * TARGET_SPACING) {
+    return network().pow_limit;
+  }
+  // Core walks back past the minimum difficulty headers to the last one
+  // with the real target, stopping at the start of the interval. Every
+  // header in between that isn't at the minimum had the start's target
+  // itself, so that's what the walk finds.
+  return first_bits;
+}
+
+PROFILE_BOUNDARY bool check_pow(const hash_t &hash, uint32_t bits) {
+  // the network's minimum difficulty, decoded again only if it changes
+  static thread_local uint32_t limit_bits = 0;
+  static thread_local uint256 pow_limit;
+  if (network().pow_limit != limit_bits) {
+    limit_bits = network().pow_limit;
+    pow_limit = compact_to_target(limit_bits);
+  }
+  const uint256 target = compact_to_target(bits);
+  if (target.is_zero() || target > pow_limit) {
+    return false;
+  }
+  return uint256::from_hash(hash) <= target;
+}
+
+uint256 block_work(uint32_t bits) {
+  // Work is 2**256 / (target + 1), which doesn't fit in 256 bits; but it's
+  // equal to (~target / (target + 1)) + 1. Consecutive headers almost always
+  // share their nBits, so the last answer is remembered, though the
+  // division takes only a few limb steps.
+  static thread_local uint32_t last_bits = 0;
+  static thread_local uint256 last_work;
+  if (bits == last_bits) {
+    return last_work;
+  }
+  const uint256 target = compact_to_target(bits);
+  if (target.is_zero()) {
+    return 0;
+  }
+  last_bits = bits;
+  last_work = (~target / (target + 1)) + 1;
+  return last_work;
+}
 }  // namespace spv
@@ -20,9 +20,73 @@
 #include <cstdint>
 
 #include "./constants.h"
+#include "./sha256.h"
+#include "./uint256.h"
 
 namespace spv {
 hash_t pow_hash(const char *data, size_t sz, bool big_endian = false);
+
+// Hash n 80-byte headers at base, base + stride, etc. into out, like
+// pow_hash(hdr, 80, true). Much faster than one at a time on AVX2 hardware.
+void pow_hash_batch(const char *base, size_t stride, size_t n, hash_t *out);
+
+// Hash n pairs of merkle tree nodes, nodes[0] and nodes[1] into out[0] and
+// so on. Unlike the functions above this works in wire byte order: nothing
+// is reversed. out may overlap the start of nodes.
+void merkle_hash_batch(const hash_t *nodes, size_t n, hash_t *out);
 void checksum(const char *data, size_t sz, std::array<char, 4> &out);
 uint32_t checksum(const char *data, size_t sz);
+
+// Whether a payload matches the checksum in its message's header, as decoded
+// into Headers::checksum. The second form checks the n ranges one after
+// another, as in sha256::double_hash_ranges().
+bool check_checksum(const char *payload, size_t sz, uint32_t expected);
+bool check_checksum(const sha256::Range *ranges, size_t n, uint32_t expected);
+
+// expand a compact nBits difficulty into the full 256-bit target
+constexpr uint256 compact_to_target(uint32_t bits) {
+  const uint32_t exponent = bits >> 24;
+  const uint32_t mantissa = bits & 0x007fffff;
+  if (bits & 0x00800000) {
+    return 0;  // negative targets are invalid
+  }
+  if (exponent <= 3) {
+    return uint256(mantissa >> (8 * (3 - exponent)));
+  }
+  if (exponent > 32) {
+    return 0;  // overflow
+  }
+  return uint256(mantissa) << (8 * (exponent - 3));
+}
+
+// compress a target into nBits, rounding down, like GetCompact() in Core
+uint32_t target_to_compact(const uint256 &target);
+
+// Difficulty is retargeted every RETARGET_INTERVAL headers, scaling the
+// target by how long the last interval took compared to TARGET_TIMESPAN.
+// All of the networks here share these.
+static const size_t RETARGET_INTERVAL = 2016;
+static const uint32_t TARGET_SPACING = 10 * 60;
+static const uint32_t TARGET_TIMESPAN = RETARGET_INTERVAL * TARGET_SPACING;
+
+// The nBits of the first header of a new interval, where bits are the last
+// header's and timespan is the time from the first header of the last
+// interval to its last, which may even be negative. Clamped to the
+// network's proof-of-work limit.
+uint32_t retarget(uint32_t bits, int64_t timespan);
+
+// The nBits the header after parent must have, given the parent's height,
+// nBits and time, the nBits and time of the first header of the parent's
+// retarget interval, and the new header's time, which matters on networks
+// with min_difficulty_blocks.
+uint32_t next_difficulty(size_t parent_height, uint32_t parent_bits,
+                         uint32_t parent_time, uint32_t first_bits,
+                         uint32_t first_time, uint32_t timestamp);
+
+// the expected number of hashes needed to find a block with these nBits
+uint256 block_work(uint32_t bits);
+
+// Is this hash at or below the target for these nBits? The target itself
+// must be valid and no easier than the network's proof-of-work limit.
+bool check_pow(const hash_t &hash, uint32_t bits);
 }  // namespace spv
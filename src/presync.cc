@@ -0,0 +1,179 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./presync.h"
+
+#include <algorithm>
+
+#include "./gcs.h"
+#include "./pow.h"
+#include "./util.h"
+
+namespace spv {
+uint256 min_storable_work(const uint256 &tip_work, uint32_t tip_bits) {
+  const uint256 slack = block_work(tip_bits) * PRESYNC_SLACK_BLOCKS;
+  return tip_work > slack ? tip_work - slack : 0;
+}
+
+HeaderPresync::Tip::Tip(const PresyncAnchor &anchor)
+    : hash(anchor.hash),
+      height(anchor.height),
+      bits(anchor.bits),
+      timestamp(anchor.timestamp),
+      first_bits(anchor.first_bits),
+      first_time(anchor.first_time),
+      work(anchor.chainwork) {
+  for (uint32_t time : anchor.times) {
+    window.push(time);
+  }
+}
+
+HeaderPresync::Result HeaderPresync::Tip::extend(const BlockHeader &hdr,
+                                                 int64_t now,
+                                                 const char *&error) {
+  if (hdr.prev_block != hash) {
+    error = "headers don't connect";
+    return Result::DIVERGED;
+  }
+  if (hdr.difficulty != next_difficulty(height, bits, timestamp, first_bits,
+                                        first_time, hdr.timestamp)) {
+    error = "header has the wrong difficulty";
+    return Result::INVALID;
+  }
+  if (hdr.timestamp <= window.median()) {
+    error = "header time isn't after the median time past";
+    return Result::INVALID;
+  }
+  if (hdr.timestamp > now + MAX_FUTURE_BLOCK_TIME) {
+    error = "header time is too far in the future";
+    return Result::INVALID;
+  }
+  hash = hdr.block_hash;
+  height++;
+  bits = hdr.difficulty;
+  timestamp = hdr.timestamp;
+  if (height % RETARGET_INTERVAL == 0) {
+    first_bits = bits;
+    first_time = timestamp;
+  }
+  work += block_work(bits);
+  window.push(timestamp);
+  return Result::OK;
+}
+
+HeaderPresync::HeaderPresync(const PresyncAnchor &anchor,
+                             const uint256 &min_work, int64_t now)
+    : anchor_(anchor),
+      min_work_(min_work),
+      salt_{rand64(), rand64()},
+      offset_(rand64() % PRESYNC_COMMITMENT_PERIOD),
+      phase_(Phase::PRESYNC),
+      restarting_(false),
+      presync_(anchor),
+      redownload_(anchor),
+      checked_(0) {
+  const int64_t span =
+      std::max<int64_t>(now + MAX_FUTURE_BLOCK_TIME - presync_.window.median(),
+                        0);
+  max_commitments_ = 6 * span / PRESYNC_COMMITMENT_PERIOD + 1;
+}
+
+bool HeaderPresync::commitment(const hash_t &hash) const {
+  return siphash24(salt_[0], salt_[1], hash.data(), hash.size()) & 1;
+}
+
+HeaderPresync::Result HeaderPresync::presync(const BlockHeader &hdr,
+                                             int64_t now,
+                                             const char *&error) {
+  const Result result = presync_.extend(hdr, now, error);
+  if (result != Result::OK) {
+    return result;
+  }
+  if (presync_.height % PRESYNC_COMMITMENT_PERIOD == offset_) {
+    if (commitments_.size() == max_commitments_) {
+      error = "more headers than their times allow";
+      return Result::INVALID;
+    }
+    commitments_.push_back(commitment(hdr.block_hash));
+  }
+  if (presync_.work >= min_work_) {
+    // start over from the anchor, storing it this time
+    phase_ = Phase::REDOWNLOAD;
+    buffer_.reserve(PRESYNC_REDOWNLOAD_BUFFER + MAX_HEADERS_RESULTS);
+  }
+  return Result::OK;
+}
+
+HeaderPresync::Result HeaderPresync::redownload(
+    const BlockHeader &hdr, int64_t now, std::vector<BlockHeader> &ready,
+    const char *&error) {
+  const Result result = redownload_.extend(hdr, now, error);
+  if (result != Result::OK) {
+    return result;
+  }
+  if (redownload_.height > presync_.height) {
+    error = "redownloaded headers go past the presynced chain";
+    return Result::DIVERGED;
+  }
+  if (redownload_.height % PRESYNC_COMMITMENT_PERIOD == offset_ &&
+      commitments_[checked_++] != commitment(hdr.block_hash)) {
+    error = "redownloaded headers aren't the presynced chain";
+    return Result::DIVERGED;
+  }
+  buffer_.push_back(hdr);
+  buffer_.back().height = redownload_.height;
+  if (redownload_.work >= min_work_) {
+    // enough work to store the lot
+    ready.insert(ready.end(), buffer_.begin(), buffer_.end());
+    buffer_.clear();
+    phase_ = Phase::DONE;
+  } else if (buffer_.size() > PRESYNC_REDOWNLOAD_BUFFER) {
+    const size_t n = buffer_.size() - PRESYNC_REDOWNLOAD_BUFFER;
+    ready.insert(ready.end(), buffer_.begin(), buffer_.begin() + n);
+    buffer_.erase(buffer_.begin(), buffer_.begin() + n);
+  }
+  return Result::OK;
+}
+
+HeaderPresync::Result HeaderPresync::process(
+    const std::vector<BlockHeader> &hdrs, bool first, int64_t now,
+    std::vector<BlockHeader> &ready, const char *&error) {
+  if (first) {
+    restarting_ = false;
+  }
+  for (size_t i = 0; i < hdrs.size() && !restarting_; i++) {
+    Result result = Result::OK;
+    switch (phase_) {
+      case Phase::PRESYNC:
+        result = presync(hdrs[i], now, error);
+        // the rest of the message is more of phase one, which is over
+        restarting_ = phase_ == Phase::REDOWNLOAD;
+        break;
+      case Phase::REDOWNLOAD:
+        result = redownload(hdrs[i], now, ready, error);
+        break;
+      case Phase::DONE:
+        // past the presynced chain, on a chain with the work to be stored
+        ready.insert(ready.end(), hdrs.begin() + i, hdrs.end());
+        return Result::OK;
+    }
+    if (result != Result::OK) {
+      return result;
+    }
+  }
+  return Result::OK;
+}
+}  // namespace spv
@@ -0,0 +1,149 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "./fields.h"
+#include "./timedata.h"
+#include "./uint256.h"
+
+namespace spv {
+// Headers are only stored once the chain they're on has come within this
+// many blocks' worth of work, at the tip's difficulty, of our tip. Any peer
+// can make up as many forks as it likes from low in the chain, where the
+// difficulty was low, but none that gets this close.
+static const uint32_t PRESYNC_SLACK_BLOCKS = 6;
+
+// the least work a chain needs for its headers to be stored
+uint256 min_storable_work(const uint256 &tip_work, uint32_t tip_bits);
+
+// In phase one a bit is committed for one header in this many.
+static const size_t PRESYNC_COMMITMENT_PERIOD = 600;
+
+// In phase two headers are held back until this many more have matched
+// their commitments, so a chain that differs from the presynced one is
+// caught (all but 2^-24 of the time) before any of it is stored.
+static const size_t PRESYNC_REDOWNLOAD_BUFFER = 24 * PRESYNC_COMMITMENT_PERIOD;
+
+// The header a peer's chain forks from, and what's needed of its ancestors
+// to check the difficulty and times of the headers after it.
+struct PresyncAnchor {
+  hash_t hash;
+  size_t height;
+  uint32_t bits;
+  uint32_t timestamp;
+  uint32_t first_bits;  // of the first header of its retarget interval
+  uint32_t first_time;
+  uint256 chainwork;
+  std::vector<uint32_t> times;  // its own and up to ten before, in order
+};
+
+// Two-phase header sync against one peer, like PRESYNC and REDOWNLOAD in
+// Bitcoin Core, for a chain that doesn't have enough work yet to store any
+// of it. In phase one the peer's headers are checked as they would be by
+// Chain (linked, with the right difficulty and times; the validator has
+// already checked the proof of work), and their work is added up, but all
+// that's kept of them is a bit of a salted hash of one header in every
+// PRESYNC_COMMITMENT_PERIOD. If the chain gets to the work it needs, phase
+// two asks for the same headers again from the anchor, checks each against
+// the commitments, and releases them to be stored, PRESYNC_REDOWNLOAD_BUFFER
+// behind, and all at once when the redownload reaches the presynced work.
+//
+// The commitments are the only state that grows, at a bit per period, and
+// they're capped at what the times allow: the median time past rule lets a
+// chain gain at most six headers a second from the anchor up to the future
+// limit, so a longer one is invalid.
+class HeaderPresync {
+ public:
+  enum class Phase {
+    PRESYNC,
+    REDOWNLOAD,
+    DONE,
+  };
+
+  enum class Result {
+    OK,
+    DIVERGED,  // not the chain we were following, e.g. after a reorg
+    INVALID,   // against the rules
+  };
+
+  // min_work is the work the chain has to get to; now the adjusted time
+  HeaderPresync(const PresyncAnchor &anchor, const uint256 &min_work,
+                int64_t now);
+  HeaderPresync(const HeaderPresync &other) = delete;
+
+  inline Phase phase() const { return phase_; }
+
+  // the hash for the next getheaders to start from
+  inline const hash_t &cursor() const {
+    return phase_ == Phase::PRESYNC ? presync_.hash : redownload_.hash;
+  }
+
+  // height and work of the presynced chain, for logging
+  inline size_t height() const { return presync_.height; }
+  inline const uint256 &work() const { return presync_.work; }
+
+  // Take the next run of the peer's headers, first if it starts a headers
+  // message, appending any released to be stored to ready, followed by
+  // any after the presynced chain once it's done. Anything but OK comes
+  // with the reason, and ends the presync.
+  Result process(const std::vector<BlockHeader> &hdrs, bool first,
+                 int64_t now, std::vector<BlockHeader> &ready,
+                 const char *&error);
+
+ private:
+  // the end of a chain being checked, with enough to check the next header
+  struct Tip {
+    hash_t hash;
+    size_t height;
+    uint32_t bits;
+    uint32_t timestamp;
+    uint32_t first_bits;
+    uint32_t first_time;
+    uint256 work;
+    MedianTime window;
+
+    explicit Tip(const PresyncAnchor &anchor);
+
+    // check hdr against the rules and move on to it
+    Result extend(const BlockHeader &hdr, int64_t now, const char *&error);
+  };
+
+  const PresyncAnchor anchor_;
+  const uint256 min_work_;
+  const uint64_t salt_[2];
+  const size_t offset_;  // of the committed headers' heights in each period
+  size_t max_commitments_;
+
+  Phase phase_;
+  bool restarting_;  // skipping the rest of the message phase one ended in
+  Tip presync_;
+  Tip redownload_;
+  uint256 end_work_;  // what phase one got to
+  std::vector<bool> commitments_;
+  size_t checked_;  // commitments phase two has matched
+  std::vector<BlockHeader> buffer_;
+
+  bool commitment(const hash_t &hash) const;
+  Result presync(const BlockHeader &hdr, int64_t now, const char *&error);
+  Result redownload(const BlockHeader &hdr, int64_t now,
+                    std::vector<BlockHeader> &ready, const char *&error);
+};
+}  // namespace spv
@@ -0,0 +1,197 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./profiler.h"
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+
+#include "./logging.h"
+
+namespace spv {
+MODULE_LOGGER
+
+namespace {
+const int max_depth = 64;
+
+// the first two frames are the handler and the signal trampoline
+const int skip_frames = 2;
+
+struct Sample {
+  int depth;
+  void *pcs[max_depth];
+};
+
+// Written by the handler, which may run on any thread; the array is only
+// replaced while no profile is running.
+std::atomic<bool> active{false};
+std::atomic<int> in_handler{0};
+std::unique_ptr<Sample[]> samples;
+size_t capacity = 0;
+std::atomic<size_t> next_sample{0};
+bool installed = false;
+
+void on_sigprof(int, siginfo_t *, void *) {
+  in_handler.fetch_add(1, std::memory_order_acquire);
+  if (active.load(std::memory_order_relaxed)) {
+    const int saved_errno = errno;
+    const size_t i = next_sample.fetch_add(1, std::memory_order_relaxed);
+    if (i < capacity) {
+      samples[i].depth = backtrace(samples[i].pcs, max_depth);
+    }
+    errno = saved_errno;
+  }
+  in_handler.fetch_sub(1, std::memory_order_release);
+}
+
+// the function pc is in, or the object and offset if it has no symbol
+std::string symbolize(void *pc) {
+  Dl_info info;
+  if (dladdr(pc, &info) == 0) {
+    char buf[32];
+    snprintf(buf, sizeof buf, "%p", pc);
+    return buf;
+  }
+  if (info.dli_sname != nullptr) {
+    int status;
+    char *name = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+    if (status == 0) {
+      std::string out(name);
+      free(name);
+      return out;
+    }
+    return info.dli_sname;
+  }
+  const char *obj = info.dli_fname ? strrchr(info.dli_fname, '/') : nullptr;
+  char buf[32];
+  snprintf(buf, sizeof buf, "+0x%zx",
+           static_cast<size_t>(static_cast<char *>(pc) -
+                               static_cast<char *>(info.dli_fbase)));
+  return std::string(obj ? obj + 1 : "?") + buf;
+}
+}  // namespace
+
+bool profiling() { return active.load(std::memory_order_relaxed); }
+
+bool start_profiling(unsigned hz, size_t max_samples) {
+  if (active || hz == 0 || max_samples == 0) {
+    return false;
+  }
+  // backtrace() loads libgcc the first time, which mustn't happen in the
+  // handler
+  void *warm[1];
+  backtrace(warm, 1);
+
+  samples.reset(new Sample[max_samples]);
+  capacity = max_samples;
+  next_sample = 0;
+  if (!installed) {
+    // The handler stays installed, doing nothing between profiles, so a
+    // late SIGPROF can't take the default action of killing the process.
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof sa);
+    sa.sa_sigaction = on_sigprof;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, nullptr) != 0) {
+      log->error("failed to install the SIGPROF handler: {}", strerror(errno));
+      return false;
+    }
+    installed = true;
+  }
+  active = true;
+
+  struct itimerval timer;
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = std::max(1000000 / hz, 1u);
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+    log->error("failed to start the profiling timer: {}", strerror(errno));
+    active = false;
+    return false;
+  }
+  log->info("profiling at {} Hz, keeping up to {} samples", hz, max_samples);
+  return true;
+}
+
+bool stop_profiling(const std::string &path) {
+  if (!active) {
+    return false;
+  }
+  struct itimerval timer;
+  std::memset(&timer, 0, sizeof timer);
+  setitimer(ITIMER_PROF, &timer, nullptr);
+  active = false;
+  while (in_handler.load(std::memory_order_acquire)) {
+    std::this_thread::yield();
+  }
+
+  // Name the frames of each stack, root first, symbolizing each pc once;
+  // samples at different pcs of the same functions are the same stack.
+  const size_t total = next_sample.load();
+  const size_t n = std::min(total, capacity);
+  std::unordered_map<void *, std::string> names;
+  std::map<std::string, size_t> stacks;
+  for (size_t i = 0; i < n; i++) {
+    const Sample &s = samples[i];
+    std::string stack;
+    for (int j = s.depth - 1; j >= skip_frames; j--) {
+      // return addresses point past the call, except at the leaf
+      void *pc = j == skip_frames ? s.pcs[j]
+                                  : static_cast<char *>(s.pcs[j]) - 1;
+      auto it = names.find(pc);
+      if (it == names.end()) {
+        it = names.emplace(pc, symbolize(pc)).first;
+      }
+      if (!stack.empty()) {
+        stack += ';';
+      }
+      stack += it->second;
+    }
+    if (!stack.empty()) {
+      stacks[stack]++;
+    }
+  }
+  std::ofstream out(path, std::ios::trunc);
+  for (const auto &pr : stacks) {
+    out << pr.first << ' ' << pr.second << '\n';
+  }
+  samples.reset();
+  capacity = 0;
+  out.close();
+  if (!out) {
+    log->error("failed to write profile to {}", path);
+    return false;
+  }
+  log->info("wrote {} samples ({} dropped) to {}", n, total - n, path);
+  return true;
+}
+}  // namespace spv
@@ -0,0 +1,51 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "./config.h"
+
+// With --enable-profiling the hot paths are kept out of line, so they show
+// up as frames of their own in perf and in the profiles below instead of
+// being folded into their callers.
+#ifdef SPV_PROFILING
+#define PROFILE_BOUNDARY __attribute__((noinline))
+#else
+#define PROFILE_BOUNDARY
+#endif
+
+namespace spv {
+// A sampling profiler for running nodes. Between start_profiling() and
+// stop_profiling(), SIGPROF fires hz times per second of CPU time and the
+// handler records the stack of whichever thread was running into a fixed
+// array, dropping samples once it's full. Stacks are only symbolized at the
+// end, and written as folded stacks ("main;f;g 12" lines) for
+// flamegraph.pl or speedscope. Frame pointers (--enable-profiling) make the
+// stacks more reliable, but aren't required.
+
+// Start sampling; returns false if a profile is already running or the
+// timer can't be set.
+bool start_profiling(unsigned hz, size_t max_samples);
+
+bool profiling();
+
+// Stop sampling and write the folded stacks to path. Returns false if no
+// profile was running or the file can't be written.
+bool stop_profiling(const std::string &path);
+}  // namespace spv
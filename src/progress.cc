@@ -0,0 +1,171 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./progress.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+
+#include "./metrics.h"
+
+namespace spv {
+// the rate is sampled over at least this long, and an old sample's weight
+// falls by a factor of e every decay
+static const std::chrono::seconds sample_interval{1};
+static const double decay_seconds = 10.0;
+
+const char *sync_state_name(SyncState state) {
+  switch (state) {
+    case SyncState::WAITING:
+      return "waiting";
+    case SyncState::SYNCING:
+      return "syncing";
+    case SyncState::SYNCED:
+      return "synced";
+  }
+  return "unknown";
+}
+
+SyncProgress::SyncProgress()
+    : height_(0),
+      synced_(false),
+      rate_(0),
+      pending_(0),
+      have_sample_(false) {}
+
+void SyncProgress::connected(const Addr &addr, uint32_t start_height) {
+  PeerStats &stats = peers_[addr];
+  stats.start_height = start_height;
+}
+
+void SyncProgress::disconnected(const Addr &addr) { peers_.erase(addr); }
+
+void SyncProgress::added(const Addr &addr, size_t count, size_t height,
+                         time_point t) {
+  height_ = height;
+  auto it = peers_.find(addr);
+  if (it != peers_.end()) {
+    it->second.headers += count;
+  }
+  if (!have_sample_) {
+    // the rate is measured from the first batch on
+    have_sample_ = true;
+    sampled_ = t;
+    return;
+  }
+  pending_ += count;
+  const auto elapsed = t - sampled_;
+  if (elapsed < sample_interval) {
+    return;
+  }
+  const double secs = std::chrono::duration<double>(elapsed).count();
+  const double sample = pending_ / secs;
+  if (rate_ == 0) {
+    rate_ = sample;
+  } else {
+    const double alpha = 1 - std::exp(-secs / decay_seconds);
+    rate_ += alpha * (sample - rate_);
+  }
+  pending_ = 0;
+  sampled_ = t;
+}
+
+SyncState SyncProgress::state() const {
+  if (synced_) {
+    return SyncState::SYNCED;
+  }
+  return peers_.empty() ? SyncState::WAITING : SyncState::SYNCING;
+}
+
+uint32_t SyncProgress::target() const {
+  uint32_t best = 0;
+  for (const auto &pr : peers_) {
+    best = std::max(best, pr.second.start_height);
+  }
+  return best;
+}
+
+size_t SyncProgress::remaining() const {
+  const size_t best = target();
+  return best > height_ ? best - height_ : 0;
+}
+
+double SyncProgress::eta() const {
+  const size_t left = remaining();
+  if (left == 0) {
+    return 0;
+  }
+  return rate_ > 0 ? left / rate_ : -1;
+}
+
+std::string SyncProgress::json() const {
+  std::ostringstream os;
+  os << "{\"state\":\"" << sync_state_name(state()) << "\",\"height\":"
+     << height_ << ",\"target\":" << target()
+     << ",\"remaining\":" << remaining() << ",\"headers_per_second\":";
+  char buf[32];
+  snprintf(buf, sizeof buf, "%.1f", rate_);
+  os << buf << ",\"eta_seconds\":";
+  const double secs = eta();
+  if (secs < 0) {
+    os << "null";
+  } else {
+    snprintf(buf, sizeof buf, "%.1f", secs);
+    os << buf;
+  }
+  os << ",\"peers\":[";
+  bool first = true;
+  for (const auto &pr : peers_) {
+    os << (first ? "" : ",") << "{\"peer\":\"" << pr.first
+       << "\",\"start_height\":" << pr.second.start_height
+       << ",\"headers\":" << pr.second.headers << '}';
+    first = false;
+  }
+  os << "]}\n";
+  return os.str();
+}
+
+void SyncProgress::expose(std::string &out) const {
+  const SyncState current = state();
+  expose_header(out, "spv_sync_state", "gauge",
+                "1 for the state header sync is in");
+  for (SyncState s :
+       {SyncState::WAITING, SyncState::SYNCING, SyncState::SYNCED}) {
+    expose_sample(out, "spv_sync_state",
+                  std::string("state=\"") + sync_state_name(s) + '"',
+                  s == current);
+  }
+  expose_header(out, "spv_sync_target_height", "gauge",
+                "Longest chain advertised by a connected peer");
+  expose_sample(out, "spv_sync_target_height", "", target());
+  expose_header(out, "spv_sync_headers_per_second", "gauge",
+                "Moving average of headers added per second");
+  expose_sample(out, "spv_sync_headers_per_second", "", rate_);
+  expose_header(out, "spv_sync_eta_seconds", "gauge",
+                "Estimated seconds to reach the target height, or -1");
+  expose_sample(out, "spv_sync_eta_seconds", "", eta());
+  expose_header(out, "spv_peer_headers_total", "counter",
+                "Headers added to the chain from each connected peer");
+  for (const auto &pr : peers_) {
+    std::ostringstream labels;
+    labels << "peer=\"" << pr.first << '"';
+    expose_sample(out, "spv_peer_headers_total", labels.str(),
+                  pr.second.headers);
+  }
+}
+}  // namespace spv
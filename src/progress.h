@@ -0,0 +1,91 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include "./addr.h"
+#include "./util.h"
+
+namespace spv {
+enum class SyncState {
+  WAITING,  // for a peer to say how long its chain is
+  SYNCING,
+  SYNCED,
+};
+
+const char *sync_state_name(SyncState state);
+
+// How far header sync has got and how long the rest should take. The
+// target is the longest chain the connected peers advertised in their
+// version messages, and the rate is an exponentially weighted moving
+// average of headers added per second, sampled at most once a second.
+class SyncProgress {
+ public:
+  struct PeerStats {
+    uint32_t start_height;  // as advertised
+    size_t headers;         // added to the chain from this peer
+  };
+
+  SyncProgress();
+
+  // a peer finished its handshake, advertising this height
+  void connected(const Addr &addr, uint32_t start_height);
+  void disconnected(const Addr &addr);
+
+  inline void set_height(size_t height) { height_ = height; }
+
+  // count headers from addr that were just added, making the chain this high
+  void added(const Addr &addr, size_t count, size_t height, time_point t);
+
+  // Set by the client when it has caught up with its peers, and cleared
+  // when it finds it has fallen behind.
+  inline void set_synced(bool synced) { synced_ = synced; }
+
+  SyncState state() const;
+  inline size_t height() const { return height_; }
+  uint32_t target() const;
+  size_t remaining() const;
+  inline double rate() const { return rate_; }
+
+  // seconds until the target is reached at the current rate, or a negative
+  // number if there's no rate to go by
+  double eta() const;
+
+  inline const std::unordered_map<Addr, PeerStats> &peers() const {
+    return peers_;
+  }
+
+  // the state as a single JSON object, for the status socket
+  std::string json() const;
+
+  // append the sync metrics in the Prometheus text format
+  void expose(std::string &out) const;
+
+ private:
+  std::unordered_map<Addr, PeerStats> peers_;
+  size_t height_;
+  bool synced_;
+  double rate_;  // headers/s, or 0 before the first sample
+  size_t pending_;  // headers added since the last sample
+  time_point sampled_;
+  bool have_sample_;
+};
+}  // namespace spv
@@ -0,0 +1,85 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./proto.h"
+
+#include <endian.h>
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+
+namespace spv {
+namespace {
+enum WireType : uint8_t { VARINT = 0, LENGTH = 2, FIXED32 = 5 };
+
+inline size_t put_varint(uint64_t val, char *out) {
+  size_t n = 0;
+  while (val >= 0x80) {
+    out[n++] = static_cast<char>(val | 0x80);
+    val >>= 7;
+  }
+  out[n++] = static_cast<char>(val);
+  return n;
+}
+
+inline size_t put_tag(unsigned field, WireType type, char *out) {
+  return put_varint((field << 3) | type, out);
+}
+
+inline size_t put_uint(unsigned field, uint64_t val, char *out) {
+  if (val == 0) {
+    return 0;
+  }
+  const size_t n = put_tag(field, VARINT, out);
+  return n + put_varint(val, out + n);
+}
+
+inline size_t put_hash(unsigned field, const hash_t &hash, char *out) {
+  size_t n = put_tag(field, LENGTH, out);
+  n += put_varint(hash.size(), out + n);
+  std::memcpy(out + n, hash.data(), hash.size());
+  return n + hash.size();
+}
+
+inline size_t put_fixed32(unsigned field, uint32_t val, char *out) {
+  if (val == 0) {
+    return 0;
+  }
+  const size_t n = put_tag(field, FIXED32, out);
+  val = htole32(val);
+  std::memcpy(out + n, &val, sizeof val);
+  return n + sizeof val;
+}
+}  // namespace
+
+size_t proto_encode(const BlockHeader &hdr, char *out) {
+  char msg[MAX_PROTO_HEADER_SIZE];
+  size_t n = 0;
+  n += put_uint(1, hdr.version, msg + n);
+  n += put_hash(2, hdr.prev_block, msg + n);
+  n += put_hash(3, hdr.merkle_root, msg + n);
+  n += put_uint(4, hdr.timestamp, msg + n);
+  n += put_uint(5, hdr.difficulty, msg + n);
+  n += put_fixed32(6, hdr.nonce, msg + n);
+  n += put_uint(7, hdr.height, msg + n);
+  n += put_hash(8, hdr.block_hash, msg + n);
+  const size_t prefix = put_varint(n, out);
+  assert(prefix + n <= MAX_PROTO_HEADER_SIZE);
+  std::memcpy(out + prefix, msg, n);
+  return prefix + n;
+}
+}  // namespace spv
@@ -0,0 +1,36 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+
+#include "./fields.h"
+
+namespace spv {
+// The spv.proto BlockHeader message, encoded by hand so that exporting
+// doesn't need libprotobuf; anything generated from spv.proto can read it.
+// Hashes are in display order, as spv logs them, and fields that are zero
+// are left out, as proto3 encoders do.
+
+// the most proto_encode() can write, including the length prefix
+static const size_t MAX_PROTO_HEADER_SIZE = 160;
+
+// Write hdr to out as a length-delimited message: a varint of the message's
+// size and then the message, as protobuf's writeDelimitedTo() and
+// parseDelimitedFrom() expect. Returns the number of bytes written.
+size_t proto_encode(const BlockHeader &hdr, char *out);
+}  // namespace spv
@@ -0,0 +1,225 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./query_server.h"
+
+#include <endian.h>
+
+#include <cstring>
+
+#include "./logging.h"
+#include "./unix_socket.h"
+
+namespace spv {
+MODULE_LOGGER
+
+static const size_t max_clients = 64;
+
+// A client that sends requests faster than it reads the answers is
+// disconnected once this much is waiting to be written to it.
+static const size_t max_queued_bytes = 16 << 20;
+
+QueryServer::QueryServer(std::shared_ptr<uvw::Loop> loop, const Chain &chain,
+                         PeerInfo &&peer_info)
+    : loop_(loop),
+      chain_(chain),
+      peer_info_(std::move(peer_info)),
+      clients_(new size_t(0)) {}
+
+bool QueryServer::listen(const std::string &path) {
+  listener_ = listen_unix(*loop_, path, "queries",
+                          [this](uvw::PipeHandle &server) { accept(server); });
+  if (!listener_) {
+    return false;
+  }
+  path_ = path;
+  log->info("serving header queries on {}", path);
+  return true;
+}
+
+void QueryServer::close() { close_unix(listener_, path_); }
+
+static void put_entry(const IndexEntry &entry, bool best, char *out) {
+  out[2] = best;
+  const uint32_t height = htole32(entry.height);
+  std::memcpy(out + 8, &height, sizeof height);
+  std::memcpy(out + 16, entry.hash.data(), entry.hash.size());
+  std::memcpy(out + 48, entry.data.data(), entry.data.size());
+}
+
+void QueryServer::answer(const char *req, std::string &response) const {
+  const size_t start = response.size();
+  response.resize(start + QUERY_RESPONSE_SIZE);
+  char *out = &response[start];
+  const QueryOp op = QueryOp(req[0]);
+  out[1] = req[0];
+  std::memcpy(out + 4, req + 4, sizeof(uint32_t));  // the id
+
+  const IndexEntry *entry = nullptr;
+  bool best = false;
+  switch (op) {
+    case QueryOp::HEADER_AT:
+    case QueryOp::PROOF: {
+      uint32_t height;
+      std::memcpy(&height, req + 8, sizeof height);
+      entry = chain_.best_entry(le32toh(height));
+      best = true;
+      break;
+    }
+    case QueryOp::AT_TIME: {
+      uint32_t time;
+      std::memcpy(&time, req + 8, sizeof time);
+      entry = chain_.best_entry(chain_.height_at_time(le32toh(time)));
+      best = true;
+      break;
+    }
+    case QueryOp::CHAIN_PROOF:
+    case QueryOp::PEER_INFO:
+    case QueryOp::TIP:
+      entry = chain_.best_entry(chain_.height());
+      best = true;
+      break;
+    case QueryOp::HEIGHT_OF:
+    case QueryOp::IN_BEST: {
+      hash_t hash;
+      std::memcpy(hash.data(), req + 8, hash.size());
+      entry = chain_.index_entry(hash);
+      best = entry != nullptr && chain_.on_best_chain(*entry);
+      if (entry == nullptr && op == QueryOp::IN_BEST) {
+        out[0] = char(QueryStatus::OK);
+        return;
+      }
+      break;
+    }
+    default:
+      out[0] = char(QueryStatus::BAD_OP);
+      return;
+  }
+  if (entry == nullptr) {
+    out[0] = char(QueryStatus::NOT_FOUND);
+    return;
+  }
+  if (op == QueryOp::PROOF) {
+    size_t leaves;
+    hash_t root;
+    std::vector<hash_t> proof;
+    if (!chain_.mmr_proof(entry->height, leaves, root, proof)) {
+      out[0] = char(QueryStatus::NOT_FOUND);
+      return;
+    }
+    const uint32_t size = htole32(proof.size());
+    std::memcpy(out + 12, &size, sizeof size);
+    char head[64] = {0};
+    const uint32_t n = htole32(leaves);
+    std::memcpy(head, &n, sizeof n);
+    std::memcpy(head + 32, root.data(), root.size());
+    response.append(head, sizeof head);
+    for (const auto &hash : proof) {
+      response.append(reinterpret_cast<const char *>(hash.data()),
+                      hash.size());
+    }
+    out = &response[start];  // the append may have moved it
+  }
+  if (op == QueryOp::CHAIN_PROOF) {
+    uint32_t samples;
+    std::memcpy(&samples, req + 8, sizeof samples);
+    samples = le32toh(samples);
+    if (samples == 0) {
+      samples = CHAIN_PROOF_SAMPLES;
+    }
+    ChainProof proof;
+    if (samples > MAX_CHAIN_PROOF_SAMPLES ||
+        !chain_.chain_proof(samples, proof)) {
+      out[0] = char(QueryStatus::NOT_FOUND);
+      return;
+    }
+    proof.encode(response);
+    out = &response[start];
+    const size_t bytes = response.size() - start - QUERY_RESPONSE_SIZE;
+    const uint32_t size = htole32(bytes);
+    std::memcpy(out + 12, &size, sizeof size);
+  }
+  if (op == QueryOp::PEER_INFO) {
+    if (!peer_info_) {
+      out[0] = char(QueryStatus::NOT_FOUND);
+      return;
+    }
+    const std::string json = peer_info_();
+    response += json;
+    out = &response[start];
+    const uint32_t size = htole32(json.size());
+    std::memcpy(out + 12, &size, sizeof size);
+  }
+  out[0] = char(QueryStatus::OK);
+  put_entry(*entry, best, out);
+}
+
+void QueryServer::accept(uvw::PipeHandle &server) {
+  auto pipe = loop_->resource<uvw::PipeHandle>();
+  server.accept(*pipe);
+  if (*clients_ >= max_clients) {
+    pipe->close();
+    return;
+  }
+  ++*clients_;
+
+  // a partial request left over from the last read, and the bytes written
+  // but not yet flushed
+  struct State {
+    std::string partial;
+    size_t queued = 0;
+  };
+  auto state = std::make_shared<State>();
+  std::shared_ptr<size_t> clients = clients_;
+  pipe->once<uvw::CloseEvent>([clients](const auto &, auto &) { --*clients; });
+  pipe->once<uvw::ErrorEvent>([](const auto &, auto &pipe) { pipe.close(); });
+  pipe->once<uvw::EndEvent>([](const auto &, auto &pipe) { pipe.close(); });
+  pipe->on<uvw::WriteEvent>([state](const auto &, auto &) {
+    // every write is a whole number of responses
+    state->queued = 0;
+  });
+  pipe->on<uvw::DataEvent>([this, state](const auto &data, auto &pipe) {
+    const char *in = data.data.get();
+    size_t len = data.length;
+    if (!state->partial.empty()) {
+      state->partial.append(in, len);
+      in = state->partial.data();
+      len = state->partial.size();
+    }
+    const size_t n = len / QUERY_REQUEST_SIZE;
+    if (n) {
+      std::string response;
+      response.reserve(n * QUERY_RESPONSE_SIZE);
+      for (size_t i = 0; i < n; i++) {
+        answer(in + i * QUERY_REQUEST_SIZE, response);
+      }
+      if (state->queued + response.size() > max_queued_bytes) {
+        log->warn("closing a query client that isn't reading its answers");
+        pipe.close();
+        return;
+      }
+      const size_t out_size = response.size();
+      std::unique_ptr<char[]> out(new char[out_size]);
+      std::memcpy(out.get(), response.data(), out_size);
+      pipe.write(std::move(out), out_size);
+      state->queued += out_size;
+    }
+    std::string rest(in + n * QUERY_REQUEST_SIZE, len - n * QUERY_REQUEST_SIZE);
+    state->partial.swap(rest);
+  });
+  pipe->read();
+}
+}  // namespace spv
@@ -0,0 +1,127 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "./chain.h"
+#include "./uvw.h"
+
+namespace spv {
+// Answers header lookups over a Unix socket, on the client's loop and
+// straight from the in-memory header index, so that local services can ask
+// while sync carries on. Requests and responses are fixed-size binary
+// records (but for the proof after a PROOF response), with integers
+// little-endian and hashes in display order (as spv prints them). A client
+// may pipeline as many requests as it likes; the responses to everything
+// that arrived in one read go out in one write, in order, each echoing its
+// request's id.
+//
+// A request is QUERY_REQUEST_SIZE bytes:
+//
+//   0   u8   op, a QueryOp
+//   1   u8   reserved[3]
+//   4   u32  id
+//   8   u8   arg[32]: a height (u32) for HEADER_AT and PROOF, a Unix time
+//                      (u32) for AT_TIME, a number of samples (u32, 0 for
+//                      CHAIN_PROOF_SAMPLES) for CHAIN_PROOF, or a block hash
+//
+// and a response QUERY_RESPONSE_SIZE bytes:
+//
+//   0   u8   status, a QueryStatus
+//   1   u8   op
+//   2   u8   best: 1 if the header is on the best chain
+//   3   u8   reserved
+//   4   u32  id
+//   8   u32  height
+//   12  u32  proof_size: the number of proof hashes, for PROOF, or bytes
+//                        of proof, for CHAIN_PROOF, or of JSON, for
+//                        PEER_INFO
+//   16  u8   hash[32]
+//   48  u8   header[80], in the wire encoding
+//
+// Everything after the id is zero unless the status is OK. An OK PROOF
+// response is followed by
+//
+//   0   u32  leaves: the number of best chain headers the root covers
+//   4   u8   reserved[28]
+//   32  u8   root[32]
+//   64  u8   proof[32 * proof_size]
+//
+// which HeaderMmr::verify() checks, with the header's hash as the leaf. An
+// OK CHAIN_PROOF response, whose header is the tip, is followed by the
+// encoded ChainProof (see flyclient.h), for verify_chain_proof() with the
+// same number of samples. An OK PEER_INFO response, whose header is also
+// the tip, is followed by proof_size bytes of JSON: an array with an object
+// for each connected peer, like getpeerinfo's, with its PeerCost (see
+// peer_cost.h).
+enum class QueryOp : uint8_t {
+  HEADER_AT = 1,  // the header at a height on the best chain
+  HEIGHT_OF = 2,  // the header with a hash, on any branch
+  TIP = 3,        // the tip of the best chain
+  IN_BEST = 4,    // like HEIGHT_OF, but answers OK with best = 0 if unknown
+  PROOF = 5,      // like HEADER_AT, with the header's inclusion proof
+  AT_TIME = 6,    // the first on the best chain at or past a time, as for
+                  // a wallet's birthday; see Chain::height_at_time()
+  CHAIN_PROOF = 7,  // a FlyClient proof of the best chain, with the tip
+  PEER_INFO = 8,    // the connected peers and their costs, with the tip
+};
+
+enum class QueryStatus : uint8_t {
+  OK = 0,
+  NOT_FOUND = 1,
+  BAD_OP = 2,
+};
+
+static const size_t QUERY_REQUEST_SIZE = 40;
+static const size_t QUERY_RESPONSE_SIZE = 128;
+
+class QueryServer {
+ public:
+  // the JSON for a PEER_INFO response
+  typedef std::function<std::string()> PeerInfo;
+
+  QueryServer(std::shared_ptr<uvw::Loop> loop, const Chain &chain,
+              PeerInfo &&peer_info = nullptr);
+  QueryServer(const QueryServer &other) = delete;
+  ~QueryServer() { close(); }
+
+  // Listen at path, replacing a socket left there by an earlier run; false
+  // if something else is there, see listen_unix().
+  bool listen(const std::string &path);
+
+  // stop listening and remove the socket
+  void close();
+
+  // Append the answer to one request to out.
+  void answer(const char *req, std::string &out) const;
+
+ private:
+  std::shared_ptr<uvw::Loop> loop_;
+  const Chain &chain_;
+  PeerInfo peer_info_;
+  std::shared_ptr<uvw::PipeHandle> listener_;
+  std::string path_;
+  std::shared_ptr<size_t> clients_;  // open connections, shared with them
+
+  void accept(uvw::PipeHandle &server);
+};
+}  // namespace spv
@@ -0,0 +1,281 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+// Replays peer traffic recorded with spv --capture-file:
+//
+//   spv-replay capture.dat [--max-speed] [-- options]
+//
+// A Client with a fresh data directory, taking any spv options after the
+// --, gets each captured peer as a connection with no socket under it, and
+// is handed the bytes the peer sent at the offsets they arrived at, or
+// with --max-speed as fast as it takes them. What the client sends is
+// dropped, so the run doesn't depend on the network or the peers, only on
+// the capture. At the end the program prints the height reached, and the
+// throughput and CPU time of the run.
+
+#include <sys/resource.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "./capture.h"
+#include "./chain.h"
+#include "./client.h"
+#include "./fs.h"
+#include "./logging.h"
+#include "./settings.h"
+#include "./uvw.h"
+
+using namespace spv;
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+// with --max-speed, bytes to hand over per loop iteration, so that the
+// client's own timers and idle handles still get to run
+static const size_t MAX_SPEED_BATCH = 1 << 20;
+
+// how long the client can go without progress after the capture ends
+// before the run is over
+static const std::chrono::seconds SETTLE_TIME{1};
+
+static double process_cpu_ns() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e9 +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e3;
+}
+
+class Replay {
+ public:
+  Replay(std::shared_ptr<uvw::Loop> loop, CaptureReader &capture,
+         Client &client, bool max_speed)
+      : loop_(loop),
+        capture_(capture),
+        client_(client),
+        max_speed_(max_speed),
+        have_next_(false),
+        done_(false),
+        records_(0),
+        bytes_(0) {}
+
+  inline bool done() const { return done_; }
+  inline size_t records() const { return records_; }
+  inline size_t bytes() const { return bytes_; }
+
+  void start() {
+    start_ = Clock::now();
+    have_next_ = capture_.next(next_, payload_);
+    if (max_speed_) {
+      idle_ = loop_->resource<uvw::IdleHandle>();
+      idle_->on<uvw::IdleEvent>([this](const auto &, auto &) { batch(); });
+      idle_->start();
+    } else {
+      timer_ = loop_->resource<uvw::TimerHandle>();
+      timer_->on<uvw::TimerEvent>([this](const auto &, auto &) { due(); });
+      due();
+    }
+  }
+
+  void close() {
+    if (idle_) {
+      idle_->close();
+      idle_.reset();
+    }
+    if (timer_) {
+      timer_->close();
+      timer_.reset();
+    }
+  }
+
+ private:
+  std::shared_ptr<uvw::Loop> loop_;
+  CaptureReader &capture_;
+  Client &client_;
+  const bool max_speed_;
+  Clock::time_point start_;
+  std::shared_ptr<uvw::IdleHandle> idle_;
+  std::shared_ptr<uvw::TimerHandle> timer_;
+
+  // the record to feed next, if have_next_
+  CaptureRecord next_;
+  std::string payload_;
+  bool have_next_;
+  bool done_;
+
+  std::vector<Addr> peers_;  // by capture peer number
+  size_t records_;
+  size_t bytes_;
+
+  void feed() {
+    records_++;
+    bytes_ += next_.size;
+    switch (next_.type) {
+      case CaptureType::OPEN:
+        if (peers_.size() <= next_.peer) {
+          peers_.resize(next_.peer + 1);
+        }
+        // an inbound peer becomes an outbound connection, so we speak
+        // first; after the version messages it's all the same
+        peers_[next_.peer] = CaptureReader::peer_addr(payload_);
+        client_.replay_open(peers_[next_.peer]);
+        break;
+      case CaptureType::RECV:
+        if (next_.peer < peers_.size()) {
+          client_.replay_read(peers_[next_.peer], payload_.data(),
+                              payload_.size());
+        }
+        break;
+      case CaptureType::SEND:
+        break;  // the client makes its own
+      case CaptureType::CLOSE:
+        if (next_.peer < peers_.size()) {
+          client_.replay_close(peers_[next_.peer]);
+        }
+        break;
+    }
+    have_next_ = capture_.next(next_, payload_);
+    if (!have_next_) {
+      done_ = true;
+      close();
+    }
+  }
+
+  void batch() {
+    size_t fed = 0;
+    while (have_next_ && fed < MAX_SPEED_BATCH) {
+      fed += next_.size;
+      feed();
+    }
+  }
+
+  // feed the records that are due, and wait for the next one
+  void due() {
+    const uint64_t elapsed =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+                                                             start_)
+            .count();
+    while (have_next_ && next_.time <= elapsed) {
+      feed();
+    }
+    if (have_next_) {
+      const uint64_t wait_ms = (next_.time - elapsed) / 1000000;
+      timer_->start(std::chrono::milliseconds(wait_ms ? wait_ms : 1),
+                    std::chrono::milliseconds(0));
+    }
+  }
+};
+
+std::unique_ptr<Client> client;
+}  // namespace
+
+int main(int argc, char **argv) {
+  int split = argc;
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--") == 0) {
+      split = i;
+      break;
+    }
+  }
+  const bool max_speed =
+      split > 2 && std::strcmp(argv[2], "--max-speed") == 0;
+  if (split < 2 || split > 3 || (split == 3 && !max_speed)) {
+    std::fprintf(stderr,
+                 "usage: %s capture.dat [--max-speed] [-- spv options]\n",
+                 argv[0]);
+    return 1;
+  }
+
+  CaptureReader capture;
+  if (!capture.open(argv[1])) {
+    return 1;
+  }
+
+  char datadir[] = "/tmp/spv-replay.XXXXXX";
+  if (mkdtemp(datadir) == nullptr) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  std::vector<const char *> args = {argv[0], "--data-dir", datadir};
+  for (int i = split + 1; i < argc; i++) {
+    args.push_back(argv[i]);
+  }
+  args.push_back(nullptr);
+  spdlog::set_level(spdlog::level::warn);  // -d still turns on debugging
+  int ret = -1;
+  const Settings &settings = parse_settings(
+      args.size() - 1, const_cast<char **>(args.data()), &ret);
+  if (ret != -1) {
+    recursive_delete(datadir);
+    return ret;
+  }
+  if (!settings.checkpoints_file.empty() &&
+      !load_checkpoints(settings.checkpoints_file)) {
+    recursive_delete(datadir);
+    return 1;
+  }
+
+  auto loop = uvw::Loop::getDefault();
+  const double base_cpu = process_cpu_ns();
+  const auto start = Clock::now();
+  client.reset(new Client(settings, loop));
+  client->replay_start();
+  Replay replay(loop, capture, *client, max_speed);
+  replay.start();
+
+  // once the capture is in, wait for the client to settle
+  size_t last_height = client->get_height();
+  auto last_progress = start;
+  auto poll = loop->resource<uvw::TimerHandle>();
+  poll->on<uvw::TimerEvent>([&](const auto &, auto &) {
+    const size_t height = client->get_height();
+    const auto now = Clock::now();
+    if (height > last_height || !replay.done()) {
+      last_height = height;
+      last_progress = now;
+      return;
+    }
+    if (now - last_progress < SETTLE_TIME) {
+      return;
+    }
+    const double secs =
+        std::chrono::duration<double>(last_progress - start).count();
+    const double cpu = process_cpu_ns() - base_cpu;
+    std::printf("replayed %zu records, %.1f MB, in %.2f s: %.1f MB/s\n",
+                replay.records(), replay.bytes() / 1e6, secs,
+                replay.bytes() / 1e6 / secs);
+    std::printf("height %zu: %.0f headers/s, %.2f us cpu/header\n", height,
+                height / secs, height ? cpu / height / 1e3 : 0.0);
+    client->shutdown();
+    replay.close();
+    loop->walk([](uvw::BaseHandle &h) {
+      if (!h.closing()) {
+        h.close();
+      }
+    });
+  });
+  poll->start(std::chrono::milliseconds(100), std::chrono::milliseconds(100));
+
+  loop->run();
+  loop->close();
+  client.reset();
+  recursive_delete(datadir);
+  return 0;
+}
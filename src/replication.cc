@@ -0,0 +1,330 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./replication.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "./decoder.h"
+#include "./encoder.h"
+#include "./logging.h"
+#include "./network.h"
+
+namespace spv {
+MODULE_LOGGER
+
+static const size_t max_followers = 64;
+
+// the most written to a follower and not yet flushed, about six full
+// headers messages
+static const size_t max_queued_bytes = 1 << 20;
+
+// the biggest headers message the leader sends
+static const size_t max_payload =
+    MAX_VARINT_SIZE + MAX_HEADERS_RESULTS * HeadersView::stride;
+
+// how long a follower waits to reconnect to the leader
+static const std::chrono::seconds retry_delay{5};
+
+ReplicationServer::ReplicationServer(std::shared_ptr<uvw::Loop> loop,
+                                     const Chain &chain, TipFeed &feed)
+    : loop_(loop), chain_(chain), feed_(feed), feed_id_(0) {}
+
+void ReplicationServer::listen(const std::string &host, uint16_t port) {
+  listener_ = loop_->resource<uvw::TcpHandle>();
+  listener_->on<uvw::ErrorEvent>([](const auto &exc, auto &) {
+    log->error("error serving header replication: {}", exc.what());
+  });
+  listener_->on<uvw::ListenEvent>(
+      [this](const auto &, auto &server) { accept(server); });
+  if (host.find(':') != std::string::npos) {
+    listener_->bind<uvw::IPv6>(host, port);
+  } else {
+    listener_->bind<uvw::IPv4>(host, port);
+  }
+  listener_->listen();
+  feed_id_ = feed_.subscribe([this](const TipEvent &) { schedule_pump(); });
+  log->info("replicating headers on {} port {}", host, port);
+}
+
+void ReplicationServer::close() {
+  if (!listener_) {
+    return;
+  }
+  feed_.unsubscribe(feed_id_);
+  listener_->close();
+  listener_.reset();
+  if (pump_) {
+    pump_->close();
+    pump_.reset();
+  }
+  for (auto &follower : followers_) {
+    follower->tcp->close();
+  }
+  followers_.clear();
+}
+
+void ReplicationServer::accept(uvw::TcpHandle &server) {
+  auto tcp = loop_->resource<uvw::TcpHandle>();
+  server.accept(*tcp);
+  if (followers_.size() >= max_followers) {
+    tcp->close();
+    return;
+  }
+  tcp->noDelay(true);
+  auto follower = std::make_shared<Follower>();
+  follower->tcp = tcp;
+  follower->ready = false;
+  follower->queued = 0;
+  followers_.push_back(follower);
+
+  Follower *raw = follower.get();
+  tcp->once<uvw::ErrorEvent>([this, raw](const auto &, auto &) { drop(raw); });
+  tcp->once<uvw::EndEvent>([this, raw](const auto &, auto &) { drop(raw); });
+  tcp->on<uvw::WriteEvent>([this, raw](const auto &, auto &) {
+    raw->queued -= raw->writes.front()->size();
+    raw->writes.pop_front();
+    if (raw->writes.empty()) {
+      pump(*raw);
+    }
+  });
+  tcp->on<uvw::DataEvent>([this, raw](const auto &data, auto &) {
+    if (!read(*raw, data.data.get(), data.length)) {
+      log->warn("dropping header follower {} with a bad hello",
+                raw->tcp->peer().ip);
+      drop(raw);
+    }
+  });
+  tcp->read();
+}
+
+bool ReplicationServer::read(Follower &follower, const char *data,
+                             size_t size) {
+  if (follower.ready) {
+    return true;  // nothing else is expected
+  }
+  follower.hello.append(data, size);
+  if (follower.hello.size() < REPLICATION_HELLO_SIZE) {
+    return true;
+  }
+  Decoder dec(follower.hello.data(), follower.hello.size());
+  uint32_t magic, count;
+  dec.pull(magic);
+  dec.pull(count);
+  if (magic != network().magic || count == 0 ||
+      count > REPLICATION_MAX_LOCATOR) {
+    return false;
+  }
+  if (dec.bytes_remaining() < count * sizeof(hash_t)) {
+    return true;
+  }
+  follower.locator.resize(count);
+  for (auto &hash : follower.locator) {
+    dec.pull(hash);
+  }
+  follower.ready = true;
+  follower.hello.clear();
+  log->info("streaming headers to follower {}", follower.tcp->peer().ip);
+  pump(follower);
+  return true;
+}
+
+void ReplicationServer::drop(Follower *follower) {
+  auto it = std::find_if(
+      followers_.begin(), followers_.end(),
+      [follower](const auto &f) { return f.get() == follower; });
+  if (it == followers_.end()) {
+    return;
+  }
+  // closing cancels the writes in flight, so no WriteEvent can see it
+  (*it)->tcp->close();
+  followers_.erase(it);
+}
+
+void ReplicationServer::schedule_pump() {
+  if (!pump_) {
+    pump_ = loop_->resource<uvw::IdleHandle>();
+    pump_->on<uvw::IdleEvent>([this](const auto &, auto &idle) {
+      idle.stop();
+      pump();
+    });
+  }
+  if (!pump_->active()) {
+    pump_->start();
+  }
+}
+
+void ReplicationServer::pump() {
+  for (const auto &follower : followers_) {
+    pump(*follower);
+  }
+}
+
+void ReplicationServer::pump(Follower &follower) {
+  // headers_message() would wait for the index
+  if (!follower.ready || !chain_.index_loaded()) {
+    return;
+  }
+  while (follower.queued < max_queued_bytes) {
+    ReplyCache::Message msg = chain_.headers_message(follower.locator,
+                                                     empty_hash);
+    Decoder dec(msg->data() + HEADER_SIZE, msg->size() - HEADER_SIZE);
+    uint64_t count;
+    dec.pull_varint(count);
+    if (count == 0) {
+      return;  // caught up
+    }
+    // The next message follows this one's last header, along its branch,
+    // and so starts from the fork if a reorg takes it off the best chain.
+    const HeadersView view(msg->data() + HEADER_SIZE + varint_size(count),
+                           count);
+    follower.locator = chain_.locator(view.hash(count - 1));
+    follower.queued += msg->size();
+    follower.writes.push_back(msg);
+    // msg is kept alive by writes until the WriteEvent
+    follower.tcp->write(const_cast<char *>(msg->data()),
+                        static_cast<unsigned>(msg->size()));
+  }
+}
+
+ReplicationFollower::ReplicationFollower(
+    std::shared_ptr<uvw::Loop> loop, const Addr &leader,
+    std::function<std::vector<hash_t>()> locator, HeadersCallback headers,
+    std::function<void(bool)> changed)
+    : loop_(loop),
+      leader_(leader),
+      locator_(locator),
+      headers_(headers),
+      changed_(changed),
+      streaming_(false),
+      closed_(false) {}
+
+void ReplicationFollower::start() {
+  retry_ = loop_->resource<uvw::TimerHandle>();
+  retry_->on<uvw::TimerEvent>([this](const auto &, auto &) { connect(); });
+  connect();
+}
+
+void ReplicationFollower::close() {
+  if (closed_) {
+    return;
+  }
+  closed_ = true;
+  if (retry_) {
+    retry_->close();
+    retry_.reset();
+  }
+  if (tcp_) {
+    tcp_->close();
+    tcp_.reset();
+  }
+  streaming_ = false;
+}
+
+void ReplicationFollower::connect() {
+  tcp_ = loop_->resource<uvw::TcpHandle>();
+  tcp_->once<uvw::ErrorEvent>([this](const auto &exc, auto &) {
+    log->warn("lost header leader {}: {}", leader_, exc.what());
+    disconnected();
+  });
+  tcp_->once<uvw::EndEvent>([this](const auto &, auto &) {
+    log->warn("header leader {} closed the connection", leader_);
+    disconnected();
+  });
+  tcp_->once<uvw::ConnectEvent>([this](const auto &, auto &tcp) {
+    tcp.noDelay(true);
+    const std::vector<hash_t> locator = locator_();
+    const size_t count = std::min(locator.size(), REPLICATION_MAX_LOCATOR);
+    Encoder enc;
+    enc.push_int<uint32_t>(network().magic);
+    enc.push_int<uint32_t>(count);
+    for (size_t i = 0; i < count; i++) {
+      enc.push_int(locator[i]);
+    }
+    size_t size;
+    std::unique_ptr<char[]> buf = enc.serialize(size, false);
+    tcp.write(std::move(buf), size);
+    tcp.read();
+    streaming_ = true;
+    log->info("following headers from leader {}", leader_);
+    changed_(true);
+  });
+  tcp_->on<uvw::DataEvent>([this](const auto &data, auto &) {
+    if (!read(data.data.get(), data.length)) {
+      log->warn("header leader {} sent a bad message", leader_);
+      disconnected();
+    }
+  });
+  in_.clear();
+  sockaddr_storage sa;
+  leader_.to_sockaddr(sa);
+  tcp_->connect(reinterpret_cast<const sockaddr &>(sa));
+}
+
+void ReplicationFollower::disconnected() {
+  if (!tcp_) {
+    return;
+  }
+  tcp_->close();
+  tcp_.reset();
+  retry_->start(retry_delay, std::chrono::seconds(0));
+  if (streaming_) {
+    streaming_ = false;
+    changed_(false);
+  }
+}
+
+bool ReplicationFollower::read(const char *data, size_t size) {
+  in_.append(data, size);
+  size_t off = 0;
+  while (in_.size() - off >= HEADER_SIZE) {
+    const char *msg = in_.data() + off;
+    Decoder dec(msg, HEADER_SIZE);
+    Headers hdrs;
+    dec.pull(hdrs);
+    if (hdrs.magic != network().magic || hdrs.type != Command::HEADERS ||
+        hdrs.payload_size > max_payload) {
+      return false;
+    }
+    if (in_.size() - off < HEADER_SIZE + hdrs.payload_size) {
+      break;
+    }
+    Decoder payload(msg + HEADER_SIZE, hdrs.payload_size);
+    uint64_t count;
+    try {
+      payload.pull_varint(count);
+    } catch (const DecodeError &) {
+      return false;
+    }
+    const size_t prefix = varint_size(count);
+    if (count > MAX_HEADERS_RESULTS ||
+        prefix + count * HeadersView::stride != hdrs.payload_size) {
+      return false;
+    }
+    if (count) {
+      headers_(std::string(msg + HEADER_SIZE + prefix,
+                           count * HeadersView::stride),
+               hdrs.checksum);
+    }
+    off += HEADER_SIZE + hdrs.payload_size;
+  }
+  in_.erase(0, off);
+  return true;
+}
+}  // namespace spv
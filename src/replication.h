@@ -0,0 +1,139 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "./addr.h"
+#include "./chain.h"
+#include "./uvw.h"
+
+namespace spv {
+// Header replication between our own nodes: a leader that syncs from the
+// network serves its best chain over TCP, and followers take their headers
+// from it instead of asking peers (--replicate-port and --follow). The
+// follower opens with a hello, little-endian:
+//
+//   0   u32  network magic
+//   4   u32  count, of at most REPLICATION_MAX_LOCATOR hashes
+//   8   u8   hashes[32 * count], a block locator in wire byte order
+//
+// and from then on the leader sends headers messages, framed and encoded
+// as on the P2P network, holding the best chain after the fork point of the
+// locator, and after that whatever it adds, with reorgs starting from the
+// fork. A follower resumes by reconnecting with a locator from its own tip.
+// The leader's messages come from Chain::headers_message(), so followers
+// asking for the same ranges share its encoded replies; followers check the
+// proof of work themselves, in HeaderValidator's batches.
+static const size_t REPLICATION_HELLO_SIZE = 8;
+static const size_t REPLICATION_MAX_LOCATOR = 101;
+
+// The leader's side. Each follower keeps a locator from the last header
+// sent to it, and is sent what follows that whenever the tip moves and its
+// last writes have gone out.
+class ReplicationServer {
+ public:
+  ReplicationServer(std::shared_ptr<uvw::Loop> loop, const Chain &chain,
+                    TipFeed &feed);
+  ReplicationServer(const ReplicationServer &other) = delete;
+  ~ReplicationServer() { close(); }
+
+  void listen(const std::string &host, uint16_t port);
+
+  // stop listening and disconnect every follower
+  void close();
+
+ private:
+  struct Follower {
+    std::shared_ptr<uvw::TcpHandle> tcp;
+    std::string hello;  // until it's all in
+    bool ready;         // the hello was read
+    std::vector<hash_t> locator;
+    std::deque<ReplyCache::Message> writes;  // in flight, kept alive
+    size_t queued;                           // their total size
+  };
+
+  std::shared_ptr<uvw::Loop> loop_;
+  const Chain &chain_;
+  TipFeed &feed_;
+  size_t feed_id_;
+  std::shared_ptr<uvw::TcpHandle> listener_;
+  std::shared_ptr<uvw::IdleHandle> pump_;
+  std::vector<std::shared_ptr<Follower> > followers_;
+
+  void accept(uvw::TcpHandle &server);
+
+  // take the hello from data; returns false if it's bad
+  bool read(Follower &follower, const char *data, size_t size);
+
+  // send what's new to every follower on the next loop iteration
+  void schedule_pump();
+  void pump();
+  void pump(Follower &follower);
+  void drop(Follower *follower);
+};
+
+// The follower's side: connects to the leader, reconnecting a few seconds
+// after it drops, and hands each headers message's entries (laid out as
+// HeadersView expects) and checksum to the callback, to validate as if a
+// peer had sent them.
+class ReplicationFollower {
+ public:
+  typedef std::function<void(std::string &&raw, uint32_t checksum)>
+      HeadersCallback;
+
+  ReplicationFollower(std::shared_ptr<uvw::Loop> loop, const Addr &leader,
+                      std::function<std::vector<hash_t>()> locator,
+                      HeadersCallback headers,
+                      std::function<void(bool streaming)> changed);
+  ReplicationFollower(const ReplicationFollower &other) = delete;
+  ~ReplicationFollower() { close(); }
+
+  inline const Addr &leader() const { return leader_; }
+
+  // is the leader streaming headers to us?
+  inline bool streaming() const { return streaming_; }
+
+  void start();
+  void close();
+
+ private:
+  std::shared_ptr<uvw::Loop> loop_;
+  Addr leader_;
+  std::function<std::vector<hash_t>()> locator_;
+  HeadersCallback headers_;
+  std::function<void(bool)> changed_;
+  std::shared_ptr<uvw::TcpHandle> tcp_;
+  std::shared_ptr<uvw::TimerHandle> retry_;
+  std::string in_;  // the start of a message that isn't all in yet
+  bool streaming_;
+  bool closed_;
+
+  void connect();
+  void disconnected();
+
+  // take whole messages off data; returns false if one is bad
+  bool read(const char *data, size_t size);
+};
+}  // namespace spv
@@ -0,0 +1,46 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./reply_cache.h"
+
+#include <algorithm>
+
+namespace spv {
+ReplyCache::Message ReplyCache::find(size_t start, const hash_t &last) {
+  for (Entry &entry : entries_) {
+    if (entry.start == start && entry.last == last) {
+      entry.used = ++clock_;
+      return entry.msg;
+    }
+  }
+  return nullptr;
+}
+
+void ReplyCache::put(size_t start, const hash_t &last, Message msg) {
+  if (capacity_ == 0) {
+    return;
+  }
+  if (entries_.size() < capacity_) {
+    entries_.push_back({start, last, msg, ++clock_});
+    return;
+  }
+  auto lru = std::min_element(
+      entries_.begin(), entries_.end(),
+      [](const Entry &a, const Entry &b) { return a.used < b.used; });
+  *lru = {start, last, msg, ++clock_};
+}
+}  // namespace spv
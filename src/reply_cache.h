@@ -0,0 +1,61 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "./constants.h"
+
+namespace spv {
+// ReplyCache keeps the last few fully encoded headers messages sent in reply
+// to getheaders, since peers syncing from us tend to ask for the same recent
+// ranges. A range of the best chain is named by its first height and the
+// hash it ends at, so an entry can't go stale after a reorg; it just stops
+// being asked for and gets evicted, least recently used first.
+class ReplyCache {
+ public:
+  typedef std::shared_ptr<const std::string> Message;
+
+  explicit ReplyCache(size_t capacity) : capacity_(capacity), clock_(0) {}
+  ReplyCache(const ReplyCache &other) = delete;
+
+  inline size_t size() const { return entries_.size(); }
+
+  // the message for the headers after start up to last, or nullptr
+  Message find(size_t start, const hash_t &last);
+
+  void put(size_t start, const hash_t &last, Message msg);
+
+ private:
+  struct Entry {
+    size_t start;
+    hash_t last;
+    Message msg;
+    uint64_t used;  // clock_ when last found
+  };
+
+  // few enough that a linear scan beats anything fancier
+  std::vector<Entry> entries_;
+  size_t capacity_;
+  uint64_t clock_;
+};
+}  // namespace spv
@@ -0,0 +1,295 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./rescan.h"
+
+#include <endian.h>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "./chain.h"
+#include "./gcs.h"
+#include "./logging.h"
+#include "./scheduler.h"
+
+namespace spv {
+MODULE_LOGGER
+
+// the chain state key of the saved cursor and stop height
+static const std::string rescan_key = "rescan";
+
+// Batches fetched or matched at once; this bounds the filters held in
+// memory to about this many times MAX_GETCFILTERS_SIZE.
+static const size_t max_batches = 16;
+
+Rescan::Rescan(std::shared_ptr<uvw::Loop> loop, Chain &chain,
+               const FilterHeaderChain &cfheaders, const WatchList &watch,
+               FilterStore *store)
+    : loop_(loop),
+      chain_(chain),
+      cfheaders_(cfheaders),
+      watch_(watch),
+      store_(store),
+      shutdown_(false),
+      from_(1),
+      cursor_(1),
+      stop_(0),
+      next_(1),
+      matches_(0) {}
+
+bool Rescan::start(size_t from, size_t to) {
+  if (from == 0) {
+    std::string val;
+    uint64_t saved[2];
+    if (!chain_.get_state(rescan_key, val) || val.size() != sizeof saved) {
+      return false;
+    }
+    std::memcpy(saved, val.data(), sizeof saved);
+    from = le64toh(saved[0]);
+    to = le64toh(saved[1]);
+    if (from > to) {
+      return false;  // that one finished
+    }
+    log->info("resuming rescan at height {} of {}", from, to);
+  } else {
+    log->info("rescanning heights {} to {}", from, to);
+  }
+  batches_.clear();
+  from_ = cursor_ = next_ = from;
+  stop_ = to;
+  matches_ = 0;
+  save();
+  return !finished();
+}
+
+bool Rescan::assign(const Addr &peer, size_t limit, size_t &start,
+                    size_t &stop, hash_t &stop_hash) {
+  assert(!busy(peer));
+  std::shared_ptr<Batch> batch;
+  for (const auto &b : batches_) {
+    if (b->state == State::QUEUED && b->stop < limit) {
+      batch = b;  // given back by another peer
+      break;
+    }
+  }
+  if (batch == nullptr) {
+    if (next_ > stop_ || next_ >= limit || batches_.size() >= max_batches) {
+      return false;
+    }
+    batch = std::make_shared<Batch>();
+    batch->start = next_;
+    batch->stop = std::min(
+        {stop_, next_ + MAX_GETCFILTERS_SIZE - 1, limit - 1});
+    next_ = batch->stop + 1;
+    batches_.push_back(batch);
+  }
+
+  // Copy what the worker needs to check the filters, so that it doesn't
+  // touch the filter header chain.
+  batch->state = State::FETCHING;
+  batch->peer = peer;
+  batch->local = false;
+  batch->block_hashes.clear();
+  batch->headers.assign(1, cfheaders_.prev_header(batch->start));
+  for (size_t h = batch->start; h <= batch->stop; h++) {
+    batch->block_hashes.push_back(cfheaders_.block_hash(h));
+    batch->headers.push_back(cfheaders_.header(h));
+  }
+  batch->filters.clear();
+  batch->filters.reserve(batch->block_hashes.size());
+
+  start = batch->start;
+  stop = batch->stop;
+  stop_hash = batch->block_hashes.back();
+  return true;
+}
+
+void Rescan::scan_local() {
+  if (store_ == nullptr) {
+    return;
+  }
+  const size_t limit = cfheaders_.size();
+  while (next_ <= stop_ && next_ < limit && batches_.size() < max_batches) {
+    auto batch = std::make_shared<Batch>();
+    batch->start = next_;
+    batch->local = true;
+    batch->headers.assign(1, cfheaders_.prev_header(next_));
+    const size_t last =
+        std::min({stop_, next_ + MAX_GETCFILTERS_SIZE - 1, limit - 1});
+    for (size_t h = next_; h <= last; h++) {
+      const char *data;
+      size_t size;
+      if (!store_->get(h, cfheaders_.block_hash(h), &data, &size)) {
+        break;
+      }
+      batch->block_hashes.push_back(cfheaders_.block_hash(h));
+      batch->headers.push_back(cfheaders_.header(h));
+      batch->filters.emplace_back(data, size);
+    }
+    if (batch->filters.empty()) {
+      return;  // this one is for a peer
+    }
+    batch->stop = batch->start + batch->filters.size() - 1;
+    next_ = batch->stop + 1;
+    batches_.push_back(batch);
+    start_matching(batch);
+  }
+}
+
+bool Rescan::busy(const Addr &peer) const {
+  return std::any_of(batches_.begin(), batches_.end(), [&](const auto &b) {
+    return b->state == State::FETCHING && b->peer == peer;
+  });
+}
+
+bool Rescan::add_filter(const Addr &peer, const hash_t &block_hash,
+                        std::string &&filter, bool &done) {
+  done = false;
+  auto it = std::find_if(batches_.begin(), batches_.end(), [&](auto &b) {
+    return b->state == State::FETCHING && b->peer == peer;
+  });
+  if (it == batches_.end()) {
+    return false;
+  }
+  std::shared_ptr<Batch> batch = *it;
+  const size_t i = batch->filters.size();
+  if (block_hash != batch->block_hashes[i]) {
+    return false;  // cfilters come in height order
+  }
+  batch->filters.push_back(std::move(filter));
+  if (batch->filters.size() < batch->block_hashes.size()) {
+    return true;
+  }
+
+  done = true;
+  start_matching(batch);
+  return true;
+}
+
+void Rescan::start_matching(const std::shared_ptr<Batch> &batch) {
+  batch->state = State::MATCHING;
+  batch->bad = false;
+  batch->matches.clear();
+  scheduler().post(
+      *loop_, Priority::NORMAL,
+      [batch, watch = watch_.elements()]() { match(batch.get(), watch); },
+      [this, batch]() { matched(batch); });
+}
+
+void Rescan::match(Batch *batch, const std::vector<std::string> &watch) {
+  for (size_t i = 0; i < batch->filters.size(); i++) {
+    const std::string &filter = batch->filters[i];
+    if (filter_header(filter_hash(filter), batch->headers[i]) !=
+        batch->headers[i + 1]) {
+      batch->bad = true;
+      return;
+    }
+    const GcsFilter gcs(batch->block_hashes[i], filter);
+    if (!gcs.valid()) {
+      batch->bad = true;
+      return;
+    }
+    if (gcs.match_any(watch)) {
+      batch->matches.push_back(batch->start + i);
+    }
+  }
+}
+
+void Rescan::matched(const std::shared_ptr<Batch> &batch) {
+  if (shutdown_) {
+    return;
+  }
+  if (store_ && !batch->local && !batch->bad) {
+    for (size_t i = 0; i < batch->filters.size(); i++) {
+      store_->put(batch->start + i, batch->block_hashes[i],
+                  batch->filters[i]);
+    }
+  }
+  batch->filters.clear();
+  batch->filters.shrink_to_fit();
+  if (batch->bad && batch->local) {
+    // fetch them again, rather than blame a peer
+    log->warn("stored filters for heights {} to {} are bad", batch->start,
+              batch->stop);
+    for (size_t h = batch->start; h <= batch->stop; h++) {
+      store_->forget(h);
+    }
+    batch->state = State::QUEUED;
+  } else if (batch->bad) {
+    log->warn("peer {} sent bad filters for heights {} to {}", batch->peer,
+              batch->start, batch->stop);
+    batch->state = State::QUEUED;
+    if (callbacks.bad_peer) {
+      callbacks.bad_peer(batch->peer);
+    }
+  } else {
+    batch->state = State::DONE;
+    matches_ += batch->matches.size();
+    for (size_t height : batch->matches) {
+      if (callbacks.match) {
+        callbacks.match(height, batch->block_hashes[height - batch->start]);
+      }
+    }
+    advance();
+  }
+  if (callbacks.progress) {
+    callbacks.progress();
+  }
+}
+
+void Rescan::release(const Addr &peer) {
+  for (auto &batch : batches_) {
+    if (batch->state == State::FETCHING && batch->peer == peer) {
+      batch->state = State::QUEUED;
+      batch->filters.clear();
+    }
+  }
+}
+
+void Rescan::advance() {
+  const size_t before = cursor_;
+  while (!batches_.empty() && batches_.front()->state == State::DONE) {
+    cursor_ = batches_.front()->stop + 1;
+    batches_.pop_front();
+  }
+  if (cursor_ == before) {
+    return;
+  }
+  save();
+  if (finished()) {
+    log->info("rescan finished at height {}, {} matching block(s)", stop_,
+              matches_);
+  } else {
+    log->info("rescan at height {} of {} ({:.1f}%), {} matching block(s)",
+              cursor_ - 1, stop_,
+              100.0 * (cursor_ - from_) / (stop_ - from_ + 1), matches_);
+  }
+}
+
+void Rescan::save() const {
+  const uint64_t saved[2] = {htole64(cursor_), htole64(stop_)};
+  chain_.put_state(rescan_key,
+                   std::string(reinterpret_cast<const char *>(saved),
+                               sizeof saved));
+}
+
+void Rescan::shutdown() {
+  shutdown_ = true;
+  batches_.clear();
+}
+}  // namespace spv
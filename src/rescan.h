@@ -0,0 +1,142 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "./addr.h"
+#include "./cfheaders.h"
+#include "./constants.h"
+#include "./filter_store.h"
+#include "./uvw.h"
+#include "./watch.h"
+
+namespace spv {
+class Chain;
+
+// Rescan checks the compact filters of a range of past blocks against the
+// watched scripts, e.g. after a wallet imports keys. The range is split
+// into batches of MAX_GETCFILTERS_SIZE blocks, each fetched from a
+// different peer, and once a batch is complete its filters are checked
+// against the filter header chain and matched on the Scheduler's workers.
+// The cursor is the height below which every block has been checked; it
+// is saved in the chain's database, so an interrupted rescan picks up
+// where it left off. The rescan doesn't talk to peers itself: the client
+// asks it for batches to request and hands it the cfilters that arrive.
+// With a FilterStore, the filters peers send are kept, and the batches it
+// has already are matched straight from it, with no peer involved.
+class Rescan {
+ public:
+  // Run on the loop thread.
+  struct Callbacks {
+    std::function<void(size_t height, const hash_t &block_hash)> match;
+    std::function<void(const Addr &peer)> bad_peer;  // sent bad filters
+    std::function<void()> progress;  // a batch is done, so more can start
+  };
+
+  Rescan() = delete;
+  Rescan(const Rescan &other) = delete;
+  Rescan(std::shared_ptr<uvw::Loop> loop, Chain &chain,
+         const FilterHeaderChain &cfheaders, const WatchList &watch,
+         FilterStore *store = nullptr);
+
+  Callbacks callbacks;
+
+  // Scan heights [from, to], replacing any saved rescan; with from 0, pick
+  // up the saved one instead. Returns false if there's nothing to scan.
+  bool start(size_t from, size_t to);
+
+  inline bool finished() const { return cursor_ > stop_; }
+  inline size_t cursor() const { return cursor_; }
+  inline size_t stop() const { return stop_; }
+
+  // Give this peer the next batch to fetch, [start, stop], if there is one
+  // whose filter headers are all below limit.
+  bool assign(const Addr &peer, size_t limit, size_t &start, size_t &stop,
+              hash_t &stop_hash);
+
+  // Start matching the next batches the store has every filter of, as many
+  // as there's room for; assign() goes on from the first it doesn't have.
+  void scan_local();
+
+  // is this peer fetching a batch?
+  bool busy(const Addr &peer) const;
+
+  // A cfilter from a busy peer. Returns false if it isn't the block the
+  // peer should send next. done is set when that was the batch's last one.
+  bool add_filter(const Addr &peer, const hash_t &block_hash,
+                  std::string &&filter, bool &done);
+
+  // put the peer's batch (if any) back in the queue, e.g. on disconnect
+  void release(const Addr &peer);
+
+  // drop any results that haven't been delivered yet
+  void shutdown();
+
+ private:
+  enum class State { QUEUED, FETCHING, MATCHING, DONE };
+
+  struct Batch {
+    size_t start, stop;  // inclusive heights
+    State state;
+    Addr peer;
+    bool local;  // read from the store rather than fetched
+    std::vector<hash_t> block_hashes;
+    std::vector<hash_t> headers;  // the one before start, then one per block
+    std::vector<std::string> filters;
+
+    // set on the worker thread
+    bool bad;
+    std::vector<size_t> matches;  // heights
+  };
+
+  std::shared_ptr<uvw::Loop> loop_;
+  Chain &chain_;
+  const FilterHeaderChain &cfheaders_;
+  const WatchList &watch_;
+  FilterStore *store_;
+  bool shutdown_;
+  size_t from_;  // where this run started, for the progress reports
+  size_t cursor_;
+  size_t stop_;
+  size_t next_;  // the first height that isn't in batches_
+  size_t matches_;
+
+  // the window of batches from the cursor on, in height order
+  std::deque<std::shared_ptr<Batch> > batches_;
+
+  // hand a batch with all its filters to the thread pool
+  void start_matching(const std::shared_ptr<Batch> &batch);
+
+  // Verify and match a batch's filters; runs on a worker thread, so it
+  // gets its own copy of the watched elements.
+  static void match(Batch *batch, const std::vector<std::string> &watch);
+
+  // a batch came back from the thread pool
+  void matched(const std::shared_ptr<Batch> &batch);
+
+  // move the cursor past the done batches at the front, and save it
+  void advance();
+  void save() const;
+};
+}  // namespace spv
@@ -0,0 +1,145 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./ripemd160.h"
+
+#include <endian.h>
+#include <cstring>
+
+#include "./sha256.h"
+
+namespace spv {
+namespace ripemd160 {
+namespace {
+// message word order, rotations and constants of the left and right lines
+const uint8_t left_words[80] = {
+    0, 1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+    7, 4,  13, 1,  10, 6,  15, 3,  12, 0, 9,  5,  2,  14, 11, 8,
+    3, 10, 14, 4,  9,  15, 8,  1,  2,  7, 0,  6,  13, 11, 5,  12,
+    1, 9,  11, 10, 0,  8,  12, 4,  13, 3, 7,  15, 14, 5,  6,  2,
+    4, 0,  5,  9,  7,  12, 2,  10, 14, 1, 3,  8,  11, 6,  15, 13};
+const uint8_t right_words[80] = {
+    5,  14, 7,  0, 9, 2,  11, 4,  13, 6,  15, 8,  1,  10, 3,  12,
+    6,  11, 3,  7, 0, 13, 5,  10, 14, 15, 8,  12, 4,  9,  1,  2,
+    15, 5,  1,  3, 7, 14, 6,  9,  11, 8,  12, 2,  10, 0,  4,  13,
+    8,  6,  4,  1, 3, 11, 15, 0,  5,  12, 2,  13, 9,  7,  10, 14,
+    12, 15, 10, 4, 1, 5,  8,  7,  6,  2,  13, 14, 0,  3,  9,  11};
+const uint8_t left_rotations[80] = {
+    11, 14, 15, 12, 5,  8,  7,  9,  11, 13, 14, 15, 6,  7,  9,  8,
+    7,  6,  8,  13, 11, 9,  7,  15, 7,  12, 15, 9,  11, 7,  13, 12,
+    11, 13, 6,  7,  14, 9,  13, 15, 14, 8,  13, 6,  5,  12, 7,  5,
+    11, 12, 14, 15, 14, 15, 9,  8,  9,  14, 5,  6,  8,  6,  5,  12,
+    9,  15, 5,  11, 6,  8,  13, 12, 5,  12, 13, 14, 11, 8,  5,  6};
+const uint8_t right_rotations[80] = {
+    8,  9,  9,  11, 13, 15, 15, 5,  7,  7,  8,  11, 14, 14, 12, 6,
+    9,  13, 15, 7,  12, 8,  9,  11, 7,  7,  12, 7,  6,  15, 13, 11,
+    9,  7,  15, 11, 8,  6,  6,  14, 12, 13, 5,  14, 13, 13, 7,  5,
+    15, 5,  8,  11, 14, 14, 6,  14, 6,  9,  12, 9,  12, 5,  15, 8,
+    8,  5,  12, 9,  12, 5,  14, 6,  8,  13, 6,  5,  15, 13, 11, 11};
+const uint32_t left_constants[5] = {0x00000000, 0x5a827999, 0x6ed9eba1,
+                                    0x8f1bbcdc, 0xa953fd4e};
+const uint32_t right_constants[5] = {0x50a28be6, 0x5c4dd124, 0x6d703ef3,
+                                     0x7a6d76e9, 0x00000000};
+
+inline uint32_t rotl(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+
+// the boolean function of round j / 16
+inline uint32_t f(int round, uint32_t x, uint32_t y, uint32_t z) {
+  switch (round) {
+    case 0:
+      return x ^ y ^ z;
+    case 1:
+      return (x & y) | (~x & z);
+    case 2:
+      return (x | ~y) ^ z;
+    case 3:
+      return (x & z) | (y & ~z);
+    default:
+      return x ^ (y | ~z);
+  }
+}
+
+void transform(uint32_t *state, const uint8_t *block) {
+  uint32_t w[16];
+  for (int i = 0; i < 16; i++) {
+    uint32_t word;
+    std::memcpy(&word, block + 4 * i, sizeof word);
+    w[i] = le32toh(word);
+  }
+  uint32_t al = state[0], bl = state[1], cl = state[2], dl = state[3],
+           el = state[4];
+  uint32_t ar = al, br = bl, cr = cl, dr = dl, er = el;
+  for (int j = 0; j < 80; j++) {
+    const int round = j / 16;
+    uint32_t t = rotl(al + f(round, bl, cl, dl) + w[left_words[j]] +
+                          left_constants[round],
+                      left_rotations[j]) +
+                 el;
+    al = el;
+    el = dl;
+    dl = rotl(cl, 10);
+    cl = bl;
+    bl = t;
+    t = rotl(ar + f(4 - round, br, cr, dr) + w[right_words[j]] +
+                 right_constants[round],
+             right_rotations[j]) +
+        er;
+    ar = er;
+    er = dr;
+    dr = rotl(cr, 10);
+    cr = br;
+    br = t;
+  }
+  const uint32_t t = state[1] + cl + dr;
+  state[1] = state[2] + dl + er;
+  state[2] = state[3] + el + ar;
+  state[3] = state[4] + al + br;
+  state[4] = state[0] + bl + cr;
+  state[0] = t;
+}
+}  // namespace
+
+void hash(const uint8_t *data, size_t sz, uint8_t *out) {
+  uint32_t state[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+                       0xc3d2e1f0};
+  size_t left = sz;
+  for (; left >= 64; left -= 64, data += 64) {
+    transform(state, data);
+  }
+
+  // as for SHA-1, but with the bit length little-endian
+  uint8_t tail[128] = {0};
+  std::memcpy(tail, data, left);
+  tail[left] = 0x80;
+  const size_t tail_size = left < 56 ? 64 : 128;
+  const uint64_t bits = htole64(uint64_t(sz) * 8);
+  std::memcpy(tail + tail_size - 8, &bits, sizeof bits);
+  for (size_t i = 0; i < tail_size; i += 64) {
+    transform(state, tail + i);
+  }
+  for (int i = 0; i < 5; i++) {
+    const uint32_t word = htole32(state[i]);
+    std::memcpy(out + 4 * i, &word, sizeof word);
+  }
+}
+
+void hash160(const uint8_t *data, size_t sz, uint8_t *out) {
+  uint8_t sha[32];
+  sha256::hash(data, sz, sha);
+  hash(sha, sizeof sha, out);
+}
+}  // namespace ripemd160
+}  // namespace spv
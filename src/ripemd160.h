@@ -0,0 +1,31 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace spv {
+namespace ripemd160 {
+// out = RIPEMD160(data), where out has 20 bytes
+void hash(const uint8_t *data, size_t sz, uint8_t *out);
+
+// out = RIPEMD160(SHA256(data)), the "hash160" of keys and scripts in
+// addresses, where out has 20 bytes
+void hash160(const uint8_t *data, size_t sz, uint8_t *out);
+}  // namespace ripemd160
+}  // namespace spv
@@ -0,0 +1,496 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./rpc_server.h"
+
+#include <endian.h>
+#include <strings.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+#include "./logging.h"
+#include "./util.h"
+
+namespace spv {
+MODULE_LOGGER
+
+static const size_t max_clients = 64;
+static const size_t max_request_size = 1 << 20;
+static const std::chrono::seconds idle_timeout{30};
+
+// A client that sends requests faster than it reads the answers is
+// disconnected once this much is waiting to be written to it.
+static const size_t max_queued_bytes = 16 << 20;
+
+// bitcoind's own error codes
+static const int misc_error = -1;
+static const int invalid_address_or_key = -5;
+static const int invalid_parameter = -8;
+
+// the timestamps that make up the median time past
+static const size_t median_window = 11;
+
+static inline void put(Buffer &out, const char *str) {
+  out.append(str, std::strlen(str));
+}
+
+static inline void put(Buffer &out, const std::string &str) {
+  out.append(str.data(), str.size());
+}
+
+static void put_uint(Buffer &out, uint64_t val) {
+  char buf[20];
+  size_t n = 0;
+  do {
+    buf[sizeof buf - ++n] = '0' + val % 10;
+    val /= 10;
+  } while (val);
+  out.append(buf + sizeof buf - n, n);
+}
+
+static void put_int(Buffer &out, int64_t val) {
+  if (val < 0) {
+    put(out, "-");
+    put_uint(out, -uint64_t(val));
+  } else {
+    put_uint(out, val);
+  }
+}
+
+static void put_hex(Buffer &out, const void *data, size_t size) {
+  char buf[2 * BLOCK_HEADER_SIZE];
+  assert(size <= BLOCK_HEADER_SIZE);
+  hex_encode(data, size, buf);
+  out.append(buf, 2 * size);
+}
+
+// a quoted hex string, most significant byte first
+static void put_hash(Buffer &out, const hash_t &hash) {
+  put(out, "\"");
+  put_hex(out, hash.data(), hash.size());
+  put(out, "\"");
+}
+
+static void put_hex32(Buffer &out, uint32_t val) {
+  const uint32_t be_val = htobe32(val);
+  put(out, "\"");
+  put_hex(out, &be_val, sizeof be_val);
+  put(out, "\"");
+}
+
+// the difficulty of a compact target, as bitcoind computes it
+static double difficulty(uint32_t bits) {
+  int shift = (bits >> 24) & 0xff;
+  double diff = double(0x0000ffff) / double(bits & 0x00ffffff);
+  for (; shift < 29; shift++) {
+    diff *= 256.0;
+  }
+  for (; shift > 29; shift--) {
+    diff /= 256.0;
+  }
+  return diff;
+}
+
+RpcServer::RpcServer(std::shared_ptr<uvw::Loop> loop, const Chain &chain,
+                     TipFeed &feed)
+    : loop_(loop), chain_(chain), clients_(new size_t(0)), tips_(loop, feed) {}
+
+void RpcServer::listen(const std::string &host, uint16_t port) {
+  listener_ = loop_->resource<uvw::TcpHandle>();
+  listener_->on<uvw::ErrorEvent>([](const auto &exc, auto &) {
+    log->error("error serving rpc: {}", exc.what());
+  });
+  listener_->on<uvw::ListenEvent>(
+      [this](const auto &, auto &server) { accept(server); });
+  if (host.find(':') != std::string::npos) {
+    listener_->bind<uvw::IPv6>(host, port);
+  } else {
+    listener_->bind<uvw::IPv4>(host, port);
+  }
+  listener_->listen();
+  tips_.start();
+  log->info("serving json-rpc on {} port {}", host, port);
+}
+
+void RpcServer::close() {
+  if (listener_) {
+    listener_->close();
+    listener_.reset();
+  }
+  tips_.close();
+}
+
+void RpcServer::accept(uvw::TcpHandle &server) {
+  auto tcp = loop_->resource<uvw::TcpHandle>();
+  server.accept(*tcp);
+  if (*clients_ >= max_clients) {
+    tcp->close();
+    return;
+  }
+  ++*clients_;
+  tcp->noDelay(true);
+
+  // As for MetricsServer, the handles only refer to each other weakly. The
+  // timer closes a connection that has sat idle.
+  auto timer = loop_->resource<uvw::TimerHandle>();
+  std::weak_ptr<uvw::TcpHandle> weak_tcp = tcp;
+  timer->on<uvw::TimerEvent>([weak_tcp](const auto &, auto &timer) {
+    timer.close();
+    if (auto tcp = weak_tcp.lock()) {
+      tcp->close();
+    }
+  });
+  timer->start(idle_timeout, std::chrono::seconds(0));
+
+  struct State {
+    std::string in;
+    size_t queued = 0;
+    size_t writes = 0;  // in flight
+    bool closing = false;
+  };
+  auto state = std::make_shared<State>();
+  std::weak_ptr<uvw::TimerHandle> weak_timer = timer;
+  std::shared_ptr<size_t> clients = clients_;
+  tcp->once<uvw::CloseEvent>([weak_timer, clients](const auto &, auto &) {
+    --*clients;
+    if (auto timer = weak_timer.lock()) {
+      timer->close();
+    }
+  });
+  tcp->once<uvw::ErrorEvent>([](const auto &, auto &tcp) { tcp.close(); });
+  tcp->once<uvw::EndEvent>([](const auto &, auto &tcp) { tcp.close(); });
+  tcp->on<uvw::WriteEvent>([state](const auto &, auto &) {
+    // every write is a whole number of responses
+    state->queued = 0;
+    state->writes--;
+  });
+  tcp->on<uvw::DataEvent>([this, state, weak_timer](const auto &data,
+                                                     auto &tcp) {
+    if (state->closing) {
+      return;
+    }
+    if (auto timer = weak_timer.lock()) {
+      timer->start(idle_timeout, std::chrono::seconds(0));
+    }
+    state->in.append(data.data.get(), data.length);
+    Encoder out;
+    const After after = serve(state->in, out);
+    if (after == After::UPGRADE) {
+      // From here on the connection is tips_'s, with none of our callbacks
+      // or the idle timer, and it doesn't count against max_clients.
+      if (auto timer = weak_timer.lock()) {
+        timer->close();
+      }
+      --*clients_;
+      std::string head(out.data(), out.size());
+      std::string rest = std::move(state->in);
+      tcp.clear();
+      tips_.add(tcp.shared_from_this(), state->writes, std::move(head),
+                std::move(rest));
+      return;
+    }
+    if (out.size()) {
+      if (state->queued + out.size() > max_queued_bytes) {
+        log->warn("closing an rpc client that isn't reading its answers");
+        tcp.close();
+        return;
+      }
+      state->queued += out.size();
+      size_t sz;
+      std::unique_ptr<char[]> buf = out.serialize(sz, false);
+      tcp.write(std::move(buf), sz);
+      state->writes++;
+    }
+    if (after == After::CLOSE) {
+      state->closing = true;
+      tcp.template once<uvw::ShutdownEvent>(
+          [](const auto &, auto &tcp) { tcp.close(); });
+      tcp.shutdown();
+    }
+  });
+  tcp->read();
+}
+
+RpcServer::After RpcServer::serve(std::string &in, Encoder &out) const {
+  for (;;) {
+    const size_t head_end = in.find("\r\n\r\n");
+    if (head_end == std::string::npos) {
+      return in.size() <= max_request_size ? After::KEEP : After::CLOSE;
+    }
+    const size_t line_end = in.find("\r\n");
+    const std::string line = in.substr(0, line_end);
+    const size_t sp1 = line.find(' '), sp2 = line.rfind(' ');
+    if (sp1 == std::string::npos || sp1 == sp2) {
+      put(out, "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n"
+               "Connection: close\r\n\r\n");
+      return After::CLOSE;
+    }
+    const bool http11 = line.compare(sp2 + 1, std::string::npos,
+                                     "HTTP/1.1") == 0;
+    const bool post = line.compare(0, sp1, "POST") == 0;
+    const bool get = line.compare(0, sp1, "GET") == 0;
+    const std::string path = line.substr(sp1 + 1, sp2 - sp1 - 1);
+
+    size_t length = 0;
+    bool keep = http11;
+    bool websocket = false;
+    std::string ws_key;
+    for (size_t pos = line_end + 2; pos < head_end;) {
+      const size_t end = in.find("\r\n", pos);
+      const size_t colon = in.find(':', pos);
+      if (colon < end) {
+        size_t val = colon + 1;
+        while (val < end && in[val] == ' ') {
+          val++;
+        }
+        const char *name = in.data() + pos;
+        const size_t name_len = colon - pos;
+        const std::string value = in.substr(val, end - val);
+        if (name_len == 14 && strncasecmp(name, "content-length", 14) == 0) {
+          length = std::strtoul(value.c_str(), nullptr, 10);
+        } else if (name_len == 10 &&
+                   strncasecmp(name, "connection", 10) == 0) {
+          if (strcasecmp(value.c_str(), "close") == 0) {
+            keep = false;
+          } else if (strcasecmp(value.c_str(), "keep-alive") == 0) {
+            keep = true;
+          }
+        } else if (name_len == 7 && strncasecmp(name, "upgrade", 7) == 0) {
+          websocket = strcasecmp(value.c_str(), "websocket") == 0;
+        } else if (name_len == 17 &&
+                   strncasecmp(name, "sec-websocket-key", 17) == 0) {
+          ws_key = value;
+        }
+      }
+      pos = end + 2;
+    }
+    if (length > max_request_size) {
+      put(out, "HTTP/1.1 413 Payload Too Large\r\nContent-Length: 0\r\n"
+               "Connection: close\r\n\r\n");
+      return After::CLOSE;
+    }
+    const size_t body_start = head_end + 4;
+    if (in.size() < body_start + length) {
+      return After::KEEP;  // wait for the rest of the body
+    }
+
+    if (get && websocket) {
+      if (path != "/tips" || ws_key.empty() || tips_.full()) {
+        put(out, path != "/tips" ? "HTTP/1.1 404 Not Found"
+                 : ws_key.empty() ? "HTTP/1.1 400 Bad Request"
+                                  : "HTTP/1.1 503 Service Unavailable");
+        put(out, "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        return After::CLOSE;
+      }
+      put(out, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+               "Connection: Upgrade\r\nSec-WebSocket-Accept: ");
+      put(out, TipStream::accept_key(ws_key));
+      put(out, "\r\n\r\n");
+      in.erase(0, body_start + length);
+      return After::UPGRADE;
+    }
+
+    Buffer body(256);
+    int status = 405;
+    if (post) {
+      status = answer(in.data() + body_start, length, body);
+    } else {
+      put(body, "JSONRPC server handles only POST requests");
+    }
+    put(out, "HTTP/1.1 ");
+    put_uint(out, status);
+    put(out, status == 200   ? " OK"
+             : status == 400 ? " Bad Request"
+             : status == 404 ? " Not Found"
+             : status == 405 ? " Method Not Allowed"
+                             : " Internal Server Error");
+    put(out, "\r\nContent-Type: application/json\r\nContent-Length: ");
+    put_uint(out, body.size());
+    put(out, keep ? "\r\n\r\n" : "\r\nConnection: close\r\n\r\n");
+    out.append(body.data(), body.size());
+    in.erase(0, body_start + length);
+    if (!keep) {
+      return After::CLOSE;
+    }
+  }
+}
+
+int RpcServer::answer(const char *body, size_t size, Buffer &out) const {
+  JsonCursor cur(body, size);
+  const bool batch = cur.eat('[');
+  if (batch) {
+    put(out, "[");
+  }
+  int status = 200;
+  bool first = true;
+  if (!batch || !cur.eat(']')) {
+    do {
+      if (!first) {
+        put(out, ",");
+      }
+      first = false;
+      JsonRequest req;
+      if (!parse_json_request(cur, req)) {
+        put(out, "{\"result\":null,\"error\":{\"code\":");
+        put_int(out, RPC_PARSE_ERROR);
+        put(out, ",\"message\":\"Parse error\"},\"id\":null}");
+        status = 500;
+        break;
+      }
+      int error = 0;
+      std::string message;
+      put(out, "{\"result\":");
+      call(req, out, error, message);
+      if (error) {
+        put(out, "null,\"error\":{\"code\":");
+        put_int(out, error);
+        put(out, ",\"message\":\"");
+        put(out, message);
+        put(out, "\"}");
+        status = error == RPC_METHOD_NOT_FOUND  ? 404
+                 : error == RPC_INVALID_REQUEST ? 400
+                                                : 500;
+      } else {
+        put(out, ",\"error\":null");
+      }
+      put(out, ",\"id\":");
+      put(out, req.id);
+      put(out, "}");
+    } while (batch && cur.eat(','));
+  }
+  put(out, batch ? "]\n" : "\n");
+  // a batch always succeeds, whatever its calls did
+  return batch ? 200 : status;
+}
+
+void RpcServer::call(const JsonRequest &req, Buffer &out, int &error,
+                     std::string &message) const {
+  const std::string &m = req.method;
+  if (m == "getblockcount") {
+    put_uint(out, chain_.height());
+  } else if (m == "getbestblockhash") {
+    put_hash(out, chain_.tip().block_hash);
+  } else if (m == "getblockhash") {
+    size_t height;
+    if (!req.size_param(0, height)) {
+      error = misc_error;
+      message = "getblockhash height";
+      return;
+    }
+    const IndexEntry *entry =
+        height <= chain_.height() ? chain_.best_entry(height) : nullptr;
+    if (entry == nullptr) {
+      error = invalid_parameter;
+      message = "Block height out of range";
+      return;
+    }
+    put_hash(out, entry->hash);
+  } else if (m == "getblockheader") {
+    hash_t hash;
+    if (req.params.empty()) {
+      error = misc_error;
+      message = "getblockheader \\\"blockhash\\\" ( verbose )";
+      return;
+    }
+    if (!req.hex32_param(0, hash.data())) {
+      error = invalid_parameter;
+      message = "blockhash must be of length 64";
+      return;
+    }
+    const bool verbose = req.params.size() < 2 ||
+                         (req.params[1] != "false" && req.params[1] != "0");
+    const IndexEntry *entry = chain_.index_entry(hash);
+    if (entry == nullptr) {
+      error = invalid_address_or_key;
+      message = "Block not found";
+      return;
+    }
+    if (verbose) {
+      header_json(*entry, out);
+    } else {
+      put(out, "\"");
+      put_hex(out, entry->data.data(), entry->data.size());
+      put(out, "\"");
+    }
+  } else {
+    error = RPC_METHOD_NOT_FOUND;
+    message = "Method not found";
+  }
+}
+
+void RpcServer::header_json(const IndexEntry &entry, Buffer &out) const {
+  const BlockHeader hdr = entry.header();
+  const size_t tip = chain_.height();
+  const bool best = chain_.on_best_chain(entry);
+
+  // walk back through the parents for the median time past
+  uint32_t times[median_window];
+  size_t n = 0;
+  for (const IndexEntry *e = &entry; e != nullptr && n < median_window;) {
+    times[n++] = e->timestamp();
+    if (e->height == 0) {
+      break;
+    }
+    hash_t prev;
+    std::reverse_copy(e->data.data() + 4, e->data.data() + 36, prev.begin());
+    e = chain_.index_entry(prev);
+  }
+  std::sort(times, times + n);
+
+  put(out, "{\"hash\":");
+  put_hash(out, entry.hash);
+  put(out, ",\"confirmations\":");
+  put_int(out, best ? int64_t(tip - entry.height + 1) : -1);
+  put(out, ",\"height\":");
+  put_uint(out, entry.height);
+  put(out, ",\"version\":");
+  put_uint(out, hdr.version);
+  put(out, ",\"versionHex\":");
+  put_hex32(out, hdr.version);
+  put(out, ",\"merkleroot\":");
+  put_hash(out, hdr.merkle_root);
+  put(out, ",\"time\":");
+  put_uint(out, hdr.timestamp);
+  put(out, ",\"mediantime\":");
+  put_uint(out, times[n / 2]);
+  put(out, ",\"nonce\":");
+  put_uint(out, hdr.nonce);
+  put(out, ",\"bits\":");
+  put_hex32(out, hdr.difficulty);
+  put(out, ",\"difficulty\":");
+  char diff[32];
+  const int len =
+      std::snprintf(diff, sizeof diff, "%.16g", difficulty(hdr.difficulty));
+  out.append(diff, len);
+  put(out, ",\"chainwork\":");
+  put_hash(out, entry.chainwork.to_hash());
+  if (entry.height > 0) {
+    put(out, ",\"previousblockhash\":");
+    put_hash(out, hdr.prev_block);
+  }
+  if (best && entry.height < tip) {
+    const IndexEntry *next = chain_.best_entry(entry.height + 1);
+    if (next != nullptr) {
+      put(out, ",\"nextblockhash\":");
+      put_hash(out, next->hash);
+    }
+  }
+  put(out, "}");
+}
+}  // namespace spv
@@ -0,0 +1,90 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "./chain.h"
+#include "./encoder.h"
+#include "./json.h"
+#include "./tip_stream.h"
+#include "./uvw.h"
+
+namespace spv {
+// Answers the bitcoind JSON-RPC calls that header tools use, over HTTP on
+// the client's loop and straight from the in-memory header index:
+//
+//   getblockcount, getbestblockhash, getblockhash height,
+//   getblockheader hash [verbose]
+//
+// A POST body is one request or a batch array of them. Connections are
+// kept alive, as HTTP/1.1 has it unless the client asks otherwise, and
+// requests on one may be pipelined; the answers to everything that arrived
+// in one read go out in one write. Responses are written by a small JSON
+// writer into an Encoder from the slab pool, which is handed to libuv as
+// it is, with hashes and headers hex encoded by hex_encode(). A GET of
+// /tips that asks to upgrade to a WebSocket is handed to a TipStream, which
+// pushes tip changes to it. There's no authentication, so it should only
+// listen where the tools are.
+class RpcServer {
+ public:
+  RpcServer(std::shared_ptr<uvw::Loop> loop, const Chain &chain,
+            TipFeed &feed);
+  RpcServer(const RpcServer &other) = delete;
+  ~RpcServer() { close(); }
+
+  void listen(const std::string &host, uint16_t port);
+
+  // stop listening and disconnect the tip stream; other connections close
+  // once they're idle
+  void close();
+
+  // Answer a request body as bitcoind would, appending the JSON to out.
+  // Returns the HTTP status.
+  int answer(const char *body, size_t size, Buffer &out) const;
+
+ private:
+  std::shared_ptr<uvw::Loop> loop_;
+  const Chain &chain_;
+  std::shared_ptr<uvw::TcpHandle> listener_;
+  std::shared_ptr<size_t> clients_;  // open connections, shared with them
+  TipStream tips_;
+
+  enum class After {
+    KEEP,     // wait for the next request
+    CLOSE,    // close once out is written
+    UPGRADE,  // hand the connection to tips_, with out still to write
+  };
+
+  void accept(uvw::TcpHandle &server);
+
+  // Answer the complete HTTP requests at the front of in, consuming them,
+  // up to one that asks for the connection to be closed, is malformed, or
+  // upgrades to a WebSocket.
+  After serve(std::string &in, Encoder &out) const;
+
+  // the result of one call, or with error set its message
+  void call(const JsonRequest &req, Buffer &out, int &error,
+            std::string &message) const;
+
+  // the verbose form of getblockheader
+  void header_json(const IndexEntry &entry, Buffer &out) const;
+};
+}  // namespace spv
@@ -0,0 +1,277 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./scheduler.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "./affinity.h"
+#include "./logging.h"
+
+namespace spv {
+MODULE_LOGGER
+
+// Tasks a worker's deque holds before spawns overflow into the queues.
+static const size_t deque_capacity = 4096;
+static_assert((deque_capacity & (deque_capacity - 1)) == 0,
+              "the deque capacity must be a power of two");
+
+// A bounded Chase-Lev deque, as in "Correct and Efficient Work-Stealing for
+// Weak Memory Models" (Lê et al., 2013). Only the owner pushes and pops,
+// at the bottom; anyone may steal from the top.
+struct Scheduler::Worker {
+  Scheduler *sched;
+  size_t id;
+  std::atomic<int64_t> top;
+  std::atomic<int64_t> bottom;
+  std::unique_ptr<std::atomic<Task *>[]> slots;
+
+  Worker(Scheduler *sched, size_t id)
+      : sched(sched),
+        id(id),
+        top(0),
+        bottom(0),
+        slots(new std::atomic<Task *>[deque_capacity]) {}
+
+  inline std::atomic<Task *> &slot(int64_t i) {
+    return slots[size_t(i) & (deque_capacity - 1)];
+  }
+
+  // false if the deque is full
+  bool push(Task *task) {
+    const int64_t b = bottom.load(std::memory_order_relaxed);
+    const int64_t t = top.load(std::memory_order_acquire);
+    if (b - t >= int64_t(deque_capacity)) {
+      return false;
+    }
+    slot(b).store(task, std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_release);
+    return true;
+  }
+
+  Task *pop() {
+    const int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+    if (t > b) {
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    Task *task = slot(b).load(std::memory_order_relaxed);
+    if (t == b) {
+      // the last one, which a thief may be taking too
+      if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                       std::memory_order_relaxed)) {
+        task = nullptr;
+      }
+      bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return task;
+  }
+
+  Task *steal() {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const int64_t b = bottom.load(std::memory_order_acquire);
+    if (t >= b) {
+      return nullptr;
+    }
+    Task *task = slot(t).load(std::memory_order_acquire);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed)) {
+      return nullptr;  // lost the race, to the owner or another thief
+    }
+    return task;
+  }
+};
+
+thread_local Scheduler::Worker *Scheduler::current_ = nullptr;
+
+inline Scheduler::Worker *Scheduler::own_worker() const {
+  return current_ != nullptr && current_->sched == this ? current_ : nullptr;
+}
+
+Scheduler::Scheduler(size_t threads)
+    : queued_(0), sleeping_(0), stop_(false) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+#ifdef SPV_SIMULATION
+  threads = 0;  // see Simulation::settle()
+#endif
+  for (size_t i = 0; i < threads; i++) {
+    workers_.emplace_back(new Worker(this, i));
+  }
+  for (size_t i = 0; i < threads; i++) {
+    threads_.emplace_back([this, self = workers_[i].get()]() { run(self); });
+  }
+  log->info("started {} worker threads", threads);
+}
+
+Scheduler::~Scheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wakeup_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+  // tasks still queued at exit are dropped
+  for (auto &queue : queues_) {
+    for (Task *task : queue) {
+      delete task;
+    }
+  }
+  for (auto &worker : workers_) {
+    while (Task *task = worker->pop()) {
+      delete task;
+    }
+  }
+}
+
+void Scheduler::submit(Priority priority, Task &&task) {
+  push(own_worker(), priority, new Task(std::move(task)));
+}
+
+void Scheduler::post(uvw::Loop &loop, Priority priority, Task &&work,
+                     Task &&done) {
+  // The handle is active until it's closed, which holds the loop open
+  // while the work is out, and its event brings done back to the loop.
+  auto async = loop.resource<uvw::AsyncHandle>();
+  async->once<uvw::AsyncEvent>(
+      [done = std::move(done)](const auto &, auto &handle) {
+        handle.close();
+        done();
+      });
+  submit(priority, [async, work = std::move(work)]() {
+    work();
+    async->send();
+  });
+}
+
+void Scheduler::push(Worker *self, Priority priority, Task *task) {
+  queued_.fetch_add(1, std::memory_order_seq_cst);
+  if (self == nullptr || !self->push(task)) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queues_[size_t(priority)].push_back(task);
+  }
+  wake();
+}
+
+void Scheduler::wake() {
+  // A worker counts itself as sleeping, under the mutex, before it checks
+  // queued_ for the last time, so either it sees the task or this sees it.
+  if (sleeping_.load(std::memory_order_seq_cst) > 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    wakeup_.notify_one();
+  }
+}
+
+Scheduler::Task *Scheduler::take_queued() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto &queue : queues_) {
+    if (!queue.empty()) {
+      Task *task = queue.front();
+      queue.pop_front();
+      return task;
+    }
+  }
+  return nullptr;
+}
+
+Scheduler::Task *Scheduler::take(Worker *self) {
+  if (queued_.load(std::memory_order_acquire) == 0) {
+    return nullptr;
+  }
+  Task *task = self != nullptr ? self->pop() : nullptr;
+  if (task == nullptr) {
+    task = take_queued();
+  }
+  // steal going round from the next worker, so thieves spread out
+  const size_t start = self != nullptr ? self->id + 1 : 0;
+  for (size_t i = 0; task == nullptr && i < workers_.size(); i++) {
+    Worker *victim = workers_[(start + i) % workers_.size()].get();
+    if (victim != self) {
+      task = victim->steal();
+    }
+  }
+  if (task != nullptr) {
+    queued_.fetch_sub(1, std::memory_order_relaxed);
+  }
+  return task;
+}
+
+bool Scheduler::run_one() {
+  std::unique_ptr<Task> task(take(own_worker()));
+  if (!task) {
+    return false;
+  }
+  (*task)();
+  return true;
+}
+
+void Scheduler::run(Worker *self) {
+  current_ = self;
+  place_thread(ThreadGroup::WORKERS);
+  for (;;) {
+    if (run_one()) {
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    sleeping_.fetch_add(1, std::memory_order_seq_cst);
+    while (!stop_ && queued_.load(std::memory_order_seq_cst) == 0) {
+      wakeup_.wait(lock);
+    }
+    sleeping_.fetch_sub(1, std::memory_order_relaxed);
+    if (stop_) {
+      return;
+    }
+  }
+}
+
+static std::unique_ptr<Scheduler> the_scheduler;
+static std::once_flag scheduler_once;
+
+void start_scheduler(size_t threads) {
+  std::call_once(scheduler_once,
+                 [threads]() { the_scheduler.reset(new Scheduler(threads)); });
+}
+
+Scheduler &scheduler() {
+  start_scheduler(0);
+  return *the_scheduler;
+}
+
+void TaskGroup::run(Scheduler::Task &&task) {
+  left_.fetch_add(1, std::memory_order_relaxed);
+  scheduler().submit(priority_, [this, task = std::move(task)]() {
+    task();
+    left_.fetch_sub(1, std::memory_order_release);
+  });
+}
+
+void TaskGroup::wait() {
+  while (left_.load(std::memory_order_acquire) > 0) {
+    if (!scheduler().run_one()) {
+      std::this_thread::yield();  // the rest are running elsewhere
+    }
+  }
+}
+}  // namespace spv
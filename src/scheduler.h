@@ -0,0 +1,131 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "./config.h"
+#include "./uvw.h"
+
+namespace spv {
+// Which work a worker picks up first, of what's queued from outside the
+// pool. Work that tasks spawn themselves stays with them; see Scheduler.
+enum class Priority {
+  HIGH,    // on the sync path: header validation and block verification
+  NORMAL,  // e.g. hashing an import, deriving keys, matching filters
+  LOW,     // background checks, like the database verifier
+  NUM_PRIORITIES,
+};
+
+// One pool of worker threads for the CPU-bound work of every client in the
+// process, sized by --worker-threads and pinned with --worker-cpus. Each
+// worker has a Chase-Lev deque: tasks a worker spawns go on the bottom of
+// its own, where it pops them newest first while they're still in cache,
+// and idle workers steal the oldest from the top of the others' without
+// locks. Tasks from threads outside the pool, like the event loops, go in
+// a queue per Priority, which the workers check (highest first) before
+// stealing. Workers with nothing to do sleep until a task is queued.
+//
+// With --enable-simulation there are no workers: the Simulation runs the
+// queued tasks on its own thread with run_one(), so that they finish in
+// the same order every run.
+class Scheduler {
+ public:
+  typedef std::function<void()> Task;
+
+  // start this many workers, or with 0 one per --worker-cpus or per CPU
+  explicit Scheduler(size_t threads);
+  Scheduler(const Scheduler &other) = delete;
+  ~Scheduler();
+
+  // how many ways to split work: the workers, or 1 in a simulation
+  inline size_t threads() const {
+    return std::max<size_t>(1, workers_.size());
+  }
+
+  // run a task on the pool, from any thread
+  void submit(Priority priority, Task &&task);
+
+  // Run work on the pool and then done on the loop's thread; on the loop's
+  // thread. Like a uvw::WorkReq, this keeps the loop alive until done has
+  // run.
+  void post(uvw::Loop &loop, Priority priority, Task &&work, Task &&done);
+
+  // Run one queued task on the calling thread, if there is one; for
+  // TaskGroup::wait(), which helps rather than blocks.
+  bool run_one();
+
+ private:
+  struct Worker;
+
+  // the worker the calling thread is, if it's one
+  static thread_local Worker *current_;
+
+  std::vector<std::unique_ptr<Worker> > workers_;
+  std::vector<std::thread> threads_;
+
+  std::mutex mutex_;  // for queues_ and the sleepers
+  std::condition_variable wakeup_;
+  std::deque<Task *> queues_[size_t(Priority::NUM_PRIORITIES)];
+  std::atomic<size_t> queued_;  // tasks in queues_ and every deque
+  std::atomic<size_t> sleeping_;
+  bool stop_;
+
+  inline Worker *own_worker() const;
+  void run(Worker *self);
+  Task *take(Worker *self);
+  Task *take_queued();
+  void push(Worker *self, Priority priority, Task *task);
+  void wake();
+};
+
+// The process's Scheduler, started with start_scheduler(), or on first use
+// with a worker per CPU.
+Scheduler &scheduler();
+
+// Size the scheduler from the settings; this has to happen before its
+// first use, e.g. in main() right after the thread groups are set.
+void start_scheduler(size_t threads);
+
+// Fork-join on the scheduler: run() tasks, then wait() for all of them,
+// running queued tasks on the waiting thread in the meantime.
+class TaskGroup {
+ public:
+  explicit TaskGroup(Priority priority = Priority::NORMAL)
+      : priority_(priority), left_(0) {}
+  TaskGroup(const TaskGroup &other) = delete;
+  ~TaskGroup() { wait(); }
+
+  void run(Scheduler::Task &&task);
+  void wait();
+
+ private:
+  Priority priority_;
+  std::atomic<size_t> left_;
+};
+}  // namespace spv
@@ -0,0 +1,129 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./script_index.h"
+
+#include <algorithm>
+#include <set>
+
+#include "./sha256.h"
+#include "./tx.h"
+#include "./util.h"
+#include "./watch.h"
+
+namespace spv {
+// the order of a history, with the unconfirmed transactions last
+static inline size_t sort_height(size_t height) {
+  return height ? height : SIZE_MAX;
+}
+
+hash_t ScriptIndex::script_hash(const std::string &script) {
+  hash_t out;
+  sha256::hash(reinterpret_cast<const uint8_t *>(script.data()),
+               script.size(), out.data());
+  std::reverse(out.begin(), out.end());
+  return out;
+}
+
+bool ScriptIndex::note(Entry &entry, const hash_t &txid, size_t height) {
+  auto it =
+      std::find_if(entry.history.begin(), entry.history.end(),
+                   [&txid](const Item &item) { return item.txid == txid; });
+  if (it != entry.history.end()) {
+    if (it->height == height) {
+      return false;
+    }
+    entry.history.erase(it);
+  }
+  // after the items at the same height, which keeps a block's in order
+  auto pos = std::upper_bound(
+      entry.history.begin(), entry.history.end(), sort_height(height),
+      [](size_t h, const Item &item) { return h < sort_height(item.height); });
+  entry.history.insert(pos, Item{txid, height});
+  return true;
+}
+
+void ScriptIndex::add(const hash_t &txid, const Tx &tx, size_t height) {
+  std::set<hash_t> touched;
+  for (const TxIn &in : tx.inputs) {
+    auto out = outputs_.find(Outpoint{in.prev_hash, in.prev_index});
+    if (out == outputs_.end()) {
+      continue;
+    }
+    Entry &entry = entries_[out->second];
+    auto utxo = std::find_if(entry.utxos.begin(), entry.utxos.end(),
+                             [&out](const Utxo &u) {
+                               return u.outpoint == out->first;
+                             });
+    if (utxo != entry.utxos.end()) {
+      entry.utxos.erase(utxo);
+    }
+    if (note(entry, txid, height)) {
+      touched.insert(out->second);
+    }
+  }
+  for (uint32_t i = 0; i < tx.outputs.size(); i++) {
+    const TxOut &out = tx.outputs[i];
+    if (!watch_.contains(out.script)) {
+      continue;
+    }
+    const hash_t sh = script_hash(out.script);
+    const Outpoint outpoint{txid, i};
+    Entry &entry = entries_[sh];
+    outputs_[outpoint] = sh;
+    auto utxo = std::find_if(
+        entry.utxos.begin(), entry.utxos.end(),
+        [&outpoint](const Utxo &u) { return u.outpoint == outpoint; });
+    if (utxo == entry.utxos.end()) {
+      entry.utxos.push_back(Utxo{outpoint, out.value, height});
+    } else {
+      utxo->height = height;
+    }
+    if (note(entry, txid, height)) {
+      touched.insert(sh);
+    }
+  }
+  if (changed) {
+    for (const auto &sh : touched) {
+      changed(sh);
+    }
+  }
+}
+
+const ScriptIndex::Entry *ScriptIndex::find(const hash_t &script_hash) const {
+  auto it = entries_.find(script_hash);
+  return it == entries_.end() || it->second.history.empty() ? nullptr
+                                                            : &it->second;
+}
+
+bool ScriptIndex::status(const hash_t &script_hash, hash_t &out) const {
+  const Entry *entry = find(script_hash);
+  if (entry == nullptr) {
+    return false;
+  }
+  std::string concat;
+  concat.reserve(entry->history.size() * 74);
+  for (const Item &item : entry->history) {
+    concat += to_hex(item.txid);
+    concat += ':';
+    concat += std::to_string(item.height);
+    concat += ':';
+  }
+  sha256::hash(reinterpret_cast<const uint8_t *>(concat.data()),
+               concat.size(), out.data());
+  return true;
+}
+}  // namespace spv
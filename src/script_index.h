@@ -0,0 +1,94 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "./constants.h"
+#include "./hashmap.h"
+#include "./mempool.h"
+
+namespace spv {
+struct Tx;
+class WatchList;
+
+// ScriptIndex is the history of the watched output scripts by Electrum
+// script hash, the SHA256 of the script in display order, for
+// ElectrumServer. It's built from the matching transactions the client
+// scans, in blocks and in relay, so it covers the blocks since startup and
+// any rescan. An output counts towards its script if the whole script is
+// watched, and an input towards the script of the output it spends, if
+// that output was seen.
+class ScriptIndex {
+ public:
+  // a transaction touching the script, at height 0 while unconfirmed
+  struct Item {
+    hash_t txid;
+    size_t height;
+  };
+
+  struct Utxo {
+    Outpoint outpoint;
+    uint64_t value;
+    size_t height;
+  };
+
+  struct Entry {
+    std::vector<Item> history;  // by height, the unconfirmed ones last
+    std::vector<Utxo> utxos;
+  };
+
+  // called with each script hash whose history changes
+  typedef std::function<void(const hash_t &script_hash)> Callback;
+
+  ScriptIndex() = delete;
+  ScriptIndex(const ScriptIndex &other) = delete;
+  explicit ScriptIndex(const WatchList &watch) : watch_(watch) {}
+
+  Callback changed;
+
+  static hash_t script_hash(const std::string &script);
+
+  // Add a matching transaction, which may already be there unconfirmed.
+  void add(const hash_t &txid, const Tx &tx, size_t height);
+
+  // the script's entry, or nullptr if it has no history
+  const Entry *find(const hash_t &script_hash) const;
+
+  // The Electrum status of the script: the SHA256 of "txid:height:" for
+  // each item of its history. Returns false if it has none.
+  bool status(const hash_t &script_hash, hash_t &out) const;
+
+  inline size_t size() const { return entries_.size(); }
+
+ private:
+  const WatchList &watch_;
+  std::unordered_map<hash_t, Entry, BlockHashHasher> entries_;
+
+  // the watched outputs, to the script hashes they pay
+  std::unordered_map<Outpoint, hash_t, OutpointHasher> outputs_;
+
+  // record txid in the history; returns false if it was already there at
+  // this height
+  static bool note(Entry &entry, const hash_t &txid, size_t height);
+};
+}  // namespace spv
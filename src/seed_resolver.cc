@@ -0,0 +1,207 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./seed_resolver.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include "./decoder.h"
+#include "./encoder.h"
+#include "./logging.h"
+#include "./util.h"
+
+namespace spv {
+MODULE_LOGGER
+
+static const char file_magic[4] = {'S', 'P', 'V', 'S'};
+static const uint32_t file_version = 1;
+
+// more than any seeder returns, so a bad file can't ask for much memory
+static const size_t max_seed_addrs = 256;
+static const size_t max_seeds = 64;
+
+SeedResolver::SeedResolver(std::shared_ptr<uvw::Loop> loop, uint16_t port,
+                           Callback cb)
+    : loop_(loop), port_(port), cb_(cb), found_(0), enough_(0) {}
+
+void SeedResolver::resolve(const char *const *seeds, size_t n,
+                           uint64_t services, size_t enough) {
+  found_ = 0;
+  enough_ = enough;
+  const uint32_t now = uint32_t(cached_time());
+  for (size_t i = 0; i < n; i++) {
+    const std::string seed = seeds[i];
+    auto it = cache_.find(seed);
+    if (it != cache_.end() && now - it->second.time < SEED_TTL) {
+      LOG_DEBUG(log, "using {} cached address(es) from seed {}",
+                it->second.addrs.size(), seed);
+      found_ += it->second.addrs.size();
+      cb_(it->second.addrs);
+      continue;
+    }
+    if (services) {
+      char prefix[20];
+      std::snprintf(prefix, sizeof prefix, "x%llx.",
+                    static_cast<unsigned long long>(services));
+      lookup(seed, prefix + seed);
+    } else {
+      lookup(seed, seed);
+    }
+  }
+  if (found_ >= enough_) {
+    cancel();
+  }
+}
+
+void SeedResolver::lookup(const std::string &seed, const std::string &name) {
+  auto request = loop_->resource<uvw::GetAddrInfoReq>();
+  request->on<uvw::ErrorEvent>([=](const auto &, auto &req) {
+    if (!remove(&req)) {
+      return;
+    }
+    if (name != seed) {
+      LOG_DEBUG(log, "seed {} has no filtered answers, asking it plainly",
+                seed);
+      lookup(seed, seed);
+    } else {
+      log->warn("async dns resolution to {} failed", seed);
+    }
+  });
+  request->on<uvw::AddrInfoEvent>([=](const auto &event, auto &req) {
+    if (!remove(&req)) {
+      return;
+    }
+    std::vector<Addr> addrs;
+    for (const addrinfo *p = event.data.get(); p != nullptr; p = p->ai_next) {
+      const Addr addr(p, port_);
+      if (addr.af() != -1 &&
+          std::find(addrs.begin(), addrs.end(), addr) == addrs.end() &&
+          addrs.size() < max_seed_addrs) {
+        addrs.push_back(addr);
+      }
+    }
+    answer(seed, std::move(addrs));
+  });
+  // just the one socket type, or every address comes back three times
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  request->nodeAddrInfo(name, &hints);
+  requests_.push_back(request);
+}
+
+void SeedResolver::answer(const std::string &seed, std::vector<Addr> &&addrs) {
+  LOG_DEBUG(log, "seed {} returned {} address(es)", seed, addrs.size());
+  found_ += addrs.size();
+  Cached &entry = cache_[seed];
+  entry.time = uint32_t(cached_time());
+  entry.addrs = std::move(addrs);
+  save();
+  cb_(entry.addrs);
+  if (found_ >= enough_ && !requests_.empty()) {
+    log->info("have {} address(es) from the dns seeds, cancelling {} lookup(s)",
+              found_, requests_.size());
+    cancel();
+  }
+}
+
+bool SeedResolver::remove(uvw::GetAddrInfoReq *req) {
+  auto it = std::find_if(requests_.begin(), requests_.end(),
+                         [=](const auto &p) { return p.get() == req; });
+  if (it == requests_.end()) {
+    return false;
+  }
+  requests_.erase(it);
+  return true;
+}
+
+void SeedResolver::cancel() {
+  for (auto &req : requests_) {
+    req->cancel();
+  }
+  requests_.clear();
+}
+
+void SeedResolver::load(const std::string &path) {
+  path_ = path;
+  cache_.clear();
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return;
+  }
+  const std::string data((std::istreambuf_iterator<char>(file)),
+                         std::istreambuf_iterator<char>());
+  Decoder dec(data.data(), data.size());
+  try {
+    char magic[sizeof file_magic];
+    uint32_t version;
+    dec.pull_buf(magic, sizeof magic);
+    dec.pull(version);
+    if (std::memcmp(magic, file_magic, sizeof magic) != 0 ||
+        version != file_version) {
+      throw BadMessage("not a seed cache");
+    }
+    const size_t seeds = dec.pull_count(max_seeds, "seed");
+    for (size_t i = 0; i < seeds; i++) {
+      std::string seed;
+      Cached entry;
+      dec.pull(seed);
+      dec.pull(entry.time);
+      entry.addrs.resize(dec.pull_count(max_seed_addrs, "seed address"));
+      for (auto &addr : entry.addrs) {
+        dec.pull(addr);
+      }
+      cache_[seed] = std::move(entry);
+    }
+  } catch (const DecodeError &exc) {
+    log->warn("ignoring bad seed cache {}: {}", path, exc.what());
+    cache_.clear();
+    return;
+  }
+  LOG_DEBUG(log, "loaded {} cached seed(s) from {}", cache_.size(), path);
+}
+
+void SeedResolver::save() const {
+  if (path_.empty()) {
+    return;
+  }
+  Encoder enc;
+  enc.append(file_magic, sizeof file_magic);
+  enc.push(file_version);
+  enc.push_varint(cache_.size());
+  for (const auto &pr : cache_) {
+    enc.push(pr.first);
+    enc.push(pr.second.time);
+    enc.push_varint(pr.second.addrs.size());
+    for (const auto &addr : pr.second.addrs) {
+      enc.push(addr);
+    }
+  }
+
+  // a new file renamed over the old one, as in AddrManager::save()
+  const std::string tmp = path_ + ".tmp";
+  std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+  file.write(enc.data(), enc.size());
+  file.close();
+  if (!file || std::rename(tmp.c_str(), path_.c_str()) != 0) {
+    log->warn("failed to save the seed cache to {}", path_);
+  }
+}
+}  // namespace spv
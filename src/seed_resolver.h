@@ -0,0 +1,90 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "./addr.h"
+#include "./uvw.h"
+
+namespace spv {
+// SeedResolver looks up the DNS seeds, all at once on the libuv thread
+// pool. Each seed is asked for peers with the services we want first, with
+// the "x9." style prefix that the seeders support, and by its plain name if
+// that fails. Answers are cached and saved next to the peer table, so that
+// falling back to the seeds again, or restarting, within SEED_TTL doesn't
+// wait on DNS. N.B. getaddrinfo() doesn't report the records' TTLs, so the
+// cache lifetime is fixed; seeders' own TTLs are too short to be of use.
+class SeedResolver {
+ public:
+  typedef std::function<void(const std::vector<Addr> &)> Callback;
+
+  static const uint32_t SEED_TTL = 3600;  // seconds
+
+  // cb gets the addresses of each seed that answers, with the given port
+  SeedResolver(std::shared_ptr<uvw::Loop> loop, uint16_t port, Callback cb);
+  SeedResolver(const SeedResolver &other) = delete;
+
+  // Look up n seeds, asking for peers with services. Seeds in the cache are
+  // answered before this returns. Once enough addresses have come in, the
+  // lookups that haven't started yet are cancelled, so slow or dead seeds
+  // don't tie up the thread pool.
+  void resolve(const char *const *seeds, size_t n, uint64_t services,
+               size_t enough);
+
+  // cancel every lookup; the ones that have started are ignored
+  void cancel();
+
+  inline size_t pending() const { return requests_.size(); }
+
+  // Load the cache from path, and save it there as answers come in. A
+  // missing or bad file just leaves the cache empty.
+  void load(const std::string &path);
+
+ private:
+  struct Cached {
+    uint32_t time;  // unix time of the answer
+    std::vector<Addr> addrs;
+  };
+
+  std::shared_ptr<uvw::Loop> loop_;
+  uint16_t port_;
+  Callback cb_;
+  std::string path_;
+  std::unordered_map<std::string, Cached> cache_;
+  std::vector<std::shared_ptr<uvw::GetAddrInfoReq> > requests_;
+  size_t found_;   // addresses from this round of lookups
+  size_t enough_;  // stop looking after this many
+
+  // look up name, for seed; prefixed lookups fall back to the seed itself
+  void lookup(const std::string &seed, const std::string &name);
+
+  void answer(const std::string &seed, std::vector<Addr> &&addrs);
+
+  // Take req out of requests_, returning false if it isn't there: it was
+  // cancelled, but had already started and finished anyway.
+  bool remove(uvw::GetAddrInfoReq *req);
+
+  void save() const;
+};
+}  // namespace spv
@@ -16,11 +16,24 @@
 
 #include "./settings.h"
 
+#include <algorithm>
+#include <sstream>
+#include <utility>
+
 #include "cxxopts.hpp"
 
+#include "./addr.h"
+#include "./affinity.h"
 #include "./config.h"
+#include "./constants.h"
 #include "./fs.h"
+#include "./hd_wallet.h"
+#include "./header_mirror.h"
+#include "./lmdb_store.h"
 #include "./logging.h"
+#include "./socks5.h"
+#include "./uring.h"
+#include "./util.h"
 
 namespace spv {
 MODULE_LOGGER
@@ -28,6 +41,65 @@ MODULE_LOGGER
 static Settings settings_;
 static bool did_parse = false;
 
+// --profile embedded, for devices with 256 MiB or so: flags that go before
+// the command line's, so that any of them can still be overridden
+static const char* const embedded_profile[] = {
+    "--header-store=mmap",
+    "--db-cache=2",
+    "--header-cache-mb=1",
+    "--max-orphans=2000",
+    "--connections=4",
+    "--min-connections=2",
+    "--header-pipeline=1",
+    "--socket-profile=low-memory",
+    "--log-queue=512",
+    "--block-window=64",
+    "--blocks-per-peer=4",
+    "--memory-budget-mb=40",
+};
+
+// the --profile given, if any
+static std::string find_profile(int argc, char** argv) {
+  std::string profile;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg(argv[i]);
+    if (arg == "--") {
+      break;
+    } else if (arg == "--profile" && i + 1 < argc) {
+      profile = argv[++i];
+    } else if (arg.compare(0, 10, "--profile=") == 0) {
+      profile = arg.substr(10);
+    }
+  }
+  return profile;
+}
+
+static const std::pair<const char*, Durability> durability_names[] = {
+    {"sync", Durability::SYNC},
+    {"async", Durability::ASYNC},
+    {"periodic", Durability::PERIODIC},
+    {"nowal", Durability::NO_WAL},
+};
+
+const char* durability_name(Durability durability) {
+  for (const auto& pr : durability_names) {
+    if (pr.second == durability) {
+      return pr.first;
+    }
+  }
+  return "unknown";
+}
+
+bool parse_durability(const std::string& name, Durability& durability) {
+  for (const auto& pr : durability_names) {
+    if (name == pr.first) {
+      durability = pr.second;
+      return true;
+    }
+  }
+  return false;
+}
+
 const Settings& parse_settings(int argc, char** argv, int* ret) {
   assert(!did_parse);
   did_parse = true;
@@ -35,25 +107,213 @@ const Settings& parse_settings(int argc, char** argv, int* ret) {
   cxxopts::Options options("spv", "A simple Bitcoin client.");
   auto g = options.add_options();
   g("d,debug", "Enable debugging");
+  g("profile",
+    "Preset for the other options: default, or embedded for small devices",
+    cxxopts::value<std::string>()->default_value("default"));
+  g("log-queue", "Log messages to queue for the logging thread (0 = no thread)",
+    cxxopts::value<std::size_t>()->default_value("8192"));
   g("c,connections", "Max connections to make",
     cxxopts::value<std::size_t>()->default_value("8"));
+  g("min-connections", "Connections to keep once synced",
+    cxxopts::value<std::size_t>()->default_value("4"));
   g("h,help", "Print help information");
   g("v,version", "Print version information");
-  g("data-dir", "Path to the SPV database",
-    cxxopts::value<std::string>()->default_value(".spv"));
+  g("network", "Chains to sync: main, testnet or signet, comma separated",
+    cxxopts::value<std::string>()->default_value("testnet"));
+  g("data-dir", "Path to the SPV database (default: .spv, or .spv-NETWORK)",
+    cxxopts::value<std::string>());
   g("lock-file", "Path to the SPV lock file",
     cxxopts::value<std::string>()->default_value(".lock"));
   g("delete-data", "Delete the SPV data directory");
+  g("header-store", "Where to store headers (rocksdb, mmap or lmdb)",
+    cxxopts::value<std::string>()->default_value("rocksdb"));
+  g("db-cache", "RocksDB block cache size in MiB",
+    cxxopts::value<std::size_t>()->default_value("32"));
+  g("db-background-jobs", "RocksDB flush and compaction threads",
+    cxxopts::value<std::size_t>()->default_value("2"));
+  g("db-write-rate", "MiB/s RocksDB may flush and compact (0 = no limit)",
+    cxxopts::value<std::size_t>()->default_value("0"));
+  g("header-cache-mb", "Size of the decoded header cache in MiB",
+    cxxopts::value<std::size_t>()->default_value("4"));
+  g("max-orphans", "Headers to hold whose parent we don't have yet",
+    cxxopts::value<std::size_t>()->default_value("20000"));
+  g("memory-budget-mb", "Warn when resident memory passes this (0 = never)",
+    cxxopts::value<std::size_t>()->default_value("0"));
+  g("huge-pages", "Back the header index with 2 MiB huge pages");
+  g("durability", "How chain writes are synced (sync, async, periodic, nowal)",
+    cxxopts::value<std::string>()->default_value("async"));
+  g("sync-interval", "Milliseconds between syncs with --durability=periodic",
+    cxxopts::value<unsigned>()->default_value("10000"));
+  g("chain-writer", "Commit header batches on a thread of their own");
+  g("checkpoints", "File of checkpoints to use, one height and hash per line",
+    cxxopts::value<std::string>());
+  g("asmap", "Bitcoin Core asmap file, to spread outbound peers across ASes",
+    cxxopts::value<std::string>());
+  g("assume-valid", "Skip proof-of-work checks below the last checkpoint");
+  g("verify-db", "Check the database in the background while syncing");
+  g("repair-db", "Like --verify-db, but also repair what it finds");
+  g("import-headers", "Load a file of 80-byte headers before syncing",
+    cxxopts::value<std::string>());
+  g("export-headers", "Write the best chain to a file of headers and exit",
+    cxxopts::value<std::string>());
+  g("export-proto", "Write the best chain as spv.proto messages and exit",
+    cxxopts::value<std::string>());
+  g("export-from", "Height to start --export-proto at",
+    cxxopts::value<std::size_t>()->default_value("0"));
+  g("export-to", "Height to stop --export-proto before (default: the tip)",
+    cxxopts::value<std::size_t>()->default_value("0"));
+  g("io-threads", "Threads to spread peer socket I/O across (0 for none)",
+    cxxopts::value<std::size_t>()->default_value("0"));
+  g("io-uring", "Move peer socket reads and writes to io_uring");
+  g("worker-threads",
+    "Threads for validation, hashing and other CPU-bound work (0 for one "
+    "per worker CPU)",
+    cxxopts::value<std::size_t>()->default_value("0"));
+  g("network-cpus", "CPUs to run the event loops on, e.g. 0-3,8",
+    cxxopts::value<std::string>());
+  g("worker-cpus", "CPUs to run the validation and hashing workers on",
+    cxxopts::value<std::string>());
+  g("chain-cpus", "CPUs to load the header index on",
+    cxxopts::value<std::string>());
+  g("listen", "Accept inbound peers on the protocol port");
+  g("listen-address", "Address to accept inbound peers on",
+    cxxopts::value<std::string>()->default_value("::"));
+  g("max-inbound", "Max inbound peers",
+    cxxopts::value<std::size_t>()->default_value("32"));
+  g("max-inbound-per-ip", "Max inbound peers from one IP address",
+    cxxopts::value<std::size_t>()->default_value("4"));
+  g("ban-time", "Seconds to ban misbehaving peers for (0 to only disconnect)",
+    cxxopts::value<uint32_t>()->default_value("86400"));
+  g("addr-rate", "Addresses per second to take from each peer (0 = no limit)",
+    cxxopts::value<std::size_t>()->default_value("1"));
+  g("connect-race", "Connections to attempt at once per free slot",
+    cxxopts::value<std::size_t>()->default_value("2"));
+  g("header-pipeline",
+    "Headers replies to validate per peer while the next one is requested",
+    cxxopts::value<std::size_t>()->default_value("2"));
+  g("socket-profile", "Peer socket options (sync, relay, low-memory)",
+    cxxopts::value<std::string>()->default_value("sync"));
+  g("busy-poll", "SO_BUSY_POLL microseconds for peer sockets (0 = off)",
+    cxxopts::value<unsigned>()->default_value("0"));
+  g("quickack", "Set TCP_QUICKACK on peer sockets after every read");
+  g("max-upload", "KiB per second to send to all peers (0 = unlimited)",
+    cxxopts::value<std::size_t>()->default_value("0"));
+  g("max-download", "KiB per second to read from all peers (0 = unlimited)",
+    cxxopts::value<std::size_t>()->default_value("0"));
+  g("peer-max-upload", "KiB per second to send to each peer (0 = unlimited)",
+    cxxopts::value<std::size_t>()->default_value("0"));
+  g("peer-max-download",
+    "KiB per second to read from each peer (0 = unlimited)",
+    cxxopts::value<std::size_t>()->default_value("0"));
+  g("optimistic-handshake",
+    "Send verack and sendheaders with our version, not after the peer's");
+  g("connect", "Connect only to this peer, as ip or ip:port (repeatable)",
+    cxxopts::value<std::vector<std::string>>());
+  g("proxy", "Connect to peers through this SOCKS5 proxy, as ip or ip:port",
+    cxxopts::value<std::string>());
+  g("proxy-wait", "Wait for the proxy to connect before sending to peers");
+  g("v2-transport", "Encrypt peer connections with BIP324 where peers can");
+  g("getdata-delay", "Milliseconds to collect inv announcements for getdata",
+    cxxopts::value<unsigned>()->default_value("50"));
+  g("block-window", "Matched blocks to download ahead of the lowest one",
+    cxxopts::value<std::size_t>()->default_value("1024"));
+  g("blocks-per-peer", "Matched blocks to have in flight from each peer",
+    cxxopts::value<std::size_t>()->default_value("16"));
+  g("block-store-mb", "MiB of downloaded blocks to keep on disk (0 = none)",
+    cxxopts::value<std::size_t>()->default_value("0"));
+  g("watch", "Hex data element to match transactions with (repeatable)",
+    cxxopts::value<std::vector<std::string>>());
+  g("xpub", "Account xpub, ypub or zpub to watch the keys of (repeatable)",
+    cxxopts::value<std::vector<std::string>>());
+  g("xpub-lookahead", "Keys of each --xpub chain to derive and watch",
+    cxxopts::value<uint32_t>()->default_value("1000"));
+  g("bloom-fp-rate", "False positive rate of the bloom filter for --watch",
+    cxxopts::value<double>()->default_value("0.0001"));
+  g("compact-filters", "Match --watch with BIP158 filters, not a bloom filter");
+  g("filter-scan-from", "Height to start matching compact filters from",
+    cxxopts::value<std::size_t>()->default_value("0"));
+  g("filter-store-mb", "MiB of compact filters to keep on disk (0 = none)",
+    cxxopts::value<std::size_t>()->default_value("0"));
+  g("serve-filters", "Serve stored compact filters to peers");
+  g("rescan-from", "Height to rescan past compact filters from",
+    cxxopts::value<std::size_t>()->default_value("0"));
+  g("rescan-to", "Height to stop the rescan at (default: the tip)",
+    cxxopts::value<std::size_t>()->default_value("0"));
+  g("rescan-since", "Unix time to rescan from, e.g. a wallet's birthday",
+    cxxopts::value<uint32_t>()->default_value("0"));
+  g("mempool-mb", "MB of unconfirmed watched transactions to track (0 = off)",
+    cxxopts::value<std::size_t>()->default_value("0"));
+  g("broadcast", "Hex transaction to broadcast until it's mined (repeatable)",
+    cxxopts::value<std::vector<std::string>>());
+  g("metrics-port", "Serve Prometheus metrics on this HTTP port (0 = off)",
+    cxxopts::value<uint16_t>()->default_value("0"));
+  g("metrics-address", "Address to serve metrics on",
+    cxxopts::value<std::string>()->default_value("127.0.0.1"));
+  g("electrum-port", "Serve the Electrum protocol on this TCP port (0 = off)",
+    cxxopts::value<uint16_t>()->default_value("0"));
+  g("electrum-address", "Address to serve the Electrum protocol on",
+    cxxopts::value<std::string>()->default_value("127.0.0.1"));
+  g("rpc-port", "Serve header RPCs and /tips on this HTTP port (0 = off)",
+    cxxopts::value<uint16_t>()->default_value("0"));
+  g("rpc-address", "Address to answer JSON-RPC on",
+    cxxopts::value<std::string>()->default_value("127.0.0.1"));
+  g("replicate-port", "Serve headers to followers on this TCP port (0 = off)",
+    cxxopts::value<uint16_t>()->default_value("0"));
+  g("replicate-address", "Address to serve header replication on",
+    cxxopts::value<std::string>()->default_value("127.0.0.1"));
+  g("follow", "Take headers from this leader's --replicate-port, as ip:port",
+    cxxopts::value<std::string>());
+  g("header-mirror", "HTTP URL of a raw header dump to sync headers from",
+    cxxopts::value<std::string>());
+  g("mirror-connections", "Range requests to have out to the header mirror",
+    cxxopts::value<std::size_t>()->default_value("8"));
+  g("trace-file", "Trace message handling and write Chrome trace JSON here",
+    cxxopts::value<std::string>());
+  g("trace-events", "Trace events to keep per thread",
+    cxxopts::value<std::size_t>()->default_value("65536"));
+  g("capture-file", "Record all peer traffic here, for spv-replay",
+    cxxopts::value<std::string>());
+  g("event-log-mb", "MiB of peer and chain events to log for post-mortems",
+    cxxopts::value<std::size_t>()->default_value("0"));
+  g("status-socket", "Unix socket to report sync progress on, as JSON",
+    cxxopts::value<std::string>());
+  g("query-socket", "Unix socket to answer binary header lookups on",
+    cxxopts::value<std::string>());
+  g("chain-proofs", "Keep a work mmr to answer FlyClient proof queries");
+  g("tip-socket", "Unix socket to push tip changes to subscribers on",
+    cxxopts::value<std::string>());
+  g("control-socket", "Unix socket to take runtime tuning commands on",
+    cxxopts::value<std::string>());
+  g("profile-hz", "Stack samples per CPU second when profiling on SIGUSR2",
+    cxxopts::value<unsigned>()->default_value("99"));
+  g("profile-seconds", "Seconds to profile for after SIGUSR2",
+    cxxopts::value<unsigned>()->default_value("30"));
+  g("slow-callback-ms",
+    "Log loop iterations that run callbacks this long (0 to not watch)",
+    cxxopts::value<unsigned>()->default_value("250"));
+  g("shutdown-timeout", "Seconds to let shutdown run before exiting anyway",
+    cxxopts::value<unsigned>()->default_value("4"));
 
   g("protocol-version", "Protocol version to advertise",
     cxxopts::value<uint32_t>()->default_value(PROTOCOL_VERSION));
-  g("protocol-port", "Port to use",
-    cxxopts::value<uint16_t>()->default_value(PROTOCOL_PORT));
+  g("protocol-port", "Port to use (default: the network's)",
+    cxxopts::value<uint16_t>()->default_value("0"));
   g("protocol-user-agent", "User agent to advertise",
     cxxopts::value<std::string>()->default_value(USER_AGENT));
 
+  std::vector<char*> preset_argv(argv, argv + 1);
+  const std::string preset = find_profile(argc, argv);
+  if (preset == "embedded") {
+    for (const char* flag : embedded_profile) {
+      preset_argv.push_back(const_cast<char*>(flag));
+    }
+  }
+  preset_argv.insert(preset_argv.end(), argv + 1, argv + argc);
+  int preset_argc = int(preset_argv.size());
+  char** preset_args = preset_argv.data();
+
   try {
-    auto args = options.parse(argc, argv);
+    auto args = options.parse(preset_argc, preset_args);
     if (args.count("help")) {
       std::cout << options.help();
       *ret = 0;
@@ -63,20 +323,339 @@ const Settings& parse_settings(int argc, char** argv, int* ret) {
       spdlog::set_level(spdlog::level::debug);
       settings_.debug = true;
     }
-    if (args.count("delete-data")) {
-      spv::recursive_delete(".spv");
-    }
     if (args.count("version")) {
       std::cout << PACKAGE_STRING << std::endl;
       *ret = 0;
       goto finish;
     }
+    if (args["profile"].as<std::string>() != "default" &&
+        args["profile"].as<std::string>() != "embedded") {
+      std::cerr << "unknown profile: " << args["profile"].as<std::string>()
+                << "\n\n" << options.help();
+      *ret = 1;
+      goto finish;
+    }
+    settings_.networks.clear();
+    std::istringstream nets(args["network"].as<std::string>());
+    for (std::string name; std::getline(nets, name, ',');) {
+      Network net;
+      if (!find_network(name, net) ||
+          std::count(settings_.networks.begin(), settings_.networks.end(),
+                     net)) {
+        std::cerr << "unknown or repeated network: " << name << "\n\n"
+                  << options.help();
+        *ret = 1;
+        goto finish;
+      }
+      settings_.networks.push_back(net);
+    }
+    if (settings_.networks.empty()) {
+      std::cerr << "--network needs a network\n\n" << options.help();
+      *ret = 1;
+      goto finish;
+    }
+    settings_.network = settings_.networks.front();
+    select_network(settings_.network);
+    settings_.datadir = args.count("data-dir")
+                            ? args["data-dir"].as<std::string>()
+                            : std::string(network().datadir);
+    settings_.log_queue = args["log-queue"].as<std::size_t>();
     settings_.max_connections = args["connections"].as<std::size_t>();
-    settings_.datadir = args["data-dir"].as<std::string>();
+    settings_.min_connections = std::min(
+        args["min-connections"].as<std::size_t>(), settings_.max_connections);
     settings_.lockfile = args["lock-file"].as<std::string>();
+    const std::string store = args["header-store"].as<std::string>();
+    if (store == "rocksdb") {
+      settings_.header_backend = HeaderBackend::ROCKSDB;
+    } else if (store == "mmap") {
+      settings_.header_backend = HeaderBackend::MMAP;
+    } else if (store == "lmdb" && lmdb_available) {
+      settings_.header_backend = HeaderBackend::LMDB;
+    } else if (store == "lmdb") {
+      std::cerr << "--header-store lmdb needs a build with --enable-lmdb\n";
+      *ret = 1;
+      goto finish;
+    } else {
+      std::cerr << "unknown header store: " << store << "\n\n"
+                << options.help();
+      *ret = 1;
+      goto finish;
+    }
+    settings_.db_cache_mb = args["db-cache"].as<std::size_t>();
+    settings_.db_background_jobs =
+        std::max<size_t>(args["db-background-jobs"].as<std::size_t>(), 1);
+    settings_.db_write_rate_mb = args["db-write-rate"].as<std::size_t>();
+    settings_.header_cache_mb = args["header-cache-mb"].as<std::size_t>();
+    settings_.max_orphans =
+        std::max<size_t>(args["max-orphans"].as<std::size_t>(), 1);
+    settings_.memory_budget_mb = args["memory-budget-mb"].as<std::size_t>();
+    settings_.huge_pages = args.count("huge-pages") > 0;
+    const std::string durability = args["durability"].as<std::string>();
+    if (!parse_durability(durability, settings_.durability)) {
+      std::cerr << "unknown durability: " << durability << "\n\n"
+                << options.help();
+      *ret = 1;
+      goto finish;
+    }
+    settings_.sync_interval =
+        std::chrono::milliseconds(args["sync-interval"].as<unsigned>());
+    settings_.chain_writer = args.count("chain-writer") > 0;
+    if (args.count("checkpoints")) {
+      settings_.checkpoints_file = args["checkpoints"].as<std::string>();
+    }
+    if (args.count("asmap")) {
+      settings_.asmap_file = args["asmap"].as<std::string>();
+    }
+    settings_.assume_valid = args.count("assume-valid") > 0;
+    settings_.repair_db = args.count("repair-db") > 0;
+    settings_.verify_db = settings_.repair_db || args.count("verify-db") > 0;
+    if (args.count("import-headers")) {
+      settings_.import_headers = args["import-headers"].as<std::string>();
+    }
+    if (args.count("export-headers")) {
+      settings_.export_headers = args["export-headers"].as<std::string>();
+    }
+    if (args.count("export-proto")) {
+      settings_.export_proto = args["export-proto"].as<std::string>();
+    }
+    settings_.export_from = args["export-from"].as<std::size_t>();
+    settings_.export_to = args["export-to"].as<std::size_t>();
+    settings_.io_threads = args["io-threads"].as<std::size_t>();
+    settings_.io_uring = args.count("io-uring") > 0;
+    settings_.worker_threads = args["worker-threads"].as<std::size_t>();
+    if (settings_.io_uring && !io_uring_available) {
+      std::cerr << "--io-uring needs a build with --enable-io-uring\n";
+      *ret = 1;
+      goto finish;
+    }
+    for (const auto &pr :
+         {std::make_pair("network-cpus", &settings_.network_cpus),
+          std::make_pair("worker-cpus", &settings_.worker_cpus),
+          std::make_pair("chain-cpus", &settings_.chain_cpus)}) {
+      if (args.count(pr.first) &&
+          !parse_cpu_list(args[pr.first].as<std::string>(), *pr.second)) {
+        std::cerr << "bad CPU list for --" << pr.first << ": "
+                  << args[pr.first].as<std::string>() << "\n";
+        *ret = 1;
+        goto finish;
+      }
+    }
+    if (settings_.io_uring && settings_.io_threads) {
+      std::cerr << "--io-uring and --io-threads don't mix\n\n"
+                << options.help();
+      *ret = 1;
+      goto finish;
+    }
+    settings_.listen = args.count("listen") > 0;
+    settings_.listen_address = args["listen-address"].as<std::string>();
+    settings_.max_inbound = args["max-inbound"].as<std::size_t>();
+    settings_.max_inbound_per_ip = args["max-inbound-per-ip"].as<std::size_t>();
+    settings_.ban_time = args["ban-time"].as<uint32_t>();
+    settings_.addr_rate = args["addr-rate"].as<std::size_t>();
+    settings_.connect_race =
+        std::max<size_t>(args["connect-race"].as<std::size_t>(), 1);
+    settings_.header_pipeline = args["header-pipeline"].as<std::size_t>();
+    const std::string profile = args["socket-profile"].as<std::string>();
+    if (profile == "sync") {
+      settings_.socket_profile = SocketProfile::SYNC;
+    } else if (profile == "relay") {
+      settings_.socket_profile = SocketProfile::RELAY;
+    } else if (profile == "low-memory") {
+      settings_.socket_profile = SocketProfile::LOW_MEMORY;
+    } else {
+      std::cerr << "unknown socket profile: " << profile << "\n\n"
+                << options.help();
+      *ret = 1;
+      goto finish;
+    }
+    settings_.busy_poll = args["busy-poll"].as<unsigned>();
+    settings_.quickack = args.count("quickack") > 0;
+    settings_.max_upload = args["max-upload"].as<std::size_t>();
+    settings_.max_download = args["max-download"].as<std::size_t>();
+    settings_.peer_max_upload = args["peer-max-upload"].as<std::size_t>();
+    settings_.peer_max_download = args["peer-max-download"].as<std::size_t>();
+    settings_.optimistic_handshake = args.count("optimistic-handshake") > 0;
+    settings_.getdata_delay =
+        std::chrono::milliseconds(args["getdata-delay"].as<unsigned>());
+    settings_.block_window =
+        std::max<size_t>(args["block-window"].as<std::size_t>(), 1);
+    settings_.blocks_per_peer =
+        std::max<size_t>(args["blocks-per-peer"].as<std::size_t>(), 1);
+    settings_.block_store_mb = args["block-store-mb"].as<std::size_t>();
+    if (args.count("connect")) {
+      settings_.connect = args["connect"].as<std::vector<std::string>>();
+    }
+    if (args.count("proxy")) {
+      settings_.proxy = args["proxy"].as<std::string>();
+      Addr proxy;
+      if (!parse_peer(settings_.proxy, SOCKS_PORT, proxy)) {
+        std::cerr << "--proxy must be ip or ip:port\n\n" << options.help();
+        *ret = 1;
+        goto finish;
+      }
+    }
+    settings_.proxy_wait = args.count("proxy-wait") > 0;
+    if (args.count("watch")) {
+      for (const auto& hex : args["watch"].as<std::vector<std::string>>()) {
+        std::string data;
+        if (!from_hex(hex, data) || data.empty() ||
+            data.size() > MAX_FILTERADD_SIZE) {
+          std::cerr << "bad --watch element: " << hex << "\n\n"
+                    << options.help();
+          *ret = 1;
+          goto finish;
+        }
+        settings_.watch.push_back(data);
+      }
+    }
+    if (args.count("xpub")) {
+      for (const auto& xpub : args["xpub"].as<std::vector<std::string>>()) {
+        ExtPubKey key;
+        if (!key.parse(xpub)) {
+          std::cerr << "bad --xpub: " << xpub << "\n\n" << options.help();
+          *ret = 1;
+          goto finish;
+        }
+        settings_.xpubs.push_back(xpub);
+      }
+    }
+    settings_.xpub_lookahead = args["xpub-lookahead"].as<uint32_t>();
+    settings_.bloom_fp_rate = args["bloom-fp-rate"].as<double>();
+    if (!(settings_.bloom_fp_rate > 0 && settings_.bloom_fp_rate < 1)) {
+      std::cerr << "--bloom-fp-rate must be between 0 and 1\n\n"
+                << options.help();
+      *ret = 1;
+      goto finish;
+    }
+    settings_.compact_filters = args.count("compact-filters") > 0;
+    settings_.filter_scan_from = args["filter-scan-from"].as<std::size_t>();
+    settings_.filter_store_mb = args["filter-store-mb"].as<std::size_t>();
+    settings_.serve_filters = args.count("serve-filters") > 0;
+    if (settings_.serve_filters) {
+      if (!settings_.compact_filters || !settings_.filter_store_mb) {
+        std::cerr << "--serve-filters needs --compact-filters and "
+                     "--filter-store-mb\n\n"
+                  << options.help();
+        *ret = 1;
+        goto finish;
+      }
+      // there's nothing to serve unless we fetch the older filters too
+      if (!settings_.filter_scan_from) {
+        settings_.filter_scan_from = 1;
+      }
+    }
+    settings_.rescan_from = args["rescan-from"].as<std::size_t>();
+    settings_.rescan_to = args["rescan-to"].as<std::size_t>();
+    settings_.rescan_since = args["rescan-since"].as<uint32_t>();
+    if (settings_.rescan_since && settings_.rescan_from) {
+      std::cerr << "--rescan-since and --rescan-from are exclusive\n\n"
+                << options.help();
+      *ret = 1;
+      goto finish;
+    }
+    settings_.mempool_mb = args["mempool-mb"].as<std::size_t>();
+    if (args.count("broadcast")) {
+      for (const auto& hex : args["broadcast"].as<std::vector<std::string>>()) {
+        std::string raw;
+        if (!from_hex(hex, raw) || raw.empty()) {
+          std::cerr << "bad --broadcast transaction: " << hex << "\n\n"
+                    << options.help();
+          *ret = 1;
+          goto finish;
+        }
+        settings_.broadcast.push_back(hex);
+      }
+    }
+    settings_.metrics_port = args["metrics-port"].as<uint16_t>();
+    settings_.metrics_address = args["metrics-address"].as<std::string>();
+    settings_.electrum_port = args["electrum-port"].as<uint16_t>();
+    settings_.electrum_address = args["electrum-address"].as<std::string>();
+    settings_.rpc_port = args["rpc-port"].as<uint16_t>();
+    settings_.rpc_address = args["rpc-address"].as<std::string>();
+    settings_.replicate_port = args["replicate-port"].as<uint16_t>();
+    settings_.replicate_address =
+        args["replicate-address"].as<std::string>();
+    if (args.count("follow")) {
+      settings_.follow = args["follow"].as<std::string>();
+      Addr leader;
+      if (!parse_peer(settings_.follow, 0, leader) || leader.port() == 0) {
+        std::cerr << "--follow must be ip:port\n\n" << options.help();
+        *ret = 1;
+        goto finish;
+      }
+    }
+    if (args.count("header-mirror")) {
+      settings_.header_mirror = args["header-mirror"].as<std::string>();
+      std::string host, path;
+      uint16_t port;
+      if (!HeaderMirror::parse_url(settings_.header_mirror, host, port,
+                                   path)) {
+        std::cerr << "--header-mirror must be an http:// URL\n\n"
+                  << options.help();
+        *ret = 1;
+        goto finish;
+      }
+    }
+    settings_.mirror_connections =
+        std::max<size_t>(args["mirror-connections"].as<std::size_t>(), 1);
+    if (args.count("trace-file")) {
+      settings_.trace_file = args["trace-file"].as<std::string>();
+    }
+    settings_.trace_events = args["trace-events"].as<std::size_t>();
+    if (args.count("capture-file")) {
+      settings_.capture_file = args["capture-file"].as<std::string>();
+    }
+    settings_.v2_transport = args.count("v2-transport") > 0;
+    if (settings_.v2_transport &&
+        (settings_.io_threads || !settings_.capture_file.empty())) {
+      std::cerr << "--v2-transport doesn't mix with --io-threads or "
+                   "--capture-file\n\n"
+                << options.help();
+      *ret = 1;
+      goto finish;
+    }
+    settings_.event_log_mb = args["event-log-mb"].as<std::size_t>();
+    if (args.count("status-socket")) {
+      settings_.status_socket = args["status-socket"].as<std::string>();
+    }
+    if (args.count("query-socket")) {
+      settings_.query_socket = args["query-socket"].as<std::string>();
+    }
+    settings_.chain_proofs = args.count("chain-proofs") > 0;
+    if (settings_.chain_proofs && settings_.query_socket.empty()) {
+      std::cerr << "--chain-proofs needs --query-socket\n\n" << options.help();
+      *ret = 1;
+      goto finish;
+    }
+    if (args.count("tip-socket")) {
+      settings_.tip_socket = args["tip-socket"].as<std::string>();
+    }
+    if (args.count("control-socket")) {
+      settings_.control_socket = args["control-socket"].as<std::string>();
+    }
+    settings_.profile_hz = args["profile-hz"].as<unsigned>();
+    settings_.profile_seconds = args["profile-seconds"].as<unsigned>();
+    settings_.slow_callback_ms = args["slow-callback-ms"].as<unsigned>();
+    settings_.shutdown_timeout = args["shutdown-timeout"].as<unsigned>();
     settings_.version = args["protocol-version"].as<uint32_t>();
     settings_.port = args["protocol-port"].as<uint16_t>();
     settings_.user_agent = args["protocol-user-agent"].as<std::string>();
+    if (settings_.networks.size() > 1 &&
+        (!settings_.checkpoints_file.empty() ||
+         !settings_.import_headers.empty() ||
+         !settings_.export_headers.empty() ||
+         !settings_.export_proto.empty() || !settings_.connect.empty())) {
+      std::cerr << "--checkpoints, --connect, --import-headers and --export-* "
+                   "need a single --network\n\n"
+                << options.help();
+      *ret = 1;
+      goto finish;
+    }
+    if (args.count("delete-data")) {
+      for (size_t i = 0; i < settings_.networks.size(); i++) {
+        spv::recursive_delete(settings_for_network(settings_, i).datadir);
+      }
+    }
   } catch (const cxxopts::option_not_exists_exception& exc) {
     std::cerr << exc.what() << "\n\n" << options.help();
     *ret = 1;
@@ -90,4 +669,39 @@ const Settings& get_settings() {
   assert(did_parse);
   return settings_;
 }
+
+Settings settings_for_network(const Settings& settings, size_t i) {
+  assert(i < settings.networks.size());
+  Settings out(settings);
+  if (settings.networks.size() == 1) {
+    return out;
+  }
+  out.network = settings.networks[i];
+  out.networks = {out.network};
+  const std::string name = network_params(out.network).name;
+  // the default data directory is the first network's
+  out.datadir = settings.datadir == network_params(settings.network).datadir
+                    ? std::string(network_params(out.network).datadir)
+                    : settings.datadir + "-" + name;
+  for (std::string* path :
+       {&out.status_socket, &out.query_socket, &out.tip_socket,
+        &out.control_socket, &out.capture_file}) {
+    if (!path->empty()) {
+      *path += "-" + name;
+    }
+  }
+  if (out.metrics_port) {
+    out.metrics_port += i;
+  }
+  if (out.electrum_port) {
+    out.electrum_port += i;
+  }
+  if (out.rpc_port) {
+    out.rpc_port += i;
+  }
+  if (out.replicate_port) {
+    out.replicate_port += i;
+  }
+  return out;
+}
 }  // namespace spv
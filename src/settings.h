@@ -16,37 +16,418 @@
 
 #pragma once
 
+#include <chrono>
 #include <cstddef>
+#include <cstdlib>
 #include <string>
+#include <vector>
 
 #include "./config.h"
+#include "./network.h"
 
 namespace spv {
 
+// how hard chain writes try to survive a crash
+enum class Durability {
+  SYNC,      // sync the WAL (and header store) on every write
+  ASYNC,     // write the WAL, but leave flushing it to the OS
+  PERIODIC,  // like ASYNC, but sync at most once per sync_interval
+  NO_WAL,    // skip the WAL; writes since the last flush are lost on a crash
+};
+
+// socket options for peer connections, see sockopt.h
+enum class SocketProfile {
+  SYNC,        // big receive buffers for header sync
+  RELAY,       // moderate buffers both ways, for serving inbound peers
+  LOW_MEMORY,  // small buffers for many mostly idle connections
+};
+
+// where the best chain's headers are persisted
+enum class HeaderBackend {
+  ROCKSDB,
+  MMAP,  // flat memory-mapped file, see store.h
+  LMDB,  // LMDB B+tree, with --enable-lmdb; see lmdb_store.h
+};
+
 struct Settings {
   bool debug;
+
+  // the chain to sync, which picks the defaults below marked as the
+  // network's; see network.h
+  Network network;
+
+  // Every network given to --network, network first. main runs a client
+  // for each on a thread of its own, with settings_for_network().
+  std::vector<Network> networks;
+
+  // log from a background thread, queueing up to this many messages, or
+  // with 0 log synchronously; see start_async_logging()
+  size_t log_queue;
+
+  // outbound peers to sync with at most, and to keep once synced; see
+  // PeerScaler
   size_t max_connections;
+  size_t min_connections;
   std::string datadir;
   std::string lockfile;
+  HeaderBackend header_backend;
+
+  // size of the RocksDB block cache, in MiB
+  size_t db_cache_mb;
+
+  // RocksDB's flush and compaction threads, and the MiB per second they
+  // may write, or 0 for no limit
+  size_t db_background_jobs;
+  size_t db_write_rate_mb;
+
+  // size of the cache of decoded headers, in MiB
+  size_t header_cache_mb;
+
+  // headers to hold whose parent we don't have yet
+  size_t max_orphans;
+
+  // warn when the resident set passes this many MiB, or with 0 don't
+  // check; see Client::check_memory()
+  size_t memory_budget_mb;
+
+  // back the header index with 2 MiB pages; see HugePageAllocator
+  bool huge_pages;
+
+  // a file of checkpoints to use instead of the built-in ones, if set
+  std::string checkpoints_file;
+
+  // a Bitcoin Core asmap file, to spread outbound peers over ASes rather
+  // than network groups, if set; see asmap.h
+  std::string asmap_file;
+
+  Durability durability;
+  std::chrono::milliseconds sync_interval;  // for Durability::PERIODIC
+  bool chain_writer;  // commit header batches on a thread of their own
+
+  // only check proof of work past the last checkpoint
+  bool assume_valid;
+
+  // check the database in the background, and maybe fix it
+  bool verify_db;
+  bool repair_db;
+
+  // header files to load before syncing, or to write the chain to and exit
+  std::string import_headers;
+  std::string export_headers;
+
+  // write heights [export_from, export_to) of the best chain here, as
+  // length-delimited spv.proto messages, and exit; export_to 0 is the tip
+  std::string export_proto;
+  size_t export_from;
+  size_t export_to;
+
+  // threads for socket I/O, or 0 to do it all on the main loop
+  size_t io_threads;
+
+  // threads in the Scheduler's pool, or with 0 one per worker_cpus, or per
+  // CPU if that's empty; see scheduler.h
+  size_t worker_threads;
+
+  // CPUs to pin the event loops, the worker pool and the index
+  // loader to, or none to leave them to the scheduler; see affinity.h
+  std::vector<unsigned> network_cpus;
+  std::vector<unsigned> worker_cpus;
+  std::vector<unsigned> chain_cpus;
+
+  // with io_threads 0, read and write peer sockets through io_uring,
+  // submitting every connection's I/O together once per loop iteration;
+  // see uring.h
+  bool io_uring;
+
+  // accept inbound peers on port, and how many of them to allow
+  bool listen;
+  std::string listen_address;
+  size_t max_inbound;
+  size_t max_inbound_per_ip;
+
+  // seconds a misbehaving peer's address is banned for, or 0 to just
+  // disconnect it
+  uint32_t ban_time;
+
+  // addresses per second to take from each peer's addr messages, after a
+  // burst of a getaddr reply's worth, or 0 for no limit
+  size_t addr_rate;
+
+  // candidate connections to race for each free connection slot
+  size_t connect_race;
+
+  // headers replies from a peer that may be validating while its next
+  // getheaders is already out, or 0 to wait for each reply to be stored
+  size_t header_pipeline;
+
+  // Socket options for peer connections, and optionally SO_BUSY_POLL
+  // microseconds and TCP_QUICKACK, for deployments that trade CPU for
+  // latency.
+  SocketProfile socket_profile;
+  unsigned busy_poll;
+  bool quickack;
+
+  // KiB per second to send to and receive from all peers together, and
+  // from each peer, or 0 for no limit; see TokenBucket
+  size_t max_upload;
+  size_t max_download;
+  size_t peer_max_upload;
+  size_t peer_max_download;
+
+  // Send verack and sendheaders to outbound peers right after our version,
+  // rather than once theirs is in; the peer reads them after our version
+  // either way.
+  bool optimistic_handshake;
+
+  // Connect only to these peers, each an IPv4 or bracketed IPv6 address
+  // with an optional port, and never to the DNS seeds or saved peers.
+  std::vector<std::string> connect;
+
+  // Make outbound connections through the SOCKS5 proxy at this address, as
+  // ip or ip:port (port 1080 by default), or not if empty. The version
+  // message goes out with the CONNECT request, unless proxy_wait is set
+  // for a proxy that won't take data before it has answered.
+  std::string proxy;
+  bool proxy_wait;
+
+  // Speak BIP324's encrypted transport with peers that have it, both ways,
+  // and v1 with the rest. Not with io_threads or capture_file, whose
+  // sockets and captures are of v1 streams.
+  bool v2_transport;
+
+  // how long to collect inv announcements before sending getdata
+  std::chrono::milliseconds getdata_delay;
+
+  // matched blocks to fetch ahead of the lowest one not yet in, and to ask
+  // of each peer at once; see BlockDownload
+  size_t block_window;
+  size_t blocks_per_peer;
+
+  // Keep the downloaded blocks in blk files in the data directory, pruning
+  // the oldest past this many MiB, or with 0 don't; see BlockStore.
+  size_t block_store_mb;
+
+  // Data elements (pubkey hashes, scripts and so on) to put in the bloom
+  // filter sent to peers; with none, no filter is used.
+  std::vector<std::string> watch;
+  double bloom_fp_rate;
+
+  // Also watch the first xpub_lookahead keys of the receiving and change
+  // chains of these accounts' extended public keys; see HdWallet.
+  std::vector<std::string> xpubs;
+  uint32_t xpub_lookahead;
+
+  // Match the watched scripts against BIP158 compact filters instead of
+  // sending peers a bloom filter, checking the filters of blocks from
+  // filter_scan_from on; with 0, just the blocks that arrive after the
+  // filter headers have caught up.
+  bool compact_filters;
+  size_t filter_scan_from;
+
+  // with compact filters, keep the ones downloaded in cf files in the data
+  // directory, pruning the oldest past this many MiB, or with 0 don't; see
+  // FilterStore
+  size_t filter_store_mb;
+
+  // Answer peers' BIP157 requests from the filters in the store and
+  // advertise NODE_COMPACT_FILTERS; see FilterServer. Needs compact_filters
+  // and filter_store_mb.
+  bool serve_filters;
+
+  // With compact filters, rescan the blocks from rescan_from to rescan_to
+  // (0 for the tip) across several peers; see Rescan. With rescan_from 0,
+  // an interrupted rescan is resumed.
+  size_t rescan_from;
+  size_t rescan_to;
+
+  // or rescan from the first block at or past this Unix time, e.g. a
+  // wallet's birthday, if set; see Chain::height_at_time()
+  uint32_t rescan_since;
+
+  // Track unconfirmed transactions matching the watch list in up to this
+  // many MB, or 0 not to; see MempoolTracker. With a bloom filter the peers
+  // only announce matching transactions, otherwise all of them are fetched.
+  size_t mempool_mb;
+
+  // serialized transactions, in hex, to broadcast until they're mined; see
+  // TxBroadcast
+  std::vector<std::string> broadcast;
+
+  // serve Prometheus metrics over HTTP on this address and port, or 0 not to
+  std::string metrics_address;
+  uint16_t metrics_port;
+
+  // serve the Electrum protocol on this address and port, or 0 not to; see
+  // electrum_server.h
+  std::string electrum_address;
+  uint16_t electrum_port;
+
+  // answer bitcoind's header RPCs over HTTP on this address and port, and
+  // stream tip changes to WebSockets on /tips, or with 0 don't; there is no
+  // authentication, so keep it local; see rpc_server.h
+  std::string rpc_address;
+  uint16_t rpc_port;
+
+  // serve the best chain's headers to followers on this address and port,
+  // or with 0 don't; and take headers from such a leader, at ip:port,
+  // rather than syncing them from peers, if follow is set; see
+  // replication.h
+  std::string replicate_address;
+  uint16_t replicate_port;
+  std::string follow;
+
+  // fetch the header segments before the last checkpoint from this HTTP
+  // dump of raw headers, with up to mirror_connections range requests at
+  // once, leaving the stretch to the tip to peers; see header_mirror.h
+  std::string header_mirror;
+  size_t mirror_connections;
+
+  // trace the receive pipeline, keeping this many events per thread, and
+  // write the trace here at exit; see trace.h
+  std::string trace_file;
+  size_t trace_events;
+
+  // write every peer's traffic here, for spv-replay; see capture.h
+  std::string capture_file;
+
+  // MiB of peer and chain events to keep in events.dat in the data
+  // directory, or 0 not to; see eventlog.h
+  size_t event_log_mb;
+
+  // answer connections to this Unix socket with the sync progress as JSON,
+  // or not if empty
+  std::string status_socket;
+
+  // answer binary header lookups on this Unix socket, or not if empty,
+  // keeping mmr.dat in the data directory for inclusion proofs; see
+  // query_server.h
+  std::string query_socket;
+
+  // with query_socket, also keep workmmr.dat in the data directory, for
+  // CHAIN_PROOF queries; see flyclient.h
+  bool chain_proofs;
+
+  // push tip changes to connections on this Unix socket, or not if empty;
+  // see tip_server.h
+  std::string tip_socket;
+
+  // take tuning commands on this Unix socket, or not if empty; see
+  // control_server.h
+  std::string control_socket;
+
+  // SIGUSR2 samples stacks this many times a second of CPU time, for this
+  // long; see profiler.h
+  unsigned profile_hz;
+  unsigned profile_seconds;
+
+  // log loop iterations that run callbacks for longer than this many
+  // milliseconds, or with 0 don't watch the loop; see loop_monitor.h
+  unsigned slow_callback_ms;
+
+  // after SIGINT or SIGTERM, exit anyway if shutting down takes longer than
+  // this many seconds; 0 waits for as long as it takes
+  unsigned shutdown_timeout;
 
   // protocol options
   uint32_t version;
-  uint16_t port;
+  uint16_t port;  // 0 for the network's
   std::string user_agent;
 
   Settings()
       : debug(false),
+        network(Network::TESTNET),
+        networks(1, Network::TESTNET),
+        log_queue(8192),
         max_connections(8),
+        min_connections(4),
         datadir(".spv"),
         lockfile(".lock"),
-        version(0),
+        header_backend(HeaderBackend::ROCKSDB),
+        db_cache_mb(32),
+        db_background_jobs(2),
+        db_write_rate_mb(0),
+        header_cache_mb(4),
+        max_orphans(20000),
+        memory_budget_mb(0),
+        huge_pages(false),
+        durability(Durability::ASYNC),
+        sync_interval(10000),
+        chain_writer(false),
+        assume_valid(false),
+        verify_db(false),
+        repair_db(false),
+        export_from(0),
+        export_to(0),
+        io_threads(0),
+        worker_threads(0),
+        io_uring(false),
+        listen(false),
+        listen_address("::"),
+        max_inbound(32),
+        max_inbound_per_ip(4),
+        ban_time(24 * 60 * 60),
+        addr_rate(1),
+        connect_race(2),
+        header_pipeline(2),
+        socket_profile(SocketProfile::SYNC),
+        busy_poll(0),
+        quickack(false),
+        max_upload(0),
+        max_download(0),
+        peer_max_upload(0),
+        peer_max_download(0),
+        optimistic_handshake(false),
+        proxy_wait(false),
+        v2_transport(false),
+        getdata_delay(50),
+        block_window(1024),
+        blocks_per_peer(16),
+        block_store_mb(0),
+        bloom_fp_rate(0.0001),
+        xpub_lookahead(1000),
+        compact_filters(false),
+        filter_scan_from(0),
+        filter_store_mb(0),
+        serve_filters(false),
+        rescan_from(0),
+        rescan_to(0),
+        rescan_since(0),
+        mempool_mb(0),
+        metrics_address("127.0.0.1"),
+        metrics_port(0),
+        electrum_address("127.0.0.1"),
+        electrum_port(0),
+        rpc_address("127.0.0.1"),
+        rpc_port(0),
+        replicate_address("127.0.0.1"),
+        replicate_port(0),
+        mirror_connections(8),
+        trace_events(65536),
+        event_log_mb(0),
+        chain_proofs(false),
+        profile_hz(99),
+        profile_seconds(30),
+        slow_callback_ms(250),
+        shutdown_timeout(4),
+        version(std::strtoul(PROTOCOL_VERSION, nullptr, 10)),
         port(0),
         user_agent(USER_AGENT) {}
 };
 
+// the --durability name of a mode, and the mode with a name, false if none
+const char *durability_name(Durability durability);
+bool parse_durability(const std::string &name, Durability &durability);
+
 // parse settings from the command line arguments
 const Settings &parse_settings(int argc, char **argv, int *ret);
 
 // get the global settings singleton
 const Settings &get_settings();
+
+// The settings for one of several networks run in one process, or with one
+// network just a copy. So that the clients don't collide, each gets the
+// network's own data directory (or --data-dir with a -NETWORK suffix), its
+// sockets and capture file get a -NETWORK suffix too, and its metrics,
+// Electrum, RPC and replication ports are offset by its place in the list.
+Settings settings_for_network(const Settings &settings, size_t i);
 }  // namespace spv
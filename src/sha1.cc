@@ -0,0 +1,94 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./sha1.h"
+
+#include <endian.h>
+#include <cstring>
+
+namespace spv {
+namespace sha1 {
+namespace {
+inline uint32_t rotl(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+
+void transform(uint32_t *state, const uint8_t *block) {
+  uint32_t w[80];
+  for (int i = 0; i < 16; i++) {
+    uint32_t word;
+    std::memcpy(&word, block + 4 * i, sizeof word);
+    w[i] = be32toh(word);
+  }
+  for (int i = 16; i < 80; i++) {
+    w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+           e = state[4];
+  for (int i = 0; i < 80; i++) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+    const uint32_t t = rotl(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rotl(b, 30);
+    b = a;
+    a = t;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+}  // namespace
+
+void hash(const uint8_t *data, size_t sz, uint8_t *out) {
+  uint32_t state[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+                       0xc3d2e1f0};
+  size_t left = sz;
+  for (; left >= 64; left -= 64, data += 64) {
+    transform(state, data);
+  }
+
+  // the tail, the 0x80 marker and the big-endian bit length, in one or two
+  // more blocks
+  uint8_t tail[128] = {0};
+  std::memcpy(tail, data, left);
+  tail[left] = 0x80;
+  const size_t tail_size = left < 56 ? 64 : 128;
+  const uint64_t bits = htobe64(uint64_t(sz) * 8);
+  std::memcpy(tail + tail_size - 8, &bits, sizeof bits);
+  for (size_t i = 0; i < tail_size; i += 64) {
+    transform(state, tail + i);
+  }
+  for (int i = 0; i < 5; i++) {
+    const uint32_t word = htobe32(state[i]);
+    std::memcpy(out + 4 * i, &word, sizeof word);
+  }
+}
+}  // namespace sha1
+}  // namespace spv
@@ -0,0 +1,689 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./sha256.h"
+
+#include <endian.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_SHANI 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#define HAVE_ARMV8 1
+#endif
+
+#include "picosha2/picosha2.h"
+
+#include "./logging.h"
+
+namespace spv {
+MODULE_LOGGER
+
+namespace sha256 {
+namespace {
+typedef void (*transform_fn)(uint32_t *state, const uint8_t *blocks,
+                             size_t n);
+
+const uint32_t initial_state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                   0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                   0x1f83d9ab, 0x5be0cd19};
+
+#if defined(HAVE_SHANI) || defined(HAVE_ARMV8)
+alignas(16) const uint32_t round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+#endif
+
+void transform_generic(uint32_t *state, const uint8_t *blocks, size_t n) {
+  for (size_t i = 0; i < n; i++, blocks += 64) {
+    picosha2::detail::hash256_block(state, blocks, blocks + 64);
+  }
+}
+
+#ifdef HAVE_SHANI
+bool have_shani() {
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1)) {
+    return false;
+  }
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+  return ebx & (1 << 29);  // bit_SHA
+}
+
+// Based on the Intel SHA extensions white paper. The state is kept in the
+// ABEF/CDGH register layout that sha256rnds2 expects.
+__attribute__((target("sha,sse4.1"))) void transform_shani(
+    uint32_t *state, const uint8_t *blocks, size_t n) {
+  const __m128i bswap =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(state));
+  __m128i state1 =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(state + 4));
+  tmp = _mm_shuffle_epi32(tmp, 0xb1);                  // CDAB
+  state1 = _mm_shuffle_epi32(state1, 0x1b);            // EFGH
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);    // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xf0);         // CDGH
+
+  for (size_t b = 0; b < n; b++, blocks += 64) {
+    const __m128i abef = state0, cdgh = state1;
+    __m128i w[4];
+    for (int i = 0; i < 16; i++) {
+      __m128i &cur = w[i % 4];
+      if (i < 4) {
+        cur = _mm_shuffle_epi8(
+            _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(blocks + 16 * i)),
+            bswap);
+      } else {
+        // cur holds W[t-16..t-13]
+        const __m128i &w15 = w[(i + 1) % 4], &w7 = w[(i + 2) % 4],
+                      &w3 = w[(i + 3) % 4];
+        __m128i x = _mm_sha256msg1_epu32(cur, w15);
+        x = _mm_add_epi32(x, _mm_alignr_epi8(w3, w7, 4));
+        cur = _mm_sha256msg2_epu32(x, w3);
+      }
+      __m128i msg = _mm_add_epi32(
+          cur, _mm_load_si128(
+                   reinterpret_cast<const __m128i *>(round_constants + 4 * i)));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      msg = _mm_shuffle_epi32(msg, 0x0e);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1b);        // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xb1);     // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xf0);  // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8);     // HGFE
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(state), state0);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(state + 4), state1);
+}
+#endif
+
+#ifdef HAVE_ARMV8
+bool have_armv8() { return getauxval(AT_HWCAP) & HWCAP_SHA2; }
+
+__attribute__((target("arch=armv8-a+crypto"))) void transform_armv8(
+    uint32_t *state, const uint8_t *blocks, size_t n) {
+  uint32x4_t state0 = vld1q_u32(state), state1 = vld1q_u32(state + 4);
+  for (size_t b = 0; b < n; b++, blocks += 64) {
+    const uint32x4_t abcd = state0, efgh = state1;
+    uint32x4_t w[4];
+    for (int i = 0; i < 16; i++) {
+      uint32x4_t &cur = w[i % 4];
+      if (i < 4) {
+        cur = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(blocks + 16 * i)));
+      } else {
+        // cur holds W[t-16..t-13]
+        cur = vsha256su1q_u32(vsha256su0q_u32(cur, w[(i + 1) % 4]),
+                              w[(i + 2) % 4], w[(i + 3) % 4]);
+      }
+      const uint32x4_t msg = vaddq_u32(cur, vld1q_u32(round_constants + 4 * i));
+      const uint32x4_t prev = state0;
+      state0 = vsha256hq_u32(state0, state1, msg);
+      state1 = vsha256h2q_u32(state1, prev, msg);
+    }
+    state0 = vaddq_u32(state0, abcd);
+    state1 = vaddq_u32(state1, efgh);
+  }
+  vst1q_u32(state, state0);
+  vst1q_u32(state + 4, state1);
+}
+#endif
+
+#ifdef HAVE_SHANI
+// Multi-buffer hashing: each 32-bit lane of a vector holds the state of a
+// different message, so one pass of the scalar algorithm hashes 8 (AVX2) or
+// 16 (AVX-512) headers or merkle node pairs. These helpers are always
+// inlined into the target specific functions below, which is where they get
+// their instruction set.
+typedef uint32_t v8u __attribute__((vector_size(32)));
+typedef uint32_t v16u __attribute__((vector_size(64)));
+
+#define LANE_INLINE __attribute__((always_inline)) inline
+
+// a macro rather than a function, since GCC warns about returning vectors
+// from functions compiled without AVX, even if they're always inlined
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// compress one block per lane; w is the message, and is clobbered
+template <typename V>
+LANE_INLINE void transform_lanes(V *state, V *w) {
+  V a = state[0], b = state[1], c = state[2], d = state[3], e = state[4],
+    f = state[5], g = state[6], h = state[7];
+  for (int i = 0; i < 64; i++) {
+    if (i >= 16) {
+      const V w15 = w[(i - 15) % 16], w2 = w[(i - 2) % 16];
+      w[i % 16] += (ROTR(w15, 7) ^ ROTR(w15, 18) ^ (w15 >> 3)) +
+                   w[(i - 7) % 16] +
+                   (ROTR(w2, 17) ^ ROTR(w2, 19) ^ (w2 >> 10));
+    }
+    const V t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) +
+                 ((e & f) ^ (~e & g)) + (V{} + round_constants[i]) +
+                 w[i % 16];
+    const V t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) +
+                 ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+LANE_INLINE uint32_t load_be32(const uint8_t *p) {
+  uint32_t x;
+  std::memcpy(&x, p, sizeof x);
+  return be32toh(x);
+}
+
+// hash the first round's digests in state, using w as scratch, and write
+// LANES digests to out
+template <typename V, int LANES>
+LANE_INLINE void second_round_lanes(V *state, V *w, uint8_t *out) {
+  // the first digest is the message of the second round, as words
+  for (int j = 0; j < 8; j++) {
+    w[j] = state[j];
+    state[j] = (V{} + initial_state[j]);
+  }
+  w[8] = (V{} + 0x80000000);
+  for (int j = 9; j < 15; j++) {
+    w[j] = (V{} + 0);
+  }
+  w[15] = (V{} + 32 * 8);
+  transform_lanes(state, w);
+
+  for (int l = 0; l < LANES; l++) {
+    for (int j = 0; j < 8; j++) {
+      const uint32_t be = htobe32(state[j][l]);
+      std::memcpy(out + 32 * l + 4 * j, &be, sizeof be);
+    }
+  }
+}
+
+// double hash one LEN-byte message per lane: an 80-byte header, or a
+// 64-byte pair of merkle nodes
+template <typename V, int LANES, int LEN>
+LANE_INLINE void double_hash_lanes(const uint8_t *base, size_t stride,
+                                   uint8_t *out) {
+  static_assert(LEN == 64 || LEN == 80, "one or two blocks, short tail");
+  V state[8], w[16];
+  for (int j = 0; j < 8; j++) {
+    state[j] = (V{} + initial_state[j]);
+  }
+  for (int j = 0; j < 16; j++) {
+    for (int l = 0; l < LANES; l++) {
+      w[j][l] = load_be32(base + l * stride + 4 * j);
+    }
+  }
+  transform_lanes(state, w);
+
+  // the rest of the message (if any), then the padding
+  const int tail = (LEN - 64) / 4;
+  for (int j = 0; j < tail; j++) {
+    for (int l = 0; l < LANES; l++) {
+      w[j][l] = load_be32(base + l * stride + 64 + 4 * j);
+    }
+  }
+  w[tail] = (V{} + 0x80000000);
+  for (int j = tail + 1; j < 15; j++) {
+    w[j] = (V{} + 0);
+  }
+  w[15] = (V{} + LEN * 8);
+  transform_lanes(state, w);
+  second_round_lanes<V, LANES>(state, w, out);
+}
+
+// Double hash messages that are already padded, each blocks * 64 bytes
+// long, one per lane; padding a message costs a copy, but it's a lot less
+// than the hashing for any message longer than a block.
+template <typename V, int LANES>
+LANE_INLINE void double_hash_padded_lanes(const uint8_t *base, size_t stride,
+                                          size_t blocks, uint8_t *out) {
+  V state[8], w[16];
+  for (int j = 0; j < 8; j++) {
+    state[j] = (V{} + initial_state[j]);
+  }
+  for (size_t b = 0; b < blocks; b++) {
+    for (int j = 0; j < 16; j++) {
+      for (int l = 0; l < LANES; l++) {
+        w[j][l] = load_be32(base + l * stride + 64 * b + 4 * j);
+      }
+    }
+    transform_lanes(state, w);
+  }
+  second_round_lanes<V, LANES>(state, w, out);
+}
+
+__attribute__((target("avx2"))) void double_hash80_avx2(const uint8_t *base,
+                                                        size_t stride,
+                                                        uint8_t *out) {
+  double_hash_lanes<v8u, 8, 80>(base, stride, out);
+}
+
+__attribute__((target("avx512f"))) void double_hash80_avx512(
+    const uint8_t *base, size_t stride, uint8_t *out) {
+  double_hash_lanes<v16u, 16, 80>(base, stride, out);
+}
+
+__attribute__((target("avx2"))) void double_hash64_avx2(const uint8_t *base,
+                                                        size_t stride,
+                                                        uint8_t *out) {
+  double_hash_lanes<v8u, 8, 64>(base, stride, out);
+}
+
+__attribute__((target("avx512f"))) void double_hash64_avx512(
+    const uint8_t *base, size_t stride, uint8_t *out) {
+  double_hash_lanes<v16u, 16, 64>(base, stride, out);
+}
+
+__attribute__((target("avx2"))) void double_hash_padded_avx2(
+    const uint8_t *base, size_t stride, size_t blocks, uint8_t *out) {
+  double_hash_padded_lanes<v8u, 8>(base, stride, blocks, out);
+}
+
+__attribute__((target("avx512f"))) void double_hash_padded_avx512(
+    const uint8_t *base, size_t stride, size_t blocks, uint8_t *out) {
+  double_hash_padded_lanes<v16u, 16>(base, stride, blocks, out);
+}
+#endif
+
+typedef void (*batch_fn)(const uint8_t *base, size_t stride, uint8_t *out);
+typedef void (*padded_fn)(const uint8_t *base, size_t stride, size_t blocks,
+                          uint8_t *out);
+
+struct Backend {
+  const char *name;
+  transform_fn transform;
+};
+
+struct BatchBackend {
+  const char *name;
+  size_t lanes;
+  batch_fn batch;    // hashes exactly this many headers, or nullptr
+  batch_fn batch64;  // the same for 64-byte messages
+  padded_fn padded;  // the same for padded messages of any length
+};
+
+Backend select_backend() {
+#ifdef HAVE_SHANI
+  if (have_shani()) {
+    return {"shani", transform_shani};
+  }
+#endif
+#ifdef HAVE_ARMV8
+  if (have_armv8()) {
+    return {"armv8", transform_armv8};
+  }
+#endif
+  return {"generic", transform_generic};
+}
+
+const Backend &get_backend() {
+  static const Backend backend = [] {
+    const Backend b = select_backend();
+    LOG_DEBUG(log, "using {} sha256 implementation", b.name);
+    return b;
+  }();
+  return backend;
+}
+
+BatchBackend select_batch_backend() {
+#ifdef HAVE_SHANI
+  if (have_avx512()) {
+    return {"avx512", 16, double_hash80_avx512, double_hash64_avx512,
+            double_hash_padded_avx512};
+  }
+  if (have_avx2()) {
+    return {"avx2", 8, double_hash80_avx2, double_hash64_avx2,
+            double_hash_padded_avx2};
+  }
+#endif
+  return {"none", 1, nullptr, nullptr, nullptr};
+}
+
+const BatchBackend &get_batch_backend() {
+  static const BatchBackend backend = [] {
+    const BatchBackend b = select_batch_backend();
+    LOG_DEBUG(log, "using {} multi-buffer sha256 implementation", b.name);
+    return b;
+  }();
+  return backend;
+}
+
+inline void write_digest(const uint32_t *state, uint8_t *out) {
+  for (int i = 0; i < 8; i++) {
+    const uint32_t be = htobe32(state[i]);
+    std::memcpy(out + 4 * i, &be, sizeof be);
+  }
+}
+
+inline void write_length(uint8_t *end, uint64_t bytes) {
+  const uint64_t bits = htobe64(bytes * 8);
+  std::memcpy(end - sizeof bits, &bits, sizeof bits);
+}
+
+// the second round hashes a 32-byte digest, which is always one block
+void second_round(transform_fn transform, const uint8_t *digest,
+                  uint8_t *out) {
+  uint8_t block[64] = {0};
+  std::memcpy(block, digest, 32);
+  block[32] = 0x80;
+  write_length(block + sizeof block, 32);
+  uint32_t state[8];
+  std::memcpy(state, initial_state, sizeof state);
+  transform(state, block, 1);
+  write_digest(state, out);
+}
+}  // namespace
+
+#ifdef HAVE_SHANI
+// XCR0 bits for the register state AVX needs the OS to save: SSE and YMM,
+// and for AVX-512 the opmask and ZMM registers too
+static const uint64_t xcr0_avx = 0x6;
+static const uint64_t xcr0_avx512 = 0xe6;
+
+// Whether the OS saves all the state in mask across context switches. A
+// CPU can have AVX while the kernel or hypervisor leaves it off, and the
+// instructions fault.
+static bool os_saves(uint64_t mask) {
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE)) {
+    return false;
+  }
+  __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+  const uint64_t xcr0 = (uint64_t(edx) << 32) | eax;
+  return (xcr0 & mask) == mask;
+}
+
+bool have_avx2() {
+  unsigned eax, ebx, ecx, edx;
+  return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+         (ebx & bit_AVX2) && os_saves(xcr0_avx);
+}
+
+bool have_avx512() {
+  unsigned eax, ebx, ecx, edx;
+  return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+         (ebx & bit_AVX512F) && os_saves(xcr0_avx512);
+}
+#else
+bool have_avx2() { return false; }
+
+bool have_avx512() { return false; }
+#endif
+
+const char *backend() { return get_backend().name; }
+
+void hash(const uint8_t *data, size_t sz, uint8_t *out) {
+  const transform_fn transform = get_backend().transform;
+  uint32_t state[8];
+  std::memcpy(state, initial_state, sizeof state);
+  const size_t full = sz / 64;
+  transform(state, data, full);
+
+  // the remaining bytes, the 0x80 terminator and the length need one or two
+  // more blocks
+  uint8_t tail[128] = {0};
+  const size_t rem = sz % 64;
+  std::memcpy(tail, data + 64 * full, rem);
+  tail[rem] = 0x80;
+  const size_t tail_blocks = rem < 56 ? 1 : 2;
+  write_length(tail + 64 * tail_blocks, sz);
+  transform(state, tail, tail_blocks);
+  write_digest(state, out);
+}
+
+void double_hash(const uint8_t *data, size_t sz, uint8_t *out) {
+  uint8_t digest[32];
+  hash(data, sz, digest);
+  second_round(get_backend().transform, digest, out);
+}
+
+void double_hash_ranges(const Range *ranges, size_t n, uint8_t *out) {
+  const transform_fn transform = get_backend().transform;
+  uint32_t state[8];
+  std::memcpy(state, initial_state, sizeof state);
+
+  // full blocks are hashed in place; what's left of a range is carried in
+  // tail until the next range fills the block
+  uint8_t tail[128] = {0};
+  size_t used = 0, total = 0;
+  for (size_t i = 0; i < n; i++) {
+    const uint8_t *data = ranges[i].data;
+    size_t sz = ranges[i].size;
+    total += sz;
+    if (used) {
+      const size_t take = std::min(sz, 64 - used);
+      std::memcpy(tail + used, data, take);
+      used += take;
+      data += take;
+      sz -= take;
+      if (used < 64) {
+        continue;
+      }
+      transform(state, tail, 1);
+      used = 0;
+    }
+    const size_t full = sz / 64;
+    transform(state, data, full);
+    used = sz % 64;
+    std::memcpy(tail, data + 64 * full, used);
+  }
+
+  std::memset(tail + used, 0, sizeof tail - used);
+  tail[used] = 0x80;
+  const size_t tail_blocks = used < 56 ? 1 : 2;
+  write_length(tail + 64 * tail_blocks, total);
+  transform(state, tail, tail_blocks);
+
+  uint8_t digest[32];
+  write_digest(state, digest);
+  second_round(transform, digest, out);
+}
+
+void double_hash80(const uint8_t *data, uint8_t *out) {
+  static const size_t header_size = 80;
+  const transform_fn transform = get_backend().transform;
+  uint32_t state[8];
+  std::memcpy(state, initial_state, sizeof state);
+  transform(state, data, 1);
+
+  uint8_t block[64] = {0};
+  std::memcpy(block, data + 64, header_size - 64);
+  block[header_size - 64] = 0x80;
+  write_length(block + sizeof block, header_size);
+  transform(state, block, 1);
+
+  uint8_t digest[32];
+  write_digest(state, digest);
+  second_round(transform, digest, out);
+}
+
+void double_hash64(const uint8_t *data, uint8_t *out) {
+  const transform_fn transform = get_backend().transform;
+  uint32_t state[8];
+  std::memcpy(state, initial_state, sizeof state);
+  transform(state, data, 1);
+
+  // the padding is a block of its own
+  uint8_t block[64] = {0x80};
+  write_length(block + sizeof block, 64);
+  transform(state, block, 1);
+
+  uint8_t digest[32];
+  write_digest(state, digest);
+  second_round(transform, digest, out);
+}
+
+void double_hash64_batch(const uint8_t *data, size_t n, uint8_t *out) {
+  const BatchBackend &backend = get_batch_backend();
+  if (backend.batch64 != nullptr) {
+    for (; n >= backend.lanes; n -= backend.lanes) {
+      backend.batch64(data, 64, out);
+      data += 64 * backend.lanes;
+      out += 32 * backend.lanes;
+    }
+  }
+  for (; n; n--, data += 64, out += 32) {
+    double_hash64(data, out);
+  }
+}
+
+void double_hash80_batch(const uint8_t *base, size_t stride, size_t n,
+                         uint8_t *out) {
+  const BatchBackend &backend = get_batch_backend();
+  if (backend.batch != nullptr) {
+    for (; n >= backend.lanes; n -= backend.lanes) {
+      backend.batch(base, stride, out);
+      base += backend.lanes * stride;
+      out += 32 * backend.lanes;
+    }
+  }
+  for (; n; n--, base += stride, out += 32) {
+    double_hash80(base, out);
+  }
+}
+
+namespace {
+// Messages of up to this many blocks (padding included) are hashed in
+// lanes; a transaction that big is rare, and only blocks of the same size
+// can share a batch.
+const size_t max_lane_blocks = 32;
+
+inline size_t padded_blocks(size_t sz) { return (sz + 8) / 64 + 1; }
+
+// copy a message made of ranges into dst, padded to blocks * 64 bytes
+void pad_message(const Range *ranges, size_t n, size_t sz, size_t blocks,
+                 uint8_t *dst) {
+  uint8_t *p = dst;
+  for (size_t i = 0; i < n; i++) {
+    std::memcpy(p, ranges[i].data, ranges[i].size);
+    p += ranges[i].size;
+  }
+  std::memset(p, 0, dst + 64 * blocks - p);
+  *p = 0x80;
+  write_length(dst + 64 * blocks, sz);
+}
+
+struct PaddedScratch {
+  std::vector<uint32_t> order;  // message indices, sorted by block count
+  std::vector<uint8_t> padded;  // a batch of padded messages
+  uint8_t digests[32 * 16];
+};
+
+thread_local PaddedScratch scratch;
+}  // namespace
+
+void double_hash_ranges_batch(const Range *ranges, const size_t *first,
+                              size_t n, uint8_t *out) {
+  const BatchBackend &backend = get_batch_backend();
+  if (backend.padded == nullptr || n < backend.lanes) {
+    for (size_t i = 0; i < n; i++) {
+      double_hash_ranges(ranges + first[i], first[i + 1] - first[i],
+                         out + 32 * i);
+    }
+    return;
+  }
+
+  // Counting sort the messages by their number of blocks, so that each
+  // run of equal sizes can be hashed a full set of lanes at a time. The
+  // messages too big for lanes go last.
+  auto size_of = [&](size_t i) {
+    size_t sz = 0;
+    for (size_t j = first[i]; j < first[i + 1]; j++) {
+      sz += ranges[j].size;
+    }
+    return sz;
+  };
+  size_t counts[max_lane_blocks + 2] = {0};
+  for (size_t i = 0; i < n; i++) {
+    counts[std::min(padded_blocks(size_of(i)), max_lane_blocks + 1)]++;
+  }
+  size_t starts[max_lane_blocks + 2];
+  for (size_t b = 0, total = 0; b < max_lane_blocks + 2; b++) {
+    starts[b] = total;
+    total += counts[b];
+  }
+  PaddedScratch &s = scratch;
+  s.order.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    const size_t b = std::min(padded_blocks(size_of(i)), max_lane_blocks + 1);
+    s.order[starts[b]++] = i;
+  }
+
+  const size_t lanes = backend.lanes;
+  size_t pos = 0;
+  for (size_t b = 1; b <= max_lane_blocks; b++) {
+    const size_t end = pos + counts[b];
+    const size_t stride = 64 * b;
+    s.padded.resize(lanes * stride);
+    for (; end - pos >= lanes; pos += lanes) {
+      for (size_t l = 0; l < lanes; l++) {
+        const size_t i = s.order[pos + l];
+        pad_message(ranges + first[i], first[i + 1] - first[i], size_of(i), b,
+                    s.padded.data() + l * stride);
+      }
+      backend.padded(s.padded.data(), stride, b, s.digests);
+      for (size_t l = 0; l < lanes; l++) {
+        std::memcpy(out + 32 * s.order[pos + l], s.digests + 32 * l, 32);
+      }
+    }
+    for (; pos < end; pos++) {
+      const size_t i = s.order[pos];
+      double_hash_ranges(ranges + first[i], first[i + 1] - first[i],
+                         out + 32 * i);
+    }
+  }
+  for (; pos < n; pos++) {
+    const size_t i = s.order[pos];
+    double_hash_ranges(ranges + first[i], first[i + 1] - first[i],
+                       out + 32 * i);
+  }
+}
+}  // namespace sha256
+}  // namespace spv
@@ -0,0 +1,80 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace spv {
+namespace sha256 {
+// The block compression function is picked at startup based on the CPU:
+// SHA-NI on x86, the crypto extensions on ARMv8, and picosha2 otherwise.
+// Everything else (padding, double hashing) is shared.
+
+// name of the compression function in use, e.g. "shani"
+const char *backend();
+
+// out = SHA256(data), where out has 32 bytes
+void hash(const uint8_t *data, size_t sz, uint8_t *out);
+
+// out = SHA256(SHA256(data)), where out has 32 bytes
+void double_hash(const uint8_t *data, size_t sz, uint8_t *out);
+
+// A piece of the message for double_hash_ranges().
+struct Range {
+  const uint8_t *data;
+  size_t size;
+};
+
+// double_hash() of the n ranges one after another, without copying them
+// together first. A segwit transaction's txid is the hash of its bytes
+// with the marker, flag and witnesses left out, for example.
+void double_hash_ranges(const Range *ranges, size_t n, uint8_t *out);
+
+// double_hash_ranges() of n messages, where message i is made of the
+// ranges from ranges[first[i]] up to ranges[first[i + 1]]; out gets 32 * n
+// bytes. Messages that pad to the same number of blocks are hashed in
+// lanes, like double_hash80_batch(), which is how a block's txids are
+// hashed. Hashing a few messages is no faster than one at a time.
+void double_hash_ranges_batch(const Range *ranges, const size_t *first,
+                              size_t n, uint8_t *out);
+
+// Same as double_hash() for an 80-byte block header. The padding for both
+// rounds is known in advance, so this is three compressions and no copies
+// of the input.
+void double_hash80(const uint8_t *data, uint8_t *out);
+
+// double_hash80() of n headers at base, base + stride, and so on; out gets
+// 32 * n bytes. Where the CPU has AVX2 or AVX-512 this hashes 8 or 16
+// headers at once, with any leftovers hashed one at a time.
+void double_hash80_batch(const uint8_t *base, size_t stride, size_t n,
+                         uint8_t *out);
+
+// Whether the CPU has AVX2, or AVX-512F, and the OS saves the registers
+// they use. The other vectorized code checks here too.
+bool have_avx2();
+bool have_avx512();
+
+// Same as double_hash() for 64 bytes, the size of a pair of merkle nodes.
+// The second block is all padding.
+void double_hash64(const uint8_t *data, uint8_t *out);
+
+// double_hash64() of n consecutive 64-byte messages, batched like
+// double_hash80_batch(); out may be the same as data.
+void double_hash64_batch(const uint8_t *data, size_t n, uint8_t *out);
+}  // namespace sha256
+}  // namespace spv
@@ -0,0 +1,179 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./sha512.h"
+
+#include <endian.h>
+#include <algorithm>
+#include <cstring>
+
+namespace spv {
+namespace sha512 {
+namespace {
+const uint64_t round_constants[80] = {
+    0x428a2f98d728ae22, 0x7137449123ef65cd, 0xb5c0fbcfec4d3b2f,
+    0xe9b5dba58189dbbc, 0x3956c25bf348b538, 0x59f111f1b605d019,
+    0x923f82a4af194f9b, 0xab1c5ed5da6d8118, 0xd807aa98a3030242,
+    0x12835b0145706fbe, 0x243185be4ee4b28c, 0x550c7dc3d5ffb4e2,
+    0x72be5d74f27b896f, 0x80deb1fe3b1696b1, 0x9bdc06a725c71235,
+    0xc19bf174cf692694, 0xe49b69c19ef14ad2, 0xefbe4786384f25e3,
+    0x0fc19dc68b8cd5b5, 0x240ca1cc77ac9c65, 0x2de92c6f592b0275,
+    0x4a7484aa6ea6e483, 0x5cb0a9dcbd41fbd4, 0x76f988da831153b5,
+    0x983e5152ee66dfab, 0xa831c66d2db43210, 0xb00327c898fb213f,
+    0xbf597fc7beef0ee4, 0xc6e00bf33da88fc2, 0xd5a79147930aa725,
+    0x06ca6351e003826f, 0x142929670a0e6e70, 0x27b70a8546d22ffc,
+    0x2e1b21385c26c926, 0x4d2c6dfc5ac42aed, 0x53380d139d95b3df,
+    0x650a73548baf63de, 0x766a0abb3c77b2a8, 0x81c2c92e47edaee6,
+    0x92722c851482353b, 0xa2bfe8a14cf10364, 0xa81a664bbc423001,
+    0xc24b8b70d0f89791, 0xc76c51a30654be30, 0xd192e819d6ef5218,
+    0xd69906245565a910, 0xf40e35855771202a, 0x106aa07032bbd1b8,
+    0x19a4c116b8d2d0c8, 0x1e376c085141ab53, 0x2748774cdf8eeb99,
+    0x34b0bcb5e19b48a8, 0x391c0cb3c5c95a63, 0x4ed8aa4ae3418acb,
+    0x5b9cca4f7763e373, 0x682e6ff3d6b2b8a3, 0x748f82ee5defb2fc,
+    0x78a5636f43172f60, 0x84c87814a1f0ab72, 0x8cc702081a6439ec,
+    0x90befffa23631e28, 0xa4506cebde82bde9, 0xbef9a3f7b2c67915,
+    0xc67178f2e372532b, 0xca273eceea26619c, 0xd186b8c721c0c207,
+    0xeada7dd6cde0eb1e, 0xf57d4f7fee6ed178, 0x06f067aa72176fba,
+    0x0a637dc5a2c898a6, 0x113f9804bef90dae, 0x1b710b35131c471b,
+    0x28db77f523047d84, 0x32caab7b40c72493, 0x3c9ebe0a15c9bebc,
+    0x431d67c49c100d4c, 0x4cc5d4becb3e42b6, 0x597f299cfc657e2a,
+    0x5fcb6fab3ad6faec, 0x6c44198c4a475817};
+
+inline uint64_t rotr(uint64_t x, int n) { return (x >> n) | (x << (64 - n)); }
+
+void transform(uint64_t *state, const uint8_t *block) {
+  uint64_t w[80];
+  for (int i = 0; i < 16; i++) {
+    uint64_t word;
+    std::memcpy(&word, block + 8 * i, sizeof word);
+    w[i] = be64toh(word);
+  }
+  for (int i = 16; i < 80; i++) {
+    const uint64_t s0 =
+        rotr(w[i - 15], 1) ^ rotr(w[i - 15], 8) ^ (w[i - 15] >> 7);
+    const uint64_t s1 =
+        rotr(w[i - 2], 19) ^ rotr(w[i - 2], 61) ^ (w[i - 2] >> 6);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint64_t a = state[0], b = state[1], c = state[2], d = state[3],
+           e = state[4], f = state[5], g = state[6], h = state[7];
+  for (int i = 0; i < 80; i++) {
+    const uint64_t s1 = rotr(e, 14) ^ rotr(e, 18) ^ rotr(e, 41);
+    const uint64_t ch = (e & f) ^ (~e & g);
+    const uint64_t t1 = h + s1 + ch + round_constants[i] + w[i];
+    const uint64_t s0 = rotr(a, 28) ^ rotr(a, 34) ^ rotr(a, 39);
+    const uint64_t maj = (a & b) ^ (a & c) ^ (b & c);
+    const uint64_t t2 = s0 + maj;
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+// the streaming form, so HMAC can hash its pads and the message without
+// copying them together
+struct Hasher {
+  uint64_t state[8] = {0x6a09e667f3bcc908, 0xbb67ae8584caa73b,
+                       0x3c6ef372fe94f82b, 0xa54ff53a5f1d36f1,
+                       0x510e527fade682d1, 0x9b05688c2b3e6c1f,
+                       0x1f83d9abfb41bd6b, 0x5be0cd19137e2179};
+  uint8_t buf[128];
+  size_t used = 0;
+  uint64_t total = 0;
+
+  void write(const uint8_t *data, size_t sz) {
+    total += sz;
+    if (used) {
+      const size_t n = std::min(sz, sizeof buf - used);
+      std::memcpy(buf + used, data, n);
+      used += n;
+      data += n;
+      sz -= n;
+      if (used < sizeof buf) {
+        return;
+      }
+      transform(state, buf);
+      used = 0;
+    }
+    for (; sz >= sizeof buf; sz -= sizeof buf, data += sizeof buf) {
+      transform(state, data);
+    }
+    std::memcpy(buf, data, sz);
+    used = sz;
+  }
+
+  void finish(uint8_t *out) {
+    // the 0x80 marker and the 128-bit big-endian bit length, of which the
+    // high half is always 0 here
+    const uint64_t bits = htobe64(total * 8);
+    static const uint8_t pad[136] = {0x80};
+    write(pad, 1 + ((sizeof buf + 112 - 1 - used) % sizeof buf) + 8);
+    std::memcpy(buf + sizeof buf - 8, &bits, sizeof bits);
+    transform(state, buf);
+    for (int i = 0; i < 8; i++) {
+      const uint64_t word = htobe64(state[i]);
+      std::memcpy(out + 8 * i, &word, sizeof word);
+    }
+  }
+};
+}  // namespace
+
+void hash(const uint8_t *data, size_t sz, uint8_t *out) {
+  Hasher h;
+  h.write(data, sz);
+  h.finish(out);
+}
+
+void hmac(const uint8_t *key, size_t key_sz, const uint8_t *data, size_t sz,
+          uint8_t *out) {
+  uint8_t block[128] = {0};
+  if (key_sz > sizeof block) {
+    hash(key, key_sz, block);
+  } else {
+    std::memcpy(block, key, key_sz);
+  }
+  uint8_t pad[128];
+  for (size_t i = 0; i < sizeof pad; i++) {
+    pad[i] = block[i] ^ 0x36;
+  }
+  uint8_t inner[64];
+  Hasher ih;
+  ih.write(pad, sizeof pad);
+  ih.write(data, sz);
+  ih.finish(inner);
+  for (size_t i = 0; i < sizeof pad; i++) {
+    pad[i] = block[i] ^ 0x5c;
+  }
+  Hasher oh;
+  oh.write(pad, sizeof pad);
+  oh.write(inner, sizeof inner);
+  oh.finish(out);
+}
+}  // namespace sha512
+}  // namespace spv
@@ -0,0 +1,32 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace spv {
+namespace sha512 {
+// out = SHA512(data), where out has 64 bytes
+void hash(const uint8_t *data, size_t sz, uint8_t *out);
+
+// out = HMAC-SHA512(key, data), where out has 64 bytes, as BIP32 derives
+// child keys with
+void hmac(const uint8_t *key, size_t key_sz, const uint8_t *data, size_t sz,
+          uint8_t *out);
+}  // namespace sha512
+}  // namespace spv
@@ -0,0 +1,122 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./shaper.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace spv {
+Traffic traffic_class(Command cmd) {
+  switch (cmd) {
+    case Command::ADDR:
+    case Command::ADDRV2:
+    case Command::BLOCKTXN:
+    case Command::CMPCTBLOCK:
+    case Command::GETADDR:
+    case Command::GETBLOCKTXN:
+    case Command::GETDATA:
+    case Command::INV:
+    case Command::MEMPOOL:
+    case Command::TX:
+      return Traffic::RELAY;
+    case Command::GETHEADERS:
+    case Command::HEADERS:
+      return Traffic::HEADERS;
+    case Command::BLOCK:
+    case Command::CFCHECKPT:
+    case Command::CFHEADERS:
+    case Command::CFILTER:
+    case Command::GETBLOCKS:
+    case Command::GETCFCHECKPT:
+    case Command::GETCFHEADERS:
+    case Command::GETCFILTERS:
+    case Command::MERKLEBLOCK:
+      return Traffic::BULK;
+    default:
+      return Traffic::CONTROL;
+  }
+}
+
+void TokenBucket::set_rate(uint64_t bytes_per_second, uint64_t burst) {
+  rate_ = bytes_per_second;
+  burst_ = burst ? burst : rate_;
+  tokens_ = int64_t(burst_);
+  last_ = std::chrono::steady_clock::now();
+}
+
+void TokenBucket::refill() {
+  const time_point now = std::chrono::steady_clock::now();
+  const int64_t us =
+      std::chrono::duration_cast<std::chrono::microseconds>(now - last_)
+          .count();
+  const int64_t earned = int64_t(rate_) * us / 1000000;
+  if (earned > 0) {
+    tokens_ = std::min(tokens_ + earned, int64_t(burst_));
+    last_ = now;
+  }
+}
+
+int64_t TokenBucket::tokens() {
+  if (!limited()) {
+    return INT64_MAX;
+  }
+  refill();
+  return tokens_;
+}
+
+void TokenBucket::take(size_t n) {
+  if (limited()) {
+    refill();
+    tokens_ -= int64_t(n);
+  }
+}
+
+std::chrono::milliseconds TokenBucket::wait(int64_t min) {
+  const int64_t missing = min - tokens();
+  if (missing <= 0) {
+    return std::chrono::milliseconds(0);
+  }
+  const int64_t rate = int64_t(rate_);
+  return std::chrono::milliseconds((missing * 1000 + rate - 1) / rate);
+}
+
+int64_t TokenBucket::reserve(Traffic cls) const {
+  switch (cls) {
+    case Traffic::CONTROL:
+      return INT64_MIN;
+    case Traffic::RELAY:
+      return 0;
+    case Traffic::HEADERS:
+      return burst() / 4;
+    case Traffic::BULK:
+      return burst() / 2;
+  }
+  return 0;
+}
+
+bool TokenBucket::allows(Traffic cls) {
+  return !limited() || cls == Traffic::CONTROL || tokens() > reserve(cls);
+}
+
+std::chrono::milliseconds TokenBucket::wait(Traffic cls) {
+  if (allows(cls)) {
+    return std::chrono::milliseconds(0);
+  }
+  return wait(reserve(cls) + 1);
+}
+}  // namespace spv
@@ -0,0 +1,92 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "./fields.h"
+
+namespace spv {
+// Classes of traffic for bandwidth shaping, most urgent first. When a cap
+// runs short, the later classes wait first, so handshakes, pings and what
+// keeps the tip fresh get through while bulk sync takes what's left.
+enum class Traffic {
+  CONTROL,  // the handshake, pings and the like
+  RELAY,    // inv, tx and compact block relay, which carry the tip
+  HEADERS,  // header sync
+  BULK,     // blocks and compact filters
+};
+
+static const size_t num_traffic_classes = size_t(Traffic::BULK) + 1;
+
+// the class a message with this command is sent in
+Traffic traffic_class(Command cmd);
+
+// A token bucket that refills at a fixed rate of bytes (or whatever else is
+// counted) per second, holding at most a second's worth unless given a
+// bigger burst. Taking may overdraw it, so a message is never split;
+// whoever overdrew waits until it's back in credit. A rate of 0 means no
+// limit.
+class TokenBucket {
+ public:
+  typedef std::chrono::steady_clock::time_point time_point;
+
+  TokenBucket() : rate_(0), burst_(0), tokens_(0) {}
+  TokenBucket(const TokenBucket &other) = delete;
+
+  // start full, with burst tokens, or rate of them with 0
+  void set_rate(uint64_t bytes_per_second, uint64_t burst = 0);
+
+  inline bool limited() const { return rate_ != 0; }
+  inline uint64_t rate() const { return rate_; }
+
+  // the bytes that can be taken now, negative if overdrawn
+  int64_t tokens();
+
+  // take n bytes' worth, if limited
+  void take(size_t n);
+
+  // how long until there are at least min tokens
+  std::chrono::milliseconds wait(int64_t min = 1);
+
+  // the most the bucket holds
+  inline int64_t burst() const { return int64_t(burst_); }
+
+  // Can traffic of this class draw on the bucket now? Control traffic
+  // always can, and every other class leaves a reserve for the ones before
+  // it: none for relay, a quarter of the burst for headers and half of it
+  // for bulk transfers.
+  bool allows(Traffic cls);
+
+  // how long until allows(cls)
+  std::chrono::milliseconds wait(Traffic cls);
+
+ private:
+  uint64_t rate_;
+  uint64_t burst_;
+  int64_t tokens_;
+  time_point last_;
+
+  void refill();
+
+  // the tokens a class leaves in the bucket, see allows()
+  int64_t reserve(Traffic cls) const;
+};
+}  // namespace spv
@@ -0,0 +1,451 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+// Runs clients and their peers on a virtual clock, in a build configured
+// with --enable-simulation:
+//
+//   spv-sim headers.dat [nodes] [peers] [hours] [start] [-- options]
+//
+// headers.dat holds consecutive 80-byte headers from the genesis block, as
+// written by spv --export-headers. Each of the nodes (1 by default) is a
+// Client with its own data directory, taking any spv options after the --,
+// and has its own simulated peers (8 by default) serving the headers over
+// connections with no sockets, on the same loop. The clock starts at the
+// timestamp of header start (the last one by default): the peers know the
+// headers up to there, and announce the rest as the clock passes their
+// timestamps, so that the chain grows as it did. Each connection lasts
+// CHURN_MEAN on average, and its peer is back RECONNECT_DELAY later.
+//
+// The run covers hours of virtual time (24 by default), reporting every
+// REPORT_EVERY of it, and ends with how much faster than real time it
+// went.
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "./arena.h"
+#include "./chain.h"
+#include "./client.h"
+#include "./constants.h"
+#include "./fs.h"
+#include "./hashmap.h"
+#include "./logging.h"
+#include "./message.h"
+#include "./pow.h"
+#include "./settings.h"
+#include "./simulation.h"
+#include "./timer_wheel.h"
+#include "./util.h"
+#include "./uvw.h"
+
+using namespace spv;
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+static const std::chrono::milliseconds LATENCY{50};
+static const std::chrono::minutes CHURN_MEAN{30};
+static const std::chrono::seconds RECONNECT_DELAY{10};
+static const std::chrono::minutes ANNOUNCE_EVERY{1};
+static const std::chrono::hours REPORT_EVERY{1};
+
+// the headers, and how many of them the simulated network knows so far
+class SimChain {
+ public:
+  explicit SimChain(const std::string &raw)
+      : raw_(raw), count_(raw.size() / BLOCK_HEADER_SIZE), known_(0) {
+    hashes_.resize(count_);
+    pow_hash_batch(raw_.data(), BLOCK_HEADER_SIZE, count_, hashes_.data());
+    heights_.reserve(count_);
+    for (size_t i = 0; i < count_; i++) {
+      heights_.emplace(hashes_[i], i);
+    }
+  }
+
+  inline size_t count() const { return count_; }
+  inline size_t known() const { return known_; }
+  inline const hash_t &hash(size_t height) const { return hashes_[height]; }
+
+  uint32_t timestamp(size_t height) const {
+    BlockHeader hdr;
+    hdr.unpack(raw_.data() + height * BLOCK_HEADER_SIZE);
+    return hdr.timestamp;
+  }
+
+  // know the headers up to this height
+  inline void set_known(size_t height) { known_ = height + 1; }
+
+  // Know the headers whose time has come, in order; returns true if there
+  // are more.
+  bool reveal(uint32_t now) {
+    const size_t before = known_;
+    while (known_ < count_ && timestamp(known_) <= now) {
+      known_++;
+    }
+    return known_ > before;
+  }
+
+  // headers [from, to) of the known ones, at most a message's worth
+  HeadersMsg headers(size_t from, size_t to) const {
+    to = std::min({to, known_, from + MAX_HEADERS_RESULTS});
+    HeadersMsg msg;
+    msg.block_headers.resize(to > from ? to - from : 0);
+    for (size_t i = from; i < to; i++) {
+      msg.block_headers[i - from].unpack(raw_.data() + i * BLOCK_HEADER_SIZE);
+    }
+    return msg;
+  }
+
+  // the reply to a getheaders, from the first locator hash we know
+  HeadersMsg headers_after(const GetHeaders &req) const {
+    size_t start = 0;
+    for (const auto &hash : req.locator_hashes) {
+      const uint32_t *height = heights_.find(hash);
+      if (height != nullptr && *height < known_) {
+        start = *height + 1;
+        break;
+      }
+    }
+    size_t stop = known_;
+    const uint32_t *stop_height = heights_.find(req.hash_stop);
+    if (stop_height != nullptr && *stop_height >= start) {
+      stop = std::min<size_t>(stop, *stop_height + 1);
+    }
+    return headers(start, stop);
+  }
+
+ private:
+  const std::string &raw_;
+  const size_t count_;
+  size_t known_;
+  std::vector<hash_t> hashes_;
+  FlatHashMap<hash_t, uint32_t> heights_;
+};
+
+// A peer of one node: it answers the handshake, getheaders and pings after
+// LATENCY, announces new headers, and comes and goes.
+class SimPeer {
+ public:
+  SimPeer(Client &client, const Addr &addr, const SimChain &chain,
+          TimerWheel &wheel, std::mt19937_64 &rng)
+      : client_(client),
+        addr_(addr),
+        chain_(chain),
+        rng_(rng),
+        reply_timer_(wheel, [this]() { deliver(); }),
+        churn_timer_(wheel, [this]() { churn(); }),
+        connected_(false),
+        announced_(0),
+        reconnects_(0) {}
+
+  inline bool connected() const { return connected_; }
+  inline size_t reconnects() const { return reconnects_; }
+
+  void connect() {
+    connected_ = true;
+    announced_ = chain_.known();
+    client_.replay_open(addr_);
+    std::exponential_distribution<double> lasts(1.0 / CHURN_MEAN.count());
+    churn_timer_.start(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::duration<double, std::ratio<60>>(lasts(rng_))));
+  }
+
+  // what the client wrote to us
+  void receive(const char *data, size_t size) {
+    in_.append(data, size);
+    size_t off = 0;
+    while (in_.size() - off >= HEADER_SIZE) {
+      const size_t msg_size = message_size(in_.data() + off);
+      if (in_.size() - off < msg_size) {
+        break;
+      }
+      size_t used;
+      auto msg = decode_message(in_.data() + off, msg_size, &used, arena_);
+      if (msg != nullptr) {
+        handle(msg.get());
+      }
+      off += msg_size;
+    }
+    in_.erase(0, off);
+    arena_.reset();
+  }
+
+  // send the headers the network has learned of since the last time
+  void announce() {
+    if (connected_ && chain_.known() > announced_) {
+      send(chain_.headers(announced_, chain_.known()));
+      announced_ = chain_.known();
+    }
+  }
+
+ private:
+  Client &client_;
+  const Addr addr_;
+  const SimChain &chain_;
+  std::mt19937_64 &rng_;
+  Timer reply_timer_;
+  Timer churn_timer_;  // to hang up, or to come back
+  bool connected_;
+  size_t announced_;
+  size_t reconnects_;
+  std::string in_;
+  Arena arena_;
+  std::deque<std::pair<time_point, std::string> > out_;
+
+  void handle(const Message *msg) {
+    if (auto *ver = dynamic_cast<const Version *>(msg)) {
+      Version reply;
+      reply.version = 70016;
+      reply.services = NODE_NETWORK | NODE_WITNESS;
+      reply.nonce = ver->nonce + 1;  // anything but the client's
+      reply.user_agent = "/spv-sim/";
+      reply.start_height = chain_.known() - 1;
+      send(reply);
+      send(VerAck{});
+    } else if (auto *req = dynamic_cast<const GetHeaders *>(msg)) {
+      send(chain_.headers_after(*req));
+    } else if (auto *ping = dynamic_cast<const Ping *>(msg)) {
+      Pong pong;
+      pong.nonce = ping->nonce;
+      send(pong);
+    }
+  }
+
+  void send(const Message &msg) {
+    size_t size;
+    std::unique_ptr<char[]> data = msg.encode(size);
+    out_.emplace_back(now() + LATENCY, std::string(data.get(), size));
+    if (!reply_timer_.active()) {
+      reply_timer_.start(LATENCY);
+    }
+  }
+
+  void deliver() {
+    const time_point cur = now();
+    while (connected_ && !out_.empty() && out_.front().first <= cur) {
+      const std::string bytes = std::move(out_.front().second);
+      out_.pop_front();
+      client_.replay_read(addr_, bytes.data(), bytes.size());
+    }
+    if (connected_ && !out_.empty()) {
+      reply_timer_.start(std::chrono::duration_cast<std::chrono::milliseconds>(
+          out_.front().first - cur));
+    }
+  }
+
+  void churn() {
+    if (!connected_) {
+      reconnects_++;
+      connect();
+      return;
+    }
+    connected_ = false;
+    out_.clear();
+    in_.clear();
+    reply_timer_.stop();
+    client_.replay_close(addr_);
+    churn_timer_.start(RECONNECT_DELAY);
+  }
+};
+
+// a client and its peers
+struct Node {
+  Settings settings;
+  std::unique_ptr<Client> client;
+  std::unordered_map<Addr, std::unique_ptr<SimPeer> > peers;
+};
+
+void report(const Simulation &sim, const SimChain &chain,
+            const std::vector<std::unique_ptr<Node> > &nodes,
+            Clock::time_point start) {
+  size_t lowest = SIZE_MAX, highest = 0, connected = 0, reconnects = 0;
+  for (const auto &node : nodes) {
+    lowest = std::min(lowest, node->client->get_height());
+    highest = std::max(highest, node->client->get_height());
+    for (const auto &pr : node->peers) {
+      connected += pr.second->connected();
+      reconnects += pr.second->reconnects();
+    }
+  }
+  std::printf(
+      "%6.1f h (%.2f s real): heights %zu to %zu of %zu, %zu peers "
+      "connected, %zu reconnects, %zu clock jumps\n",
+      std::chrono::duration<double, std::ratio<3600> >(sim.elapsed()).count(),
+      std::chrono::duration<double>(Clock::now() - start).count(), lowest,
+      highest, chain.known() - 1, connected, reconnects, sim.jumps());
+  std::fflush(stdout);
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  int split = argc;
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--") == 0) {
+      split = i;
+      break;
+    }
+  }
+  if (split < 2 || split > 6) {
+    std::fprintf(stderr,
+                 "usage: %s headers.dat [nodes] [peers] [hours] [start] "
+                 "[-- spv options]\n",
+                 argv[0]);
+    return 1;
+  }
+  if (!simulation_available) {
+    std::fprintf(stderr, "%s needs a build with --enable-simulation\n",
+                 argv[0]);
+    return 1;
+  }
+  const size_t node_count = split > 2 ? std::stoul(argv[2]) : 1;
+  const size_t peer_count = split > 3 ? std::stoul(argv[3]) : 8;
+  const std::chrono::hours hours(split > 4 ? std::stoul(argv[4]) : 24);
+
+  std::ifstream file(argv[1], std::ios::binary);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  const std::string headers = contents.str();
+  if (!file || headers.empty() || headers.size() % BLOCK_HEADER_SIZE != 0) {
+    std::fprintf(stderr, "%s isn't a file of 80-byte headers\n", argv[1]);
+    return 1;
+  }
+  SimChain chain(headers);
+  const size_t start_height = std::min<size_t>(
+      split > 5 ? std::stoul(argv[5]) : chain.count(), chain.count() - 1);
+  chain.set_known(start_height);
+
+  char datadir[] = "/tmp/spv-sim.XXXXXX";
+  if (mkdtemp(datadir) == nullptr) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  std::vector<const char *> args = {argv[0], "--data-dir", datadir,
+                                    "--slow-callback-ms", "0"};
+  for (int i = split + 1; i < argc; i++) {
+    args.push_back(argv[i]);
+  }
+  args.push_back(nullptr);
+  spdlog::set_level(spdlog::level::warn);  // -d still turns on debugging
+  int ret = -1;
+  const Settings &settings = parse_settings(
+      args.size() - 1, const_cast<char **>(args.data()), &ret);
+  if (ret != -1) {
+    recursive_delete(datadir);
+    return ret;
+  }
+  if (chain.hash(0) != BlockHeader::genesis().block_hash) {
+    std::fprintf(stderr, "%s doesn't start at the genesis block\n", argv[1]);
+    recursive_delete(datadir);
+    return 1;
+  }
+
+  auto loop = uvw::Loop::getDefault();
+  Simulation sim(loop, uint64_t(chain.timestamp(start_height)) * 1000);
+  TimerWheel wheel(loop);  // for the peers, on the virtual clock
+  std::mt19937_64 rng(0);  // the same run every time
+
+  std::vector<std::unique_ptr<Node> > nodes;
+  for (size_t i = 0; i < node_count; i++) {
+    std::unique_ptr<Node> node(new Node);
+    node->settings = settings;
+    node->settings.datadir = std::string(datadir) + "/" + std::to_string(i);
+    ::mkdir(node->settings.datadir.c_str(), 0700);
+    node->client.reset(new Client(node->settings, loop));
+    Node *raw = node.get();
+    node->client->on_replay_write(
+        [raw](const Addr &addr, const char *data, size_t size) {
+          auto it = raw->peers.find(addr);
+          if (it != raw->peers.end()) {
+            it->second->receive(data, size);
+          }
+        });
+    for (size_t j = 0; j < peer_count; j++) {
+      Addr addr;
+      addr.set_ip("10." + std::to_string(i % 256) + "." +
+                  std::to_string(j / 256) + "." + std::to_string(j % 256));
+      addr.set_port(network().port);
+      node->peers.emplace(addr, std::unique_ptr<SimPeer>(new SimPeer(
+                                    *node->client, addr, chain, wheel, rng)));
+    }
+    nodes.push_back(std::move(node));
+  }
+  // the indexes load on threads of their own, in real time
+  for (const auto &node : nodes) {
+    while (!node->client->chain().index_loaded()) {
+      usleep(1000);
+    }
+  }
+  for (const auto &node : nodes) {
+    node->client->replay_start();
+    for (auto &pr : node->peers) {
+      pr.second->connect();
+    }
+  }
+
+  Timer announce(wheel);
+  announce.set_callback([&]() {
+    if (chain.reveal(time32())) {
+      for (const auto &node : nodes) {
+        for (auto &pr : node->peers) {
+          pr.second->announce();
+        }
+      }
+    }
+    announce.start(ANNOUNCE_EVERY);
+  });
+  announce.start(ANNOUNCE_EVERY);
+
+  const auto start = Clock::now();
+  while (sim.elapsed() < hours) {
+    sim.run_for(std::min<std::chrono::milliseconds>(
+        REPORT_EVERY, hours - sim.elapsed()));
+    report(sim, chain, nodes, start);
+  }
+  const double real =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  std::printf("simulated %zu h in %.2f s, %.0fx real time\n",
+              size_t(hours.count()), real, hours.count() * 3600 / real);
+
+  announce.stop();
+  for (const auto &node : nodes) {
+    node->client->shutdown();
+  }
+  wheel.close();
+  loop->walk([](uvw::BaseHandle &h) {
+    if (!h.closing()) {
+      h.close();
+    }
+  });
+  loop->run();
+  loop->close();
+  nodes.clear();
+  recursive_delete(datadir);
+  return 0;
+}
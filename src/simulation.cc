@@ -0,0 +1,124 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./simulation.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+#include "./logging.h"
+#include "./scheduler.h"
+#include "./timer_wheel.h"
+#include "./util.h"
+
+namespace spv {
+MODULE_LOGGER
+
+#ifdef SPV_SIMULATION
+Simulation::Simulation(std::shared_ptr<uvw::Loop> loop, uint64_t start_ms)
+    : loop_(loop), start_ms_(start_ms), jumps_(0), stopped_(false) {
+  sim_clock_ms.store(start_ms, std::memory_order_relaxed);
+}
+
+std::chrono::milliseconds Simulation::elapsed() const {
+  return std::chrono::milliseconds(
+      sim_clock_ms.load(std::memory_order_relaxed) - start_ms_);
+}
+
+bool Simulation::busy() {
+  bool busy = false;
+  loop_->walk([&busy](uvw::BaseHandle &h) {
+    busy |= h.type() == uvw::HandleType::IDLE && h.active();
+  });
+  return busy;
+}
+
+void Simulation::settle() {
+  for (;;) {
+    // one pass over whatever is ready, async wakeups from tasks included
+    loop_->run<uvw::Loop::Mode::NOWAIT>();
+    bool ran = false;
+    while (scheduler().run_one()) {
+      ran = true;
+    }
+    if (!ran && !busy()) {
+      return;
+    }
+  }
+}
+
+uint64_t Simulation::next_wakeup() const {
+  uint64_t next = 0;
+  for (const TimerWheel *wheel : TimerWheel::wheels_) {
+    if (wheel->handle_ && wheel->wakeup_) {
+      const uint64_t due =
+          wheel->origin_ + wheel->wakeup_ * TimerWheel::tick.count();
+      if (next == 0 || due < next) {
+        next = due;
+      }
+    }
+  }
+  return next;
+}
+
+void Simulation::run_for(std::chrono::milliseconds duration) {
+  const uint64_t until =
+      sim_clock_ms.load(std::memory_order_relaxed) + duration.count();
+  stopped_ = false;
+  while (!stopped_) {
+    settle();
+    const uint64_t next = next_wakeup();
+    const uint64_t cur = sim_clock_ms.load(std::memory_order_relaxed);
+    if (next == 0 || next > until) {
+      sim_clock_ms.store(std::max(cur, until), std::memory_order_relaxed);
+      return;
+    }
+    sim_clock_ms.store(std::max(cur, next), std::memory_order_relaxed);
+    jumps_++;
+    // timer callbacks may make or destroy wheels, e.g. with a client
+    const std::vector<TimerWheel *> wheels = TimerWheel::wheels_;
+    for (TimerWheel *wheel : wheels) {
+      const auto &live = TimerWheel::wheels_;
+      if (std::find(live.begin(), live.end(), wheel) == live.end() ||
+          !wheel->handle_ || !wheel->wakeup_ ||
+          wheel->origin_ + wheel->wakeup_ * TimerWheel::tick.count() >
+              sim_clock_ms.load(std::memory_order_relaxed)) {
+        continue;
+      }
+      wheel->wakeup_ = 0;
+      wheel->advance();
+    }
+  }
+}
+#else
+Simulation::Simulation(std::shared_ptr<uvw::Loop> loop, uint64_t start_ms)
+    : loop_(loop), start_ms_(start_ms), jumps_(0), stopped_(false) {
+  log->error("simulations need a build with --enable-simulation");
+  std::abort();
+}
+
+std::chrono::milliseconds Simulation::elapsed() const {
+  return std::chrono::milliseconds(0);
+}
+
+void Simulation::run_for(std::chrono::milliseconds) {}
+void Simulation::settle() {}
+bool Simulation::busy() { return false; }
+uint64_t Simulation::next_wakeup() const { return 0; }
+#endif
+}  // namespace spv
@@ -0,0 +1,81 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "./config.h"
+#include "./uvw.h"
+
+namespace spv {
+#ifdef SPV_SIMULATION
+static const bool simulation_available = true;
+#else
+static const bool simulation_available = false;
+#endif
+
+// Runs a loop on a virtual clock, with --enable-simulation. In that build
+// now(), time32() and time64() read the virtual clock, every TimerWheel
+// runs on it (the client's and its connections' timers all live on one),
+// and the Scheduler has no threads. A Simulation runs whatever is ready on
+// the loop, and the scheduler's tasks, until nothing is; then it moves the
+// clock straight to the next timer on any wheel. Hours of timeouts, pings
+// and retries take only as long as the work they do, and with the peers
+// simulated on the loop too (see Client::replay_open()) a run goes the same
+// way every time.
+//
+// Only the wheels are virtual: libuv's own timers, the token buckets and
+// the latency metrics still go by the real clock.
+class Simulation {
+ public:
+  // Start the virtual clock at this many ms since the epoch. This has to
+  // happen before the clients are made, so that their wheels start on it.
+  Simulation(std::shared_ptr<uvw::Loop> loop, uint64_t start_ms);
+  Simulation(const Simulation &other) = delete;
+
+  // the virtual time since the start
+  std::chrono::milliseconds elapsed() const;
+
+  // Run the loop until the clock has moved on this far, stop() is called,
+  // or no timer is left.
+  void run_for(std::chrono::milliseconds duration);
+
+  inline void stop() { stopped_ = true; }
+
+  // how many times the clock has jumped to a timer
+  inline size_t jumps() const { return jumps_; }
+
+ private:
+  std::shared_ptr<uvw::Loop> loop_;
+  const uint64_t start_ms_;
+  size_t jumps_;
+  bool stopped_;
+
+  // run what's ready until nothing is
+  void settle();
+
+  // does the loop have an idle handle that wants to run?
+  bool busy();
+
+  // the ms the earliest wheel on this thread wakes at, or 0 if none does
+  uint64_t next_wakeup() const;
+};
+}  // namespace spv
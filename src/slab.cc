@@ -0,0 +1,99 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./slab.h"
+
+#include <array>
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+#include "./memory.h"
+
+namespace spv {
+namespace slab {
+namespace {
+// size classes are 2^min_shift through 2^max_shift bytes; anything larger
+// goes straight to the heap
+const size_t min_shift = 6;
+const size_t max_shift = 22;
+const size_t num_classes = max_shift - min_shift + 1;
+
+// don't keep more than this many bytes of a size class per thread
+const size_t max_cached_bytes = 1 << 20;
+
+struct FreeLists {
+  std::array<std::vector<std::unique_ptr<char[]> >, num_classes> lists;
+
+  ~FreeLists() {
+    for (size_t i = 0; i < num_classes; i++) {
+      mem_add(MemTag::SLAB_CACHE,
+              -int64_t(lists[i].size() << (i + min_shift)));
+    }
+  }
+};
+
+thread_local FreeLists free_lists;
+
+inline size_t class_shift(size_t sz) {
+  size_t shift = min_shift;
+  while ((size_t(1) << shift) < sz) {
+    shift++;
+  }
+  return shift;
+}
+}  // namespace
+
+size_t round_up(size_t sz) { return size_t(1) << class_shift(sz); }
+
+std::unique_ptr<char[]> allocate(size_t sz, bool zero) {
+  const size_t shift = class_shift(sz);
+  const size_t cap = size_t(1) << shift;
+  std::unique_ptr<char[]> block;
+  if (shift <= max_shift) {
+    auto &list = free_lists.lists[shift - min_shift];
+    if (!list.empty()) {
+      block = std::move(list.back());
+      list.pop_back();
+      mem_add(MemTag::SLAB_CACHE, -int64_t(cap));
+    }
+  }
+  if (!block) {
+    block.reset(new char[cap]);
+  }
+  if (zero) {
+    std::memset(block.get(), 0, cap);
+  }
+  return block;
+}
+
+void release(std::unique_ptr<char[]> block, size_t cap) {
+  if (!block) {
+    return;
+  }
+  const size_t shift = class_shift(cap);
+  assert((size_t(1) << shift) == cap);
+  if (shift > max_shift) {
+    return;
+  }
+  auto &list = free_lists.lists[shift - min_shift];
+  if ((list.size() + 1) * cap <= max_cached_bytes || list.empty()) {
+    list.push_back(std::move(block));
+    mem_add(MemTag::SLAB_CACHE, cap);
+  }
+}
+}  // namespace slab
+}  // namespace spv
@@ -0,0 +1,40 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+
+namespace spv {
+namespace slab {
+// A pool of power-of-two sized byte blocks for Buffer and Encoder. Freed
+// blocks go on a per-thread free list for their size class, so growing and
+// shrinking buffers doesn't keep going back to the heap. Blocks are plain
+// new char[] allocations, which means one can also just be deleted, e.g. by
+// uvw after it has written a serialized message.
+
+// the size of the block that allocate(sz) returns
+size_t round_up(size_t sz);
+
+// Get a block of round_up(sz) bytes. Its contents are indeterminate unless
+// zero is set.
+std::unique_ptr<char[]> allocate(size_t sz, bool zero = false);
+
+// Give a block back to this thread's free list; cap must be the block's size.
+void release(std::unique_ptr<char[]> block, size_t cap);
+}  // namespace slab
+}  // namespace spv
@@ -0,0 +1,584 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+// A soak test of many connections at once:
+//
+//   spv-soak peers [fast,slow,flood,disconnect,malicious] [seconds]
+//            [-- options]
+//
+// Simulated peers, 1 to 5000 of them, run on a loop of their own thread,
+// each on an address of its own in 127.0.0.0/8 so that the client sees
+// them as different hosts. Their addresses go in the address book of a
+// Client with a fresh data directory, which runs with --connections set to
+// the number of peers and any spv options after the --. The second
+// argument weighs how many peers behave in each way (60,10,10,10,10 by
+// default):
+//
+//   fast        answers the handshake, pings and requests at once
+//   slow        the same, but every reply takes SLOW_DELAY
+//   flood       announces INV_FLOOD made up transactions every INV_EVERY
+//   disconnect  hangs up a few seconds after the handshake
+//   malicious   sends a headers message with a bad checksum
+//
+// Every REPORT_EVERY, for as many seconds as asked (60 by default), it
+// prints the client's loop lag, its peers and the memory per peer, the
+// messages per second both ways, and the rate of new connections after the
+// first one to each peer.
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./addrman.h"
+#include "./arena.h"
+#include "./chain.h"
+#include "./client.h"
+#include "./constants.h"
+#include "./fs.h"
+#include "./logging.h"
+#include "./memory.h"
+#include "./message.h"
+#include "./settings.h"
+#include "./uvw.h"
+
+using namespace spv;
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+static const size_t MAX_PEERS = 5000;
+static const std::chrono::seconds REPORT_EVERY{5};
+static const std::chrono::milliseconds LAG_TICK{10};
+static const std::chrono::milliseconds SLOW_DELAY{2000};
+static const std::chrono::milliseconds INV_EVERY{100};
+static const size_t INV_FLOOD = 50;
+
+// disconnecting peers hang up this long after the handshake, at random
+static const std::chrono::milliseconds MIN_HANGUP{1000};
+static const std::chrono::milliseconds MAX_HANGUP{10000};
+
+enum class Behavior { FAST, SLOW, FLOOD, DISCONNECT, MALICIOUS, NUM };
+
+static const char *behavior_names[] = {"fast", "slow", "flood", "disconnect",
+                                       "malicious"};
+
+// Peer i listens on 127.(1 + i % 250).(1 + i / 250).1, so that the peers
+// spread over 250 network groups, as the address book sees them.
+static std::string peer_ip(size_t i) {
+  return "127." + std::to_string(1 + i % 250) + "." +
+         std::to_string(1 + i / 250) + ".1";
+}
+
+static bool peer_index(const std::string &ip, size_t &i) {
+  unsigned a, b, c, d;
+  if (std::sscanf(ip.c_str(), "%u.%u.%u.%u", &a, &b, &c, &d) != 4 ||
+      a != 127 || b < 1 || b > 250 || c < 1 || d != 1) {
+    return false;
+  }
+  i = (c - 1) * 250 + (b - 1);
+  return true;
+}
+
+// counted on the peers' thread, read on the client's
+struct Stats {
+  std::atomic<size_t> accepts{0};
+  std::atomic<size_t> reconnects{0};  // accepts after a peer's first
+  std::atomic<size_t> closes{0};
+  std::atomic<size_t> live{0};  // connections whose handshake is done
+  std::atomic<size_t> messages_in{0};
+  std::atomic<size_t> messages_out{0};
+};
+
+class SimPeers;
+
+// one accepted connection from the client
+class SimConnection {
+ public:
+  SimConnection(SimPeers &peers, std::shared_ptr<uvw::TcpHandle> tcp,
+                Behavior behavior);
+  SimConnection(const SimConnection &other) = delete;
+  ~SimConnection() { close(); }
+
+  void close();
+
+ private:
+  struct Reply {
+    Clock::time_point ready;
+    std::unique_ptr<char[]> data;
+    size_t size;
+  };
+
+  SimPeers &peers_;
+  std::shared_ptr<uvw::TcpHandle> tcp_;
+  std::shared_ptr<uvw::TimerHandle> timer_;  // for delays, floods, hangups
+  const Behavior behavior_;
+  std::string in_;
+  Arena arena_;
+  std::deque<Reply> out_;
+  bool live_;
+
+  void read(const char *data, size_t size);
+  void handle(const Message *msg);
+  void handshake_done();
+  void send(const Message &msg);
+  void write(std::unique_ptr<char[]> data, size_t size);
+  void tick();
+  void pump();
+  void flood();
+};
+
+// the listener for every simulated peer, and their connections
+class SimPeers {
+ public:
+  SimPeers(std::shared_ptr<uvw::Loop> loop, size_t count,
+           const std::vector<unsigned> &weights)
+      : loop_(loop), rng_(std::random_device{}()), seen_(count, false) {
+    const unsigned total =
+        std::accumulate(weights.begin(), weights.end(), 0u);
+    behaviors_.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+      // interleaved, so that every network group gets a mix
+      unsigned pick = (i * 2654435761u) % total;
+      size_t b = 0;
+      while (pick >= weights[b]) {
+        pick -= weights[b++];
+      }
+      behaviors_.push_back(Behavior(b));
+    }
+  }
+
+  Stats stats;
+
+  inline std::shared_ptr<uvw::Loop> loop() { return loop_; }
+  inline std::mt19937_64 &rng() { return rng_; }
+  inline Behavior behavior(size_t i) const { return behaviors_[i]; }
+
+  // listen on an ephemeral port of every loopback address, and return it
+  uint16_t listen() {
+    server_ = loop_->resource<uvw::TcpHandle>();
+    server_->on<uvw::ErrorEvent>([](const auto &exc, auto &) {
+      std::fprintf(stderr, "simulated peers: %s\n", exc.what());
+    });
+    server_->on<uvw::ListenEvent>(
+        [this](const auto &, auto &server) { accept(server); });
+    server_->bind("0.0.0.0", 0);
+    server_->listen(1024);
+    stop_ = loop_->resource<uvw::AsyncHandle>();
+    stop_->on<uvw::AsyncEvent>([this](const auto &, auto &) { close(); });
+    return server_->sock().port;
+  }
+
+  // from another thread, close everything so that the loop's run returns
+  void stop() { stop_->send(); }
+
+  void remove(SimConnection *conn) {
+    auto it = std::find_if(conns_.begin(), conns_.end(),
+                           [=](const std::unique_ptr<SimConnection> &c) {
+                             return c.get() == conn;
+                           });
+    if (it == conns_.end()) {
+      return;
+    }
+    stats.closes++;
+    conn->close();
+    it->release();
+    conns_.erase(it);
+    // one of its handles' callbacks is still on the stack
+    auto idle = loop_->resource<uvw::IdleHandle>();
+    idle->once<uvw::IdleEvent>([conn](const auto &, auto &idle) {
+      delete conn;
+      idle.close();
+    });
+    idle->start();
+  }
+
+ private:
+  std::shared_ptr<uvw::Loop> loop_;
+  std::mt19937_64 rng_;
+  std::vector<Behavior> behaviors_;
+  std::vector<bool> seen_;
+  std::shared_ptr<uvw::TcpHandle> server_;
+  std::shared_ptr<uvw::AsyncHandle> stop_;
+  std::vector<std::unique_ptr<SimConnection>> conns_;
+
+  void accept(uvw::TcpHandle &server) {
+    auto tcp = loop_->resource<uvw::TcpHandle>();
+    server.accept(*tcp);
+    size_t i;
+    if (!peer_index(tcp->sock().ip, i) || i >= behaviors_.size()) {
+      tcp->close();
+      return;
+    }
+    stats.accepts++;
+    if (seen_[i]) {
+      stats.reconnects++;
+    }
+    seen_[i] = true;
+    conns_.emplace_back(new SimConnection(*this, tcp, behaviors_[i]));
+  }
+
+  void close() {
+    conns_.clear();
+    loop_->walk([](uvw::BaseHandle &h) {
+      if (!h.closing()) {
+        h.close();
+      }
+    });
+  }
+};
+
+SimConnection::SimConnection(SimPeers &peers,
+                             std::shared_ptr<uvw::TcpHandle> tcp,
+                             Behavior behavior)
+    : peers_(peers), tcp_(tcp), behavior_(behavior), live_(false) {
+  timer_ = peers_.loop()->resource<uvw::TimerHandle>();
+  timer_->on<uvw::TimerEvent>([this](const auto &, auto &) { tick(); });
+  tcp_->on<uvw::DataEvent>([this](const auto &data, auto &) {
+    read(data.data.get(), data.length);
+  });
+  tcp_->once<uvw::EndEvent>(
+      [this](const auto &, auto &) { peers_.remove(this); });
+  tcp_->once<uvw::ErrorEvent>(
+      [this](const auto &, auto &) { peers_.remove(this); });
+  tcp_->read();
+}
+
+void SimConnection::close() {
+  if (live_) {
+    peers_.stats.live--;
+    live_ = false;
+  }
+  if (!timer_->closing()) {
+    timer_->close();
+  }
+  if (!tcp_->closing()) {
+    tcp_->close();
+  }
+}
+
+void SimConnection::read(const char *data, size_t size) {
+  in_.append(data, size);
+  size_t off = 0;
+  while (in_.size() - off >= HEADER_SIZE) {
+    const size_t msg_size = message_size(in_.data() + off);
+    if (in_.size() - off < msg_size) {
+      break;
+    }
+    size_t used;
+    auto msg = decode_message(in_.data() + off, msg_size, &used, arena_);
+    peers_.stats.messages_in++;
+    if (msg != nullptr) {
+      handle(msg.get());
+    }
+    off += msg_size;
+  }
+  in_.erase(0, off);
+  arena_.reset();
+}
+
+void SimConnection::handle(const Message *msg) {
+  if (auto *ver = dynamic_cast<const Version *>(msg)) {
+    Version reply;
+    reply.version = 70016;
+    reply.services = NODE_NETWORK | NODE_WITNESS | NODE_BLOOM;
+    reply.nonce = ver->nonce + 1;  // anything but the client's
+    reply.user_agent = "/spv-soak/";
+    send(reply);
+    send(VerAck{});
+  } else if (dynamic_cast<const VerAck *>(msg) != nullptr) {
+    handshake_done();
+  } else if (auto *ping = dynamic_cast<const Ping *>(msg)) {
+    Pong pong;
+    pong.nonce = ping->nonce;
+    send(pong);
+  } else if (dynamic_cast<const GetHeaders *>(msg) != nullptr) {
+    send(HeadersMsg{});  // we're at the genesis block too
+  } else if (dynamic_cast<const GetAddr *>(msg) != nullptr) {
+    send(AddrMsg{});
+  }
+}
+
+void SimConnection::handshake_done() {
+  if (live_) {
+    return;
+  }
+  live_ = true;
+  peers_.stats.live++;
+  switch (behavior_) {
+    case Behavior::FLOOD:
+      timer_->start(INV_EVERY, INV_EVERY);
+      break;
+    case Behavior::DISCONNECT: {
+      std::uniform_int_distribution<long> after(MIN_HANGUP.count(),
+                                                MAX_HANGUP.count());
+      timer_->start(std::chrono::milliseconds(after(peers_.rng())),
+                    std::chrono::milliseconds(0));
+      break;
+    }
+    case Behavior::MALICIOUS: {
+      HeadersMsg msg;
+      msg.block_headers.push_back(BlockHeader::genesis());
+      size_t size;
+      std::unique_ptr<char[]> data = msg.encode(size);
+      data[HEADER_SIZE - sizeof(uint32_t)] ^= 1;  // in the checksum
+      peers_.stats.messages_out++;
+      write(std::move(data), size);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+void SimConnection::tick() {
+  switch (behavior_) {
+    case Behavior::SLOW:
+      pump();
+      break;
+    case Behavior::FLOOD:
+      flood();
+      break;
+    case Behavior::DISCONNECT:
+      peers_.remove(this);
+      break;
+    default:
+      break;
+  }
+}
+
+void SimConnection::flood() {
+  InvMsg msg;
+  msg.invs.resize(INV_FLOOD);
+  for (Inv &inv : msg.invs) {
+    inv.type = InvType::TX;
+    for (size_t i = 0; i < inv.hash.size(); i += sizeof(uint64_t)) {
+      const uint64_t word = peers_.rng()();
+      std::memcpy(inv.hash.data() + i, &word, sizeof word);
+    }
+  }
+  send(msg);
+}
+
+void SimConnection::send(const Message &msg) {
+  peers_.stats.messages_out++;
+  size_t size;
+  std::unique_ptr<char[]> data = msg.encode(size);
+  if (behavior_ != Behavior::SLOW) {
+    write(std::move(data), size);
+    return;
+  }
+  out_.push_back({Clock::now() + SLOW_DELAY, std::move(data), size});
+  if (out_.size() == 1) {
+    timer_->start(SLOW_DELAY, std::chrono::milliseconds(0));
+  }
+}
+
+void SimConnection::write(std::unique_ptr<char[]> data, size_t size) {
+  if (!tcp_->closing()) {
+    tcp_->write(std::move(data), size);
+  }
+}
+
+// send the slow replies that are due, and wait for the next one
+void SimConnection::pump() {
+  const auto now = Clock::now();
+  while (!out_.empty() && out_.front().ready <= now) {
+    write(std::move(out_.front().data), out_.front().size);
+    out_.pop_front();
+  }
+  if (!out_.empty()) {
+    timer_->start(std::chrono::duration_cast<std::chrono::milliseconds>(
+                      out_.front().ready - now) +
+                      std::chrono::milliseconds(1),
+                  std::chrono::milliseconds(0));
+  }
+}
+
+std::unique_ptr<Client> client;
+}  // namespace
+
+int main(int argc, char **argv) {
+  int split = argc;
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--") == 0) {
+      split = i;
+      break;
+    }
+  }
+  size_t count = split > 1 ? std::strtoul(argv[1], nullptr, 10) : 0;
+  std::vector<unsigned> weights = {60, 10, 10, 10, 10};
+  if (split > 2) {
+    unsigned w[size_t(Behavior::NUM)];
+    if (std::sscanf(argv[2], "%u,%u,%u,%u,%u", &w[0], &w[1], &w[2], &w[3],
+                    &w[4]) != 5) {
+      count = 0;
+    }
+    weights.assign(w, w + size_t(Behavior::NUM));
+  }
+  const std::chrono::seconds duration(split > 3 ? std::stoul(argv[3]) : 60);
+  if (count < 1 || count > MAX_PEERS || split > 4 ||
+      std::accumulate(weights.begin(), weights.end(), 0u) == 0) {
+    std::fprintf(stderr,
+                 "usage: %s peers [fast,slow,flood,disconnect,malicious] "
+                 "[seconds] [-- spv options]\n",
+                 argv[0]);
+    return 1;
+  }
+
+  // three descriptors a peer: the client's end, our end, and some slack
+  rlimit files;
+  getrlimit(RLIMIT_NOFILE, &files);
+  files.rlim_cur = files.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &files);
+  if (files.rlim_cur < 3 * count + 64) {
+    std::fprintf(stderr, "warning: only %zu file descriptors allowed\n",
+                 size_t(files.rlim_cur));
+  }
+
+  auto peers_loop = uvw::Loop::create();
+  SimPeers peers(peers_loop, count, weights);
+  const uint16_t port = peers.listen();
+
+  char datadir[] = "/tmp/spv-soak.XXXXXX";
+  if (mkdtemp(datadir) == nullptr) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  // The simulated address book. The sources are spread over network
+  // groups too, so that the addresses spread over the new table's buckets.
+  size_t known = 0;
+  {
+    AddrManager book;
+    for (size_t i = 0; i < count; i++) {
+      Addr addr, source;
+      addr.set_ip(peer_ip(i));
+      addr.set_port(port);
+      source.set_ip("10." + std::to_string(i % 256) + "." +
+                    std::to_string(i / 256) + ".1");
+      known += book.add(addr, source);
+    }
+    book.save(std::string(datadir) + "/peers.dat");
+  }
+  const std::string connections = std::to_string(count);
+  std::vector<const char *> args = {argv[0], "--data-dir", datadir,
+                                    "--connections", connections.c_str()};
+  for (int i = split + 1; i < argc; i++) {
+    args.push_back(argv[i]);
+  }
+  args.push_back(nullptr);
+  spdlog::set_level(spdlog::level::err);  // -d still turns on debugging
+  int ret = -1;
+  const Settings &settings = parse_settings(
+      args.size() - 1, const_cast<char **>(args.data()), &ret);
+  if (ret != -1) {
+    recursive_delete(datadir);
+    return ret;
+  }
+  if (!settings.checkpoints_file.empty() &&
+      !load_checkpoints(settings.checkpoints_file)) {
+    recursive_delete(datadir);
+    return 1;
+  }
+  std::printf("%zu peers, %zu in the address book:", count, known);
+  for (size_t b = 0; b < size_t(Behavior::NUM); b++) {
+    std::printf(" %u%% %s", weights[b] * 100 /
+                std::accumulate(weights.begin(), weights.end(), 0u),
+                behavior_names[b]);
+  }
+  std::printf("\n");
+
+  std::thread peers_thread([peers_loop]() { peers_loop->run(); });
+
+  auto loop = uvw::Loop::getDefault();
+  const size_t base_rss = resident_bytes();
+  const auto start = Clock::now();
+  client.reset(new Client(settings, loop));
+  client->run();
+
+  // Loop lag is how late a LAG_TICK timer fires, the worst in each report.
+  auto last_tick = Clock::now();
+  std::chrono::microseconds worst_lag(0);
+  auto lag = loop->resource<uvw::TimerHandle>();
+  lag->on<uvw::TimerEvent>([&](const auto &, auto &) {
+    const auto now = Clock::now();
+    worst_lag = std::max(worst_lag,
+                         std::chrono::duration_cast<std::chrono::microseconds>(
+                             now - last_tick - LAG_TICK));
+    last_tick = now;
+  });
+  lag->start(LAG_TICK, LAG_TICK);
+
+  size_t last_in = 0, last_out = 0, last_reconnects = 0;
+  auto report = loop->resource<uvw::TimerHandle>();
+  report->on<uvw::TimerEvent>([&](const auto &, auto &) {
+    const double secs = std::chrono::duration<double>(REPORT_EVERY).count();
+    // in and out of the client
+    const size_t in = peers.stats.messages_out, out = peers.stats.messages_in;
+    const size_t reconnects = peers.stats.reconnects;
+    const size_t connected = client->progress().peers().size();
+    const size_t rss = resident_bytes();
+    const int64_t buffers =
+        mem_usage(MemTag::BUFFERS) + mem_usage(MemTag::ARENAS);
+    std::printf(
+        "%4.0fs: lag %6.1f ms, %zu peers (%zu handshaken), %.1f KiB rss and "
+        "%.1f KiB buffers per peer, %.0f msg/s in, %.0f out, %.1f "
+        "reconnects/s, %zu closes\n",
+        std::chrono::duration<double>(Clock::now() - start).count(),
+        worst_lag.count() / 1e3, connected, size_t(peers.stats.live),
+        connected ? (rss > base_rss ? rss - base_rss : 0) / 1024.0 / connected
+                  : 0.0,
+        connected ? buffers / 1024.0 / connected : 0.0,
+        (in - last_in) / secs, (out - last_out) / secs,
+        (reconnects - last_reconnects) / secs, size_t(peers.stats.closes));
+    std::fflush(stdout);
+    last_in = in;
+    last_out = out;
+    last_reconnects = reconnects;
+    worst_lag = std::chrono::microseconds(0);
+    if (Clock::now() - start < duration) {
+      return;
+    }
+    client->shutdown();
+    peers.stop();
+    loop->walk([](uvw::BaseHandle &h) {
+      if (!h.closing()) {
+        h.close();
+      }
+    });
+  });
+  report->start(REPORT_EVERY, REPORT_EVERY);
+
+  loop->run();
+  peers_thread.join();
+  loop->close();
+  peers_loop->close();
+  client.reset();
+  recursive_delete(datadir);
+  return 0;
+}
@@ -0,0 +1,99 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./sockopt.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <cerrno>
+#include <cstring>
+
+#include "./logging.h"
+
+namespace spv {
+MODULE_LOGGER
+
+SocketTuning socket_tuning(const Settings &settings) {
+  SocketTuning tuning;
+  tuning.nodelay = true;
+  tuning.keepalive = std::chrono::seconds(60);
+  tuning.recv_buffer = 0;
+  tuning.send_buffer = 0;
+  switch (settings.socket_profile) {
+    case SocketProfile::SYNC:
+      // Room for every headers reply a pipelined peer may have in flight
+      // and one more, each 162k bytes rounded up to 256k since the kernel
+      // counts its own overhead against the buffer. What we send is small.
+      tuning.recv_buffer =
+          int((settings.header_pipeline + 1) * (256 << 10) + (256 << 10));
+      break;
+    case SocketProfile::RELAY:
+      // headers and blocks go both ways, to and from inbound peers
+      tuning.recv_buffer = 256 << 10;
+      tuning.send_buffer = 256 << 10;
+      tuning.keepalive = std::chrono::seconds(30);
+      break;
+    case SocketProfile::LOW_MEMORY:
+      tuning.recv_buffer = 32 << 10;
+      tuning.send_buffer = 32 << 10;
+      break;
+  }
+  tuning.busy_poll = int(settings.busy_poll);
+  tuning.quickack = settings.quickack;
+  return tuning;
+}
+
+static void set_option(int fd, int level, int name, int val,
+                       const char *what) {
+  if (setsockopt(fd, level, name, &val, sizeof val) != 0) {
+    log->warn("failed to set {} to {}: {}", what, val, std::strerror(errno));
+  }
+}
+
+void tune_socket(uvw::TcpHandle &tcp, const SocketTuning &tuning) {
+  if (!tcp.noDelay(tuning.nodelay)) {
+    log->warn("failed to set TCP_NODELAY");
+  }
+  if (!tcp.keepAlive(tuning.keepalive.count() > 0,
+                     uvw::TcpHandle::Time(tuning.keepalive.count()))) {
+    log->warn("failed to set SO_KEEPALIVE");
+  }
+  const int fd = tcp.fileno();
+  if (tuning.recv_buffer) {
+    set_option(fd, SOL_SOCKET, SO_RCVBUF, tuning.recv_buffer, "SO_RCVBUF");
+  }
+  if (tuning.send_buffer) {
+    set_option(fd, SOL_SOCKET, SO_SNDBUF, tuning.send_buffer, "SO_SNDBUF");
+  }
+#ifdef SO_BUSY_POLL
+  if (tuning.busy_poll) {
+    set_option(fd, SOL_SOCKET, SO_BUSY_POLL, tuning.busy_poll,
+               "SO_BUSY_POLL");
+  }
+#endif
+  rearm_quickack(tcp, tuning);
+}
+
+void rearm_quickack(uvw::TcpHandle &tcp, const SocketTuning &tuning) {
+#ifdef TCP_QUICKACK
+  if (tuning.quickack) {
+    set_option(tcp.fileno(), IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+  }
+#endif
+}
+}  // namespace spv
@@ -0,0 +1,51 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <chrono>
+
+#include "./settings.h"
+#include "./uvw.h"
+
+namespace spv {
+// Socket options for peer connections, as picked by --socket-profile. A
+// buffer size of 0 leaves it to the kernel's autotuning.
+struct SocketTuning {
+  // TCP_NODELAY, since our writes are already coalesced
+  bool nodelay;
+
+  // idle time before keepalive probes, or 0 for none
+  std::chrono::seconds keepalive;
+
+  int recv_buffer;
+  int send_buffer;
+  int busy_poll;  // SO_BUSY_POLL microseconds, or 0
+  bool quickack;  // TCP_QUICKACK, re-armed after every read
+};
+
+// the options for settings.socket_profile, with --busy-poll and --quickack
+SocketTuning socket_tuning(const Settings &settings);
+
+// Apply tuning to a handle whose socket has been created, e.g. one made for
+// an address family or one that was accepted. Failures are only logged.
+void tune_socket(uvw::TcpHandle &tcp, const SocketTuning &tuning);
+
+// Linux turns quick acks off again once the connection looks interactive,
+// so with tuning.quickack this goes after each read.
+void rearm_quickack(uvw::TcpHandle &tcp, const SocketTuning &tuning);
+}  // namespace spv
@@ -0,0 +1,133 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./socks5.h"
+
+#include <sys/socket.h>
+#include <algorithm>
+#include <cstring>
+
+namespace spv {
+static const uint8_t SOCKS_VERSION = 5;
+static const uint8_t NO_AUTH = 0;
+static const uint8_t NO_ACCEPTABLE_METHOD = 0xff;
+static const uint8_t CMD_CONNECT = 1;
+static const uint8_t ATYP_IPV4 = 1;
+static const uint8_t ATYP_DOMAIN = 3;
+static const uint8_t ATYP_IPV6 = 4;
+
+// the reply codes, RFC 1928 section 6
+static const char *reply_error(uint8_t rep) {
+  switch (rep) {
+    case 1:
+      return "proxy failure";
+    case 2:
+      return "proxy doesn't allow the connection";
+    case 3:
+      return "proxy can't reach the network";
+    case 4:
+      return "proxy can't reach the host";
+    case 5:
+      return "peer refused the proxy";
+    case 6:
+      return "proxy's connection timed out";
+    case 7:
+      return "proxy doesn't support CONNECT";
+    case 8:
+      return "proxy doesn't support the address type";
+    default:
+      return "proxy error";
+  }
+}
+
+Socks5Handshake::Socks5Handshake(const Addr &dest)
+    : dest_(dest), state_(State::METHOD), error_(nullptr), have_(0) {}
+
+std::unique_ptr<char[]> Socks5Handshake::request(size_t &size) const {
+  const addrbuf_t &ip = dest_.addrbuf();
+  const bool v4 = dest_.af() == AF_INET;
+  const size_t ip_size = v4 ? 4 : ip.size();
+  size = 3 + 4 + ip_size + 2;
+  std::unique_ptr<char[]> data(new char[size]);
+  uint8_t *p = reinterpret_cast<uint8_t *>(data.get());
+  *p++ = SOCKS_VERSION;
+  *p++ = 1;  // one method
+  *p++ = NO_AUTH;
+  *p++ = SOCKS_VERSION;
+  *p++ = CMD_CONNECT;
+  *p++ = 0;
+  *p++ = v4 ? ATYP_IPV4 : ATYP_IPV6;
+  std::memcpy(p, ip.data() + ip.size() - ip_size, ip_size);
+  p += ip_size;
+  *p++ = dest_.port() >> 8;
+  *p++ = dest_.port() & 0xff;
+  return data;
+}
+
+size_t Socks5Handshake::reply_size() const {
+  switch (answer_[3]) {
+    case ATYP_IPV4:
+      return 4 + 4 + 2;
+    case ATYP_IPV6:
+      return 4 + 16 + 2;
+    default:  // ATYP_DOMAIN
+      return 4 + 1 + answer_[4] + 2;
+  }
+}
+
+void Socks5Handshake::fail(const char *why) {
+  state_ = State::FAILED;
+  error_ = why;
+}
+
+size_t Socks5Handshake::consume(const char *data, size_t size) {
+  size_t used = 0;
+  while (used < size && (state_ == State::METHOD || state_ == State::REPLY)) {
+    size_t want = 2;
+    if (state_ == State::REPLY) {
+      want = have_ < 5 ? 5 : reply_size();
+    }
+    const size_t n = std::min(want - have_, size - used);
+    std::memcpy(answer_.data() + have_, data + used, n);
+    have_ += n;
+    used += n;
+    if (have_ < want) {
+      break;
+    }
+    if (answer_[0] != SOCKS_VERSION) {
+      fail("not a SOCKS5 proxy");
+    } else if (state_ == State::METHOD) {
+      if (answer_[1] == NO_AUTH) {
+        state_ = State::REPLY;
+        have_ = 0;
+      } else {
+        fail(answer_[1] == NO_ACCEPTABLE_METHOD
+                 ? "proxy requires authentication"
+                 : "proxy chose an unknown method");
+      }
+    } else if (answer_[1] != 0) {
+      fail(reply_error(answer_[1]));
+    } else if (answer_[3] != ATYP_IPV4 && answer_[3] != ATYP_IPV6 &&
+               answer_[3] != ATYP_DOMAIN) {
+      fail("proxy sent an unknown address type");
+    } else if (have_ == reply_size()) {
+      state_ = State::DONE;  // the bound address isn't needed
+    }
+  }
+  return used;
+}
+}  // namespace spv
@@ -0,0 +1,73 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "./addr.h"
+
+namespace spv {
+// The default SOCKS port, for a --proxy without one.
+static const uint16_t SOCKS_PORT = 1080;
+
+// A CONNECT to a peer through a SOCKS5 proxy (RFC 1928), without
+// authentication. The greeting and the CONNECT request don't wait for the
+// proxy's answers, and the peer's first message can follow them in the
+// same write; the answers come back ahead of the peer's bytes, and are
+// taken off the front of the stream in place.
+class Socks5Handshake {
+ public:
+  Socks5Handshake() = delete;
+  explicit Socks5Handshake(const Addr &dest);
+  Socks5Handshake(const Socks5Handshake &other) = delete;
+
+  // the greeting and the CONNECT request, to write once connected to the
+  // proxy
+  std::unique_ptr<char[]> request(size_t &size) const;
+
+  // Take the proxy's answers off the front of data, returning the number of
+  // bytes they used. Once done(), whatever follows is from the peer.
+  size_t consume(const char *data, size_t size);
+
+  inline bool done() const { return state_ == State::DONE; }
+
+  // why the proxy wouldn't connect us, or nullptr
+  inline const char *error() const { return error_; }
+
+ private:
+  enum class State { METHOD, REPLY, DONE, FAILED };
+
+  const Addr dest_;
+  State state_;
+  const char *error_;
+
+  // the answer being read, which may be split across reads: the two byte
+  // method selection, then the reply, whose size is only known from its
+  // fifth byte
+  std::array<uint8_t, 4 + 1 + 255 + 2> answer_;
+  size_t have_;
+
+  void fail(const char *why);
+
+  // the size of the reply so far as answer_ tells, at least 5 bytes
+  size_t reply_size() const;
+};
+}  // namespace spv
@@ -0,0 +1,56 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./status_server.h"
+
+#include <cstring>
+
+#include "./logging.h"
+#include "./unix_socket.h"
+
+namespace spv {
+MODULE_LOGGER
+
+StatusServer::StatusServer(std::shared_ptr<uvw::Loop> loop, Reporter &&report)
+    : loop_(loop), report_(std::move(report)) {}
+
+bool StatusServer::listen(const std::string &path) {
+  listener_ = listen_unix(*loop_, path, "status",
+                          [this](uvw::PipeHandle &server) { accept(server); });
+  if (!listener_) {
+    return false;
+  }
+  path_ = path;
+  log->info("serving status on {}", path);
+  return true;
+}
+
+void StatusServer::close() { close_unix(listener_, path_); }
+
+void StatusServer::accept(uvw::PipeHandle &server) {
+  auto pipe = loop_->resource<uvw::PipeHandle>();
+  server.accept(*pipe);
+  pipe->once<uvw::ErrorEvent>([](const auto &, auto &pipe) { pipe.close(); });
+  pipe->once<uvw::ShutdownEvent>(
+      [](const auto &, auto &pipe) { pipe.close(); });
+
+  const std::string report = report_();
+  std::unique_ptr<char[]> buf(new char[report.size()]);
+  std::memcpy(buf.get(), report.data(), report.size());
+  pipe->write(std::move(buf), report.size());
+  pipe->shutdown();
+}
+}  // namespace spv
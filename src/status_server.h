@@ -0,0 +1,52 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "./uvw.h"
+
+namespace spv {
+// Answers every connection to a Unix socket with a status report, then
+// closes it, so a script can poll the client with e.g. nc -U. Runs on the
+// client's loop.
+class StatusServer {
+ public:
+  typedef std::function<std::string()> Reporter;
+
+  StatusServer(std::shared_ptr<uvw::Loop> loop, Reporter &&report);
+  StatusServer(const StatusServer &other) = delete;
+  ~StatusServer() { close(); }
+
+  // Listen at path, replacing a socket left there by an earlier run; false
+  // if something else is there, see listen_unix().
+  bool listen(const std::string &path);
+
+  // stop listening and remove the socket
+  void close();
+
+ private:
+  std::shared_ptr<uvw::Loop> loop_;
+  Reporter report_;
+  std::shared_ptr<uvw::PipeHandle> listener_;
+  std::string path_;
+
+  void accept(uvw::PipeHandle &server);
+};
+}  // namespace spv
@@ -0,0 +1,343 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./store.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+
+#include "./logging.h"
+#include "./pow.h"
+
+namespace spv {
+MODULE_LOGGER
+
+// grow the file 64k records (about 5 MB) at a time
+static const size_t grow_records = 1 << 16;
+
+static const char tip_magic[8] = {'S', 'P', 'V', 'T', 'I', 'P', '0', '1'};
+
+// The layout of the .tip file, a seqlock: the writer makes seq odd, updates
+// the fields after it and makes seq even again, and a reader that sees an
+// odd seq, or a different one after reading, tries again. The hash is in
+// 64-bit words so that even a torn read is of atomics.
+struct StoreTip {
+  char magic[8];
+  std::atomic<uint64_t> seq;
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> reorgs;
+  std::atomic<uint64_t> hash[4];
+};
+static_assert(sizeof(StoreTip) == 64, "the .tip file layout changed");
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+              "the .tip file needs lock-free 64-bit atomics");
+
+static void begin_update(StoreTip *tip, bool reorg) {
+  tip->seq.store(tip->seq.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_relaxed);
+  if (reorg) {
+    tip->reorgs.store(tip->reorgs.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_relaxed);
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+static void end_update(StoreTip *tip, size_t count, const hash_t &hash) {
+  tip->count.store(count, std::memory_order_relaxed);
+  for (size_t i = 0; i < 4; i++) {
+    uint64_t word;
+    std::memcpy(&word, hash.data() + i * sizeof word, sizeof word);
+    tip->hash[i].store(word, std::memory_order_relaxed);
+  }
+  tip->seq.store(tip->seq.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_release);
+}
+
+static bool is_zero_record(const char *rec) {
+  return std::all_of(rec, rec + BLOCK_HEADER_SIZE,
+                     [](char c) { return c == 0; });
+}
+
+HeaderStore::HeaderStore(const std::string &path)
+    : fd_(-1),
+      base_(nullptr),
+      count_(0),
+      capacity_(0),
+      last_(empty_hash),
+      tip_fd_(-1),
+      tip_(nullptr) {
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd_ == -1) {
+    log->error("failed to open header store {}: {}", path, strerror(errno));
+    assert(false);
+  }
+  struct stat st;
+  assert(fstat(fd_, &st) == 0);
+  map(std::max<size_t>(st.st_size / BLOCK_HEADER_SIZE, grow_records));
+
+  count_ = st.st_size / BLOCK_HEADER_SIZE;
+  while (count_ > 0 &&
+         is_zero_record(base_ + (count_ - 1) * BLOCK_HEADER_SIZE)) {
+    count_--;
+  }
+  if (count_) {
+    last_ = header(count_ - 1).block_hash;
+  }
+  open_tip(path + ".tip");
+  log->info("mapped header store {} with {} headers", path, count_);
+}
+
+HeaderStore::~HeaderStore() {
+  if (base_ != nullptr) {
+    msync(base_, capacity_ * BLOCK_HEADER_SIZE, MS_SYNC);
+    munmap(base_, capacity_ * BLOCK_HEADER_SIZE);
+  }
+  if (fd_ != -1) {
+    close(fd_);
+  }
+  if (tip_ != nullptr) {
+    munmap(tip_, sizeof(StoreTip));
+  }
+  if (tip_fd_ != -1) {
+    close(tip_fd_);
+  }
+}
+
+void HeaderStore::open_tip(const std::string &path) {
+  tip_fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (tip_fd_ == -1) {
+    log->error("failed to open {}: {}", path, strerror(errno));
+    assert(false);
+  }
+  assert(ftruncate(tip_fd_, sizeof(StoreTip)) == 0);
+  void *addr = mmap(nullptr, sizeof(StoreTip), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, tip_fd_, 0);
+  if (addr == MAP_FAILED) {
+    log->error("failed to mmap {}: {}", path, strerror(errno));
+    assert(false);
+  }
+  tip_ = static_cast<StoreTip *>(addr);
+  if (std::memcmp(tip_->magic, tip_magic, sizeof tip_magic) != 0) {
+    std::memset(addr, 0, sizeof(StoreTip));
+    std::memcpy(tip_->magic, tip_magic, sizeof tip_magic);
+  }
+  // a reader left holding a snapshot from the last run must start over
+  publish(true);
+}
+
+void HeaderStore::publish(bool reorg) {
+  begin_update(tip_, reorg);
+  end_update(tip_, count_, last_);
+}
+
+void HeaderStore::map(size_t capacity) {
+  assert(capacity >= count_);
+  if (base_ != nullptr) {
+    assert(munmap(base_, capacity_ * BLOCK_HEADER_SIZE) == 0);
+    base_ = nullptr;
+  }
+  const size_t len = capacity * BLOCK_HEADER_SIZE;
+  struct stat st;
+  assert(fstat(fd_, &st) == 0);
+  if (static_cast<size_t>(st.st_size) < len) {
+    assert(ftruncate(fd_, len) == 0);
+  }
+  void *addr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (addr == MAP_FAILED) {
+    log->error("failed to mmap header store: {}", strerror(errno));
+    assert(false);
+  }
+  base_ = static_cast<char *>(addr);
+  capacity_ = capacity;
+}
+
+BlockHeader HeaderStore::header(size_t height) const {
+  BlockHeader hdr;
+  hdr.unpack(at(height));
+  hdr.block_hash = pow_hash(at(height), BLOCK_HEADER_SIZE, true);
+  hdr.height = height;
+  return hdr;
+}
+
+void HeaderStore::append(const BlockHeader &hdr) {
+  char raw[BLOCK_HEADER_SIZE];
+  hdr.pack(raw);
+  append(hdr, raw);
+}
+
+void HeaderStore::append(const BlockHeader &hdr, const char *raw) {
+  assert(extends(hdr));
+  if (count_ == capacity_) {
+    map(capacity_ + grow_records);
+  }
+  std::memcpy(base_ + count_ * BLOCK_HEADER_SIZE, raw, BLOCK_HEADER_SIZE);
+  count_++;
+  last_ = hdr.block_hash;
+  publish(false);
+}
+
+void HeaderStore::truncate(size_t height) {
+  if (height >= count_) {
+    return;
+  }
+  // readers have to see the reorg before any of the headers change
+  begin_update(tip_, true);
+  std::memset(base_ + height * BLOCK_HEADER_SIZE, 0,
+              (count_ - height) * BLOCK_HEADER_SIZE);
+  count_ = height;
+  last_ = count_ ? header(count_ - 1).block_hash : empty_hash;
+  end_update(tip_, count_, last_);
+}
+
+void HeaderStore::sync(bool wait) {
+  const int flags = wait ? MS_SYNC : MS_ASYNC;
+  assert(msync(base_, count_ * BLOCK_HEADER_SIZE, flags) == 0);
+}
+
+StoreReader::StoreReader()
+    : fd_(-1), tip_fd_(-1), base_(nullptr), len_(0), tip_(nullptr) {}
+
+bool StoreReader::open(const std::string &path) {
+  close();
+  const std::string tip_path = path + ".tip";
+  fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  tip_fd_ = ::open(tip_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ == -1 || tip_fd_ == -1) {
+    log->error("failed to open header store {}: {}", path, strerror(errno));
+    close();
+    return false;
+  }
+  struct stat st;
+  if (fstat(tip_fd_, &st) != 0 || size_t(st.st_size) != sizeof(StoreTip)) {
+    log->error("{} is not a header store tip", tip_path);
+    close();
+    return false;
+  }
+  // the writer only maps the file writable, so mapping it read-only here
+  // still sees its stores
+  void *addr = mmap(nullptr, sizeof(StoreTip), PROT_READ, MAP_SHARED,
+                    tip_fd_, 0);
+  if (addr == MAP_FAILED) {
+    log->error("failed to mmap {}: {}", tip_path, strerror(errno));
+    close();
+    return false;
+  }
+  tip_ = static_cast<const StoreTip *>(addr);
+  if (std::memcmp(tip_->magic, tip_magic, sizeof tip_magic) != 0) {
+    log->error("{} is not a header store tip", tip_path);
+    close();
+    return false;
+  }
+  return true;
+}
+
+void StoreReader::close() {
+  if (base_ != nullptr) {
+    munmap(const_cast<char *>(base_), len_);
+    base_ = nullptr;
+    len_ = 0;
+  }
+  if (tip_ != nullptr) {
+    munmap(const_cast<StoreTip *>(tip_), sizeof(StoreTip));
+    tip_ = nullptr;
+  }
+  if (fd_ != -1) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+  if (tip_fd_ != -1) {
+    ::close(tip_fd_);
+    tip_fd_ = -1;
+  }
+}
+
+StoreReader::Snapshot StoreReader::snapshot() const {
+  assert(is_open());
+  for (;;) {
+    const uint64_t seq = tip_->seq.load(std::memory_order_acquire);
+    if (seq & 1) {
+      continue;
+    }
+    Snapshot snap;
+    snap.size = tip_->count.load(std::memory_order_relaxed);
+    snap.reorgs = tip_->reorgs.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < 4; i++) {
+      const uint64_t word = tip_->hash[i].load(std::memory_order_relaxed);
+      std::memcpy(snap.tip.data() + i * sizeof word, &word, sizeof word);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (tip_->seq.load(std::memory_order_relaxed) == seq) {
+      return snap;
+    }
+  }
+}
+
+bool StoreReader::map(size_t records) {
+  const size_t need = records * BLOCK_HEADER_SIZE;
+  if (need <= len_) {
+    return true;
+  }
+  // the writer grows the file before it publishes headers in the new part
+  struct stat st;
+  if (fstat(fd_, &st) != 0 || size_t(st.st_size) < need) {
+    return false;
+  }
+  if (base_ != nullptr) {
+    munmap(const_cast<char *>(base_), len_);
+    base_ = nullptr;
+    len_ = 0;
+  }
+  void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd_, 0);
+  if (addr == MAP_FAILED) {
+    log->error("failed to mmap header store: {}", strerror(errno));
+    return false;
+  }
+  base_ = static_cast<const char *>(addr);
+  len_ = st.st_size;
+  return true;
+}
+
+bool StoreReader::read(const Snapshot &snap, size_t from, size_t to,
+                       char *out) {
+  assert(from <= to && to <= snap.size);
+  if (!map(to)) {
+    return false;
+  }
+  std::memcpy(out, base_ + from * BLOCK_HEADER_SIZE,
+              (to - from) * BLOCK_HEADER_SIZE);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return tip_->reorgs.load(std::memory_order_relaxed) == snap.reorgs;
+}
+
+bool StoreReader::header(const Snapshot &snap, size_t height,
+                         BlockHeader *hdr) {
+  char raw[BLOCK_HEADER_SIZE];
+  if (!read(snap, height, height + 1, raw)) {
+    return false;
+  }
+  hdr->unpack(raw);
+  hdr->block_hash = pow_hash(raw, BLOCK_HEADER_SIZE, true);
+  hdr->height = height;
+  return true;
+}
+}  // namespace spv
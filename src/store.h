@@ -0,0 +1,160 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "./constants.h"
+#include "./fields.h"
+
+namespace spv {
+struct StoreTip;
+
+// Where Chain keeps the best chain's headers by height, with a HeaderBackend
+// other than ROCKSDB: a HeaderStore, or with --enable-lmdb an LmdbStore.
+// Appends may be buffered until the next sync(), which Chain calls once per
+// batch of headers.
+class BestChainStore {
+ public:
+  virtual ~BestChainStore() {}
+
+  // number of headers in the store, i.e. the height of the next append
+  virtual size_t size() const = 0;
+
+  // decode (and hash) the header at this height
+  virtual BlockHeader header(size_t height) const = 0;
+
+  // would this header extend the store?
+  virtual bool extends(const BlockHeader &hdr) const = 0;
+
+  // append a header whose 80-byte wire encoding is already at hand; it must
+  // extend the store
+  virtual void append(const BlockHeader &hdr, const char *raw) = 0;
+
+  // drop every header at or above this height
+  virtual void truncate(size_t height) = 0;
+
+  // make the appends so far durable, waiting for the disk with wait
+  virtual void sync(bool wait = false) = 0;
+};
+
+// HeaderStore is an append-only, memory-mapped file of 80-byte headers on the
+// best chain, where the header at height h lives at offset h * 80. The file
+// is grown in large chunks and the unused tail is zero filled, so the number
+// of headers is recovered on open by skipping trailing zero records.
+//
+// The number of headers and the tip are also published in a small file next
+// to it (the path plus ".tip"), so that StoreReader can read the store from
+// other processes while this one writes it.
+class HeaderStore : public BestChainStore {
+ public:
+  HeaderStore() = delete;
+  HeaderStore(const HeaderStore &other) = delete;
+  explicit HeaderStore(const std::string &path);
+  ~HeaderStore() override;
+
+  size_t size() const override { return count_; }
+
+  // The raw header at this height. N.B. the pointer is only valid until the
+  // next append, which may remap the file.
+  inline const char *at(size_t height) const {
+    assert(height < count_);
+    return base_ + height * BLOCK_HEADER_SIZE;
+  }
+
+  BlockHeader header(size_t height) const override;
+
+  bool extends(const BlockHeader &hdr) const override {
+    return hdr.height == count_ && (count_ == 0 || hdr.prev_block == last_);
+  }
+
+  // append a header; it must extend the store
+  void append(const BlockHeader &hdr);
+  void append(const BlockHeader &hdr, const char *raw) override;
+
+  void truncate(size_t height) override;
+
+  // schedule dirty pages to be written back, or with wait, write them
+  void sync(bool wait = false) override;
+
+ private:
+  int fd_;
+  char *base_;
+  size_t count_;
+  size_t capacity_;  // in records
+  hash_t last_;      // hash of the header at count_ - 1
+  int tip_fd_;
+  StoreTip *tip_;
+
+  // open and map the .tip file, and publish the current tip in it
+  void open_tip(const std::string &path);
+
+  // write count_ and last_ to the .tip file, counting a reorg if asked
+  void publish(bool reorg);
+
+  // (re)map the file with room for this many records
+  void map(size_t capacity);
+};
+
+// Read-only access to a HeaderStore that another process may be writing,
+// without taking the data directory's lock or ever blocking the writer. A
+// reader takes a snapshot of the store's size and tip, then reads headers
+// below that size; appends don't touch those, so the reads are consistent
+// with the snapshot unless a reorg rewrote them meanwhile, which read()
+// detects. The caller then takes a new snapshot and starts over.
+class StoreReader {
+ public:
+  struct Snapshot {
+    size_t size;      // number of headers
+    hash_t tip;       // hash of the header at size - 1
+    uint64_t reorgs;  // the writer's count of truncations
+  };
+
+  StoreReader();
+  StoreReader(const StoreReader &other) = delete;
+  ~StoreReader() { close(); }
+
+  // open the store at this path (e.g. .spv/headers.dat), logging why not
+  bool open(const std::string &path);
+  void close();
+
+  inline bool is_open() const { return tip_ != nullptr; }
+
+  // the store as of now, retrying if the writer is mid-update
+  Snapshot snapshot() const;
+
+  // Copy the raw headers at heights [from, to) into out, 80 bytes apiece.
+  // Returns false if a reorg since the snapshot may have changed them.
+  bool read(const Snapshot &snap, size_t from, size_t to, char *out);
+
+  // decode (and hash) the header at this height; false as for read()
+  bool header(const Snapshot &snap, size_t height, BlockHeader *hdr);
+
+ private:
+  int fd_;
+  int tip_fd_;
+  const char *base_;
+  size_t len_;  // of the mapping of the store, in bytes
+  const StoreTip *tip_;
+
+  // make sure the store is mapped through this many records
+  bool map(size_t records);
+};
+}  // namespace spv
@@ -0,0 +1,164 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./sync.h"
+
+#include <cassert>
+#include <iterator>
+
+#include "./chain.h"
+#include "./logging.h"
+
+namespace spv {
+MODULE_LOGGER
+
+void HeaderSync::plan(const BlockHeader &tip, bool assume_valid) {
+  assert(!tip.is_orphan());
+  segments_.clear();
+
+  size_t height = tip.height;
+  hash_t cursor = tip.block_hash;
+  for (const auto &pr : checkpoints()) {
+    if (pr.first <= height) {
+      continue;
+    }
+    segments_.emplace_back(height, cursor, pr.first, pr.second, assume_valid);
+    height = pr.first;
+    cursor = pr.second;
+  }
+  segments_.emplace_back(height, cursor, 0, empty_hash, false);
+  log->info("planned {} header segment(s) starting at height {}",
+            segments_.size(), tip.height);
+}
+
+HeaderSegment *HeaderSync::assign(const Addr &peer) {
+  assert(find(peer) == nullptr);
+  for (auto &seg : segments_) {
+    if (seg.done || seg.assigned || seg.lagging == peer) {
+      continue;
+    }
+    seg.assigned = true;
+    seg.peer = peer;
+    LOG_DEBUG(log, "assigned header segment at height {} to peer {}",
+              seg.cursor_height, peer);
+    return &seg;
+  }
+  return nullptr;
+}
+
+HeaderSegment *HeaderSync::find(const Addr &peer) {
+  for (auto &seg : segments_) {
+    if (seg.assigned && seg.peer == peer) {
+      return &seg;
+    }
+  }
+  return nullptr;
+}
+
+bool HeaderSync::resume(const Addr &peer, const hash_t &from) {
+  for (auto &seg : segments_) {
+    if (!seg.assigned && seg.peer == peer && !seg.done &&
+        seg.lagging != peer && seg.cursor == from) {
+      seg.assigned = true;
+      return true;
+    }
+  }
+  return false;
+}
+
+void HeaderSync::release(const Addr &peer, bool lagging) {
+  HeaderSegment *seg = find(peer);
+  if (seg != nullptr) {
+    seg->assigned = false;
+    if (lagging) {
+      seg->lagging = peer;
+    }
+  }
+}
+
+bool HeaderSync::add_headers(const Addr &peer,
+                             const std::vector<BlockHeader> &hdrs,
+                             std::vector<BlockHeader> &ready,
+                             size_t reply_size, bool more) {
+  HeaderSegment *seg = find(peer);
+  if (seg == nullptr) {
+    return false;
+  }
+  if (!hdrs.empty() && hdrs.front().prev_block != seg->cursor) {
+    LOG_DEBUG(log,
+              "headers from peer {} do not connect to segment at height {}",
+              peer, seg->cursor_height);
+    return false;
+  }
+  bool broken = false;
+  for (const auto &hdr : hdrs) {
+    if (hdr.prev_block != seg->cursor) {
+      log->warn("peer {} sent non-contiguous headers after height {}", peer,
+                seg->cursor_height);
+      broken = true;
+      break;
+    }
+    seg->pending.push_back(hdr);
+    seg->cursor = hdr.block_hash;
+    seg->cursor_height++;
+    if (hdr.block_hash == seg->stop) {
+      seg->done = true;
+      break;
+    }
+  }
+  // the rest of a streamed reply is still to come
+  seg->assigned = more && !seg->done && !broken;
+
+  if (!seg->done && seg->trusted && seg->cursor_height >= seg->stop_height) {
+    // this went past the checkpoint without reaching it, so it's a fork
+    log->warn("peer {} sent headers that miss the checkpoint at height {}",
+              peer, seg->stop_height);
+    seg->rewind();
+    seg->assigned = false;
+    seg->lagging = peer;
+  } else if (!seg->done && !more && reply_size < MAX_HEADERS_RESULTS) {
+    if (seg->is_open()) {
+      // the peer has nothing past this point
+      seg->done = true;
+    } else {
+      // The peer is behind this segment's checkpoint, let someone else try.
+      // Trusted headers might not even be on the checkpointed chain.
+      if (seg->trusted) {
+        seg->rewind();
+      }
+      seg->lagging = peer;
+    }
+  }
+  drain(ready);
+  return true;
+}
+
+void HeaderSync::drain(std::vector<BlockHeader> &ready) {
+  while (!segments_.empty()) {
+    HeaderSegment &front = segments_.front();
+    if (front.trusted && !front.done) {
+      break;
+    }
+    ready.insert(ready.end(), std::make_move_iterator(front.pending.begin()),
+                 std::make_move_iterator(front.pending.end()));
+    front.pending.clear();
+    if (!front.done) {
+      break;
+    }
+    segments_.pop_front();
+  }
+}
+}  // namespace spv
@@ -0,0 +1,128 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+#include "./addr.h"
+#include "./fields.h"
+
+namespace spv {
+// A contiguous range of the header chain that is downloaded from one peer at
+// a time. Segments are anchored on checkpoints, so every segment except the
+// last has a known stop hash.
+struct HeaderSegment {
+  size_t start_height;  // height of the header this segment builds on
+  hash_t start;
+  size_t stop_height;
+  hash_t stop;    // last header in the segment, or empty_hash if open
+  hash_t cursor;  // last header received so far
+  size_t cursor_height;
+  bool done;
+
+  // The proof of work of these headers isn't checked: they're only trusted
+  // once they link up to the stop hash, so none are released before then.
+  bool trusted;
+
+  bool assigned;
+  Addr peer;
+  Addr lagging;  // last peer that couldn't reach the stop hash
+
+  // Headers received before all earlier segments have been stitched into the
+  // chain; they are released in order once this segment reaches the front.
+  std::vector<BlockHeader> pending;
+
+  HeaderSegment(size_t height, const hash_t &start, size_t stop_height,
+                const hash_t &stop, bool trusted)
+      : start_height(height),
+        start(start),
+        stop_height(stop_height),
+        stop(stop),
+        cursor(start),
+        cursor_height(height),
+        done(false),
+        trusted(trusted),
+        assigned(false) {}
+
+  inline bool is_open() const { return stop == empty_hash; }
+
+  // forget the headers received so far
+  inline void rewind() {
+    pending.clear();
+    cursor = start;
+    cursor_height = start_height;
+  }
+};
+
+// HeaderSync splits the header chain into checkpoint-anchored segments so
+// that they can be fetched from several peers concurrently. It only does the
+// bookkeeping; the client owns the connections and the timers.
+class HeaderSync {
+ public:
+  HeaderSync() {}
+  HeaderSync(const HeaderSync &other) = delete;
+
+  // Plan segments from the current tip up to the last checkpoint, plus an
+  // open-ended segment past it. With assume_valid, the segments ending at a
+  // checkpoint are trusted.
+  void plan(const BlockHeader &tip, bool assume_valid = false);
+
+  // Assign the next idle segment to a peer, or return nullptr if there is
+  // nothing left to hand out.
+  HeaderSegment *assign(const Addr &peer);
+
+  // The segment currently assigned to this peer, if any.
+  HeaderSegment *find(const Addr &peer);
+
+  // Keep a peer on its segment after add_headers() took a reply, since it
+  // was already asked for the headers after from. Returns false if the
+  // segment is done, or the reply didn't end at from, which leaves the
+  // answer to that request stale.
+  bool resume(const Addr &peer, const hash_t &from);
+
+  // Give back a peer's segment (e.g. on timeout or disconnect). A lagging
+  // peer won't be handed the same segment again.
+  void release(const Addr &peer, bool lagging = false);
+
+  // Accept a getheaders response from a peer. Returns false if the headers
+  // aren't a reply to the peer's outstanding segment request. Headers that
+  // are now contiguous with the chain are appended to ready, in chain order.
+  // A reply that's streamed in parts comes with the count of headers in the
+  // whole message, and more set on all but its last part, which keeps the
+  // peer on its segment.
+  bool add_headers(const Addr &peer, const std::vector<BlockHeader> &hdrs,
+                   std::vector<BlockHeader> &ready, size_t reply_size,
+                   bool more = false);
+
+  // Drop every segment, e.g. after the chain rejected some of the headers
+  // they delivered, so that the next plan() starts over from the tip.
+  inline void clear() { segments_.clear(); }
+
+  // Have all planned segments been downloaded?
+  inline bool finished() const { return segments_.empty(); }
+
+  inline size_t size() const { return segments_.size(); }
+
+ private:
+  std::deque<HeaderSegment> segments_;
+
+  // Move completed headers at the front of the queue into ready.
+  void drain(std::vector<BlockHeader> &ready);
+};
+}  // namespace spv
@@ -0,0 +1,510 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+// An end-to-end benchmark of header sync:
+//
+//   spv-bench-sync [baseline options] headers.dat [latency ms]
+//                  [bandwidth MB/s] [-- options]
+//
+// headers.dat holds consecutive 80-byte headers from the genesis block, as
+// written by spv --export-headers, or made up by spv-gen-chain (see
+// gen_chain.cc) with the checkpoints that let it sync. A fake peer on the
+// client's own loop serves them over loopback TCP. Each reply waits out the
+// latency, and its bytes are paced to the bandwidth (0 for no limit). A
+// Client with a fresh data directory syncs from it, taking any spv options
+// after the --. At the end the program prints headers/s, CPU time per
+// header and resident memory, at the end and at its peak, which is what a
+// --memory-budget-mb has to hold. The fake peer's CPU time is counted
+// separately, and the memory it had before the sync started.
+//
+// Each sync runs in a child process of its own. With --save-baseline or
+// --compare (see bench_baseline.h) there are five of them, or --samples,
+// and the wall and client CPU time per header are saved or compared.
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "./arena.h"
+#include "./bench_baseline.h"
+#include "./client.h"
+#include "./constants.h"
+#include "./fs.h"
+#include "./hashmap.h"
+#include "./logging.h"
+#include "./memory.h"
+#include "./message.h"
+#include "./pow.h"
+#include "./settings.h"
+#include "./uvw.h"
+
+using namespace spv;
+
+namespace {
+DECLARE_LOGGER(bench_log)
+
+using Clock = std::chrono::steady_clock;
+
+// how long the sync can go without progress before we give up
+static const std::chrono::seconds STALL_TIMEOUT{60};
+
+// syncs to time when saving or comparing a baseline, without --samples
+static const size_t default_runs = 5;
+
+static double thread_cpu_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double process_cpu_ns() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e9 +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e3;
+}
+
+// A peer that only has headers: it answers version, getheaders and ping,
+// and ignores everything else. One client connection at a time.
+class FakePeer {
+ public:
+  FakePeer(std::shared_ptr<uvw::Loop> loop, const std::string &headers,
+           std::chrono::milliseconds latency, double bandwidth)
+      : loop_(loop),
+        headers_(headers),
+        count_(headers.size() / BLOCK_HEADER_SIZE),
+        latency_(latency),
+        bytes_per_ns_(bandwidth * 1e6 / 1e9),
+        cpu_ns_(0) {
+    std::vector<hash_t> hashes(count_);
+    pow_hash_batch(headers_.data(), BLOCK_HEADER_SIZE, count_, hashes.data());
+    heights_.reserve(count_);
+    for (size_t i = 0; i < count_; i++) {
+      heights_.emplace(hashes[i], i);
+    }
+    genesis_ = count_ ? hashes[0] : empty_hash;
+  }
+
+  inline size_t height() const { return count_ - 1; }
+  inline const hash_t &genesis() const { return genesis_; }
+
+  // time spent serving the client, on the loop thread
+  inline double cpu_ns() const { return cpu_ns_; }
+
+  // listen on an ephemeral loopback port, and return it
+  uint16_t listen() {
+    server_ = loop_->resource<uvw::TcpHandle>();
+    server_->on<uvw::ErrorEvent>([](const auto &exc, auto &) {
+      bench_log->error("fake peer error: {}", exc.what());
+    });
+    server_->on<uvw::ListenEvent>(
+        [this](const auto &, auto &server) { accept(server); });
+    server_->bind("127.0.0.1", 0);
+    server_->listen();
+    pump_ = loop_->resource<uvw::TimerHandle>();
+    pump_->on<uvw::TimerEvent>([this](const auto &, auto &) { pump(); });
+    return server_->sock().port;
+  }
+
+  void close() {
+    for (auto *handle : {&conn_, &server_}) {
+      if (*handle) {
+        (*handle)->close();
+        handle->reset();
+      }
+    }
+    if (pump_) {
+      pump_->stop();
+      pump_->close();
+      pump_.reset();
+    }
+  }
+
+ private:
+  struct Reply {
+    Clock::time_point ready;
+    std::unique_ptr<char[]> data;
+    size_t size;
+    size_t sent;
+  };
+
+  std::shared_ptr<uvw::Loop> loop_;
+  const std::string &headers_;
+  const size_t count_;
+  const std::chrono::milliseconds latency_;
+  const double bytes_per_ns_;  // or 0 for no limit
+  double cpu_ns_;
+  hash_t genesis_;
+  FlatHashMap<hash_t, uint32_t> heights_;
+
+  std::shared_ptr<uvw::TcpHandle> server_, conn_;
+  std::shared_ptr<uvw::TimerHandle> pump_;
+  std::string in_;
+  Arena arena_;
+  std::deque<Reply> out_;
+  Clock::time_point last_pump_;
+
+  void accept(uvw::TcpHandle &server) {
+    if (conn_) {
+      conn_->close();
+    }
+    in_.clear();
+    out_.clear();
+    conn_ = loop_->resource<uvw::TcpHandle>();
+    server.accept(*conn_);
+    conn_->on<uvw::DataEvent>([this](const auto &data, auto &) {
+      const double start = thread_cpu_ns();
+      read(data.data.get(), data.length);
+      cpu_ns_ += thread_cpu_ns() - start;
+    });
+    conn_->once<uvw::EndEvent>([](const auto &, auto &tcp) { tcp.close(); });
+    conn_->once<uvw::ErrorEvent>(
+        [](const auto &, auto &tcp) { tcp.close(); });
+    conn_->read();
+  }
+
+  void read(const char *data, size_t size) {
+    in_.append(data, size);
+    size_t off = 0;
+    while (in_.size() - off >= HEADER_SIZE) {
+      const size_t msg_size = message_size(in_.data() + off);
+      if (in_.size() - off < msg_size) {
+        break;
+      }
+      size_t used;
+      auto msg = decode_message(in_.data() + off, msg_size, &used, arena_);
+      if (msg != nullptr) {
+        handle(msg.get());
+      }
+      off += msg_size;
+    }
+    in_.erase(0, off);
+  }
+
+  void handle(const Message *msg) {
+    if (auto *ver = dynamic_cast<const Version *>(msg)) {
+      Version reply;
+      reply.version = 70016;
+      reply.services = NODE_NETWORK;
+      reply.nonce = ver->nonce + 1;  // anything but the client's
+      reply.user_agent = "/spv-bench-sync/";
+      reply.start_height = height();
+      send(reply);
+      send(VerAck{});
+    } else if (auto *req = dynamic_cast<const GetHeaders *>(msg)) {
+      send(headers_after(*req));
+    } else if (auto *ping = dynamic_cast<const Ping *>(msg)) {
+      Pong pong;
+      pong.nonce = ping->nonce;
+      send(pong);
+    }
+  }
+
+  // the reply to a getheaders, from the first locator hash we know
+  HeadersMsg headers_after(const GetHeaders &req) const {
+    size_t start = 0;
+    for (const auto &hash : req.locator_hashes) {
+      const uint32_t *height = heights_.find(hash);
+      if (height != nullptr) {
+        start = *height + 1;
+        break;
+      }
+    }
+    size_t stop = std::min<size_t>(count_, start + MAX_HEADERS_RESULTS);
+    const uint32_t *stop_height = heights_.find(req.hash_stop);
+    if (stop_height != nullptr && *stop_height >= start) {
+      stop = std::min<size_t>(stop, *stop_height + 1);
+    }
+    HeadersMsg msg;
+    msg.block_headers.resize(stop > start ? stop - start : 0);
+    for (size_t i = start; i < stop; i++) {
+      msg.block_headers[i - start].unpack(headers_.data() +
+                                          i * BLOCK_HEADER_SIZE);
+    }
+    return msg;
+  }
+
+  void send(const Message &msg) {
+    Reply reply;
+    reply.ready = Clock::now() + latency_;
+    reply.data = msg.encode(reply.size);
+    reply.sent = 0;
+    out_.push_back(std::move(reply));
+    if (!pump_->active()) {
+      last_pump_ = Clock::now();
+      pump_->start(std::chrono::milliseconds(0), std::chrono::milliseconds(1));
+    }
+  }
+
+  // write what the latency and bandwidth allow, about once a millisecond
+  void pump() {
+    const auto now = Clock::now();
+    double budget = bytes_per_ns_ *
+                    std::chrono::duration<double, std::nano>(now - last_pump_)
+                        .count();
+    last_pump_ = now;
+    while (!out_.empty() && out_.front().ready <= now && conn_) {
+      Reply &reply = out_.front();
+      size_t n = reply.size - reply.sent;
+      if (bytes_per_ns_ > 0) {
+        n = std::min<size_t>(n, budget);
+        budget -= n;
+      }
+      if (n == 0) {
+        break;
+      }
+      std::unique_ptr<char[]> chunk(new char[n]);
+      std::memcpy(chunk.get(), reply.data.get() + reply.sent, n);
+      conn_->write(std::move(chunk), n);
+      reply.sent += n;
+      if (reply.sent < reply.size) {
+        break;
+      }
+      out_.pop_front();
+    }
+    if (out_.empty()) {
+      pump_->stop();
+    }
+  }
+};
+
+std::unique_ptr<Client> client;
+}  // namespace
+
+static void shutdown(FakePeer &peer) {
+  client->shutdown();
+  peer.close();
+  uvw::Loop::getDefault()->walk([](uvw::BaseHandle &h) {
+    if (!h.closing()) {
+      h.close();
+    }
+  });
+}
+
+// what a sync measured, passed back from the child that ran it
+struct SyncResult {
+  size_t height;
+  double secs;
+  double client_cpu_ns;
+};
+
+// Sync once from a fresh data directory, printing the results and filling
+// in result. Returns the exit status.
+static int run_sync(const std::string &headers, const char *input,
+                    std::chrono::milliseconds latency, double bandwidth,
+                    const std::vector<const char *> &options,
+                    SyncResult &result) {
+  auto loop = uvw::Loop::getDefault();
+  FakePeer peer(loop, headers, latency, bandwidth);
+  const uint16_t port = peer.listen();
+
+  char datadir[] = "/tmp/spv-bench-sync.XXXXXX";
+  if (mkdtemp(datadir) == nullptr) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  const std::string connect = "127.0.0.1:" + std::to_string(port);
+  std::vector<const char *> args = {"spv-bench-sync", "--data-dir",
+                                    datadir,          "--connect",
+                                    connect.c_str(),  "--connections",
+                                    "1"};
+  args.insert(args.end(), options.begin(), options.end());
+  args.push_back(nullptr);
+  spdlog::set_level(spdlog::level::warn);  // -d still turns on debugging
+  int ret = -1;
+  const Settings &settings = parse_settings(
+      args.size() - 1, const_cast<char **>(args.data()), &ret);
+  if (ret != -1) {
+    recursive_delete(datadir);
+    return ret;
+  }
+  if (peer.genesis() != BlockHeader::genesis().block_hash) {
+    std::fprintf(stderr, "%s doesn't start at the genesis block\n", input);
+    recursive_delete(datadir);
+    return 1;
+  }
+  if (!settings.checkpoints_file.empty() &&
+      !load_checkpoints(settings.checkpoints_file)) {
+    recursive_delete(datadir);
+    return 1;
+  }
+
+  const size_t base_rss = resident_bytes();
+  const double base_cpu = process_cpu_ns();
+  const auto start = Clock::now();
+  client.reset(new Client(settings, loop));
+  client->run();
+
+  // check on the sync every 100ms
+  bool ok = false;
+  size_t last_height = client->get_height();
+  auto last_progress = start;
+  auto poll = loop->resource<uvw::TimerHandle>();
+  poll->on<uvw::TimerEvent>([&](const auto &, auto &) {
+    const size_t height = client->get_height();
+    const auto now = Clock::now();
+    if (height > last_height) {
+      last_height = height;
+      last_progress = now;
+    }
+    if (height >= peer.height()) {
+      ok = true;
+    } else if (now - last_progress < STALL_TIMEOUT) {
+      return;
+    }
+    const double secs =
+        std::chrono::duration<double>(now - start).count();
+    const double cpu = process_cpu_ns() - base_cpu;
+    const size_t rss = resident_bytes();
+    const size_t peak = peak_resident_bytes();
+    if (ok) {
+      result.height = height;
+      result.secs = secs;
+      result.client_cpu_ns = cpu - peer.cpu_ns();
+      std::printf("synced %zu headers in %.2f s: %.0f headers/s\n", height,
+                  secs, height / secs);
+      std::printf("cpu: %.2f us/header in the client, %.2f in the peer\n",
+                  (cpu - peer.cpu_ns()) / height / 1e3,
+                  peer.cpu_ns() / height / 1e3);
+      std::printf("rss: %.1f MB for the client and chain, %.1f MB total\n",
+                  (rss > base_rss ? rss - base_rss : 0) / 1048576.0,
+                  rss / 1048576.0);
+      std::printf("peak rss: %.1f MB over the start, %.1f MB total\n",
+                  (peak > base_rss ? peak - base_rss : 0) / 1048576.0,
+                  peak / 1048576.0);
+    } else {
+      std::fprintf(stderr, "sync stalled at height %zu of %zu\n", height,
+                   peer.height());
+    }
+    shutdown(peer);
+  });
+  poll->start(std::chrono::milliseconds(100), std::chrono::milliseconds(100));
+
+  loop->run();
+  loop->close();
+  client.reset();
+  recursive_delete(datadir);
+  return ok ? 0 : 1;
+}
+
+// Run run_sync() in a child, so each run starts from a fresh process, and
+// read back its result. Returns the child's exit status.
+static int run_sync_in_child(const std::string &headers,
+                             const char *input,
+                             std::chrono::milliseconds latency,
+                             double bandwidth,
+                             const std::vector<const char *> &options,
+                             SyncResult &result) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    std::perror("pipe");
+    return 1;
+  }
+  std::fflush(stdout);
+  const pid_t pid = fork();
+  if (pid < 0) {
+    std::perror("fork");
+    return 1;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    SyncResult mine;
+    const int ret =
+        run_sync(headers, input, latency, bandwidth, options, mine);
+    if (ret == 0 && write(fds[1], &mine, sizeof mine) != sizeof mine) {
+      std::exit(1);
+    }
+    std::exit(ret);
+  }
+  close(fds[1]);
+  const bool got = read(fds[0], &result, sizeof result) == sizeof result;
+  close(fds[0]);
+  int status;
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+    return 1;
+  }
+  return got ? WEXITSTATUS(status) : std::max(WEXITSTATUS(status), 1);
+}
+
+int main(int argc, char **argv) {
+  BaselineOptions baseline;
+  if (!parse_baseline_options(argc, argv, baseline)) {
+    return 1;
+  }
+  int split = argc;
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--") == 0) {
+      split = i;
+      break;
+    }
+  }
+  if (split < 2) {
+    std::fprintf(stderr,
+                 "usage: %s [--save-baseline FILE] [--compare FILE] "
+                 "[--samples N] headers.dat [latency ms] [bandwidth MB/s] "
+                 "[-- spv options]\n",
+                 argv[0]);
+    return 1;
+  }
+  const std::chrono::milliseconds latency(split > 2 ? std::stoul(argv[2]) : 0);
+  const double bandwidth = split > 3 ? std::stod(argv[3]) : 0;
+
+  std::ifstream file(argv[1], std::ios::binary);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  const std::string headers = contents.str();
+  if (!file || headers.empty() || headers.size() % BLOCK_HEADER_SIZE != 0) {
+    std::fprintf(stderr, "%s isn't a file of 80-byte headers\n", argv[1]);
+    return 1;
+  }
+  const std::vector<const char *> options(argv + std::min(split + 1, argc),
+                                          argv + argc);
+
+  // a comparison needs a few runs on each side to say anything
+  size_t runs = baseline.samples;
+  if (runs == 0) {
+    runs = baseline.enabled() ? default_runs : 1;
+  }
+  Baseline results;
+  for (size_t i = 0; i < runs; i++) {
+    if (runs > 1) {
+      std::printf("run %zu of %zu\n", i + 1, runs);
+    }
+    SyncResult result;
+    const int ret = run_sync_in_child(headers, argv[1], latency, bandwidth,
+                                      options, result);
+    if (ret != 0) {
+      return ret;
+    }
+    results.add("sync us/header", result.secs * 1e6 / result.height);
+    results.add("sync client cpu us/header",
+                result.client_cpu_ns / 1e3 / result.height);
+  }
+  return baseline.enabled() ? finish_baseline(results, baseline) : 0;
+}
@@ -0,0 +1,57 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./timedata.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "./logging.h"
+
+namespace spv {
+MODULE_LOGGER
+
+bool AdjustedTime::add(const Addr &peer, int64_t offset) {
+  if (samples_.size() >= MAX_SAMPLES || !peers_.insert(peer).second) {
+    return false;
+  }
+  samples_.push_back(offset);
+  // an odd count has a proper median
+  if (samples_.size() < 5 || samples_.size() % 2 == 0) {
+    return false;
+  }
+  std::vector<int64_t> sorted(samples_);
+  std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2,
+                   sorted.end());
+  const int64_t median = sorted[sorted.size() / 2];
+  int64_t next = 0;
+  if (std::llabs(median) <= MAX_OFFSET) {
+    next = median;
+  } else if (!warned_) {
+    log->warn("peer clocks are {}s off from ours, please check the time",
+              median);
+    warned_ = true;
+  }
+  if (next == offset_) {
+    return false;
+  }
+  log->info("network time offset is now {}s, from {} peers", next,
+            samples_.size());
+  offset_ = next;
+  return true;
+}
+}  // namespace spv
@@ -0,0 +1,103 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+
+#include "./addr.h"
+
+namespace spv {
+// how far past the network-adjusted time a header's timestamp may be
+static const int64_t MAX_FUTURE_BLOCK_TIME = 2 * 60 * 60;
+
+// The timestamps of the last eleven headers of a chain, for the median time
+// past that the next header's timestamp has to be after. The window rolls
+// along a run of headers one push() at a time; a sorted copy is kept next
+// to the ring, so nothing is sorted per header.
+class MedianTime {
+ public:
+  static const size_t SPAN = 11;
+
+  MedianTime() : size_(0), next_(0) {}
+
+  inline size_t size() const { return size_; }
+
+  inline void clear() { size_ = next_ = 0; }
+
+  // Add the timestamp of the next header, dropping the oldest if the
+  // window is full. Timestamps are pushed in chain order.
+  void push(uint32_t timestamp) {
+    uint32_t *end = sorted_.data() + size_;
+    if (size_ == SPAN) {
+      // take the oldest out of the sorted copy
+      uint32_t *old = std::lower_bound(sorted_.data(), end, ring_[next_]);
+      std::copy(old + 1, end, old);
+      end--;
+    } else {
+      size_++;
+    }
+    uint32_t *pos = std::upper_bound(sorted_.data(), end, timestamp);
+    std::copy_backward(pos, end, end + 1);
+    *pos = timestamp;
+    ring_[next_] = timestamp;
+    next_ = (next_ + 1) % SPAN;
+  }
+
+  // with fewer than SPAN timestamps (near the genesis block), the median
+  // of those, like Core; the window must not be empty
+  inline uint32_t median() const { return sorted_[size_ / 2]; }
+
+ private:
+  std::array<uint32_t, SPAN> ring_;    // next_ is the oldest once full
+  std::array<uint32_t, SPAN> sorted_;  // the first size_ are valid
+  size_t size_;
+  size_t next_;
+};
+
+// The network-adjusted time, as in Core: our clock plus the median of the
+// offsets of our outbound peers' clocks, as their version messages showed.
+// The offset only moves once there are five samples, and a median of more
+// than MAX_OFFSET is ignored, since then either our clock or most of the
+// peers are badly wrong.
+class AdjustedTime {
+ public:
+  static const size_t MAX_SAMPLES = 200;
+  static const int64_t MAX_OFFSET = 70 * 60;
+
+  AdjustedTime() : offset_(0), warned_(false) {}
+  AdjustedTime(const AdjustedTime &other) = delete;
+
+  // Add a peer's clock minus ours, in seconds. Only the first sample from
+  // each address counts. Returns true if the offset changed.
+  bool add(const Addr &peer, int64_t offset);
+
+  // seconds to add to our clock
+  inline int64_t offset() const { return offset_; }
+
+ private:
+  std::unordered_set<Addr> peers_;
+  std::vector<int64_t> samples_;
+  int64_t offset_;
+  bool warned_;  // about a median past MAX_OFFSET
+};
+}  // namespace spv
@@ -0,0 +1,256 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./timer_wheel.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "./cpu_time.h"
+#include "./logging.h"
+#include "./loop_monitor.h"
+#include "./util.h"
+#include "./uvw.h"
+
+namespace spv {
+MODULE_LOGGER
+
+static inline void link_back(TimerNode *head, TimerNode *node) {
+  node->prev = head->prev;
+  node->next = head;
+  head->prev->next = node;
+  head->prev = node;
+}
+
+static inline void unlink(TimerNode *node) {
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  node->prev = node->next = node;
+}
+
+// the distance (1 to 64) from slot to the next set bit after it, wrapping
+// around, or 0 if none are set
+static inline unsigned next_set(uint64_t bits, unsigned slot) {
+  const unsigned shift = (slot + 1) & 63;
+  const uint64_t rotated = shift ? (bits >> shift) | (bits << (64 - shift))
+                                 : bits;
+  return rotated ? __builtin_ctzll(rotated) + 1 : 0;
+}
+
+void Timer::start(std::chrono::milliseconds delay) {
+  if (active()) {
+    wheel_.remove(this);
+  }
+  wheel_.add(this, delay);
+}
+
+void Timer::stop() {
+  if (active()) {
+    wheel_.remove(this);
+  }
+}
+
+#ifdef SPV_SIMULATION
+thread_local std::vector<TimerWheel *> TimerWheel::wheels_;
+#endif
+
+TimerWheel::TimerWheel(std::shared_ptr<uvw::Loop> loop)
+    : loop_(loop),
+      handle_(loop->resource<uvw::TimerHandle>()),
+      origin_(0),
+      now_(0),
+      wakeup_(0),
+      count_(0),
+      running_(false),
+      occupied_{0, 0, 0, 0} {
+  handle_->on<uvw::ErrorEvent>(
+      [](const auto &, auto &) { log->error("got error from timer wheel"); });
+  handle_->on<uvw::TimerEvent>([this](const auto &, auto &) {
+    LoopScope scope("timer", "wheel");
+    wakeup_ = 0;
+    advance();
+  });
+  origin_ = clock_ms();
+#ifdef SPV_SIMULATION
+  wheels_.push_back(this);
+#endif
+}
+
+TimerWheel::~TimerWheel() {
+  close();
+#ifdef SPV_SIMULATION
+  wheels_.erase(std::find(wheels_.begin(), wheels_.end(), this));
+#endif
+}
+
+void TimerWheel::close() {
+  if (handle_) {
+    handle_->stop();
+    handle_->close();
+    handle_.reset();
+  }
+}
+
+uint64_t TimerWheel::clock_ms() const {
+#ifdef SPV_SIMULATION
+  return sim_clock_ms.load(std::memory_order_relaxed);
+#else
+  return loop_->now().count();
+#endif
+}
+
+uint64_t TimerWheel::current_tick() const {
+  return (clock_ms() - origin_) / tick.count();
+}
+
+void TimerWheel::add(Timer *timer, std::chrono::milliseconds delay) {
+  assert(!timer->active());
+  if (count_ == 0) {
+    now_ = current_tick();  // nothing can be due in between
+  }
+  const uint64_t due = clock_ms() - origin_ + delay.count();
+  timer->expires_ = std::max(now_ + 1, (due + tick.count() - 1) / tick.count());
+  insert(timer);
+  count_++;
+  if (!running_ && (wakeup_ == 0 || timer->expires_ < wakeup_)) {
+    reschedule();
+  }
+}
+
+void TimerWheel::remove(Timer *timer) {
+  assert(timer->active() && count_);
+  unlink(timer);
+  count_--;
+  if (timer->slot_ != running_slot) {
+    const unsigned level = timer->slot_ / slots_per_level;
+    const TimerNode &head = slots_[timer->slot_];
+    if (head.next == &head) {
+      occupied_[level] &= ~(uint64_t(1) << (timer->slot_ % slots_per_level));
+    }
+  }
+  // handle_ may go off early now, which is harmless
+}
+
+void TimerWheel::insert(Timer *timer) {
+  assert(timer->expires_ >= now_);
+  uint64_t delta = timer->expires_ - now_;
+  unsigned level = 0;
+  while (level < levels - 1 && delta >> (level_bits * (level + 1))) {
+    level++;
+  }
+  if (delta >> (level_bits * levels)) {
+    // further out than the wheel reaches, so it fires a little early
+    timer->expires_ = now_ + (uint64_t(1) << (level_bits * levels)) - 1;
+  }
+  const unsigned slot =
+      (timer->expires_ >> (level_bits * level)) & (slots_per_level - 1);
+  timer->slot_ = level * slots_per_level + slot;
+  link_back(&slots_[timer->slot_], timer);
+  occupied_[level] |= uint64_t(1) << slot;
+}
+
+void TimerWheel::cascade(unsigned level) {
+  const unsigned slot =
+      (now_ >> (level_bits * level)) & (slots_per_level - 1);
+  TimerNode &head = slots_[level * slots_per_level + slot];
+  occupied_[level] &= ~(uint64_t(1) << slot);
+  while (head.next != &head) {
+    Timer *timer = static_cast<Timer *>(head.next);
+    unlink(timer);
+    insert(timer);
+  }
+}
+
+void TimerWheel::advance() {
+  CpuScope cpu(CpuTag::TIMERS);
+  const uint64_t target = current_tick();
+  running_ = true;
+  while (now_ < target && count_) {
+    now_++;
+    for (unsigned level = 1; level < levels; level++) {
+      if ((now_ >> (level_bits * (level - 1))) & (slots_per_level - 1)) {
+        break;
+      }
+      cascade(level);
+    }
+
+    // Take the whole slot first, so that callbacks can stop other timers
+    // in it (say, by destroying a connection) or start new ones.
+    const unsigned slot = now_ & (slots_per_level - 1);
+    TimerNode &head = slots_[slot];
+    if (head.next == &head) {
+      continue;
+    }
+    TimerNode due;
+    due.next = head.next;
+    due.prev = head.prev;
+    due.next->prev = due.prev->next = &due;
+    head.prev = head.next = &head;
+    occupied_[0] &= ~(uint64_t(1) << slot);
+    for (TimerNode *node = due.next; node != &due; node = node->next) {
+      static_cast<Timer *>(node)->slot_ = running_slot;
+    }
+    while (due.next != &due) {
+      Timer *timer = static_cast<Timer *>(due.next);
+      unlink(timer);
+      count_--;
+      if (timer->callback_) {
+        timer->callback_();
+      }
+    }
+  }
+  if (count_ == 0) {
+    now_ = target;
+  }
+  running_ = false;
+  reschedule();
+}
+
+uint64_t TimerWheel::next_expiry() const {
+  uint64_t next = 0;
+  for (unsigned level = 0; level < levels; level++) {
+    const unsigned shift = level_bits * level;
+    const unsigned dist =
+        next_set(occupied_[level], (now_ >> shift) & (slots_per_level - 1));
+    if (dist) {
+      const uint64_t when = ((now_ >> shift) + dist) << shift;
+      if (next == 0 || when < next) {
+        next = when;
+      }
+    }
+  }
+  return next ? next : now_ + 1;
+}
+
+void TimerWheel::reschedule() {
+  if (!handle_) {
+    return;
+  }
+  if (count_ == 0) {
+    handle_->stop();
+    wakeup_ = 0;
+    return;
+  }
+  wakeup_ = next_expiry();
+  // in a simulation, the Simulation goes by wakeup_ instead
+#ifndef SPV_SIMULATION
+  const uint64_t due = origin_ + wakeup_ * tick.count();
+  const uint64_t cur = loop_->now().count();
+  handle_->start(std::chrono::milliseconds(due > cur ? due - cur : 0),
+                 std::chrono::milliseconds(0));
+#endif
+}
+}  // namespace spv
@@ -0,0 +1,154 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "./config.h"
+
+namespace uvw {
+class Loop;
+class TimerHandle;
+}  // namespace uvw
+
+namespace spv {
+class Simulation;
+class TimerWheel;
+
+// a link in one of the wheel's slot lists
+struct TimerNode {
+  TimerNode *prev;
+  TimerNode *next;
+
+  TimerNode() : prev(this), next(this) {}
+  TimerNode(const TimerNode &other) = delete;
+};
+
+// A one-shot deadline on a TimerWheel, meant to be a member of whatever it
+// times so that arming it never allocates. The interface follows
+// uvw::TimerHandle. The callback runs on the loop after the timer has been
+// disarmed, so it may start the timer again or destroy its owner. Destroying
+// a timer stops it.
+class Timer : private TimerNode {
+  friend TimerWheel;
+
+ public:
+  typedef std::function<void()> Callback;
+
+  explicit Timer(TimerWheel &wheel, Callback &&cb = nullptr)
+      : wheel_(wheel), callback_(std::move(cb)), expires_(0), slot_(0) {}
+  Timer(const Timer &other) = delete;
+  ~Timer() { stop(); }
+
+  inline void set_callback(Callback &&cb) { callback_ = std::move(cb); }
+
+  inline bool active() const { return next != this; }
+
+  // run the callback after this long, replacing any earlier deadline
+  void start(std::chrono::milliseconds delay);
+
+  void stop();
+
+ private:
+  TimerWheel &wheel_;
+  Callback callback_;
+  uint64_t expires_;  // in ticks
+  uint16_t slot_;     // index into TimerWheel::slots_, or running_slot
+};
+
+// TimerWheel keeps every Timer on a loop with a single libuv timer. Timers
+// sit in a hierarchical wheel (as in the Linux kernel): four levels of 64
+// slots, where the first level has one slot per tick and each level above
+// covers 64 times as much time, so starting and stopping a timer is O(1)
+// whatever the number of connections. Timers in the upper levels cascade
+// down as their slots come due. Deadlines are rounded up to a whole tick.
+//
+// With --enable-simulation the wheel runs on the virtual clock instead of
+// the loop's, and rather than set a libuv timer it waits for the
+// Simulation on its thread to advance it.
+class TimerWheel {
+  friend Simulation;
+  friend Timer;
+
+ public:
+  static constexpr std::chrono::milliseconds tick{10};
+
+  explicit TimerWheel(std::shared_ptr<uvw::Loop> loop);
+  TimerWheel(const TimerWheel &other) = delete;
+  ~TimerWheel();
+
+  // number of active timers
+  inline size_t size() const { return count_; }
+
+  // Release the libuv timer, e.g. at shutdown. Timers that are still active
+  // never fire.
+  void close();
+
+ private:
+  static constexpr unsigned level_bits = 6;
+  static constexpr unsigned slots_per_level = 1 << level_bits;
+  static constexpr unsigned levels = 4;
+  static constexpr uint16_t running_slot = levels * slots_per_level;
+
+  std::shared_ptr<uvw::Loop> loop_;
+  std::shared_ptr<uvw::TimerHandle> handle_;
+  uint64_t origin_;  // loop time of tick 0, in ms
+  uint64_t now_;     // the last tick that has been run
+  uint64_t wakeup_;  // the tick handle_ is set for, or 0 if it's stopped
+  size_t count_;
+  bool running_;
+
+  // one bit per non-empty slot, for each level
+  std::array<uint64_t, levels> occupied_;
+  std::array<TimerNode, levels * slots_per_level> slots_;
+
+#ifdef SPV_SIMULATION
+  // the wheels on this thread, for Simulation to advance
+  static thread_local std::vector<TimerWheel *> wheels_;
+#endif
+
+  // the loop's clock, or the virtual one, in ms
+  uint64_t clock_ms() const;
+
+  // the tick the clock is in
+  uint64_t current_tick() const;
+
+  void add(Timer *timer, std::chrono::milliseconds delay);
+  void remove(Timer *timer);
+
+  // put a timer in the slot for its expiry, relative to now_
+  void insert(Timer *timer);
+
+  // run every timer that's due, then set handle_ for the next one
+  void advance();
+
+  // move the timers in the current slot of this level down the wheel
+  void cascade(unsigned level);
+
+  // the earliest tick something could be due: exact for the first level,
+  // and the next cascade for the others
+  uint64_t next_expiry() const;
+
+  void reschedule();
+};
+}  // namespace spv
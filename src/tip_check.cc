@@ -0,0 +1,48 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./tip_check.h"
+
+namespace spv {
+bool TipCheck::start(size_t height, const std::vector<size_t> &start_heights) {
+  probes_.clear();
+  disagree_ = 0;
+  for (size_t h : start_heights) {
+    if (h >= height + LAG) {
+      disagree_++;
+    }
+  }
+  return disagree_ >= quorum_;
+}
+
+bool TipCheck::pending(const Addr &addr) const {
+  auto it = probes_.find(addr);
+  return it != probes_.end() && !it->second;
+}
+
+bool TipCheck::answered(const Addr &addr, size_t unknown) {
+  auto it = probes_.find(addr);
+  if (it == probes_.end() || it->second) {
+    return false;
+  }
+  it->second = true;
+  if (unknown < LAG) {
+    return false;
+  }
+  return ++disagree_ == quorum_;
+}
+}  // namespace spv
@@ -0,0 +1,70 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+
+#include "./addr.h"
+
+namespace spv {
+// What the outbound peers say about our tip. Headers are synced from
+// whichever peers sync_more_headers() picks, so one that lags or lies
+// could keep us on a stale chain that still looks recent. Every so often
+// the client starts a round: it counts the peers whose version advertised
+// a start height past ours, and asks a few others for the headers after
+// our tip, with a full locator. A peer that answers with headers we don't
+// have, or advertised a height we're behind, disagrees with our tip; once
+// quorum peers do in a round, the client syncs again from all of them.
+class TipCheck {
+ public:
+  // headers a peer has to be ahead by to disagree, since a block found
+  // since the last announcement is no sign of anything
+  static const size_t LAG = 2;
+
+  explicit TipCheck(size_t quorum) : quorum_(quorum), disagree_(0) {}
+  TipCheck(const TipCheck &other) = delete;
+
+  // Start a round at our height, forgetting the last one's unanswered
+  // probes, given the ready peers' advertised start heights. Returns
+  // whether they alone reach the quorum.
+  bool start(size_t height, const std::vector<size_t> &start_heights);
+
+  // record a getheaders probe to a peer
+  inline void probed(const Addr &addr) { probes_[addr] = false; }
+
+  // is there a probe to this peer that hasn't been answered?
+  bool pending(const Addr &addr) const;
+
+  // A probed peer answered with this many headers we didn't have. Returns
+  // true if that makes the round reach the quorum, which it does once.
+  bool answered(const Addr &addr, size_t unknown);
+
+  // forget a peer that disconnected
+  inline void remove(const Addr &addr) { probes_.erase(addr); }
+
+  // peers that disagreed with our tip this round
+  inline size_t disagree() const { return disagree_; }
+
+ private:
+  const size_t quorum_;
+  size_t disagree_;
+  std::unordered_map<Addr, bool> probes_;  // to whether it was answered
+};
+}  // namespace spv
@@ -0,0 +1,195 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./tip_feed.h"
+
+#include <endian.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <type_traits>
+
+namespace spv {
+static_assert((TipFeed::CAPACITY & (TipFeed::CAPACITY - 1)) == 0,
+              "the capacity must be a power of two");
+
+void TipEvent::pack(char *out) const {
+  std::memset(out, 0, RECORD_SIZE);
+  out[0] = reorg ? 2 : 1;
+  const uint32_t fields[3] = {htole32(uint32_t(seq)), htole32(height),
+                              htole32(fork_height)};
+  std::memcpy(out + 4, fields, sizeof fields);
+  std::memcpy(out + 16, hash.data(), hash.size());
+  std::memcpy(out + 48, header, sizeof header);
+}
+
+void TipEvent::unpack(const char *rec) {
+  uint32_t fields[3];
+  std::memcpy(fields, rec + 4, sizeof fields);
+  reorg = rec[0] == 2;
+  seq = le32toh(fields[0]);
+  height = le32toh(fields[1]);
+  fork_height = le32toh(fields[2]);
+  std::memcpy(hash.data(), rec + 16, hash.size());
+  std::memcpy(header, rec + 48, sizeof header);
+}
+
+TipFeed::TipFeed() : ring_(new Slot[CAPACITY]), next_(0), next_id_(0) {
+  for (size_t i = 0; i < CAPACITY; i++) {
+    ring_[i].seq.store(0, std::memory_order_relaxed);
+  }
+}
+
+void TipFeed::publish(const BlockHeader &tip, size_t fork_height,
+                      bool reorg) {
+  const uint64_t seq = next_.load(std::memory_order_relaxed);
+  TipEvent ev;
+  ev.seq = seq;
+  ev.reorg = reorg;
+  ev.height = tip.height;
+  ev.fork_height = fork_height;
+  ev.hash = tip.block_hash;
+  tip.pack(ev.header);
+
+  char rec[TipEvent::RECORD_SIZE];
+  ev.pack(rec);
+  Slot &slot = ring_[seq & (CAPACITY - 1)];
+  slot.seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  for (size_t i = 0; i < RECORD_WORDS; i++) {
+    uint64_t word;
+    std::memcpy(&word, rec + i * sizeof word, sizeof word);
+    slot.words[i].store(word, std::memory_order_relaxed);
+  }
+  slot.seq.store(seq + 1, std::memory_order_release);
+  next_.store(seq + 1, std::memory_order_release);
+
+  for (const auto &sub : subscribers_) {
+    sub.second(ev);
+  }
+}
+
+size_t TipFeed::subscribe(Subscriber &&fn) {
+  subscribers_.emplace_back(next_id_, std::move(fn));
+  return next_id_++;
+}
+
+void TipFeed::unsubscribe(size_t id) {
+  subscribers_.erase(
+      std::remove_if(subscribers_.begin(), subscribers_.end(),
+                     [id](const auto &sub) { return sub.first == id; }),
+      subscribers_.end());
+}
+
+TipFeed::ReadStatus TipFeed::read_record(uint64_t cursor, char *out) const {
+  const uint64_t head = next_.load(std::memory_order_acquire);
+  if (cursor >= head) {
+    return ReadStatus::EMPTY;
+  }
+  if (head - cursor > CAPACITY) {
+    return ReadStatus::LAGGED;
+  }
+  const Slot &slot = ring_[cursor & (CAPACITY - 1)];
+  const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+  if (seq != cursor + 1) {
+    return ReadStatus::LAGGED;  // overwritten, or being overwritten
+  }
+  for (size_t i = 0; i < RECORD_WORDS; i++) {
+    const uint64_t word = slot.words[i].load(std::memory_order_relaxed);
+    std::memcpy(out + i * sizeof word, &word, sizeof word);
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (slot.seq.load(std::memory_order_relaxed) != seq) {
+    return ReadStatus::LAGGED;
+  }
+  return ReadStatus::OK;
+}
+
+TipFeed::ReadStatus TipFeed::read(uint64_t &cursor, TipEvent &out) const {
+  char rec[TipEvent::RECORD_SIZE];
+  const ReadStatus status = read_record(cursor, rec);
+  if (status == ReadStatus::OK) {
+    out.unpack(rec);
+    out.seq = cursor++;  // the record only has the low 32 bits
+  }
+  return status;
+}
+
+size_t TipFeed::read_records(uint64_t &cursor, char *out, size_t max,
+                             ReadStatus &status) const {
+  size_t n = 0;
+  status = ReadStatus::OK;
+  while (n < max) {
+    status = read_record(cursor, out + n * TipEvent::RECORD_SIZE);
+    if (status != ReadStatus::OK) {
+      break;
+    }
+    cursor++;
+    n++;
+  }
+  return n;
+}
+
+static_assert(std::is_trivially_copyable<BlockHeader>::value &&
+                  std::is_trivially_copyable<uint256>::value,
+              "TipSnapshot copies the tip as words");
+
+TipSnapshot::TipSnapshot() : seq_(0) {
+  for (auto &word : words_) {
+    word.store(0, std::memory_order_relaxed);
+  }
+}
+
+void TipSnapshot::store(const BlockHeader &tip, const uint256 &chainwork) {
+  uint64_t words[RECORD_WORDS] = {};
+  Record rec{tip, chainwork};
+  std::memcpy(words, &rec, sizeof rec);
+
+  const uint64_t seq = seq_.load(std::memory_order_relaxed);
+  seq_.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  for (size_t i = 0; i < RECORD_WORDS; i++) {
+    words_[i].store(words[i], std::memory_order_relaxed);
+  }
+  seq_.store(seq + 2, std::memory_order_release);
+}
+
+bool TipSnapshot::load(BlockHeader &tip, uint256 &chainwork) const {
+  uint64_t words[RECORD_WORDS];
+  for (;;) {
+    const uint64_t seq = seq_.load(std::memory_order_acquire);
+    if (seq == 0) {
+      return false;
+    }
+    if (seq & 1) {
+      continue;  // mid-store, which is only a few words
+    }
+    for (size_t i = 0; i < RECORD_WORDS; i++) {
+      words[i] = words_[i].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (seq_.load(std::memory_order_relaxed) == seq) {
+      break;
+    }
+  }
+  Record rec;
+  std::memcpy(&rec, words, sizeof rec);
+  tip = rec.tip;
+  chainwork = rec.chainwork;
+  return true;
+}
+}  // namespace spv
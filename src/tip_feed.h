@@ -0,0 +1,144 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "./constants.h"
+#include "./fields.h"
+#include "./uint256.h"
+
+namespace spv {
+// A change of the best chain's tip. Runs of headers that extend the tip
+// give one event per header; a reorg gives one event for the new tip, with
+// fork_height at the last header the old and new chains have in common.
+struct TipEvent {
+  uint64_t seq;          // counts events from 0, since the process started
+  bool reorg;            // false if the new tip's parent was the old tip
+  uint32_t height;       // of the new tip
+  uint32_t fork_height;  // height - 1 unless reorg
+  hash_t hash;           // of the new tip, in display order
+  char header[BLOCK_HEADER_SIZE];  // the new tip, in the wire encoding
+
+  // The fixed-size record for TipServer and TipFeed's ring, little-endian:
+  //
+  //   0   u8   type: 1 for a new tip, 2 for a reorg
+  //   1   u8   reserved[3]
+  //   4   u32  seq, wrapping
+  //   8   u32  height
+  //   12  u32  fork_height
+  //   16  u8   hash[32]
+  //   48  u8   header[80]
+  static const size_t RECORD_SIZE = 128;
+  void pack(char *out) const;
+  void unpack(const char *rec);
+};
+
+// Publishes tip changes from the chain to subscribers two ways. Callbacks
+// from subscribe() run synchronously as the tip changes, on the chain's
+// thread. Everyone else reads the ring of the last CAPACITY events at their
+// own pace, from any thread: the chain writes a slot and moves on without
+// waiting for anyone, and a reader that fell more than CAPACITY events
+// behind is told so by read() and has to catch up from the chain itself.
+class TipFeed {
+ public:
+  static const size_t CAPACITY = 8192;
+
+  typedef std::function<void(const TipEvent &)> Subscriber;
+
+  enum class ReadStatus {
+    OK,      // the event was read, and the cursor moved past it
+    EMPTY,   // nothing has been published after the cursor yet
+    LAGGED,  // the event at the cursor was overwritten
+  };
+
+  TipFeed();
+  TipFeed(const TipFeed &other) = delete;
+
+  // Only the chain's thread may call these, and not from a subscriber.
+  void publish(const BlockHeader &tip, size_t fork_height, bool reorg);
+  size_t subscribe(Subscriber &&fn);
+  void unsubscribe(size_t id);
+
+  // the seq the next event will have, i.e. a cursor for new events only
+  inline uint64_t next() const {
+    return next_.load(std::memory_order_acquire);
+  }
+
+  // Read the event at the cursor and advance it, from any thread.
+  ReadStatus read(uint64_t &cursor, TipEvent &out) const;
+
+  // Copy the records of up to max events from the cursor into out, which
+  // has room for max * RECORD_SIZE bytes, and advance the cursor. Returns
+  // how many were copied, stopping at the first one that isn't OK.
+  size_t read_records(uint64_t &cursor, char *out, size_t max,
+                      ReadStatus &status) const;
+
+ private:
+  static const size_t RECORD_WORDS = TipEvent::RECORD_SIZE / 8;
+
+  // A seqlock per slot: seq is the event's seq plus one once the slot is
+  // written, and 0 while it's being overwritten. The record is in 64-bit
+  // atomic words so that even a torn read is of atomics.
+  struct Slot {
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> words[RECORD_WORDS];
+  };
+
+  std::unique_ptr<Slot[]> ring_;
+  std::atomic<uint64_t> next_;
+  std::vector<std::pair<size_t, Subscriber> > subscribers_;
+  size_t next_id_;
+
+  ReadStatus read_record(uint64_t cursor, char *out) const;
+};
+
+// The best chain's tip and its chainwork as of the last change, for threads
+// other than the chain's, which mustn't touch Chain::tip() while the chain
+// may be moving it. A seqlock like TipFeed's slots: the chain's thread (or
+// its ChainWriter's, which stores tips once they're written) makes seq
+// odd, stores the words and makes it even again, and a reader that saw an
+// odd or changed seq tries again. Neither side ever blocks.
+class TipSnapshot {
+ public:
+  TipSnapshot();
+  TipSnapshot(const TipSnapshot &other) = delete;
+
+  // Only the chain's thread, or its ChainWriter's, may call this.
+  void store(const BlockHeader &tip, const uint256 &chainwork);
+
+  // The latest tip and its chainwork, from any thread, or false (leaving
+  // them alone) if there's been no store yet.
+  bool load(BlockHeader &tip, uint256 &chainwork) const;
+
+ private:
+  struct Record {
+    BlockHeader tip;
+    uint256 chainwork;
+  };
+  static const size_t RECORD_WORDS = (sizeof(Record) + 7) / 8;
+
+  std::atomic<uint64_t> seq_;
+  std::atomic<uint64_t> words_[RECORD_WORDS];
+};
+}  // namespace spv
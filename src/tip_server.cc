@@ -0,0 +1,149 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./tip_server.h"
+
+#include <algorithm>
+
+#include "./logging.h"
+#include "./unix_socket.h"
+
+namespace spv {
+MODULE_LOGGER
+
+static const size_t max_subscribers = 64;
+
+// the most written to a subscriber and not yet flushed, 2048 events
+static const size_t max_queued_bytes = 256 << 10;
+
+TipServer::TipServer(std::shared_ptr<uvw::Loop> loop, TipFeed &feed)
+    : loop_(loop), feed_(feed), feed_id_(0) {}
+
+bool TipServer::listen(const std::string &path) {
+  listener_ = listen_unix(*loop_, path, "tip changes",
+                          [this](uvw::PipeHandle &server) { accept(server); });
+  if (!listener_) {
+    return false;
+  }
+  path_ = path;
+  feed_id_ = feed_.subscribe([this](const TipEvent &) { schedule_pump(); });
+  log->info("pushing tip changes on {}", path);
+  return true;
+}
+
+void TipServer::close() {
+  if (!listener_) {
+    return;
+  }
+  feed_.unsubscribe(feed_id_);
+  close_unix(listener_, path_);
+  if (pump_) {
+    pump_->close();
+    pump_.reset();
+  }
+  for (auto &sub : subs_) {
+    sub->pipe->close();
+  }
+  subs_.clear();
+}
+
+void TipServer::accept(uvw::PipeHandle &server) {
+  auto pipe = loop_->resource<uvw::PipeHandle>();
+  server.accept(*pipe);
+  if (subs_.size() >= max_subscribers) {
+    pipe->close();
+    return;
+  }
+  auto sub = std::make_shared<Subscriber>();
+  sub->pipe = pipe;
+  sub->cursor = feed_.next();
+  sub->queued = 0;
+  subs_.push_back(sub);
+
+  Subscriber *raw = sub.get();
+  pipe->once<uvw::ErrorEvent>(
+      [this, raw](const auto &, auto &) { drop(raw); });
+  pipe->once<uvw::EndEvent>([this, raw](const auto &, auto &) { drop(raw); });
+  pipe->on<uvw::WriteEvent>([this, raw](const auto &, auto &) {
+    raw->queued -= raw->writes.front();
+    raw->writes.pop_front();
+    if (raw->cursor != feed_.next()) {
+      schedule_pump();
+    }
+  });
+  // nothing is expected from the subscriber, but reading notices it leave
+  pipe->on<uvw::DataEvent>([](const auto &, auto &) {});
+  pipe->read();
+}
+
+void TipServer::drop(Subscriber *sub) {
+  auto it = std::find_if(subs_.begin(), subs_.end(),
+                         [sub](const auto &s) { return s.get() == sub; });
+  if (it == subs_.end()) {
+    return;
+  }
+  // closing cancels the writes in flight, so no WriteEvent can see sub
+  (*it)->pipe->close();
+  subs_.erase(it);
+}
+
+void TipServer::schedule_pump() {
+  if (!pump_) {
+    pump_ = loop_->resource<uvw::IdleHandle>();
+    pump_->on<uvw::IdleEvent>([this](const auto &, auto &idle) {
+      idle.stop();
+      pump();
+    });
+  }
+  if (!pump_->active()) {
+    pump_->start();
+  }
+}
+
+void TipServer::pump() {
+  // pump(sub) can drop sub, so go over a copy
+  const std::vector<std::shared_ptr<Subscriber> > subs(subs_);
+  for (const auto &sub : subs) {
+    if (!pump(*sub)) {
+      log->warn("dropping a tip subscriber more than {} events behind",
+                TipFeed::CAPACITY);
+      drop(sub.get());
+    }
+  }
+}
+
+bool TipServer::pump(Subscriber &sub) {
+  const size_t room = (max_queued_bytes - sub.queued) / TipEvent::RECORD_SIZE;
+  const size_t avail = feed_.next() - sub.cursor;
+  const size_t max = std::min(room, avail);
+  if (max == 0) {
+    return avail <= TipFeed::CAPACITY;
+  }
+  std::unique_ptr<char[]> buf(new char[max * TipEvent::RECORD_SIZE]);
+  TipFeed::ReadStatus status;
+  const size_t n = feed_.read_records(sub.cursor, buf.get(), max, status);
+  if (status == TipFeed::ReadStatus::LAGGED) {
+    return false;
+  }
+  if (n) {
+    const size_t size = n * TipEvent::RECORD_SIZE;
+    sub.writes.push_back(size);
+    sub.queued += size;
+    sub.pipe->write(std::move(buf), size);
+  }
+  return true;
+}
+}  // namespace spv
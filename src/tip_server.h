@@ -0,0 +1,75 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "./tip_feed.h"
+#include "./uvw.h"
+
+namespace spv {
+// Pushes tip changes to every connection on a Unix socket, as the
+// TipEvent::RECORD_SIZE records described in tip_feed.h, starting with the
+// first change after the connection is accepted. Each connection has its own
+// cursor in the feed's ring, so one that reads slowly only falls behind; if
+// it falls so far behind that the ring wraps, it's disconnected, and should
+// reconnect and catch up from the chain (e.g. with the query server).
+class TipServer {
+ public:
+  TipServer(std::shared_ptr<uvw::Loop> loop, TipFeed &feed);
+  TipServer(const TipServer &other) = delete;
+  ~TipServer() { close(); }
+
+  // Listen at path, replacing a socket left there by an earlier run; false
+  // if something else is there, see listen_unix().
+  bool listen(const std::string &path);
+
+  // stop listening, disconnect everyone and remove the socket
+  void close();
+
+ private:
+  struct Subscriber {
+    std::shared_ptr<uvw::PipeHandle> pipe;
+    uint64_t cursor;
+    std::deque<size_t> writes;  // sizes of the writes still in flight
+    size_t queued;              // their total
+  };
+
+  std::shared_ptr<uvw::Loop> loop_;
+  TipFeed &feed_;
+  size_t feed_id_;
+  std::shared_ptr<uvw::PipeHandle> listener_;
+  std::shared_ptr<uvw::IdleHandle> pump_;
+  std::string path_;
+  std::vector<std::shared_ptr<Subscriber> > subs_;
+
+  void accept(uvw::PipeHandle &server);
+
+  // write what's new to every subscriber on the next loop iteration
+  void schedule_pump();
+  void pump();
+
+  // returns false if sub lagged and was closed
+  bool pump(Subscriber &sub);
+  void drop(Subscriber *sub);
+};
+}  // namespace spv
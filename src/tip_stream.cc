@@ -0,0 +1,299 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./tip_stream.h"
+
+#include <endian.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "./logging.h"
+#include "./sha1.h"
+#include "./util.h"
+
+namespace spv {
+MODULE_LOGGER
+
+static const size_t max_queued_bytes = 1 << 20;
+
+// control frames are at most this big, and nothing else is expected
+static const size_t max_client_frame = 4096;
+
+enum Opcode : uint8_t {
+  OP_TEXT = 0x1,
+  OP_CLOSE = 0x8,
+  OP_PING = 0x9,
+  OP_PONG = 0xa,
+};
+
+// append an unmasked frame, as a server sends them
+static void put_frame(std::string &out, Opcode op, const char *payload,
+                      size_t size) {
+  out.push_back(char(0x80 | op));
+  if (size < 126) {
+    out.push_back(char(size));
+  } else if (size <= 0xffff) {
+    const uint16_t len = htobe16(uint16_t(size));
+    out.push_back(char(126));
+    out.append(reinterpret_cast<const char *>(&len), sizeof len);
+  } else {
+    const uint64_t len = htobe64(size);
+    out.push_back(char(127));
+    out.append(reinterpret_cast<const char *>(&len), sizeof len);
+  }
+  out.append(payload, size);
+}
+
+static void put_event(std::string &out, const TipEvent &ev) {
+  char hash[2 * sizeof ev.hash], header[2 * sizeof ev.header];
+  hex_encode(ev.hash.data(), ev.hash.size(), hash);
+  hex_encode(ev.header, sizeof ev.header, header);
+  char json[384];
+  const int n = std::snprintf(
+      json, sizeof json,
+      "{\"type\":\"%s\",\"seq\":%" PRIu64
+      ",\"height\":%u,\"fork_height\":%u,\"hash\":\"%.*s\","
+      "\"header\":\"%.*s\"}",
+      ev.reorg ? "reorg" : "tip", ev.seq, ev.height, ev.fork_height,
+      int(sizeof hash), hash, int(sizeof header), header);
+  put_frame(out, OP_TEXT, json, n);
+}
+
+// Closing cancels the writes in flight, so no WriteEvent can see sub, but
+// libuv only lets go of their buffers once the handle is closed; the frames
+// go with the close callback.
+void TipStream::disconnect(Subscriber &sub) {
+  std::deque<Frames> writes;
+  writes.swap(sub.writes);
+  sub.tcp->clear();
+  sub.tcp->once<uvw::CloseEvent>([writes](const auto &, auto &) {});
+  sub.tcp->close();
+}
+
+TipStream::TipStream(std::shared_ptr<uvw::Loop> loop, TipFeed &feed)
+    : loop_(loop), feed_(feed), feed_id_(0), started_(false), cursor_(0) {}
+
+void TipStream::start() {
+  if (started_) {
+    return;
+  }
+  started_ = true;
+  cursor_ = feed_.next();
+  feed_id_ = feed_.subscribe([this](const TipEvent &) { schedule_pump(); });
+}
+
+void TipStream::close() {
+  if (!started_) {
+    return;
+  }
+  started_ = false;
+  feed_.unsubscribe(feed_id_);
+  if (pump_) {
+    pump_->close();
+    pump_.reset();
+  }
+  for (auto &sub : subs_) {
+    disconnect(*sub);
+  }
+  subs_.clear();
+}
+
+std::string TipStream::accept_key(const std::string &key) {
+  static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  static const char b64[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  const std::string input = key + guid;
+  uint8_t digest[20];
+  sha1::hash(reinterpret_cast<const uint8_t *>(input.data()), input.size(),
+             digest);
+  std::string out;
+  for (size_t i = 0; i < sizeof digest; i += 3) {
+    const size_t left = sizeof digest - i;
+    uint32_t bits = uint32_t(digest[i]) << 16;
+    if (left > 1) {
+      bits |= uint32_t(digest[i + 1]) << 8;
+    }
+    if (left > 2) {
+      bits |= digest[i + 2];
+    }
+    out.push_back(b64[(bits >> 18) & 63]);
+    out.push_back(b64[(bits >> 12) & 63]);
+    out.push_back(left > 1 ? b64[(bits >> 6) & 63] : '=');
+    out.push_back(left > 2 ? b64[bits & 63] : '=');
+  }
+  return out;
+}
+
+void TipStream::add(std::shared_ptr<uvw::TcpHandle> tcp, size_t pending,
+                    std::string head, std::string rest) {
+  auto sub = std::make_shared<Subscriber>();
+  sub->tcp = tcp;
+  sub->pending = pending;
+  sub->in = std::move(rest);
+  subs_.push_back(sub);
+
+  Subscriber *raw = sub.get();
+  tcp->once<uvw::ErrorEvent>([this, raw](const auto &, auto &) { drop(raw); });
+  tcp->once<uvw::EndEvent>([this, raw](const auto &, auto &) { drop(raw); });
+  tcp->on<uvw::WriteEvent>([raw](const auto &, auto &) {
+    if (raw->pending) {
+      raw->pending--;
+      return;
+    }
+    raw->queued -= raw->writes.front()->size();
+    raw->writes.pop_front();
+  });
+  tcp->on<uvw::DataEvent>([this, raw](const auto &data, auto &) {
+    raw->in.append(data.data.get(), data.length);
+    if (!read(*raw)) {
+      drop(raw);
+    }
+  });
+  send(*sub, std::make_shared<const std::string>(std::move(head)));
+  if (!read(*sub)) {
+    drop(raw);
+    return;
+  }
+  tcp->read();
+}
+
+void TipStream::drop(Subscriber *sub) {
+  auto it = std::find_if(subs_.begin(), subs_.end(),
+                         [sub](const auto &s) { return s.get() == sub; });
+  if (it == subs_.end()) {
+    return;
+  }
+  disconnect(**it);
+  std::swap(*it, subs_.back());
+  subs_.pop_back();
+}
+
+void TipStream::send(Subscriber &sub, const Frames &frames) {
+  sub.queued += frames->size();
+  sub.writes.push_back(frames);
+  // frames is kept alive by sub.writes until the WriteEvent
+  sub.tcp->write(const_cast<char *>(frames->data()),
+                 static_cast<unsigned>(frames->size()));
+}
+
+bool TipStream::read(Subscriber &sub) {
+  while (!sub.closing && sub.in.size() >= 2) {
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(sub.in.data());
+    const uint8_t op = p[0] & 0x0f;
+    if (!(p[1] & 0x80)) {
+      return false;  // clients have to mask their frames
+    }
+    size_t len = p[1] & 0x7f, pos = 2;
+    if (len == 126) {
+      if (sub.in.size() < 4) {
+        return true;
+      }
+      len = size_t(p[2]) << 8 | p[3];
+      pos = 4;
+    } else if (len == 127) {
+      return false;  // far more than max_client_frame
+    }
+    if (len > max_client_frame) {
+      return false;
+    }
+    if (sub.in.size() < pos + 4 + len) {
+      return true;
+    }
+    const uint8_t *mask = p + pos;
+    std::string payload(sub.in, pos + 4, len);
+    for (size_t i = 0; i < len; i++) {
+      payload[i] ^= mask[i % 4];
+    }
+    sub.in.erase(0, pos + 4 + len);
+
+    if (op == OP_PING || op == OP_CLOSE) {
+      auto reply = std::make_shared<std::string>();
+      put_frame(*reply, op == OP_PING ? OP_PONG : OP_CLOSE, payload.data(),
+                std::min<size_t>(payload.size(), op == OP_PING ? 125 : 2));
+      send(sub, reply);
+    }
+    if (op == OP_CLOSE) {
+      sub.closing = true;
+      Subscriber *raw = &sub;
+      sub.tcp->once<uvw::ShutdownEvent>(
+          [this, raw](const auto &, auto &) { drop(raw); });
+      sub.tcp->shutdown();
+    }
+  }
+  return true;
+}
+
+void TipStream::schedule_pump() {
+  if (!pump_) {
+    pump_ = loop_->resource<uvw::IdleHandle>();
+    pump_->on<uvw::IdleEvent>([this](const auto &, auto &idle) {
+      idle.stop();
+      pump();
+    });
+  }
+  if (!pump_->active()) {
+    pump_->start();
+  }
+}
+
+void TipStream::pump() {
+  if (subs_.empty()) {
+    cursor_ = feed_.next();
+    return;
+  }
+  auto frames = std::make_shared<std::string>();
+  for (;;) {
+    TipEvent ev;
+    const TipFeed::ReadStatus status = feed_.read(cursor_, ev);
+    if (status == TipFeed::ReadStatus::EMPTY) {
+      break;
+    }
+    if (status == TipFeed::ReadStatus::LAGGED) {
+      // Everyone missed the same events; they have to reconnect and catch
+      // up from the chain.
+      log->warn("dropping {} websocket subscribers more than {} events behind",
+                subs_.size(), TipFeed::CAPACITY);
+      for (auto &sub : subs_) {
+        disconnect(*sub);
+      }
+      subs_.clear();
+      cursor_ = feed_.next();
+      return;
+    }
+    put_event(*frames, ev);
+  }
+  if (frames->empty()) {
+    return;
+  }
+  const Frames shared = frames;
+  // drop() reorders subs_, so go over a copy
+  const std::vector<std::shared_ptr<Subscriber> > subs(subs_);
+  for (const auto &sub : subs) {
+    if (sub->closing) {
+      continue;
+    }
+    if (sub->queued + shared->size() > max_queued_bytes) {
+      log->warn("dropping a websocket subscriber that isn't reading");
+      drop(sub.get());
+      continue;
+    }
+    send(*sub, shared);
+  }
+}
+}  // namespace spv
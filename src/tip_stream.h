@@ -0,0 +1,96 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "./tip_feed.h"
+#include "./uvw.h"
+
+namespace spv {
+// Streams tip changes to WebSocket clients that RpcServer has upgraded, one
+// JSON text message per TipEvent:
+//
+//   {"type":"tip","seq":7,"height":1200,"fork_height":1199,
+//    "hash":"0000...","header":"0100..."}
+//
+// with type "reorg" for a reorg. Unlike TipServer, there's one cursor in
+// the feed for everyone: each batch of events is framed once, into one
+// buffer that every subscriber's write refers to, and the buffer is freed
+// when the last of those writes is done. A subscriber that lets more than
+// a megabyte pile up is dropped. Clients' pings are answered and their
+// close frames echoed; anything else they send is ignored.
+class TipStream {
+ public:
+  static const size_t MAX_SUBSCRIBERS = 4096;
+
+  TipStream(std::shared_ptr<uvw::Loop> loop, TipFeed &feed);
+  TipStream(const TipStream &other) = delete;
+  ~TipStream() { close(); }
+
+  // follow the feed from its next event on
+  void start();
+
+  // stop following the feed and disconnect everyone
+  void close();
+
+  bool full() const { return subs_.size() >= MAX_SUBSCRIBERS; }
+
+  // Take over a connection after the handshake: pending writes to it may
+  // still be in flight, head is what's to be written next (the 101 response,
+  // and any answers before it), and rest is anything read after the request.
+  void add(std::shared_ptr<uvw::TcpHandle> tcp, size_t pending,
+           std::string head, std::string rest);
+
+  // the Sec-WebSocket-Accept value for a Sec-WebSocket-Key
+  static std::string accept_key(const std::string &key);
+
+ private:
+  typedef std::shared_ptr<const std::string> Frames;
+
+  struct Subscriber {
+    std::shared_ptr<uvw::TcpHandle> tcp;
+    std::deque<Frames> writes;  // in flight, so they outlive the writes
+    size_t queued = 0;          // their total size
+    size_t pending = 0;         // writes from before the handshake
+    std::string in;             // a partial frame from the client
+    bool closing = false;       // once our close frame is out
+  };
+
+  std::shared_ptr<uvw::Loop> loop_;
+  TipFeed &feed_;
+  size_t feed_id_;
+  bool started_;
+  uint64_t cursor_;
+  std::shared_ptr<uvw::IdleHandle> pump_;
+  std::vector<std::shared_ptr<Subscriber> > subs_;
+
+  void schedule_pump();
+  void pump();
+  void send(Subscriber &sub, const Frames &frames);
+
+  // handle the client's complete frames; returns false to drop it
+  bool read(Subscriber &sub);
+  void drop(Subscriber *sub);
+  static void disconnect(Subscriber &sub);
+};
+}  // namespace spv
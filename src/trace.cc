@@ -0,0 +1,120 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./trace.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "./logging.h"
+
+namespace spv {
+MODULE_LOGGER
+
+std::atomic<bool> tracing_enabled(false);
+
+// The events of one thread. The mutex is only contended while dumping.
+struct TraceRing {
+  std::mutex mutex;
+  std::vector<TraceEvent> events;
+  uint64_t recorded = 0;  // the next event goes at recorded % size
+  uint32_t tid;
+};
+
+static size_t ring_size;
+static std::atomic<uint64_t> msg_ids(0);
+
+// Every ring, in the order their threads first traced. They're never freed,
+// so the events of threads that have exited can still be dumped.
+static std::mutex rings_mutex;
+static std::vector<std::unique_ptr<TraceRing> > rings;
+
+static thread_local TraceRing *this_ring = nullptr;
+
+void start_tracing(size_t events_per_thread) {
+  ring_size = std::max<size_t>(events_per_thread, 1);
+  tracing_enabled = true;
+}
+
+uint64_t next_trace_msg() {
+  return msg_ids.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+void trace_event(const TraceEvent &event) {
+  if (this_ring == nullptr) {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    rings.emplace_back(new TraceRing);
+    this_ring = rings.back().get();
+    this_ring->events.resize(ring_size);
+    this_ring->tid = rings.size();
+  }
+  std::lock_guard<std::mutex> lock(this_ring->mutex);
+  this_ring->events[this_ring->recorded++ % ring_size] = event;
+}
+
+static void write_event(std::FILE *out, const TraceEvent &event,
+                        uint32_t tid, bool first) {
+  // Chrome wants microseconds; the fraction keeps the nanoseconds
+  std::fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"spv\",\"pid\":1,"
+               "\"tid\":%" PRIu32 ",\"ts\":%.3f,",
+               first ? "" : ",", event.name, tid, event.start / 1e3);
+  if (event.duration == TraceEvent::INSTANT) {
+    std::fprintf(out, "\"ph\":\"i\",\"s\":\"t\"");
+  } else {
+    std::fprintf(out, "\"ph\":\"X\",\"dur\":%.3f", event.duration / 1e3);
+  }
+  std::fprintf(out, ",\"args\":{\"size\":%" PRIu64, event.size);
+  if (event.msg) {
+    std::fprintf(out, ",\"msg\":%" PRIu64, event.msg);
+  }
+  if (event.command != nullptr) {
+    std::fprintf(out, ",\"command\":\"%s\"", event.command);
+  }
+  std::fprintf(out, "}}");
+}
+
+bool dump_trace(const std::string &path) {
+  std::FILE *out = std::fopen(path.c_str(), "w");
+  if (out == nullptr) {
+    log->error("failed to open trace file {}", path);
+    return false;
+  }
+  std::fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  size_t written = 0, lost = 0;
+  std::lock_guard<std::mutex> lock(rings_mutex);
+  for (const auto &ring : rings) {
+    std::lock_guard<std::mutex> ring_lock(ring->mutex);
+    const uint64_t n = std::min<uint64_t>(ring->recorded, ring_size);
+    lost += ring->recorded - n;
+    for (uint64_t i = ring->recorded - n; i < ring->recorded; i++) {
+      write_event(out, ring->events[i % ring_size], ring->tid, written++ == 0);
+    }
+  }
+  std::fprintf(out, "\n]}\n");
+  const bool ok = std::fclose(out) == 0;
+  if (!ok) {
+    log->error("failed to write trace file {}", path);
+    return false;
+  }
+  log->info("wrote {} trace events to {}, {} more were overwritten", written,
+            path, lost);
+  return true;
+}
+}  // namespace spv
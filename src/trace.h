@@ -0,0 +1,98 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace spv {
+// Opt-in tracing of where the time goes in the receive pipeline, turned on
+// by --trace-file. The stages of a message (reading the socket, the frame
+// being complete, decoding, dispatch, adding headers to the chain, writing
+// a reply) record events into a ring buffer of the thread they ran on, so
+// threads don't contend and old events are overwritten rather than
+// growing memory. dump_trace() writes every ring as Chrome trace JSON, for
+// chrome://tracing or Perfetto.
+struct TraceEvent {
+  const char *name;     // the stage
+  const char *command;  // of the message, or nullptr
+  uint64_t start;       // ns on the steady clock
+  uint64_t duration;    // ns, or INSTANT
+  uint64_t msg;         // ties the stages of a received message, or 0
+  uint64_t size;        // bytes, or headers for the chain, or 0
+
+  static const uint64_t INSTANT = UINT64_MAX;
+};
+
+// set once by start_tracing(), before the threads that trace start
+extern std::atomic<bool> tracing_enabled;
+
+inline bool tracing() {
+  return tracing_enabled.load(std::memory_order_relaxed);
+}
+
+// Turn tracing on, keeping the last events_per_thread events of each
+// thread.
+void start_tracing(size_t events_per_thread);
+
+inline uint64_t trace_ns(std::chrono::steady_clock::time_point t) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             t.time_since_epoch())
+      .count();
+}
+
+inline uint64_t trace_now() {
+  return trace_ns(std::chrono::steady_clock::now());
+}
+
+// a new TraceEvent::msg
+uint64_t next_trace_msg();
+
+// Add an event to this thread's ring; only call this when tracing().
+void trace_event(const TraceEvent &event);
+
+// Traces a scope, if tracing is on.
+class TraceSpan {
+ public:
+  explicit TraceSpan(const char *name, const char *command = nullptr,
+                     uint64_t msg = 0, uint64_t size = 0)
+      : event_{name, command, 0, 0, msg, size}, on_(tracing()) {
+    if (on_) {
+      event_.start = trace_now();
+    }
+  }
+  TraceSpan(const TraceSpan &other) = delete;
+
+  ~TraceSpan() {
+    if (on_) {
+      event_.duration = trace_now() - event_.start;
+      trace_event(event_);
+    }
+  }
+
+ private:
+  TraceEvent event_;
+  const bool on_;
+};
+
+// Write the events of every thread to path as Chrome trace JSON. Returns
+// false if the file can't be written.
+bool dump_trace(const std::string &path);
+}  // namespace spv
@@ -0,0 +1,240 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./tx.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "./decoder.h"
+#include "./pow.h"
+#include "./sha256.h"
+
+namespace spv {
+// the smallest an input or output can be, with an empty script
+static const size_t min_input_size = 32 + 4 + 1 + 4;
+static const size_t min_output_size = 8 + 1;
+
+// a count of items at least min_size bytes each
+static size_t pull_count(Decoder &dec, size_t min_size, const char *what) {
+  uint64_t count;
+  dec.pull_varint(count);
+  if (count > dec.bytes_remaining() / min_size) {
+    std::ostringstream os;
+    os << "transaction " << what << " count " << count << " is invalid";
+    throw BadMessage(os.str());
+  }
+  return count;
+}
+
+// skip a length prefixed script or witness item
+static inline void skip_bytes(Decoder &dec) {
+  uint64_t size;
+  dec.pull_varint(size);
+  dec.skip(size);
+}
+
+// scripts can be bigger than Decoder::pull(std::string) allows
+static void pull_bytes(Decoder &dec, std::string &out) {
+  uint64_t size;
+  dec.pull_varint(size);
+  if (size > dec.bytes_remaining()) {
+    throw IncompleteParse("script is truncated");
+  }
+  out.assign(dec.data_ + dec.off_, size);
+  dec.skip(size);
+}
+
+TxSpan TxSpan::pull(Decoder &dec) {
+  TxSpan span;
+  span.offset = dec.off_;
+  dec.skip(4);  // version
+
+  // BIP144: an input count of zero is really the marker, then a flag
+  bool segwit = false;
+  if (dec.bytes_remaining() >= 2 && dec.data_[dec.off_] == 0) {
+    if (dec.data_[dec.off_ + 1] != 1) {
+      throw BadMessage("unknown transaction serialization flag");
+    }
+    segwit = true;
+    dec.skip(2);
+  }
+  span.body = dec.off_;
+
+  const size_t inputs = pull_count(dec, min_input_size, "input");
+  for (size_t i = 0; i < inputs; i++) {
+    dec.skip(32 + 4);  // prev hash and index
+    skip_bytes(dec);
+    dec.skip(4);  // sequence
+  }
+  const size_t outputs = pull_count(dec, min_output_size, "output");
+  for (size_t i = 0; i < outputs; i++) {
+    dec.skip(8);  // value
+    skip_bytes(dec);
+  }
+
+  span.witness = dec.off_;
+  if (segwit) {
+    bool empty = true;
+    for (size_t i = 0; i < inputs; i++) {
+      const size_t items = pull_count(dec, 1, "witness item");
+      empty = empty && items == 0;
+      for (size_t j = 0; j < items; j++) {
+        skip_bytes(dec);
+      }
+    }
+    if (empty) {
+      throw BadMessage("transaction has a witness flag but no witnesses");
+    }
+  }
+  dec.skip(4);  // locktime
+  span.size = dec.off_ - span.offset;
+  return span;
+}
+
+static inline sha256::Range range(const char *base, size_t begin,
+                                  size_t end) {
+  return {reinterpret_cast<const uint8_t *>(base) + begin, end - begin};
+}
+
+size_t TxSpan::txid_ranges(const char *base, sha256::Range *out) const {
+  const size_t end = offset + size;
+  if (!has_witness()) {
+    out[0] = range(base, offset, end);
+    return 1;
+  }
+  out[0] = range(base, offset, offset + 4);
+  out[1] = range(base, body, witness);
+  out[2] = range(base, end - 4, end);
+  return 3;
+}
+
+hash_t TxSpan::txid(const char *base) const {
+  if (!has_witness()) {
+    return wtxid(base);
+  }
+  sha256::Range ranges[3];
+  hash_t hash;
+  sha256::double_hash_ranges(ranges, txid_ranges(base, ranges), hash.data());
+  reverse_hash(hash.data(), hash.data());
+  return hash;
+}
+
+hash_t TxSpan::wtxid(const char *base) const {
+  return pow_hash(base + offset, size, true);
+}
+
+// the next length prefixed script or witness item, which pull() checked
+static inline bool visit_bytes(
+    Decoder &dec, const std::function<bool(const char *, size_t)> &fn) {
+  uint64_t size;
+  dec.pull_varint(size);
+  const char *data = dec.data_ + dec.off_;
+  dec.skip(size);
+  return fn(data, size);
+}
+
+bool TxSpan::any_script(
+    const char *base,
+    const std::function<bool(const char *, size_t)> &fn) const {
+  Decoder dec(base + body, offset + size - body);
+  uint64_t inputs, count;
+  dec.pull_varint(inputs);
+  for (size_t i = 0; i < inputs; i++) {
+    dec.skip(32 + 4);
+    if (visit_bytes(dec, fn)) {
+      return true;
+    }
+    dec.skip(4);
+  }
+  dec.pull_varint(count);
+  for (size_t i = 0; i < count; i++) {
+    dec.skip(8);
+    if (visit_bytes(dec, fn)) {
+      return true;
+    }
+  }
+  if (has_witness()) {
+    for (size_t i = 0; i < inputs; i++) {
+      dec.pull_varint(count);
+      for (size_t j = 0; j < count; j++) {
+        if (visit_bytes(dec, fn)) {
+          return true;
+        }
+      }
+    }
+  }
+  return false;
+}
+
+bool TxSpan::any_input(
+    const char *base,
+    const std::function<bool(const hash_t &, uint32_t)> &fn) const {
+  Decoder dec(base + body, offset + size - body);
+  uint64_t inputs;
+  dec.pull_varint(inputs);
+  hash_t prev_hash;
+  uint32_t prev_index;
+  for (size_t i = 0; i < inputs; i++) {
+    dec.pull(prev_hash);
+    dec.pull(prev_index);
+    if (fn(prev_hash, prev_index)) {
+      return true;
+    }
+    skip_bytes(dec);
+    dec.skip(4);  // sequence
+  }
+  return false;
+}
+
+Tx TxSpan::parse(const char *base, bool witnesses) const {
+  Decoder dec(base + offset, size);
+  Tx tx;
+  dec.pull(tx.version);
+  dec.skip(body - offset - 4);
+
+  uint64_t count;
+  dec.pull_varint(count);
+  tx.inputs.resize(count);
+  for (auto &in : tx.inputs) {
+    dec.pull(in.prev_hash);
+    dec.pull(in.prev_index);
+    pull_bytes(dec, in.script);
+    dec.pull(in.sequence);
+  }
+  dec.pull_varint(count);
+  tx.outputs.resize(count);
+  for (auto &out : tx.outputs) {
+    dec.pull(out.value);
+    pull_bytes(dec, out.script);
+  }
+  if (has_witness() && !witnesses) {
+    dec.skip(offset + size - 4 - witness);
+  } else if (has_witness()) {
+    for (auto &in : tx.inputs) {
+      dec.pull_varint(count);
+      in.witness.resize(count);
+      for (auto &item : in.witness) {
+        pull_bytes(dec, item);
+      }
+    }
+  }
+  dec.pull(tx.locktime);
+  assert(dec.bytes_remaining() == 0);  // pull() already checked all this
+  return tx;
+}
+}  // namespace spv
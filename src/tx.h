@@ -0,0 +1,99 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "./constants.h"
+#include "./sha256.h"
+
+namespace spv {
+struct Decoder;
+
+struct TxIn {
+  hash_t prev_hash;
+  uint32_t prev_index;
+  std::string script;
+  uint32_t sequence;
+  // empty unless the tx has witnesses and they were asked of parse()
+  std::vector<std::string> witness;
+};
+
+struct TxOut {
+  uint64_t value;  // in satoshis
+  std::string script;
+};
+
+// a fully decoded transaction, see TxSpan::parse()
+struct Tx {
+  uint32_t version;
+  std::vector<TxIn> inputs;
+  std::vector<TxOut> outputs;
+  uint32_t locktime;
+};
+
+// Where a transaction lies in a buffer of serialized transactions, such as
+// a tx message or the body of a block, in either the legacy or the BIP144
+// segwit serialization. Finding the offsets only reads lengths, so indexing
+// a block allocates nothing per transaction. The txid is hashed straight
+// from the buffer, and the inputs and outputs are only decoded by parse(),
+// for the transactions that turn out to matter.
+struct TxSpan {
+  uint32_t offset;   // of the version
+  uint32_t body;     // of the input count, after any marker and flag
+  uint32_t witness;  // of the witnesses, or of the locktime without any
+  uint32_t size;     // of the whole serialization
+
+  // Index the transaction at the decoder's offset and move past it; the
+  // offsets are from the start of the decoder's data. Throws IncompleteParse
+  // or BadMessage if the transaction is malformed.
+  static TxSpan pull(Decoder &dec);
+
+  inline bool has_witness() const { return body != offset + 4; }
+
+  // the hash of the serialization without witnesses, in display order
+  hash_t txid(const char *base) const;
+
+  // Write the one or three ranges of the serialization the txid is the
+  // hash of to out, returning how many there are.
+  size_t txid_ranges(const char *base, sha256::Range *out) const;
+
+  // the hash of the full serialization, which is the txid without witnesses
+  hash_t wtxid(const char *base) const;
+
+  // Call fn(data, size) on each input script, output script and witness
+  // item, in that order, until it returns true; returns whether it did.
+  // Nothing is copied, so this is a cheap test before parse().
+  bool any_script(const char *base,
+                  const std::function<bool(const char *, size_t)> &fn) const;
+
+  // Call fn(prev_hash, prev_index) on each input until it returns true;
+  // returns whether it did.
+  bool any_input(
+      const char *base,
+      const std::function<bool(const hash_t &, uint32_t)> &fn) const;
+
+  // Decode the transaction. Witnesses are often most of its bytes and
+  // nothing but matching needs them, which any_script() does in place, so
+  // they're only copied into the inputs if asked for.
+  Tx parse(const char *base, bool witnesses = false) const;
+};
+}  // namespace spv
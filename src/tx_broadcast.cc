@@ -0,0 +1,133 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./tx_broadcast.h"
+
+#include <algorithm>
+
+#include "./decoder.h"
+#include "./message.h"
+
+namespace spv {
+static inline bool has(const std::vector<Addr> &peers, const Addr &peer) {
+  return std::find(peers.begin(), peers.end(), peer) != peers.end();
+}
+
+bool TxBroadcast::add(const std::string &raw, hash_t &txid) {
+  TxMsg msg;
+  msg.raw = raw;
+  try {
+    Decoder dec(msg.raw.data(), msg.raw.size());
+    msg.span = TxSpan::pull(dec);
+    if (dec.bytes_remaining()) {
+      return false;
+    }
+  } catch (const std::exception &) {
+    return false;
+  }
+  txid = msg.txid();
+  if (txs_.count(txid)) {
+    return true;
+  }
+  while (txs_.size() >= max_txs_ && !order_.empty()) {
+    txs_.erase(order_.front());
+    order_.pop_front();
+  }
+  size_t sz;
+  std::unique_ptr<char[]> data = msg.encode(sz);
+  Entry &entry = txs_[txid];
+  entry.msg.assign(data.get(), sz);
+  entry.added = now();
+  order_.push_back(txid);
+  return true;
+}
+
+const TxBroadcast::Entry *TxBroadcast::find(const hash_t &txid) const {
+  auto it = txs_.find(txid);
+  return it == txs_.end() ? nullptr : &it->second;
+}
+
+const std::string *TxBroadcast::serve(const hash_t &txid, const Addr &peer) {
+  auto it = txs_.find(txid);
+  if (it == txs_.end()) {
+    return nullptr;
+  }
+  Entry &entry = it->second;
+  if (!has(entry.fetched, peer)) {
+    entry.fetched.push_back(peer);
+  }
+  return &entry.msg;
+}
+
+void TxBroadcast::told(const hash_t &txid, const std::vector<Addr> &peers,
+                       time_point t) {
+  auto it = txs_.find(txid);
+  if (it == txs_.end()) {
+    return;
+  }
+  Entry &entry = it->second;
+  entry.announced_at = t;
+  for (const Addr &peer : peers) {
+    if (!has(entry.told, peer)) {
+      entry.told.push_back(peer);
+    }
+  }
+}
+
+bool TxBroadcast::seen(const hash_t &txid, const Addr &peer) {
+  auto it = txs_.find(txid);
+  if (it == txs_.end()) {
+    return false;
+  }
+  Entry &entry = it->second;
+  if (!has(entry.told, peer) && !has(entry.seen, peer)) {
+    entry.seen.push_back(peer);
+  }
+  return true;
+}
+
+size_t TxBroadcast::propagated(const hash_t &txid) const {
+  const Entry *entry = find(txid);
+  if (entry == nullptr) {
+    return 0;
+  }
+  size_t n = entry->seen.size();
+  for (const Addr &peer : entry->fetched) {
+    if (!has(entry->seen, peer)) {
+      n++;
+    }
+  }
+  return n;
+}
+
+bool TxBroadcast::remove(const hash_t &txid) {
+  if (!txs_.erase(txid)) {
+    return false;
+  }
+  order_.erase(std::find(order_.begin(), order_.end(), txid));
+  return true;
+}
+
+void TxBroadcast::stale(time_point cutoff, size_t min_peers,
+                        std::vector<hash_t> &out) const {
+  for (const hash_t &txid : order_) {
+    const Entry &entry = txs_.find(txid)->second;
+    if (entry.announced_at < cutoff && propagated(txid) < min_peers) {
+      out.push_back(txid);
+    }
+  }
+}
+}  // namespace spv
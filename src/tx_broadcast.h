@@ -0,0 +1,89 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "./addr.h"
+#include "./constants.h"
+#include "./hashmap.h"
+#include "./util.h"
+
+namespace spv {
+// TxBroadcast holds the transactions we're pushing to the network, until
+// they're mined or pushed out by newer ones. Each is kept as its tx
+// message, encoded once, so a getdata is answered by copying it into the
+// connection's output. The client announces a transaction to a few peers
+// at a time, each on its trickle (see Connection::announce_tx()), and
+// counts it as propagating as other peers fetch it or announce it back;
+// one that doesn't propagate is announced to more peers.
+class TxBroadcast {
+ public:
+  struct Entry {
+    std::string msg;  // the tx message, headers and all
+    time_point added;
+    time_point announced_at;    // the last round of announcements
+    std::vector<Addr> told;     // peers it was announced to
+    std::vector<Addr> fetched;  // peers that sent getdata for it
+    std::vector<Addr> seen;     // other peers that announced it to us
+  };
+
+  explicit TxBroadcast(size_t max_txs) : max_txs_(max_txs) {}
+  TxBroadcast(const TxBroadcast &other) = delete;
+
+  // Add a serialized transaction, encoding its message for the current
+  // network. Returns false if it doesn't parse; txid is set either way if
+  // it does. Adding one that's already there is a no-op.
+  bool add(const std::string &raw, hash_t &txid);
+
+  const Entry *find(const hash_t &txid) const;
+
+  // the message to answer a peer's getdata with, or nullptr if it's not ours
+  const std::string *serve(const hash_t &txid, const Addr &peer);
+
+  // record a round of announcements to peers
+  void told(const hash_t &txid, const std::vector<Addr> &peers,
+            time_point t);
+
+  // A peer announced txid. Returns whether it's ours, in which case it
+  // counts as propagating if we hadn't told the peer about it.
+  bool seen(const hash_t &txid, const Addr &peer);
+
+  // how many peers have the transaction, as far as we know
+  size_t propagated(const hash_t &txid) const;
+
+  // forget a mined transaction; returns whether it was ours
+  bool remove(const hash_t &txid);
+
+  // Append the transactions last announced before cutoff that fewer than
+  // min_peers are known to have, to announce again.
+  void stale(time_point cutoff, size_t min_peers,
+             std::vector<hash_t> &out) const;
+
+  inline size_t size() const { return txs_.size(); }
+  inline bool empty() const { return txs_.empty(); }
+
+ private:
+  size_t max_txs_;
+  std::unordered_map<hash_t, Entry, BlockHashHasher> txs_;
+  std::deque<hash_t> order_;  // oldest first, for eviction
+};
+}  // namespace spv
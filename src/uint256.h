@@ -0,0 +1,296 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <endian.h>
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+
+#include "./constants.h"
+
+namespace spv {
+// A fixed-width unsigned 256-bit integer for targets and chainwork, in four
+// 64-bit limbs. Products and quotients go a limb at a time through
+// unsigned __int128, which compiles to mul (or mulx) and div. The bundled
+// third_party/uint256_t is deliberately not used: its unconstrained
+// converting constructor makes unrelated comparisons ambiguous in any file
+// that includes it, and it divides a bit at a time.
+class uint256 {
+ public:
+  constexpr uint256() : limbs_{0, 0, 0, 0} {}
+  constexpr uint256(uint64_t val) : limbs_{val, 0, 0, 0} {}  // NOLINT
+
+  // interpret a hash (most significant byte first) as a number
+  static uint256 from_hash(const hash_t &hash) {
+    uint256 out;
+    for (size_t i = 0; i < 4; i++) {
+      uint64_t word;
+      std::memcpy(&word, hash.data() + 8 * i, sizeof word);
+      out.limbs_[3 - i] = be64toh(word);
+    }
+    return out;
+  }
+
+  constexpr uint64_t low64() const { return limbs_[0]; }
+
+  constexpr bool is_zero() const {
+    return (limbs_[0] | limbs_[1] | limbs_[2] | limbs_[3]) == 0;
+  }
+
+  // number of significant bits
+  constexpr unsigned bits() const {
+    for (int i = 3; i >= 0; i--) {
+      if (limbs_[i]) {
+        return 64 * i + 64 - __builtin_clzll(limbs_[i]);
+      }
+    }
+    return 0;
+  }
+
+  constexpr int compare(const uint256 &other) const {
+    return *this < other ? -1 : (other < *this ? 1 : 0);
+  }
+
+  // Branch free, as the borrow out of a subtraction; check_pow() runs this
+  // for every header.
+  friend constexpr bool operator<(const uint256 &a, const uint256 &b) {
+    bool borrow = false;
+    for (int i = 0; i < 4; i++) {
+      borrow = (a.limbs_[i] < b.limbs_[i]) |
+               ((a.limbs_[i] == b.limbs_[i]) & borrow);
+    }
+    return borrow;
+  }
+  friend constexpr bool operator==(const uint256 &a, const uint256 &b) {
+    return ((a.limbs_[0] ^ b.limbs_[0]) | (a.limbs_[1] ^ b.limbs_[1]) |
+            (a.limbs_[2] ^ b.limbs_[2]) | (a.limbs_[3] ^ b.limbs_[3])) == 0;
+  }
+  friend constexpr bool operator!=(const uint256 &a, const uint256 &b) {
+    return !(a == b);
+  }
+  friend constexpr bool operator>(const uint256 &a, const uint256 &b) {
+    return b < a;
+  }
+  friend constexpr bool operator<=(const uint256 &a, const uint256 &b) {
+    return !(b < a);
+  }
+  friend constexpr bool operator>=(const uint256 &a, const uint256 &b) {
+    return !(a < b);
+  }
+
+  constexpr uint256 &operator+=(const uint256 &other) {
+    unsigned __int128 carry = 0;
+    for (int i = 0; i < 4; i++) {
+      carry += (unsigned __int128)limbs_[i] + other.limbs_[i];
+      limbs_[i] = uint64_t(carry);
+      carry >>= 64;
+    }
+    return *this;
+  }
+
+  constexpr uint256 &operator-=(const uint256 &other) {
+    uint64_t borrow = 0;
+    for (int i = 0; i < 4; i++) {
+      const uint64_t a = limbs_[i], b = other.limbs_[i];
+      limbs_[i] = a - b - borrow;
+      borrow = (a < b) | ((a == b) & borrow);
+    }
+    return *this;
+  }
+
+  constexpr uint256 &operator<<=(unsigned shift) {
+    uint256 out;
+    const unsigned words = shift / 64, rem = shift % 64;
+    for (int i = 3; i >= int(words); i--) {
+      out.limbs_[i] = limbs_[i - words] << rem;
+      if (rem && i - int(words) - 1 >= 0) {
+        out.limbs_[i] |= limbs_[i - words - 1] >> (64 - rem);
+      }
+    }
+    return *this = out;
+  }
+
+  constexpr uint256 &operator>>=(unsigned shift) {
+    uint256 out;
+    const unsigned words = shift / 64, rem = shift % 64;
+    for (unsigned i = 0; i + words < 4; i++) {
+      out.limbs_[i] = limbs_[i + words] >> rem;
+      if (rem && i + words + 1 < 4) {
+        out.limbs_[i] |= limbs_[i + words + 1] << (64 - rem);
+      }
+    }
+    return *this = out;
+  }
+
+  // multiply by a small factor, dropping any overflow
+  constexpr uint256 &operator*=(uint32_t factor) {
+    unsigned __int128 carry = 0;
+    for (int i = 0; i < 4; i++) {
+      carry += (unsigned __int128)limbs_[i] * factor;
+      limbs_[i] = uint64_t(carry);
+      carry >>= 64;
+    }
+    return *this;
+  }
+
+  // schoolbook multiplication, dropping any overflow
+  constexpr uint256 &operator*=(const uint256 &other) {
+    uint256 out;
+    for (int i = 0; i < 4; i++) {
+      unsigned __int128 carry = 0;
+      for (int j = 0; i + j < 4; j++) {
+        carry += (unsigned __int128)limbs_[i] * other.limbs_[j] +
+                 out.limbs_[i + j];
+        out.limbs_[i + j] = uint64_t(carry);
+        carry >>= 64;
+      }
+    }
+    return *this = out;
+  }
+
+  // Knuth's algorithm D, a limb at a time; division by zero yields zero
+  constexpr uint256 &operator/=(const uint256 &divisor) {
+    int n = 4;
+    while (n > 0 && divisor.limbs_[n - 1] == 0) {
+      n--;
+    }
+    if (n == 0 || *this < divisor) {
+      return *this = uint256();
+    }
+    int m = 4;
+    while (limbs_[m - 1] == 0) {
+      m--;
+    }
+    uint256 quot;
+    if (n == 1) {
+      const uint64_t d = divisor.limbs_[0];
+      unsigned __int128 rem = 0;
+      for (int i = m - 1; i >= 0; i--) {
+        const unsigned __int128 cur = (rem << 64) | limbs_[i];
+        quot.limbs_[i] = uint64_t(cur / d);
+        rem = cur % d;
+      }
+      return *this = quot;
+    }
+
+    // normalize, so the divisor's top limb has its top bit set
+    const unsigned s = __builtin_clzll(divisor.limbs_[n - 1]);
+    uint64_t vn[4] = {0, 0, 0, 0}, un[5] = {0, 0, 0, 0, 0};
+    for (int i = n - 1; i > 0; i--) {
+      vn[i] = (divisor.limbs_[i] << s) |
+              (s ? divisor.limbs_[i - 1] >> (64 - s) : 0);
+    }
+    vn[0] = divisor.limbs_[0] << s;
+    un[m] = s ? limbs_[m - 1] >> (64 - s) : 0;
+    for (int i = m - 1; i > 0; i--) {
+      un[i] = (limbs_[i] << s) | (s ? limbs_[i - 1] >> (64 - s) : 0);
+    }
+    un[0] = limbs_[0] << s;
+
+    for (int j = m - n; j >= 0; j--) {
+      // estimate the quotient limb from the top two and correct it
+      const unsigned __int128 top =
+          ((unsigned __int128)un[j + n] << 64) | un[j + n - 1];
+      unsigned __int128 qhat = top / vn[n - 1];
+      unsigned __int128 rhat = top % vn[n - 1];
+      while ((qhat >> 64) ||
+             qhat * vn[n - 2] > ((rhat << 64) | un[j + n - 2])) {
+        qhat--;
+        rhat += vn[n - 1];
+        if (rhat >> 64) {
+          break;
+        }
+      }
+      // multiply and subtract
+      uint64_t borrow = 0;
+      for (int i = 0; i < n; i++) {
+        const unsigned __int128 p = qhat * vn[i];
+        const uint64_t lo = uint64_t(p), hi = uint64_t(p >> 64);
+        const uint64_t t = un[i + j] - lo;
+        const uint64_t b1 = un[i + j] < lo, b2 = t < borrow;
+        un[i + j] = t - borrow;
+        borrow = hi + b1 + b2;
+      }
+      const bool negative = un[j + n] < borrow;
+      un[j + n] -= borrow;
+      quot.limbs_[j] = uint64_t(qhat);
+      if (negative) {
+        // qhat was one too big, so add the divisor back
+        quot.limbs_[j]--;
+        unsigned __int128 carry = 0;
+        for (int i = 0; i < n; i++) {
+          carry += (unsigned __int128)un[i + j] + vn[i];
+          un[i + j] = uint64_t(carry);
+          carry >>= 64;
+        }
+        un[j + n] += uint64_t(carry);
+      }
+    }
+    return *this = quot;
+  }
+
+  constexpr uint256 operator~() const {
+    uint256 out;
+    for (int i = 0; i < 4; i++) {
+      out.limbs_[i] = ~limbs_[i];
+    }
+    return out;
+  }
+
+  friend constexpr uint256 operator+(uint256 a, const uint256 &b) {
+    return a += b;
+  }
+  friend constexpr uint256 operator-(uint256 a, const uint256 &b) {
+    return a -= b;
+  }
+  friend constexpr uint256 operator*(uint256 a, uint32_t factor) {
+    return a *= factor;
+  }
+  friend constexpr uint256 operator*(uint256 a, const uint256 &b) {
+    return a *= b;
+  }
+  friend constexpr uint256 operator/(uint256 a, const uint256 &b) {
+    return a /= b;
+  }
+  friend constexpr uint256 operator<<(uint256 a, unsigned shift) {
+    return a <<= shift;
+  }
+  friend constexpr uint256 operator>>(uint256 a, unsigned shift) {
+    return a >>= shift;
+  }
+
+  // most significant byte first, like hash_t
+  hash_t to_hash() const {
+    hash_t out;
+    for (size_t i = 0; i < 4; i++) {
+      const uint64_t word = htobe64(limbs_[3 - i]);
+      std::memcpy(out.data() + 8 * i, &word, sizeof word);
+    }
+    return out;
+  }
+
+ private:
+  std::array<uint64_t, 4> limbs_;  // least significant limb first
+};
+}  // namespace spv
+
+inline std::ostream &operator<<(std::ostream &o, const spv::uint256 &n) {
+  return o << n.to_hash();
+}
@@ -0,0 +1,70 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./unix_socket.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "./logging.h"
+
+namespace spv {
+MODULE_LOGGER
+
+std::shared_ptr<uvw::PipeHandle> listen_unix(
+    uvw::Loop &loop, const std::string &path, const char *what,
+    std::function<void(uvw::PipeHandle &)> accept) {
+  struct stat st;
+  if (::lstat(path.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      log->error("not serving {} on {}, which isn't a socket", what, path);
+      return nullptr;
+    }
+    if (::unlink(path.c_str())) {
+      log->error("failed to remove the old socket {}: {}", path,
+                 std::strerror(errno));
+      return nullptr;
+    }
+  } else if (errno != ENOENT) {
+    log->error("not serving {} on {}: {}", what, path, std::strerror(errno));
+    return nullptr;
+  }
+
+  auto listener = loop.resource<uvw::PipeHandle>();
+  const std::string name = what;
+  listener->on<uvw::ErrorEvent>([name](const auto &exc, auto &) {
+    log->error("error serving {}: {}", name, exc.what());
+  });
+  listener->on<uvw::ListenEvent>(
+      [accept](const auto &, auto &server) { accept(server); });
+  listener->bind(path);
+  listener->listen();
+  return listener;
+}
+
+void close_unix(std::shared_ptr<uvw::PipeHandle> &listener,
+                const std::string &path) {
+  if (listener) {
+    listener->close();
+    listener.reset();
+    ::unlink(path.c_str());
+  }
+}
+}  // namespace spv
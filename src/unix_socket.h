@@ -0,0 +1,40 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "./uvw.h"
+
+namespace spv {
+// Listen on a unix socket at path for the status, query, tip and control
+// servers. A socket already there is taken to be left by an earlier run
+// and replaced, since the lock file keeps another client from still using
+// it. Anything else at path is left alone, and this logs why and returns
+// nullptr, so a mistyped path can't cost a file. Errors on the socket are
+// logged as serving what, and each connection goes to accept.
+std::shared_ptr<uvw::PipeHandle> listen_unix(
+    uvw::Loop &loop, const std::string &path, const char *what,
+    std::function<void(uvw::PipeHandle &)> accept);
+
+// Close a listener from listen_unix() at path, if there is one, and remove
+// its socket.
+void close_unix(std::shared_ptr<uvw::PipeHandle> &listener,
+                const std::string &path);
+}  // namespace spv
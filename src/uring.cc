@@ -0,0 +1,390 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./uring.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef SPV_IO_URING
+#include <liburing.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+#include "./logging.h"
+#include "./slab.h"
+
+namespace spv {
+MODULE_LOGGER
+
+// submission slots, enough for a receive and a send on every connection
+// plus the odd cancel between two loop iterations
+const static unsigned ring_entries = 256;
+
+// provided receive buffers: a power of two, and each as big as the reads
+// libuv would do
+const static unsigned recv_buffers = 128;
+const static size_t recv_buffer_size = 32 << 10;
+const static uint16_t recv_group = 0;
+
+// the low bits of a user_data say what completed; the rest is the socket
+enum : uint64_t { TAG_CANCEL = 0, TAG_RECV = 1, TAG_SEND = 2, TAG_MASK = 3 };
+
+static inline uint64_t make_tag(RingSocket *sock, uint64_t kind) {
+  return reinterpret_cast<uintptr_t>(sock) | kind;
+}
+
+#ifdef SPV_IO_URING
+Ring::Ring(uvw::Loop &loop)
+    : ring_(nullptr),
+      bufs_(nullptr),
+      efd_(-1),
+      queued_(0),
+      in_flight_(0) {
+  submit_ = loop.resource<uvw::PrepareHandle>();
+  submit_->on<uvw::PrepareEvent>([this](const auto &, auto &) { submit(); });
+}
+
+std::unique_ptr<Ring> Ring::open(uvw::Loop &loop) {
+  std::unique_ptr<Ring> ring(new Ring(loop));
+  std::unique_ptr<io_uring> uring(new io_uring);
+  int err = io_uring_queue_init(ring_entries, uring.get(), 0);
+  if (err < 0) {
+    log->warn("failed to set up io_uring, using libuv: {}", strerror(-err));
+    return nullptr;
+  }
+  ring->ring_ = uring.release();
+  ring->bufs_ = io_uring_setup_buf_ring(ring->ring_, recv_buffers,
+                                        recv_group, 0, &err);
+  if (ring->bufs_ == nullptr) {
+    log->warn("failed to register io_uring buffers, using libuv: {}",
+              strerror(-err));
+    return nullptr;
+  }
+  const int mask = io_uring_buf_ring_mask(recv_buffers);
+  for (unsigned i = 0; i < recv_buffers; i++) {
+    ring->buffers_.push_back(slab::allocate(recv_buffer_size));
+    io_uring_buf_ring_add(ring->bufs_, ring->buffers_.back().get(),
+                          recv_buffer_size, i, mask, i);
+  }
+  io_uring_buf_ring_advance(ring->bufs_, recv_buffers);
+
+  ring->efd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (ring->efd_ < 0 ||
+      (err = io_uring_register_eventfd(ring->ring_, ring->efd_)) < 0) {
+    log->warn("failed to poll io_uring, using libuv: {}",
+              strerror(ring->efd_ < 0 ? errno : -err));
+    return nullptr;
+  }
+  Ring *self = ring.get();
+  ring->poll_ = loop.resource<uvw::PollHandle>(ring->efd_);
+  ring->poll_->on<uvw::PollEvent>([self](const auto &, auto &) {
+    uint64_t count;
+    while (read(self->efd_, &count, sizeof count) > 0) {
+    }
+    self->reap();
+  });
+  ring->poll_->start(uvw::PollHandle::Event::READABLE);
+  ring->submit_->start();
+  log->info("reading and writing peer sockets with io_uring");
+  return ring;
+}
+
+Ring::~Ring() {
+  close();
+  if (ring_) {
+    if (bufs_ != nullptr) {
+      io_uring_free_buf_ring(ring_, bufs_, recv_buffers, recv_group);
+    }
+    io_uring_queue_exit(ring_);
+    delete ring_;
+  }
+  if (efd_ >= 0) {
+    ::close(efd_);
+  }
+  for (auto &buf : buffers_) {
+    slab::release(std::move(buf), slab::round_up(recv_buffer_size));
+  }
+}
+
+void Ring::close() {
+  if (submit_) {
+    submit_->stop();
+    submit_->close();
+    submit_.reset();
+  }
+  if (poll_) {
+    poll_->stop();
+    poll_->close();
+    poll_.reset();
+  }
+  // the closed sockets' cancels finish quickly; don't wait on anything else
+  for (int i = 0; ring_ && in_flight_ && i < 10; i++) {
+    submit();
+    io_uring_cqe *cqe;
+    __kernel_timespec ts = {0, 10 * 1000 * 1000};
+    if (io_uring_wait_cqe_timeout(ring_, &cqe, &ts) == 0) {
+      reap();
+    }
+  }
+  starved_.clear();
+}
+
+void Ring::submit() {
+  if (queued_) {
+    const int ret = io_uring_submit(ring_);
+    if (ret < 0) {
+      log->warn("io_uring submit failed: {}", strerror(-ret));
+      return;
+    }
+    queued_ -= std::min<size_t>(queued_, ret);
+  }
+}
+
+// Get a submission slot, handing the full queue over first if need be.
+static io_uring_sqe *get_sqe(io_uring *ring) {
+  io_uring_sqe *sqe = io_uring_get_sqe(ring);
+  while (sqe == nullptr) {
+    io_uring_submit(ring);
+    sqe = io_uring_get_sqe(ring);
+  }
+  return sqe;
+}
+
+void Ring::prep_recv(RingSocket *sock, uint64_t tag) {
+  io_uring_sqe *sqe = get_sqe(ring_);
+  io_uring_prep_recv(sqe, sock->fd_, nullptr, recv_buffer_size, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = recv_group;
+  io_uring_sqe_set_data64(sqe, tag);
+  queued_++;
+  in_flight_++;
+}
+
+void Ring::prep_send(RingSocket *sock, uint64_t tag) {
+  io_uring_sqe *sqe = get_sqe(ring_);
+  io_uring_prep_sendmsg(sqe, sock->fd_, &sock->msg_, MSG_NOSIGNAL);
+  io_uring_sqe_set_data64(sqe, tag);
+  queued_++;
+  in_flight_++;
+}
+
+void Ring::prep_cancel(uint64_t tag) {
+  io_uring_sqe *sqe = get_sqe(ring_);
+  io_uring_prep_cancel64(sqe, tag, 0);
+  io_uring_sqe_set_data64(sqe, TAG_CANCEL);
+  queued_++;
+  in_flight_++;
+}
+
+void Ring::reap() {
+  io_uring_cqe *cqe;
+  const int mask = io_uring_buf_ring_mask(recv_buffers);
+  while (io_uring_peek_cqe(ring_, &cqe) == 0) {
+    const uint64_t data = io_uring_cqe_get_data64(cqe);
+    const int res = cqe->res;
+    const unsigned flags = cqe->flags;
+    io_uring_cqe_seen(ring_, cqe);
+    assert(in_flight_);
+    in_flight_--;
+
+    RingSocket *sock = reinterpret_cast<RingSocket *>(data & ~TAG_MASK);
+    switch (data & TAG_MASK) {
+      case TAG_RECV: {
+        const char *buf = nullptr;
+        unsigned bid = 0;
+        if (flags & IORING_CQE_F_BUFFER) {
+          bid = flags >> IORING_CQE_BUFFER_SHIFT;
+          buf = buffers_[bid].get();
+        }
+        sock->received(res, buf);
+        if (buf != nullptr) {
+          io_uring_buf_ring_add(bufs_, buffers_[bid].get(), recv_buffer_size,
+                                bid, mask, 0);
+          io_uring_buf_ring_advance(bufs_, 1);
+        }
+        break;
+      }
+      case TAG_SEND:
+        sock->sent(res);
+        break;
+      default:
+        break;
+    }
+  }
+  // every buffer is back by now
+  std::vector<std::shared_ptr<RingSocket>> starved;
+  starved.swap(starved_);
+  for (auto &sock : starved) {
+    sock->recv();
+  }
+}
+#else
+Ring::Ring(uvw::Loop &)
+    : ring_(nullptr),
+      bufs_(nullptr),
+      efd_(-1),
+      queued_(0),
+      in_flight_(0) {}
+
+std::unique_ptr<Ring> Ring::open(uvw::Loop &) {
+  log->warn("built without io_uring, using libuv");
+  return nullptr;
+}
+
+Ring::~Ring() {}
+
+void Ring::close() {}
+
+void Ring::submit() {}
+
+void Ring::prep_recv(RingSocket *, uint64_t) { abort(); }
+
+void Ring::prep_send(RingSocket *, uint64_t) { abort(); }
+
+void Ring::prep_cancel(uint64_t) { abort(); }
+
+void Ring::reap() {}
+#endif
+
+std::shared_ptr<RingSocket> Ring::socket(int fd) {
+  return std::make_shared<RingSocket>(*this, fd);
+}
+
+void RingSocket::hold() {
+  if (ops_++ == 0) {
+    self_ = shared_from_this();
+  }
+}
+
+void RingSocket::release() {
+  assert(ops_);
+  if (--ops_ == 0) {
+    self_.reset();
+  }
+}
+
+void RingSocket::pause(bool paused) {
+  paused_ = paused;
+  if (!paused_) {
+    recv();
+  }
+}
+
+void RingSocket::recv() {
+  if (paused_ || closed_ || receiving_) {
+    return;
+  }
+  receiving_ = true;
+  hold();
+  ring_.prep_recv(this, make_tag(this, TAG_RECV));
+}
+
+void RingSocket::received(int res, const char *data) {
+  std::shared_ptr<RingSocket> self = shared_from_this();
+  receiving_ = false;
+  release();
+  if (closed_ || res == -ECANCELED) {
+    return;
+  }
+  if (res == -ENOBUFS) {
+    ring_.starved_.push_back(std::move(self));
+  } else if (res > 0) {
+    callbacks.data(data, res);
+    recv();
+  } else {
+    fail(res);
+  }
+}
+
+void RingSocket::fail(int res) {
+  closed_ = true;
+  // the callback may close this, which clears callbacks
+  Callbacks cb = std::move(callbacks);
+  if (res == 0) {
+    cb.end();
+  } else {
+    cb.error(-res, strerror(-res));
+  }
+}
+
+void RingSocket::write(std::unique_ptr<char[]> data, size_t size) {
+  if (closed_) {
+    return;
+  }
+  writes_.push_back(Write{std::move(data), size});
+  send();
+}
+
+void RingSocket::send() {
+  if (sending_ || closed_ || writes_.empty()) {
+    return;
+  }
+  size_t n = 0;
+  for (auto it = writes_.begin(); it != writes_.end() && n < MAX_IOV; ++it) {
+    const size_t skip = n ? 0 : sent_;
+    iov_[n].iov_base = it->data.get() + skip;
+    iov_[n].iov_len = it->size - skip;
+    n++;
+  }
+  std::memset(&msg_, 0, sizeof msg_);
+  msg_.msg_iov = iov_;
+  msg_.msg_iovlen = n;
+  sending_ = true;
+  hold();
+  ring_.prep_send(this, make_tag(this, TAG_SEND));
+}
+
+void RingSocket::sent(int res) {
+  std::shared_ptr<RingSocket> self = shared_from_this();
+  sending_ = false;
+  release();
+  if (res < 0) {
+    if (!closed_ && res != -ECANCELED) {
+      fail(res);
+    }
+  } else {
+    // a short send leaves the rest of the first unfinished write queued
+    size_t left = res;
+    while (!writes_.empty() && left >= writes_.front().size - sent_) {
+      left -= writes_.front().size - sent_;
+      const size_t size = writes_.front().size;
+      writes_.pop_front();
+      sent_ = 0;
+      if (!closed_) {
+        callbacks.written(size);
+      }
+    }
+    sent_ += left;
+  }
+  send();
+}
+
+void RingSocket::close() {
+  closed_ = true;
+  callbacks = Callbacks();
+  if (receiving_) {
+    ring_.prep_cancel(make_tag(this, TAG_RECV));
+  }
+  if (sending_) {
+    ring_.prep_cancel(make_tag(this, TAG_SEND));
+  }
+}
+}  // namespace spv
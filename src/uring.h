@@ -0,0 +1,167 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "./config.h"
+#include "./uvw.h"
+
+struct io_uring;
+struct io_uring_buf_ring;
+
+namespace spv {
+#ifdef SPV_IO_URING
+static const bool io_uring_available = true;
+#else
+static const bool io_uring_available = false;
+#endif
+
+class RingSocket;
+
+// Ring moves the reads and writes of connected peer sockets from libuv to
+// io_uring (--io-uring, in builds configured with --enable-io-uring).
+// libuv still connects, accepts and closes the sockets, but instead of a
+// read() or writev() per socket per loop iteration, every connection's
+// receives and sends are queued as submissions and handed to the kernel
+// together with one io_uring_enter() just before the loop polls. The ring
+// signals completions on an eventfd that the loop polls like any other
+// descriptor, so timers and the rest of the loop are unchanged.
+//
+// Receives don't each own a buffer: they pick one from a ring of provided
+// buffers, taken from the slab pool when the ring opens, so an idle
+// connection holds no read buffer at all. A buffer goes back as soon as
+// its data has been handed on.
+class Ring {
+ public:
+  Ring(const Ring &other) = delete;
+  ~Ring();
+
+  // Set up a ring on loop, or return nullptr (with a warning) if this
+  // build or the kernel can't.
+  static std::unique_ptr<Ring> open(uvw::Loop &loop);
+
+  // Take over the reads and writes of a connected socket; fd stays owned
+  // by its libuv handle, and the RingSocket has to be closed before it is.
+  std::shared_ptr<RingSocket> socket(int fd);
+
+  // Submit what's queued, wait a little for the cancelled operations to
+  // come back, and stop polling. Call once every socket is closed.
+  void close();
+
+ private:
+  friend RingSocket;
+
+  explicit Ring(uvw::Loop &loop);
+
+  io_uring *ring_;  // owned
+  io_uring_buf_ring *bufs_;
+  std::vector<std::unique_ptr<char[]>> buffers_;
+  int efd_;
+  std::shared_ptr<uvw::PollHandle> poll_;
+  std::shared_ptr<uvw::PrepareHandle> submit_;
+  size_t queued_;     // prepared, but not yet submitted
+  size_t in_flight_;  // submitted, or queued, and not yet complete
+
+  // sockets that found no free buffer, to receive again after a reap
+  std::vector<std::shared_ptr<RingSocket>> starved_;
+
+  // queue a receive, a send of the socket's iov_ or a cancel of tag
+  void prep_recv(RingSocket *sock, uint64_t tag);
+  void prep_send(RingSocket *sock, uint64_t tag);
+  void prep_cancel(uint64_t tag);
+
+  void submit();
+
+  // handle every completion that's in
+  void reap();
+};
+
+// A peer socket whose reads and writes go through a Ring; the counterpart
+// of IoSocket in io.h for the main loop.
+class RingSocket : public std::enable_shared_from_this<RingSocket> {
+ public:
+  // none of these are called after close()
+  struct Callbacks {
+    std::function<void(const char *data, size_t size)> data;
+    std::function<void(int code, const char *what)> error;
+    std::function<void()> end;
+    std::function<void(size_t bytes)> written;
+  };
+
+  RingSocket(Ring &ring, int fd) : ring_(ring), fd_(fd) {}
+  RingSocket(const RingSocket &other) = delete;
+
+  Callbacks callbacks;
+
+  // start or stop receiving; a socket starts out paused
+  void pause(bool paused);
+
+  void write(std::unique_ptr<char[]> data, size_t size);
+
+  // Cancel what's in flight; the buffers being sent are kept until the
+  // kernel lets go of them.
+  void close();
+
+ private:
+  friend Ring;
+
+  // at most this many queued writes go out in one sendmsg
+  static const size_t MAX_IOV = 16;
+
+  struct Write {
+    std::unique_ptr<char[]> data;
+    size_t size;
+  };
+
+  Ring &ring_;
+  const int fd_;
+  bool paused_ = true;
+  bool closed_ = false;
+  bool receiving_ = false;
+  bool sending_ = false;
+  std::deque<Write> writes_;
+  size_t sent_ = 0;  // of the first write
+  iovec iov_[MAX_IOV];
+  msghdr msg_;
+
+  // kept while anything is in flight, as the kernel may still write to
+  // or read from this
+  std::shared_ptr<RingSocket> self_;
+  unsigned ops_ = 0;
+
+  void recv();
+  void send();
+  void hold();
+  void release();
+
+  // a receive or send came back with res
+  void received(int res, const char *data);
+  void sent(int res);
+
+  // the peer closed the connection (res 0) or it failed with -res
+  void fail(int res);
+};
+}  // namespace spv
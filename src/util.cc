@@ -16,35 +16,190 @@
 
 #include "./util.h"
 
+#include <cstring>
 #include <limits>
+#include <mutex>
 #include <random>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
 namespace {
+std::mutex rd_mutex;
 std::random_device rd;
-std::uniform_int_distribution<uint64_t> dist(
-    0, std::numeric_limits<uint64_t>::max());
+
+// random_device isn't safe to call from several threads at once
+uint64_t seed() {
+  std::lock_guard<std::mutex> lock(rd_mutex);
+#ifdef SPV_SIMULATION
+  // the same every run, so that a simulation can be replayed exactly
+  static uint64_t next = 0;
+  return next++;
+#else
+  return uint64_t(rd()) << 32 | rd();
+#endif
 }
+}  // namespace
 
 namespace spv {
-std::mt19937_64 rg(rd());
+#ifdef SPV_SIMULATION
+std::atomic<uint64_t> sim_clock_ms(0);
+#endif
 
-uint64_t rand64() { return dist(rg); }
+thread_local std::mt19937_64 rg(seed());
+thread_local uint64_t clock_seconds = 0;
+thread_local int64_t clock_offset = 0;
 
-std::string to_hex(const char* data, size_t nbytes) {
-  std::string output;
-  output.reserve(2 * nbytes);
-  for (size_t i = 0; i < nbytes; i++) {
-    hex_encode(*(data + i), output);
+void tick_clock() { clock_seconds = time64(); }
+
+void set_time_offset(int64_t seconds) { clock_offset = seconds; }
+
+uint64_t rand64() {
+  std::uniform_int_distribution<uint64_t> dist(
+      0, std::numeric_limits<uint64_t>::max());
+  return dist(rg);
+}
+
+// The vector loops do 16 bytes (32 digits) at a time and leave the rest to
+// the scalar loops. SSE2 is always there on x86-64, and NEON on aarch64, so
+// unlike sha256.cc there's nothing to detect at runtime.
+void hex_encode(const void* data, size_t nbytes, char* out) {
+  static const char* const lut = "0123456789abcdef";
+  const uint8_t* in = static_cast<const uint8_t*>(data);
+  size_t i = 0;
+#if defined(HAVE_SSE2)
+  const __m128i nibble = _mm_set1_epi8(0x0f), nine = _mm_set1_epi8(9);
+  const __m128i zero = _mm_set1_epi8('0'), gap = _mm_set1_epi8('a' - '9' - 1);
+  auto digits = [&](__m128i v) {
+    const __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(v, nine), gap);
+    return _mm_add_epi8(_mm_add_epi8(v, zero), letters);
+  };
+  for (; i + 16 <= nbytes; i += 16) {
+    const __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    const __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+    const __m128i lo = _mm_and_si128(v, nibble);
+    __m128i* dst = reinterpret_cast<__m128i*>(out + 2 * i);
+    _mm_storeu_si128(dst, digits(_mm_unpacklo_epi8(hi, lo)));
+    _mm_storeu_si128(dst + 1, digits(_mm_unpackhi_epi8(hi, lo)));
+  }
+#elif defined(HAVE_NEON)
+  const uint8x16_t table = vld1q_u8(reinterpret_cast<const uint8_t*>(lut));
+  const uint8x16_t nibble = vdupq_n_u8(0x0f);
+  for (; i + 16 <= nbytes; i += 16) {
+    const uint8x16_t v = vld1q_u8(in + i);
+    const uint8x16_t hi = vqtbl1q_u8(table, vshrq_n_u8(v, 4));
+    const uint8x16_t lo = vqtbl1q_u8(table, vandq_u8(v, nibble));
+    uint8_t* dst = reinterpret_cast<uint8_t*>(out + 2 * i);
+    vst1q_u8(dst, vzip1q_u8(hi, lo));
+    vst1q_u8(dst + 16, vzip2q_u8(hi, lo));
+  }
+#endif
+  for (; i < nbytes; i++) {
+    out[2 * i] = lut[in[i] >> 4];
+    out[2 * i + 1] = lut[in[i] & 15];
+  }
+}
+
+static inline int hex_value(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+#if defined(HAVE_SSE2)
+// The values of 16 hex digits, or false if one of them isn't a digit. Bytes
+// over 0x7f compare as negative, so they fail both range checks.
+static inline bool hex_values(const char* hex, __m128i& out) {
+  const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hex));
+  const __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+  const __m128i is_digit =
+      _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                    _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+  const __m128i is_letter =
+      _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                    _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+  if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_letter)) != 0xffff) {
+    return false;
   }
+  const __m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+  const __m128i letter = _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10));
+  const __m128i v = _mm_or_si128(_mm_and_si128(is_digit, digit),
+                                 _mm_and_si128(is_letter, letter));
+  // each 16-bit lane has the high nibble's digit in its low byte
+  out = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0xff)), 4),
+                     _mm_srli_epi16(v, 8));
+  return true;
+}
+#elif defined(HAVE_NEON)
+static inline bool hex_values(const char* hex, uint8x16_t& out) {
+  const uint8x16_t c = vld1q_u8(reinterpret_cast<const uint8_t*>(hex));
+  const uint8x16_t lower = vorrq_u8(c, vdupq_n_u8(0x20));
+  const uint8x16_t digit = vsubq_u8(c, vdupq_n_u8('0'));
+  const uint8x16_t letter = vsubq_u8(lower, vdupq_n_u8('a'));
+  const uint8x16_t is_digit = vcltq_u8(digit, vdupq_n_u8(10));
+  const uint8x16_t is_letter = vcltq_u8(letter, vdupq_n_u8(6));
+  if (vminvq_u8(vorrq_u8(is_digit, is_letter)) != 0xff) {
+    return false;
+  }
+  out = vbslq_u8(is_digit, digit, vaddq_u8(letter, vdupq_n_u8(10)));
+  return true;
+}
+#endif
+
+bool hex_decode(const char* hex, size_t nbytes, void* data) {
+  uint8_t* out = static_cast<uint8_t*>(data);
+  size_t i = 0;
+#if defined(HAVE_SSE2)
+  for (; i + 16 <= nbytes; i += 16) {
+    __m128i a, b;
+    if (!hex_values(hex + 2 * i, a) || !hex_values(hex + 2 * i + 16, b)) {
+      return false;
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                     _mm_packus_epi16(a, b));
+  }
+#elif defined(HAVE_NEON)
+  for (; i + 16 <= nbytes; i += 16) {
+    uint8x16_t a, b;
+    if (!hex_values(hex + 2 * i, a) || !hex_values(hex + 2 * i + 16, b)) {
+      return false;
+    }
+    const uint8x16_t hi = vuzp1q_u8(a, b), lo = vuzp2q_u8(a, b);
+    vst1q_u8(out + i, vorrq_u8(vshlq_n_u8(hi, 4), lo));
+  }
+#endif
+  for (; i < nbytes; i++) {
+    const int hi = hex_value(hex[2 * i]), lo = hex_value(hex[2 * i + 1]);
+    if (hi < 0 || lo < 0) {
+      return false;
+    }
+    out[i] = static_cast<uint8_t>(hi << 4 | lo);
+  }
+  return true;
+}
+
+std::string to_hex(const char* data, size_t nbytes) {
+  std::string output(2 * nbytes, '\0');
+  hex_encode(data, nbytes, &output[0]);
   return output;
 }
 
 std::string to_hex(const std::string& str) {
-  std::string output;
-  output.reserve(2 * str.size());
-  for (const auto& c : str) {
-    hex_encode(c, output);
+  return to_hex(str.data(), str.size());
+}
+
+bool from_hex(const std::string& hex, std::string& out) {
+  if (hex.size() % 2) {
+    return false;
   }
-  return output;
+  out.assign(hex.size() / 2, '\0');
+  return hex_decode(hex.data(), out.size(), &out[0]);
 }
 }
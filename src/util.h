@@ -18,47 +18,66 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
 #include <cstdint>
 #include <ctime>
 #include <random>
 #include <string>
 
-namespace {
-template <typename T>
-inline void hex_encode(T byte, std::string& output) {
-  static_assert(sizeof(T) == 1);
-  static const char* const lut = "0123456789abcdef";
-  uint8_t b = static_cast<uint8_t>(byte);
-  output.push_back(lut[b >> 4]);
-  output.push_back(lut[b & 15]);
-}
-}
+#include "./config.h"
 
 namespace spv {
 typedef std::chrono::time_point<std::chrono::system_clock> time_point;
 
-extern std::mt19937_64 rg;
+// one per thread, since clients on different threads all use it
+extern thread_local std::mt19937_64 rg;
 
+#ifdef SPV_SIMULATION
+// With --enable-simulation, the clock that now(), time32() and time64()
+// read, in ms since the epoch. It only moves when a Simulation moves it;
+// see simulation.h.
+extern std::atomic<uint64_t> sim_clock_ms;
+
+inline time_point now() {
+  return time_point(std::chrono::milliseconds(
+      sim_clock_ms.load(std::memory_order_relaxed)));
+}
+#else
 inline time_point now() { return std::chrono::system_clock::now(); }
+#endif
+
+// write 2 * nbytes lowercase hex digits to out, with no terminator
+void hex_encode(const void* data, size_t nbytes, char* out);
+
+// decode 2 * nbytes hex digits from hex into nbytes bytes at out; returns
+// false if any of them isn't a hex digit
+bool hex_decode(const char* hex, size_t nbytes, void* out);
 
 // convert an array to hex (for debubbing/logging)
 template <size_t N>
 std::string to_hex(const std::array<uint8_t, N>& arr) {
-  std::string output;
-  output.reserve(2 * N);
-  for (const auto& c : arr) {
-    hex_encode(c, output);
-  }
+  std::string output(2 * N, '\0');
+  hex_encode(arr.data(), N, &output[0]);
   return output;
 }
 
 std::string to_hex(const std::string& str);
 std::string to_hex(const char* data, size_t nbytes);
 
+// decode hex into bytes; returns false if it isn't valid hex
+bool from_hex(const std::string& hex, std::string& out);
+
 // generate a random uint64_t value
 uint64_t rand64();
 
+#ifdef SPV_SIMULATION
+inline uint64_t time64() {
+  return sim_clock_ms.load(std::memory_order_relaxed) / 1000;
+}
+
+inline uint32_t time32() { return static_cast<uint32_t>(time64()); }
+#else
 inline uint32_t time32() {
   time_t tv = time(nullptr);
   return static_cast<uint32_t>(tv);
@@ -68,6 +87,33 @@ inline uint64_t time64() {
   time_t tv = time(nullptr);
   return static_cast<uint64_t>(tv);
 }
+#endif
+
+// This thread's cached clock, in seconds since the epoch, or 0 before the
+// first tick_clock(); and its offset from the network's time, as set by
+// set_time_offset().
+extern thread_local uint64_t clock_seconds;
+extern thread_local int64_t clock_offset;
+
+// Refresh the cached clock. A client calls this once per loop iteration, so
+// the clock is read once per wakeup rather than for every address parsed
+// or header checked; everything on the loop sees the time as of the
+// iteration's start.
+void tick_clock();
+
+// Set the seconds to add to the clock for the network-adjusted time, which
+// a client takes from its peers' clocks; see AdjustedTime.
+void set_time_offset(int64_t seconds);
+
+// the cached clock, reading the real one on threads that never tick it
+inline uint64_t cached_time() {
+  return clock_seconds ? clock_seconds : time64();
+}
+
+// the cached clock plus the network's offset
+inline uint32_t adjusted_time() {
+  return static_cast<uint32_t>(int64_t(cached_time()) + clock_offset);
+}
 
 template <typename T>
 void shuffle(T& iterable) {
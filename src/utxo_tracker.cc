@@ -0,0 +1,101 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./utxo_tracker.h"
+
+#include <iterator>
+
+#include "./tx.h"
+#include "./watch.h"
+
+namespace spv {
+void UtxoTracker::journal(uint32_t height, const CompactOutpoint &op,
+                          const Utxo *prev) {
+  if (height == 0) {
+    return;
+  }
+  undo_[height].push_back(Undo{op, prev ? *prev : Utxo(), prev != nullptr});
+  if (height > top_) {
+    top_ = height;
+    if (top_ > UNDO_DEPTH) {
+      undo_.erase(undo_.begin(), undo_.lower_bound(top_ - UNDO_DEPTH));
+    }
+  }
+}
+
+void UtxoTracker::put(const CompactOutpoint &op, const Utxo &utxo) {
+  auto pr = utxos_.emplace(op, utxo);
+  if (!pr.second) {
+    balance(*pr.first) -= pr.first->value;
+    *pr.first = utxo;
+  }
+  balance(utxo) += utxo.value;
+}
+
+void UtxoTracker::remove(const CompactOutpoint &op) {
+  const Utxo *utxo = utxos_.find(op);
+  if (utxo != nullptr) {
+    balance(*utxo) -= utxo->value;
+    utxos_.erase(op);
+  }
+}
+
+bool UtxoTracker::spend(const hash_t &txid, uint32_t index, uint32_t height) {
+  const CompactOutpoint op(txid, index);
+  const Utxo *utxo = utxos_.find(op);
+  if (utxo == nullptr) {
+    return false;
+  }
+  journal(height, op, utxo);
+  remove(op);
+  return true;
+}
+
+void UtxoTracker::add_outputs(const hash_t &txid, const Tx &tx,
+                              uint32_t height) {
+  for (uint32_t i = 0; i < tx.outputs.size(); i++) {
+    const TxOut &out = tx.outputs[i];
+    if (!watch_.matches_script(out.script)) {
+      continue;
+    }
+    const CompactOutpoint op(txid, i);
+    const Utxo *prev = utxos_.find(op);
+    if (prev != nullptr && prev->height == height) {
+      continue;  // seen already, e.g. a block scanned twice
+    }
+    journal(height, op, prev);
+    put(op, Utxo(out.value, height));
+  }
+}
+
+void UtxoTracker::disconnect_to(uint32_t height) {
+  while (!undo_.empty() && undo_.rbegin()->first > height) {
+    auto it = std::prev(undo_.end());
+    const std::vector<Undo> &undos = it->second;
+    for (auto u = undos.rbegin(); u != undos.rend(); ++u) {
+      if (u->existed) {
+        put(u->outpoint, u->prev);
+      } else {
+        remove(u->outpoint);
+      }
+    }
+    undo_.erase(it);
+  }
+  if (top_ > height) {
+    top_ = height;
+  }
+}
+}  // namespace spv
@@ -0,0 +1,129 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include "./constants.h"
+#include "./hashmap.h"
+
+namespace spv {
+struct Tx;
+class WatchList;
+
+// An outpoint with the txid cut down to 8 bytes, which is plenty to tell
+// one wallet's outputs apart and keeps a table entry to 32 bytes.
+struct CompactOutpoint {
+  uint64_t txid;
+  uint32_t index;
+
+  CompactOutpoint() : txid(0), index(0) {}
+  CompactOutpoint(const hash_t &hash, uint32_t i) : index(i) {
+    std::memcpy(&txid, hash.data() + sizeof(hash_t) - sizeof txid,
+                sizeof txid);
+  }
+
+  inline bool operator==(const CompactOutpoint &other) const {
+    return txid == other.txid && index == other.index;
+  }
+};
+
+struct CompactOutpointHasher {
+  inline std::size_t operator()(const CompactOutpoint &op) const noexcept {
+    return op.txid ^ (op.index * 0x9e3779b97f4a7c15ULL);
+  }
+};
+
+// UtxoTracker is the set of unspent outputs that pay the watch list, and
+// their balance, kept up to date as blocks and relayed transactions are
+// scanned rather than recomputed. Every change a block makes is recorded in
+// an undo journal under its height, so a reorg rolls back by replaying the
+// journals above the fork point in reverse. Journals more than UNDO_DEPTH
+// blocks below the highest seen are dropped. Unconfirmed changes (height
+// 0) aren't journaled: a relayed spend is final here until the output is
+// added again.
+class UtxoTracker {
+ public:
+  static const uint32_t UNDO_DEPTH = 1000;
+
+  struct Utxo {
+    uint64_t value;
+    uint32_t height;  // 0 while unconfirmed
+
+    Utxo() : value(0), height(0) {}
+    Utxo(uint64_t v, uint32_t h) : value(v), height(h) {}
+  };
+
+  UtxoTracker() = delete;
+  UtxoTracker(const UtxoTracker &other) = delete;
+  explicit UtxoTracker(const WatchList &watch)
+      : watch_(watch), confirmed_(0), unconfirmed_(0), top_(0) {}
+
+  // Spend the output if it's ours; returns whether it was. Blocks spend
+  // through this for every input, matched or not, since spending a
+  // watched output needn't match the watch list itself.
+  bool spend(const hash_t &txid, uint32_t index, uint32_t height);
+
+  // add the outputs of a matching transaction that pay the watch list
+  void add_outputs(const hash_t &txid, const Tx &tx, uint32_t height);
+
+  // Undo the blocks above height, e.g. a reorg's fork height, newest first.
+  void disconnect_to(uint32_t height);
+
+  const Utxo *find(const hash_t &txid, uint32_t index) const {
+    return utxos_.find(CompactOutpoint(txid, index));
+  }
+
+  // balances in satoshis
+  inline uint64_t confirmed() const { return confirmed_; }
+  inline uint64_t unconfirmed() const { return unconfirmed_; }
+
+  inline size_t size() const { return utxos_.size(); }
+  inline bool empty() const { return utxos_.empty(); }
+  inline size_t memory_usage() const { return utxos_.memory_usage(); }
+
+ private:
+  // the output as it was before the change, or with existed false that it
+  // wasn't there
+  struct Undo {
+    CompactOutpoint outpoint;
+    Utxo prev;
+    bool existed;
+  };
+
+  const WatchList &watch_;
+  FlatHashMap<CompactOutpoint, Utxo, CompactOutpointHasher> utxos_;
+  std::map<uint32_t, std::vector<Undo> > undo_;
+  uint64_t confirmed_;
+  uint64_t unconfirmed_;
+  uint32_t top_;  // the highest height journaled
+
+  inline uint64_t &balance(const Utxo &utxo) {
+    return utxo.height ? confirmed_ : unconfirmed_;
+  }
+
+  // journal a change at height, unless it's unconfirmed
+  void journal(uint32_t height, const CompactOutpoint &op, const Utxo *prev);
+
+  void put(const CompactOutpoint &op, const Utxo &utxo);
+  void remove(const CompactOutpoint &op);
+};
+}  // namespace spv
@@ -0,0 +1,433 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./v2_transport.h"
+
+#include <endian.h>
+#include <secp256k1.h>
+#include <secp256k1_ellswift.h>
+#include <sys/random.h>
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include "./constants.h"
+#include "./logging.h"
+#include "./message.h"
+#include "./network.h"
+#include "./sha256.h"
+
+namespace spv {
+MODULE_LOGGER
+
+// BIP324's table; 5 is feefilter and 17 notfound, which this client has no
+// Message type for
+static const Command short_ids[] = {
+    Command::UNKNOWN,      Command::ADDR,         Command::BLOCK,
+    Command::BLOCKTXN,     Command::CMPCTBLOCK,   Command::UNKNOWN,
+    Command::FILTERADD,    Command::FILTERCLEAR,  Command::FILTERLOAD,
+    Command::GETBLOCKS,    Command::GETBLOCKTXN,  Command::GETDATA,
+    Command::GETHEADERS,   Command::HEADERS,      Command::INV,
+    Command::MEMPOOL,      Command::MERKLEBLOCK,  Command::UNKNOWN,
+    Command::PING,         Command::PONG,         Command::SENDCMPCT,
+    Command::TX,           Command::GETCFILTERS,  Command::CFILTER,
+    Command::GETCFHEADERS, Command::CFHEADERS,    Command::GETCFCHECKPT,
+    Command::CFCHECKPT,    Command::ADDRV2,
+};
+
+static const size_t num_short_ids = sizeof short_ids / sizeof short_ids[0];
+
+uint8_t v2_short_id(Command type) {
+  static const auto ids = [] {
+    std::array<uint8_t, size_t(Command::VERSION) + 1> ids{};
+    for (size_t i = 1; i < num_short_ids; i++) {
+      if (short_ids[i] != Command::UNKNOWN) {
+        ids[size_t(short_ids[i])] = uint8_t(i);
+      }
+    }
+    return ids;
+  }();
+  return ids[size_t(type)];
+}
+
+Command v2_command(uint8_t id) {
+  return id < num_short_ids ? short_ids[id] : Command::UNKNOWN;
+}
+
+static const size_t hash_size = 32;
+
+// HMAC-SHA256 with a key of at most one block
+static void hmac(const uint8_t *key, size_t key_size, const uint8_t *data,
+                 size_t size, uint8_t *out) {
+  static const size_t block = 64;
+  assert(key_size <= block);
+  std::string buf(block + std::max(size, hash_size), '\0');
+  uint8_t *p = reinterpret_cast<uint8_t *>(&buf[0]);
+  uint8_t inner[hash_size];
+  for (size_t i = 0; i < block; i++) {
+    p[i] = (i < key_size ? key[i] : 0) ^ 0x36;
+  }
+  std::memcpy(p + block, data, size);
+  sha256::hash(p, block + size, inner);
+  for (size_t i = 0; i < block; i++) {
+    p[i] ^= 0x36 ^ 0x5c;
+  }
+  std::memcpy(p + block, inner, hash_size);
+  sha256::hash(p, block + hash_size, out);
+}
+
+// HKDF-Expand for a single block of output
+static void expand(const uint8_t *prk, const char *label, uint8_t *out,
+                   size_t size) {
+  assert(size <= hash_size);
+  std::string info(label);
+  info.push_back(1);
+  uint8_t t[hash_size];
+  hmac(prk, hash_size, reinterpret_cast<const uint8_t *>(info.data()),
+       info.size(), t);
+  std::memcpy(out, t, size);
+}
+
+void derive_v2_keys(const uint8_t *secret, V2Keys *keys) {
+  std::string salt("bitcoin_v2_shared_secret");
+  const uint32_t magic = htole32(network().magic);
+  salt.append(reinterpret_cast<const char *>(&magic), sizeof magic);
+  uint8_t prk[hash_size];
+  hmac(reinterpret_cast<const uint8_t *>(salt.data()), salt.size(), secret, 32,
+       prk);
+
+  expand(prk, "initiator_L", keys->initiator_l, sizeof keys->initiator_l);
+  expand(prk, "initiator_P", keys->initiator_p, sizeof keys->initiator_p);
+  expand(prk, "responder_L", keys->responder_l, sizeof keys->responder_l);
+  expand(prk, "responder_P", keys->responder_p, sizeof keys->responder_p);
+  uint8_t garbage[32];
+  expand(prk, "garbage_terminators", garbage, sizeof garbage);
+  std::memcpy(keys->initiator_garbage, garbage, 16);
+  std::memcpy(keys->responder_garbage, garbage + 16, 16);
+  expand(prk, "session_id", keys->session_id, sizeof keys->session_id);
+}
+
+bool parse_v2_packet(const char *data, size_t contents_size, V2Message *msg) {
+  if (contents_size == 0) {
+    return false;
+  }
+  msg->ignore = (uint8_t(data[0]) & V2_IGNORE) != 0;
+  const uint8_t id = uint8_t(data[V2_HEADER_SIZE]);
+  if (id != 0) {
+    msg->type = v2_command(id);
+    msg->command = nullptr;
+    msg->payload = data + V2_HEADER_SIZE + 1;
+    msg->size = contents_size - 1;
+    return true;
+  }
+  if (contents_size < 1 + COMMAND_SIZE) {
+    return false;
+  }
+  msg->command = data + V2_HEADER_SIZE + 1;
+  msg->type = to_command(load_command_key(msg->command));
+  msg->payload = msg->command + COMMAND_SIZE;
+  msg->size = contents_size - 1 - COMMAND_SIZE;
+  return true;
+}
+
+V2Cipher::V2Cipher(const V2Keys &keys, bool initiator)
+    : send_length_(initiator ? keys.initiator_l : keys.responder_l),
+      recv_length_(initiator ? keys.responder_l : keys.initiator_l),
+      send_(initiator ? keys.initiator_p : keys.responder_p),
+      recv_(initiator ? keys.responder_p : keys.initiator_p) {}
+
+void V2Cipher::seal_message(const char *msg, std::string *out) {
+  const size_t payload = message_size(msg) - HEADER_SIZE;
+  const char *command = msg + sizeof(uint32_t);
+  const uint8_t id = v2_short_id(to_command(load_command_key(command)));
+  const size_t contents = (id ? 1 : 1 + COMMAND_SIZE) + payload;
+  assert(contents <= V2_MAX_CONTENTS);
+
+  // the contents are put together in out and then sealed where they are
+  const size_t start = out->size();
+  out->resize(start + V2_EXPANSION + contents);
+  char *p = &(*out)[start];
+  uint32_t le_size = htole32(uint32_t(contents));
+  std::memcpy(p, &le_size, V2_LENGTH_SIZE);
+  p[V2_LENGTH_SIZE] = 0;
+  char *body = p + V2_LENGTH_SIZE + V2_HEADER_SIZE;
+  *body++ = char(id);
+  if (id == 0) {
+    std::memcpy(body, command, COMMAND_SIZE);
+    body += COMMAND_SIZE;
+  }
+  std::memcpy(body, msg + HEADER_SIZE, payload);
+
+  uint8_t *u = reinterpret_cast<uint8_t *>(p);
+  send_length_.crypt(u, u, V2_LENGTH_SIZE);
+  send_.seal(nullptr, 0, u + V2_LENGTH_SIZE, V2_HEADER_SIZE + contents,
+             u + V2_LENGTH_SIZE);
+}
+
+void V2Cipher::seal(const char *data, size_t size, bool ignore,
+                    std::string *out, const uint8_t *aad, size_t aad_size) {
+  assert(size <= V2_MAX_CONTENTS);
+  const size_t start = out->size();
+  out->resize(start + V2_EXPANSION + size);
+  char *p = &(*out)[start];
+  uint32_t le_size = htole32(uint32_t(size));
+  std::memcpy(p, &le_size, V2_LENGTH_SIZE);
+  p[V2_LENGTH_SIZE] = ignore ? char(V2_IGNORE) : 0;
+  std::memcpy(p + V2_LENGTH_SIZE + V2_HEADER_SIZE, data, size);
+
+  uint8_t *u = reinterpret_cast<uint8_t *>(p);
+  send_length_.crypt(u, u, V2_LENGTH_SIZE);
+  send_.seal(aad, aad_size, u + V2_LENGTH_SIZE, V2_HEADER_SIZE + size,
+             u + V2_LENGTH_SIZE);
+}
+
+size_t V2Cipher::open_length(const char *data) {
+  uint8_t le_size[sizeof(uint32_t)] = {};
+  recv_length_.crypt(reinterpret_cast<const uint8_t *>(data), le_size,
+                     V2_LENGTH_SIZE);
+  uint32_t size;
+  std::memcpy(&size, le_size, sizeof size);
+  return le32toh(size);
+}
+
+bool V2Cipher::open(char *data, size_t contents_size, const uint8_t *aad,
+                    size_t aad_size) {
+  uint8_t *u = reinterpret_cast<uint8_t *>(data);
+  return recv_.open(aad, aad_size, u,
+                    V2_HEADER_SIZE + contents_size + Poly1305::TAG_SIZE, u);
+}
+
+// from the kernel's CSPRNG, since the keys and garbage can't come from rg
+static void random_bytes(void *out, size_t size) {
+  uint8_t *p = static_cast<uint8_t *>(out);
+  while (size) {
+    const ssize_t n = getrandom(p, size, 0);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error(errno, std::generic_category(), "getrandom");
+    }
+    p += n;
+    size -= n;
+  }
+}
+
+// shared by all sessions, which only read it once it's randomized
+static const secp256k1_context *context() {
+  static secp256k1_context *ctx = [] {
+    secp256k1_context *ctx = secp256k1_context_create(SECP256K1_CONTEXT_NONE);
+    uint8_t seed[32];
+    random_bytes(seed, sizeof seed);
+    const int ok = secp256k1_context_randomize(ctx, seed);
+    assert(ok);
+    (void)ok;
+    return ctx;
+  }();
+  return ctx;
+}
+
+// the first bytes of a v1 stream: the magic and a version message's command
+static std::string v1_prefix() {
+  std::string prefix(sizeof(uint32_t) + COMMAND_SIZE, '\0');
+  const uint32_t magic = htole32(network().magic);
+  std::memcpy(&prefix[0], &magic, sizeof magic);
+  std::memcpy(&prefix[sizeof magic], "version", 7);
+  return prefix;
+}
+
+V2Session::V2Session(bool initiator)
+    : initiator_(initiator),
+      state_(State::KEY),
+      error_(nullptr),
+      sent_(false),
+      received_(false),
+      contents_(0) {
+  const secp256k1_context *ctx = context();
+  const std::string prefix = v1_prefix();
+  for (;;) {
+    uint8_t aux[32];
+    random_bytes(seckey_, sizeof seckey_);
+    random_bytes(aux, sizeof aux);
+    if (!secp256k1_ec_seckey_verify(ctx, seckey_) ||
+        !secp256k1_ellswift_create(ctx, key_, seckey_, aux)) {
+      continue;
+    }
+    // a responder would take this for a v1 peer
+    if (!initiator_ || std::memcmp(key_, prefix.data(), prefix.size()) != 0) {
+      break;
+    }
+  }
+  uint16_t garbage_size;
+  random_bytes(&garbage_size, sizeof garbage_size);
+  garbage_.resize(garbage_size % (V2_MAX_GARBAGE + 1));
+  random_bytes(&garbage_[0], garbage_.size());
+  if (initiator_) {
+    out_.append(reinterpret_cast<const char *>(key_), sizeof key_);
+    out_.append(garbage_);
+  }
+}
+
+void V2Session::read(const char *data, size_t size) {
+  if (done()) {
+    return;
+  }
+  received_ = received_ || size;
+  in_.append(data, size);
+  while (step()) {
+  }
+}
+
+std::string V2Session::take_output() {
+  std::string out;
+  out.swap(out_);
+  sent_ = sent_ || !out.empty();
+  return out;
+}
+
+std::string V2Session::take_input() {
+  std::string in;
+  in.swap(in_);
+  return in;
+}
+
+bool V2Session::step() {
+  switch (state_) {
+    case State::KEY:
+      return read_key();
+    case State::GARBAGE:
+      return read_garbage();
+    case State::VERSION:
+      return read_version();
+    case State::READY:
+    case State::V1:
+    case State::FAILED:
+      break;
+  }
+  return false;
+}
+
+bool V2Session::fail(const char *why) {
+  LOG_DEBUG(log, "v2 handshake failed: {}", why);
+  state_ = State::FAILED;
+  error_ = why;
+  return false;
+}
+
+bool V2Session::read_key() {
+  if (!initiator_) {
+    // a v1 peer's version message is told apart by its first 16 bytes
+    const std::string prefix = v1_prefix();
+    const size_t n = std::min(in_.size(), prefix.size());
+    if (in_.compare(0, n, prefix, 0, n) == 0) {
+      if (n == prefix.size()) {
+        state_ = State::V1;
+      }
+      return false;
+    }
+  }
+  if (in_.size() < V2_KEY_SIZE) {
+    return false;
+  }
+  const uint8_t *theirs = reinterpret_cast<const uint8_t *>(in_.data());
+  uint8_t secret[32];
+  if (!secp256k1_ellswift_xdh(context(), secret, initiator_ ? key_ : theirs,
+                              initiator_ ? theirs : key_, seckey_,
+                              initiator_ ? 0 : 1,
+                              secp256k1_ellswift_xdh_hash_function_bip324,
+                              nullptr)) {
+    return fail("bad v2 key");
+  }
+  V2Keys keys;
+  derive_v2_keys(secret, &keys);
+  std::memset(secret, 0, sizeof secret);
+  std::memset(seckey_, 0, sizeof seckey_);
+  std::memcpy(terminator_,
+              initiator_ ? keys.responder_garbage : keys.initiator_garbage,
+              sizeof terminator_);
+  std::memcpy(session_id_, keys.session_id, sizeof session_id_);
+  cipher_.reset(new V2Cipher(keys, initiator_));
+  in_.erase(0, V2_KEY_SIZE);
+
+  if (!initiator_) {
+    out_.append(reinterpret_cast<const char *>(key_), sizeof key_);
+    out_.append(garbage_);
+  }
+  out_.append(reinterpret_cast<const char *>(
+                  initiator_ ? keys.initiator_garbage : keys.responder_garbage),
+              V2_TERMINATOR_SIZE);
+  cipher_->seal(nullptr, 0, false, &out_,
+                reinterpret_cast<const uint8_t *>(garbage_.data()),
+                garbage_.size());
+  garbage_.clear();
+  state_ = State::GARBAGE;
+  return true;
+}
+
+bool V2Session::read_garbage() {
+  const char *term = reinterpret_cast<const char *>(terminator_);
+  const size_t pos = in_.find(term, 0, sizeof terminator_);
+  if (pos == std::string::npos || pos > V2_MAX_GARBAGE) {
+    if (in_.size() >= V2_MAX_GARBAGE + V2_TERMINATOR_SIZE) {
+      return fail("no v2 garbage terminator");
+    }
+    return false;
+  }
+  peer_garbage_ = in_.substr(0, pos);
+  in_.erase(0, pos + sizeof terminator_);
+  contents_ = std::string::npos;
+  state_ = State::VERSION;
+  return true;
+}
+
+bool V2Session::read_version() {
+  if (contents_ == std::string::npos) {
+    if (in_.size() < V2_LENGTH_SIZE) {
+      return false;
+    }
+    contents_ = cipher_->open_length(in_.data());
+    if (contents_ > MAX_MESSAGE_SIZE) {
+      return fail("oversized v2 packet");
+    }
+  }
+  if (in_.size() < V2_EXPANSION + contents_) {
+    return false;
+  }
+  // only the first packet has the garbage for AAD
+  char *packet = &in_[V2_LENGTH_SIZE];
+  const uint8_t *aad =
+      reinterpret_cast<const uint8_t *>(peer_garbage_.data());
+  const bool ok = cipher_->open(packet, contents_, aad, peer_garbage_.size());
+  peer_garbage_.clear();
+  if (!ok) {
+    return fail("v2 packet failed authentication");
+  }
+  // Decoys may come first. The version packet's contents are for future
+  // features, and ignored.
+  const bool decoy = (uint8_t(packet[0]) & V2_IGNORE) != 0;
+  in_.erase(0, V2_EXPANSION + contents_);
+  contents_ = std::string::npos;
+  if (!decoy) {
+    state_ = State::READY;
+    return false;
+  }
+  return true;
+}
+}  // namespace spv
@@ -0,0 +1,180 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "./chacha20.h"
+#include "./fields.h"
+
+namespace spv {
+// BIP324 encrypted transport, with --v2-transport. A connection's
+// V2Session sits under Connection::read() and flush(): it does the
+// handshake, then read() decrypts each packet and dispatches its message by
+// short id, and flush() seals the v1 frames queued in out_ into packets.
+// Peers that don't speak v2 are talked to in v1, see V2Session::v1() and
+// V2Session::refused().
+
+// BIP324 packets: the contents length as 3 encrypted bytes, then a header
+// byte and the contents, sealed together with a 16-byte tag.
+static const size_t V2_LENGTH_SIZE = 3;
+static const size_t V2_HEADER_SIZE = 1;
+static const size_t V2_EXPANSION =
+    V2_LENGTH_SIZE + V2_HEADER_SIZE + Poly1305::TAG_SIZE;
+static const size_t V2_MAX_CONTENTS = (1 << 24) - 1;
+static const uint8_t V2_IGNORE = 0x80;  // header bit for decoy packets
+
+// the short id for a command, or 0 if it's sent with its name
+uint8_t v2_short_id(Command type);
+
+// the command for a short id; ids with no Message type are UNKNOWN
+Command v2_command(uint8_t id);
+
+// What both sides derive from the ECDH secret.
+struct V2Keys {
+  uint8_t initiator_l[32];  // FSChaCha20 keys for the lengths
+  uint8_t initiator_p[32];  // FSChaCha20Poly1305 keys for the packets
+  uint8_t responder_l[32];
+  uint8_t responder_p[32];
+  uint8_t initiator_garbage[16];  // garbage terminators
+  uint8_t responder_garbage[16];
+  uint8_t session_id[32];
+};
+
+// HKDF-SHA256 of the 32-byte ECDH secret, salted with this thread's
+// network magic.
+void derive_v2_keys(const uint8_t *secret, V2Keys *keys);
+
+// A decrypted packet, pointing into its buffer.
+struct V2Message {
+  bool ignore;
+  Command type;
+  const char *command;  // the COMMAND_SIZE byte name, or nullptr for a short id
+  const char *payload;
+  size_t size;
+};
+
+// Parse the header byte and contents_size bytes of contents at data. Returns
+// false if the contents are too short to hold a message type.
+bool parse_v2_packet(const char *data, size_t contents_size, V2Message *msg);
+
+// Both directions of a session. Each packet is a single pass of ChaCha20
+// over its contents and one of Poly1305, and it's decrypted where it lies.
+class V2Cipher {
+ public:
+  V2Cipher(const V2Keys &keys, bool initiator);
+
+  // Append the packet for v1 message msg, header and all, to out. The
+  // command goes as a short id where it has one, and the v1 header's
+  // checksum is dropped.
+  void seal_message(const char *msg, std::string *out);
+
+  // Append a packet of the contents at data to out. The first packet after
+  // the garbage is authenticated with the garbage as AAD.
+  void seal(const char *data, size_t size, bool ignore, std::string *out,
+            const uint8_t *aad = nullptr, size_t aad_size = 0);
+
+  // The contents size of the next packet, from its first V2_LENGTH_SIZE
+  // bytes. Called once for each packet, since the length cipher moves on.
+  size_t open_length(const char *data);
+
+  // Decrypt the V2_HEADER_SIZE + contents_size bytes at data, and the tag
+  // after them, in place. Returns false if the tag doesn't match, which
+  // has to end the session.
+  bool open(char *data, size_t contents_size, const uint8_t *aad = nullptr,
+            size_t aad_size = 0);
+
+ private:
+  FSChaCha20 send_length_, recv_length_;
+  FSChaCha20Poly1305 send_, recv_;
+};
+
+static const size_t V2_KEY_SIZE = 64;  // an ElligatorSwift encoded pubkey
+static const size_t V2_TERMINATOR_SIZE = 16;
+static const size_t V2_MAX_GARBAGE = 4095;
+
+// The handshake, and then the session's cipher. Each side sends its key and
+// up to V2_MAX_GARBAGE bytes of garbage, and once it has the other's key,
+// the terminator for its garbage and an empty version packet; the other
+// side's are read back in the same order. The initiator's key goes out
+// right away, and the responder's once it knows its peer isn't speaking v1.
+class V2Session {
+ public:
+  explicit V2Session(bool initiator);
+
+  // Take in bytes from the peer, up to those after its version packet.
+  void read(const char *data, size_t size);
+
+  // Is the handshake over? It's then either ready for packets, v1() or
+  // failed with error().
+  bool done() const { return state_ >= State::READY; }
+  bool v1() const { return state_ == State::V1; }
+  const char *error() const { return error_; }
+
+  // Has the peer's key come in? Until then nothing can be sealed, and all
+  // that's written is output().
+  bool keyed() const { return cipher_ != nullptr; }
+  V2Cipher &cipher() { return *cipher_; }
+  const uint8_t *session_id() const { return session_id_; }
+
+  // what the handshake has to write, before any packets
+  bool has_output() const { return !out_.empty(); }
+  std::string take_output();
+
+  // What read() took in past the end of the handshake: the first packets,
+  // or with v1() all the peer sent, since it was a v1 stream from the
+  // start.
+  std::string take_input();
+
+  // Did our key go out to a peer that never sent back a byte? That's an
+  // initiator whose peer hung up on it or is waiting for a v1 version
+  // message, which is worth redialing with v1.
+  bool refused() const { return initiator_ && sent_ && !received_; }
+
+ private:
+  enum class State { KEY, GARBAGE, VERSION, READY, V1, FAILED };
+
+  bool initiator_;
+  State state_;
+  const char *error_;
+  bool sent_;
+  bool received_;
+
+  uint8_t seckey_[32];
+  uint8_t key_[V2_KEY_SIZE];
+  std::string garbage_;       // ours, the AAD of our version packet
+  std::string peer_garbage_;  // the AAD of the peer's first packet
+  uint8_t terminator_[V2_TERMINATOR_SIZE];  // the peer's
+  uint8_t session_id_[32];
+  std::unique_ptr<V2Cipher> cipher_;
+
+  std::string in_;  // read but not yet handled
+  std::string out_;
+  size_t contents_;  // of the peer's next packet, once its length is read
+
+  // Move the handshake on with what's in in_, returning false once it's
+  // waiting for more or done.
+  bool step();
+  bool read_key();
+  bool read_garbage();
+  bool read_version();
+  bool fail(const char *why);
+};
+}  // namespace spv
@@ -0,0 +1,211 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./validate.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "./constants.h"
+#include "./decoder.h"
+#include "./encoder.h"
+#include "./logging.h"
+#include "./network.h"
+#include "./pow.h"
+#include "./scheduler.h"
+
+namespace spv {
+MODULE_LOGGER
+
+// Small enough that a full headers message is spread over the whole pool,
+// but large enough to amortize the cost of queueing the work.
+static const size_t chunk_size = 256;
+
+// Messages with at most this many headers, as in a BIP130 announcement of
+// a new block, are checked on the loop thread rather than waiting for a
+// trip through the thread pool; hashing them takes a few microseconds.
+static const size_t inline_headers = 8;
+
+void HeaderValidator::submit(const Addr &peer, std::string &&raw,
+                             bool check_pow, const uint32_t *checksum) {
+  assert(raw.size() % HeadersView::stride == 0);
+  const size_t n = raw.size() / HeadersView::stride;
+  if (n <= inline_headers && jobs_.empty()) {
+    Job job(peer, std::move(raw), check_pow);
+    job.hdrs.resize(n);
+    if (checksum != nullptr) {
+      check(&job, *checksum);
+    }
+    validate(&job, 0, n);
+    if (!shutdown_) {
+      cb_(job.peer, job.hdrs, job.ok, job.check_pow);
+    }
+    return;
+  }
+
+  auto job = std::make_shared<Job>(peer, std::move(raw), check_pow);
+  jobs_.push_back(job);
+  job->hdrs.resize(n);
+  if (n <= inline_headers) {
+    // checked now, but delivered after the messages ahead of it
+    if (checksum != nullptr) {
+      check(job.get(), *checksum);
+    }
+    validate(job.get(), 0, n);
+    drain();
+    return;
+  }
+  job->chunks_left =
+      (n + chunk_size - 1) / chunk_size + (checksum != nullptr ? 1 : 0);
+  for (size_t begin = 0; begin < n; begin += chunk_size) {
+    const size_t end = std::min(n, begin + chunk_size);
+    queue(job, [job, begin, end, net = &network()]() {
+      NetworkScope scope(*net);
+      validate(job.get(), begin, end);
+    });
+  }
+  // Hashing the payload can't be split up like the headers, so it's a job
+  // of its own that runs alongside the first chunks.
+  if (checksum != nullptr) {
+    queue(job, [job, expected = *checksum]() { check(job.get(), expected); });
+  }
+}
+
+void HeaderValidator::queue(std::shared_ptr<Job> job,
+                            std::function<void()> work) {
+  scheduler().post(*loop_, Priority::HIGH, std::move(work), [this, job]() {
+    job->chunks_left--;
+    drain();
+  });
+}
+
+void HeaderValidator::check(Job *job, uint32_t checksum) {
+  char count[MAX_VARINT_SIZE];
+  const sha256::Range ranges[] = {
+      {reinterpret_cast<const uint8_t *>(count),
+       store_varint(job->view().size(), count)},
+      {reinterpret_cast<const uint8_t *>(job->raw.data()), job->raw.size()},
+  };
+  if (!check_checksum(ranges, 2, checksum)) {
+    log->warn("headers message from peer {} has a bad checksum", job->peer);
+    job->ok = false;
+  }
+}
+
+void HeaderValidator::validate(Job *job, size_t begin, size_t end) {
+  // chunks write to disjoint headers, so they don't need to synchronize
+  const HeadersView view = job->view();
+  std::vector<hash_t> hashes(end - begin);
+  pow_hash_batch(view.raw(begin), HeadersView::stride, end - begin,
+                 hashes.data());
+  for (size_t i = begin; i < end; i++) {
+    const hash_t &hash = hashes[i - begin];
+    if (job->check_pow && !check_pow(hash, view.difficulty(i))) {
+      job->ok = false;
+    }
+    job->hdrs[i] = view.header(i, hash);
+  }
+}
+
+void HeaderValidator::drain() {
+  while (!jobs_.empty() && jobs_.front()->chunks_left == 0) {
+    std::shared_ptr<Job> job = jobs_.front();
+    jobs_.pop_front();
+    if (!shutdown_) {
+      cb_(job->peer, job->hdrs, job->ok, job->check_pow);
+    }
+  }
+}
+
+void HeaderValidator::shutdown() {
+  shutdown_ = true;
+  jobs_.clear();
+}
+
+// Blocks with fewer transactions than this are checked on the loop thread,
+// which takes well under a millisecond. Bigger ones are hashed on the pool
+// in chunks of this size.
+static const size_t parallel_txs = 1024;
+
+// whether a block's payload matches the checksum of the message it came in
+static bool check_block_checksum(const Addr &peer, const Block &block) {
+  if (check_checksum(block.raw.data(), block.raw.size(),
+                     block.headers.checksum)) {
+    return true;
+  }
+  log->warn("block message from peer {} has a bad checksum", peer);
+  return false;
+}
+
+void BlockVerifier::submit(const Addr &peer, Block &&block, bool checksum) {
+  const size_t n = block.txns.size();
+  if (n < parallel_txs && jobs_.empty()) {
+    const bool ok = (!checksum || check_block_checksum(peer, block)) &&
+                    block.check_merkle_root();
+    cb_(peer, block, ok);
+    return;
+  }
+
+  auto job = std::make_shared<Job>(peer, std::move(block));
+  jobs_.push_back(job);
+  job->leaves.resize(n);
+  if (n < parallel_txs) {
+    // hashed now, but delivered after the blocks ahead of it
+    job->checksum_ok = !checksum || check_block_checksum(peer, job->block);
+    job->block.leaf_hashes(0, n, job->leaves.data());
+    drain();
+    return;
+  }
+  // The payload's checksum is one more chunk, hashed next to the txids. It
+  // goes first, being the longest.
+  job->chunks_left = (n + parallel_txs - 1) / parallel_txs + (checksum ? 1 : 0);
+  std::vector<std::function<void()> > chunks;
+  if (checksum) {
+    chunks.push_back([job]() {
+      job->checksum_ok = check_block_checksum(job->peer, job->block);
+    });
+  }
+  for (size_t begin = 0; begin < n; begin += parallel_txs) {
+    const size_t end = std::min(n, begin + parallel_txs);
+    chunks.push_back([job, begin, end]() {
+      job->block.leaf_hashes(begin, end, job->leaves.data() + begin);
+    });
+  }
+  for (auto &hash_chunk : chunks) {
+    scheduler().post(*loop_, Priority::HIGH, std::move(hash_chunk),
+                     [this, job]() {
+                       job->chunks_left--;
+                       drain();
+                     });
+  }
+}
+
+void BlockVerifier::drain() {
+  while (!jobs_.empty() && jobs_.front()->chunks_left == 0) {
+    std::shared_ptr<Job> job = jobs_.front();
+    jobs_.pop_front();
+    if (!shutdown_) {
+      cb_(job->peer, job->block,
+          job->checksum_ok && job->block.check_merkle_root(job->leaves));
+    }
+  }
+}
+
+void BlockVerifier::shutdown() {
+  shutdown_ = true;
+  jobs_.clear();
+}
+}  // namespace spv
@@ -0,0 +1,162 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "./addr.h"
+#include "./fields.h"
+#include "./message.h"
+#include "./uvw.h"
+
+namespace spv {
+// HeaderValidator hashes and checks the proof of work of headers messages on
+// the Scheduler's workers, so that a 2000-header message doesn't stall the
+// loop. Each message is split into chunks that are validated in parallel,
+// and its checksum is checked by one more job alongside them.
+// Results are handed back on the loop thread in the order the messages were
+// submitted, so the chain still sees headers in the order they arrived.
+class HeaderValidator {
+ public:
+  // Called on the loop thread with the hashed headers; ok is false if any
+  // header failed its proof-of-work check or the message's checksum was
+  // wrong, and checked is false if the proof of work wasn't checked at all.
+  typedef std::function<void(const Addr &, std::vector<BlockHeader> &,
+                             bool ok, bool checked)>
+      Callback;
+
+  HeaderValidator() = delete;
+  HeaderValidator(const HeaderValidator &other) = delete;
+  HeaderValidator(std::shared_ptr<uvw::Loop> loop, Callback cb)
+      : loop_(loop), cb_(cb), shutdown_(false) {}
+
+  // Validate the headers in the payload of a headers message, laid out as
+  // HeadersView expects. Headers are decoded on the worker threads too,
+  // except for a handful, which are done here; then the callback may run
+  // before this returns.
+  // Without check_pow they're only hashed. With a checksum, the count of
+  // headers and then raw must match it, as the message's payload.
+  void submit(const Addr &peer, std::string &&raw, bool check_pow = true,
+              const uint32_t *checksum = nullptr);
+
+  // number of messages still being validated or waiting to be delivered
+  inline size_t pending() const { return jobs_.size(); }
+
+  // drop any results that haven't been delivered yet
+  void shutdown();
+
+ private:
+  struct Job {
+    Addr peer;
+    std::vector<BlockHeader> hdrs;
+    std::string raw;
+    bool check_pow;
+    size_t chunks_left;
+    std::atomic<bool> ok;
+
+    Job(const Addr &peer, std::string &&raw, bool check_pow)
+        : peer(peer),
+          raw(std::move(raw)),
+          check_pow(check_pow),
+          chunks_left(0),
+          ok(true) {}
+
+    inline HeadersView view() const {
+      return {raw.data(), raw.size() / HeadersView::stride};
+    }
+  };
+
+  std::shared_ptr<uvw::Loop> loop_;
+  Callback cb_;
+  bool shutdown_;
+
+  // in submission order
+  std::deque<std::shared_ptr<Job> > jobs_;
+
+  // run work, one of a job's chunks_left, on the thread pool
+  void queue(std::shared_ptr<Job> job, std::function<void()> work);
+
+  // hash and check headers [begin, end) of a job; runs on a worker thread
+  static void validate(Job *job, size_t begin, size_t end);
+
+  // check a job's payload against the checksum of its message
+  static void check(Job *job, uint32_t checksum);
+
+  // deliver finished jobs from the front of the queue
+  void drain();
+};
+
+// BlockVerifier checks the merkle roots of full blocks. Hashing the txids
+// is nearly all of the work, so a big block has them hashed in chunks on
+// the Scheduler's workers, and only the tree above them is built on the loop
+// thread. A small block is checked on the spot unless bigger blocks are
+// still ahead of it, since blocks are delivered in the order they were
+// submitted.
+class BlockVerifier {
+ public:
+  // Called on the loop thread; ok is false if the merkle root is wrong. The
+  // callback may move the block out.
+  typedef std::function<void(const Addr &, Block &, bool ok)> Callback;
+
+  BlockVerifier() = delete;
+  BlockVerifier(const BlockVerifier &other) = delete;
+  BlockVerifier(std::shared_ptr<uvw::Loop> loop, Callback cb)
+      : loop_(loop), cb_(cb), shutdown_(false) {}
+
+  // With checksum, block.headers.checksum is that of the block message, to
+  // be checked against its payload, block.raw.
+  void submit(const Addr &peer, Block &&block, bool checksum = false);
+
+  // number of blocks still being checked or waiting to be delivered
+  inline size_t pending() const { return jobs_.size(); }
+
+  // drop any results that haven't been delivered yet
+  void shutdown();
+
+ private:
+  struct Job {
+    Addr peer;
+    Block block;
+    std::vector<hash_t> leaves;
+    size_t chunks_left;
+    bool checksum_ok;
+
+    Job(const Addr &peer, Block &&block)
+        : peer(peer),
+          block(std::move(block)),
+          chunks_left(0),
+          checksum_ok(true) {}
+  };
+
+  std::shared_ptr<uvw::Loop> loop_;
+  Callback cb_;
+  bool shutdown_;
+
+  // in submission order
+  std::deque<std::shared_ptr<Job> > jobs_;
+
+  // deliver finished jobs from the front of the queue
+  void drain();
+};
+}  // namespace spv
@@ -0,0 +1,120 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "./verify.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+#include "./logging.h"
+#include "./network.h"
+#include "./scheduler.h"
+
+namespace spv {
+MODULE_LOGGER
+
+// Heights checked per height_view_ shard.
+static const size_t heights_per_shard = 100000;
+
+void DbVerifier::queue(std::function<void(VerifyResult &)> fn) {
+  auto result = std::make_shared<VerifyResult>();
+  shards_++;
+  shards_left_++;
+  scheduler().post(
+      *loop_, Priority::LOW,
+      [fn, result, net = &network()]() {
+        NetworkScope scope(*net);
+        fn(*result);
+      },
+      [this, result]() { finish_shard(std::move(*result)); });
+}
+
+void DbVerifier::start() {
+  assert(snap_ == nullptr);
+  snap_ = chain_.snapshot();
+  const Chain *chain = &chain_;
+  const rocksdb::Snapshot *snap = snap_;
+
+  // Encoded hash keys start with the low byte of the hash, which is
+  // uniform, so they're split by that. A few shards per core keeps every
+  // thread busy even if some shards are bigger.
+  const size_t ncpu = scheduler().threads();
+  const size_t nshards = std::min<size_t>(256, 4 * ncpu);
+  for (size_t i = 0; i < nshards; i++) {
+    const uint8_t first = i * 256 / nshards;
+    const uint8_t last = (i + 1) * 256 / nshards - 1;
+    queue([chain, snap, first, last](VerifyResult &result) {
+      chain->verify_headers(snap, first, last, result);
+    });
+  }
+
+  // The best chain is only in height_view_ without a header store. The
+  // last shard also picks up any heights past the tip.
+  if (!chain_.has_store()) {
+    const size_t end = chain_.height() + 1;
+    for (size_t from = 0; from < end; from += heights_per_shard) {
+      const size_t to = from + heights_per_shard < end
+                            ? from + heights_per_shard
+                            : std::numeric_limits<size_t>::max();
+      queue([chain, snap, from, to, end](VerifyResult &result) {
+        chain->verify_heights(snap, from, to, end, result);
+      });
+    }
+  }
+  log->info("verifying database in {} shards", shards_);
+}
+
+void DbVerifier::finish_shard(VerifyResult &&result) {
+  assert(shards_left_ > 0);
+  total_.merge(std::move(result));
+  shards_left_--;
+  const size_t done = shards_ - shards_left_;
+  if (done % std::max<size_t>(1, shards_ / 10) == 0 || !shards_left_) {
+    log->info("verified {}/{} database shards, {} records so far", done,
+              shards_, total_.checked);
+  }
+  if (shards_left_) {
+    return;
+  }
+  chain_.release(snap_);
+  snap_ = nullptr;
+  if (shutdown_) {
+    return;
+  }
+
+  chain_.check_parentless(total_);
+  const size_t problems = total_.bad_headers.size() +
+                          total_.bad_heights.size() +
+                          total_.parentless.size();
+  if (!problems) {
+    log->info("database verified, {} records are ok", total_.checked);
+    return;
+  }
+  log->warn(
+      "database has {} bad header record(s), {} bad height(s) and {} "
+      "header(s) without a parent",
+      total_.bad_headers.size(), total_.bad_heights.size(),
+      total_.parentless.size());
+  for (const auto &hdr : total_.parentless) {
+    log->warn("no parent for {}", hdr);
+  }
+  if (repair_) {
+    log->info("repaired {} database record(s)", chain_.repair(total_));
+  }
+}
+}  // namespace spv
@@ -0,0 +1,72 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "./chain.h"
+#include "./uvw.h"
+
+namespace spv {
+// DbVerifier checks the chain's database in the background. It takes a
+// snapshot, splits hdr_view_ and height_view_ into shards, and checks the
+// shards in parallel on the Scheduler, at low priority, while the client keeps
+// syncing. Problems are logged once every shard is done, and optionally
+// repaired from the header index.
+class DbVerifier {
+ public:
+  DbVerifier() = delete;
+  DbVerifier(const DbVerifier &other) = delete;
+  DbVerifier(std::shared_ptr<uvw::Loop> loop, Chain &chain, bool repair)
+      : loop_(loop),
+        chain_(chain),
+        repair_(repair),
+        shutdown_(false),
+        snap_(nullptr),
+        shards_(0),
+        shards_left_(0) {}
+
+  // queue the shards; call once
+  void start();
+
+  // is a verification still running?
+  inline bool running() const { return shards_left_ > 0; }
+
+  // drop the results of a running verification
+  inline void shutdown() { shutdown_ = true; }
+
+ private:
+  std::shared_ptr<uvw::Loop> loop_;
+  Chain &chain_;
+  bool repair_;
+  bool shutdown_;
+  const rocksdb::Snapshot *snap_;
+  size_t shards_;
+  size_t shards_left_;
+  VerifyResult total_;
+
+  // queue fn(result) on the thread pool
+  void queue(std::function<void(VerifyResult &)> fn);
+
+  // called on the loop thread as each shard finishes
+  void finish_shard(VerifyResult &&result);
+};
+}  // namespace spv
@@ -0,0 +1,165 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#include "./watch.h"
+
+#include <cassert>
+#include <cstring>
+#include <limits>
+
+#include "./gcs.h"
+#include "./tx.h"
+#include "./util.h"
+
+namespace spv {
+// opcodes that push data, see BIP37
+enum : uint8_t {
+  OP_PUSHDATA1 = 0x4c,
+  OP_PUSHDATA2 = 0x4d,
+  OP_PUSHDATA4 = 0x4e,
+};
+
+WatchList::WatchList() : k0_(rand64()), k1_(rand64()) {}
+
+WatchList::WatchList(const std::vector<std::string> &elements)
+    : WatchList() {
+  elements_.reserve(elements.size());
+  hashes_.reserve(elements.size());
+  slots_.reserve(elements.size());
+  for (const auto &data : elements) {
+    add(data);
+  }
+}
+
+inline uint64_t WatchList::hash(const char *data, size_t size) const {
+  return siphash24(k0_, k1_, data, size);
+}
+
+size_t WatchList::lower_bound(uint64_t h) const {
+  const uint64_t *first = hashes_.data();
+  size_t len = hashes_.size();
+  if (len == 0) {
+    return 0;
+  }
+  // the answer is always in [first, first + len]; the compiler turns the
+  // step into a conditional move, so there are no branches to mispredict
+  while (len > 1) {
+    const size_t half = len / 2;
+    first += first[half - 1] < h ? half : 0;
+    len -= half;
+  }
+  first += *first < h;
+  return first - hashes_.data();
+}
+
+bool WatchList::add(const std::string &data) {
+  const uint64_t h = hash(data.data(), data.size());
+  size_t i = lower_bound(h);
+  for (; i < hashes_.size() && hashes_[i] == h; i++) {
+    if (elements_[slots_[i]] == data) {
+      return false;
+    }
+  }
+  assert(elements_.size() < std::numeric_limits<uint32_t>::max());
+  hashes_.insert(hashes_.begin() + i, h);
+  slots_.insert(slots_.begin() + i, elements_.size());
+  elements_.push_back(data);
+  if (sizes_.size() <= data.size()) {
+    sizes_.resize(data.size() + 1);
+  }
+  sizes_[data.size()] = true;
+  return true;
+}
+
+bool WatchList::contains(const char *data, size_t size) const {
+  if (size >= sizes_.size() || !sizes_[size]) {
+    return false;
+  }
+  const uint64_t h = hash(data, size);
+  for (size_t i = lower_bound(h); i < hashes_.size() && hashes_[i] == h;
+       i++) {
+    const std::string &elem = elements_[slots_[i]];
+    if (std::memcmp(elem.data(), data, size) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool WatchList::matches_script(const char *script, size_t size) const {
+  if (contains(script, size)) {
+    return true;
+  }
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(script);
+  size_t pos = 0;
+  while (pos < size) {
+    const uint8_t op = p[pos++];
+    size_t len;
+    if (op == 0 || op > OP_PUSHDATA4) {
+      continue;  // not a push, or an empty one
+    } else if (op < OP_PUSHDATA1) {
+      len = op;
+    } else {
+      const size_t width = op == OP_PUSHDATA1 ? 1 : op == OP_PUSHDATA2 ? 2 : 4;
+      if (size - pos < width) {
+        return false;
+      }
+      len = 0;
+      for (size_t i = 0; i < width; i++) {
+        len |= static_cast<size_t>(p[pos + i]) << (8 * i);
+      }
+      pos += width;
+    }
+    if (len > size - pos) {
+      return false;  // a truncated push ends the script
+    }
+    if (contains(script + pos, len)) {
+      return true;
+    }
+    pos += len;
+  }
+  return false;
+}
+
+bool WatchList::matches(const Tx &tx) const {
+  if (empty()) {
+    return false;
+  }
+  for (const auto &out : tx.outputs) {
+    if (matches_script(out.script)) {
+      return true;
+    }
+  }
+  for (const auto &in : tx.inputs) {
+    if (matches_script(in.script)) {
+      return true;
+    }
+    for (const auto &item : in.witness) {
+      if (matches_script(item)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool WatchList::matches(const char *base, const TxSpan &span) const {
+  return !empty() &&
+         span.any_script(base, [this](const char *data, size_t size) {
+           return matches_script(data, size);
+         });
+}
+}  // namespace spv
@@ -0,0 +1,88 @@
+// Copyright (c) 2017 Evan Klitzke <evan@eklitzke.org>
+//
+// This file is part of SPV.
+//
+// SPV is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SPV is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SPV. If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace spv {
+struct Tx;
+struct TxSpan;
+
+// WatchList is the set of data elements (output scripts, pubkey hashes and
+// so on) we're looking for. The same list feeds the bloom filter, the
+// BIP158 matcher and the decoding of blocks and transactions.
+//
+// Lookups happen for every push in every script of a block, so they avoid
+// touching the elements. A bitmap of element sizes rules out most data
+// immediately. What's left is hashed with SipHash under a random key and
+// looked up in a sorted flat array with a branchless binary search. Only
+// a hash hit compares the bytes. Adding an element is a push_back and an
+// insert into the array, so wallets can add addresses one at a time.
+class WatchList {
+ public:
+  WatchList();
+  explicit WatchList(const std::vector<std::string> &elements);
+  WatchList(const WatchList &other) = delete;
+
+  // add an element; returns false if it was already there
+  bool add(const std::string &data);
+
+  inline bool empty() const { return elements_.empty(); }
+  inline size_t size() const { return elements_.size(); }
+
+  // the elements in the order they were added, e.g. to build a filter from
+  inline const std::vector<std::string> &elements() const {
+    return elements_;
+  }
+
+  // is this exact data an element?
+  bool contains(const char *data, size_t size) const;
+  inline bool contains(const std::string &data) const {
+    return contains(data.data(), data.size());
+  }
+
+  // Is the script an element, or is any data it pushes one? This is how
+  // BIP37 defines a match, so it agrees with the bloom filter.
+  bool matches_script(const char *script, size_t size) const;
+  inline bool matches_script(const std::string &script) const {
+    return matches_script(script.data(), script.size());
+  }
+
+  // Does any script or witness item of the transaction match? Witness items
+  // are matched like scripts, since the last one is often a script; a tx
+  // parsed without them only has its scripts matched.
+  bool matches(const Tx &tx) const;
+
+  // the same, straight from the serialization, without decoding the tx
+  bool matches(const char *base, const TxSpan &span) const;
+
+ private:
+  uint64_t k0_, k1_;
+  std::vector<std::string> elements_;
+  std::vector<uint64_t> hashes_;  // of the elements, sorted
+  std::vector<uint32_t> slots_;   // hashes_[i] is of elements_[slots_[i]]
+  std::vector<bool> sizes_;       // sizes_[n] if an element is n bytes
+
+  inline uint64_t hash(const char *data, size_t size) const;
+
+  // the first index of hashes_ that isn't less than h
+  size_t lower_bound(uint64_t h) const;
+};
+}  // namespace spv